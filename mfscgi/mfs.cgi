@@ -98,7 +98,7 @@ try:
 			masterversion = (1,4,0)
 		elif length==60:
 			masterversion = (1,5,0)
-		elif length==68:
+		elif length==68 or length==102:
 			masterversion = struct.unpack(">HBB",data[:4])
 except Exception:
 	print "Content-Type: text/html; charset=UTF-8"
@@ -182,10 +182,11 @@ else:
 		"MS":"Mounts",
 		"MO":"Operations",
 		"QU":"Quotas",
+		"LA":"Latency",
 		"MC":"Master Charts",
 		"CC":"Server Charts"
 	}
-	sectionorder=["IN","CS","HD","EX","MS","MO","QU","MC","CC"];
+	sectionorder=["IN","CS","HD","EX","MS","MO","QU","LA","MC","CC"];
 
 print "Content-Type: text/html; charset=UTF-8"
 print
@@ -308,9 +309,9 @@ if "IN" in sectionset:
 			out.append("""	<td align="right">%u</td>""" % tdcopies)
 			out.append("""</tr>""")
 			out.append("""</table>""")
-		elif cmd==511 and length==68:
+		elif cmd==511 and (length==68 or length==102):
 			data = myrecv(s,length)
-			v1,v2,v3,total,avail,trspace,trfiles,respace,refiles,nodes,dirs,files,chunks,allcopies,tdcopies = struct.unpack(">HBBQQQLQLLLLLLL",data)
+			v1,v2,v3,total,avail,trspace,trfiles,respace,refiles,nodes,dirs,files,chunks,allcopies,tdcopies = struct.unpack(">HBBQQQLQLLLLLLL",data[:68])
 			out.append("""<table class="FR" cellspacing="0">""")
 			out.append("""<tr><th colspan="13">Info</th></tr>""")
 			out.append("""<tr>""")
@@ -348,6 +349,47 @@ if "IN" in sectionset:
 			out.append("""	<td align="right">%u</td>""" % tdcopies)
 			out.append("""</tr>""")
 			out.append("""</table>""")
+			if length==102:
+				storestatus,storeresult,storestart,storemsec,storebytes,storestored,storerecords = struct.unpack(">BBLLQQQ",data[68:])
+				if storestatus&1:
+					storekind = "image"
+				elif storestatus&2:
+					storekind = "delta"
+				else:
+					storekind = "-"
+				if storeresult==1:
+					storeresultstr = "ok"
+				elif storeresult==2:
+					storeresultstr = "failed"
+				elif storestatus:
+					storeresultstr = "in progress"
+				else:
+					storeresultstr = "-"
+				out.append("""<br/>""")
+				out.append("""<table class="FR" cellspacing="0">""")
+				out.append("""<tr><th colspan="7">Metadata store</th></tr>""")
+				out.append("""<tr>""")
+				out.append("""	<th>kind</th>""")
+				out.append("""	<th>status</th>""")
+				out.append("""	<th>started</th>""")
+				out.append("""	<th>duration</th>""")
+				out.append("""	<th>image size</th>""")
+				out.append("""	<th>written to disk</th>""")
+				out.append("""	<th>records</th>""")
+				out.append("""</tr>""")
+				out.append("""<tr>""")
+				out.append("""	<td align="center">%s</td>""" % storekind)
+				out.append("""	<td align="center">%s</td>""" % storeresultstr)
+				if storestart>0:
+					out.append("""	<td align="center">%s</td>""" % time.asctime(time.localtime(storestart)))
+				else:
+					out.append("""	<td align="center">-</td>""")
+				out.append("""	<td align="right">%.3f s</td>""" % (storemsec/1000.0))
+				out.append("""	<td align="right"><a style="cursor:default" title="%s B">%sB</a></td>""" % (decimal_number(storebytes),humanize_number(storebytes,"&nbsp;")))
+				out.append("""	<td align="right"><a style="cursor:default" title="%s B">%sB</a></td>""" % (decimal_number(storestored),humanize_number(storestored,"&nbsp;")))
+				out.append("""	<td align="right">%u</td>""" % storerecords)
+				out.append("""</tr>""")
+				out.append("""</table>""")
 		else:
 			out.append("""<table class="FR" cellspacing="0">""")
 			out.append("""<tr><td align="left">""")
@@ -469,7 +511,7 @@ if "IN" in sectionset:
 		mysend(s,struct.pack(">LL",514,0))
 		header = myrecv(s,8)
 		cmd,length = struct.unpack(">LL",header)
-		if cmd==515 and length==52:
+		if cmd==515 and (length==52 or length==68):
 			data = myrecv(s,length)
 			loopstart,loopend,del_invalid,ndel_invalid,del_unused,ndel_unused,del_dclean,ndel_dclean,del_ogoal,ndel_ogoal,rep_ugoal,nrep_ugoal,rebalnce = struct.unpack(">LLLLLLLLLLLLL",data[:52])
 			out.append("""<table class="FR" cellspacing="0">""")
@@ -505,6 +547,24 @@ if "IN" in sectionset:
 				out.append("""	<td colspan="8" align="center">no data</td>""")
 				out.append("</tr>")
 			out.append("""</table>""")
+			if length==68:
+				q_endangered,q_onecopy,q_undergoal,q_overgoal = struct.unpack(">LLLL",data[52:68])
+				out.append("""<br/>""")
+				out.append("""<table class="FR" cellspacing="0">""")
+				out.append("""	<tr><th colspan="4">Chunk replication queue</th></tr>""")
+				out.append("""	<tr>""")
+				out.append("""		<th>endangered</th>""")
+				out.append("""		<th>one copy</th>""")
+				out.append("""		<th>under goal</th>""")
+				out.append("""		<th>over goal</th>""")
+				out.append("""	</tr>""")
+				out.append("<tr>")
+				out.append("""	<td align="right">%u</td>""" % q_endangered)
+				out.append("""	<td align="right">%u</td>""" % q_onecopy)
+				out.append("""	<td align="right">%u</td>""" % q_undergoal)
+				out.append("""	<td align="right">%u</td>""" % q_overgoal)
+				out.append("</tr>")
+				out.append("""</table>""")
 		s.close()
 		print "\n".join(out)
 	except Exception:
@@ -585,9 +645,12 @@ if "CS" in sectionset:
 	except Exception:
 		CSrev = 0
 
+	# since 1.6.17 master can also report memory used by its table of server's chunks
+	cswithmem = 1 if masterversion>=(1,6,17) else 0
+
 	try:
 		out.append("""<table class="FR" cellspacing="0">""")
-		out.append("""	<tr><th colspan="14">Chunk Servers</th></tr>""")
+		out.append("""	<tr><th colspan="%u">Chunk Servers</th></tr>""" % (14+cswithmem))
 		out.append("""	<tr>""")
 		out.append("""		<th rowspan="2">#</th>""")
 		if CSorder==1 and CSrev==0:
@@ -606,6 +669,11 @@ if "CS" in sectionset:
 			out.append("""		<th rowspan="2"><a href="%s">version</a></th>""" % (createlink({"CSrev":"1"})))
 		else:
 			out.append("""		<th rowspan="2"><a href="%s">version</a></th>""" % (createlink({"CSorder":"4","CSrev":"0"})))
+		if cswithmem:
+			if CSorder==5 and CSrev==0:
+				out.append("""		<th rowspan="2"><a href="%s">master mem</a></th>""" % (createlink({"CSrev":"1"})))
+			else:
+				out.append("""		<th rowspan="2"><a href="%s">master mem</a></th>""" % (createlink({"CSorder":"5","CSrev":"0"})))
 		out.append("""		<th colspan="4">'regular' hdd space</th>""")
 		if masterversion>=(1,6,10):
 			out.append("""		<th colspan="4">'marked for removal' hdd space</th>""")
@@ -649,16 +717,25 @@ if "CS" in sectionset:
 
 		s = socket.socket()
 		s.connect((masterhost,masterport))
-		mysend(s,struct.pack(">LL",500,0))
+		if cswithmem:
+			mysend(s,struct.pack(">LLB",500,1,1))
+			recsize = 62
+		else:
+			mysend(s,struct.pack(">LL",500,0))
+			recsize = 54
 		header = myrecv(s,8)
 		cmd,length = struct.unpack(">LL",header)
-		if cmd==501 and masterversion>=(1,5,13) and (length%54)==0:
+		if cmd==501 and masterversion>=(1,5,13) and (length%recsize)==0:
 			data = myrecv(s,length)
-			n = length/54
+			n = length/recsize
 			servers = []
 			for i in xrange(n):
-				d = data[i*54:(i+1)*54]
-				v1,v2,v3,ip1,ip2,ip3,ip4,port,used,total,chunks,tdused,tdtotal,tdchunks,errcnt = struct.unpack(">HBBBBBBHQQLQQLL",d)
+				d = data[i*recsize:(i+1)*recsize]
+				v1,v2,v3,ip1,ip2,ip3,ip4,port,used,total,chunks,tdused,tdtotal,tdchunks,errcnt = struct.unpack(">HBBBBBBHQQLQQLL",d[:54])
+				if cswithmem:
+					tabmem = struct.unpack(">Q",d[54:62])[0]
+				else:
+					tabmem = 0
 				try:
 					host = (socket.gethostbyaddr("%u.%u.%u.%u" % (ip1,ip2,ip3,ip4)))[0]
 				except Exception:
@@ -671,6 +748,8 @@ if "CS" in sectionset:
 					sf = port
 				elif CSorder==4:
 					sf = (v1,v2,v3)
+				elif CSorder==5:
+					sf = tabmem
 				elif CSorder==10:
 					sf = chunks
 				elif CSorder==11:
@@ -695,14 +774,16 @@ if "CS" in sectionset:
 						sf = 0
 				else:
 					sf = 0
-				servers.append((sf,host,ip1,ip2,ip3,ip4,port,v1,v2,v3,used,total,chunks,tdused,tdtotal,tdchunks,errcnt))
+				servers.append((sf,host,ip1,ip2,ip3,ip4,port,v1,v2,v3,tabmem,used,total,chunks,tdused,tdtotal,tdchunks,errcnt))
 			servers.sort()
 			if CSrev:
 				servers.reverse()
 			i = 1
-			for sf,host,ip1,ip2,ip3,ip4,port,v1,v2,v3,used,total,chunks,tdused,tdtotal,tdchunks,errcnt in servers:
+			for sf,host,ip1,ip2,ip3,ip4,port,v1,v2,v3,tabmem,used,total,chunks,tdused,tdtotal,tdchunks,errcnt in servers:
 				out.append("""<tr class="C%u">""" % (((i-1)%2)+1))
 				out.append("""	<td align="right">%u</td><td align="left">%s</td><td align="center">%u.%u.%u.%u</td><td align="center">%u</td><td align="center">%u.%u.%u</td>""" % (i,host,ip1,ip2,ip3,ip4,port,v1,v2,v3))
+				if cswithmem:
+					out.append("""	<td align="right"><a style="cursor:default" title="%s B">%sB</a></td>""" % (decimal_number(tabmem),humanize_number(tabmem,"&nbsp;")))
 				out.append("""	<td align="right">%u</td><td align="right"><a style="cursor:default" title="%s B">%sB</a></td><td align="right"><a style="cursor:default" title="%s B">%sB</a></td>""" % (chunks,decimal_number(used),humanize_number(used,"&nbsp;"),decimal_number(total),humanize_number(total,"&nbsp;")))
 				if (total>0):
 					out.append("""	<td><div class="box"><div class="progress" style="width:%upx;"></div><div class="value">%.2f</div></div></td>""" % (int((used*200.0)/total),(used*100.0)/total))
@@ -2208,6 +2289,103 @@ if "QU" in sectionset:
 
 	print """<br/>"""
 
+if "LA" in sectionset:
+	out = []
+
+	try:
+		LAorder = int(fields.getvalue("LAorder"))
+	except Exception:
+		LAorder = 0
+	try:
+		LArev = int(fields.getvalue("LArev"))
+	except Exception:
+		LArev = 0
+
+	try:
+		s = socket.socket()
+		s.connect((masterhost,masterport))
+		mysend(s,struct.pack(">LL",524,0))
+		header = myrecv(s,8)
+		cmd,length = struct.unpack(">LL",header)
+		if cmd==525 and length>=4:
+			data = myrecv(s,length)
+			slowthreshold = struct.unpack(">L",data[:4])[0]
+			out.append("""<table class="FR" cellspacing="0">""")
+			if slowthreshold>0:
+				out.append("""<tr><th colspan="10">Handler latency (slow handler threshold: %u ms)</th></tr>""" % slowthreshold)
+			else:
+				out.append("""<tr><th colspan="10">Handler latency</th></tr>""")
+			out.append("""	<tr>""")
+			out.append("""		<th>#</th>""")
+			for i,name in ((1,"handler"),(2,"count"),(3,"avg"),(4,"p50"),(5,"p90"),(6,"p99"),(7,"p99.9"),(8,"max"),(9,"total&nbsp;time")):
+				if LAorder==i and LArev==0:
+					out.append("""		<th><a href="%s">%s</a></th>""" % (createlink({"LArev":"1"}),name))
+				else:
+					out.append("""		<th><a href="%s">%s</a></th>""" % (createlink({"LAorder":str(i),"LArev":"0"}),name))
+			out.append("""	</tr>""")
+			hists = []
+			pos = 4
+			while pos<length:
+				nleng = ord(data[pos])
+				pos+=1
+				name = data[pos:pos+nleng]
+				pos+=nleng
+				count,usecsum,usecmax = struct.unpack(">QQQ",data[pos:pos+24])
+				pos+=24
+				buckets = struct.unpack(">24L",data[pos:pos+96])
+				pos+=96
+				if count==0:
+					continue
+				# percentiles - upper bounds of log2 buckets
+				pct = []
+				for p in (0.5,0.9,0.99,0.999):
+					need = count*p
+					acc = 0
+					for i in xrange(24):
+						acc += buckets[i]
+						if acc>=need:
+							break
+					pct.append(min(2**(i+1),usecmax))
+				avg = usecsum/count
+				if LAorder==1 or LAorder==0:
+					sf = name
+				elif LAorder==2:
+					sf = count
+				elif LAorder==3:
+					sf = avg
+				elif LAorder>=4 and LAorder<=7:
+					sf = pct[LAorder-4]
+				elif LAorder==8:
+					sf = usecmax
+				else:
+					sf = usecsum
+				hists.append((sf,name,count,avg,pct,usecmax,usecsum))
+			hists.sort()
+			if LArev:
+				hists.reverse()
+			i = 1
+			for sf,name,count,avg,pct,usecmax,usecsum in hists:
+				out.append("""<tr class="C%u">""" % (((i-1)%2)+1))
+				out.append("""	<td align="right">%u</td>""" % i)
+				out.append("""	<td align="left">%s</td>""" % htmlentities(name))
+				out.append("""	<td align="right">%s</td>""" % decimal_number(count))
+				for v in [avg]+pct+[usecmax]:
+					out.append("""	<td align="right">%.3f&nbsp;ms</td>""" % (v/1000.0))
+				out.append("""	<td align="right">%.1f&nbsp;s</td>""" % (usecsum/1000000.0))
+				out.append("""</tr>""")
+				i+=1
+			out.append("""</table>""")
+		s.close()
+		print "\n".join(out)
+	except Exception:
+		print """<table class="FR" cellspacing="0">"""
+		print """<tr><td align="left"><pre>"""
+		traceback.print_exc(file=sys.stdout)
+		print """</pre></td></tr>"""
+		print """</table>"""
+
+	print """<br/>"""
+
 if "MC" in sectionset:
 	out = []
 
@@ -2231,7 +2409,22 @@ if "MC" in sectionset:
 			(16,'readdir','readdir operations (per minute)'),
 			(17,'open','open operations (per minute)'),
 			(18,'read','read operations (per minute)'),
-			(19,'write','write operations (per minute)')
+			(19,'write','write operations (per minute)'),
+			(20,'fsmemalloc','metadata allocator - allocated memory (bytes)'),
+			(21,'fsmemused','metadata allocator - used memory (bytes)'),
+			(22,'storebytes','metadata store - bytes written to disk (per minute)'),
+			(23,'storetime','metadata store - time spent (seconds per minute)'),
+			(24,'rebalbytes','rebalance - data left to move (bytes)'),
+			(25,'rebaleta','rebalance - estimated time to finish (seconds, 0 - unknown)'),
+			(26,'rebalmoved','rebalance - data moved (bytes per minute)'),
+			(27,'pktalloc','network - packet buffers allocated with malloc (per minute)'),
+			(28,'pktreused','network - packet buffers reused from pools (per minute)'),
+			(29,'pktqueued','network - packets queued for sending (per minute)'),
+			(30,'pktwrites','network - write syscalls (per minute)'),
+			(31,'loopmax','main loop - longest handler run (seconds)'),
+			(32,'loopslow','main loop - handler runs above slow threshold (per minute)'),
+			(33,'cuopavg','client operations - average handling time (seconds)'),
+			(34,'cuopmax','client operations - longest handling time (seconds)')
 		)
 
 		out.append("""<script type="text/javascript">""")
@@ -46,6 +46,7 @@ enum {
 	OP_EXIT,
 	OP_INVAL,
 	OP_CHUNKOP,
+	OP_CHUNKOP_BATCH,
 	OP_OPEN,
 	OP_CLOSE,
 	OP_READ,
@@ -60,6 +61,17 @@ typedef struct _chunk_op_args {
 	uint32_t length;
 } chunk_op_args;
 
+// for OP_CHUNKOP_BATCH
+typedef struct _chunk_bop_entry {
+	chunk_op_args op;
+	uint32_t pos;		// position in status vector
+} chunk_bop_entry;
+
+typedef struct _chunk_bop_args {
+	uint32_t cnt;
+	uint8_t *statuses;
+} chunk_bop_args;
+
 // for OP_OPEN and OP_CLOSE
 typedef struct _chunk_oc_args {
 	uint64_t chunkid;
@@ -141,6 +153,8 @@ static inline int job_receive_status(jobpool *jp,uint32_t *jobid,uint8_t *status
 }
 
 #define opargs ((chunk_op_args*)(jptr->args))
+#define bopargs ((chunk_bop_args*)(jptr->args))
+#define bopentries ((chunk_bop_entry*)(((uint8_t*)(jptr->args))+sizeof(chunk_bop_args)))
 #define ocargs ((chunk_oc_args*)(jptr->args))
 #define rdargs ((chunk_rd_args*)(jptr->args))
 #define wrargs ((chunk_wr_args*)(jptr->args))
@@ -152,6 +166,8 @@ void* job_worker(void *th_arg) {
 	uint8_t status,jstate;
 	uint32_t jobid;
 	uint32_t op;
+	uint32_t i;
+	chunk_bop_entry *be;
 	for (;;) {
 		queue_get(jp->jobqueue,&jobid,&op,&jptrarg,NULL);
 		jptr = (job*)jptrarg;
@@ -176,6 +192,17 @@ void* job_worker(void *th_arg) {
 					status = hdd_chunkop(opargs->chunkid,opargs->version,opargs->newversion,opargs->copychunkid,opargs->copyversion,opargs->length);
 				}
 				break;
+			case OP_CHUNKOP_BATCH:
+				for (i=0 ; i<bopargs->cnt ; i++) {
+					be = bopentries+i;
+					if (jstate==JSTATE_DISABLED) {
+						bopargs->statuses[be->pos] = ERROR_NOTDONE;
+					} else {
+						bopargs->statuses[be->pos] = hdd_chunkop(be->op.chunkid,be->op.version,be->op.newversion,be->op.copychunkid,be->op.copyversion,be->op.length);
+					}
+				}
+				status = STATUS_OK;
+				break;
 			case OP_OPEN:
 				status = hdd_open(ocargs->chunkid);
 				break;
@@ -369,6 +396,29 @@ uint32_t job_chunkop(void *jpool,void (*callback)(uint8_t status,void *extra),vo
 	return job_new(jp,OP_CHUNKOP,args,callback,extra);
 }
 
+uint32_t job_chunkop_batch(void *jpool,void (*callback)(uint8_t status,void *extra),void *extra,uint32_t cnt,const uint8_t *ops,const uint32_t *idx,uint8_t *statuses) {
+	jobpool* jp = (jobpool*)jpool;
+	chunk_bop_args *args;
+	chunk_bop_entry *be;
+	const uint8_t *ptr;
+	uint32_t i;
+	args = malloc(sizeof(chunk_bop_args)+cnt*sizeof(chunk_bop_entry));
+	args->cnt = cnt;
+	args->statuses = statuses;
+	be = (chunk_bop_entry*)(((uint8_t*)args)+sizeof(chunk_bop_args));
+	for (i=0 ; i<cnt ; i++) {
+		ptr = ops+idx[i]*(8+4+4+8+4+4);
+		be[i].op.chunkid = get64bit(&ptr);
+		be[i].op.version = get32bit(&ptr);
+		be[i].op.newversion = get32bit(&ptr);
+		be[i].op.copychunkid = get64bit(&ptr);
+		be[i].op.copyversion = get32bit(&ptr);
+		be[i].op.length = get32bit(&ptr);
+		be[i].pos = idx[i];
+	}
+	return job_new(jp,OP_CHUNKOP_BATCH,args,callback,extra);
+}
+
 uint32_t job_open(void *jpool,void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid) {
 	jobpool* jp = (jobpool*)jpool;
 	chunk_oc_args *args;
@@ -39,6 +39,8 @@ uint32_t job_chunkop(void *jpool,void (*callback)(uint8_t status,void *extra),vo
 #define job_truncate(_jp,_cb,_ex,_chunkid,_version,_newversion,_length) (((_newversion)>0&&(_length)!=0xFFFFFFFF)?job_chunkop(_jp,_cb,_ex,_chunkid,_version,_newversion,0,0,_length):job_inval(_jp,_cb,_ex))
 #define job_duplicate(_jp,_cb,_ex,_chunkid,_version,_newversion,_copychunkid,_copyversion) (((_newversion>0)&&(_copychunkid)>0)?job_chunkop(_jp,_cb,_ex,_chunkid,_version,_newversion,_copychunkid,_copyversion,0xFFFFFFFF):job_inval(_jp,_cb,_ex))
 #define job_duptrunc(_jp,_cb,_ex,_chunkid,_version,_newversion,_copychunkid,_copyversion,_length) (((_newversion>0)&&(_copychunkid)>0&&(_length)!=0xFFFFFFFF)?job_chunkop(_jp,_cb,_ex,_chunkid,_version,_newversion,_copychunkid,_copyversion,_length):job_inval(_jp,_cb,_ex))
+/* ops: N * (chunkid:64 version:32 newversion:32 copychunkid:64 copyversion:32 length:32) - job executes records idx[0..cnt-1], status of record idx[j] goes to statuses[idx[j]] */
+uint32_t job_chunkop_batch(void *jpool,void (*callback)(uint8_t status,void *extra),void *extra,uint32_t cnt,const uint8_t *ops,const uint32_t *idx,uint8_t *statuses);
 
 uint32_t job_open(void *jpool,void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid);
 uint32_t job_close(void *jpool,void (*callback)(uint8_t status,void *extra),void *extra,uint64_t chunkid);
@@ -718,6 +718,18 @@ static chunk* hdd_chunk_tryfind(uint64_t chunkid) {
 	return c;
 }
 
+/* folder holding given chunk (NULL if not found) - used only to group operations by disk */
+void* hdd_chunk_folder(uint64_t chunkid) {
+	uint32_t hashpos = HASHPOS(chunkid);
+	chunk *c;
+	void *f;
+	pthread_mutex_lock(&hashlock);
+	for (c=hashtab[hashpos] ; c && c->chunkid!=chunkid ; c=c->next) {}
+	f = (c!=NULL)?c->owner:NULL;
+	pthread_mutex_unlock(&hashlock);
+	return f;
+}
+
 static chunk* hdd_chunk_get(uint64_t chunkid,uint8_t cflag) {
 	uint32_t hashpos = HASHPOS(chunkid);
 	chunk *c;
@@ -71,6 +71,7 @@ int hdd_get_checksum_tab(uint64_t chunkid, uint32_t version, uint8_t *checksum_t
 // newversion==0 && length==1                              -> create
 // newversion==0 && length==2                              -> test
 int hdd_chunkop(uint64_t chunkid,uint32_t version,uint32_t newversion,uint64_t copychunkid,uint32_t copyversion,uint32_t length);
+void* hdd_chunk_folder(uint64_t chunkid);
 
 #define hdd_delete(_chunkid,_version) hdd_chunkop(_chunkid,_version,0,0,0,0)
 #define hdd_create(_chunkid,_version) hdd_chunkop(_chunkid,_version,0,0,0,1)
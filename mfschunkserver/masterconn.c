@@ -71,6 +71,8 @@ typedef struct masterconn {
 	uint32_t masterip;		//MasterIP
 	uint16_t masterport;	//MasterĶ˿
 	uint8_t masteraddrvalid;
+	uint8_t oldregister;	// use registration of older masters (one packet with all chunks, no features)
+	uint8_t gotpacket;	// anything received from master since registration
 #ifdef BGJOBS
 	void *jpool;
 	int jobfd;
@@ -186,13 +188,17 @@ void masterconn_sendregister(masterconn *eptr) {
 	myport =  csserv_getlistenport();
 	hdd_get_space(&usedspace,&totalspace,&chunkcount,&tdusedspace,&tdtotalspace,&tdchunkcount);
 	chunks = hdd_get_chunks_count();
-	buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+4+4+2+2+8+8+4+8+8+4+chunks*(8+4));
+	if (eptr->oldregister) {
+		buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+4+4+2+2+8+8+4+8+8+4+chunks*(8+4));
+	} else {
+		buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+4+4+2+2+8+8+4+8+8+4+4);
+	}
 	if (buff==NULL) {
 		eptr->mode=KILL;
 		hdd_get_chunks_data(NULL);	// unlock
 		return;
 	}
-	put8bit(&buff,4);
+	put8bit(&buff,eptr->oldregister?4:5);
 	/* put32bit(&buff,VERSION): */
 	put16bit(&buff,VERSMAJ);
 	put8bit(&buff,VERSMID);
@@ -206,11 +212,33 @@ void masterconn_sendregister(masterconn *eptr) {
 	put64bit(&buff,tdusedspace);
 	put64bit(&buff,tdtotalspace);
 	put32bit(&buff,tdchunkcount);
+	if (eptr->oldregister) {
+		if (chunks>0) {
+			hdd_get_chunks_data(buff);
+		} else {
+			hdd_get_chunks_data(NULL);	// unlock
+		}
+		return;
+	}
+	put32bit(&buff,CSFEATURE_CHUNKOP_BATCH);
 	if (chunks>0) {
+		buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1+chunks*(8+4));
+		if (buff==NULL) {
+			eptr->mode=KILL;
+			hdd_get_chunks_data(NULL);	// unlock
+			return;
+		}
+		put8bit(&buff,6);
 		hdd_get_chunks_data(buff);
 	} else {
 		hdd_get_chunks_data(NULL);	// unlock
 	}
+	buff = masterconn_create_attached_packet(eptr,CSTOMA_REGISTER,1);
+	if (buff==NULL) {
+		eptr->mode=KILL;
+		return;
+	}
+	put8bit(&buff,7);
 }
 
 /*
@@ -340,6 +368,27 @@ void masterconn_chunkopfinished(uint8_t status,void *packet) {
 	}
 }
 
+typedef struct _batchstate {
+	void *packet;
+	uint32_t jobsleft;
+} batchstate;
+
+void masterconn_batchfinished(uint8_t status,void *extra) {
+	batchstate *bs = (batchstate*)extra;
+	masterconn *eptr = masterconnsingleton;
+	(void)status;
+	bs->jobsleft--;
+	if (bs->jobsleft>0) {
+		return;
+	}
+	if (eptr->mode==DATA || eptr->mode==HEADER) {
+		masterconn_attach_packet(eptr,bs->packet);
+	} else {
+		masterconn_delete_packet(bs->packet);
+	}
+	free(bs);
+}
+
 void masterconn_replicationfinished(uint8_t status,void *packet) {
 	uint8_t *ptr;
 	masterconn *eptr = masterconnsingleton;
@@ -668,6 +717,91 @@ void masterconn_chunkop(masterconn *eptr,const uint8_t *data,uint32_t length) {
 #endif /* BGJOBS */
 }
 
+//operations from MATOCS_CHUNKOP_BATCH are grouped by disk - one job per disk, one status vector for the whole batch
+//called from masterconn_gotpacket()
+void masterconn_chunkop_batch(masterconn *eptr,const uint8_t *data,uint32_t length) {
+	uint32_t batchid,cnt,i;
+	uint8_t *ptr;
+	const uint8_t *rptr;
+	void *packet;
+#ifdef BGJOBS
+	void *keys[CHUNKOP_BATCH_MAX];
+	uint32_t idx[CHUNKOP_BATCH_MAX];
+	uint32_t j,n,groups;
+	batchstate *bs;
+#else /* BGJOBS */
+	uint64_t chunkid,copychunkid;
+	uint32_t version,newversion,copyversion,leng;
+#endif /* BGJOBS */
+
+	if (length<4 || ((length-4)%32)!=0 || (length-4)/32>CHUNKOP_BATCH_MAX) {
+		syslog(LOG_NOTICE,"MATOCS_CHUNKOP_BATCH - wrong size (%"PRIu32"/4+N*32[N:0..%u])",length,CHUNKOP_BATCH_MAX);
+		eptr->mode = KILL;
+		return;
+	}
+	batchid = get32bit(&data);
+	cnt = (length-4)/32;
+	packet = masterconn_create_detached_packet(CSTOMA_CHUNKOP_BATCH,4+cnt);
+	if (packet==NULL) {
+		eptr->mode=KILL;
+		return;
+	}
+	ptr = masterconn_get_packet_data(packet);
+	put32bit(&ptr,batchid);
+#ifdef BGJOBS
+	if (cnt==0) {
+		masterconn_attach_packet(eptr,packet);
+		return;
+	}
+	for (i=0 ; i<cnt ; i++) {
+		rptr = data+i*32;
+		keys[i] = hdd_chunk_folder(get64bit(&rptr));
+	}
+	bs = malloc(sizeof(batchstate));
+	if (bs==NULL) {
+		masterconn_delete_packet(packet);
+		eptr->mode=KILL;
+		return;
+	}
+	bs->packet = packet;
+	// count disks before starting jobs - callbacks are called from main loop, so all jobs are started before the first one is finished
+	bs->jobsleft = 0;
+	for (i=0 ; i<cnt ; i++) {
+		for (j=0 ; j<i && keys[j]!=keys[i] ; j++) {}
+		if (j==i) {
+			bs->jobsleft++;
+		}
+	}
+	groups = bs->jobsleft;
+	for (i=0 ; i<cnt && groups>0 ; i++) {
+		for (j=0 ; j<i && keys[j]!=keys[i] ; j++) {}
+		if (j<i) {	// disk already has its job
+			continue;
+		}
+		n = 0;
+		for (j=i ; j<cnt ; j++) {
+			if (keys[j]==keys[i]) {
+				idx[n++] = j;
+			}
+		}
+		job_chunkop_batch(eptr->jpool,masterconn_batchfinished,bs,n,data,idx,ptr);
+		groups--;
+	}
+#else /* BGJOBS */
+	for (i=0 ; i<cnt ; i++) {
+		rptr = data+i*32;
+		chunkid = get64bit(&rptr);
+		version = get32bit(&rptr);
+		newversion = get32bit(&rptr);
+		copychunkid = get64bit(&rptr);
+		copyversion = get32bit(&rptr);
+		leng = get32bit(&rptr);
+		put8bit(&ptr,hdd_chunkop(chunkid,version,newversion,copychunkid,copyversion,leng));
+	}
+	masterconn_attach_packet(eptr,packet);
+#endif /* BGJOBS */
+}
+
 //ȡMasterpacketchunk
 //ãmasterconn_gotpacket()
 #ifdef BGJOBS
@@ -881,6 +1015,7 @@ void masterconn_chunk_checksum_tab(masterconn *eptr,const uint8_t *data,uint32_t
 //ȡMasterpacketַͣͬĴд
 //ãmasterconn_read()
 void masterconn_gotpacket(masterconn *eptr,uint32_t type,const uint8_t *data,uint32_t length) {
+	eptr->gotpacket = 1;
 	switch (type) {
 		case ANTOAN_NOP:
 			break;
@@ -902,6 +1037,9 @@ void masterconn_gotpacket(masterconn *eptr,uint32_t type,const uint8_t *data,uin
 		case MATOCS_CHUNKOP:
 			masterconn_chunkop(eptr,data,length);
 			break;
+		case MATOCS_CHUNKOP_BATCH:
+			masterconn_chunkop_batch(eptr,data,length);
+			break;
 		case MATOCS_TRUNCATE:
 			masterconn_truncate(eptr,data,length);
 			break;
@@ -967,6 +1105,7 @@ void masterconn_connected(masterconn *eptr) {
 	eptr->inputpacket.packet = NULL;
 	eptr->outputhead = NULL;
 	eptr->outputtail = &(eptr->outputhead);
+	eptr->gotpacket = 0;
 
 	masterconn_sendregister(eptr);
 	eptr->lastread = eptr->lastwrite = main_time();
@@ -1296,6 +1435,14 @@ void masterconn_serve(struct pollfd *pdesc) {
 		}
 #endif /* BGJOBS */
 		tcpclose(eptr->sock);
+		// older masters close connection on unknown registration version - master sends NOP every few seconds, so nothing received means
+		// that registration was refused ; next time register as before (then the new registration is tried again)
+		if (eptr->gotpacket==0 && eptr->oldregister==0) {
+			syslog(LOG_NOTICE,"master closed connection without answer - next registration will be done without chunkserver features");
+			eptr->oldregister = 1;
+		} else {
+			eptr->oldregister = 0;
+		}
 		if (eptr->inputpacket.packet) {
 			free(eptr->inputpacket.packet);
 		}
@@ -1345,6 +1492,8 @@ int masterconn_init(FILE *msgfd) {
 	eptr = masterconnsingleton = malloc(sizeof(masterconn));
 
 	eptr->masteraddrvalid = 0;
+	eptr->oldregister = 0;
+	eptr->gotpacket = 0;
 	eptr->mode = FREE;
 	eptr->pdescpos = -1;
 #ifdef BGJOBS
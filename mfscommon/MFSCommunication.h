@@ -178,6 +178,20 @@
 #define GMODE_RECURSIVE        1
 #define GMODE_ISVALID(x)       (((uint32_t)(x))<=1)
 
+// goal:
+// 1..9 - number of copies
+// GOAL_XOR(2..9) - one copy of each chunk plus one parity chunk (XOR) for every 'level' chunks
+#define GOAL_XOR_BASE          0x10
+#define GOAL_XOR(level)        (GOAL_XOR_BASE+(level))
+#define GOAL_XOR_LEVEL(x)      ((x)-GOAL_XOR_BASE)
+#define GOAL_IS_XOR(x)         (((uint32_t)(x))>=GOAL_XOR(2) && ((uint32_t)(x))<=GOAL_XOR(9))
+#define GOAL_MAX               GOAL_XOR(9)
+#define GOAL_ISVALID(x)        ((((uint32_t)(x))>=1 && ((uint32_t)(x))<=9) || GOAL_IS_XOR(x))
+// full copies of every chunk
+#define GOAL_COPIES(x)         (GOAL_IS_XOR(x)?1:(x))
+// order of redundancy: 1 < xor9 < ... < xor2 < 2 < ... < 9
+#define GOAL_RANK(x)           (GOAL_IS_XOR(x)?(16+10-GOAL_XOR_LEVEL(x)):((x)*16))
+
 // extraattr:
 
 #define EATTR_BITS             4
@@ -335,6 +349,13 @@
 // 		myip:32 myport:16 tpctimeout:16 usedspace:64 totalspace:64 chunks:32 tdusedspace:64 tdtotalspace:64 tdchunks:32 N*[ chunkid:64 version:32 ]
 // 	rver==4:
 // 		version:32 myip:32 myport:16 tcptimeout:16 usedspace:64 totalspace:64 chunks:32 tdusedspace:64 tdtotalspace:64 tdchunks:32 N*[ chunkid:64 version:32 ]
+// 	rver==5: (begin - chunk list sent in following packets)
+// 		version:32 myip:32 myport:16 tcptimeout:16 usedspace:64 totalspace:64 chunks:32 tdusedspace:64 tdtotalspace:64 tdchunks:32
+// 		version:32 myip:32 myport:16 tcptimeout:16 usedspace:64 totalspace:64 chunks:32 tdusedspace:64 tdtotalspace:64 tdchunks:32 features:32
+// 	rver==6: (chunks - any number of packets)
+// 		N*[ chunkid:64 version:32 ]
+// 	rver==7: (end)
+// 		-
 #define CSTOMA_SPACE 101
 // usedspace:64 totalspace:64
 // usedspace:64 totalspace:64 tdusedspace:64 tdtotalspace:64
@@ -402,6 +423,17 @@
 #define CSTOMA_DUPTRUNC 171
 // chunkid:64 status:8
 
+// chunkserver features (CSTOMA_REGISTER rver==5)
+#define CSFEATURE_CHUNKOP_BATCH 0x00000001
+
+#define MATOCS_CHUNKOP_BATCH 180
+// many operations in one packet (only for chunkservers with CSFEATURE_CHUNKOP_BATCH) - records as in MATOCS_CHUNKOP
+// batchid:32 N*[ chunkid:64 version:32 newversion:32 copychunkid:64 copyversion:32 length:32 ]
+#define CSTOMA_CHUNKOP_BATCH 181
+// statuses in the same order as operations in MATOCS_CHUNKOP_BATCH
+// batchid:32 N*[ status:8 ]
+#define CHUNKOP_BATCH_MAX 256
+
 
 
 
@@ -744,6 +776,14 @@
 // msgid:32 status:8
 // msgid:32 qflags:8 sinodes:32 slength:64 ssize:64 srealsize:64 hinodes:32 hlength:64 hsize:64 hrealsize:64 curinodes:32 curlength:64 cursize:64 currealsize:64
 
+#define CUTOMA_FUSE_READDIR 478
+// msgid:32 inode:32 uid:32 gid:32 flags:8 cookie:64 maxsize:32 - cookie==0 starts listing, otherwise continues it
+#define MATOCU_FUSE_READDIR 479
+// msgid:32 status:8
+// msgid:32 nextcookie:64 N*[ name:NAME inode:32 type:8 ]	- when GETDIR_FLAG_WITHATTR in flags is not set
+// msgid:32 nextcookie:64 N*[ name:NAME inode:32 type:35B ]	- when GETDIR_FLAG_WITHATTR in flags is set
+// first page (cookie==0) starts with '.' and '..', nextcookie==0 - no more entries, ERROR_EINVAL - cookie expired
+
 
 // special - reserved (opened) inodes - keep opened files.
 #define CUTOMA_FUSE_RESERVED_INODES 499
@@ -757,10 +797,13 @@
 
 #define CUTOMA_CSERV_LIST 500
 // -
+// withmem:8 (1 - add master memory used by server's chunk table)
 #define MATOCU_CSERV_LIST 501
 // 	N*[ip:32 port:16 used:64 total:64 chunks:32 tdused:64 tdtotal:64 tdchunks:32 errorcount:32 ]
 // since version 1.5.13:
 // 	N*[version:32 ip:32 port:16 used:64 total:64 chunks:32 tdused:64 tdtotal:64 tdchunks:32 errorcount:32 ]
+// with withmem==1:
+// 	N*[version:32 ip:32 port:16 used:64 total:64 chunks:32 tdused:64 tdtotal:64 tdchunks:32 errorcount:32 tablemem:64 ]
 
 #define CUTOCS_HDD_LIST_V1 502
 // -
@@ -788,6 +831,8 @@
 // 	totalspace:64 availspace:64 trashspace:64 trashnodes:32 reservedspace:64 reservednodes:32 allnodes:32 dirnodes:32 filenodes:32 chunks:32 tdchunks:32
 // since version 1.5.13:
 // 	version:32 totalspace:64 availspace:64 trashspace:64 trashnodes:32 reservedspace:64 reservednodes:32 allnodes:32 dirnodes:32 filenodes:32 chunks:32 chunkcopies:32 tdcopies:32
+// with metadata store state (102 bytes):
+// 	version:32 totalspace:64 availspace:64 trashspace:64 trashnodes:32 reservedspace:64 reservednodes:32 allnodes:32 dirnodes:32 filenodes:32 chunks:32 chunkcopies:32 tdcopies:32 storestatus:8 storeresult:8 storestart:32 storemsec:32 storebytes:64 storestored:64 storerecords:64
 
 #define CUTOMA_FSTEST_INFO 512
 // -
@@ -800,6 +845,8 @@
 // -
 #define MATOCU_CHUNKSTEST_INFO 515
 // loopstart:32 loopend:32 del_invalid:32 nodel_invalid:32 del_unused:32 nodel_unused:32 del_diskclean:32 nodel_diskclean:32 del_overgoal:32 nodel_overgoal:32 copy_undergoal:32 nocopy_undergoal:32 copy_rebalance:32
+// with replication queue lengths (68 bytes):
+// loopstart:32 loopend:32 del_invalid:32 nodel_invalid:32 del_unused:32 nodel_unused:32 del_diskclean:32 nodel_diskclean:32 del_overgoal:32 nodel_overgoal:32 copy_undergoal:32 nocopy_undergoal:32 copy_rebalance:32 queue_endangered:32 queue_onecopy:32 queue_undergoal:32 queue_overgoal:32
 
 #define CUTOMA_CHUNKS_MATRIX 516
 // [matrix_id:8]
@@ -821,6 +868,13 @@
 #define MATOCU_MLOG_LIST 523
 // N * [ version:32 ip:32 ]
 
+#define CUTOMA_LATENCY_INFO 524
+// -
+#define MATOCU_LATENCY_INFO 525
+// slowthreshold:32 N * [ nleng:8 name:nlengB count:64 usecsum:64 usecmax:64 24 * [ bucket:32 ] ]
+// names: "desc:fun" "serve:fun" "loop:fun" "timer:fun" (main loop handlers) , "cuop:type" (client packets)
+// bucket i counts runs which took [2^i,2^(i+1)) us (bucket 0: below 2us, last bucket: everything longer)
+
 
 // CHUNKSERVER STATS
 
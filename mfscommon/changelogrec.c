@@ -0,0 +1,322 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "datapack.h"
+#include "changelogrec.h"
+
+#define ARG_NONE 0
+#define ARG_U32 1
+#define ARG_U64 2
+#define ARG_CHAR 3
+#define ARG_STR 4
+#define ARG_PERCENT 5
+#define ARG_BAD 6
+
+static const char* opformats[CHLOG_OPCOUNT] = {
+#define CHLOG_OP(name,format) format,
+	CHLOG_OPS
+#undef CHLOG_OP
+};
+
+// parses conversion after '%' - PRIu8/PRIu16 arguments are promoted to int, so only 'l' (PRIu64) changes size
+static inline const char* changelogrec_conv(const char *f,uint8_t *argtype) {
+	uint8_t wide = 0;
+	while (*f=='l' || *f=='h' || *f=='j' || *f=='q') {
+		if (*f=='l' || *f=='j' || *f=='q') {
+			wide = 1;
+		}
+		f++;
+	}
+	switch (*f) {
+	case 'u':
+	case 'd':
+	case 'x':
+		*argtype = wide?ARG_U64:ARG_U32;
+		break;
+	case 'c':
+		*argtype = ARG_CHAR;
+		break;
+	case 's':
+		*argtype = ARG_STR;
+		break;
+	case '%':
+		*argtype = ARG_PERCENT;
+		break;
+	default:
+		*argtype = ARG_BAD;
+		return f;
+	}
+	return f+1;
+}
+
+uint32_t changelogrec_pack(uint8_t *buff,uint64_t version,uint8_t op,va_list ap) {
+	const char *f;
+	const char *str;
+	uint8_t *ptr,*end;
+	uint8_t argtype;
+	uint32_t sleng;
+
+	ptr = buff+CHLOG_HDRSIZE;
+	end = ptr+CHLOG_MAXDATA;
+	f = (op<CHLOG_OPCOUNT)?opformats[op]:"";
+	while (*f) {
+		if (*f!='%') {
+			f++;
+			continue;
+		}
+		f = changelogrec_conv(f+1,&argtype);
+		switch (argtype) {
+		case ARG_U32:
+			put32bit(&ptr,va_arg(ap,uint32_t));
+			break;
+		case ARG_U64:
+			put64bit(&ptr,va_arg(ap,uint64_t));
+			break;
+		case ARG_CHAR:
+			put8bit(&ptr,va_arg(ap,int));
+			break;
+		case ARG_STR:
+			str = va_arg(ap,const char*);
+			sleng = strlen(str);
+			if (ptr+2+sleng>end-32) {	// leave room for numbers after the string
+				sleng = (ptr+2<end-32)?(end-32)-(ptr+2):0;
+			}
+			put16bit(&ptr,sleng);
+			memcpy(ptr,str,sleng);
+			ptr+=sleng;
+			break;
+		}
+	}
+	sleng = ptr-(buff+CHLOG_HDRSIZE);
+	ptr = buff;
+	put8bit(&ptr,CHLOG_RECMARK);
+	put8bit(&ptr,op);
+	put16bit(&ptr,sleng);
+	put64bit(&ptr,version);
+	return CHLOG_HDRSIZE+sleng;
+}
+
+int changelogrec_totext(const uint8_t *rec,uint32_t leng,char *buff,uint32_t size) {
+	const uint8_t *ptr,*end;
+	const char *f;
+	uint8_t op,argtype;
+	uint16_t dleng,sleng;
+	uint64_t version;
+	uint32_t pos;
+	int l;
+
+	if (leng<CHLOG_HDRSIZE || rec[0]!=CHLOG_RECMARK) {
+		return -1;
+	}
+	ptr = rec+1;
+	op = get8bit(&ptr);
+	dleng = get16bit(&ptr);
+	version = get64bit(&ptr);
+	if (op>=CHLOG_OPCOUNT || CHLOG_HDRSIZE+(uint32_t)dleng!=leng) {
+		return -1;
+	}
+	end = ptr+dleng;
+	l = snprintf(buff,size,"%"PRIu64": ",version);
+	if (l<0 || (uint32_t)l>=size) {
+		return -1;
+	}
+	pos = l;
+	f = opformats[op];
+	while (*f) {
+		if (*f!='%') {
+			if (pos+1>=size) {
+				return -1;
+			}
+			buff[pos++] = *f++;
+			continue;
+		}
+		f = changelogrec_conv(f+1,&argtype);
+		l = 0;
+		switch (argtype) {
+		case ARG_U32:
+			if (ptr+4>end) {
+				return -1;
+			}
+			l = snprintf(buff+pos,size-pos,"%"PRIu32,get32bit(&ptr));
+			break;
+		case ARG_U64:
+			if (ptr+8>end) {
+				return -1;
+			}
+			l = snprintf(buff+pos,size-pos,"%"PRIu64,get64bit(&ptr));
+			break;
+		case ARG_CHAR:
+			if (ptr+1>end) {
+				return -1;
+			}
+			l = snprintf(buff+pos,size-pos,"%c",get8bit(&ptr));
+			break;
+		case ARG_STR:
+			if (ptr+2>end) {
+				return -1;
+			}
+			sleng = get16bit(&ptr);
+			if (ptr+sleng>end || pos+sleng>=size) {
+				return -1;
+			}
+			memcpy(buff+pos,ptr,sleng);
+			ptr+=sleng;
+			l = sleng;
+			break;
+		case ARG_PERCENT:
+			l = snprintf(buff+pos,size-pos,"%%");
+			break;
+		default:
+			return -1;
+		}
+		if (l<0 || pos+l>=size) {
+			return -1;
+		}
+		pos+=l;
+	}
+	if (ptr!=end || pos+1>=size) {
+		return -1;
+	}
+	buff[pos++]='\n';
+	buff[pos]=0;
+	return pos;
+}
+
+uint64_t changelogrec_getnum(const uint8_t *rec,uint32_t leng,uint8_t argno) {
+	const uint8_t *ptr,*end;
+	const char *f;
+	uint8_t op,argtype;
+	uint16_t dleng,sleng;
+
+	if (leng<CHLOG_HDRSIZE || rec[0]!=CHLOG_RECMARK) {
+		return 0;
+	}
+	ptr = rec+1;
+	op = get8bit(&ptr);
+	dleng = get16bit(&ptr);
+	ptr+=8;
+	if (op>=CHLOG_OPCOUNT || CHLOG_HDRSIZE+(uint32_t)dleng!=leng) {
+		return 0;
+	}
+	end = ptr+dleng;
+	f = opformats[op];
+	while (*f) {
+		if (*f!='%') {
+			f++;
+			continue;
+		}
+		f = changelogrec_conv(f+1,&argtype);
+		switch (argtype) {
+		case ARG_U32:
+			if (ptr+4>end) {
+				return 0;
+			}
+			if (argno==0) {
+				return get32bit(&ptr);
+			}
+			ptr+=4;
+			break;
+		case ARG_U64:
+			if (ptr+8>end) {
+				return 0;
+			}
+			if (argno==0) {
+				return get64bit(&ptr);
+			}
+			ptr+=8;
+			break;
+		case ARG_CHAR:
+			if (ptr+1>end) {
+				return 0;
+			}
+			if (argno==0) {
+				return get8bit(&ptr);
+			}
+			ptr++;
+			break;
+		case ARG_STR:
+			if (ptr+2>end) {
+				return 0;
+			}
+			sleng = get16bit(&ptr);
+			if (argno==0 || ptr+sleng>end) {
+				return 0;
+			}
+			ptr+=sleng;
+			break;
+		case ARG_PERCENT:
+			continue;
+		default:
+			return 0;
+		}
+		argno--;
+	}
+	return 0;
+}
+
+int changelogrec_read(FILE *fd,char *buff,uint32_t size) {
+	uint8_t rec[CHLOG_MAXRECSIZE];
+	const uint8_t *ptr;
+	uint32_t dleng;
+	long offset;
+	int c;
+	size_t l;
+
+	offset = ftell(fd);
+	if (offset<0) {
+		return -1;
+	}
+	c = getc(fd);
+	if (c==EOF) {
+		clearerr(fd);
+		return 0;
+	}
+	if (c!=CHLOG_RECMARK) {
+		ungetc(c,fd);
+		if (fgets(buff,size,fd)==NULL) {
+			return (fseek(fd,offset,SEEK_SET)<0)?-1:0;
+		}
+		l = strlen(buff);
+		if (l>0 && buff[l-1]=='\n') {
+			return l;
+		}
+		if (l+1>=size) {	// line longer than buffer
+			return -1;
+		}
+		// last line is not complete yet
+		return (fseek(fd,offset,SEEK_SET)<0)?-1:0;
+	}
+	rec[0] = c;
+	if (fread(rec+1,1,CHLOG_HDRSIZE-1,fd)!=CHLOG_HDRSIZE-1) {
+		return (fseek(fd,offset,SEEK_SET)<0)?-1:0;
+	}
+	ptr = rec+2;
+	dleng = get16bit(&ptr);
+	if (rec[1]>=CHLOG_OPCOUNT || dleng>CHLOG_MAXDATA) {
+		return -1;
+	}
+	if (dleng>0 && fread(rec+CHLOG_HDRSIZE,1,dleng,fd)!=dleng) {
+		return (fseek(fd,offset,SEEK_SET)<0)?-1:0;
+	}
+	return changelogrec_totext(rec,CHLOG_HDRSIZE+dleng,buff,size);
+}
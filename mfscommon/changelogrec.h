@@ -0,0 +1,92 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CHANGELOGREC_H_
+#define _CHANGELOGREC_H_
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+
+/* binary changelog records
+
+   record: mark:8 (CHLOG_RECMARK) op:8 dataleng:16 version:64 data[dataleng]
+   data: arguments in order of the op format - integers (%u) as 32 bits, 64-bit integers (%lu/%llu) as 64 bits,
+   characters (%c) as 8 bits, strings (%s) as leng:16 + bytes ; all numbers big-endian (datapack.h)
+
+   text lines ("version: format\n") start with a digit, so both kinds of entries can be mixed in one file (old files,
+   changes received from master by slaves) - readers take entries one by one and convert records to text lines
+   which are then parsed and sent to metaloggers/slaves exactly as before */
+
+#define CHLOG_RECMARK 0x01
+#define CHLOG_HDRSIZE (1+1+2+8)
+#define CHLOG_MAXDATA 10000
+#define CHLOG_MAXRECSIZE (CHLOG_HDRSIZE+CHLOG_MAXDATA)
+
+/* op codes are stored in files - never reorder this list, add new ops at the end */
+#define CHLOG_OPS \
+	CHLOG_OP(ACCESS,"%"PRIu32"|ACCESS(%"PRIu32")") \
+	CHLOG_OP(APPEND,"%"PRIu32"|APPEND(%"PRIu32",%"PRIu32")") \
+	CHLOG_OP(AQUIRE,"%"PRIu32"|AQUIRE(%"PRIu32",%"PRIu32")") \
+	CHLOG_OP(ATTR,"%"PRIu32"|ATTR(%"PRIu32",%"PRIu16",%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu32")") \
+	CHLOG_OP(CREATE,"%"PRIu32"|CREATE(%"PRIu32",%s,%c,%"PRIu16",%"PRIu32",%"PRIu32",%"PRIu32"):%"PRIu32) \
+	CHLOG_OP(EATTR,"%"PRIu32"|EATTR(%"PRIu32",%"PRIu16")") \
+	CHLOG_OP(EMPTYRESERVED,"%"PRIu32"|EMPTYRESERVED():%"PRIu32) \
+	CHLOG_OP(EMPTYTRASH,"%"PRIu32"|EMPTYTRASH():%"PRIu32",%"PRIu32) \
+	CHLOG_OP(FREEINODES,"%"PRIu32"|FREEINODES():%"PRIu32) \
+	CHLOG_OP(INCVERSION,"%"PRIu32"|INCVERSION(%"PRIu64")") \
+	CHLOG_OP(LENGTH,"%"PRIu32"|LENGTH(%"PRIu32",%"PRIu64")") \
+	CHLOG_OP(LINK,"%"PRIu32"|LINK(%"PRIu32",%"PRIu32",%s)") \
+	CHLOG_OP(MOVE,"%"PRIu32"|MOVE(%"PRIu32",%s,%"PRIu32",%s):%"PRIu32) \
+	CHLOG_OP(PURGE,"%"PRIu32"|PURGE(%"PRIu32")") \
+	CHLOG_OP(REINIT,"%"PRIu32"|REINIT(%"PRIu32",%"PRIu32"):%"PRIu64) \
+	CHLOG_OP(RELEASE,"%"PRIu32"|RELEASE(%"PRIu32",%"PRIu32")") \
+	CHLOG_OP(REPAIR,"%"PRIu32"|REPAIR(%"PRIu32",%"PRIu32"):%"PRIu32) \
+	CHLOG_OP(SESSION,"%"PRIu32"|SESSION():%"PRIu32) \
+	CHLOG_OP(SETEATTR,"%"PRIu32"|SETEATTR(%"PRIu32",%"PRIu32",%"PRIu8",%"PRIu8"):%"PRIu32",%"PRIu32",%"PRIu32) \
+	CHLOG_OP(SETGOAL,"%"PRIu32"|SETGOAL(%"PRIu32",%"PRIu32",%"PRIu8",%"PRIu8"):%"PRIu32",%"PRIu32",%"PRIu32) \
+	CHLOG_OP(SETPATH,"%"PRIu32"|SETPATH(%"PRIu32",%s)") \
+	CHLOG_OP(SETTRASHTIME,"%"PRIu32"|SETTRASHTIME(%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu8"):%"PRIu32",%"PRIu32",%"PRIu32) \
+	CHLOG_OP(SETTRASHTO,"%"PRIu32"|SETTRASHTIME(%"PRIu32",%"PRIu32")") \
+	CHLOG_OP(SNAPSHOT,"%"PRIu32"|SNAPSHOT(%"PRIu32",%"PRIu32",%s,%"PRIu8")") \
+	CHLOG_OP(SYMLINK,"%"PRIu32"|SYMLINK(%"PRIu32",%s,%s,%"PRIu32",%"PRIu32"):%"PRIu32) \
+	CHLOG_OP(TRUNC,"%"PRIu32"|TRUNC(%"PRIu32",%"PRIu32"):%"PRIu64) \
+	CHLOG_OP(UNDEL,"%"PRIu32"|UNDEL(%"PRIu32")") \
+	CHLOG_OP(UNLINK,"%"PRIu32"|UNLINK(%"PRIu32",%s):%"PRIu32) \
+	CHLOG_OP(UNLOCK,"%"PRIu32"|UNLOCK(%"PRIu64")") \
+	CHLOG_OP(WRITE,"%"PRIu32"|WRITE(%"PRIu32",%"PRIu32",%"PRIu8"):%"PRIu64) \
+	CHLOG_OP(XORDEL,"%"PRIu32"|XORDEL(%"PRIu64")") \
+	CHLOG_OP(XORGROUP,"%"PRIu32"|XORGROUP(%"PRIu64",%"PRIu8"%s)")
+
+enum {
+#define CHLOG_OP(name,format) CHLOG_##name,
+	CHLOG_OPS
+#undef CHLOG_OP
+	CHLOG_OPCOUNT
+};
+
+// builds record in buff (at least CHLOG_MAXRECSIZE bytes) - returns record length ; too long strings are truncated
+uint32_t changelogrec_pack(uint8_t *buff,uint64_t version,uint8_t op,va_list ap);
+// converts record to text line (with '\n') - returns line length or -1 (broken record or line longer than size-1)
+int changelogrec_totext(const uint8_t *rec,uint32_t leng,char *buff,uint32_t size);
+// returns numeric argument 'argno' of record (0 - first one) - 0 when record is broken or this argument is not a number
+uint64_t changelogrec_getnum(const uint8_t *rec,uint32_t leng,uint8_t argno);
+// reads next entry (record or text line) as text line - returns line length, 0 (no complete entry - file position is not changed) or -1 (error)
+int changelogrec_read(FILE *fd,char *buff,uint32_t size);
+
+#endif
@@ -53,6 +53,7 @@
 #include "cfg.h"
 #include "main.h"
 #include "init.h"
+#include "datapack.h"
 
 #define RM_RESTART 0
 #define RM_START 1
@@ -93,6 +94,7 @@ static rlentry *rlhead=NULL;
 typedef struct epollentry {
 	void (*desc)(int);
 	void (*serve)(int ,int ,struct epoll_event *);
+	lathist *deschist,*servehist;
 	struct epollentry *next;
 } epollentry;
 
@@ -101,31 +103,81 @@ static epollentry *epollhead=NULL;
 
 typedef struct eloopentry {
 	void (*fun)(void);
+	lathist *hist;
 	struct eloopentry *next;
 } eloopentry;
 
 static eloopentry *eloophead=NULL;
 
 
+/* millisecond timers - hierarchical timing wheel: 4 levels of 256 slots (1ms, 256ms, 65s, 4.6h),
+   timers are put into the level which covers their distance and moved down (cascaded) when the lower
+   level wraps, so adding, cancelling and expiring a timer costs O(1) regardless of number of timers */
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1<<WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE-1)
+#define WHEEL_LEVELS 4
+
+#define TIMER_IDLE 0
+#define TIMER_LINKED 1
+#define TIMER_RUNNING 2
+
+struct _main_timer {
+	uint64_t expires;
+	uint32_t period;
+	uint8_t state;
+	uint8_t cancelled;
+	void (*fun)(void*);
+	void *arg;
+	lathist *hist;
+	struct _main_timer *next,**prev;
+};
+
+static main_timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t wheeltime=0;		// all slots up to this time have been processed
+static uint32_t wheelcount=0;		// timers in wheel
+static main_timer *timerrunning=NULL;
+
 typedef struct timeentry {
 	time_t nextevent;
 	uint32_t seconds;
 	int mode;
 //	int offset;
 	void (*fun)(void);
-	struct timeentry *next;
+	lathist *hist;
+	main_timer *timer;
 } timeentry;
 
-static timeentry *timehead=NULL;
+/* latency histograms of handlers called by main loop (and other histograms registered by modules) */
+#define LATHIST_NAMELENG 48
+#define SLOWLOG_PERSEC 10
+
+struct _lathist {
+	char name[LATHIST_NAMELENG];
+	uint64_t count;
+	uint64_t usecsum;
+	uint64_t usecmax;
+	uint32_t buckets[LATHIST_BUCKETS];
+	struct _lathist *next;
+};
+
+static lathist *lathisthead=NULL,**lathisttail=&lathisthead;
+static uint32_t lathistnleng=0;	// sum of name lengths (packet size)
+static uint32_t lathistcnt=0;
+static uint32_t SlowUsec=0;	// 0 - slow handlers are not logged
+static uint64_t loopslow=0;
+static uint64_t loopmax=0;	// since last main_loopstats
+static uint32_t slowlogtime=0,slowlogcnt=0;
 
 static int now;
 static uint64_t usecnow;
+static uint64_t msecnow;
 //static int alcnt=0;
 
 static int terminate=0;
 static int sigchld=0;
 static int reload=0;
-static int epoll_fd;
+static int epoll_fd = -1;
 
 //to avoid epoll&fork problem
 
@@ -159,22 +211,369 @@ void main_reloadregister (void (*fun)(void)) {
 	rlhead = aux;
 }
 
-void main_epollregister (void (*desc)(int),void (*serve)(int ,int ,struct epoll_event *)) {
+void main_epollregister_name (void (*desc)(int),void (*serve)(int ,int ,struct epoll_event *),const char *descname,const char *servename) {
+	char name[LATHIST_NAMELENG];
 	epollentry *aux=(epollentry*)malloc(sizeof(epollentry));
 	aux->desc = desc;
 	aux->serve = serve;
+	snprintf(name,LATHIST_NAMELENG,"desc:%s",descname);
+	aux->deschist = main_lathist(name);
+	snprintf(name,LATHIST_NAMELENG,"serve:%s",servename);
+	aux->servehist = main_lathist(name);
 	aux->next = epollhead;
 	epollhead = aux;
 }
 
-void main_eachloopregister (void (*fun)(void)) {
+void main_eachloopregister_name (void (*fun)(void),const char *funname) {
+	char name[LATHIST_NAMELENG];
 	eloopentry *aux=(eloopentry*)malloc(sizeof(eloopentry));
 	aux->fun = fun;
+	snprintf(name,LATHIST_NAMELENG,"loop:%s",funname);
+	aux->hist = main_lathist(name);
 	aux->next = eloophead;
 	eloophead = aux;
 }
 
-void main_timeregister (int mode,uint32_t seconds,uint32_t offset,void (*fun)(void)) {
+uint64_t main_preciseutime(void) {
+	struct timespec ts;
+	uint64_t r;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	r = ts.tv_sec;
+	r *= 1000000;
+	r += ts.tv_nsec/1000;
+	return r;
+}
+
+lathist* main_lathist(const char *name) {
+	lathist *h;
+	for (h=lathisthead ; h ; h=h->next) {
+		if (strncmp(h->name,name,LATHIST_NAMELENG-1)==0) {
+			return h;
+		}
+	}
+	h = (lathist*)malloc(sizeof(lathist));
+	memset(h,0,sizeof(lathist));
+	strncpy(h->name,name,LATHIST_NAMELENG-1);
+	h->next = NULL;
+	*lathisttail = h;
+	lathisttail = &(h->next);
+	lathistnleng += strlen(h->name);
+	lathistcnt++;
+	return h;
+}
+
+void main_lathistadd(lathist *h,uint64_t usec) {
+	uint32_t b;
+	b = (usec>1)?(63-__builtin_clzll(usec)):0;
+	if (b>=LATHIST_BUCKETS) {
+		b = LATHIST_BUCKETS-1;
+	}
+	h->buckets[b]++;
+	h->count++;
+	h->usecsum += usec;
+	if (usec>h->usecmax) {
+		h->usecmax = usec;
+	}
+	if (SlowUsec>0 && usec>=SlowUsec) {
+		if ((uint32_t)now!=slowlogtime) {
+			slowlogtime = now;
+			slowlogcnt = 0;
+		}
+		if (slowlogcnt<SLOWLOG_PERSEC) {
+			slowlogcnt++;
+			MFSLOG(LOG_WARNING,"slow handler: %s - %"PRIu64".%03"PRIu64" ms",h->name,usec/1000,usec%1000);
+		}
+	}
+}
+
+/* handler called directly by main loop finished - returns current time (start of next handler) */
+static uint64_t main_handlertime(lathist *h,uint64_t start) {
+	uint64_t t,usec;
+	t = main_preciseutime();
+	usec = t-start;
+	main_lathistadd(h,usec);
+	if (usec>loopmax) {
+		loopmax = usec;
+	}
+	if (SlowUsec>0 && usec>=SlowUsec) {
+		loopslow++;
+	}
+	return t;
+}
+
+void main_loopstats(uint64_t *maxusec,uint64_t *slow) {
+	*maxusec = loopmax;
+	*slow = loopslow;
+	loopmax = 0;
+}
+
+uint32_t main_lathistsize(void) {
+	return 4+lathistcnt*(1+8+8+8+4*LATHIST_BUCKETS)+lathistnleng;
+}
+
+void main_lathiststore(uint8_t *buff) {
+	lathist *h;
+	uint32_t i,l;
+	put32bit(&buff,SlowUsec/1000);
+	for (h=lathisthead ; h ; h=h->next) {
+		l = strlen(h->name);
+		put8bit(&buff,l);
+		memcpy(buff,h->name,l);
+		buff += l;
+		put64bit(&buff,h->count);
+		put64bit(&buff,h->usecsum);
+		put64bit(&buff,h->usecmax);
+		for (i=0 ; i<LATHIST_BUCKETS ; i++) {
+			put32bit(&buff,h->buckets[i]);
+		}
+	}
+}
+
+static void main_clockupdate(void) {
+	struct timeval tv;
+	struct timespec ts;
+	gettimeofday(&tv,NULL);
+	usecnow = tv.tv_sec;
+	usecnow *= 1000000;
+	usecnow += tv.tv_usec;
+	now = tv.tv_sec;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	msecnow = ts.tv_sec;
+	msecnow *= 1000;
+	msecnow += ts.tv_nsec/1000000;
+}
+
+static void main_timerlink(main_timer *t,uint64_t mintime) {
+	uint64_t e,d;
+	main_timer **slot;
+	e = t->expires;
+	if (e<mintime) {
+		e = mintime;
+	}
+	d = e - wheeltime;
+	if (d < (UINT64_C(1)<<WHEEL_BITS)) {
+		slot = wheel[0] + (e & WHEEL_MASK);
+	} else if (d < (UINT64_C(1)<<(2*WHEEL_BITS))) {
+		slot = wheel[1] + ((e>>WHEEL_BITS) & WHEEL_MASK);
+	} else if (d < (UINT64_C(1)<<(3*WHEEL_BITS))) {
+		slot = wheel[2] + ((e>>(2*WHEEL_BITS)) & WHEEL_MASK);
+	} else {
+		if (d > UINT32_MAX) {
+			e = wheeltime + UINT32_MAX;
+		}
+		slot = wheel[3] + ((e>>(3*WHEEL_BITS)) & WHEEL_MASK);
+	}
+	t->next = *slot;
+	if (t->next) {
+		t->next->prev = &(t->next);
+	}
+	t->prev = slot;
+	*slot = t;
+	t->state = TIMER_LINKED;
+	wheelcount++;
+}
+
+static void main_timerunlink(main_timer *t) {
+	*(t->prev) = t->next;
+	if (t->next) {
+		t->next->prev = t->prev;
+	}
+	t->next = NULL;
+	t->prev = NULL;
+	t->state = TIMER_IDLE;
+	wheelcount--;
+}
+
+main_timer* main_timeradd_name(uint32_t msec,uint32_t period,void (*fun)(void*),void *arg,const char *funname) {
+	char name[LATHIST_NAMELENG];
+	main_timer *t;
+	t = (main_timer*)malloc(sizeof(main_timer));
+	t->period = period;
+	t->cancelled = 0;
+	t->fun = fun;
+	t->arg = arg;
+	if (funname) {
+		snprintf(name,LATHIST_NAMELENG,"timer:%s",funname);
+		t->hist = main_lathist(name);
+	} else {
+		t->hist = NULL;
+	}
+	t->expires = msecnow + msec;
+	main_timerlink(t,wheeltime+1);
+	return t;
+}
+
+void main_timerset(main_timer *t,uint32_t msec) {
+	if (t->state==TIMER_LINKED) {
+		main_timerunlink(t);
+	}
+	t->expires = msecnow + msec;
+	main_timerlink(t,wheeltime+1);
+}
+
+void main_timercancel(main_timer *t) {
+	if (t==NULL) {
+		return;
+	}
+	if (t->state==TIMER_LINKED) {
+		main_timerunlink(t);
+	}
+	if (t==timerrunning) {	// called from its own callback - freed after callback returns
+		t->cancelled = 1;
+		return;
+	}
+	free(t);
+}
+
+static void main_timercascade(uint32_t level) {
+	main_timer *t,*nt;
+	uint32_t idx;
+	idx = (wheeltime >> (level*WHEEL_BITS)) & WHEEL_MASK;
+	t = wheel[level][idx];
+	wheel[level][idx] = NULL;
+	while (t) {
+		nt = t->next;
+		wheelcount--;
+		main_timerlink(t,wheeltime);
+		t = nt;
+	}
+}
+
+static void main_timersrun(void) {
+	main_timer *t;
+	main_timer **slot;
+	lathist *hist;
+	uint64_t start;
+	while (wheeltime<msecnow) {
+		if (wheelcount==0) {
+			wheeltime = msecnow;
+			return;
+		}
+		wheeltime++;
+		if ((wheeltime & WHEEL_MASK)==0) {
+			if (((wheeltime>>WHEEL_BITS) & WHEEL_MASK)==0) {
+				if (((wheeltime>>(2*WHEEL_BITS)) & WHEEL_MASK)==0) {
+					main_timercascade(3);
+				}
+				main_timercascade(2);
+			}
+			main_timercascade(1);
+		}
+		slot = wheel[0] + (wheeltime & WHEEL_MASK);
+		while ((t=*slot)!=NULL) {	// always take list head - callbacks may cancel other timers
+			main_timerunlink(t);
+			t->state = TIMER_RUNNING;
+			timerrunning = t;
+			hist = t->hist;
+			start = (hist)?main_preciseutime():0;
+			t->fun(t->arg);
+			if (hist) {
+				main_handlertime(hist,start);
+			}
+			timerrunning = NULL;
+			if (t->cancelled) {
+				free(t);
+			} else if (t->state==TIMER_RUNNING) {	// not rearmed by callback
+				if (t->period>0) {
+					t->expires += t->period;
+					if (t->expires<=msecnow) {	// late - skip lost periods
+						t->expires = msecnow + t->period;
+					}
+					main_timerlink(t,wheeltime+1);
+				} else {
+					t->state = TIMER_IDLE;
+				}
+			}
+		}
+	}
+}
+
+/* milliseconds to the next slot which has to be processed (not more than maxwait) */
+static uint32_t main_timerswait(uint32_t maxwait) {
+	uint32_t i,l;
+	uint64_t t;
+	if (wheelcount==0) {
+		return maxwait;
+	}
+	if (wheeltime<msecnow) {
+		return 0;
+	}
+	for (i=1 ; i<maxwait ; i++) {
+		t = wheeltime + i;
+		if (wheel[0][t & WHEEL_MASK]) {
+			return i;
+		}
+		for (l=1 ; l<WHEEL_LEVELS && ((t>>((l-1)*WHEEL_BITS)) & WHEEL_MASK)==0 ; l++) {
+			if (wheel[l][(t>>(l*WHEEL_BITS)) & WHEEL_MASK]) {
+				return i;
+			}
+		}
+	}
+	return maxwait;
+}
+
+#ifndef UNITTEST
+static void main_timersterm(void) {
+	main_timer *t;
+	uint32_t l,i;
+	for (l=0 ; l<WHEEL_LEVELS ; l++) {
+		for (i=0 ; i<WHEEL_SIZE ; i++) {
+			while ((t=wheel[l][i])!=NULL) {
+				wheel[l][i] = t->next;
+				free(t);
+			}
+		}
+	}
+	wheelcount = 0;
+}
+#endif
+
+/* second timers (aligned to wall clock) - kept on the wheel as one-shot timers rearmed after each run */
+static uint32_t main_timeentrydelay(timeentry *te) {
+	uint64_t usec;
+	usec = te->nextevent;
+	usec *= 1000000;
+	if (usec<=usecnow) {
+		return 0;
+	}
+	return (usec-usecnow+999)/1000;
+}
+
+static inline void main_timeentrycall(timeentry *te) {
+	uint64_t start = main_preciseutime();
+	te->fun();
+	main_handlertime(te->hist,start);
+}
+
+static void main_timeentryrun(void *arg) {
+	timeentry *te = (timeentry*)arg;
+	if (te->mode==TIMEMODE_RUNALL) {
+		while (now>=te->nextevent) {
+			te->nextevent += te->seconds;
+			main_timeentrycall(te);
+		}
+	} else if (te->mode==TIMEMODE_RUNONCE) {
+		if (now>=te->nextevent) {
+			while (now>=te->nextevent) {
+				te->nextevent += te->seconds;
+			}
+			main_timeentrycall(te);
+		}
+	} else { /* te->mode == TIMEMODE_SKIP */
+		if (now>=te->nextevent) {
+			if (now==te->nextevent) {
+				main_timeentrycall(te);
+			}
+			while (now>=te->nextevent) {
+				te->nextevent += te->seconds;
+			}
+		}
+	}
+	main_timerset(te->timer,main_timeentrydelay(te));
+}
+
+void main_timeregister_name (int mode,uint32_t seconds,uint32_t offset,void (*fun)(void),const char *funname) {
+	char name[LATHIST_NAMELENG];
 	timeentry *aux;
 	if (seconds==0 || offset>=seconds) return;
 	aux = (timeentry*)malloc(sizeof(timeentry));
@@ -185,8 +584,27 @@ void main_timeregister (int mode,uint32_t seconds,uint32_t offset,void (*fun)(vo
 	aux->seconds = seconds;
 	aux->mode = mode;
 	aux->fun = fun;
-	aux->next = timehead;
-	timehead = aux;
+	snprintf(name,LATHIST_NAMELENG,"timer:%s",funname);
+	aux->hist = main_lathist(name);
+	aux->timer = main_timeradd_name(main_timeentrydelay(aux),0,main_timeentryrun,aux,NULL);	// timed in main_timeentrycall
+}
+
+/* epoll registration is persistent - interest is changed only when it really changes (e.g. EPOLLOUT is
+   needed only while data is waiting in output queue), so idle connections cost no syscalls */
+void main_epollinterest(serventry *eptr,uint32_t events) {
+	struct epoll_event ev;
+	if (eptr->epollevents==events) {
+		return;
+	}
+	eptr->epollevents = events;
+	if (epoll_fd<0) {
+		return;
+	}
+	ev.events = events;
+	ev.data.ptr = eptr;
+	if (epoll_ctl(epoll_fd,EPOLL_CTL_MOD,eptr->sock,&ev)<0) {
+		syslog(LOG_NOTICE,"epoll_ctl error: %m");
+	}
 }
 
 /* internal */
@@ -225,6 +643,10 @@ uint64_t main_utime() {
 	return usecnow;
 }
 
+uint64_t main_mtime() {
+	return msecnow;
+}
+
 void destruct() {
 	deentry *deit;
 	for (deit = dehead ; deit!=NULL ; deit=deit->next ) {
@@ -233,10 +655,8 @@ void destruct() {
 }
 
 void mainloop() {
-	struct timeval tv;
 	epollentry *epollit;
 	eloopentry *eloopit;
-	timeentry *timeit;
 	ceentry *ceit;
 	weentry *weit;
 	rlentry *rlit;
@@ -244,6 +664,7 @@ void mainloop() {
 	uint32_t ndesc;
 	int fd_num;
 	int count;
+	uint64_t t;
 	serventry *weptr;
 	epollentry *matoml_entry = NULL,*matocs_entry = NULL ;
 	epollentry *matocu_entry = NULL,*masterconn_entry = NULL,*matosla_entry = NULL;
@@ -277,18 +698,14 @@ void mainloop() {
 		terminate = 3;
 	}	
 	while (terminate!=3) {
-		tv.tv_sec=0;
-		tv.tv_usec=300000;
 		ndesc=0;
+		t = main_preciseutime();
 		for (epollit = epollhead ; epollit != NULL ; epollit = epollit->next) {
 			epollit->desc(epoll_fd);
+			t = main_handlertime(epollit->deschist,t);
 		}
-		fd_num = epoll_wait(epoll_fd,pdesc,MFSMAXFILES,50);
-		gettimeofday(&tv,NULL);
-		usecnow = tv.tv_sec;
-		usecnow *= 1000000;
-		usecnow += tv.tv_usec;
-		now = tv.tv_sec;
+		fd_num = epoll_wait(epoll_fd,pdesc,MFSMAXFILES,main_timerswait(50));
+		main_clockupdate();
 		if (fd_num<0) {
 			if (errno==EAGAIN) {
 				syslog(LOG_WARNING,"epoll returned EAGAIN");
@@ -300,52 +717,35 @@ void mainloop() {
 				break;
 			}
 		} else {
+			t = main_preciseutime();
 			for(count = 0;count < fd_num;count++)
 			{
 				weptr = (serventry*)pdesc[count].data.ptr;
 		//		syslog(LOG_ERR,"connection %d,sock %d",weptr->connection,weptr->sock);
 				if(weptr->connection==0) { 
-					matocu_entry->serve(epoll_fd,count,pdesc);
+					epollit = matocu_entry;
 				} else if (weptr->connection==1) {
-					matocs_entry->serve(epoll_fd,count,pdesc);
+					epollit = matocs_entry;
 				} else if (weptr->connection==2) {
-					matoml_entry->serve(epoll_fd,count,pdesc);
+					epollit = matoml_entry;
 				} else if (weptr->connection==3) {
-					masterconn_entry->serve(epoll_fd,count,pdesc);				
+					epollit = masterconn_entry;
 				} else if (weptr->connection==4) {
-					matosla_entry->serve(epoll_fd,count,pdesc);						
+					epollit = matosla_entry;
 				} else {
 					syslog(LOG_ERR,"unrecognized connection %d",weptr->connection);
+					continue;
 				}
+				epollit->serve(epoll_fd,count,pdesc);
+				t = main_handlertime(epollit->servehist,t);
 			}
 		}
+		t = main_preciseutime();
 		for (eloopit = eloophead ; eloopit != NULL ; eloopit = eloopit->next) {
 			eloopit->fun();
+			t = main_handlertime(eloopit->hist,t);
 		}
-		for (timeit = timehead ; timeit != NULL ; timeit = timeit->next) {
-			if (timeit->mode==TIMEMODE_RUNALL) {
-				while (now>=timeit->nextevent) {
-					timeit->nextevent += timeit->seconds;
-					timeit->fun();
-				}
-			} else if (timeit->mode==TIMEMODE_RUNONCE) {
-				if (now>=timeit->nextevent) {
-					while (now>=timeit->nextevent) {
-						timeit->nextevent += timeit->seconds;
-					}
-					timeit->fun();
-				}
-			} else { /* timeit->mode == TIMEMODE_SKIP */
-				if (now>=timeit->nextevent) {
-					if (now==timeit->nextevent) {
-						timeit->fun();
-					}
-					while (now>=timeit->nextevent) {
-						timeit->nextevent += timeit->seconds;
-					}
-				}
-			}
-		}
+		main_timersrun();
 		if (terminate==0 && reload) {
 			for (rlit = rlhead ; rlit!=NULL ; rlit=rlit->next ) {
 				rlit->fun();
@@ -371,13 +771,16 @@ void mainloop() {
 		}
 	}
 	close(epoll_fd);
+	epoll_fd = -1;
 }
 
 int initialize() {
 	uint32_t i;
 	int ok;
 	ok = 1;
-	now = time(NULL);
+	main_clockupdate();
+	wheeltime = msecnow;
+	SlowUsec = cfg_getuint32("SLOW_HANDLER_THRESHOLD",100)*1000;
 	for (i=0 ; (long int)(RunTab[i].fn)!=0 && ok ; i++) {
 		if (RunTab[i].fn(msgfd)<0) {
 			syslog(LOG_ERR,"init: %s failed !!!",RunTab[i].name);
@@ -1074,6 +1477,7 @@ int main(int argc,char **argv) {
 	}
 	free(logappname);
 	destruct();
+	main_timersterm();
 	closelog();
 	return 0;
 }
@@ -42,11 +42,39 @@ void main_destructregister (void (*fun)(void));
 void main_canexitregister (int (*fun)(void));
 void main_wantexitregister (void (*fun)(void));
 void main_reloadregister (void (*fun)(void));
-void main_epollregister (void (*desc)(int),void (*serve)(int ,int ,struct epoll_event *));
-void main_eachloopregister (void (*fun)(void));
-void main_timeregister (int mode,uint32_t seconds,uint32_t offset,void (*fun)(void));
+/* names of handlers are used by latency histograms (see below) */
+void main_epollregister_name (void (*desc)(int),void (*serve)(int ,int ,struct epoll_event *),const char *descname,const char *servename);
+#define main_epollregister(desc,serve) main_epollregister_name(desc,serve,#desc,#serve)
+void main_eachloopregister_name (void (*fun)(void),const char *funname);
+#define main_eachloopregister(fun) main_eachloopregister_name(fun,#fun)
+void main_timeregister_name (int mode,uint32_t seconds,uint32_t offset,void (*fun)(void),const char *funname);
+#define main_timeregister(mode,seconds,offset,fun) main_timeregister_name(mode,seconds,offset,fun,#fun)
 int main_time(void);
 uint64_t main_utime(void);
+uint64_t main_mtime(void);		/* monotonic clock in milliseconds */
+
+/* millisecond timers (timing wheel) - period==0 : one-shot timer, it stays allocated after it fires
+   and can be rearmed by main_timerset ; every timer has to be freed by main_timercancel (also allowed
+   inside its own callback) */
+typedef struct _main_timer main_timer;
+main_timer* main_timeradd_name(uint32_t msec,uint32_t period,void (*fun)(void*),void *arg,const char *funname);
+#define main_timeradd(msec,period,fun,arg) main_timeradd_name(msec,period,fun,arg,#fun)
+void main_timerset(main_timer *t,uint32_t msec);
+void main_timercancel(main_timer *t);
+
+/* latency histograms - every desc/serve/eachloop/timer handler called by main loop is timed ("desc:fun",
+   "serve:fun", "loop:fun", "timer:fun"), modules can add their own ; times are counted in log2 buckets
+   (bucket i : [2^i,2^(i+1)) us, bucket 0 : below 2us, last bucket : everything longer). Handlers which
+   took SLOW_HANDLER_THRESHOLD ms or more are logged. */
+#define LATHIST_BUCKETS 24
+typedef struct _lathist lathist;
+uint64_t main_preciseutime(void);	/* monotonic clock in microseconds (not cached) */
+lathist* main_lathist(const char *name);	/* finds or creates histogram */
+void main_lathistadd(lathist *h,uint64_t usec);
+uint32_t main_lathistsize(void);
+void main_lathiststore(uint8_t *buff);
+/* longest handler run since last call (us) and number of slow handler runs (monotonic) */
+void main_loopstats(uint64_t *maxusec,uint64_t *slow);
 
 enum {FREE,CONNECTING,HEADER,DATA,KILL};
 
@@ -66,10 +94,12 @@ typedef struct trans_status {
 } trans_status;
 
 typedef struct packetstruct {
-        struct packetstruct *next;
+        struct packetstruct *next;      /* has to be first (see pktbuf_append) */
         uint8_t *startptr;
         uint32_t bytesleft;
         uint8_t *packet;
+        uint32_t bufsize;               /* pktbuf: size of data buffer */
+        uint8_t bufclass;               /* pktbuf: pool of this buffer */
 } packetstruct;
 
 typedef struct filelist {
@@ -93,6 +123,7 @@ typedef struct session {
         uint32_t currentopstats[16];
         uint32_t lasthouropstats[16];
         filelist *openedfiles;
+        struct _main_timer *timer;      /* expiration of disconnected session */
         struct session *next;
 } session;
 
@@ -115,16 +146,12 @@ enum sync_step{
 	MFS_SYNC_CHANGELOG_END,
 };
 
-typedef struct chunk_helem {
-	void *chunk;
-	struct chunk_helem *next;
-} chunk_helem_t;
-
+/* chunks held by chunkserver - open addressing (linear probing) set of chunk pointers */
 typedef struct chunk_hlist {
-	uint32_t size;
+	uint32_t size;		// power of 2
 	uint32_t mask;
 	uint32_t num;
-	chunk_helem_t *elem;
+	void **elem;		// NULL - empty slot
 } chunk_hlist_t;
 
 typedef struct serventry {
@@ -147,6 +174,7 @@ typedef struct serventry {
 	file_info *cur_file;			// changelog information
 	trans_status *trans;			// changelog transfer infomation 
 	uint64_t changelog_offset;		// changelog.0 transfer offset
+	uint64_t metaversion;			// version of metadata image sent to slave - changelog sent next starts there
 	char pack_buff[MaxLogCount][1000];	
 
         int metafd;
@@ -180,8 +208,30 @@ typedef struct serventry {
         struct serventry *next;
         uint32_t syncstep;  /* master eptr with shadow and slave */
         chunk_hlist_t chunkhlist; /* master eptr with chunk server */
+        uint8_t *regbuff;               /* chunk list from register packet still being processed */
+        const uint8_t *regptr;
+        uint32_t regleft;               /* number of chunks left in regbuff */
+        uint8_t registering;            /* 1 - between REGISTER begin and end, 2 - single packet list */
+        uint8_t disconnected;           /* copies are being removed in background */
+        uint32_t wslot;                 /* position in weighted selection tree (matocsserv) */
+        uint16_t rebalsrc;              /* rebalance moves in progress from/to this server (chunks) */
+        uint16_t rebaldst;
+        uint32_t features;              /* CSFEATURE_* sent by chunkserver in register packet */
+        uint8_t *batchbuff;             /* chunk operations waiting for MATOCS_CHUNKOP_BATCH */
+        uint32_t batchcnt;
+        uint32_t batchid;
+        struct _opbatch *batchsent;     /* sent batches waiting for statuses */
+        uint32_t epollevents;           /* events currently registered in epoll */
+        uint8_t flushpending;           /* output queue got first packet - write it in next desc */
+        struct serventry *flushnext;
+        struct _ioconn *ioconn;         /* socket is owned by network i/o thread (netio) */
+        uint8_t ioclosing;              /* netio_close called - waiting for NETIO_CLOSED */
+        struct _main_timer *timer;      /* idle / keep-alive timer of connection */
+        uint8_t syncworker;             /* owned by changelog sync worker thread - its packets are plain malloc (pktbuf is main thread only) */
 } serventry;
 
+void main_epollinterest(serventry *eptr,uint32_t events);
+
 typedef struct sync_entry {
         uint8_t mode;                           //0 - not active, 1 - read header, 2 - read packet
         int sock;                               //socket number
@@ -0,0 +1,526 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#include "metastream.h"
+#include "crc.h"
+#include "datapack.h"
+
+#define CRCMAXBLOCK 0x40000000
+
+static uint64_t metastream_usec(void) {
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return (uint64_t)(tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+static uint32_t metastream_crc(uint32_t crc,const uint8_t *data,uint64_t leng) {
+	uint32_t l;
+	while (leng>0) {
+		l = (leng>CRCMAXBLOCK)?CRCMAXBLOCK:leng;
+		crc = mycrc32_combine(crc,mycrc32(0,data,l),l);
+		data+=l;
+		leng-=l;
+	}
+	return crc;
+}
+
+int metastream_compression_available(void) {
+#ifdef HAVE_ZLIB_H
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+// bytes not yet included in checksums go to the current section checksum (and to the file checksum when they are written uncompressed)
+static void metastream_crcfold(metastream *ms) {
+	uint32_t l,crc;
+	uint64_t leng;
+	const uint8_t *data;
+
+	data = ms->crcptr;
+	leng = ms->ptr-ms->crcptr;
+	while (leng>0) {
+		l = (leng>CRCMAXBLOCK)?CRCMAXBLOCK:leng;
+		crc = mycrc32(0,data,l);
+		ms->scrc = mycrc32_combine(ms->scrc,crc,l);
+		if (ms->fd>=0 && ms->level==0) {
+			ms->fcrc = mycrc32_combine(ms->fcrc,crc,l);
+		}
+		data+=l;
+		leng-=l;
+	}
+	ms->crcptr = ms->ptr;
+}
+
+static void metastream_update_progress(metastream *ms) {
+	uint64_t now;
+	metastream_progress *p = ms->progress;
+
+	if (p==NULL) {
+		return;
+	}
+	now = metastream_usec();
+	p->bytes = metastream_tell(ms);
+	p->stored = ms->fleng;
+	p->records = ms->records;
+	p->totalusec += now-ms->lastusec;
+	p->msec = (now-ms->startusec)/1000;
+	ms->lastusec = now;
+}
+
+// sleeps when more than 'bwlimit' bytes per second have been written (or read back) since the stream was opened
+static void metastream_throttle(metastream *ms,uint32_t leng) {
+	uint64_t now,due;
+
+	ms->bwbytes += leng;
+	if (ms->bwlimit==0) {
+		return;
+	}
+	due = ms->startusec+(ms->bwbytes*1000000/ms->bwlimit);
+	now = metastream_usec();
+	if (due>now) {
+		if (due-now>=1000000) {
+			sleep((due-now)/1000000);
+		}
+		usleep((due-now)%1000000);
+	}
+}
+
+static int metastream_rawwrite(metastream *ms,const uint8_t *data,uint32_t leng) {
+	ssize_t ret;
+
+	if (ms->level>0) {
+		ms->fcrc = mycrc32_combine(ms->fcrc,mycrc32(0,data,leng),leng);
+	}
+	if (leng>=METASTREAM_TAILSIZE) {
+		memcpy(ms->tail,data+leng-METASTREAM_TAILSIZE,METASTREAM_TAILSIZE);
+	} else {
+		memmove(ms->tail,ms->tail+leng,METASTREAM_TAILSIZE-leng);
+		memcpy(ms->tail+METASTREAM_TAILSIZE-leng,data,leng);
+	}
+	ms->fleng += leng;
+	if (ms->progress) {
+		ms->progress->totalbytes += leng;
+	}
+	while (leng>0) {
+		ret = write(ms->fd,data,leng);
+		if (ret<0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data+=ret;
+		leng-=ret;
+		metastream_throttle(ms,ret);
+	}
+	return 0;
+}
+
+static void metastream_flush(metastream *ms) {
+	uint32_t leng;
+#ifdef HAVE_ZLIB_H
+	uint8_t *ptr;
+	uLongf zleng;
+#endif
+
+	metastream_crcfold(ms);
+	leng = ms->ptr-ms->buff;
+	if (leng==0) {
+		return;
+	}
+	if (ms->error==0) {
+#ifdef HAVE_ZLIB_H
+		if (ms->level>0) {
+			ptr = ms->zbuff;
+			put32bit(&ptr,leng);
+			zleng = ms->zsize-8;
+			if (compress2(ms->zbuff+8,&zleng,ms->buff,leng,ms->level)!=Z_OK || zleng>=leng) {
+				put32bit(&ptr,leng);	// not compressible - stored
+				if (metastream_rawwrite(ms,ms->zbuff,8)<0 || metastream_rawwrite(ms,ms->buff,leng)<0) {
+					ms->error = 1;
+				}
+			} else {
+				put32bit(&ptr,zleng);
+				if (metastream_rawwrite(ms,ms->zbuff,8+zleng)<0) {
+					ms->error = 1;
+				}
+			}
+		} else
+#endif
+		if (metastream_rawwrite(ms,ms->buff,leng)<0) {
+			ms->error = 1;
+		}
+	}
+	ms->offset += leng;
+	ms->ptr = ms->buff;
+	ms->crcptr = ms->buff;
+	metastream_update_progress(ms);
+}
+
+// fd<0 - memory stream (buffer grows, returned by metastream_close) ; verify - read whole file back on close (otherwise only its size and last bytes are checked)
+metastream* metastream_open(int fd,uint8_t level,uint64_t bwlimit,uint8_t verify,metastream_progress *progress) {
+	metastream *ms;
+	void *buff;
+
+	ms = (metastream*)malloc(sizeof(metastream));
+	if (ms==NULL) {
+		return NULL;
+	}
+	memset(ms,0,sizeof(metastream));
+	if (fd<0) {
+		buff = malloc(METASTREAM_BUFFSIZE);
+		level = 0;
+		bwlimit = 0;
+		verify = 0;
+	} else if (posix_memalign(&buff,4096,METASTREAM_BUFFSIZE)!=0) {
+		buff = NULL;
+	}
+	if (buff==NULL) {
+		free(ms);
+		return NULL;
+	}
+	if (metastream_compression_available()==0) {
+		level = 0;
+	}
+	if (level>9) {
+		level = 9;
+	}
+	ms->buff = buff;
+	ms->ptr = buff;
+	ms->crcptr = buff;
+	ms->end = ms->buff+METASTREAM_BUFFSIZE;
+	ms->fd = fd;
+	ms->level = level;
+	ms->bwlimit = bwlimit;
+	ms->verify = verify;
+	ms->progress = progress;
+	ms->startusec = metastream_usec();
+	ms->lastusec = ms->startusec;
+#ifdef HAVE_ZLIB_H
+	if (level>0) {
+		ms->zsize = 8+compressBound(METASTREAM_BUFFSIZE);
+		ms->zbuff = malloc(ms->zsize);
+		if (ms->zbuff==NULL) {
+			free(ms->buff);
+			free(ms);
+			return NULL;
+		}
+		if (metastream_rawwrite(ms,(const uint8_t*)"MFSZ 2.0",8)<0) {
+			ms->error = 1;
+		}
+	}
+#endif
+	if (progress) {
+		progress->bytes = 0;
+		progress->stored = 0;
+		progress->records = 0;
+		progress->msec = 0;
+		progress->starttime = ms->startusec/1000000;
+	}
+	return ms;
+}
+
+void metastream_write_slow(metastream *ms,const void *data,uint32_t leng) {
+	const uint8_t *src = (const uint8_t*)data;
+	uint64_t size;
+	uint32_t l;
+	uint8_t *buff;
+
+	if (ms->fd<0) {
+		size = ms->end-ms->buff;
+		while (size-(ms->ptr-ms->buff)<leng) {
+			size*=2;
+		}
+		buff = realloc(ms->buff,size);
+		if (buff==NULL) {
+			ms->error = 1;
+			return;
+		}
+		ms->ptr = buff+(ms->ptr-ms->buff);
+		ms->crcptr = buff+(ms->crcptr-ms->buff);
+		ms->buff = buff;
+		ms->end = buff+size;
+		memcpy(ms->ptr,src,leng);
+		ms->ptr+=leng;
+		return;
+	}
+	while (leng>0) {
+		if (ms->ptr==ms->end) {
+			metastream_flush(ms);
+		}
+		l = ms->end-ms->ptr;
+		if (l>leng) {
+			l = leng;
+		}
+		memcpy(ms->ptr,src,l);
+		ms->ptr+=l;
+		src+=l;
+		leng-=l;
+	}
+}
+
+void metastream_section_begin(metastream *ms) {
+	metastream_crcfold(ms);
+	ms->scrc = 0;
+}
+
+uint32_t metastream_section_crc(metastream *ms) {
+	metastream_crcfold(ms);
+	return ms->scrc;
+}
+
+// checks file size and last bytes of file (trailer with checksum of compressed file) after fsync
+static int metastream_checktail(metastream *ms) {
+	uint8_t buff[METASTREAM_TAILSIZE];
+	struct stat st;
+	uint32_t l;
+
+	if (fstat(ms->fd,&st)<0 || (uint64_t)(st.st_size)!=ms->fleng) {
+		return -1;
+	}
+	l = (ms->fleng>METASTREAM_TAILSIZE)?METASTREAM_TAILSIZE:ms->fleng;
+	if (l>0 && (pread(ms->fd,buff,l,ms->fleng-l)!=(ssize_t)l || memcmp(buff,ms->tail+METASTREAM_TAILSIZE-l,l)!=0)) {
+		return -1;
+	}
+	return 0;
+}
+
+// reads the whole file back (bypassing page cache when possible) and compares its checksum with the one calculated while writing
+static int metastream_verify(metastream *ms,uint64_t leng,uint32_t crc) {
+	uint64_t pos;
+	uint32_t l,rcrc;
+	ssize_t ret;
+
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(ms->fd,0,0,POSIX_FADV_DONTNEED);
+#endif
+	rcrc = 0;
+	for (pos=0 ; pos<leng ; pos+=l) {
+		l = (leng-pos>METASTREAM_BUFFSIZE)?METASTREAM_BUFFSIZE:(leng-pos);
+		ret = pread(ms->fd,ms->buff,l,pos);
+		if (ret!=(ssize_t)l) {
+			return -1;
+		}
+		rcrc = mycrc32_combine(rcrc,mycrc32(0,ms->buff,l),l);
+		metastream_throttle(ms,l);
+	}
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(ms->fd,0,0,POSIX_FADV_DONTNEED);
+#endif
+	return (rcrc==crc)?0:-1;
+}
+
+static void metastream_free(metastream *ms) {
+	if (ms->buff) {
+		free(ms->buff);
+	}
+	if (ms->zbuff) {
+		free(ms->zbuff);
+	}
+	free(ms);
+}
+
+/* file stream: flushes buffer, writes trailer (compressed stream), fsyncs and checks file (whole file when opened with 'verify') - returns 0 (ok), -1 (write error) or -2 (checksum mismatch) ; fd is not closed
+   memory stream: returns buffer (to be freed by caller) in rbuff/rleng */
+int metastream_close(metastream *ms,uint8_t **rbuff,uint64_t *rleng) {
+	uint8_t trailer[8+METASTREAM_ZTRAILERSIZE],*ptr;
+	uint64_t vleng;
+	uint32_t vcrc;
+	int ret;
+
+	if (ms->fd<0) {
+		ret = ms->error?-1:0;
+		if (ret==0 && rbuff && rleng) {
+			*rbuff = ms->buff;
+			*rleng = ms->ptr-ms->buff;
+			ms->buff = NULL;
+		}
+		metastream_free(ms);
+		return ret;
+	}
+	metastream_flush(ms);
+	if (ms->level>0 && ms->error==0) {
+		ptr = trailer;
+		put32bit(&ptr,0);
+		put32bit(&ptr,0);
+		put64bit(&ptr,ms->offset);
+		if (metastream_rawwrite(ms,trailer,16)<0) {
+			ms->error = 1;
+		}
+		vleng = ms->fleng;
+		vcrc = ms->fcrc;
+		put32bit(&ptr,vcrc);
+		memcpy(ptr,"MFSZ END",8);
+		if (ms->error==0 && metastream_rawwrite(ms,trailer+16,12)<0) {
+			ms->error = 1;
+		}
+	} else {
+		vleng = ms->fleng;
+		vcrc = ms->fcrc;
+	}
+	ret = 0;
+	if (ms->error || fsync(ms->fd)<0) {
+		ret = -1;
+	} else if (metastream_checktail(ms)<0) {
+		ret = -2;
+	} else if (ms->verify && metastream_verify(ms,vleng,vcrc)<0) {
+		ret = -2;
+	}
+	metastream_update_progress(ms);
+	metastream_free(ms);
+	return ret;
+}
+
+void metastream_abort(metastream *ms) {
+	metastream_free(ms);
+}
+
+int metastream_iscompressed(const uint8_t *hdr) {
+	return (memcmp(hdr,"MFSZ 2.0",8)==0)?1:0;
+}
+
+// decompresses whole "MFSZ 2.0" file - returns 0 and malloc'ed image or -1 (bad checksum, bad frame or no zlib support)
+int metastream_inflate(const uint8_t *data,uint64_t leng,uint8_t **rbuff,uint64_t *rleng) {
+#ifdef HAVE_ZLIB_H
+	const uint8_t *ptr,*tptr;
+	uint8_t *buff;
+	uint64_t imageleng,pos;
+	uint32_t rawleng,zleng;
+	uLongf dleng;
+
+	if (leng<8+8+METASTREAM_ZTRAILERSIZE || metastream_iscompressed(data)==0 || memcmp(data+leng-8,"MFSZ END",8)!=0) {
+		return -1;
+	}
+	tptr = data+leng-METASTREAM_ZTRAILERSIZE;
+	imageleng = get64bit(&tptr);
+	if (metastream_crc(0,data,leng-12)!=get32bit(&tptr)) {
+		return -1;
+	}
+	buff = malloc(imageleng>0?imageleng:1);
+	if (buff==NULL) {
+		return -1;
+	}
+	ptr = data+8;
+	pos = 0;
+	for (;;) {
+		if (ptr+8>data+leng-METASTREAM_ZTRAILERSIZE) {
+			break;
+		}
+		rawleng = get32bit(&ptr);
+		zleng = get32bit(&ptr);
+		if (rawleng==0) {
+			if (pos==imageleng && ptr==data+leng-METASTREAM_ZTRAILERSIZE) {
+				*rbuff = buff;
+				*rleng = imageleng;
+				return 0;
+			}
+			break;
+		}
+		if (zleng>(uint64_t)(data+leng-METASTREAM_ZTRAILERSIZE-ptr) || rawleng>imageleng-pos) {
+			break;
+		}
+		if (zleng==rawleng) {
+			memcpy(buff+pos,ptr,rawleng);
+		} else {
+			dleng = rawleng;
+			if (uncompress(buff+pos,&dleng,ptr,zleng)!=Z_OK || dleng!=rawleng) {
+				break;
+			}
+		}
+		ptr+=zleng;
+		pos+=rawleng;
+	}
+	free(buff);
+#else
+	(void)data;
+	(void)leng;
+	(void)rbuff;
+	(void)rleng;
+#endif
+	return -1;
+}
+
+// reads first 'leng' bytes of image (from plain or compressed file) - returns 0 or -1
+int metastream_readhead(int fd,uint8_t *buff,uint32_t leng) {
+	uint8_t fhdr[16];
+#ifdef HAVE_ZLIB_H
+	const uint8_t *ptr;
+	uint32_t zleng,rawleng;
+	uint8_t *zbuff;
+	z_stream zs;
+	int ret;
+#endif
+
+	if (pread(fd,fhdr,16,0)!=16) {
+		return -1;
+	}
+	if (metastream_iscompressed(fhdr)==0) {
+		return (pread(fd,buff,leng,0)==(ssize_t)leng)?0:-1;
+	}
+#ifdef HAVE_ZLIB_H
+	ptr = fhdr+8;
+	rawleng = get32bit(&ptr);
+	zleng = get32bit(&ptr);
+	if (rawleng<leng || zleng>rawleng || zleng>compressBound(METASTREAM_BUFFSIZE)) {
+		return -1;
+	}
+	if (zleng==rawleng) {	// stored frame
+		return (pread(fd,buff,leng,16)==(ssize_t)leng)?0:-1;
+	}
+	zbuff = malloc(zleng);
+	if (zbuff==NULL) {
+		return -1;
+	}
+	ret = -1;
+	if (pread(fd,zbuff,zleng,16)==(ssize_t)zleng) {
+		memset(&zs,0,sizeof(z_stream));
+		if (inflateInit(&zs)==Z_OK) {
+			zs.next_in = zbuff;
+			zs.avail_in = zleng;
+			zs.next_out = buff;
+			zs.avail_out = leng;
+			inflate(&zs,Z_SYNC_FLUSH);
+			if (zs.avail_out==0) {
+				ret = 0;
+			}
+			inflateEnd(&zs);
+		}
+	}
+	free(zbuff);
+	return ret;
+#else
+	return -1;
+#endif
+}
@@ -0,0 +1,102 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _METASTREAM_H_
+#define _METASTREAM_H_
+
+#include <inttypes.h>
+#include <string.h>
+
+/* metadata image writer - collects records in a big aligned buffer, keeps running checksum of the current section
+   and of the whole file, optionally compresses buffers (zlib) and limits disk bandwidth
+
+   compressed file ("MFSZ 2.0"): signature , frames: [ rawleng:32 zleng:32 data ] (zleng==rawleng - stored) , empty frame (0,0) ,
+   trailer: imageleng:64 crc:32 (of all preceding bytes) "MFSZ END" ; frames decompressed one after another give the original image */
+
+#define METASTREAM_BUFFSIZE 0x400000
+#define METASTREAM_ZTRAILERSIZE (8+4+8)
+#define METASTREAM_TAILSIZE 32
+
+// shared with processes/threads doing the store - monotonic 'total' counters are used for charts
+typedef struct _metastream_progress {
+	volatile uint64_t bytes;	// image bytes written by the current (or last) store
+	volatile uint64_t stored;	// bytes written to disk by the current (or last) store
+	volatile uint64_t records;
+	volatile uint64_t totalbytes;	// bytes written to disk by all stores
+	volatile uint64_t totalusec;	// time spent in all stores
+	volatile uint32_t starttime;
+	volatile uint32_t msec;	// duration of the current (or last) store
+	volatile uint8_t status;	// owned by caller
+	volatile uint8_t laststatus;	// owned by caller
+} metastream_progress;
+
+typedef struct _metastream {
+	uint8_t *buff,*ptr,*end;
+	uint8_t *crcptr;	// first byte not included in checksums yet
+	uint64_t offset;	// image offset of buff[0]
+	uint64_t fleng;	// bytes written to file
+	uint64_t records;
+	uint64_t bwlimit;	// bytes per second (0 - unlimited)
+	uint64_t bwbytes;	// bytes counted for bandwidth limit
+	uint64_t startusec,lastusec;
+	uint8_t *zbuff;
+	uint32_t zsize;
+	uint32_t scrc;	// current section
+	uint32_t fcrc;	// whole file
+	int fd;	// -1 - memory stream
+	uint8_t level;	// compression level (0 - none)
+	uint8_t verify;	// read whole file back on close
+	uint8_t error;
+	uint8_t tail[METASTREAM_TAILSIZE];	// last bytes written to file (compared with file after fsync)
+	metastream_progress *progress;
+} metastream;
+
+int metastream_compression_available(void);
+metastream* metastream_open(int fd,uint8_t level,uint64_t bwlimit,uint8_t verify,metastream_progress *progress);
+void metastream_write_slow(metastream *ms,const void *data,uint32_t leng);
+void metastream_section_begin(metastream *ms);
+uint32_t metastream_section_crc(metastream *ms);
+int metastream_close(metastream *ms,uint8_t **rbuff,uint64_t *rleng);
+void metastream_abort(metastream *ms);
+
+int metastream_iscompressed(const uint8_t *hdr);
+int metastream_inflate(const uint8_t *data,uint64_t leng,uint8_t **rbuff,uint64_t *rleng);
+int metastream_readhead(int fd,uint8_t *buff,uint32_t leng);
+
+static inline void metastream_write(metastream *ms,const void *data,uint32_t leng) {
+	if (leng<=(uint32_t)(ms->end-ms->ptr)) {
+		memcpy(ms->ptr,data,leng);
+		ms->ptr+=leng;
+	} else {
+		metastream_write_slow(ms,data,leng);
+	}
+}
+
+static inline uint64_t metastream_tell(metastream *ms) {
+	return ms->offset+(ms->ptr-ms->buff);
+}
+
+static inline void metastream_record(metastream *ms) {
+	ms->records++;
+}
+
+static inline int metastream_error(metastream *ms) {
+	return ms->error;
+}
+
+#endif
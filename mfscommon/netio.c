@@ -0,0 +1,702 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "netio.h"
+#include "pktbuf.h"
+#include "datapack.h"
+
+#define NETIO_RINGSIZE 16384
+#define NETIO_RINGMASK (NETIO_RINGSIZE-1)
+#define NETIO_MAXEVENTS 256
+#define NETIO_RECEIVE_LIMIT 4096	// messages handled by main thread in one netio_receive call
+#define NETIO_RBUFFSIZE 65536	// sockets are read in big chunks and cut into packets here
+
+/* commands for i/o thread */
+#define IO_ATTACH 1
+#define IO_SEND 2
+#define IO_CLOSE 3
+
+/* internal message for main thread - written buffers (pktbuf pools belong to main thread) */
+#define NETIO_SENT 0x10
+
+typedef struct _netmsg {
+	uint8_t cmd;
+	serventry *eptr;
+	struct _ioconn *conn;
+	packetstruct *chain;	// IO_SEND , NETIO_SENT
+	uint8_t *data;		// NETIO_PACKET
+	uint32_t type;
+	uint32_t leng;
+} netmsg;
+
+/* single producer / single consumer - head is moved only by consumer, tail only by producer */
+typedef struct _netring {
+	uint32_t head;
+	uint8_t pad1[60];
+	uint32_t tail;
+	uint8_t pad2[60];
+	netmsg msg[NETIO_RINGSIZE];
+} netring;
+
+typedef struct _iothread {
+	pthread_t tid;
+	int epfd;
+	int wakefd;
+	netring *in;		// main -> thread
+	netring *out;		// thread -> main
+	uint8_t pushed;		// main: something was pushed since last wakeup
+	uint8_t reported;	// thread: something was reported since last main wakeup
+	netmsg *ovf;		// thread: messages which didn't fit into 'out' ring
+	uint32_t ovfcnt,ovfsize;
+	struct _ioconn *conns;	// thread: attached connections
+	uint8_t *rbuff;
+	packetstruct *donehead,**donetail;	// thread: buffers to give back to main thread
+} iothread;
+
+/* created by main thread in netio_attach, then used only by its i/o thread ('thr' is never changed) */
+typedef struct _ioconn {
+	serventry *eptr;
+	int sock;
+	iothread *thr;
+	uint8_t broken;
+	uint8_t mode;
+	uint32_t events;
+	uint8_t hdrbuff[8];
+	uint8_t *packet;
+	uint8_t *startptr;
+	uint32_t bytesleft;
+	packetstruct *outhead,**outtail;
+	struct _ioconn *next,**prev;
+} ioconn;
+
+static iothread *iothreads = NULL;
+static uint32_t iothreadscnt = 0;
+static uint32_t nextthread = 0;
+static uint32_t maxpacket;
+static int mainwakefd = -1;
+static uint32_t stopthreads;
+static uint64_t pendingpackets;	// buffers passed to threads and not given back yet (main thread only)
+
+static int netio_ring_push(netring *r,const netmsg *m) {
+	uint32_t t = r->tail;
+	if (t - __atomic_load_n(&(r->head),__ATOMIC_ACQUIRE) >= NETIO_RINGSIZE) {
+		return -1;
+	}
+	r->msg[t & NETIO_RINGMASK] = *m;
+	__atomic_store_n(&(r->tail),t+1,__ATOMIC_RELEASE);
+	return 0;
+}
+
+static int netio_ring_pop(netring *r,netmsg *m) {
+	uint32_t h = r->head;
+	if (h == __atomic_load_n(&(r->tail),__ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+	*m = r->msg[h & NETIO_RINGMASK];
+	__atomic_store_n(&(r->head),h+1,__ATOMIC_RELEASE);
+	return 0;
+}
+
+static inline int netio_ring_empty(netring *r) {
+	return (r->head == __atomic_load_n(&(r->tail),__ATOMIC_ACQUIRE))?1:0;
+}
+
+static inline void netio_signal(int fd) {
+	uint64_t one = 1;
+	if (write(fd,&one,8)!=8) {	// counter overflow (EAGAIN) means fd is readable anyway
+		return;
+	}
+}
+
+static inline void netio_drainfd(int fd) {
+	uint64_t cnt;
+	if (read(fd,&cnt,8)!=8) {
+		return;
+	}
+}
+
+/* i/o thread part */
+
+static void netio_freechain(iothread *thr,packetstruct *pptr) {
+	if (pptr==NULL) {
+		return;
+	}
+	*(thr->donetail) = pptr;
+	while (pptr->next) {
+		pptr = pptr->next;
+	}
+	thr->donetail = &(pptr->next);
+}
+
+static void netio_push_out(iothread *thr,netmsg *m);
+
+static void netio_report(iothread *thr,uint8_t cmd,ioconn *conn,uint32_t type,uint8_t *data,uint32_t leng) {
+	netmsg m;
+	m.cmd = cmd;
+	m.eptr = conn->eptr;
+	m.conn = NULL;
+	m.chain = NULL;
+	m.data = data;
+	m.type = type;
+	m.leng = leng;
+	netio_push_out(thr,&m);
+}
+
+static void netio_reportsent(iothread *thr) {
+	netmsg m;
+	if (thr->donehead==NULL) {
+		return;
+	}
+	memset(&m,0,sizeof(netmsg));
+	m.cmd = NETIO_SENT;
+	m.chain = thr->donehead;
+	thr->donehead = NULL;
+	thr->donetail = &(thr->donehead);
+	netio_push_out(thr,&m);
+}
+
+static void netio_push_out(iothread *thr,netmsg *m) {
+	if (thr->ovfcnt==0 && netio_ring_push(thr->out,m)==0) {
+		thr->reported = 1;
+		return;
+	}
+	// main thread is busy - keep messages here (in order) and stop reading until it catches up
+	if (thr->ovfcnt==thr->ovfsize) {
+		thr->ovfsize = thr->ovfsize?thr->ovfsize*2:1024;
+		thr->ovf = realloc(thr->ovf,sizeof(netmsg)*thr->ovfsize);
+	}
+	thr->ovf[thr->ovfcnt++] = *m;
+}
+
+static void netio_ovfflush(iothread *thr) {
+	uint32_t i;
+	for (i=0 ; i<thr->ovfcnt ; i++) {
+		if (netio_ring_push(thr->out,thr->ovf+i)<0) {
+			break;
+		}
+		thr->reported = 1;
+	}
+	if (i>0) {
+		memmove(thr->ovf,thr->ovf+i,sizeof(netmsg)*(thr->ovfcnt-i));
+		thr->ovfcnt -= i;
+	}
+}
+
+static void netio_setevents(ioconn *conn,uint32_t events) {
+	struct epoll_event ev;
+	if (conn->events==events) {
+		return;
+	}
+	conn->events = events;
+	ev.data.ptr = conn;
+	ev.events = events;
+	epoll_ctl(conn->thr->epfd,EPOLL_CTL_MOD,conn->sock,&ev);
+}
+
+static void netio_error(ioconn *conn,int err,uint32_t leng) {
+	struct epoll_event ev;
+	if (conn->broken) {
+		return;
+	}
+	conn->broken = 1;
+	ev.data.ptr = conn;
+	ev.events = 0;
+	epoll_ctl(conn->thr->epfd,EPOLL_CTL_DEL,conn->sock,&ev);
+	netio_freechain(conn->thr,conn->outhead);
+	conn->outhead = NULL;
+	conn->outtail = &(conn->outhead);
+	netio_report(conn->thr,NETIO_ERROR,conn,err,NULL,leng);
+}
+
+/* current part (header or data) is complete - returns -1 when connection is broken */
+static int netio_gotpart(ioconn *conn) {
+	uint32_t type,size;
+	const uint8_t *ptr;
+
+	if (conn->mode==HEADER) {
+		ptr = conn->hdrbuff+4;
+		size = get32bit(&ptr);
+
+		if (size>0) {
+			if (size>maxpacket) {
+				netio_error(conn,EMSGSIZE,size);
+				return -1;
+			}
+			conn->packet = malloc(size);
+			if (conn->packet==NULL) {
+				netio_error(conn,ENOMEM,size);
+				return -1;
+			}
+			conn->bytesleft = size;
+			conn->startptr = conn->packet;
+			conn->mode = DATA;
+			return 0;
+		}
+	}
+
+	ptr = conn->hdrbuff;
+	type = get32bit(&ptr);
+	size = get32bit(&ptr);
+
+	conn->mode = HEADER;
+	conn->bytesleft = 8;
+	conn->startptr = conn->hdrbuff;
+
+	netio_report(conn->thr,NETIO_PACKET,conn,type,conn->packet,size);
+	conn->packet = NULL;
+	return 0;
+}
+
+static void netio_read(ioconn *conn) {
+	int32_t i;
+	uint32_t n;
+	uint8_t *rptr;
+
+	for (;;) {
+		if (conn->mode==DATA && conn->bytesleft>=NETIO_RBUFFSIZE) {	// big packet - read it directly
+			i=read(conn->sock,conn->startptr,conn->bytesleft);
+			rptr = NULL;
+		} else {
+			i=read(conn->sock,conn->thr->rbuff,NETIO_RBUFFSIZE);
+			rptr = conn->thr->rbuff;
+		}
+		if (i==0) {
+			netio_error(conn,0,0);
+			return;
+		}
+		if (i<0) {
+			if (errno!=EAGAIN) {
+				netio_error(conn,errno,0);
+			}
+			return;
+		}
+		if (rptr==NULL) {
+			conn->startptr+=i;
+			conn->bytesleft-=i;
+			if (conn->bytesleft>0) {
+				return;
+			}
+			if (netio_gotpart(conn)<0) {
+				return;
+			}
+			continue;
+		}
+		n = i;
+		while (n>0) {
+			i = (n<conn->bytesleft)?n:conn->bytesleft;
+			memcpy(conn->startptr,rptr,i);
+			conn->startptr+=i;
+			conn->bytesleft-=i;
+			rptr+=i;
+			n-=i;
+			if (conn->bytesleft==0 && netio_gotpart(conn)<0) {
+				return;
+			}
+		}
+		if (rptr < conn->thr->rbuff+NETIO_RBUFFSIZE) {	// socket buffer is empty
+			return;
+		}
+	}
+}
+
+static void netio_write(ioconn *conn) {
+	int r;
+	r = pktbuf_writev(conn->sock,&(conn->outhead),&(conn->outtail),&(conn->thr->donetail));
+	if (r<0) {
+		netio_error(conn,errno,0);
+	} else {
+		netio_setevents(conn,r?EPOLLIN:(EPOLLIN|EPOLLOUT));
+	}
+}
+
+static void netio_command(iothread *thr,netmsg *m) {
+	ioconn *conn = m->conn;
+	struct epoll_event ev;
+
+	switch (m->cmd) {
+	case IO_ATTACH:
+		conn->next = thr->conns;
+		if (conn->next) {
+			conn->next->prev = &(conn->next);
+		}
+		conn->prev = &(thr->conns);
+		thr->conns = conn;
+		ev.data.ptr = conn;
+		ev.events = EPOLLIN;
+		if (epoll_ctl(thr->epfd,EPOLL_CTL_ADD,conn->sock,&ev)<0) {
+			netio_error(conn,errno,0);
+		}
+		break;
+	case IO_SEND:
+		if (conn->broken) {
+			netio_freechain(thr,m->chain);
+			break;
+		}
+		*(conn->outtail) = m->chain;
+		while (*(conn->outtail)) {
+			conn->outtail = &((*(conn->outtail))->next);
+		}
+		if ((conn->events & EPOLLOUT)==0) {	// otherwise socket buffer is full - wait for EPOLLOUT
+			netio_write(conn);
+		}
+		break;
+	case IO_CLOSE:
+		if (conn->broken==0) {
+			ev.data.ptr = conn;
+			ev.events = 0;
+			epoll_ctl(thr->epfd,EPOLL_CTL_DEL,conn->sock,&ev);
+		}
+		close(conn->sock);
+		if (conn->packet) {
+			free(conn->packet);
+		}
+		netio_freechain(thr,conn->outhead);
+		*(conn->prev) = conn->next;
+		if (conn->next) {
+			conn->next->prev = conn->prev;
+		}
+		netio_report(thr,NETIO_CLOSED,conn,0,NULL,0);
+		free(conn);
+		break;
+	}
+}
+
+static void* netio_thread(void *arg) {
+	iothread *thr = (iothread*)arg;
+	struct epoll_event ev[NETIO_MAXEVENTS];
+	ioconn *conn;
+	netmsg m;
+	int i,n;
+
+	while (__atomic_load_n(&stopthreads,__ATOMIC_ACQUIRE)==0) {
+		if (thr->ovfcnt>0) {
+			netio_ovfflush(thr);
+		}
+		if (thr->ovfcnt>0) {
+			netio_signal(mainwakefd);
+			thr->reported = 0;
+			usleep(1000);
+		} else {
+			n = epoll_wait(thr->epfd,ev,NETIO_MAXEVENTS,1000);
+			for (i=0 ; i<n ; i++) {
+				conn = (ioconn*)ev[i].data.ptr;
+				if (conn==NULL) {
+					netio_drainfd(thr->wakefd);
+					continue;
+				}
+				if (conn->broken) {
+					continue;
+				}
+				if (ev[i].events & (EPOLLERR|EPOLLHUP)) {
+					netio_error(conn,0,0);
+					continue;
+				}
+				if (ev[i].events & EPOLLIN) {
+					netio_read(conn);
+				}
+				if ((ev[i].events & EPOLLOUT) && conn->broken==0) {
+					netio_write(conn);
+				}
+			}
+		}
+		while (netio_ring_pop(thr->in,&m)==0) {
+			netio_command(thr,&m);
+		}
+		netio_reportsent(thr);
+		if (thr->reported) {
+			thr->reported = 0;
+			netio_signal(mainwakefd);
+		}
+	}
+	return NULL;
+}
+
+/* main thread part */
+
+static void netio_givenback(packetstruct *pptr) {
+	packetstruct *paptr;
+	while (pptr) {
+		paptr = pptr;
+		pptr = pptr->next;
+		pktbuf_free(paptr);
+		pendingpackets--;
+	}
+}
+
+static void netio_push(iothread *thr,const netmsg *m) {
+	while (netio_ring_push(thr->in,m)<0) {
+		netio_signal(thr->wakefd);
+		sched_yield();
+	}
+	thr->pushed = 1;
+}
+
+uint32_t netio_threads(void) {
+	return iothreadscnt;
+}
+
+void netio_attach(serventry *eptr) {
+	iothread *thr;
+	ioconn *conn;
+	netmsg m;
+
+	thr = iothreads + (nextthread++ % iothreadscnt);
+	conn = (ioconn*)malloc(sizeof(ioconn));
+	conn->eptr = eptr;
+	conn->sock = eptr->sock;
+	conn->thr = thr;
+	conn->broken = 0;
+	conn->mode = HEADER;
+	conn->events = EPOLLIN;
+	conn->packet = NULL;
+	conn->startptr = conn->hdrbuff;
+	conn->bytesleft = 8;
+	conn->outhead = NULL;
+	conn->outtail = &(conn->outhead);
+	conn->next = NULL;
+	conn->prev = NULL;
+	eptr->ioconn = conn;
+
+	memset(&m,0,sizeof(netmsg));
+	m.cmd = IO_ATTACH;
+	m.eptr = eptr;
+	m.conn = conn;
+	netio_push(thr,&m);
+}
+
+void netio_send(serventry *eptr) {
+	packetstruct *pptr;
+	uint32_t cnt;
+	netmsg m;
+
+	if (eptr->outputhead==NULL) {
+		return;
+	}
+	cnt = 0;
+	for (pptr=eptr->outputhead ; pptr ; pptr=pptr->next) {
+		cnt++;
+	}
+	pendingpackets += cnt;
+	memset(&m,0,sizeof(netmsg));
+	m.cmd = IO_SEND;
+	m.eptr = eptr;
+	m.conn = eptr->ioconn;
+	m.chain = eptr->outputhead;
+	netio_push(eptr->ioconn->thr,&m);
+	eptr->outputhead = NULL;
+	eptr->outputtail = &(eptr->outputhead);
+}
+
+void netio_close(serventry *eptr) {
+	netmsg m;
+	memset(&m,0,sizeof(netmsg));
+	m.cmd = IO_CLOSE;
+	m.eptr = eptr;
+	m.conn = eptr->ioconn;
+	netio_push(eptr->ioconn->thr,&m);
+}
+
+void netio_wakeup(void) {
+	uint32_t i;
+	for (i=0 ; i<iothreadscnt ; i++) {
+		if (iothreads[i].pushed) {
+			iothreads[i].pushed = 0;
+			netio_signal(iothreads[i].wakefd);
+		}
+	}
+}
+
+uint32_t netio_receive(void (*fun)(serventry *eptr,uint8_t cmd,uint32_t type,uint8_t *data,uint32_t leng)) {
+	uint32_t i,cnt,left;
+	netmsg m;
+
+	netio_drainfd(mainwakefd);
+	cnt = 0;
+	left = 0;
+	for (i=0 ; i<iothreadscnt ; i++) {
+		while (cnt<NETIO_RECEIVE_LIMIT && netio_ring_pop(iothreads[i].out,&m)==0) {
+			if (m.cmd==NETIO_SENT) {
+				netio_givenback(m.chain);
+			} else {
+				fun(m.eptr,m.cmd,m.type,m.data,m.leng);
+			}
+			cnt++;
+		}
+		if (netio_ring_empty(iothreads[i].out)==0) {
+			left = 1;
+		}
+	}
+	if (left) {	// rest in next loop - don't starve other modules
+		netio_signal(mainwakefd);
+	}
+	return cnt;
+}
+
+int netio_idle(void) {
+	return (pendingpackets==0)?1:0;
+}
+
+void netio_term(void) {
+	uint32_t i,j;
+	iothread *thr;
+	ioconn *conn;
+	netmsg m;
+
+	if (iothreadscnt==0) {
+		return;
+	}
+	__atomic_store_n(&stopthreads,1,__ATOMIC_RELEASE);
+	for (i=0 ; i<iothreadscnt ; i++) {
+		netio_signal(iothreads[i].wakefd);
+	}
+	for (i=0 ; i<iothreadscnt ; i++) {
+		pthread_join(iothreads[i].tid,NULL);
+	}
+	// threads are stopped - everything belongs to main thread now
+	for (i=0 ; i<iothreadscnt ; i++) {
+		thr = iothreads+i;
+		while (netio_ring_pop(thr->in,&m)==0) {
+			if (m.cmd==IO_ATTACH) {	// not attached yet - just close it
+				close(m.conn->sock);
+				free(m.conn);
+			} else if (m.cmd==IO_SEND) {
+				netio_givenback(m.chain);
+			}
+		}
+		while ((conn=thr->conns)!=NULL) {
+			thr->conns = conn->next;
+			close(conn->sock);
+			if (conn->packet) {
+				free(conn->packet);
+			}
+			netio_givenback(conn->outhead);
+			free(conn);
+		}
+		netio_givenback(thr->donehead);
+		while (netio_ring_pop(thr->out,&m)==0) {
+			if (m.data) {
+				free(m.data);
+			}
+			netio_givenback(m.chain);
+		}
+		for (j=0 ; j<thr->ovfcnt ; j++) {
+			if (thr->ovf[j].data) {
+				free(thr->ovf[j].data);
+			}
+			netio_givenback(thr->ovf[j].chain);
+		}
+		free(thr->ovf);
+		close(thr->epfd);
+		close(thr->wakefd);
+		free(thr->in);
+		free(thr->out);
+		free(thr->rbuff);
+	}
+	free(iothreads);
+	iothreads = NULL;
+	iothreadscnt = 0;
+	close(mainwakefd);
+	mainwakefd = -1;
+}
+
+int netio_init(uint32_t threads,uint32_t maxpacketsize) {
+	uint32_t i;
+	iothread *thr;
+	struct epoll_event ev;
+	sigset_t newset,oldset;
+
+	maxpacket = maxpacketsize;
+	stopthreads = 0;
+	pendingpackets = 0;
+	nextthread = 0;
+	mainwakefd = eventfd(0,EFD_NONBLOCK);
+	if (mainwakefd<0) {
+		return -1;
+	}
+	iothreads = (iothread*)malloc(sizeof(iothread)*threads);
+	if (iothreads==NULL) {
+		close(mainwakefd);
+		mainwakefd = -1;
+		return -1;
+	}
+	// i/o threads don't handle signals
+	sigfillset(&newset);
+	pthread_sigmask(SIG_BLOCK,&newset,&oldset);
+	for (i=0 ; i<threads ; i++) {
+		thr = iothreads+i;
+		memset(thr,0,sizeof(iothread));
+		thr->donetail = &(thr->donehead);
+		thr->epfd = epoll_create(1024);
+		thr->wakefd = eventfd(0,EFD_NONBLOCK);
+		thr->in = (netring*)malloc(sizeof(netring));
+		thr->out = (netring*)malloc(sizeof(netring));
+		thr->rbuff = (uint8_t*)malloc(NETIO_RBUFFSIZE);
+		if (thr->epfd<0 || thr->wakefd<0 || thr->in==NULL || thr->out==NULL || thr->rbuff==NULL) {
+			break;
+		}
+		thr->in->head = thr->in->tail = 0;
+		thr->out->head = thr->out->tail = 0;
+		ev.data.ptr = NULL;
+		ev.events = EPOLLIN;
+		if (epoll_ctl(thr->epfd,EPOLL_CTL_ADD,thr->wakefd,&ev)<0) {
+			break;
+		}
+		if (pthread_create(&(thr->tid),NULL,netio_thread,thr)!=0) {
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK,&oldset,NULL);
+	if (i<threads) {	// stop threads which have been started and clean up
+		thr = iothreads+i;
+		if (thr->epfd>=0) {
+			close(thr->epfd);
+		}
+		if (thr->wakefd>=0) {
+			close(thr->wakefd);
+		}
+		free(thr->in);
+		free(thr->out);
+		free(thr->rbuff);
+		iothreadscnt = i;
+		if (i>0) {
+			netio_term();
+		} else {
+			free(iothreads);
+			iothreads = NULL;
+			close(mainwakefd);
+			mainwakefd = -1;
+		}
+		return -1;
+	}
+	iothreadscnt = threads;
+	return mainwakefd;
+}
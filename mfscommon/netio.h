@@ -0,0 +1,54 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NETIO_H_
+#define _NETIO_H_
+
+#include <inttypes.h>
+
+#include "main.h"
+
+/* network i/o threads - sockets attached here are owned by one of N i/o threads which read them,
+   cut the stream into packets and pass complete packets to the main (metadata) thread ; packets
+   created by the main thread go back the same way. Each thread has two single producer / single
+   consumer rings (main->thread and thread->main) and an eventfd, so no locks are used. All packets
+   are still processed by the main thread one by one, so the order of metadata operations is kept. */
+
+/* messages received by the main thread */
+#define NETIO_PACKET 1		// complete packet (data is malloc'ed - receiver frees it)
+#define NETIO_ERROR 2		// connection broken ; type = errno (0 - closed by peer, EMSGSIZE - packet too long, leng = its size)
+#define NETIO_CLOSED 3		// netio_close finished - socket is closed and eptr is not used by i/o thread anymore
+
+/* returns eventfd which becomes readable when there are messages for the main thread (-1 on error) */
+int netio_init(uint32_t threads,uint32_t maxpacketsize);
+uint32_t netio_threads(void);
+/* connection (eptr->sock) is moved to i/o thread */
+void netio_attach(serventry *eptr);
+/* moves whole output queue (pktbuf buffers) of the connection to its i/o thread */
+void netio_send(serventry *eptr);
+/* closes connection - NETIO_CLOSED is returned when done */
+void netio_close(serventry *eptr);
+/* wakes up threads which got something from netio_attach/netio_send/netio_close */
+void netio_wakeup(void);
+/* calls fun for received messages - returns number of messages */
+uint32_t netio_receive(void (*fun)(serventry *eptr,uint8_t cmd,uint32_t type,uint8_t *data,uint32_t leng));
+/* 1 - all sent packets have been written (or dropped with their connections) */
+int netio_idle(void);
+void netio_term(void);
+
+#endif
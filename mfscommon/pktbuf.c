@@ -0,0 +1,228 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "pktbuf.h"
+#include "datapack.h"
+
+#define PKTBUF_CLASSES 6
+#define PKTBUF_NOCLASS 0xFF
+#define PKTBUF_SLABSIZE 4096		// small packets are put into buffers of this size
+#define PKTBUF_SMALL 512		// packets up to this size (with header) are small
+#define PKTBUF_POOLBYTES 0x400000	// max free memory kept in one class
+#define PKTBUF_IOVMAX 64
+
+static const uint32_t classsize[PKTBUF_CLASSES] = {64,256,1024,PKTBUF_SLABSIZE,16384,65536};
+
+typedef struct _pktpool {
+	packetstruct *head;
+	uint32_t cnt;
+	uint32_t maxcnt;
+} pktpool;
+
+static pktpool pools[PKTBUF_CLASSES] = {
+	{NULL,0,PKTBUF_POOLBYTES/64},
+	{NULL,0,PKTBUF_POOLBYTES/256},
+	{NULL,0,PKTBUF_POOLBYTES/1024},
+	{NULL,0,PKTBUF_POOLBYTES/PKTBUF_SLABSIZE},
+	{NULL,0,PKTBUF_POOLBYTES/16384},
+	{NULL,0,PKTBUF_POOLBYTES/65536}
+};
+
+static uint64_t stats_allocs = 0;
+static uint64_t stats_reused = 0;
+static uint64_t stats_packets = 0;
+static uint64_t stats_writes = 0;	// also counted by network i/o threads
+
+static packetstruct* pktbuf_get(uint32_t need) {
+	packetstruct *p;
+	uint8_t c;
+
+	for (c=0 ; c<PKTBUF_CLASSES && classsize[c]<need ; c++) {}
+	if (c==PKTBUF_CLASSES) {
+		p = (packetstruct*)malloc(sizeof(packetstruct)+need);
+		if (p==NULL) {
+			return NULL;
+		}
+		stats_allocs++;
+		p->bufsize = need;
+		p->bufclass = PKTBUF_NOCLASS;
+	} else if (pools[c].head!=NULL) {
+		p = pools[c].head;
+		pools[c].head = p->next;
+		pools[c].cnt--;
+		stats_reused++;
+	} else {
+		p = (packetstruct*)malloc(sizeof(packetstruct)+classsize[c]);
+		if (p==NULL) {
+			return NULL;
+		}
+		stats_allocs++;
+		p->bufsize = classsize[c];
+		p->bufclass = c;
+	}
+	p->packet = (uint8_t*)(p+1);
+	p->startptr = p->packet;
+	p->bytesleft = 0;
+	p->next = NULL;
+	return p;
+}
+
+void pktbuf_free(packetstruct *p) {
+	pktpool *pool;
+	if (p->bufclass==PKTBUF_NOCLASS || pools[p->bufclass].cnt>=pools[p->bufclass].maxcnt) {
+		free(p);
+		return;
+	}
+	pool = pools + p->bufclass;
+	p->next = pool->head;
+	pool->head = p;
+	pool->cnt++;
+}
+
+void pktbuf_freechain(packetstruct *p) {
+	packetstruct *np;
+	while (p) {
+		np = p->next;
+		pktbuf_free(p);
+		p = np;
+	}
+}
+
+uint8_t* pktbuf_append(packetstruct **head,packetstruct ***tail,uint32_t type,uint32_t size) {
+	packetstruct *p;
+	uint8_t *ptr;
+	uint32_t psize;
+
+	psize = size+8;
+	p = NULL;
+	if (psize<=PKTBUF_SMALL) {
+		if (*tail!=head) {	// 'next' is the first field, so tail points to the last packet
+			p = (packetstruct*)(*tail);
+			if (p->bufclass==PKTBUF_NOCLASS || p->startptr+p->bytesleft+psize > p->packet+p->bufsize) {
+				p = NULL;
+			}
+		}
+		if (p==NULL) {
+			p = pktbuf_get(PKTBUF_SLABSIZE);
+			if (p==NULL) {
+				return NULL;
+			}
+			*(*tail) = p;
+			*tail = &(p->next);
+		}
+	} else {
+		p = pktbuf_get(psize);
+		if (p==NULL) {
+			return NULL;
+		}
+		*(*tail) = p;
+		*tail = &(p->next);
+	}
+	ptr = p->startptr+p->bytesleft;
+	p->bytesleft += psize;
+	stats_packets++;
+	put32bit(&ptr,type);
+	put32bit(&ptr,size);
+	return ptr;
+}
+
+int pktbuf_writev(int sock,packetstruct **head,packetstruct ***tail,packetstruct ***done) {
+	struct iovec iov[PKTBUF_IOVMAX];
+	packetstruct *p;
+	uint32_t cnt;
+	size_t total;
+	ssize_t i;
+
+	for (;;) {
+		cnt = 0;
+		total = 0;
+		for (p=*head ; p!=NULL && cnt<PKTBUF_IOVMAX ; p=p->next) {
+			iov[cnt].iov_base = p->startptr;
+			iov[cnt].iov_len = p->bytesleft;
+			total += p->bytesleft;
+			cnt++;
+		}
+		if (cnt==0) {
+			return 1;
+		}
+		if (cnt==1) {
+			i = write(sock,iov[0].iov_base,iov[0].iov_len);
+		} else {
+			i = writev(sock,iov,cnt);
+		}
+		__atomic_add_fetch(&stats_writes,1,__ATOMIC_RELAXED);
+		if (i<0) {
+			return (errno==EAGAIN)?0:-1;
+		}
+		if ((size_t)i<total) {
+			total = 0;	// short write - socket buffer is full
+		}
+		while (i>0) {
+			p = *head;
+			if ((size_t)i<p->bytesleft) {
+				p->startptr += i;
+				p->bytesleft -= i;
+				break;
+			}
+			i -= p->bytesleft;
+			*head = p->next;
+			if (*head==NULL) {
+				*tail = head;
+			}
+			p->next = NULL;
+			if (done) {
+				**done = p;
+				*done = &(p->next);
+			} else {
+				pktbuf_free(p);
+			}
+		}
+		if (total==0) {
+			return (*head==NULL)?1:0;
+		}
+	}
+}
+
+void pktbuf_stats(uint64_t *allocs,uint64_t *reused,uint64_t *packets,uint64_t *writes) {
+	*allocs = stats_allocs;
+	*reused = stats_reused;
+	*packets = stats_packets;
+	*writes = __atomic_load_n(&stats_writes,__ATOMIC_RELAXED);
+}
+
+void pktbuf_term(void) {
+	packetstruct *p;
+	uint8_t c;
+	for (c=0 ; c<PKTBUF_CLASSES ; c++) {
+		while ((p=pools[c].head)!=NULL) {
+			pools[c].head = p->next;
+			free(p);
+		}
+		pools[c].cnt = 0;
+	}
+}
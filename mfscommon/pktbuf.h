@@ -0,0 +1,44 @@
+/*
+   Copyright 2005-2010 Jakub Kruszona-Zawadzki, Gemius SA.
+
+   This file is part of MooseFS.
+
+   MooseFS is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, version 3.
+
+   MooseFS is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MooseFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PKTBUF_H_
+#define _PKTBUF_H_
+
+#include <inttypes.h>
+
+#include "main.h"
+
+/* output packet buffers - packetstruct and its data are one block taken from size-classed free lists ;
+   small packets are appended to the last buffer of the queue (slab) when it has room, so one buffer
+   (and one iovec) carries many replies. Queues are written with writev.
+
+   Buffers are allocated and freed only by the main thread (pktbuf_writev called by other threads
+   moves written buffers to 'done' list - they have to be passed back to the main thread). */
+
+/* adds packet (type,size) to the queue - returns pointer to its data (NULL - no memory) */
+uint8_t* pktbuf_append(packetstruct **head,packetstruct ***tail,uint32_t type,uint32_t size);
+void pktbuf_free(packetstruct *p);
+void pktbuf_freechain(packetstruct *p);
+/* writes queue (many packets in one syscall) - written buffers are freed (done==NULL) or moved to *done
+   returns: 1 - queue is empty , 0 - socket buffer is full , -1 - error (errno) */
+int pktbuf_writev(int sock,packetstruct **head,packetstruct ***tail,packetstruct ***done);
+/* monotonic counters: malloc calls, buffers reused from pools, packets queued, write syscalls */
+void pktbuf_stats(uint64_t *allocs,uint64_t *reused,uint64_t *packets,uint64_t *writes);
+void pktbuf_term(void);
+
+#endif
@@ -0,0 +1 @@
+#define SVNVER 8313
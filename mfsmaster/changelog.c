@@ -19,20 +19,174 @@
 #include "config.h"
 
 #include <stdio.h>
-#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 
 #include "main.h"
 #include "changelog.h"
 #include "matomlserv.h"
 #include "cfg.h"
 #include "state.h"
+#include "changelogrec.h"
+
+#define SYNC_MODE_NONE 0
+#define SYNC_MODE_INTERVAL 1
+#define SYNC_MODE_BATCH 2
 
-#define MAXLOGLINESIZE 10000
 static uint32_t BackLogsNumber;
-static FILE *fd;
+static uint32_t SyncMode;
+static uint32_t SyncInterval;
+
+// changes are appended to the ring by the main thread (as binary records - see changelogrec.h) and written to changelog.0.mfs by the writer thread - everything that is in the ring when the writer wakes up goes to disk in one write (group commit)
+static int fd;
+static uint8_t *ring;
+static uint32_t ringsize;
+static uint64_t ringhead,ringtail;	// bytes ever appended / written
+static uint8_t writing,writerwaiting,writerterm,syncpending;
+static uint64_t lostchanges;
+static pthread_t writerthread;
+static pthread_mutex_t ringlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ringdata = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ringfree = PTHREAD_COND_INITIALIZER;
+
+static inline uint64_t changelog_monotonic_msec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*UINT64_C(1000)+ts.tv_nsec/1000000;
+}
+
+static int changelog_writespan(uint64_t start,uint64_t end) {
+	struct iovec iov[2];
+	uint32_t pos,leng,iovcnt;
+	ssize_t i;
+
+	if (fd<0) {
+		fd = open("changelog.0.mfs",O_WRONLY | O_APPEND | O_CREAT,0666);
+		if (fd<0) {
+			return -1;
+		}
+	}
+	pos = start%ringsize;
+	leng = end-start;
+	iov[0].iov_base = ring+pos;
+	if (pos+leng<=ringsize) {
+		iov[0].iov_len = leng;
+		iovcnt = 1;
+	} else {
+		iov[0].iov_len = ringsize-pos;
+		iov[1].iov_base = ring;
+		iov[1].iov_len = leng-(ringsize-pos);
+		iovcnt = 2;
+	}
+	while (iovcnt>0) {
+		i = writev(fd,iov,iovcnt);
+		if (i<0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		while (iovcnt>0 && (size_t)i>=iov[0].iov_len) {
+			i -= iov[0].iov_len;
+			iov[0] = iov[1];
+			iovcnt--;
+		}
+		if (iovcnt>0) {
+			iov[0].iov_base = ((uint8_t*)iov[0].iov_base)+i;
+			iov[0].iov_len -= i;
+		}
+	}
+	return 0;
+}
+
+static void* changelog_writer(void *arg) {
+	uint64_t start,end,lastsync,now;
+	struct timespec ts;
+	int i;
+	struct timeval tv;
+	(void)arg;
+
+	lastsync = changelog_monotonic_msec();
+	pthread_mutex_lock(&ringlock);
+	for (;;) {
+		while (ringtail==ringhead && writerterm==0) {
+			if (syncpending) {
+				gettimeofday(&tv,NULL);
+				ts.tv_sec = tv.tv_sec+SyncInterval/1000;
+				ts.tv_nsec = tv.tv_usec*1000+(SyncInterval%1000)*1000000;
+				if (ts.tv_nsec>=1000000000) {
+					ts.tv_sec++;
+					ts.tv_nsec-=1000000000;
+				}
+				writerwaiting = 1;
+				i = pthread_cond_timedwait(&ringdata,&ringlock,&ts);
+				writerwaiting = 0;
+				if (i==ETIMEDOUT && fd>=0) {
+					fdatasync(fd);
+					syncpending = 0;
+					lastsync = changelog_monotonic_msec();
+				}
+			} else {
+				writerwaiting = 1;
+				pthread_cond_wait(&ringdata,&ringlock);
+				writerwaiting = 0;
+			}
+		}
+		if (ringtail==ringhead) {	// writerterm
+			break;
+		}
+		start = ringtail;
+		end = ringhead;
+		writing = 1;
+		pthread_mutex_unlock(&ringlock);
+
+		if (changelog_writespan(start,end)<0) {
+			if (lostchanges==0) {
+				MFSLOG(LOG_ERR,"can't write changelog.0.mfs: %s",strerror(errno));
+			}
+			lostchanges += end-start;
+		} else {
+			if (lostchanges>0) {
+				MFSLOG(LOG_ERR,"lost %"PRIu64" bytes of MFS changes",lostchanges);
+				lostchanges = 0;
+			}
+			if (SyncMode==SYNC_MODE_BATCH) {
+				fdatasync(fd);
+			} else if (SyncMode==SYNC_MODE_INTERVAL) {
+				now = changelog_monotonic_msec();
+				if (now>=lastsync+SyncInterval) {
+					fdatasync(fd);
+					lastsync = now;
+					syncpending = 0;
+				} else {
+					syncpending = 1;
+				}
+			}
+		}
+
+		pthread_mutex_lock(&ringlock);
+		ringtail = end;
+		writing = 0;
+		pthread_cond_broadcast(&ringfree);
+	}
+	pthread_mutex_unlock(&ringlock);
+	return NULL;
+}
+
+// waits until everything appended so far is written - caller must hold ringlock
+static inline void changelog_drain(void) {
+	while (ringtail!=ringhead || writing) {
+		pthread_cond_wait(&ringfree,&ringlock);
+	}
+}
 
 //changelog func should not send anything
 void changelog_rotate() {
@@ -44,11 +198,17 @@ void changelog_rotate() {
 	if(isslave()) {
 		return;
 	}
-	
-	if (fd) {
-		fclose(fd);
-		fd=NULL;
+
+	pthread_mutex_lock(&ringlock);
+	changelog_drain();
+	if (fd>=0) {
+		if (SyncMode!=SYNC_MODE_NONE) {
+			fdatasync(fd);
+		}
+		close(fd);
+		fd=-1;
 	}
+	syncpending = 0;
 	if (BackLogsNumber>0) {
 		for (i=BackLogsNumber ; i>0 ; i--) {
 			snprintf(logname1,100,"changelog.%"PRIu32".mfs",i);
@@ -70,49 +230,181 @@ void changelog_rotate() {
                         fclose(new_fd);
                 }
 	}
+	pthread_mutex_unlock(&ringlock);
 //	matomlserv_broadcast_logrotate();
 }
 
 extern uint64_t version;
-void changelog(uint64_t in_version,const char *format,...) {
-	static char printbuff[MAXLOGLINESIZE];
-	va_list ap;
-	uint32_t leng;
 
-	/* as the caller will the global version if we need not to increase actually */
-	if(isslave()) {
-		version--;
-		return;
+// version of the first entry in given changelog file - 0 when file doesn't exist or is empty
+static uint64_t changelog_firstversion(int lfd) {
+	char buff[1000];
+	FILE *lf;
+	int dfd;
+	uint64_t fversion;
+
+	dfd = dup(lfd);
+	if (dfd<0) {
+		return 0;
+	}
+	lseek(dfd,0,SEEK_SET);	// offset is shared with 'lfd'
+	lf = fdopen(dfd,"r");
+	if (lf==NULL) {
+		close(dfd);
+		return 0;
+	}
+	fversion = 0;
+	if (changelogrec_read(lf,buff,1000)>0) {
+		fversion = strtoull(buff,NULL,10);
 	}
+	fclose(lf);
+	return fversion;
+}
 
-	va_start(ap,format);
-	leng = vsnprintf(printbuff,MAXLOGLINESIZE,format,ap);
-	va_end(ap);
-	if (leng>=MAXLOGLINESIZE) {
-		printbuff[MAXLOGLINESIZE-1]='\0';
-		leng=MAXLOGLINESIZE;
-	} else {
-		leng++;
+static int changelog_copy(int dfd,int sfd,uint64_t leng) {
+	uint8_t buff[65536];
+	uint64_t offset;
+	ssize_t i;
+	offset = 0;
+	while (offset<leng) {
+		i = pread(sfd,buff,(leng-offset>sizeof(buff))?sizeof(buff):(leng-offset),offset);
+		if (i<=0 || write(dfd,buff,i)!=i) {
+			return -1;
+		}
+		offset += i;
 	}
+	return 0;
+}
+
+// opens changes for slave which got metadata image with 'fromversion' (0 - unknown) - changelog.0.mfs when it starts before this version, otherwise anonymous file with older changelogs (from the one that contains 'fromversion') followed by changelog.0.mfs ; *leng0 - length of changelog.0.mfs part (next changes are sent from there)
+int changelog_openfrom(uint64_t fromversion,uint64_t *leng0) {
+	char logname[100];
+	int lfd[100];
+	uint32_t i,n;
+	uint64_t fv;
+	int dfd;
 
-	if (fd==NULL) {
-		fd = fopen("changelog.0.mfs","a");
-		if (!fd) {
-			MFSLOG(LOG_NOTICE,"lost MFS change %"PRIu64": %s",in_version,printbuff);
+	pthread_mutex_lock(&ringlock);
+	changelog_drain();	// changelog.0.mfs ends with whole record and has all changes up to 'version'
+	lfd[0] = open("changelog.0.mfs",O_RDONLY);
+	if (lfd[0]<0) {
+		pthread_mutex_unlock(&ringlock);
+		return -1;
+	}
+	*leng0 = lseek(lfd[0],0,SEEK_END);
+	// changes since 'fromversion' are in changelog.0.mfs when it starts at or before this version (or there are no such changes yet) - otherwise older changelogs are needed (empty ones don't tell where they start)
+	n = 0;
+	fv = (*leng0>0)?changelog_firstversion(lfd[0]):0;
+	while (fromversion>0 && fromversion<version && (fv==0 || fv>fromversion)) {
+		if (n+1>=100 || n+1>BackLogsNumber) {
+			lfd[n+1] = -1;
+		} else {
+			snprintf(logname,100,"changelog.%"PRIu32".mfs",n+1);
+			lfd[n+1] = open(logname,O_RDONLY);
+		}
+		if (lfd[n+1]<0) {
+			MFSLOG(LOG_WARNING,"no changelog with version %"PRIu64" - slave gets changes since changelog.%"PRIu32".mfs",fromversion,n);
+			break;
+		}
+		n++;
+		fv = changelog_firstversion(lfd[n]);
+	}
+	pthread_mutex_unlock(&ringlock);
+	if (n==0) {
+		return lfd[0];
+	}
+	snprintf(logname,100,"changelog.dl.XXXXXX");
+	dfd = mkstemp(logname);
+	if (dfd>=0) {
+		unlink(logname);
+		for (i=n ; i>0 && dfd>=0 ; i--) {
+			if (changelog_copy(dfd,lfd[i],lseek(lfd[i],0,SEEK_END))<0) {
+				close(dfd);
+				dfd = -1;
+			}
 		}
+		if (dfd>=0 && changelog_copy(dfd,lfd[0],*leng0)<0) {
+			close(dfd);
+			dfd = -1;
+		}
+	}
+	if (dfd<0) {
+		MFSLOG(LOG_ERR,"can't prepare changelog for slave (%m)");
 	}
+	for (i=0 ; i<=n ; i++) {
+		close(lfd[i]);
+	}
+	return dfd;
+}
+
+void changelog_rec(const uint8_t *rec,uint32_t leng) {
+	uint32_t pos;
+
+	pthread_mutex_lock(&ringlock);
+	while (ringsize-(ringhead-ringtail)<leng) {
+		pthread_cond_wait(&ringfree,&ringlock);
+	}
+	pos = ringhead%ringsize;
+	if (pos+leng<=ringsize) {
+		memcpy(ring+pos,rec,leng);
+	} else {
+		memcpy(ring+pos,rec,ringsize-pos);
+		memcpy(ring,rec+(ringsize-pos),leng-(ringsize-pos));
+	}
+	ringhead += leng;
+	if (writerwaiting) {	// wake up writer only when it sleeps - otherwise it will pick this change with the next batch
+		pthread_cond_signal(&ringdata);
+	}
+	pthread_mutex_unlock(&ringlock);
+	//matomlserv_broadcast_logstring(version,(uint8_t*)rec,leng);
+}
 
-	if (fd) {
-		fprintf(fd,"%"PRIu64": %s\n",in_version,printbuff);
-		fflush(fd);
+void changelog_term(void) {
+	pthread_mutex_lock(&ringlock);
+	writerterm = 1;
+	pthread_cond_signal(&ringdata);
+	pthread_mutex_unlock(&ringlock);
+	pthread_join(writerthread,NULL);
+	if (fd>=0) {
+		if (SyncMode!=SYNC_MODE_NONE) {
+			fdatasync(fd);
+		}
+		close(fd);
+		fd=-1;
 	}
-	//matomlserv_broadcast_logstring(version,(uint8_t*)printbuff,leng);
+	free(ring);
 }
 
 int changelog_init() {
 	BackLogsNumber = cfg_getuint32("BACK_LOGS",50);
-	fd = NULL;
+	SyncMode = cfg_getuint32("CHANGELOG_SYNC_MODE",SYNC_MODE_NONE);
+	SyncInterval = cfg_getuint32("CHANGELOG_SYNC_INTERVAL",1000);
+	ringsize = cfg_getuint32("CHANGELOG_BUFFER_SIZE",4*1024*1024);
+	if (SyncMode>SYNC_MODE_BATCH) {
+		MFSLOG(LOG_WARNING,"unknown CHANGELOG_SYNC_MODE (%"PRIu32") - using 0 (no sync)",SyncMode);
+		SyncMode = SYNC_MODE_NONE;
+	}
+	if (SyncInterval==0) {
+		SyncInterval = 1;
+	}
+	if (ringsize<2*CHLOG_MAXRECSIZE) {
+		ringsize = 2*CHLOG_MAXRECSIZE;
+	}
+	ring = malloc(ringsize);
+	if (ring==NULL) {
+		MFSLOG(LOG_ERR,"changelog: can't allocate buffer (%"PRIu32" bytes)",ringsize);
+		return -1;
+	}
+	fd = -1;
+	ringhead = ringtail = 0;
+	writing = writerwaiting = writerterm = syncpending = 0;
+	lostchanges = 0;
+	if (pthread_create(&writerthread,NULL,changelog_writer,NULL)!=0) {
+		MFSLOG(LOG_ERR,"changelog: can't create writer thread");
+		free(ring);
+		return -1;
+	}
+	main_destructregister(changelog_term);
 	//changelog_lock_init();
 	return 0;
 }
-
@@ -22,8 +22,12 @@
 #include <stdio.h>
 #include <inttypes.h>
 
+#include "changelogrec.h"
+
 void changelog_rotate(void);
-void changelog(uint64_t version,const char *format,...);
+int changelog_openfrom(uint64_t fromversion,uint64_t *leng0);
+// appends record built by changelogrec_pack (filesystem.c - fs_changelog)
+void changelog_rec(const uint8_t *rec,uint32_t leng);
 int changelog_init();
 
 #endif
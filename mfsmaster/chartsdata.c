@@ -30,6 +30,8 @@
 
 #include "charts.h"
 #include "main.h"
+#include "pktbuf.h"
+#include "matocuserv.h"
 
 #include "chunks.h"
 #include "filesystem.h"
@@ -56,8 +58,23 @@
 #define CHARTS_OPEN 17
 #define CHARTS_READ 18
 #define CHARTS_WRITE 19
-
-#define CHARTS 20
+#define CHARTS_FSMEMALLOC 20
+#define CHARTS_FSMEMUSED 21
+#define CHARTS_STOREBYTES 22
+#define CHARTS_STORETIME 23
+#define CHARTS_REBALBYTES 24
+#define CHARTS_REBALETA 25
+#define CHARTS_REBALMOVED 26
+#define CHARTS_PKTALLOC 27
+#define CHARTS_PKTREUSED 28
+#define CHARTS_PKTQUEUED 29
+#define CHARTS_PKTWRITES 30
+#define CHARTS_LOOPMAX 31
+#define CHARTS_LOOPSLOW 32
+#define CHARTS_CUOPAVG 33
+#define CHARTS_CUOPMAX 34
+
+#define CHARTS 35
 
 /* name , join mode , percent , scale , multiplier , divisor */
 #define STATDEFS { \
@@ -81,6 +98,21 @@
 	{"open"         ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
 	{"read"         ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
 	{"write"        ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"fsmemalloc"   ,CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"fsmemused"    ,CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"storebytes"   ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"storetime"    ,CHARTS_MODE_ADD,0,CHARTS_SCALE_MILI ,   1, 1}, \
+	{"rebalbytes"   ,CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"rebaleta"     ,CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"rebalmoved"   ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"pktalloc"     ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"pktreused"    ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"pktqueued"    ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"pktwrites"    ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"loopmax"      ,CHARTS_MODE_MAX,0,CHARTS_SCALE_MICRO,   1, 1}, \
+	{"loopslow"     ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"cuopavg"      ,CHARTS_MODE_MAX,0,CHARTS_SCALE_MICRO,   1, 1}, \
+	{"cuopmax"      ,CHARTS_MODE_MAX,0,CHARTS_SCALE_MICRO,   1, 1}, \
 	{NULL           ,0              ,0,0                 ,   0, 0}  \
 };
 
@@ -99,10 +131,16 @@ static const statdef statdefs[]=STATDEFS
 static const estatdef estatdefs[]=ESTATDEFS
 
 static struct itimerval it_set;
+static uint64_t pktlast[4];	// pktbuf counters are monotonic
+static uint64_t slowlast,cuoplast,cuopusec;
 
 void chartsdata_refresh(void) {
 	uint64_t data[CHARTS];
 	uint32_t fsdata[16];
+	uint64_t memalloc,memused,storebytes,rebalbytes,rebalmoved;
+	uint64_t pkt[4];
+	uint64_t loopmax,loopslow,cuops,cuopsum,cuopmax;
+	uint32_t storemsec,rebaleta;
 	uint32_t i,del,repl; //,bin,bout,opr,opw,dbr,dbw,dopr,dopw,repl;
 	struct itimerval uc,pc;
 	uint32_t ucusec,pcusec;
@@ -147,6 +185,30 @@ void chartsdata_refresh(void) {
 	for (i=0 ; i<16 ; i++) {
 		data[CHARTS_STATFS+i]=fsdata[i];
 	}
+	fs_meminfo(&memalloc,&memused);
+	data[CHARTS_FSMEMALLOC]=memalloc;
+	data[CHARTS_FSMEMUSED]=memused;
+	fs_storestats(&storebytes,&storemsec);
+	data[CHARTS_STOREBYTES]=storebytes;
+	data[CHARTS_STORETIME]=storemsec;
+	chunk_rebalance_stats(&rebalbytes,&rebaleta,&rebalmoved);
+	data[CHARTS_REBALBYTES]=rebalbytes;
+	data[CHARTS_REBALETA]=rebaleta;
+	data[CHARTS_REBALMOVED]=rebalmoved;
+	pktbuf_stats(pkt,pkt+1,pkt+2,pkt+3);
+	for (i=0 ; i<4 ; i++) {
+		data[CHARTS_PKTALLOC+i]=pkt[i]-pktlast[i];
+		pktlast[i]=pkt[i];
+	}
+	main_loopstats(&loopmax,&loopslow);
+	data[CHARTS_LOOPMAX]=loopmax;
+	data[CHARTS_LOOPSLOW]=loopslow-slowlast;
+	slowlast=loopslow;
+	matocuserv_opstats(&cuops,&cuopsum,&cuopmax);
+	data[CHARTS_CUOPAVG]=(cuops>cuoplast)?(cuopsum-cuopusec)/(cuops-cuoplast):0;
+	data[CHARTS_CUOPMAX]=cuopmax;
+	cuoplast=cuops;
+	cuopusec=cuopsum;
 
 	charts_add(data,get_current_time()-60);
 }
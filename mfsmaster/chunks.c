@@ -44,6 +44,7 @@
 #include "chunks.h"
 #include "filesystem.h"
 #include "datapack.h"
+#include "metastream.h"
 #include "nettopology.h"
 #include "state.h"
 #include "main.h"
@@ -54,8 +55,14 @@
 
 #define NOT_USED(x) ( (void)(x) )
 
-#define HASHSIZE 65536
-#define HASHPOS(chunkid) (((uint32_t)chunkid)&0xFFFF)
+/* chunk hash - linear hashing: when average chain becomes longer than HASHMAXLOAD next bucket (in order) is split
+   into itself and bucket number 'hashmask+1' higher, so the table grows by one bucket at a time and never has to be
+   rehashed at once; buckets are allocated in segments, so growing never moves existing buckets */
+#define HASHSEGBITS 16
+#define HASHSEGSIZE (1<<HASHSEGBITS)
+#define HASHSEGMAX 32768
+#define HASHMAXLOAD 4
+#define HASHBUCKET(pos) (chunkhash[(pos)>>HASHSEGBITS]+((pos)&(HASHSEGSIZE-1)))
 
 /* log print control */
 //#define LOG_COUNT 1000
@@ -140,16 +147,20 @@ typedef struct chunk {
 	uint64_t chunkid;
 	uint32_t version;
 	uint8_t goal;
+	uint8_t xorpart:1;	// member or parity of xor group - group is in xorparthash
 #ifndef METARESTORE
 	uint8_t allvalidcopies;
 	uint8_t regularvalidcopies;
 	uint8_t needverincrease:1;
 	uint8_t interrupted:1;
 	uint8_t operation:4;
+	uint8_t dirty:1;
+	uint8_t rebalance:1;	// planned or being moved by the rebalance planner
 #endif
 	uint32_t lockedto;
 #ifndef METARESTORE
-//	uint32_t lockedby;
+	uint8_t jobqueue;	// 0 - not queued, otherwise (most urgent queue level)+1
+	uint32_t lockedby;	// session that holds (or last held) the write lease
 	slist *slisthead;
 //	bcdata *bestchunk;
 #endif
@@ -169,7 +180,124 @@ static chunk_bucket *cbhead = NULL;
 static chunk *chfreehead = NULL;
 #endif /* USE_CHUNK_BUCKETS */
 
-static chunk *chunkhash[HASHSIZE];
+/* xor groups (goal xorN) - N cold chunks stored in one copy each and a parity chunk (XOR of them) kept on another
+   server; any lost part is rebuilt by XOR replication from the rest of the group; groups are built by the master
+   (chunk_xor_candidate) and logged (XORGROUP/XORDEL), a group whose member has changed (new version) or disappeared
+   is dissolved and its members go back to two copies */
+#define XOR_MAXLEVEL 9
+#define XOR_REBUILD_TIMEOUT 600
+
+typedef struct _xorgroup {
+	uint64_t parityid;
+	uint64_t chunkid[XOR_MAXLEVEL];
+	uint32_t version[XOR_MAXLEVEL];
+	uint8_t level;
+#ifndef METARESTORE
+	uint64_t rebuildid;	// part being (re)built now
+	uint32_t rebuildtime;
+#endif
+	struct _xorgroup *next,**prev;
+} xorgroup;
+
+static xorgroup *xorgroups = NULL;
+static uint32_t xorgroupscnt = 0;
+
+// group of every chunk with 'xorpart' set - kept outside chunk structure (only small part of chunks is in groups)
+typedef struct _xorpart {
+	uint64_t chunkid;
+	xorgroup *g;
+	struct _xorpart *next;
+} xorpart;
+
+#define XORPART_MINHASHSIZE 1024
+
+static xorpart **xorparthash = NULL;
+static uint32_t xorparthashsize = 0;
+static uint32_t xorpartcnt = 0;
+
+static inline uint32_t chunk_xorpart_hashpos(uint64_t chunkid) {
+	return ((uint32_t)chunkid) & (xorparthashsize-1);
+}
+
+static void chunk_xorpart_rehash(uint32_t newsize) {
+	xorpart **oldhash,*xp,*xpn;
+	uint32_t i,oldsize;
+	oldhash = xorparthash;
+	oldsize = xorparthashsize;
+	xorparthash = (xorpart**)malloc(sizeof(xorpart*)*newsize);
+	for (i=0 ; i<newsize ; i++) {
+		xorparthash[i] = NULL;
+	}
+	xorparthashsize = newsize;
+	for (i=0 ; i<oldsize ; i++) {
+		for (xp=oldhash[i] ; xp ; xp=xpn) {
+			xpn = xp->next;
+			xp->next = xorparthash[chunk_xorpart_hashpos(xp->chunkid)];
+			xorparthash[chunk_xorpart_hashpos(xp->chunkid)] = xp;
+		}
+	}
+	free(oldhash);
+}
+
+static inline xorgroup* chunk_xorpart_get(uint64_t chunkid) {
+	xorpart *xp;
+	if (xorpartcnt==0) {
+		return NULL;
+	}
+	for (xp=xorparthash[chunk_xorpart_hashpos(chunkid)] ; xp ; xp=xp->next) {
+		if (xp->chunkid==chunkid) {
+			return xp->g;
+		}
+	}
+	return NULL;
+}
+
+static inline void chunk_xorpart_add(uint64_t chunkid,xorgroup *g) {
+	xorpart *xp;
+	if (xorpartcnt>=xorparthashsize) {
+		chunk_xorpart_rehash((xorparthashsize<XORPART_MINHASHSIZE)?XORPART_MINHASHSIZE:xorparthashsize*2);
+	}
+	xp = (xorpart*)malloc(sizeof(xorpart));
+	xp->chunkid = chunkid;
+	xp->g = g;
+	xp->next = xorparthash[chunk_xorpart_hashpos(chunkid)];
+	xorparthash[chunk_xorpart_hashpos(chunkid)] = xp;
+	xorpartcnt++;
+}
+
+// removes entry only if it belongs to given group - returns 1 if removed
+static inline int chunk_xorpart_delete(uint64_t chunkid,xorgroup *g) {
+	xorpart *xp,**xpp;
+	if (xorpartcnt==0) {
+		return 0;
+	}
+	xpp = xorparthash+chunk_xorpart_hashpos(chunkid);
+	while ((xp=*xpp)) {
+		if (xp->chunkid==chunkid) {
+			if (xp->g!=g) {
+				return 0;
+			}
+			*xpp = xp->next;
+			free(xp);
+			xorpartcnt--;
+			return 1;
+		}
+		xpp = &(xp->next);
+	}
+	return 0;
+}
+
+static inline xorgroup* chunk_xorgroup(const chunk *c) {
+	return (c->xorpart)?chunk_xorpart_get(c->chunkid):NULL;
+}
+
+#define CHUNK_IS_PARITY(c) ((c)->xorpart && chunk_xorgroup(c)->parityid==(c)->chunkid)
+
+static chunk **chunkhash[HASHSEGMAX];
+static uint32_t chunkhashmask;	// bucket count at the beginning of current round - 1
+static uint32_t chunkhashsplit;	// next bucket to split
+static uint32_t chunkhashsize;	// number of buckets (chunkhashmask+1+chunkhashsplit)
+static uint64_t chunkhashelements;
 static uint64_t nextchunkid=1;
 #define LOCKTIMEOUT 120
 
@@ -187,19 +315,16 @@ static uint32_t ReplicationsDelayInit=300;
 // static uint32_t MaxRepl=1;
 // static uint32_t MaxDel=100;
 // static uint32_t LoopTime=300;
-// static uint32_t HashSteps=1+((HASHSIZE)/3600);
 static uint32_t MaxWriteRepl;
 static uint32_t MaxReadRepl;
 static uint32_t MaxDel;
 static double TmpMaxDelFrac;
 static uint32_t TmpMaxDel;
 static uint32_t LoopTime;
-static uint32_t HashSteps;
 
 //#define MAXCOPY 2
 //#define MAXDEL 6
 //#define LOOPTIME 3600
-//#define HASHSTEPS (1+((HASHSIZE)/(LOOPTIME)))
 
 #define ACCEPTABLE_DIFFERENCE 0.01
 
@@ -225,16 +350,65 @@ typedef struct _loop_info {
 static loop_info chunksinfo = {{0,0,0,0,0},{0,0,0,0,0},0};
 static uint32_t chunksinfo_loopstart=0,chunksinfo_loopend=0;
 
+/* urgent jobs - chunks which lost copies (or changed goal) are queued by priority and handled by chunk_jobs_tick
+   every second before the regular loop; the loop still visits every chunk once per LoopTime, so it catches anything
+   that was not queued (queue full); rebalancing is planned separately (see chunk_rebalance_plan) */
+enum {JOBQ_ENDANGERED,JOBQ_ONECOPY,JOBQ_UNDERGOAL,JOBQ_OVERGOAL,JOBQ_LEVELS};
+
+#define JOBQ_MAXLENGTH 0x1000000
+#define JOBQ_MAXFAILS 1000
+
+// hlist elements processed per main loop iteration after chunkserver disconnection
+#define DISCONNECT_BATCH 50000
+
+typedef struct _jobqueue {
+	uint64_t *ids;
+	uint32_t size;	// power of 2
+	uint32_t head;
+	uint32_t length;
+} jobqueue;
+
+static jobqueue jobqueues[JOBQ_LEVELS];
+
 #endif
 
 static uint64_t lastchunkid=0;
 static chunk* lastchunkptr=NULL;
 
+#ifndef METARESTORE
+// ids of chunks created, changed or deleted since the last metadata checkpoint (written by chunk_delta_store)
+static uint8_t deltaon=0;
+static uint64_t *deltaids=NULL;
+static uint32_t deltacnt=0;
+static uint32_t deltasize=0;
+
+static inline void chunk_delta_add(uint64_t chunkid) {
+	if (deltacnt==deltasize) {
+		deltasize = (deltasize>0)?deltasize*2:4096;
+		deltaids = (uint64_t*)realloc(deltaids,sizeof(uint64_t)*deltasize);
+	}
+	deltaids[deltacnt++] = chunkid;
+}
+
+static inline void chunk_dirty(chunk *c) {
+	if (deltaon && c->dirty==0) {
+		c->dirty = 1;
+		chunk_delta_add(c->chunkid);
+	}
+}
+#else
+#define chunk_dirty(c)
+#endif
+
 #ifndef METARESTORE
 static uint32_t chunks;
 #endif
 
 #ifndef METARESTORE
+// xor goals are counted with goal 1 (one full copy of every chunk)
+#define CHUNK_GOAL_ROW(g) (GOAL_IS_XOR(g)?1:(((g)>9)?10:(g)))
+// copies of a new chunk - chunks with xor goal are kept in two copies until they are added to a group
+#define CHUNK_NEW_COPIES(g) (GOAL_IS_XOR(g)?2:(g))
 uint32_t allchunkcounts[11][11];
 uint32_t regularchunkcounts[11][11];
 #endif
@@ -249,179 +423,93 @@ void chunk_stats(uint32_t *del,uint32_t *repl) {
 	stats_replications = 0;
 }
 
-static void chunk_hlist_resize(serventry *eptr) {
-    uint32_t i;
-    uint32_t newsize = eptr->chunkhlist.size << 1;
-    uint32_t newmask = newsize - 1;
-    uint32_t rehashnum = 0;
-    chunk_helem_t *newelemarray; 
-    chunk_helem_t *elem, *newelem, *nextelem;
-
-    MFSLOG(LOG_NOTICE,  "resize begin size:%lu num:%lu\n", 
-        eptr->chunkhlist.size, eptr->chunkhlist.num);
-
-    newelemarray = calloc(newsize, sizeof(chunk_helem_t));
-    if(newelemarray == NULL) {
-        MFSLOG(LOG_NOTICE, "alloc mem for new chunk hlist failed size:%lu\n", newsize);
-        return;
-    }
-
-    for(i = 0; i < eptr->chunkhlist.size; i++) {
-        uint32_t newkey;
-        /**
-          * deal the first elem in hlist which is actually mem of hlist table, we should not 
-          * free the elem, instead we should free it by free all the table 
-          */
-        elem = &eptr->chunkhlist.elem[i];
-
-        if(elem->chunk) {
-			newkey = ((chunk *)elem->chunk)->chunkid & newmask;
-            if(newelemarray[newkey].chunk) {
-                newelem = malloc(sizeof(chunk_helem_t));
-                newelem->next = newelemarray[newkey].next;
-				newelem->chunk = elem->chunk;
-                newelemarray[newkey].next = newelem;                   
-            } else {
-                newelemarray[newkey].chunk = elem->chunk;
-            }
-            elem->chunk = NULL;
-            rehashnum++;
-        } else {
-            /* no elem in the hlist */
-            assert(elem->next == NULL);
-            continue;
-        }
-
-        /* rehash the elem which is alloced one by one */
-        elem = elem->next;
-        while(elem) {
-            /* del from the old array */
-            nextelem = elem->next;
-            eptr->chunkhlist.elem[i].next = nextelem;            
-            newkey = ((chunk *)elem->chunk)->chunkid & newmask;
-            rehashnum++;
-
-            /* just move the elem to new elem array */
-            if(newelemarray[newkey].chunk) {
-                elem->next = newelemarray[newkey].next;
-                newelemarray[newkey].next = elem;                
-            } else {
-                newelemarray[newkey].chunk = elem->chunk;
-                free(elem);
-                elem = NULL;
-            }
-            elem = nextelem;               
-        }
-    }
-
-    assert(rehashnum == eptr->chunkhlist.num);
-
-    eptr->chunkhlist.size   = newsize;
-    eptr->chunkhlist.mask = newsize - 1;
-    free(eptr->chunkhlist.elem);
-    eptr->chunkhlist.elem = newelemarray;
-
-    MFSLOG(LOG_NOTICE,  "resize end size:%lu num:%lu\n", 
-        eptr->chunkhlist.size, eptr->chunkhlist.num);
-
-}
-
-static inline int chunk_hlist_need_resize(serventry *eptr)
-{
-    return eptr->chunkhlist.num > eptr->chunkhlist.size;
+static inline uint32_t chunk_hlist_pos(chunk_hlist_t *hl,uint64_t chunkid) {
+	return (uint32_t)((chunkid*UINT64_C(0x9E3779B97F4A7C15))>>32) & hl->mask;
 }
 
-static void chunk_hlist_add(serventry *eptr,  chunk *addchunk)
-{
-    uint64_t chunkid = addchunk->chunkid;
-    uint32_t key = chunkid & eptr->chunkhlist.mask;
-    chunk_helem_t * elem =  &eptr->chunkhlist.elem[key];
+/* whole table is reallocated at once - no per element allocations */
+static int chunk_hlist_resize(chunk_hlist_t *hl,uint32_t newsize) {
+	void **oldelem = hl->elem;
+	uint32_t oldsize = hl->size;
+	uint32_t i,pos;
+	void **newelem;
 
-    while(elem) {
-    	if(elem->chunk && ((chunk *)elem->chunk)->chunkid == chunkid) {
-    		MFSLOG(LOG_NOTICE, "chunkid:%llu exist skip it\n", chunkid);
-    		return;
-    	}
-    	elem = elem->next;
-    }
-
-    eptr->chunkhlist.num++;
-
-    if(eptr->chunkhlist.elem[key].chunk) {
-        elem = malloc(sizeof(elem));
-        elem->chunk                   = addchunk;  
-        elem->next                    = eptr->chunkhlist.elem[key].next;
-        eptr->chunkhlist.elem[key].next = elem;
-    } else {
-        eptr->chunkhlist.elem[key].chunk = addchunk;
-    }
-
-    if(chunk_hlist_need_resize(eptr)) {
-    	MFSLOG(LOG_NOTICE, "needresize size:%llu num:%llu\n", 
-    		eptr->chunkhlist.size, eptr->chunkhlist.num);
-    	chunk_hlist_resize(eptr);
-    }
+	newelem = calloc(newsize,sizeof(void*));
+	if (newelem==NULL) {
+		MFSLOG(LOG_WARNING,"chunk hlist: can't resize to %"PRIu32" elements",newsize);
+		return -1;
+	}
+	hl->elem = newelem;
+	hl->size = newsize;
+	hl->mask = newsize-1;
+	for (i=0 ; i<oldsize ; i++) {
+		if (oldelem[i]) {
+			pos = chunk_hlist_pos(hl,((chunk*)(oldelem[i]))->chunkid);
+			while (newelem[pos]) {
+				pos = (pos+1) & hl->mask;
+			}
+			newelem[pos] = oldelem[i];
+		}
+	}
+	free(oldelem);
+	return 0;
 }
 
-void chunk_hlist_free(serventry *eptr)
-{
-/*
-    uint32_t i;
-    chunk_helem_t *elem, *nextelem;
-
-    for(i = 0; i < eptr->chunkhlist.size; i++) {
-        elem = eptr->chunkhlist.elem[i].next;
-        while(elem) {
-            nextelem= elem->next;
-            free(elem);
-            elem = nextelem;
-        }
-    }
-*/
-
-    assert(eptr->chunkhlist.num == 0);
+static void chunk_hlist_add(serventry *eptr,chunk *addchunk) {
+	chunk_hlist_t *hl = &(eptr->chunkhlist);
+	uint32_t pos;
 
-    free(eptr->chunkhlist.elem);
-    eptr->chunkhlist.elem = NULL;
+	// keep load factor below 3/4
+	if ((uint64_t)(hl->num+1)*4 > (uint64_t)(hl->size)*3) {
+		if (chunk_hlist_resize(hl,hl->size<<1)<0 && hl->num+1>=hl->size) {
+			return;
+		}
+	}
+	pos = chunk_hlist_pos(hl,addchunk->chunkid);
+	while (hl->elem[pos]) {
+		if (hl->elem[pos]==addchunk) {
+			return;
+		}
+		pos = (pos+1) & hl->mask;
+	}
+	hl->elem[pos] = addchunk;
+	hl->num++;
 }
 
-void chunk_hlist_del(serventry *eptr, uint64_t chunkid)
-{
-    uint32_t key = chunkid & eptr->chunkhlist.mask;
-    chunk_helem_t *elem, *nextelem;
-
-    //assert(eptr->chunkhlist.num != 0);
+void chunk_hlist_free(serventry *eptr) {
+	assert(eptr->chunkhlist.num == 0);
 
-    elem = &eptr->chunkhlist.elem[key];
-    if(elem->chunk && ((chunk *)elem->chunk)->chunkid == chunkid) {
-        /* copy the chunkid and del the chunk from hlist */
-        if(elem->next) {
-            elem->chunk = elem->next->chunk;
-            nextelem = elem->next;
-            elem->next = nextelem->next;
-            free(nextelem);
-        } else {
-            elem->chunk = NULL;
-        }
+	free(eptr->chunkhlist.elem);
+	eptr->chunkhlist.elem = NULL;
+}
 
-        eptr->chunkhlist.num--;
-        return;    
-    }
+/* backward shift deletion - no tombstones, slots before the removed one are never touched */
+void chunk_hlist_del(serventry *eptr,uint64_t chunkid) {
+	chunk_hlist_t *hl = &(eptr->chunkhlist);
+	uint32_t pos,next,home;
 
-    nextelem = elem->next;
-    while(nextelem) {
-		if(nextelem->chunk && ((chunk *)nextelem->chunk)->chunkid == chunkid) {
-            elem->next = nextelem->next;
-            free(nextelem);
-            nextelem = NULL;
-            eptr->chunkhlist.num--;
-            return;
-        }
-        elem = nextelem;
-        nextelem = nextelem->next;
-    }
-    
-    //assert(0);
+	pos = chunk_hlist_pos(hl,chunkid);
+	while (hl->elem[pos]) {
+		if (((chunk*)(hl->elem[pos]))->chunkid==chunkid) {
+			break;
+		}
+		pos = (pos+1) & hl->mask;
+	}
+	if (hl->elem[pos]==NULL) {
+		return;
+	}
+	next = (pos+1) & hl->mask;
+	while (hl->elem[next]) {
+		home = chunk_hlist_pos(hl,((chunk*)(hl->elem[next]))->chunkid);
+		// move element back if its home slot is not in (pos,next]
+		if (((next-home) & hl->mask) >= ((next-pos) & hl->mask)) {
+			hl->elem[pos] = hl->elem[next];
+			pos = next;
+		}
+		next = (next+1) & hl->mask;
+	}
+	hl->elem[pos] = NULL;
+	hl->num--;
 }
 
 #endif
@@ -585,8 +673,68 @@ void chunk_cfg_check() {
 }
 #endif
 */
+static inline uint32_t chunk_hashpos(uint64_t chunkid) {
+	uint32_t pos;
+	pos = ((uint32_t)chunkid) & (chunkhashmask*2+1);
+	if (pos>=chunkhashsize) {
+		pos &= chunkhashmask;
+	}
+	return pos;
+}
+
+// moves chunks from the next bucket to split into the new one - only to the bucket with higher number, so iterating by bucket number never misses any chunk
+static inline void chunk_hash_split(void) {
+	uint32_t newpos,newmask;
+	chunk *c,**cp,**np;
+
+	newpos = chunkhashsize;
+	if (newpos>>HASHSEGBITS>=HASHSEGMAX) {
+		return;
+	}
+	if (chunkhash[newpos>>HASHSEGBITS]==NULL) {
+		chunkhash[newpos>>HASHSEGBITS] = (chunk**)calloc(HASHSEGSIZE,sizeof(chunk*));
+		if (chunkhash[newpos>>HASHSEGBITS]==NULL) {
+			return;
+		}
+	}
+	newmask = chunkhashmask*2+1;
+	cp = HASHBUCKET(chunkhashsplit);
+	np = HASHBUCKET(newpos);
+	while ((c=*cp)!=NULL) {
+		if ((((uint32_t)(c->chunkid))&newmask)==newpos) {
+			*cp = c->next;
+			c->next = NULL;
+			*np = c;
+			np = &(c->next);
+		} else {
+			cp = &(c->next);
+		}
+	}
+	chunkhashsize++;
+	chunkhashsplit++;
+	if (chunkhashsplit>chunkhashmask) {
+		chunkhashmask = newmask;
+		chunkhashsplit = 0;
+	}
+}
+
+static inline void chunk_hash_init(void) {
+	uint32_t i;
+	for (i=0 ; i<HASHSEGMAX ; i++) {
+		if (chunkhash[i]) {
+			free(chunkhash[i]);
+			chunkhash[i] = NULL;
+		}
+	}
+	chunkhash[0] = (chunk**)calloc(HASHSEGSIZE,sizeof(chunk*));
+	chunkhashmask = HASHSEGSIZE-1;
+	chunkhashsplit = 0;
+	chunkhashsize = HASHSEGSIZE;
+	chunkhashelements = 0;
+}
+
 chunk* chunk_new(uint64_t chunkid) {
-	uint32_t chunkpos = HASHPOS(chunkid);
+	chunk **bucket;
 	chunk *newchunk;
 	newchunk = chunk_malloc();
 #ifndef METARESTORE
@@ -594,43 +742,140 @@ chunk* chunk_new(uint64_t chunkid) {
 	allchunkcounts[0][0]++;
 	regularchunkcounts[0][0]++;
 #endif
-	newchunk->next = chunkhash[chunkpos];
-	chunkhash[chunkpos] = newchunk;
+	if (chunkhashelements>=(uint64_t)chunkhashsize*HASHMAXLOAD) {
+		chunk_hash_split();
+	}
+	chunkhashelements++;
+	bucket = HASHBUCKET(chunk_hashpos(chunkid));
+	newchunk->next = *bucket;
+	*bucket = newchunk;
 	newchunk->chunkid = chunkid;
 	newchunk->version = 0;
 	newchunk->goal = 0;
+	newchunk->xorpart = 0;
 	newchunk->lockedto = 0;
 #ifndef METARESTORE
 	newchunk->allvalidcopies = 0;
 	newchunk->regularvalidcopies = 0;
 	newchunk->needverincrease = 1;
+	newchunk->lockedby = 0;
 	newchunk->interrupted = 0;
 	newchunk->operation = NONE;
 	newchunk->slisthead = NULL;
+	newchunk->dirty = 0;
+	newchunk->rebalance = 0;
+	newchunk->jobqueue = 0;
 #endif
 	newchunk->flisthead = NULL;
 	lastchunkid = chunkid;
 	lastchunkptr = newchunk;
+	chunk_dirty(newchunk);
 	return newchunk;
 }
 
+#ifndef METARESTORE
+/* servers whose copies are still being removed after disconnection - chunks
+   touched before the background loop reaches them are cleaned up on access */
+typedef struct _discserv {
+	serventry *eptr;
+	uint32_t pos;
+	struct _discserv *next;
+} discserv;
+
+static discserv *discservhead=NULL,**discservtail=&discservhead;
+
+static void chunk_remove_disconnected_copies(chunk *c);
+
+/* rebalance planner - every REBALANCE_PLAN_PERIOD seconds servers are compared with the target utilization (the
+   same for every server and rack) and a bounded list of moves (copy to dst, then delete from src) is planned;
+   chunk_jobs_tick starts them when there is nothing more urgent, respecting per server limits */
+#define REBALANCE_PLAN_PERIOD 60
+#define REBALANCE_MOVE_TIMEOUT 600
+#define REBALANCE_HASHSIZE 4096
+#define REBALANCE_MAXFAILS 100
+// chunk list slots checked per chunk wanted from the source server
+#define REBALANCE_SCANFACTOR 32
+
+typedef struct _rebalmove {
+	uint64_t chunkid;
+	serventry *src,*dst;
+	uint64_t size;
+	uint32_t starttime;
+	struct _rebalmove *next;
+} rebalmove;
+
+static rebalmove *rebalqhead=NULL,**rebalqtail=&rebalqhead;	// planned, not started
+static uint32_t rebalqlength=0;
+static rebalmove *rebalinflight[REBALANCE_HASHSIZE];		// started, by chunkid
+static uint32_t rebalinflightcnt=0;
+
+static uint32_t RebalanceQueueMax;
+static uint32_t RebalanceSrcLimit;
+static uint32_t RebalanceDstLimit;
+
+static uint64_t rebalbytesleft=0;	// to reach the target utilization (last plan)
+static uint64_t rebalbytesmoved=0;	// moves finished since last plan
+static uint64_t rebalbytesstat=0;	// moves finished since last charts refresh
+static uint32_t reballoopstarted=0;	// moves started in current loop (reported as copy_rebalance)
+static double rebalrate=0.0;		// bytes per second (smoothed)
+
+static void chunk_rebalance_server_disconnected(serventry *eptr);
+static rebalmove* chunk_rebalance_finished(uint64_t chunkid,serventry *dst);
+static void chunk_rebalance_delete_source(chunk *c,rebalmove *m);
+static void chunk_xor_dissolve(xorgroup *g);
+#endif
+
 chunk* chunk_find(uint64_t chunkid) {
-	uint32_t chunkpos = HASHPOS(chunkid);
 	chunk *chunkit;
 	if (lastchunkid==chunkid) {
+#ifndef METARESTORE
+		if (discservhead && lastchunkptr) {
+			chunk_remove_disconnected_copies(lastchunkptr);
+		}
+#endif
 		return lastchunkptr;
 	}
-	for (chunkit = chunkhash[chunkpos] ; chunkit ; chunkit = chunkit->next ) {
+	for (chunkit = *HASHBUCKET(chunk_hashpos(chunkid)) ; chunkit ; chunkit = chunkit->next ) {
 		if (chunkit->chunkid == chunkid) {
 			lastchunkid = chunkid;
 			lastchunkptr = chunkit;
+#ifndef METARESTORE
+			if (discservhead) {
+				chunk_remove_disconnected_copies(chunkit);
+			}
+#endif
 			return chunkit;
 		}
 	}
 	return NULL;
 }
 
+// looks for chunk without side effects of chunk_find (cache, removing copies from disconnected servers)
+static inline chunk* chunk_xor_find(uint64_t chunkid) {
+	chunk *c;
+	for (c=*HASHBUCKET(chunk_hashpos(chunkid)) ; c ; c=c->next) {
+		if (c->chunkid==chunkid) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
 #ifndef METARESTORE
+// all members have the versions they had when the parity was built and the parity exists
+static int chunk_xor_intact(xorgroup *g) {
+	chunk *c;
+	uint8_t i;
+	for (i=0 ; i<g->level ; i++) {
+		c = chunk_xor_find(g->chunkid[i]);
+		if (c==NULL || c->version!=g->version[i] || chunk_xorgroup(c)!=g) {
+			return 0;
+		}
+	}
+	c = chunk_xor_find(g->parityid);
+	return (c!=NULL && chunk_xorgroup(c)==g);
+}
+
 void chunk_delete(chunk* c) {
 //	slist *s;
 //	flist *f;
@@ -651,29 +896,109 @@ void chunk_delete(chunk* c) {
 	}
 */
 	chunks--;
+	if (deltaon && c->dirty==0) {
+		chunk_delta_add(c->chunkid);
+	}
 
-	if(allchunkcounts[c->goal][0] == 0) {
+	if(allchunkcounts[CHUNK_GOAL_ROW(c->goal)][0] == 0) {
 		//MFSLOG(LOG_NOTICE, "the allcount goal:%u copys:%u is  zero skip it\n", c->goal, 0);
 	} else {
-		allchunkcounts[c->goal][0]--;		
+		allchunkcounts[CHUNK_GOAL_ROW(c->goal)][0]--;		
 	}
 
-	if(regularchunkcounts[c->goal][0] == 0) {
+	if(regularchunkcounts[CHUNK_GOAL_ROW(c->goal)][0] == 0) {
 		//MFSLOG(LOG_NOTICE, "the regucount goal:%u copys:%u is  zero skip it\n", c->goal, 0);
 	} else {
-		regularchunkcounts[c->goal][0]--;	
+		regularchunkcounts[CHUNK_GOAL_ROW(c->goal)][0]--;	
 	}	
 	
 	chunk_free(c);
 }
 
-static inline void chunk_state_change(uint8_t oldgoal,uint8_t newgoal,uint8_t oldavc,uint8_t newavc,uint8_t oldrvc,uint8_t newrvc) {
-	if (oldgoal>9) {
-		oldgoal=10;
+// wanted number of copies - members of a group with parity need only one
+static inline uint8_t chunk_goal_copies(chunk *c,uint8_t goal) {
+	chunk *pc;
+	xorgroup *g;
+	if (CHUNK_IS_PARITY(c)) {
+		return 1;
+	}
+	if (GOAL_IS_XOR(goal)) {
+		if (c->xorpart==0) {
+			return CHUNK_NEW_COPIES(goal);
+		}
+		g = chunk_xorgroup(c);
+		pc = chunk_xor_find(g->parityid);
+		return (pc!=NULL && pc->regularvalidcopies>0 && chunk_xor_intact(g))?1:2;
+	}
+	return goal;
+}
+
+static inline uint8_t chunk_jobqueue_level(chunk *c,uint8_t goal,uint8_t avc,uint8_t rvc) {
+	if (goal==0) {	// unused chunk
+		return JOBQ_LEVELS;
+	}
+	if (avc==0 && c->xorpart) {	// lost part of xor group - can be rebuilt from the rest of the group
+		return JOBQ_ENDANGERED;
+	}
+	goal = chunk_goal_copies(c,goal);
+	if (rvc==0) {	// only copies on disks marked for removal can be saved
+		return (avc>0)?JOBQ_ENDANGERED:JOBQ_LEVELS;
+	}
+	if (rvc<goal) {
+		return (rvc==1)?JOBQ_ONECOPY:JOBQ_UNDERGOAL;
+	}
+	if (rvc>goal) {
+		return JOBQ_OVERGOAL;
+	}
+	return JOBQ_LEVELS;
+}
+
+static inline void chunk_jobqueue_add(chunk *c,uint8_t level) {
+	jobqueue *q;
+	uint64_t *ids;
+	uint32_t i;
+
+	if (level>=JOBQ_LEVELS || (c->jobqueue>0 && c->jobqueue<=level+1)) {	// healthy or already queued with the same or higher priority
+		return;
 	}
-	if (newgoal>9) {
-		newgoal=10;
+	q = jobqueues+level;
+	if (q->length>=q->size) {
+		if (q->size>=JOBQ_MAXLENGTH) {
+			return;
+		}
+		ids = (uint64_t*)malloc(sizeof(uint64_t)*(q->size?q->size*2:0x1000));
+		if (ids==NULL) {
+			return;
+		}
+		for (i=0 ; i<q->length ; i++) {
+			ids[i] = q->ids[(q->head+i)&(q->size-1)];
+		}
+		if (q->ids) {
+			free(q->ids);
+		}
+		q->ids = ids;
+		q->size = q->size?q->size*2:0x1000;
+		q->head = 0;
 	}
+	q->ids[(q->head+q->length)&(q->size-1)] = c->chunkid;
+	q->length++;
+	c->jobqueue = level+1;
+}
+
+static inline uint64_t chunk_jobqueue_get(uint8_t level) {
+	jobqueue *q;
+	uint64_t chunkid;
+	q = jobqueues+level;
+	chunkid = q->ids[q->head];
+	q->head = (q->head+1)&(q->size-1);
+	q->length--;
+	return chunkid;
+}
+
+static inline void chunk_state_change(chunk *c,uint8_t oldgoal,uint8_t newgoal,uint8_t oldavc,uint8_t newavc,uint8_t oldrvc,uint8_t newrvc) {
+	uint8_t goal = newgoal;
+	oldgoal = CHUNK_GOAL_ROW(oldgoal);
+	newgoal = CHUNK_GOAL_ROW(newgoal);
 	if (oldavc>9) {
 		oldavc=10;
 	}
@@ -701,6 +1026,11 @@ static inline void chunk_state_change(uint8_t oldgoal,uint8_t newgoal,uint8_t ol
 
 	allchunkcounts[newgoal][newavc]++;
 	regularchunkcounts[newgoal][newrvc]++;
+
+	// new copies only make things better (registration, replication) - queue only losses and goal changes
+	if (newavc<oldavc || newrvc<oldrvc || newgoal!=oldgoal) {
+		chunk_jobqueue_add(c,chunk_jobqueue_level(c,goal,newavc,newrvc));
+	}
 }
 
 uint32_t chunk_count(void) {
@@ -749,12 +1079,12 @@ void chunk_refresh_goal(chunk* c) {
 	uint8_t oldgoal = c->goal;
 	c->goal = 0;
 	for (f=c->flisthead ; f ; f=f->next) {
-		if (f->goal > c->goal) {
+		if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
 			c->goal = f->goal;
 		}
 	}
 	if (c->goal!=oldgoal) {
-		chunk_state_change(oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+		chunk_state_change(c,oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
 	}
 }
 #endif
@@ -986,8 +1316,8 @@ int chunk_duptrunc(uint64_t *chunkid,uint64_t oldchunkid,uint32_t length,uint8_t
 void chunk_load_goal(void) {
 	uint32_t i;
 	chunk *c;
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (c=chunkhash[i] ; c ; c=c->next) {
+	for (i=0 ; i<chunkhashsize ; i++) {
+		for (c=*HASHBUCKET(i) ; c ; c=c->next) {
 			c->goal = c->tgoal;
 			c->tgoal = 0;
 		}
@@ -1013,13 +1343,13 @@ int chunk_set_file_goal(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t go
 		if (f->inode == inode && f->indx == indx) {
 			f->goal = goal;
 		}
-		if (f->goal > c->goal) {
+		if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
 			c->goal = f->goal;
 		}
 	}
 #ifndef METARESTORE
 	if (oldgoal!=c->goal) {
-		chunk_state_change(oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+		chunk_state_change(c,oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
 	}
 #endif
 	return STATUS_OK;
@@ -1048,7 +1378,7 @@ int chunk_delete_file(uint64_t chunkid,uint32_t inode,uint16_t indx) {
 			flist_free(f);
 			i=1;
 		} else {
-			if (f->goal > c->goal) {
+			if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
 				c->goal = f->goal;
 			}
 			fp = &(f->next);
@@ -1062,7 +1392,7 @@ int chunk_delete_file(uint64_t chunkid,uint32_t inode,uint16_t indx) {
 	}
 #ifndef METARESTORE
 	if (oldgoal!=c->goal) {
-		chunk_state_change(oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+		chunk_state_change(c,oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
 	}
 #endif
 	return STATUS_OK;
@@ -1089,7 +1419,7 @@ int chunk_add_file(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t goal) {
 			f->goal = goal;
 			i=1;
 		}
-		if (f->goal > c->goal) {
+		if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
 			c->goal = f->goal;
 		}
 	}
@@ -1100,7 +1430,7 @@ int chunk_add_file(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t goal) {
 		f->goal = goal;
 		f->next = c->flisthead;
 		c->flisthead = f;
-		if (goal > c->goal) {
+		if (GOAL_RANK(goal) > GOAL_RANK(c->goal)) {
 			c->goal = goal;
 		}
 	} else {
@@ -1111,7 +1441,7 @@ int chunk_add_file(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t goal) {
 	}
 #ifndef METARESTORE
 	if (oldgoal!=c->goal) {
-		chunk_state_change(oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+		chunk_state_change(c,oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
 	}
 #endif
 	return STATUS_OK;
@@ -1162,6 +1492,7 @@ int chunk_unlock(uint64_t chunkid) {
 		return ERROR_NOCHUNK;
 	}
 	c->lockedto=0;
+	chunk_dirty(c);
 	return STATUS_OK;
 }
 
@@ -1191,11 +1522,34 @@ int chunk_get_validcopies(uint64_t chunkid,uint8_t *vcopies) {
 
 
 #ifndef METARESTORE
-int chunk_multi_modify(uint64_t *nchunkid,uint64_t ochunkid,uint32_t inode,uint16_t indx,uint8_t goal,uint8_t *opflag) {
+/* write lease - session that holds the lock on a chunk may reopen it without version increase (only the lease
+   is extended - logged as WRITE with opflag=0, so replay extends lockedto the same way); version is increased
+   when the lease goes to another session (or after master restart - leases are not stored) or when chunk copies
+   have changed (needverincrease) */
+int chunk_lease_renew(uint64_t chunkid,uint32_t sessionid) {
+	chunk *c;
+	uint32_t now;
+	c = chunk_find(chunkid);
+	if (c==NULL) {
+		return 0;
+	}
+	now = get_current_time();
+	if (sessionid==0 || c->lockedby!=sessionid || c->lockedto<now || c->operation!=NONE || c->needverincrease || c->allvalidcopies==0) {
+		return 0;
+	}
+	if (c->flisthead==NULL || c->flisthead->next!=NULL) {	// shared (snapshot) - has to be duplicated
+		return 0;
+	}
+	c->lockedto = now+LOCKTIMEOUT;
+	chunk_dirty(c);
+	return 1;
+}
+
+int chunk_multi_modify(uint64_t *nchunkid,uint64_t ochunkid,uint32_t inode,uint16_t indx,uint8_t goal,uint32_t sessionid,uint8_t *opflag) {
 	void* ptrs[65536];
 	uint16_t servcount;
 	slist *os,*s;
-	uint8_t oldgoal;
+	uint8_t oldgoal,copies;
 #else
 int chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint32_t inode,uint16_t indx,uint8_t goal,uint8_t opflag) {
 #endif
@@ -1206,7 +1560,8 @@ int chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint32_t
 	if (ochunkid==0) {	// new chunk
 //		servcount = matocsserv_getservers_ordered(ptrs,MINMAXRND,NULL,NULL);
 #ifndef METARESTORE
-		servcount = matocsserv_getservers_wrandom(ptrs,goal);
+		copies = CHUNK_NEW_COPIES(goal);
+		servcount = matocsserv_getservers_wrandom(ptrs,copies);
 		if (servcount==0) {
 			uint16_t uscount,tscount;
 			double minusage,maxusage;
@@ -1231,12 +1586,12 @@ int chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint32_t
 		c->flisthead->goal = goal;
 		c->flisthead->next = NULL;
 #ifndef METARESTORE
-		if (servcount<goal) {
+		if (servcount<copies) {
 			c->allvalidcopies = servcount;
 			c->regularvalidcopies = servcount;
 		} else {
-			c->allvalidcopies = goal;
-			c->regularvalidcopies = goal;
+			c->allvalidcopies = copies;
+			c->regularvalidcopies = copies;
 		}
 		for (i=0 ; i<c->allvalidcopies ; i++) {
 			s = slist_malloc();
@@ -1248,7 +1603,7 @@ int chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint32_t
 			chunk_hlist_add(ptrs[i], c);			
 			matocsserv_send_createchunk(s->ptr,c->chunkid,c->version);
 		}
-		chunk_state_change(0,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
+		chunk_state_change(c,0,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
 		*opflag=1;
 #endif
 		*nchunkid = c->chunkid;
@@ -1281,7 +1636,19 @@ int chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint32_t
 			if (c->operation!=NONE) {
 				return ERROR_CHUNKBUSY;
 			}
-			if (c->needverincrease) {
+			if (c->xorpart) {	// write makes parity stale - group is dissolved (members go back to two copies)
+				chunk_xor_dissolve(chunk_xorgroup(c));
+			}
+			if (GOAL_IS_XOR(c->goal) && c->regularvalidcopies==1) {	// only copy of former group member - write when the second copy is made
+				uint16_t uscount,tscount;
+				double minusage,maxusage;
+				matocsserv_usagedifference(&minusage,&maxusage,&uscount,&tscount);
+				if (uscount>1) {
+					chunk_jobqueue_add(c,JOBQ_ONECOPY);
+					return ERROR_LOCKED;
+				}
+			}
+			if (c->needverincrease || c->lockedby!=sessionid) {	// copies changed or new lease owner
 				i=0;
 				for (s=c->slisthead ;s ; s=s->next) {
 					if (s->valid!=INVALID && s->valid!=DEL) {
@@ -1356,7 +1723,7 @@ int chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint32_t
 				}
 			}
 			if (c!=NULL) {
-				chunk_state_change(0,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
+				chunk_state_change(c,0,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
 			}
 			if (i>0) {
 #endif
@@ -1366,13 +1733,13 @@ int chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint32_t
 #endif
 				oc->goal = 0;
 				for (f=oc->flisthead ; f ; f=f->next) {
-					if (f->goal > oc->goal) {
+					if (GOAL_RANK(f->goal) > GOAL_RANK(oc->goal)) {
 						oc->goal = f->goal;
 					}
 				}
 #ifndef METARESTORE
 				if (oldgoal!=oc->goal) {
-					chunk_state_change(oldgoal,oc->goal,oc->allvalidcopies,oc->allvalidcopies,oc->regularvalidcopies,oc->regularvalidcopies);
+					chunk_state_change(oc,oldgoal,oc->goal,oc->allvalidcopies,oc->allvalidcopies,oc->regularvalidcopies,oc->regularvalidcopies);
 				}
 				*opflag=1;
 			} else {
@@ -1383,10 +1750,12 @@ int chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint32_t
 	}
 
 #ifndef METARESTORE
+	c->lockedby=sessionid;
 	c->lockedto=(uint32_t)get_current_time()+LOCKTIMEOUT;
 #else
 	c->lockedto=ts+LOCKTIMEOUT;
 #endif
+	chunk_dirty(c);
 	return STATUS_OK;
 }
 
@@ -1496,7 +1865,7 @@ int chunk_multi_truncate(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint32
 			}
 		}
 		if (c!=NULL) {
-			chunk_state_change(0,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
+			chunk_state_change(c,0,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
 		}
 		if (i>0) {
 #endif
@@ -1506,13 +1875,13 @@ int chunk_multi_truncate(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint32
 #endif
 			oc->goal = 0;
 			for (f=oc->flisthead ; f ; f=f->next) {
-				if (f->goal > oc->goal) {
+				if (GOAL_RANK(f->goal) > GOAL_RANK(oc->goal)) {
 					oc->goal = f->goal;
 				}
 			}
 #ifndef METARESTORE
 			if (oldgoal!=oc->goal) {
-				chunk_state_change(oldgoal,oc->goal,oc->allvalidcopies,oc->allvalidcopies,oc->regularvalidcopies,oc->regularvalidcopies);
+				chunk_state_change(oc,oldgoal,oc->goal,oc->allvalidcopies,oc->allvalidcopies,oc->regularvalidcopies,oc->regularvalidcopies);
 			}
 		} else {
 			return ERROR_CHUNKLOST;
@@ -1521,10 +1890,12 @@ int chunk_multi_truncate(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,uint32
 	}
 
 #ifndef METARESTORE
+	c->lockedby=0;	// truncate is not a write lease - next writer will increase version
 	c->lockedto=(uint32_t)get_current_time()+LOCKTIMEOUT;
 #else
 	c->lockedto=ts+LOCKTIMEOUT;
 #endif
+	chunk_dirty(c);
 	return STATUS_OK;
 }
 
@@ -1627,14 +1998,14 @@ int chunk_repair(uint32_t inode,uint16_t indx,uint64_t ochunkid,uint32_t *nversi
 				*fp = f->next;
 				flist_free(f);
 			} else {
-				if (f->goal > c->goal) {
+				if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
 					c->goal = f->goal;
 				}
 				fp = &(f->next);
 			}
 		}
 		if (oldgoal!=c->goal) {
-			chunk_state_change(oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+			chunk_state_change(c,oldgoal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
 		}
 		return 1;
 	}
@@ -1651,11 +2022,12 @@ int chunk_repair(uint32_t inode,uint16_t indx,uint64_t ochunkid,uint32_t *nversi
 				MFSLOG(LOG_WARNING,"wrong regular valid copies counter - (counter value: %u, should be: 0) - fixed",c->regularvalidcopies);
 				}
 		}
-		chunk_state_change(c->goal,c->goal,c->allvalidcopies,0,c->regularvalidcopies,0);
+		chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,0,c->regularvalidcopies,0);
 		c->allvalidcopies = 0;
 		c->regularvalidcopies = 0;
 	}
 	c->version = bestversion;
+	chunk_dirty(c);
 	for (s=c->slisthead ; s ; s=s->next) {
 		if (s->valid == INVALID && s->version==bestversion) {
 			s->valid = VALID;
@@ -1664,7 +2036,7 @@ int chunk_repair(uint32_t inode,uint16_t indx,uint64_t ochunkid,uint32_t *nversi
 		}
 	}
 	*nversion = bestversion;
-	chunk_state_change(c->goal,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
+	chunk_state_change(c,c->goal,c->goal,0,c->allvalidcopies,0,c->regularvalidcopies);
 	c->needverincrease=1;
 	return 1;
 }
@@ -1701,6 +2073,7 @@ void chunk_emergency_increase_version(chunk *c) {
 		c->interrupted = 0;
 		c->operation = SET_VERSION;
 		c->version++;
+		chunk_dirty(c);
 	} else {
 		matocuserv_chunk_status(c->chunkid,ERROR_CHUNKLOST);
 	}
@@ -1716,61 +2089,222 @@ int chunk_increase_version(uint64_t chunkid) {
 		return ERROR_NOCHUNK;
 	}
 	c->version++;
+	chunk_dirty(c);
 	return STATUS_OK;
 }
-/* ---- */
 
-#ifndef METARESTORE
+/* ---- xor groups */
 
-typedef struct locsort {
-	uint32_t ip;
-	uint16_t port;
-	uint32_t dist;
-	uint32_t rnd;
-} locsort;
+static void chunk_xor_link(xorgroup *g) {
+	chunk *c;
+	uint8_t i;
+	for (i=0 ; i<g->level ; i++) {
+		c = chunk_xor_find(g->chunkid[i]);
+		if (c!=NULL && c->xorpart==0) {
+			c->xorpart = 1;
+			chunk_xorpart_add(c->chunkid,g);
+		}
+	}
+	c = chunk_xor_find(g->parityid);
+	if (c!=NULL) {
+		c->xorpart = 1;
+		chunk_xorpart_add(c->chunkid,g);
+#ifndef METARESTORE
+		chunk_state_change(c,c->goal,GOAL_XOR(g->level),c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+#endif
+		c->goal = GOAL_XOR(g->level);
+	}
+	g->next = xorgroups;
+	if (g->next) {
+		g->next->prev = &(g->next);
+	}
+	g->prev = &xorgroups;
+	xorgroups = g;
+	xorgroupscnt++;
+}
 
-int chunk_locsort_cmp(const void *aa,const void *bb) {
-	const locsort *a = (const locsort*)aa;
-	const locsort *b = (const locsort*)bb;
-	if (a->dist<b->dist) {
-		return -1;
-	} else if (a->dist>b->dist) {
-		return 1;
-	} else if (a->rnd<b->rnd) {
-		return -1;
-	} else if (a->rnd>b->rnd) {
-		return 1;
+static void chunk_xor_unlink(xorgroup *g) {
+	chunk *c;
+	uint8_t i;
+	for (i=0 ; i<g->level ; i++) {
+		if (chunk_xorpart_delete(g->chunkid[i],g) && (c=chunk_xor_find(g->chunkid[i]))!=NULL) {
+			c->xorpart = 0;
+#ifndef METARESTORE
+			// members need two copies again
+			chunk_jobqueue_add(c,chunk_jobqueue_level(c,c->goal,c->allvalidcopies,c->regularvalidcopies));
+#endif
+		}
 	}
-	return 0;
+	if (chunk_xorpart_delete(g->parityid,g) && (c=chunk_xor_find(g->parityid))!=NULL) {
+		c->xorpart = 0;
+#ifndef METARESTORE
+		chunk_state_change(c,c->goal,0,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+#endif
+		c->goal = 0;	// no files - parity will be deleted as unused chunk
+	}
+	*(g->prev) = g->next;
+	if (g->next) {
+		g->next->prev = g->prev;
+	}
+	xorgroupscnt--;
 }
 
-int chunk_getversionandlocations(uint64_t chunkid,uint32_t cuip,uint32_t *version,uint8_t *count,uint8_t loc[100*6]) {
+// new group - parity chunk gets next chunk id (the same in master and in metadata restored from changelogs)
+int chunk_xor_add(uint64_t parityid,uint8_t level,const uint64_t *chunkid,const uint32_t *version) {
+	xorgroup *g;
 	chunk *c;
-	slist *s;
 	uint8_t i;
-	uint8_t cnt;
-	uint8_t *wptr;
-	uint32_t exact_dist;
-	uint8_t std_dist;
-	locsort lstab[100];
+	if (level<2 || level>XOR_MAXLEVEL) {
+		return ERROR_EINVAL;
+	}
+	if (parityid!=nextchunkid) {
+		return ERROR_MISMATCH;
+	}
+	c = chunk_new(nextchunkid++);
+	c->version = 1;
+	g = (xorgroup*)malloc(sizeof(xorgroup));
+	g->parityid = parityid;
+	g->level = level;
+	for (i=0 ; i<level ; i++) {
+		g->chunkid[i] = chunkid[i];
+		g->version[i] = version[i];
+	}
+#ifndef METARESTORE
+	g->rebuildid = 0;
+	g->rebuildtime = 0;
+#endif
+	chunk_xor_link(g);
+	return STATUS_OK;
+}
 
-	c = chunk_find(chunkid);
-	if (c==NULL) {
+int chunk_xor_delete(uint64_t parityid) {
+	xorgroup *g;
+	chunk *c;
+	c = chunk_find(parityid);
+	if (c==NULL || !CHUNK_IS_PARITY(c)) {
 		return ERROR_NOCHUNK;
 	}
-	*version = c->version;
-	cnt=0;
-	for (s=c->slisthead ;s ; s=s->next) {
-		if (s->valid!=INVALID && s->valid!=DEL) {
-			if (cnt<100 && matocsserv_getlocation(s->ptr,&(lstab[cnt].ip),&(lstab[cnt].port))==0) {
-				exact_dist = lstab[cnt].ip^cuip;
-				std_dist=0;
-				while(exact_dist){
-					exact_dist = exact_dist>>8;
-					std_dist++;
-				}
-				lstab[cnt].dist = std_dist;    // in the future prepare more sofisticated distance function
-				lstab[cnt].rnd = rndu32();
+	g = chunk_xorgroup(c);
+	chunk_xor_unlink(g);
+	free(g);
+	return STATUS_OK;
+}
+
+// xor groups: groups:32 , groups*[ parityid:64 level:8 level*[ chunkid:64 version:32 ] ]
+void chunk_xor_store(metastream *ms) {
+	uint8_t buff[8+1+XOR_MAXLEVEL*(8+4)];
+	uint8_t *ptr;
+	xorgroup *g;
+	uint8_t i;
+	ptr = buff;
+	put32bit(&ptr,xorgroupscnt);
+	metastream_write(ms,buff,4);
+	for (g=xorgroups ; g ; g=g->next) {
+		ptr = buff;
+		put64bit(&ptr,g->parityid);
+		put8bit(&ptr,g->level);
+		for (i=0 ; i<g->level ; i++) {
+			put64bit(&ptr,g->chunkid[i]);
+			put32bit(&ptr,g->version[i]);
+		}
+		metastream_write(ms,buff,ptr-buff);
+		metastream_record(ms);
+	}
+}
+
+// replaces all groups (image or delta) - groups whose parity chunk doesn't exist are dropped
+int chunk_xor_load(FILE *fd) {
+	uint8_t buff[8+1+XOR_MAXLEVEL*(8+4)];
+	const uint8_t *ptr;
+	xorgroup *g;
+	uint32_t cnt;
+	uint8_t i;
+
+	while ((g=xorgroups)!=NULL) {
+		chunk_xor_unlink(g);
+		free(g);
+	}
+	if (fread(buff,1,4,fd)!=4) {
+		return -1;
+	}
+	ptr = buff;
+	cnt = get32bit(&ptr);
+	while (cnt>0) {
+		if (fread(buff,1,9,fd)!=9) {
+			return -1;
+		}
+		ptr = buff;
+		g = (xorgroup*)malloc(sizeof(xorgroup));
+		g->parityid = get64bit(&ptr);
+		g->level = get8bit(&ptr);
+		if (g->level<2 || g->level>XOR_MAXLEVEL || fread(buff,1,g->level*(8+4),fd)!=(size_t)(g->level*(8+4))) {
+			free(g);
+			return -1;
+		}
+		ptr = buff;
+		for (i=0 ; i<g->level ; i++) {
+			g->chunkid[i] = get64bit(&ptr);
+			g->version[i] = get32bit(&ptr);
+		}
+#ifndef METARESTORE
+		g->rebuildid = 0;
+		g->rebuildtime = 0;
+#endif
+		if (chunk_xor_find(g->parityid)==NULL) {
+			free(g);
+		} else {
+			chunk_xor_link(g);
+		}
+		cnt--;
+	}
+	return 0;
+}
+
+/* ---- */
+
+#ifndef METARESTORE
+
+typedef struct locsort {
+	uint32_t ip;
+	uint16_t port;
+	uint32_t dist;
+	uint32_t rnd;
+} locsort;
+
+int chunk_locsort_cmp(const void *aa,const void *bb) {
+	const locsort *a = (const locsort*)aa;
+	const locsort *b = (const locsort*)bb;
+	if (a->dist<b->dist) {
+		return -1;
+	} else if (a->dist>b->dist) {
+		return 1;
+	} else if (a->rnd<b->rnd) {
+		return -1;
+	} else if (a->rnd>b->rnd) {
+		return 1;
+	}
+	return 0;
+}
+
+int chunk_getversionandlocations(uint64_t chunkid,uint32_t cuip,uint32_t *version,uint8_t *count,uint8_t loc[100*6]) {
+	chunk *c;
+	slist *s;
+	uint8_t i;
+	uint8_t cnt;
+	uint8_t *wptr;
+	locsort lstab[100];
+
+	c = chunk_find(chunkid);
+	if (c==NULL) {
+		return ERROR_NOCHUNK;
+	}
+	*version = c->version;
+	cnt=0;
+	for (s=c->slisthead ;s ; s=s->next) {
+		if (s->valid!=INVALID && s->valid!=DEL) {
+			if (cnt<100 && matocsserv_getlocation(s->ptr,&(lstab[cnt].ip),&(lstab[cnt].port))==0) {
+				lstab[cnt].dist = net_get_distance(lstab[cnt].ip,cuip);
+				lstab[cnt].rnd = rndu32();
 				cnt++;
 			}
 //			sptr[cnt++]=s->ptr;
@@ -1829,12 +2363,12 @@ void chunk_server_has_chunk(void *ptr,uint64_t chunkid,uint32_t version) {
 		if (version&0x80000000) {
 			s->valid=TDVALID;
 			s->version = c->version;
-			chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies);
+			chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies);
 			c->allvalidcopies++;
 		} else {
 			s->valid=VALID;
 			s->version = c->version;
-			chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies+1);
+			chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies+1);
 			c->allvalidcopies++;
 			c->regularvalidcopies++;
 		}
@@ -1858,11 +2392,11 @@ void chunk_damaged(void *ptr,uint64_t chunkid) {
 	for (s=c->slisthead ; s ; s=s->next) {
 		if (s->ptr==ptr) {
 			if (s->valid==TDBUSY || s->valid==TDVALID) {
-				chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 				c->allvalidcopies--;
 			}
 			if (s->valid==BUSY || s->valid==VALID) {
-				chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 				c->allvalidcopies--;
 				c->regularvalidcopies--;
 			}
@@ -1893,11 +2427,11 @@ void chunk_lost(void *ptr,uint64_t chunkid) {
 	while ((s=*sptr)) {
 		if (s->ptr==ptr) {
 			if (s->valid==TDBUSY || s->valid==TDVALID) {
-				chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 				c->allvalidcopies--;
 			}
 			if (s->valid==BUSY || s->valid==VALID) {
-				chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 				c->allvalidcopies--;
 				c->regularvalidcopies--;
 			}
@@ -1911,144 +2445,286 @@ void chunk_lost(void *ptr,uint64_t chunkid) {
 	}
 }
 
-void chunk_server_disconnected(void *ptr) {
-	chunk *c;
+static void chunk_remove_disconnected_copies(chunk *c) {
 	slist *s,**st;
-	uint32_t i;
-	uint8_t valid,vs;
+	uint8_t valid,vs,removed;
 
-	//jobsnorepbefore = main_time()+ReplicationsDelayDisconnect;
-	//jobslastdisconnect = main_time();
-
-/*  
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (c=chunkhash[i] ; c ; c=c->next ) {
-			st = &(c->slisthead);
-			while (*st) {
-				s = *st;
-				if (s->ptr == ptr) {
-					if (s->valid==TDBUSY || s->valid==TDVALID) {
-						chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
-						c->allvalidcopies--;
-					}
-					if (s->valid==BUSY || s->valid==VALID) {
-						chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
-						c->allvalidcopies--;
-						c->regularvalidcopies--;
-					}
-					c->needverincrease=1;
-					*st = s->next;
-					slist_free(s);
-				} else {
-					st = &(s->next);
-				}
+	removed=0;
+	st = &(c->slisthead);
+	while (*st) {
+		s = *st;
+		if (((serventry*)(s->ptr))->disconnected) {
+			if (s->valid==TDBUSY || s->valid==TDVALID) {
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+				c->allvalidcopies--;
 			}
-			vs=0;
-			valid=1;
-			if (c->operation!=NONE) {
-				for (s=c->slisthead ; s ; s=s->next) {
-					if (s->valid==BUSY || s->valid==TDBUSY) {
-						valid=0;
-					}
-					if (s->valid==VALID || s->valid==TDVALID) {
-						vs++;
-					}
-				}
-				if (valid) {
-					if (vs>0) {
-						chunk_emergency_increase_version(c);
-//						matocuserv_chunk_status(c->chunkid,STATUS_OK);
-					} else {
-						matocuserv_chunk_status(c->chunkid,ERROR_NOTDONE);
-						c->operation=NONE;
-					}
-				} else {
-					c->interrupted = 1;
+			if (s->valid==BUSY || s->valid==VALID) {
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+				c->allvalidcopies--;
+				c->regularvalidcopies--;
+			}
+			c->needverincrease=1;
+			chunk_hlist_del(s->ptr,c->chunkid);
+			*st = s->next;
+			slist_free(s);
+			removed=1;
+		} else {
+			st = &(s->next);
+		}
+	}
+	if (removed==0 || c->operation==NONE) {
+		return;
+	}
+	vs=0;
+	valid=1;
+	for (s=c->slisthead ; s ; s=s->next) {
+		if (s->valid==BUSY || s->valid==TDBUSY) {
+			valid=0;
+		}
+		if (s->valid==VALID || s->valid==TDVALID) {
+			vs++;
+		}
+	}
+	if (valid) {
+		if (vs>0) {
+			chunk_emergency_increase_version(c);
+		} else {
+			matocuserv_chunk_status(c->chunkid,ERROR_NOTDONE);
+			c->operation=NONE;
+		}
+	} else {
+		c->interrupted = 1;
+	}
+}
+
+/* copies are removed in background (DISCONNECT_BATCH hlist elements per loop) - until
+   then they are marked by eptr->disconnected and skipped by chunk_find and chunk_do_jobs */
+void chunk_server_disconnected(void *ptr) {
+	serventry *eptr = (serventry *)ptr;
+	discserv *ds;
+
+	eptr->disconnected = 1;
+	chunk_rebalance_server_disconnected(eptr);
+	ds = (discserv*)malloc(sizeof(discserv));
+	ds->eptr = eptr;
+	ds->pos = 0;
+	ds->next = NULL;
+	*discservtail = ds;
+	discservtail = &(ds->next);
+	MFSLOG(LOG_NOTICE,"chunkserver %s: removing %"PRIu32" chunk copies",eptr->servstrip,eptr->chunkhlist.num);
+}
+
+static void chunk_server_disconnection_loop(void) {
+	discserv *ds;
+	serventry *eptr;
+	chunk *c;
+	uint32_t steps;
+
+	steps = 0;
+	while ((ds=discservhead) && steps<DISCONNECT_BATCH) {
+		eptr = ds->eptr;
+		// deletion only shifts elements into the current slot, so all slots before it stay empty
+		while (ds->pos<eptr->chunkhlist.size && steps<DISCONNECT_BATCH) {
+			while ((c=eptr->chunkhlist.elem[ds->pos])) {
+				chunk_remove_disconnected_copies(c);
+				if (eptr->chunkhlist.elem[ds->pos]==c) {	// copy already removed from slist
+					chunk_hlist_del(eptr,c->chunkid);
 				}
+				steps++;
+			}
+			ds->pos++;
+			steps++;
+		}
+		if (ds->pos>=eptr->chunkhlist.size) {
+			MFSLOG(LOG_NOTICE,"chunkserver %s: all chunk copies removed",eptr->servstrip);
+			discservhead = ds->next;
+			if (discservhead==NULL) {
+				discservtail = &discservhead;
 			}
+			free(ds);
+			matocsserv_disconnection_finished(eptr);
 		}
 	}
-*/
-        serventry *eptr = (serventry *) ptr;    
+}
 
-        MFSLOG(LOG_WARNING,"begin");
-        for (i=0 ; i<eptr->chunkhlist.size; i++) {
-        chunk_helem_t *elem     = &eptr->chunkhlist.elem[i];
-        chunk_helem_t *nextelem = NULL;
+/* ---- xor groups - building and rebuilding (master) */
 
-        if(!elem->chunk) {
-            assert(elem->next == NULL);
-            continue;
-        } 
-        
-        while(elem) {
-            /* del and free it from the hlist which is not the first elem of the 
-              * hlist, later all the hlist will be freed before tcp_close the eptr
-              */
-            c = elem->chunk; 
-            nextelem = elem->next;
-
-            st = &(c->slisthead);
-            while (*st) {
-                s = *st;
-                if (s->ptr == ptr) {
-                    if (s->valid==TDBUSY || s->valid==TDVALID) {
-                        chunk_state_change(c->goal,c->goal,c->allvalidcopies,
-                            c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
-                        c->allvalidcopies--;
-                    }
-                    if (s->valid==BUSY || s->valid==VALID) {
-                        chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,
-                            c->regularvalidcopies,c->regularvalidcopies-1);
-                        c->allvalidcopies--;
-                        c->regularvalidcopies--;
-                    }
-                    c->needverincrease=1;
-                    *st = s->next;
-                    slist_free(s);
-                } else {
-                    st = &(s->next);
-                }
-            }
+static uint64_t xorcand[XOR_MAXLEVEL+1][XOR_MAXLEVEL];	// cold chunks waiting for group (by level)
+static uint8_t xorcandcnt[XOR_MAXLEVEL+1];
+static uint32_t XorColdTime;
 
-            vs=0;
-            valid=1;
-            if (c->operation!=NONE) {
-                for (s=c->slisthead ; s ; s=s->next) {
-                    if (s->valid==BUSY || s->valid==TDBUSY) {
-                        valid=0;
-                    }
-                    if (s->valid==VALID || s->valid==TDVALID) {
-                        vs++;
-                    }
-                }
-                if (valid) {
-                    if (vs>0) {
-                        chunk_emergency_increase_version(c);
-                        //						matocuserv_chunk_status(c->chunkid,STATUS_OK);
-                    } else {
-                        matocuserv_chunk_status(c->chunkid,ERROR_NOTDONE);
-                        c->operation=NONE;
-                    }
-                } else {
-                    c->interrupted = 1;
-                }
-            } 
-
-            if(elem != &eptr->chunkhlist.elem[i]) {
-                eptr->chunkhlist.elem[i].next = nextelem;
-				//MFSLOG(LOG_WARNING,"del second chunid:%llu", ((chunk *)elem->chunk)->chunkid);
-                free(elem);
-            } else {
-				//MFSLOG(LOG_WARNING,"del first chunid:%llu", ((chunk *)elem->chunk)->chunkid);
-                elem->chunk = NULL;
-            }
-          
-            eptr->chunkhlist.num--;
-            elem = nextelem;
-        }
-    }   
-	MFSLOG(LOG_WARNING,"end");
+static void chunk_xor_requeue(xorgroup *g) {
+	chunk *c;
+	uint8_t i;
+	for (i=0 ; i<g->level ; i++) {
+		c = chunk_xor_find(g->chunkid[i]);
+		if (c!=NULL && chunk_xorgroup(c)==g) {
+			chunk_jobqueue_add(c,chunk_jobqueue_level(c,c->goal,c->allvalidcopies,c->regularvalidcopies));
+		}
+	}
+}
+
+static void chunk_xor_dissolve(xorgroup *g) {
+	uint64_t parityid = g->parityid;
+	chunk_xor_delete(parityid);
+	fs_xordel(parityid);
+}
+
+// some part of the group (except chunk 'c') has copy on given server
+static int chunk_xor_onserver(xorgroup *g,chunk *c,void *ptr) {
+	chunk *pc;
+	slist *s;
+	uint8_t i;
+	for (i=0 ; i<=g->level ; i++) {
+		pc = chunk_xor_find((i<g->level)?g->chunkid[i]:g->parityid);
+		if (pc==NULL || pc==c) {
+			continue;
+		}
+		for (s=pc->slisthead ; s ; s=s->next) {
+			if (s->ptr==ptr) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// copy on 'ptr' is the only one kept apart from the rest of the group - don't delete it
+static int chunk_xor_keepcopy(chunk *c,void *ptr) {
+	slist *s;
+	if (chunk_xor_onserver(chunk_xorgroup(c),c,ptr)) {
+		return 0;
+	}
+	for (s=c->slisthead ; s ; s=s->next) {
+		if (s->ptr!=ptr && s->valid==VALID && chunk_xor_onserver(chunk_xorgroup(c),c,s->ptr)==0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// builds chunk 'c' (parity or lost member) as XOR of the rest of the group on a server that has no part of the group
+static int chunk_xor_rebuild(chunk *c) {
+	static void* rptrs[65536];
+	void *srcptr[XOR_MAXLEVEL];
+	uint64_t srcid[XOR_MAXLEVEL];
+	uint32_t srcversion[XOR_MAXLEVEL];
+	xorgroup *g = chunk_xorgroup(c);
+	uint16_t rservcount,i;
+	int server_multirack,availserv_multirack;
+	uint32_t now;
+	uint8_t j,n;
+	chunk *pc;
+	slist *s;
+
+	now = get_current_time();
+	if ((g->rebuildid!=0 && g->rebuildtime+XOR_REBUILD_TIMEOUT>now) || jobsnorepbefore>=now) {
+		return 0;
+	}
+	n = 0;
+	for (j=0 ; j<=g->level ; j++) {
+		pc = chunk_find((j<g->level)?g->chunkid[j]:g->parityid);
+		if (pc==c) {
+			continue;
+		}
+		if (pc==NULL) {
+			return 0;
+		}
+		srcptr[n] = NULL;
+		for (s=pc->slisthead ; s && srcptr[n]==NULL ; s=s->next) {
+			if ((s->valid==VALID || s->valid==TDVALID) && matocsserv_replication_read_counter(s->ptr)<MaxReadRepl) {
+				srcptr[n] = s->ptr;
+			}
+		}
+		if (srcptr[n]==NULL) {	// all other parts are needed
+			return 0;
+		}
+		srcid[n] = pc->chunkid;
+		srcversion[n] = pc->version;
+		n++;
+	}
+	rservcount = matocsserv_getservers_lessrepl(rptrs,&server_multirack,&availserv_multirack,MaxWriteRepl);
+	for (i=0 ; i<rservcount ; i++) {
+		for (s=c->slisthead ; s && s->ptr!=rptrs[i] ; s=s->next) {}
+		if (s || chunk_xor_onserver(g,c,rptrs[i])) {
+			continue;
+		}
+		if (matocsserv_send_replicatechunk_xor(rptrs[i],c->chunkid,c->version,n,srcptr,srcid,srcversion)<0) {
+			return 0;
+		}
+		g->rebuildid = c->chunkid;
+		g->rebuildtime = now;
+		stats_replications++;
+		return 1;
+	}
+	return 0;
+}
+
+// makes group from collected candidates - each member must have a valid copy on a different server
+static void chunk_xor_form(uint8_t level) {
+	uint64_t chunkid[XOR_MAXLEVEL];
+	uint32_t version[XOR_MAXLEVEL];
+	void *used[XOR_MAXLEVEL];
+	uint64_t parityid;
+	uint32_t now;
+	uint8_t i,j,n;
+	void *ptr;
+	chunk *c;
+	slist *s;
+
+	now = get_current_time();
+	n = 0;
+	for (i=0 ; i<xorcandcnt[level] ; i++) {
+		c = chunk_find(xorcand[level][i]);
+		if (c==NULL || c->xorpart || c->goal!=GOAL_XOR(level) || c->operation!=NONE || c->lockedto+XorColdTime>=now) {
+			continue;
+		}
+		ptr = NULL;
+		for (s=c->slisthead ; s && ptr==NULL ; s=s->next) {
+			if (s->valid==VALID) {
+				ptr = s->ptr;
+				for (j=0 ; j<n ; j++) {
+					if (used[j]==ptr) {
+						ptr = NULL;
+					}
+				}
+			}
+		}
+		if (ptr) {
+			chunkid[n] = c->chunkid;
+			version[n] = c->version;
+			used[n] = ptr;
+			n++;
+		}
+	}
+	if (n<level) {	// keep good ones
+		for (i=0 ; i<n ; i++) {
+			xorcand[level][i] = chunkid[i];
+		}
+		xorcandcnt[level] = n;
+		return;
+	}
+	xorcandcnt[level] = 0;
+	parityid = nextchunkid;
+	if (chunk_xor_add(parityid,level,chunkid,version)!=STATUS_OK) {
+		return;
+	}
+	fs_xorgroup(parityid,level,chunkid,version);
+	chunk_xor_rebuild(chunk_find(parityid));
+}
+
+static void chunk_xor_candidate(chunk *c) {
+	uint8_t level,i;
+	level = GOAL_XOR_LEVEL(c->goal);
+	for (i=0 ; i<xorcandcnt[level] ; i++) {
+		if (xorcand[level][i]==c->chunkid) {
+			return;
+		}
+	}
+	xorcand[level][xorcandcnt[level]++] = c->chunkid;
+	if (xorcandcnt[level]==level) {
+		chunk_xor_form(level);
+	}
 }
 
 void chunk_got_delete_status(void *ptr,uint64_t chunkid,uint8_t status) {
@@ -2064,11 +2740,11 @@ void chunk_got_delete_status(void *ptr,uint64_t chunkid,uint8_t status) {
 		if (s->ptr == ptr) {
 			if (s->valid!=DEL) {
 				if (s->valid==TDBUSY || s->valid==TDVALID) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 					c->allvalidcopies--;
 				}
 				if (s->valid==BUSY || s->valid==VALID) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 					c->allvalidcopies--;
 					c->regularvalidcopies--;
 				}
@@ -2092,11 +2768,23 @@ void chunk_got_delete_status(void *ptr,uint64_t chunkid,uint8_t status) {
 void chunk_got_replicate_status(void *ptr,uint64_t chunkid,uint32_t version,uint8_t status) {
 	chunk *c;
 	slist *s;
+	rebalmove *m;
+	xorgroup *g;
 	c = chunk_find(chunkid);
-	if (c==NULL) {
-		return ;
+	m = chunk_rebalance_finished(chunkid,(serventry*)ptr);
+	if (m && c) {
+		c->rebalance = 0;
+	}
+	g = (c)?chunk_xorgroup(c):NULL;
+	if (g && g->rebuildid==chunkid) {
+		g->rebuildid = 0;
+		if (status!=0 && g->parityid==chunkid && c->allvalidcopies==0) {
+			MFSLOG(LOG_NOTICE,"xor group %016"PRIX64": can't build parity chunk (status: %"PRIu8") - group dissolved",chunkid,status);
+			chunk_xor_dissolve(g);
+		}
 	}
-	if (status!=0) {
+	if (c==NULL || status!=0) {
+		free(m);
 		return ;
 	}
 	for (s=c->slisthead ; s ; s=s->next) {
@@ -2106,29 +2794,39 @@ void chunk_got_replicate_status(void *ptr,uint64_t chunkid,uint32_t version,uint
 				MFSLOG(LOG_WARNING,"got replication status from server which had had that chunk before (chunk:%016"PRIX64"_%08"PRIX32")",chunkid,version);
 			}
 			if (s->valid==VALID && version!=c->version) {
-				chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 				c->allvalidcopies--;
 				c->regularvalidcopies--;
 				s->valid = INVALID;
 				s->version = version;
 			}
+			free(m);
 			return;
 		}
 	}
 	s = slist_malloc();
 	chunk_hlist_add(ptr, c);
 	s->ptr = ptr;
+	s->version = version;
+	s->next = c->slisthead;
+	c->slisthead = s;
 	if (c->lockedto>=(uint32_t)get_current_time() || version!=c->version) {
 		s->valid = INVALID;
 	} else {
-		chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies+1);
+		chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies+1,c->regularvalidcopies,c->regularvalidcopies+1);
 		c->allvalidcopies++;
 		c->regularvalidcopies++;
 		s->valid = VALID;
+		if (m) {	// planned move - remove the copy from the source server
+			chunk_rebalance_delete_source(c,m);
+		}
+		// chunk can still need more copies (or became overgoal after rebalance) - don't wait for the loop
+		chunk_jobqueue_add(c,chunk_jobqueue_level(c,c->goal,c->allvalidcopies,c->regularvalidcopies));
+		if (CHUNK_IS_PARITY(c) && c->regularvalidcopies==1) {	// group is complete - extra copies of members can be removed
+			chunk_xor_requeue(chunk_xorgroup(c));
+		}
 	}
-	s->version = version;
-	s->next = c->slisthead;
-	c->slisthead = s;
+	free(m);
 }
 
 
@@ -2157,11 +2855,11 @@ void chunk_operation_status(chunk *c,uint8_t status,void *ptr) {
 			if (status!=0) {
 				c->interrupted = 1;	// increase version after finish, just in case
 				if (s->valid==TDBUSY || s->valid==TDVALID) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 					c->allvalidcopies--;
 				}
 				if (s->valid==BUSY || s->valid==VALID) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 					c->allvalidcopies--;
 					c->regularvalidcopies--;
 				}
@@ -2257,6 +2955,7 @@ void chunk_got_duptrunc_status(void *ptr,uint64_t chunkid,uint8_t status) {
 /* ----------------------- */
 
 void chunk_store_info(uint8_t *buff) {
+	uint32_t i;
 	put32bit(&buff,chunksinfo_loopstart);
 	put32bit(&buff,chunksinfo_loopend);
 	put32bit(&buff,chunksinfo.done.del_invalid);
@@ -2270,6 +2969,9 @@ void chunk_store_info(uint8_t *buff) {
 	put32bit(&buff,chunksinfo.done.copy_undergoal);
 	put32bit(&buff,chunksinfo.notdone.copy_undergoal);
 	put32bit(&buff,chunksinfo.copy_rebalance);
+	for (i=0 ; i<JOBQ_LEVELS ; i++) {
+		put32bit(&buff,jobqueues[i].length);
+	}
 }
 
 int chunk_is_good_deletion(chunk *c, void *del) {
@@ -2374,7 +3076,7 @@ int chunk_is_good_move(chunk* c, void* src, void* dst) {
 //jobs state: jobshpos
 
 extern serventry *matocsservhead;
-void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
+void chunk_do_jobs(chunk *c,uint16_t scount) {
 	slist *s,*s1 = NULL;
 	static void* ptrs[65535];
 	static uint16_t servcount;
@@ -2388,6 +3090,8 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 //	uint16_t port;
 	uint16_t i;
 	uint32_t vc,tdc,ivc,bc,tdb,dc;
+	uint8_t goal;
+	xorgroup *g;
 	static loop_info inforec;
 	static uint32_t delcount;
 
@@ -2414,6 +3118,8 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 				MFSLOG(LOG_NOTICE,"DEL_LIMIT decreased back to: %u/s",TmpMaxDel);
 			}
 //			prevdeldone = chunksinfo.done.del_invalid + chunksinfo.done.del_unused + chunksinfo.done.del_diskclean + chunksinfo.done.del_overgoal;
+			inforec.copy_rebalance = reballoopstarted;
+			reballoopstarted = 0;
 			chunksinfo = inforec;
 			memset(&inforec,0,sizeof(inforec));
 			chunksinfo_loopstart = chunksinfo_loopend;
@@ -2421,6 +3127,9 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 		}
 		return;
 	}
+	if (discservhead) {
+		chunk_remove_disconnected_copies(c);
+	}
 // step 1. calculate number of valid and invalid copies
 	vc=tdc=ivc=bc=tdb=dc=0;
 	for (s=c->slisthead ; s ; s=s->next) {
@@ -2450,7 +3159,7 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
                 if (log_valid++ == 0) {
 			MFSLOG(LOG_WARNING,"wrong all valid copies counter - (counter value: %u, should be: %u) - fixed",c->allvalidcopies,vc+tdc+bc+tdb);
 		}
-		chunk_state_change(c->goal,c->goal,c->allvalidcopies,vc+tdc+bc+tdb,c->regularvalidcopies,c->regularvalidcopies);
+		chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,vc+tdc+bc+tdb,c->regularvalidcopies,c->regularvalidcopies);
 		c->allvalidcopies = vc+tdc+bc+tdb;
 	}
 	if (c->regularvalidcopies!=vc+bc) {
@@ -2458,14 +3167,14 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
                 if (log_valid++ == 0) {
 			MFSLOG(LOG_WARNING,"wrong regular valid copies counter - (counter value: %u, should be: %u) - fixed",c->regularvalidcopies,vc+bc);
 		}
-		chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,vc+bc);
+		chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,vc+bc);
 		c->regularvalidcopies = vc+bc;
 	}
 
 //	syslog(LOG_WARNING,"chunk %016"PRIX64": ivc=%"PRIu32" , tdc=%"PRIu32" , vc=%"PRIu32" , bc=%"PRIu32" , tdb=%"PRIu32" , dc=%"PRIu32" , goal=%"PRIu8" , scount=%"PRIu16,c->chunkid,ivc,tdc,vc,bc,tdb,dc,c->goal,scount);
 
 // step 2. check number of copies
-	if (tdc+vc+tdb+bc==0 && ivc>0 && c->flisthead) {
+	if (tdc+vc+tdb+bc==0 && ivc>0 && c->flisthead && (c->xorpart==0 || !chunk_xor_intact(chunk_xorgroup(c)))) {	// lost part of xor group is rebuilt in step 6a
 		log_valid %= LOG_COUNT;
                 if (log_valid++ == 0) {
 			MFSLOG(LOG_WARNING,"chunk %016"PRIX64" has only invalid copies (%"PRIu32") - please repair it manually\n",c->chunkid,ivc);
@@ -2541,16 +3250,16 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 	}
 
 // step 6. delete unused chunk
-	if (c->flisthead==NULL) {
+	if (c->flisthead==NULL && !CHUNK_IS_PARITY(c)) {
 //		syslog(LOG_WARNING,"unused - delete");
 		if (delcount<TmpMaxDel) {
 			for (s=c->slisthead ; s ; s=s->next) {
 				if (s->valid==VALID || s->valid==TDVALID) {
 					if (s->valid==TDVALID) {
-						chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+						chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 						c->allvalidcopies--;
 					} else {
-						chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+						chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 						c->allvalidcopies--;
 						c->regularvalidcopies--;
 					}
@@ -2572,13 +3281,31 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 		return ;
 	}
 
+// step 6a. xor group - dissolve group with changed members, rebuild lost part
+	if ((g=chunk_xorgroup(c))!=NULL) {
+		if (!chunk_xor_intact(g)) {
+			chunk_xor_dissolve(g);
+			if (c->flisthead==NULL) {
+				return;
+			}
+		} else if (vc+tdc==0) {
+			if (chunk_xor_rebuild(c)) {
+				inforec.done.copy_undergoal++;
+			} else {
+				inforec.notdone.copy_undergoal++;
+			}
+			return;
+		}
+	}
+	goal = chunk_goal_copies(c,c->goal);
+
 // step 7a. if chunk has too many copies and some of them have status TODEL then delete them
 /* Do not delete TDVALID copies ; td no longer means 'to delete', it's more like 'to disconnect', so replicate those chunks, but do no delete them afterwards
 	if (vc+tdc>c->goal && tdc>0) {
 		if (delcount<TmpMaxDel) {
 			for (s=c->slisthead ; s && vc+tdc>c->goal && tdc>0 ; s=s->next) {
 				if (s->valid==TDVALID) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 					c->allvalidcopies--;
 					c->needverincrease=1;
 					s->valid = DEL;
@@ -2602,16 +3329,16 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 */
 
 // step 7b. if chunk has too many copies then delete some of them
-	if (vc > c->goal) {
+	if (vc > goal) {
 //		syslog(LOG_WARNING,"vc (%"PRIu32") > goal (%"PRIu32") - delete",vc,c->goal);
 		if (delcount<TmpMaxDel) {
 			if (servcount==0) {
 				servcount = matocsserv_getservers_ordered(ptrs,ACCEPTABLE_DIFFERENCE/2.0,&min,&max);
 			}
-			for (i=0 ; i<servcount && vc>c->goal ; i++) {
+			for (i=0 ; i<servcount && vc>goal ; i++) {
 				for (s=c->slisthead ; s && s->ptr!=ptrs[servcount-1-i] ; s=s->next) {}
-				if (s && s->valid==VALID && chunk_is_good_deletion(c, s->ptr)) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+				if (s && s->valid==VALID && chunk_is_good_deletion(c, s->ptr) && (goal>1 || c->xorpart==0 || !chunk_xor_keepcopy(c,s->ptr))) {
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
 					c->allvalidcopies--;
 					c->regularvalidcopies--;
 					c->needverincrease=1;
@@ -2625,18 +3352,18 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 				}
 			}
 		} else {
-			inforec.notdone.del_overgoal+=(vc-(c->goal));
+			inforec.notdone.del_overgoal+=(vc-goal);
 		}
 		return;
 	}
 
 // step 7c. if chunk has one copy on each server and some of them have status TODEL then delete one of it
-	if (vc+tdc>=scount && vc<c->goal && tdc>0 && vc+tdc>1) {
+	if (vc+tdc>=scount && vc<goal && tdc>0 && vc+tdc>1) {
 //		syslog(LOG_WARNING,"vc+tdc (%"PRIu32") >= scount (%"PRIu32") and vc (%"PRIu32") < goal (%"PRIu32") and tdc (%"PRIu32") > 0 and vc+tdc > 1 - delete",vc+tdc,scount,vc,c->goal,tdc);
 		if (delcount<TmpMaxDel) {
 			for (s=c->slisthead ; s ; s=s->next) {
 				if (s->valid==TDVALID) {
-					chunk_state_change(c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
+					chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies);
 					c->allvalidcopies--;
 					c->needverincrease=1;
 					s->valid = DEL;
@@ -2656,7 +3383,7 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 	}
 
 //step 8. if chunk has number of copies less than goal then make another copy of this chunk
-	if (c->goal > vc && vc+tdc > 0) {
+	if (goal > vc && vc+tdc > 0) {
 		if (jobsnorepbefore<(uint32_t)get_current_time()) {
 			uint32_t rgvc,rgtdc;
             int server_multirack,availserv_multirack;
@@ -2764,66 +3491,11 @@ void chunk_do_jobs(chunk *c,uint16_t scount,double minusage,double maxusage) {
 		}
 	}
 */
-	if (chunksinfo.notdone.copy_undergoal>0) {
-		return;
-	}
+// step 9. rebalancing is planned globally - see chunk_rebalance_plan
 
-// step 9. if there is too big difference between chunkservers then make copy of chunk from server with biggest disk usage on server with lowest disk usage
-	if (c->goal >= vc && vc+tdc>0 && (maxusage-minusage)>ACCEPTABLE_DIFFERENCE) {
-		if (servcount==0) {
-			servcount = matocsserv_getservers_ordered(ptrs,ACCEPTABLE_DIFFERENCE/2.0,&min,&max);
-		}
-		if (min>0 || max>0) {
-			void *srcserv=NULL;
-			void *dstserv=NULL;
-			if (max>0) {
-				for (i=0 ; i<max && srcserv==NULL ; i++) {
-					if (matocsserv_replication_read_counter(ptrs[servcount-1-i])<MaxReadRepl) {
-						for (s=c->slisthead ; s && s->ptr!=ptrs[servcount-1-i] ; s=s->next ) {}
-						if (s && (s->valid==VALID)) {
-							srcserv=s->ptr;
-						}
-					}
-				}
-			} else {
-				for (i=0 ; i<(servcount-min) && srcserv==NULL ; i++) {
-					if (matocsserv_replication_read_counter(ptrs[servcount-1-i])<MaxReadRepl) {
-						for (s=c->slisthead ; s && s->ptr!=ptrs[servcount-1-i] ; s=s->next ) {}
-						if (s && (s->valid==VALID)) {
-							srcserv=s->ptr;
-						}
-					}
-				}
-			}
-			if (srcserv!=NULL) {
-				if (min>0) {
-					for (i=0 ; i<min && dstserv==NULL ; i++) {
-						if (matocsserv_replication_write_counter(ptrs[i])<MaxWriteRepl) {
-							for (s=c->slisthead ; s && s->ptr!=ptrs[i] ; s=s->next ) {}
-							if (s==NULL && chunk_is_good_move(c, srcserv, ptrs[i])) {
-								dstserv=ptrs[i];
-							}
-						}
-					}
-				} else {
-					for (i=0 ; i<servcount-max && dstserv==NULL ; i++) {
-						if (matocsserv_replication_write_counter(ptrs[i])<MaxWriteRepl) {
-							for (s=c->slisthead ; s && s->ptr!=ptrs[i] ; s=s->next ) {}
-							if (s==NULL && chunk_is_good_move(c, srcserv, ptrs[i])) {
-								dstserv=ptrs[i];
-							}
-						}
-					}
-				}
-				if (dstserv!=NULL) {
-					stats_replications++;
-//					matocsserv_getlocation(srcserv,&ip,&port);
-					matocsserv_send_replicatechunk(dstserv,c->chunkid,c->version,srcserv);
-					c->needverincrease=1;
-					inforec.copy_rebalance++;
-				}
-			}
-		}
+// step 10. cold chunk with xor goal - add it to a new group
+	if (GOAL_IS_XOR(c->goal) && c->xorpart==0 && c->flisthead && vc>0 && c->lockedto+XorColdTime<(uint32_t)get_current_time()) {
+		chunk_xor_candidate(c);
 	}
 
 // step 9. if there is too big difference between chunkservers then make copy on server with lowest disk usage
@@ -2873,13 +3545,419 @@ void log_print_control_ck(void) {
 }
 
 
-void chunk_jobs_main(void) {
-	uint32_t i,l,r;
+#define REBALANCE_HASH(chunkid) ((uint32_t)(chunkid)&(REBALANCE_HASHSIZE-1))
+
+// chunk can be moved from src to dst - it has exactly goal copies and nothing else is going on with it
+static int chunk_rebalance_check(chunk *c,serventry *src,serventry *dst) {
+	slist *s;
+	uint8_t srcok;
+	if (c->operation!=NONE || c->lockedto>=(uint32_t)get_current_time() || c->jobqueue!=0) {
+		return 0;
+	}
+	if (chunk_goal_copies(c,c->goal)!=c->regularvalidcopies || c->allvalidcopies!=c->regularvalidcopies) {
+		return 0;
+	}
+	srcok = 0;
+	for (s=c->slisthead ; s ; s=s->next) {
+		if ((serventry*)(s->ptr)==dst) {
+			return 0;
+		}
+		if ((serventry*)(s->ptr)==src && s->valid==VALID) {
+			srcok = 1;
+		}
+	}
+	return srcok && chunk_is_good_move(c,src,dst);
+}
+
+static rebalmove* chunk_rebalance_finished(uint64_t chunkid,serventry *dst) {
+	rebalmove *m,**mp;
+	mp = rebalinflight + REBALANCE_HASH(chunkid);
+	while ((m=*mp)) {
+		if (m->chunkid==chunkid && m->dst==dst) {
+			*mp = m->next;
+			rebalinflightcnt--;
+			m->src->rebalsrc--;
+			m->dst->rebaldst--;
+			return m;
+		}
+		mp = &(m->next);
+	}
+	return NULL;
+}
+
+static void chunk_rebalance_delete_source(chunk *c,rebalmove *m) {
+	slist *s;
+	for (s=c->slisthead ; s ; s=s->next) {
+		if ((serventry*)(s->ptr)==m->src) {
+			if (s->valid==VALID && c->regularvalidcopies>chunk_goal_copies(c,c->goal) && chunk_is_good_deletion(c,s->ptr)) {
+				chunk_state_change(c,c->goal,c->goal,c->allvalidcopies,c->allvalidcopies-1,c->regularvalidcopies,c->regularvalidcopies-1);
+				c->allvalidcopies--;
+				c->regularvalidcopies--;
+				c->needverincrease=1;
+				s->valid = DEL;
+				stats_deletions++;
+				matocsserv_send_deletechunk(s->ptr,c->chunkid,0);
+				rebalbytesmoved += m->size;
+				rebalbytesstat += m->size;
+			}
+			return;
+		}
+	}
+}
+
+static void chunk_rebalance_drop(rebalmove *m) {
+	chunk *c;
+	c = chunk_find(m->chunkid);
+	if (c) {
+		c->rebalance = 0;
+	}
+	free(m);
+}
+
+// planned moves are dropped, started ones are forgotten (status from dst, if any, will be handled as a normal replication)
+static void chunk_rebalance_server_disconnected(serventry *eptr) {
+	rebalmove *m,**mp;
+	uint32_t i;
+	mp = &rebalqhead;
+	while ((m=*mp)) {
+		if (m->src==eptr || m->dst==eptr) {
+			*mp = m->next;
+			rebalqlength--;
+			chunk_rebalance_drop(m);
+		} else {
+			mp = &(m->next);
+		}
+	}
+	rebalqtail = mp;
+	if (rebalinflightcnt==0) {
+		return;
+	}
+	for (i=0 ; i<REBALANCE_HASHSIZE ; i++) {
+		mp = rebalinflight + i;
+		while ((m=*mp)) {
+			if (m->src==eptr || m->dst==eptr) {
+				*mp = m->next;
+				rebalinflightcnt--;
+				m->src->rebalsrc--;
+				m->dst->rebaldst--;
+				chunk_rebalance_drop(m);
+			} else {
+				mp = &(m->next);
+			}
+		}
+	}
+}
+
+static void chunk_rebalance_queue_free(void) {
+	rebalmove *m;
+	while ((m=rebalqhead)) {
+		rebalqhead = m->next;
+		chunk_rebalance_drop(m);
+	}
+	rebalqtail = &rebalqhead;
+	rebalqlength = 0;
+}
+
+// plans up to 'count' moves of chunks from src to dst
+static uint32_t chunk_rebalance_pick(serventry *src,serventry *dst,uint32_t count,uint64_t chunksize) {
+	chunk_hlist_t *hl = &(src->chunkhlist);
+	uint32_t pos,scan,found;
+	rebalmove *m;
+	chunk *c;
+
+	if (hl->num==0 || hl->elem==NULL) {
+		return 0;
+	}
+	scan = (count<hl->size/REBALANCE_SCANFACTOR)?count*REBALANCE_SCANFACTOR:hl->size;
+	pos = rndu32() & hl->mask;
+	found = 0;
+	while (scan>0 && found<count && rebalqlength<RebalanceQueueMax) {
+		c = (chunk*)(hl->elem[pos]);
+		if (c && c->rebalance==0 && chunk_rebalance_check(c,src,dst)) {
+			m = malloc(sizeof(rebalmove));
+			m->chunkid = c->chunkid;
+			m->src = src;
+			m->dst = dst;
+			m->size = chunksize;
+			m->starttime = 0;
+			m->next = NULL;
+			*rebalqtail = m;
+			rebalqtail = &(m->next);
+			rebalqlength++;
+			c->rebalance = 1;
+			found++;
+		}
+		pos = (pos+1) & hl->mask;
+		scan--;
+	}
+	return found;
+}
+
+typedef struct _rebalserv {
+	serventry *eptr;
+	uint32_t rack;
+	double excess;		// bytes above target (negative - below)
+	double rackexcess;	// the same for whole rack (shared by all servers of the rack - updated on first of them)
+	uint32_t rackfirst;
+} rebalserv;
+
+static int chunk_rebalserv_rack_cmp(const void *a,const void *b) {
+	uint32_t ra = ((const rebalserv*)a)->rack;
+	uint32_t rb = ((const rebalserv*)b)->rack;
+	return (ra<rb)?-1:(ra>rb)?1:0;
+}
+
+static int chunk_rebalserv_excess_cmp(const void *a,const void *b) {
+	double ea = (*(rebalserv* const*)a)->excess;
+	double eb = (*(rebalserv* const*)b)->excess;
+	return (ea>eb)?-1:(ea<eb)?1:0;
+}
+
+static void chunk_rebalance_plan(void) {
+	static void* ptrs[65535];
+	static rebalserv servtab[65535];
+	static rebalserv *srctab[65535],*dsttab[65535];
+	uint32_t i,j,k,servcount,srccount,dstcount,min,max,now,pass,cnt;
+	uint64_t tspace,uspace,chunkscount,bytesleft,chunksize;
+	double target,avgchunk,amount,rackexcess;
+	serventry *eptr;
+	rebalserv *src,*dst;
+	rebalmove *m,**mp;
+
+	now = get_current_time();
+	// forget moves without status from destination
+	for (i=0 ; i<REBALANCE_HASHSIZE && rebalinflightcnt>0 ; i++) {
+		mp = rebalinflight + i;
+		while ((m=*mp)) {
+			if (m->starttime+REBALANCE_MOVE_TIMEOUT<now) {
+				*mp = m->next;
+				rebalinflightcnt--;
+				m->src->rebalsrc--;
+				m->dst->rebaldst--;
+				chunk_rebalance_drop(m);
+			} else {
+				mp = &(m->next);
+			}
+		}
+	}
+	if (rebalrate==0.0) {
+		rebalrate = (double)rebalbytesmoved/REBALANCE_PLAN_PERIOD;
+	} else {
+		rebalrate = 0.8*rebalrate + 0.2*(double)rebalbytesmoved/REBALANCE_PLAN_PERIOD;
+	}
+	rebalbytesmoved = 0;
+	chunk_rebalance_queue_free();
+
+	servcount = matocsserv_getservers_ordered(ptrs,0.0,&min,&max);
+	tspace = 0;
+	uspace = 0;
+	chunkscount = 0;
+	for (i=j=0 ; i<servcount ; i++) {
+		eptr = (serventry*)(ptrs[i]);
+		if (eptr->registering==0 && eptr->disconnected==0) {
+			servtab[j].eptr = eptr;
+			servtab[j].rack = net_get_rack(eptr->servip);
+			tspace += eptr->totalspace;
+			uspace += eptr->usedspace;
+			chunkscount += eptr->chunkhlist.num;
+			j++;
+		}
+	}
+	servcount = j;
+	rebalbytesleft = 0;
+	if (servcount<2 || tspace==0) {
+		return;
+	}
+	target = (double)uspace/(double)tspace;
+	avgchunk = (chunkscount>0)?(double)uspace/(double)chunkscount:0.0;
+
+	// target utilization is the same everywhere - compute excess of every server and every rack
+	qsort(servtab,servcount,sizeof(rebalserv),chunk_rebalserv_rack_cmp);
+	bytesleft = 0;
+	for (i=0 ; i<servcount ; i=k) {
+		rackexcess = 0.0;
+		for (k=i ; k<servcount && servtab[k].rack==servtab[i].rack ; k++) {
+			eptr = servtab[k].eptr;
+			servtab[k].excess = (double)(eptr->usedspace) - target*(double)(eptr->totalspace);
+			if (servtab[k].excess > ACCEPTABLE_DIFFERENCE*(double)(eptr->totalspace)) {
+				bytesleft += servtab[k].excess;
+			}
+			// moves already in progress
+			servtab[k].excess -= avgchunk*eptr->rebalsrc;
+			servtab[k].excess += avgchunk*eptr->rebaldst;
+			servtab[k].rackfirst = i;
+			rackexcess += servtab[k].excess;
+		}
+		servtab[i].rackexcess = rackexcess;
+	}
+	rebalbytesleft = bytesleft;
+
+	srccount = dstcount = 0;
+	for (i=0 ; i<servcount ; i++) {
+		eptr = servtab[i].eptr;
+		if (servtab[i].excess > ACCEPTABLE_DIFFERENCE*(double)(eptr->totalspace)) {
+			srctab[srccount++] = servtab+i;
+		} else if (servtab[i].excess < -ACCEPTABLE_DIFFERENCE*(double)(eptr->totalspace)) {
+			dsttab[dstcount++] = servtab+i;
+		}
+	}
+	if (srccount==0 || dstcount==0) {
+		return;
+	}
+	qsort(srctab,srccount,sizeof(rebalserv*),chunk_rebalserv_excess_cmp);
+	qsort(dsttab,dstcount,sizeof(rebalserv*),chunk_rebalserv_excess_cmp);	// the most empty last
+
+	// pass 0 - inside rack, pass 1 - from overloaded rack to underloaded one, pass 2 - anywhere
+	for (pass=0 ; pass<3 && rebalqlength<RebalanceQueueMax ; pass++) {
+		for (i=0 ; i<srccount && rebalqlength<RebalanceQueueMax ; i++) {
+			src = srctab[i];
+			if (src->excess<=0.0 || src->eptr->chunkhlist.num==0) {
+				continue;
+			}
+			if (pass==1 && servtab[src->rackfirst].rackexcess<=0.0) {
+				continue;
+			}
+			chunksize = src->eptr->usedspace/src->eptr->chunkhlist.num;
+			if (chunksize==0) {
+				chunksize = 1;
+			}
+			for (j=dstcount ; j>0 && src->excess>0.0 && rebalqlength<RebalanceQueueMax ; j--) {
+				dst = dsttab[j-1];
+				if (dst->excess>=0.0) {
+					continue;
+				}
+				if (pass==0 && dst->rack!=src->rack) {
+					continue;
+				}
+				if (pass>0 && dst->rack==src->rack) {
+					continue;
+				}
+				if (pass==1 && servtab[dst->rackfirst].rackexcess>=0.0) {
+					continue;
+				}
+				amount = (src->excess < -dst->excess)?src->excess:-dst->excess;
+				cnt = amount/chunksize;
+				if (cnt==0) {
+					cnt = 1;
+				}
+				cnt = chunk_rebalance_pick(src->eptr,dst->eptr,cnt,chunksize);
+				amount = (double)cnt*chunksize;
+				src->excess -= amount;
+				dst->excess += amount;
+				if (pass>0) {
+					servtab[src->rackfirst].rackexcess -= amount;
+					servtab[dst->rackfirst].rackexcess += amount;
+				}
+			}
+		}
+	}
+	if (rebalqlength>0) {
+		MFSLOG(LOG_NOTICE,"rebalance: %"PRIu64" MiB to move, %"PRIu32" moves planned, %"PRIu32" in progress",rebalbytesleft>>20,rebalqlength,rebalinflightcnt);
+	}
+}
+
+// starts planned moves - stops after REBALANCE_MAXFAILS moves that could not be started (limits reached)
+static void chunk_rebalance_process(void) {
+	uint32_t n,fails,now;
+	rebalmove *m;
+	chunk *c;
+
+	now = get_current_time();
+	fails = 0;
+	for (n=rebalqlength ; n>0 && fails<REBALANCE_MAXFAILS ; n--) {
+		m = rebalqhead;
+		rebalqhead = m->next;
+		if (rebalqhead==NULL) {
+			rebalqtail = &rebalqhead;
+		}
+		rebalqlength--;
+		m->next = NULL;
+		c = chunk_find(m->chunkid);
+		if (c==NULL) {
+			free(m);
+			continue;
+		}
+		if (m->src->rebalsrc>=RebalanceSrcLimit || m->dst->rebaldst>=RebalanceDstLimit || matocsserv_replication_read_counter(m->src)>=MaxReadRepl || matocsserv_replication_write_counter(m->dst)>=MaxWriteRepl) {
+			*rebalqtail = m;
+			rebalqtail = &(m->next);
+			rebalqlength++;
+			fails++;
+			continue;
+		}
+		if (chunk_rebalance_check(c,m->src,m->dst)==0) {
+			c->rebalance = 0;
+			free(m);
+			continue;
+		}
+		stats_replications++;
+		matocsserv_send_replicatechunk(m->dst,c->chunkid,c->version,m->src);
+		c->needverincrease=1;
+		m->starttime = now;
+		m->src->rebalsrc++;
+		m->dst->rebaldst++;
+		reballoopstarted++;
+		m->next = rebalinflight[REBALANCE_HASH(m->chunkid)];
+		rebalinflight[REBALANCE_HASH(m->chunkid)] = m;
+		rebalinflightcnt++;
+	}
+}
+
+void chunk_rebalance_stats(uint64_t *bytesleft,uint32_t *eta,uint64_t *moved) {
+	*bytesleft = rebalbytesleft;
+	if (rebalbytesleft>0 && rebalrate>0.0) {
+		*eta = rebalbytesleft/rebalrate;
+	} else {
+		*eta = 0;
+	}
+	*moved = rebalbytesstat;
+	rebalbytesstat = 0;
+}
+
+// handles queued chunks (most urgent first) - stops level after JOBQ_MAXFAILS chunks that could not be handled (limits reached)
+static void chunk_jobqueue_process(uint16_t scount) {
+	uint32_t n,fails,ops;
+	uint8_t level,clevel;
+	chunk *c;
+
+	for (level=0 ; level<JOBQ_LEVELS ; level++) {
+		fails = 0;
+		for (n=jobqueues[level].length ; n>0 && fails<JOBQ_MAXFAILS ; n--) {
+			c = chunk_find(chunk_jobqueue_get(level));
+			if (c==NULL || c->jobqueue!=level+1) {	// deleted or queued again with higher priority
+				continue;
+			}
+			c->jobqueue = 0;
+			clevel = chunk_jobqueue_level(c,c->goal,c->allvalidcopies,c->regularvalidcopies);
+			if (clevel>=JOBQ_LEVELS) {
+				continue;
+			}
+			ops = stats_replications+stats_deletions;
+			chunk_do_jobs(c,scount);
+			if (stats_replications+stats_deletions==ops) {
+				fails++;
+				chunk_jobqueue_add(c,chunk_jobqueue_level(c,c->goal,c->allvalidcopies,c->regularvalidcopies));
+			}
+		}
+	}
+}
+
+/* jobs are paced in JOBS_SLICES slices per second (timing wheel) - per second limits and the urgent queue
+   are handled in the first slice, the regular hash loop is spread over all of them, so the main loop
+   never stops for a whole second worth of chunks */
+#define JOBS_SLICES 10
+
+static main_timer *jobstimer = NULL;
+static uint8_t jobsslice = 0;
+static uint8_t jobsactive = 0;
+static uint16_t jobsuscount = 0;
+static uint32_t jobshashsteps = 0;
+
+// once per second - returns 0 when jobs should not be done in this second
+static int chunk_jobs_second(void) {
 	uint16_t uscount,tscount;
 	static uint16_t lasttscount=0;
 	static uint16_t maxtscount=0;
 	double minusage,maxusage;
-	chunk *c,**cp;
 	matocsserv_usagedifference(&minusage,&maxusage,&uscount,&tscount);
 
 	if (tscount<lasttscount) {		// servers disconnected
@@ -2895,20 +3973,48 @@ void chunk_jobs_main(void) {
 	lasttscount = tscount;
 
 	if (minusage>maxusage) {
-		return;
+		return 0;
+	}
+
+	chunk_do_jobs(NULL,0);	// clear servercount and delcount
+	chunk_jobqueue_process(uscount);
+	if (rebalqlength>0 && chunksinfo.notdone.copy_undergoal==0 && jobsnorepbefore<(uint32_t)get_current_time()) {
+		chunk_rebalance_process();
 	}
+	jobsuscount = uscount;
+	jobshashsteps = 1+(chunkhashsize/LoopTime);
+	return 1;
+}
+
+static void chunk_jobs_tick(void *arg) {
+	uint32_t i,l,r,hashsteps;
+	uint16_t uscount;
+	chunk *c,**cp;
+	NOT_USED(arg);
 
-	chunk_do_jobs(NULL,0,0.0,0.0);	// clear servercount and delcount
-	for (i=0 ; i<HashSteps ; i++) {
+	if (jobsslice==0) {
+		jobsactive = chunk_jobs_second();
+	}
+	hashsteps = (jobshashsteps*(jobsslice+1))/JOBS_SLICES - (jobshashsteps*jobsslice)/JOBS_SLICES;
+	jobsslice++;
+	if (jobsslice>=JOBS_SLICES) {
+		jobsslice = 0;
+	}
+	if (jobsactive==0) {
+		return;
+	}
+	uscount = jobsuscount;
+	for (i=0 ; i<hashsteps ; i++) {
 		if (jobshpos==0) {
-			chunk_do_jobs(NULL,1,0.0,0.0);	// copy loop info
+			chunk_do_jobs(NULL,1);	// copy loop info
 		}
 		// delete unused chunks from structures
 		l=0;
-		cp = &(chunkhash[jobshpos]);
+		cp = HASHBUCKET(jobshpos);
 		while ((c=*cp)!=NULL) {
-			if (c->flisthead==NULL && c->slisthead==NULL) {
+			if (c->flisthead==NULL && c->slisthead==NULL && !CHUNK_IS_PARITY(c)) {
 				*cp = (c->next);
+				chunkhashelements--;
 				chunk_delete(c);
 			} else {
 				cp = &(c->next);
@@ -2919,23 +4025,33 @@ void chunk_jobs_main(void) {
 			r = rndu32()%l;
 			l=0;
 		// do jobs on rest of them
-			for (c=chunkhash[jobshpos] ; c ; c=c->next) {
+			for (c=*HASHBUCKET(jobshpos) ; c ; c=c->next) {
 				if (l>=r) {
-					chunk_do_jobs(c,uscount,minusage,maxusage);
+					chunk_do_jobs(c,uscount);
 				}
 				l++;
 			}
 			l=0;
-			for (c=chunkhash[jobshpos] ; l<r && c ; c=c->next) {
-				chunk_do_jobs(c,uscount,minusage,maxusage);
+			for (c=*HASHBUCKET(jobshpos) ; l<r && c ; c=c->next) {
+				chunk_do_jobs(c,uscount);
 				l++;
 			}
 		}
-//		for (c=chunkhash[jobshpos] ; c ; c=c->next) {
-//			chunk_do_jobs(c,uscount,minusage,maxusage);
+//		for (c=*HASHBUCKET(jobshpos) ; c ; c=c->next) {
+//			chunk_do_jobs(c,uscount);
 //		}
-		jobshpos+=123;	// if HASHSIZE is any power of 2 then any odd number is good here
-		jobshpos%=HASHSIZE;
+		// buckets are visited in order - splits move chunks only forward, so each chunk is checked once per loop
+		jobshpos++;
+		if (jobshpos>=chunkhashsize) {
+			jobshpos = 0;
+		}
+	}
+}
+
+void chunk_jobs_start(void) {
+	if (jobstimer==NULL) {
+		jobstimer = main_timeradd(1000/JOBS_SLICES,1000/JOBS_SLICES,chunk_jobs_tick,NULL);
+		main_timeregister(TIMEMODE_RUNONCE,REBALANCE_PLAN_PERIOD,0,chunk_rebalance_plan);
 	}
 }
 
@@ -3003,11 +4119,13 @@ int chunk_load_1_1(FILE *fd) {
 
 void chunk_dump(void) {
 	chunk *c;
+	xorgroup *g;
 	uint32_t i,lockedto,now;
+	uint8_t j;
 	now = time(NULL);
 
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (c=chunkhash[i] ; c ; c=c->next) {
+	for (i=0 ; i<chunkhashsize ; i++) {
+		for (c=*HASHBUCKET(i) ; c ; c=c->next) {
 			lockedto = c->lockedto;
 			if (lockedto<now) {
 				lockedto = 0;
@@ -3015,6 +4133,13 @@ void chunk_dump(void) {
 			printf("*|i:%016"PRIX64"|v:%08"PRIX32"|g:%"PRIu8"|t:%10"PRIu32"\n",c->chunkid,c->version,c->goal,c->lockedto);
 		}
 	}
+	for (g=xorgroups ; g ; g=g->next) {
+		printf("^|p:%016"PRIX64"|l:%"PRIu8"|c:",g->parityid,g->level);
+		for (j=0 ; j<g->level ; j++) {
+			printf("%s%016"PRIX64"_%08"PRIX32,(j>0)?",":"",g->chunkid[j],g->version[j]);
+		}
+		printf("\n");
+	}
 }
 
 #endif
@@ -3077,7 +4202,7 @@ int chunk_load(FILE *fd) {
 	return 0;
 }
 
-void chunk_store(FILE *fd) {
+void chunk_store(metastream *ms) {
 	uint8_t hdr[8];
 	uint8_t storebuff[CHUNKFSIZE*CHUNKCNT];
 	uint8_t *ptr;
@@ -3094,11 +4219,11 @@ void chunk_store(FILE *fd) {
 #endif
 	ptr = hdr;
 	put64bit(&ptr,nextchunkid);
-	fwrite(hdr,1,8,fd);
+	metastream_write(ms,hdr,8);
 	j=0;
 	ptr = storebuff;
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (c=chunkhash[i] ; c ; c=c->next) {
+	for (i=0 ; i<chunkhashsize ; i++) {
+		for (c=*HASHBUCKET(i) ; c ; c=c->next) {
 			chunkid = c->chunkid;
 			put64bit(&ptr,chunkid);
 			version = c->version;
@@ -3108,9 +4233,10 @@ void chunk_store(FILE *fd) {
 				lockedto = 0;
 			}
 			put32bit(&ptr,lockedto);
+			metastream_record(ms);
 			j++;
 			if (j==CHUNKCNT) {
-				fwrite(storebuff,1,CHUNKFSIZE*CHUNKCNT,fd);
+				metastream_write(ms,storebuff,CHUNKFSIZE*CHUNKCNT);
 				j=0;
 				ptr = storebuff;
 			}
@@ -3118,9 +4244,140 @@ void chunk_store(FILE *fd) {
 	}
 	memset(ptr,0,CHUNKFSIZE);
 	j++;
-	fwrite(storebuff,1,CHUNKFSIZE*j,fd);
+	metastream_write(ms,storebuff,CHUNKFSIZE*j);
 }
 
+#ifndef METARESTORE
+// stops or (re)starts collecting ids of modified chunks - all collected ids are dropped
+void chunk_delta_reset(uint8_t track) {
+	uint32_t i;
+	chunk *c;
+	for (i=0 ; i<deltacnt ; i++) {
+		c = chunk_find(deltaids[i]);
+		if (c) {
+			c->dirty = 0;
+		}
+	}
+	deltacnt = 0;
+	deltaon = track;
+}
+
+// chunk delta: nextchunkid:64 , records of modified chunks (as in chunk_store) ended by empty record , deleted:32 , deleted*[ chunkid:64 ]
+void chunk_delta_store(metastream *ms) {
+	uint8_t hdr[8];
+	uint8_t storebuff[CHUNKFSIZE*CHUNKCNT];
+	uint8_t *ptr;
+	uint32_t i,j,k;
+	chunk *c;
+	uint32_t lockedto,now;
+
+	now = get_current_time();
+	ptr = hdr;
+	put64bit(&ptr,nextchunkid);
+	metastream_write(ms,hdr,8);
+	j=0;
+	k=0;
+	ptr = storebuff;
+	for (i=0 ; i<deltacnt ; i++) {
+		c = chunk_find(deltaids[i]);
+		if (c==NULL) {
+			deltaids[k++] = deltaids[i];	// deleted - keep id for the second part
+		} else if (c->dirty) {
+			c->dirty = 0;
+			put64bit(&ptr,c->chunkid);
+			put32bit(&ptr,c->version);
+			lockedto = c->lockedto;
+			if (lockedto<now) {
+				lockedto = 0;
+			}
+			put32bit(&ptr,lockedto);
+			metastream_record(ms);
+			j++;
+			if (j==CHUNKCNT) {
+				metastream_write(ms,storebuff,CHUNKFSIZE*CHUNKCNT);
+				j=0;
+				ptr = storebuff;
+			}
+		}
+	}
+	memset(ptr,0,CHUNKFSIZE);
+	j++;
+	metastream_write(ms,storebuff,CHUNKFSIZE*j);
+	ptr = hdr;
+	put32bit(&ptr,k);
+	metastream_write(ms,hdr,4);
+	for (i=0 ; i<k ; i++) {
+		ptr = hdr;
+		put64bit(&ptr,deltaids[i]);
+		metastream_write(ms,hdr,8);
+	}
+	deltacnt = 0;
+}
+#else
+// applies chunk delta written by chunk_delta_store - first new and changed chunks, then (when 'deleted' is set) removes deleted ones, so files can be updated in between
+int chunk_delta_load(FILE *fd,uint8_t deleted) {
+	uint8_t buff[CHUNKFSIZE];
+	const uint8_t *ptr;
+	uint64_t chunkid;
+	uint32_t k;
+	chunk *c,**cp;
+
+	if (fread(buff,1,8,fd)!=8) {
+		return -1;
+	}
+	ptr = buff;
+	nextchunkid = get64bit(&ptr);
+	for (;;) {
+		if (fread(buff,1,CHUNKFSIZE,fd)!=CHUNKFSIZE) {
+			return -1;
+		}
+		ptr = buff;
+		chunkid = get64bit(&ptr);
+		if (chunkid==0) {
+			break;
+		}
+		if (deleted) {
+			continue;
+		}
+		c = chunk_find(chunkid);
+		if (c==NULL) {
+			c = chunk_new(chunkid);
+		}
+		c->version = get32bit(&ptr);
+		c->lockedto = get32bit(&ptr);
+	}
+	if (deleted==0) {
+		return 0;
+	}
+	if (fread(buff,1,4,fd)!=4) {
+		return -1;
+	}
+	ptr = buff;
+	k = get32bit(&ptr);
+	while (k>0) {
+		if (fread(buff,1,8,fd)!=8) {
+			return -1;
+		}
+		ptr = buff;
+		chunkid = get64bit(&ptr);
+		for (cp=HASHBUCKET(chunk_hashpos(chunkid)) ; (c=*cp) ; cp=&(c->next)) {
+			if (c->chunkid==chunkid) {
+				*cp = c->next;
+				chunkhashelements--;
+				if (lastchunkptr==c) {
+					lastchunkid = 0;
+					lastchunkptr = NULL;
+				}
+				chunk_free(c);
+				break;
+			}
+		}
+		k--;
+	}
+	return 0;
+}
+#endif
+
 void chunk_newfs(void) {
 #ifndef METARESTORE
 	chunks = 0;
@@ -3129,9 +4386,8 @@ void chunk_newfs(void) {
 }
 
 void chunk_strinit(void) {
-	uint32_t i;
 #ifndef METARESTORE
-	uint32_t j;
+	uint32_t i,j;
 	ReplicationsDelayInit = cfg_getuint32("REPLICATIONS_DELAY_INIT",300);
 	ReplicationsDelayDisconnect = cfg_getuint32("REPLICATIONS_DELAY_DISCONNECT",3600);
 	MaxDel = cfg_getuint32("CHUNKS_DEL_LIMIT",100);
@@ -3141,12 +4397,13 @@ void chunk_strinit(void) {
 	MaxWriteRepl = cfg_getuint32("CHUNKS_WRITE_REP_LIMIT",1);
 	MaxReadRepl = cfg_getuint32("CHUNKS_READ_REP_LIMIT",5);
 	LoopTime = cfg_getuint32("CHUNKS_LOOP_TIME",300);
-	HashSteps = 1+((HASHSIZE)/LoopTime);
+	RebalanceQueueMax = cfg_getuint32("CHUNKS_REBALANCE_QUEUE",10000);
+	RebalanceSrcLimit = cfg_getuint32("CHUNKS_REBALANCE_SRC_LIMIT",2);
+	RebalanceDstLimit = cfg_getuint32("CHUNKS_REBALANCE_DST_LIMIT",1);
+	XorColdTime = cfg_getuint32("CHUNKS_XOR_COLD_TIME",3600);
 //	config_getnewstr("CHUNKS_CONFIG",ETC_PATH "/mfschunks.cfg",&CfgFileName);
 #endif
-	for (i=0 ; i<HASHSIZE ; i++) {
-		chunkhash[i]=NULL;
-	}
+	chunk_hash_init();
 #ifndef METARESTORE
 	for (i=0 ; i<11 ; i++) {
 		for (j=0 ; j<11 ; j++) {
@@ -3164,8 +4421,9 @@ void chunk_strinit(void) {
 	main_timeregister(TIMEMODE_RUNONCE,30,0,chunk_cfg_check);
 */
 	if(ismaster()) {
-		main_timeregister(TIMEMODE_RUNONCE,1,0,chunk_jobs_main);
+		chunk_jobs_start();
 	}
+	main_eachloopregister(chunk_server_disconnection_loop);
 	main_timeregister(TIMEMODE_RUNONCE,60,0,log_print_control_ck);
 #endif
 }
@@ -3187,7 +4445,7 @@ int slave_chunk_delete_file(uint64_t chunkid,uint32_t inode,uint16_t indx) {
                         flist_free(f);
                         i=1;
                 } else {
-                        if (f->goal > c->goal) {
+                        if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
                                 c->goal = f->goal;
                         }
                         fp = &(f->next);
@@ -3219,7 +4477,7 @@ int slave_chunk_add_file(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t g
                         f->goal = goal;
                         i=1;
                 }
-                if (f->goal > c->goal) {
+                if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
                         c->goal = f->goal;
                 }
         }
@@ -3230,7 +4488,7 @@ int slave_chunk_add_file(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t g
                 f->goal = goal;
                 f->next = c->flisthead;
                 c->flisthead = f;
-                if (goal > c->goal) {
+                if (GOAL_RANK(goal) > GOAL_RANK(c->goal)) {
                         c->goal = goal;
                 }
         } else {
@@ -3270,9 +4528,9 @@ int slave_chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,ui
 		 */
 #ifndef METARESTORE
 		allchunkcounts[0][0]--;
-		allchunkcounts[c->goal][0]++;
+		allchunkcounts[CHUNK_GOAL_ROW(c->goal)][0]++;
 		regularchunkcounts[0][0]--;
-		regularchunkcounts[c->goal][0]++;
+		regularchunkcounts[CHUNK_GOAL_ROW(c->goal)][0]++;
 #endif
 	} else {
 		c = NULL;
@@ -3312,7 +4570,7 @@ int slave_chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,ui
 			*nchunkid = c->chunkid;
 			oc->goal = 0;
 			for (f=oc->flisthead ; f ; f=f->next) {
-				if (f->goal > oc->goal) {
+				if (GOAL_RANK(f->goal) > GOAL_RANK(oc->goal)) {
 					oc->goal = f->goal;
 				}
 			}
@@ -3365,7 +4623,7 @@ int slave_chunk_multi_truncate(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,
         *nchunkid = c->chunkid;
         oc->goal = 0;
         for (f=oc->flisthead ; f ; f=f->next) {
-            if (f->goal > oc->goal) {
+            if (GOAL_RANK(f->goal) > GOAL_RANK(oc->goal)) {
                 oc->goal = f->goal;
             }
         }
@@ -3571,12 +4829,33 @@ void* chunk_unittest_create_by_servlist(void *ptrs[], uint8_t repnum, uint8_t go
 		s->version = c->version;
 		s->next = c->slisthead;
 		c->slisthead = s;
+		chunk_hlist_add(ptrs[i], c);
 	}
     return c;
 }
 
+uint8_t chunk_unittest_validcopies(uint64_t chunkid) {
+    chunk *c = chunk_find(chunkid);
+    return c ? c->allvalidcopies : 0;
+}
+
+uint32_t chunk_unittest_rebalance_plan(void *src[], void *dst[], uint32_t max) {
+    rebalmove *m;
+    uint32_t n = 0;
+    chunk_rebalance_plan();
+    for(m=rebalqhead; m && n<max; m=m->next) {
+        src[n] = m->src;
+        dst[n] = m->dst;
+        n++;
+    }
+    return n;
+}
+
 void chunk_uinttest_init(uint32_t readrep, uint32_t writerep) {
     MaxReadRepl = readrep;
     MaxWriteRepl = writerep;
+    RebalanceQueueMax = 10000;
+    RebalanceSrcLimit = 2;
+    RebalanceDstLimit = 1;
 }
 #endif
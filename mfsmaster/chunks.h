@@ -22,6 +22,7 @@
 #include <inttypes.h>
 
 #include "main.h"
+#include "metastream.h"
 
 /*
 int chunk_create(uint64_t *chunkid,uint8_t goal);
@@ -48,10 +49,11 @@ void chunk_dump(void);
 
 #else
 
-void chunk_jobs_main(void);
+void chunk_jobs_start(void);
 int chunk_increase_version(uint64_t chunkid);
 
 void chunk_stats(uint32_t *del,uint32_t *repl);
+void chunk_rebalance_stats(uint64_t *bytesleft,uint32_t *eta,uint64_t *moved);
 void chunk_store_info(uint8_t *buff);
 void chunk_store_chunkcounters(uint8_t *buff,uint8_t matrixid);
 uint32_t chunk_count(void);
@@ -67,7 +69,8 @@ int chunk_add_file(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t goal);
 //int chunk_writelock(uint64_t chunkid);
 int chunk_unlock(uint64_t chunkid);
 
-int chunk_multi_modify(uint64_t *nchunkid,uint64_t ochunkid,uint32_t inode,uint16_t indx,uint8_t goal,uint8_t *opflag);
+int chunk_lease_renew(uint64_t chunkid,uint32_t sessionid);
+int chunk_multi_modify(uint64_t *nchunkid,uint64_t ochunkid,uint32_t inode,uint16_t indx,uint8_t goal,uint32_t sessionid,uint8_t *opflag);
 int chunk_multi_truncate(uint64_t *nchunkid,uint64_t ochunkid,uint32_t length,uint32_t inode,uint16_t indx,uint8_t goal);
 //int chunk_multi_reinitialize(uint64_t chunkid);
 int chunk_repair(uint32_t inode,uint16_t indx,uint64_t ochunkid,uint32_t *nversion);
@@ -104,7 +107,17 @@ int slave_chunk_set_version(uint64_t chunkid,uint32_t version);
 
 // int chunk_load_1_1(FILE *fd);
 int chunk_load(FILE *fd);
-void chunk_store(FILE *fd);
+void chunk_store(metastream *ms);
+int chunk_xor_add(uint64_t parityid,uint8_t level,const uint64_t *chunkid,const uint32_t *version);
+int chunk_xor_delete(uint64_t parityid);
+int chunk_xor_load(FILE *fd);
+void chunk_xor_store(metastream *ms);
+#ifndef METARESTORE
+void chunk_delta_reset(uint8_t track);
+void chunk_delta_store(metastream *ms);
+#else
+int chunk_delta_load(FILE *fd,uint8_t deleted);
+#endif
 void chunk_newfs(void);
 void chunk_strinit(void);
 
@@ -113,6 +126,8 @@ void* chunk_unittest_delete_overgoal(void *chunk_ptr);
 void* chunk_unittest_recovery_select(void *chunk_ptr);
 int chunk_unittest_banlance(void *chunk_ptr, void **pptr_src, void **pptr_dst);
 void* chunk_unittest_create_by_servlist(void *ptrs[], uint8_t repnum, uint8_t goal);
+uint8_t chunk_unittest_validcopies(uint64_t chunkid);
+uint32_t chunk_unittest_rebalance_plan(void *src[], void *dst[], uint32_t max);
 void chunk_uinttest_init(uint32_t readrep, uint32_t writerep);
 
 #endif
@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
@@ -31,6 +32,10 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include "MFSCommunication.h"
 
 #include <sys/types.h>
@@ -47,6 +52,8 @@
 #include "chunks.h"
 #include "filesystem.h"
 #include "datapack.h"
+#include "crc.h"
+#include "metastream.h"
 #include "main.h"
 
 #ifndef METARESTORE
@@ -77,17 +84,17 @@ uint32_t QuotaTimeLimit;
 
 #endif
 
-uint32_t *freebitmask;
-uint32_t bitmasksize;
-uint32_t searchpos;
+static uint64_t *idmask[3];
+static uint32_t idmaskl2words;
+static uint32_t idmaskl2pos;
 freenode *freelist,**freetail;
 
 fsedge *trash;
 fsedge *reserved;
 fsnode *root;
-fsnode* nodehash[NODEHASHSIZE];
+fsnode ***nodetab;
+uint32_t nodetabpages;
 #ifdef EDGEHASH
-fsedge* edgehash[EDGEHASHSIZE];
 #endif
 
 uint32_t maxnodeid;
@@ -265,25 +272,289 @@ static inline void sessionidrec_free(sessionidrec* p) {
 
 #endif /* USE_CUIDREC_BUCKETS */
 
-uint32_t fsnodes_get_next_id() {
-	uint32_t i,mask;
-	while (searchpos<bitmasksize && freebitmask[searchpos]==0xFFFFFFFF) {
-		searchpos++;
+#ifdef USE_FSOBJ_SLABS
+// nodes and edges are taken from size-classed slabs - edges with names up to FSEDGE_INLINE_MAX bytes keep the name in the same slot right after the edge
+#define FSSLAB_BUCKET_BYTES 0x40000
+#define FSEDGE_CLASSES ((FSEDGE_INLINE_MAX/8)+1)
+#define FSEDGE_INLINE(e) ((uint8_t*)((e)+1))
+#define FSSLAB_ESIZE(size) (((size)+7)&~((size_t)7))
+#define FSNODE_ESIZE FSSLAB_ESIZE(sizeof(fsnode))
+#define FSEDGE_ESIZE(eclass) FSSLAB_ESIZE(sizeof(fsedge)+(eclass)*8)
+
+typedef struct _fsslab_bucket {
+	struct _fsslab_bucket *next;
+	uint64_t data[];
+} fsslab_bucket;
+
+typedef struct _fsslab {
+	uint32_t firstfree;
+	fsslab_bucket *head;
+	void *freehead;
+	uint64_t buckets;
+	uint64_t used;
+} fsslab;
+
+typedef struct _fsobj_slabs {
+	fsslab nodes;
+	fsslab edges[FSEDGE_CLASSES];
+} fsobj_slabs;
+
+static fsobj_slabs fsobjslabs;
+
+static inline void* fsslab_malloc(fsslab *s,uint32_t esize) {
+	fsslab_bucket *b;
+	void *ret;
+	if (s->freehead) {
+		ret = s->freehead;
+		s->freehead = *((void**)ret);
+		s->used++;
+		return ret;
 	}
-	if (searchpos==bitmasksize) {	// no more freeinodes
-		bitmasksize+=0xF0;
-		freebitmask = (uint32_t*)realloc(freebitmask,bitmasksize*sizeof(uint32_t));
-		memset(freebitmask+searchpos,0,0xF0*sizeof(uint32_t));
+	if (s->head==NULL || s->firstfree==FSSLAB_BUCKET_BYTES/esize) {
+		b = (fsslab_bucket*)malloc(sizeof(fsslab_bucket)+FSSLAB_BUCKET_BYTES);
+		if (b==NULL) {
+			return NULL;
+		}
+		b->next = s->head;
+		s->head = b;
+		s->firstfree = 0;
+		s->buckets++;
 	}
-	mask = freebitmask[searchpos];
-	i=0;
-	while (mask&1) {
+	ret = ((uint8_t*)(s->head->data))+(s->firstfree*esize);
+	s->firstfree++;
+	s->used++;
+	return ret;
+}
+
+static inline void fsslab_free(fsslab *s,void *p) {
+	*((void**)p) = s->freehead;
+	s->freehead = p;
+	s->used--;
+}
+
+// moves all objects of slab 'src' to slab 'dst' - unused tail of the source head bucket goes to the free list
+static void fsslab_merge(fsslab *dst,fsslab *src,uint32_t esize) {
+	fsslab_bucket *b;
+	uint8_t *p;
+	uint32_t i;
+	if (src->head!=NULL) {
+		if (dst->head==NULL) {
+			dst->head = src->head;
+			dst->firstfree = src->firstfree;
+		} else {
+			for (i=src->firstfree ; i<FSSLAB_BUCKET_BYTES/esize ; i++) {
+				p = ((uint8_t*)(src->head->data))+(i*esize);
+				*((void**)p) = dst->freehead;
+				dst->freehead = p;
+			}
+			for (b=dst->head ; b->next ; b=b->next) {}
+			b->next = src->head;
+		}
+	}
+	if (src->freehead!=NULL) {
+		for (p=src->freehead ; *((void**)p) ; p=*((void**)p)) {}
+		*((void**)p) = dst->freehead;
+		dst->freehead = src->freehead;
+	}
+	dst->buckets += src->buckets;
+	dst->used += src->used;
+	memset(src,0,sizeof(fsslab));
+}
+
+static inline fsnode* fsnode_slab_malloc(fsobj_slabs *s) {
+	return (fsnode*)fsslab_malloc(&(s->nodes),FSNODE_ESIZE);
+}
+
+static inline fsnode* fsnode_malloc() {
+	return fsnode_slab_malloc(&fsobjslabs);
+}
+
+static inline void fsnode_free(fsnode *p) {
+	fsslab_free(&(fsobjslabs.nodes),p);
+}
+
+// returns edge with name buffer for nleng bytes (name is NULL for nleng==0 - caller sets it)
+static inline fsedge* fsedge_slab_malloc(fsobj_slabs *s,uint16_t nleng) {
+	fsedge *e;
+	uint8_t eclass;
+	eclass = (nleng<=FSEDGE_INLINE_MAX)?(nleng+7)/8:0;
+	e = (fsedge*)fsslab_malloc(s->edges+eclass,FSEDGE_ESIZE(eclass));
+	if (e==NULL) {
+		return NULL;
+	}
+	e->eclass = eclass;
+	e->delta = 0;
+	if (eclass>0) {
+		e->name = FSEDGE_INLINE(e);
+	} else if (nleng>0) {
+		e->name = malloc(nleng);
+	} else {
+		e->name = NULL;
+	}
+	return e;
+}
+
+static inline fsedge* fsedge_malloc(uint16_t nleng) {
+	return fsedge_slab_malloc(&fsobjslabs,nleng);
+}
+
+static inline void fsedge_name_free(fsedge *e) {
+	if (e->eclass==0 || e->name!=FSEDGE_INLINE(e)) {
+		free(e->name);
+	}
+}
+
+static inline void fsedge_free(fsedge *e) {
+	fsedge_name_free(e);
+	fsslab_free(fsobjslabs.edges+e->eclass,e);
+}
+
+// private slabs are used by loader threads and then merged into the global ones
+static void fsobj_slabs_merge(fsobj_slabs *s) {
+	uint32_t i;
+	fsslab_merge(&(fsobjslabs.nodes),&(s->nodes),FSNODE_ESIZE);
+	for (i=0 ; i<FSEDGE_CLASSES ; i++) {
+		fsslab_merge(fsobjslabs.edges+i,s->edges+i,FSEDGE_ESIZE(i));
+	}
+}
+
+static inline void fsobj_slabs_info(uint64_t *allocated,uint64_t *used) {
+	uint32_t i;
+	*allocated = fsobjslabs.nodes.buckets*FSSLAB_BUCKET_BYTES;
+	*used = fsobjslabs.nodes.used*FSNODE_ESIZE;
+	for (i=0 ; i<FSEDGE_CLASSES ; i++) {
+		*allocated += fsobjslabs.edges[i].buckets*FSSLAB_BUCKET_BYTES;
+		*used += fsobjslabs.edges[i].used*FSEDGE_ESIZE(i);
+	}
+}
+#else /* USE_FSOBJ_SLABS */
+
+typedef struct _fsobj_slabs {
+	uint8_t dummy;
+} fsobj_slabs;
+
+static inline fsnode* fsnode_malloc() {
+	return (fsnode*)malloc(sizeof(fsnode));
+}
+
+static inline fsnode* fsnode_slab_malloc(fsobj_slabs *s) {
+	(void)s;
+	return fsnode_malloc();
+}
+
+static inline void fsnode_free(fsnode *p) {
+	free(p);
+}
+
+static inline fsedge* fsedge_malloc(uint16_t nleng) {
+	fsedge *e;
+	e = (fsedge*)malloc(sizeof(fsedge));
+	if (e==NULL) {
+		return NULL;
+	}
+	e->delta = 0;
+	e->name = (nleng>0)?malloc(nleng):NULL;
+	return e;
+}
+
+static inline fsedge* fsedge_slab_malloc(fsobj_slabs *s,uint16_t nleng) {
+	(void)s;
+	return fsedge_malloc(nleng);
+}
+
+static void fsobj_slabs_merge(fsobj_slabs *s) {
+	(void)s;
+}
+
+static inline void fsedge_name_free(fsedge *e) {
+	free(e->name);
+}
+
+static inline void fsedge_free(fsedge *e) {
+	free(e->name);
+	free(e);
+}
+
+static inline void fsobj_slabs_info(uint64_t *allocated,uint64_t *used) {
+	*allocated = 0;
+	*used = 0;
+}
+#endif /* USE_FSOBJ_SLABS */
+
+/* free inode bitmap - level 0 has one bit per inode (set - inode used), level 1 one bit per level 0 word (set - word full)
+   and level 2 one bit per level 1 word; the lowest free inode is found by going down from the first not full level 2 word,
+   so allocation always returns the same inode as linear search did (changelog replay depends on it) */
+#define IDMASK_L2BITS 18	// inodes covered by one level 2 word (64*64*64)
+#define IDMASK_RESERVE 0x4000	// free inodes always available above maxnodeid after initialization
+
+static inline uint32_t fsnodes_ctz64(uint64_t x) {
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#else
+	uint32_t i = 0;
+	while ((x&1)==0) {
 		i++;
-		mask>>=1;
+		x>>=1;
+	}
+	return i;
+#endif
+}
+
+static inline void fsnodes_freebitmask_resize(uint32_t l2words) {
+	uint32_t i;
+	idmask[0] = (uint64_t*)realloc(idmask[0],sizeof(uint64_t)*((uint64_t)l2words<<12));
+	idmask[1] = (uint64_t*)realloc(idmask[1],sizeof(uint64_t)*((uint64_t)l2words<<6));
+	idmask[2] = (uint64_t*)realloc(idmask[2],sizeof(uint64_t)*l2words);
+	for (i=idmaskl2words ; i<l2words ; i++) {
+		memset(idmask[0]+((uint64_t)i<<12),0,sizeof(uint64_t)<<12);
+		memset(idmask[1]+((uint64_t)i<<6),0,sizeof(uint64_t)<<6);
+		idmask[2][i] = 0;
+	}
+	idmaskl2words = l2words;
+}
+
+static inline void fsnodes_freebitmask_set(uint32_t id) {
+	uint32_t w0,w1,l2words;
+	l2words = (id>>IDMASK_L2BITS)+1;
+	if (l2words>idmaskl2words) {
+		fsnodes_freebitmask_resize(l2words);
+	}
+	w0 = id>>6;
+	idmask[0][w0] |= UINT64_C(1)<<(id&0x3F);
+	if (idmask[0][w0]==UINT64_C(0xFFFFFFFFFFFFFFFF)) {
+		w1 = w0>>6;
+		idmask[1][w1] |= UINT64_C(1)<<(w0&0x3F);
+		if (idmask[1][w1]==UINT64_C(0xFFFFFFFFFFFFFFFF)) {
+			idmask[2][w1>>6] |= UINT64_C(1)<<(w1&0x3F);
+		}
+	}
+}
+
+static inline void fsnodes_freebitmask_clear(uint32_t id) {
+	uint32_t w0,w1;
+	w0 = id>>6;
+	w1 = w0>>6;
+	idmask[0][w0] &= ~(UINT64_C(1)<<(id&0x3F));
+	idmask[1][w1] &= ~(UINT64_C(1)<<(w0&0x3F));
+	idmask[2][w1>>6] &= ~(UINT64_C(1)<<(w1&0x3F));
+	if ((w1>>6)<idmaskl2pos) {
+		idmaskl2pos = w1>>6;
 	}
-	mask = 1<<i;
-	freebitmask[searchpos] |= mask;
-	i+=(searchpos<<5);
+}
+
+uint32_t fsnodes_get_next_id() {
+	uint32_t w0,w1,i;
+	// all level 2 words before idmaskl2pos are full
+	while (idmaskl2pos<idmaskl2words && idmask[2][idmaskl2pos]==UINT64_C(0xFFFFFFFFFFFFFFFF)) {
+		idmaskl2pos++;
+	}
+	if (idmaskl2pos==idmaskl2words) {	// no more free inodes
+		fsnodes_freebitmask_resize(idmaskl2words+1);
+	}
+	w1 = (idmaskl2pos<<6) + fsnodes_ctz64(~idmask[2][idmaskl2pos]);
+	w0 = (w1<<6) + fsnodes_ctz64(~idmask[1][w1]);
+	i = (w0<<6) + fsnodes_ctz64(~idmask[0][w0]);
+	fsnodes_freebitmask_set(i);
 	if (i>maxnodeid) {
 		maxnodeid=i;
 	}
@@ -300,12 +571,120 @@ void fsnodes_free_id(uint32_t id,uint32_t ts) {
 	freetail = &(n->next);
 }
 
+#ifndef METARESTORE
+// incremental checkpoints - inodes changed since the last checkpoint are marked in bitmaps (one per nodetab page), names created since then have 'delta' flag set and removed names of older edges are kept as tombstones (parent:32 nleng:16 name)
+static uint8_t fsdeltaon = 0;
+static uint32_t **fsdirtytab = NULL;
+static uint32_t fsdirtypages = 0;
+static uint8_t *fsdeltadel = NULL;
+static uint32_t fsdeltadelleng = 0;
+static uint32_t fsdeltadelsize = 0;
+
+static inline void fsnodes_dirty_id(uint32_t id) {
+	uint32_t page;
+	if (fsdeltaon==0 || id==0) {
+		return;
+	}
+	page = NODETABPAGE(id);
+	if (page>=fsdirtypages) {
+		fsdirtytab = (uint32_t**)realloc(fsdirtytab,sizeof(uint32_t*)*(page+1));
+		while (fsdirtypages<=page) {
+			fsdirtytab[fsdirtypages++] = NULL;
+		}
+	}
+	if (fsdirtytab[page]==NULL) {
+		fsdirtytab[page] = (uint32_t*)malloc(NODETABPAGESIZE/8);
+		memset(fsdirtytab[page],0,NODETABPAGESIZE/8);
+	}
+	fsdirtytab[page][NODETABPOS(id)>>5] |= (1U<<(id&0x1F));
+}
+
+static inline void fsnodes_dirty(fsnode *p) {
+	fsnodes_dirty_id(p->id);
+}
+
+static inline void fsnodes_dirty_newedge(fsedge *e) {
+	e->delta = fsdeltaon;
+}
+
+static inline void fsnodes_dirty_deledge(fsedge *e) {
+	uint8_t *ptr;
+	if (fsdeltaon==0 || e->parent==NULL || e->delta) {
+		return;
+	}
+	if (fsdeltadelleng+4+2+e->nleng>fsdeltadelsize) {
+		fsdeltadelsize = (fsdeltadelsize>0)?fsdeltadelsize*2:0x10000;
+		fsdeltadel = (uint8_t*)realloc(fsdeltadel,fsdeltadelsize);
+	}
+	ptr = fsdeltadel+fsdeltadelleng;
+	put32bit(&ptr,e->parent->id);
+	put16bit(&ptr,e->nleng);
+	memcpy(ptr,e->name,e->nleng);
+	fsdeltadelleng += 4+2+e->nleng;
+}
+
+// arguments of changelog entries (bit per argument, 0 - timestamp) which are inodes changed by the operation
+static const uint32_t fsdirtyargs[CHLOG_OPCOUNT] = {
+	[CHLOG_ACCESS] = 1<<1,
+	[CHLOG_APPEND] = 1<<1 | 1<<2,
+	[CHLOG_AQUIRE] = 1<<1,
+	[CHLOG_ATTR] = 1<<1,
+	[CHLOG_CREATE] = 1<<1 | 1<<8,
+	[CHLOG_EATTR] = 1<<1,
+	[CHLOG_LENGTH] = 1<<1,
+	[CHLOG_LINK] = 1<<1 | 1<<2,
+	[CHLOG_MOVE] = 1<<1 | 1<<3 | 1<<5,
+	[CHLOG_PURGE] = 1<<1,
+	[CHLOG_REINIT] = 1<<1,
+	[CHLOG_RELEASE] = 1<<1,
+	[CHLOG_REPAIR] = 1<<1,
+	[CHLOG_SETEATTR] = 1<<1,
+	[CHLOG_SETGOAL] = 1<<1,
+	[CHLOG_SETPATH] = 1<<1,
+	[CHLOG_SETTRASHTIME] = 1<<1,
+	[CHLOG_SETTRASHTO] = 1<<1,
+	[CHLOG_SNAPSHOT] = 1<<2,
+	[CHLOG_SYMLINK] = 1<<1 | 1<<6,
+	[CHLOG_TRUNC] = 1<<1,
+	[CHLOG_UNDEL] = 1<<1,
+	[CHLOG_UNLINK] = 1<<1 | 1<<3,
+	[CHLOG_WRITE] = 1<<1,
+};
+
+// every change made by master is logged here - inodes named in the entry are marked for the next delta ; objects changed as a side effect (names, recursive operations, snapshots, emptied trash) are marked by fsnodes_* helpers
+static void fs_changelog(uint8_t op,...) {
+	static uint8_t recbuff[CHLOG_MAXRECSIZE];
+	va_list ap;
+	uint32_t leng,mask;
+	uint8_t argno;
+
+	if (isslave()) {
+		return;
+	}
+	va_start(ap,op);
+	leng = changelogrec_pack(recbuff,version++,op,ap);
+	va_end(ap);
+	if (fsdeltaon) {
+		for (mask=fsdirtyargs[op],argno=0 ; mask ; mask>>=1,argno++) {
+			if (mask&1) {
+				fsnodes_dirty_id(changelogrec_getnum(recbuff,leng,argno));
+			}
+		}
+	}
+	changelog_rec(recbuff,leng);
+}
+#else
+#define fsnodes_dirty(p)
+#define fsnodes_dirty_newedge(e)
+#define fsnodes_dirty_deledge(e)
+#endif
+
 #ifndef METARESTORE
 void fsnodes_freeinodes(void) {
 #else
 uint8_t fs_freeinodes(uint32_t ts,uint32_t freeinodes) {
 #endif
-	uint32_t fi,now,pos,mask;
+	uint32_t fi,now;
 	freenode *n,*an;
 #ifndef METARESTORE
 	now = get_current_time();
@@ -316,12 +695,7 @@ uint8_t fs_freeinodes(uint32_t ts,uint32_t freeinodes) {
 	n = freelist;
 	while (n && n->ftime+86400<now) {
 		fi++;
-		pos = (n->id >> 5);
-		mask = 1<<(n->id&0x1F);
-		freebitmask[pos] &= ~mask;
-		if (pos<searchpos) {
-			searchpos = pos;
-		}
+		fsnodes_freebitmask_clear(n->id);
 		an = n->next;
 		freenode_free(n);
 		n = an;
@@ -333,7 +707,7 @@ uint8_t fs_freeinodes(uint32_t ts,uint32_t freeinodes) {
 		freetail = &(freelist);
 	}
 #ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|FREEINODES():%"PRIu32,(uint32_t)get_current_time(),fi);
+	fs_changelog(CHLOG_FREEINODES,(uint32_t)get_current_time(),fi);
 #else
 	version++;
 	if (freeinodes!=fi) {
@@ -344,18 +718,21 @@ uint8_t fs_freeinodes(uint32_t ts,uint32_t freeinodes) {
 }
 
 void fsnodes_init_freebitmask (void) {
-	bitmasksize = 0x200+(((maxnodeid)>>5)&0xFFFFFF80);
-	freebitmask = (uint32_t*)malloc(bitmasksize*sizeof(uint32_t));
-	memset(freebitmask,0,bitmasksize*sizeof(uint32_t));
-	freebitmask[0]=1;	// reserve inode 0
-	searchpos = 0;
+	uint32_t i;
+	for (i=0 ; i<3 ; i++) {
+		if (idmask[i]) {
+			free(idmask[i]);
+			idmask[i] = NULL;
+		}
+	}
+	idmaskl2words = 0;
+	idmaskl2pos = 0;
+	fsnodes_freebitmask_resize((((uint64_t)maxnodeid+IDMASK_RESERVE)>>IDMASK_L2BITS)+1);
+	fsnodes_freebitmask_set(0);	// reserve inode 0
 }
 
 void fsnodes_used_inode (uint32_t id) {
-	uint32_t pos,mask;
-	pos = id>>5;
-	mask = 1<<(id&0x1F);
-	freebitmask[pos]|=mask;
+	fsnodes_freebitmask_set(id);
 }
 
 
@@ -381,13 +758,31 @@ char* fsnodes_escape_name(uint16_t nleng,const uint8_t *name) {
 }
 */
 
+// buff - at least nleng*3+1 bytes
+static void fsnodes_escape_name_buff(char *buff,uint16_t nleng,const uint8_t *name) {
+	uint32_t i;
+	uint8_t c;
+	i = 0;
+	while (nleng>0) {
+		c = *name;
+		if (c<32 || c>=127 || c==',' || c=='%' || c=='(' || c==')') {
+			buff[i++]='%';
+			buff[i++]="0123456789ABCDEF"[(c>>4)&0xF];
+			buff[i++]="0123456789ABCDEF"[c&0xF];
+		} else {
+			buff[i++]=c;
+		}
+		name++;
+		nleng--;
+	}
+	buff[i]=0;
+}
+
 static char* fsnodes_escape_name(uint16_t nleng,const uint8_t *name) {
 	static char *escname[2]={NULL,NULL};
 	static uint32_t escnamesize[2]={0,0};
 	static uint8_t buffid=0;
-	char *currescname=NULL;
 	uint32_t i;
-	uint8_t c;
 	buffid = 1-buffid;
 	i = nleng;
 	i = i*3+1;
@@ -398,92 +793,136 @@ static char* fsnodes_escape_name(uint16_t nleng,const uint8_t *name) {
 		}
 		escname[buffid] = malloc(escnamesize[buffid]);
 	}
-	i = 0;
-	currescname = escname[buffid];
-	while (nleng>0) {
-		c = *name;
-		if (c<32 || c>=127 || c==',' || c=='%' || c=='(' || c==')') {
-			currescname[i++]='%';
-			currescname[i++]="0123456789ABCDEF"[(c>>4)&0xF];
-			currescname[i++]="0123456789ABCDEF"[c&0xF];
-		} else {
-			currescname[i++]=c;
-		}
-		name++;
-		nleng--;
-	}
-	currescname[i]=0;
-	return currescname;
+	fsnodes_escape_name_buff(escname[buffid],nleng,name);
+	return escname[buffid];
 }
 
 #ifdef EDGEHASH
-static inline uint32_t fsnodes_hash(uint32_t parentid,uint16_t nleng,const uint8_t *name) {
+static inline uint32_t fsnodes_hash(uint16_t nleng,const uint8_t *name) {
 	uint32_t hash,i;
-	hash = ((parentid * 0x5F2318BD) + nleng);
+	hash = nleng * 0x5F2318BD;
 	for (i=0 ; i<nleng ; i++) {
 		hash = hash*33+name[i];
 	}
+	hash ^= hash>>16;
+	hash *= 0x85EBCA6B;
+	hash ^= hash>>13;
 	return hash;
 }
-#endif
 
-static int fsnodes_nameisused(fsnode *node,uint16_t nleng,const uint8_t *name) {
-	fsedge *ei;
-#ifdef EDGEHASH
-	if (node->data.ddata.elements>LOOKUPNOHASHLIMIT) {
-		ei = edgehash[EDGEHASHPOS(fsnodes_hash(node->id,nleng,name))];
-		while (ei) {
-			if (ei->parent==node && nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-				return 1;
-			}
-			ei = ei->next;
+// per-directory name index - open addressing with linear probing, kept at most 3/4 full, built when directory has more than LOOKUPNOHASHLIMIT elements and dropped when it falls to LOOKUPNOHASHLIMIT/2
+static inline void fsnodes_nameidx_put(fsnameidx *ni,fsedge *e) {
+	uint32_t pos,mask;
+	mask = ni->size-1;
+	pos = e->hash & mask;
+	while (ni->slot[pos]) {
+		pos = (pos+1) & mask;
+	}
+	ni->slot[pos] = e;
+}
+
+static void fsnodes_nameidx_rebuild(fsnode *node) {
+	fsnameidx *ni;
+	fsedge *e;
+	uint32_t size;
+	size = NAMEIDXMINSIZE;
+	while (size < node->data.ddata.elements*2) {
+		size<<=1;
+	}
+	ni = malloc(sizeof(fsnameidx)+sizeof(fsedge*)*size);
+	memset(ni->slot,0,sizeof(fsedge*)*size);
+	ni->size = size;
+	for (e=node->data.ddata.children ; e ; e=e->nextchild) {
+		fsnodes_nameidx_put(ni,e);
+	}
+	if (node->data.ddata.nameidx) {
+		free(node->data.ddata.nameidx);
+	}
+	node->data.ddata.nameidx = ni;
+}
+
+// called after edge has been added to children list and elements counter
+static inline void fsnodes_nameidx_add(fsnode *node,fsedge *e) {
+	fsnameidx *ni;
+	ni = node->data.ddata.nameidx;
+	if (ni==NULL) {
+		if (node->data.ddata.elements>LOOKUPNOHASHLIMIT) {
+			fsnodes_nameidx_rebuild(node);
 		}
+	} else if (node->data.ddata.elements*4>ni->size*3) {
+		fsnodes_nameidx_rebuild(node);
 	} else {
-		ei = node->data.ddata.children;
-		while (ei) {
-			if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-				return 1;
-			}
-			ei = ei->nextchild;
+		fsnodes_nameidx_put(ni,e);
+	}
+}
+
+// called after edge has been removed from children list and elements counter
+static inline void fsnodes_nameidx_del(fsnode *node,fsedge *e) {
+	fsnameidx *ni;
+	uint32_t i,j,k,mask;
+	ni = node->data.ddata.nameidx;
+	if (ni==NULL) {
+		return;
+	}
+	if (node->data.ddata.elements<=LOOKUPNOHASHLIMIT/2) {
+		free(ni);
+		node->data.ddata.nameidx = NULL;
+		return;
+	}
+	if (ni->size>NAMEIDXMINSIZE && node->data.ddata.elements*8<ni->size) {
+		fsnodes_nameidx_rebuild(node);
+		return;
+	}
+	mask = ni->size-1;
+	i = e->hash & mask;
+	while (ni->slot[i]!=e) {
+		if (ni->slot[i]==NULL) {
+			return;
 		}
+		i = (i+1) & mask;
 	}
-#else
-	ei = node->data.ddata.children;
-	while (ei) {
-		if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-			return 1;
+// shift back following entries, so no tombstones are needed
+	j = i;
+	for (;;) {
+		j = (j+1) & mask;
+		if (ni->slot[j]==NULL) {
+			break;
+		}
+		k = ni->slot[j]->hash & mask;
+		if ((j>i && (k<=i || k>j)) || (j<i && k<=i && k>j)) {
+			ni->slot[i] = ni->slot[j];
+			i = j;
 		}
-		ei = ei->nextchild;
 	}
-#endif
-	return 0;
+	ni->slot[i] = NULL;
 }
+#endif
 
 static fsedge* fsnodes_lookup(fsnode *node,uint16_t nleng,const uint8_t *name) {
 	fsedge *ei;
+#ifdef EDGEHASH
+	fsnameidx *ni;
+	uint32_t hash,pos,mask;
+#endif
 
 	if (node->type!=TYPE_DIRECTORY) {
 		return NULL;
 	}
 #ifdef EDGEHASH
-	if (node->data.ddata.elements>LOOKUPNOHASHLIMIT) {
-		ei = edgehash[EDGEHASHPOS(fsnodes_hash(node->id,nleng,name))];
-		while (ei) {
-			if (ei->parent==node && nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-				return ei;
-			}
-			ei = ei->next;
-		}
-	} else {
-		ei = node->data.ddata.children;
-		while (ei) {
-			if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
+	ni = node->data.ddata.nameidx;
+	if (ni) {
+		hash = fsnodes_hash(nleng,name);
+		mask = ni->size-1;
+		pos = hash & mask;
+		while ((ei=ni->slot[pos])!=NULL) {
+			if (ei->hash==hash && nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
 				return ei;
 			}
-			ei = ei->nextchild;
+			pos = (pos+1) & mask;
 		}
+		return NULL;
 	}
-#else
+#endif
 	ei = node->data.ddata.children;
 	while (ei) {
 		if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
@@ -491,21 +930,59 @@ static fsedge* fsnodes_lookup(fsnode *node,uint16_t nleng,const uint8_t *name) {
 		}
 		ei = ei->nextchild;
 	}
-#endif
 	return NULL;
 }
 
+static inline int fsnodes_nameisused(fsnode *node,uint16_t nleng,const uint8_t *name) {
+	return (fsnodes_lookup(node,nleng,name)!=NULL)?1:0;
+}
+
+// inode table - pages are allocated up to the highest used page, so every page below nodetabpages exists
 static inline fsnode* fsnodes_id_to_node(uint32_t id) {
-	fsnode *p;
-	uint32_t nodepos = NODEHASHPOS(id);
-	for (p=nodehash[nodepos]; p ; p=p->next ) {
-		if (p->id == id) {
-			return p;
-		}
+	if (NODETABPAGE(id)<nodetabpages) {
+		return nodetab[NODETABPAGE(id)][NODETABPOS(id)];
 	}
 	return NULL;
 }
 
+// allocates all pages up to the one containing 'id'
+static inline void fsnodes_nodetab_reserve(uint32_t id) {
+	uint32_t newpages;
+	newpages = NODETABPAGE(id)+1;
+	if (newpages>nodetabpages) {
+		nodetab = (fsnode***)realloc(nodetab,sizeof(fsnode**)*newpages);
+		while (nodetabpages<newpages) {
+			nodetab[nodetabpages] = (fsnode**)malloc(sizeof(fsnode*)*NODETABPAGESIZE);
+			memset(nodetab[nodetabpages],0,sizeof(fsnode*)*NODETABPAGESIZE);
+			nodetabpages++;
+		}
+	}
+}
+
+static inline void fsnodes_nodetab_insert(fsnode *p) {
+	fsnodes_nodetab_reserve(p->id);
+	nodetab[NODETABPAGE(p->id)][NODETABPOS(p->id)] = p;
+	if (p->id>maxnodeid) {
+		maxnodeid = p->id;
+	}
+}
+
+static inline void fsnodes_nodetab_remove(fsnode *p) {
+	if (NODETABPAGE(p->id)<nodetabpages) {
+		nodetab[NODETABPAGE(p->id)][NODETABPOS(p->id)] = NULL;
+	}
+}
+
+static inline void fsnodes_nodetab_free(void) {
+	uint32_t i;
+	for (i=0 ; i<nodetabpages ; i++) {
+		free(nodetab[i]);
+	}
+	free(nodetab);
+	nodetab = NULL;
+	nodetabpages = 0;
+}
+
 /*
 static inline uint8_t fsnodes_geteattr(fsnode *p) {
 	fsedge *e;
@@ -666,6 +1143,14 @@ static inline uint8_t fsnodes_test_quota(fsnode *node) {
 
 // stats
 
+// estimated hdd usage of 'size' bytes of file data stored with given goal
+static inline uint64_t fsnodes_realsize(uint64_t size,uint8_t goal) {
+	if (GOAL_IS_XOR(goal)) {
+		return size+size/GOAL_XOR_LEVEL(goal);
+	}
+	return size*goal;
+}
+
 static inline void fsnodes_get_stats(fsnode *node,statsrecord *sr) {
 	uint32_t i,lastchunk,lastchunksize;
 	switch (node->type) {
@@ -700,7 +1185,7 @@ static inline void fsnodes_get_stats(fsnode *node,statsrecord *sr) {
 				sr->chunks++;
 			}
 		}
-		sr->realsize = sr->size * node->goal;
+		sr->realsize = fsnodes_realsize(sr->size,node->goal);
 		break;
 	case TYPE_SYMLINK:
 		sr->inodes = 1;
@@ -780,14 +1265,152 @@ static inline void fsnodes_add_sub_stats(fsnode *parent,statsrecord *newsr,stats
 	fsnodes_add_stats(parent,&sr);
 }
 
+/* paged readdir cursors - cursor points to the next entry to be returned. New entries are always added at the head
+   of the children list, so they are never returned by already started cursor (posix allows it), removed entries move
+   cursors pointing to them forward, so every entry existing during the whole listing is returned exactly once */
+
+#define READDIR_CURSOR_HASHSIZE 4096
+#define READDIR_CURSOR_HASHPOS(x) ((x)&(READDIR_CURSOR_HASHSIZE-1))
+#define READDIR_CURSOR_TIMEOUT 60
+#define READDIR_CURSOR_MAX 100000
+#define READDIR_PAGE_MINSIZE 4096
+#define READDIR_PAGE_MAXSIZE 0x1000000
+
+typedef struct _readdircursor {
+	uint64_t cookie;
+	fsnode *dir;
+	fsedge *next;
+	uint32_t lastuse;
+	struct _readdircursor *cnext,**cprev;	// cookie hash
+	struct _readdircursor *dnext,**dprev;	// directory hash
+	struct _readdircursor *lnext,**lprev;	// lru list
+} readdircursor;
+
+static readdircursor *rdcookiehash[READDIR_CURSOR_HASHSIZE];
+static readdircursor *rddirhash[READDIR_CURSOR_HASHSIZE];
+static readdircursor *rdlruhead = NULL;
+static readdircursor **rdlrutail = &rdlruhead;
+static uint32_t rdcursors = 0;
+static uint64_t rdnextcookie = 0;
+
+static inline void fsnodes_readdir_lru_append(readdircursor *c) {
+	c->lnext = NULL;
+	c->lprev = rdlrutail;
+	*rdlrutail = c;
+	rdlrutail = &(c->lnext);
+}
+
+static inline void fsnodes_readdir_lru_remove(readdircursor *c) {
+	if (c->lnext) {
+		c->lnext->lprev = c->lprev;
+	} else {
+		rdlrutail = c->lprev;
+	}
+	*(c->lprev) = c->lnext;
+}
+
+static inline void fsnodes_readdir_cursor_free(readdircursor *c) {
+	*(c->cprev) = c->cnext;
+	if (c->cnext) {
+		c->cnext->cprev = c->cprev;
+	}
+	*(c->dprev) = c->dnext;
+	if (c->dnext) {
+		c->dnext->dprev = c->dprev;
+	}
+	fsnodes_readdir_lru_remove(c);
+	free(c);
+	rdcursors--;
+}
+
+static inline readdircursor* fsnodes_readdir_cursor_new(fsnode *p,uint32_t ts) {
+	readdircursor *c;
+	uint32_t hpos;
+	if (rdcursors>=READDIR_CURSOR_MAX) {	// drop least recently used cursor
+		fsnodes_readdir_cursor_free(rdlruhead);
+	}
+	if (rdnextcookie==0) {	// cookies from previous master run should not be recognized
+		rdnextcookie = ((uint64_t)ts)<<32;
+	}
+	c = malloc(sizeof(readdircursor));
+	c->cookie = ++rdnextcookie;
+	c->dir = p;
+	c->next = NULL;
+	c->lastuse = ts;
+	hpos = READDIR_CURSOR_HASHPOS(c->cookie);
+	c->cnext = rdcookiehash[hpos];
+	if (c->cnext) {
+		c->cnext->cprev = &(c->cnext);
+	}
+	c->cprev = rdcookiehash+hpos;
+	rdcookiehash[hpos] = c;
+	hpos = READDIR_CURSOR_HASHPOS(p->id);
+	c->dnext = rddirhash[hpos];
+	if (c->dnext) {
+		c->dnext->dprev = &(c->dnext);
+	}
+	c->dprev = rddirhash+hpos;
+	rddirhash[hpos] = c;
+	fsnodes_readdir_lru_append(c);
+	rdcursors++;
+	return c;
+}
+
+static inline readdircursor* fsnodes_readdir_cursor_find(uint64_t cookie,fsnode *p,uint32_t ts) {
+	readdircursor *c;
+	for (c=rdcookiehash[READDIR_CURSOR_HASHPOS(cookie)] ; c ; c=c->cnext) {
+		if (c->cookie==cookie) {
+			if (c->dir!=p) {
+				return NULL;
+			}
+			c->lastuse = ts;
+			fsnodes_readdir_lru_remove(c);
+			fsnodes_readdir_lru_append(c);
+			return c;
+		}
+	}
+	return NULL;
+}
+
+// called before edge is detached from its parent
+static inline void fsnodes_readdir_edge_removed(fsedge *e) {
+	readdircursor *c;
+	for (c=rddirhash[READDIR_CURSOR_HASHPOS(e->parent->id)] ; c ; c=c->dnext) {
+		if (c->next==e) {
+			c->next = e->nextchild;
+		}
+	}
+}
+
+static inline void fsnodes_readdir_dir_removed(fsnode *p) {
+	readdircursor *c,*nc;
+	for (c=rddirhash[READDIR_CURSOR_HASHPOS(p->id)] ; c ; c=nc) {
+		nc = c->dnext;
+		if (c->dir==p) {
+			fsnodes_readdir_cursor_free(c);
+		}
+	}
+}
+
+void fs_readdir_cursors_expire(void) {
+	uint32_t now = get_current_time();
+	while (rdlruhead && rdlruhead->lastuse+READDIR_CURSOR_TIMEOUT<now) {
+		fsnodes_readdir_cursor_free(rdlruhead);
+	}
+}
+
 #endif
 
 static inline void fsnodes_remove_edge(uint32_t ts,fsedge *e) {
 #ifndef METARESTORE
 	statsrecord sr;
 #endif
+	fsnodes_dirty_deledge(e);
 	if (e->parent) {
 #ifndef METARESTORE
+		if (rdcursors>0) {
+			fsnodes_readdir_edge_removed(e);
+		}
 		fsnodes_get_stats(e->child,&sr);
 		fsnodes_sub_stats(e->parent,&sr);
 #endif
@@ -796,9 +1419,11 @@ static inline void fsnodes_remove_edge(uint32_t ts,fsedge *e) {
 		if (e->child->type==TYPE_DIRECTORY) {
 			e->parent->data.ddata.nlink--;
 		}
+		fsnodes_dirty(e->parent);
 	}
 	if (e->child) {
 		e->child->ctime = ts;
+		fsnodes_dirty(e->child);
 	}
 	*(e->prevchild) = e->nextchild;
 	if (e->nextchild) {
@@ -809,15 +1434,11 @@ static inline void fsnodes_remove_edge(uint32_t ts,fsedge *e) {
 		e->nextparent->prevparent = e->prevparent;
 	}
 #ifdef EDGEHASH
-	if (e->prev) {
-		*(e->prev) = e->next;
-		if (e->next) {
-			e->next->prev = e->prev;
-		}
+	if (e->parent) {
+		fsnodes_nameidx_del(e->parent,e);
 	}
 #endif
-	free(e->name);
-	free(e);
+	fsedge_free(e);
 }
 
 static inline void fsnodes_link(uint32_t ts,fsnode *parent,fsnode *child,uint16_t nleng,const uint8_t *name) {
@@ -825,13 +1446,9 @@ static inline void fsnodes_link(uint32_t ts,fsnode *parent,fsnode *child,uint16_
 #ifndef METARESTORE
 	statsrecord sr;
 #endif
-#ifdef EDGEHASH
-	uint32_t hpos;
-#endif
 
-	e = malloc(sizeof(fsedge));
+	e = fsedge_malloc(nleng);
 	e->nleng = nleng;
-	e->name = malloc(nleng);
 	memcpy(e->name,name,nleng);
 	e->child = child;
 	e->parent = parent;
@@ -847,20 +1464,14 @@ static inline void fsnodes_link(uint32_t ts,fsnode *parent,fsnode *child,uint16_
 	}
 	child->parents = e;
 	e->prevparent = &(child->parents);
-#ifdef EDGEHASH
-	hpos = EDGEHASHPOS(fsnodes_hash(parent->id,nleng,name));
-	e->next = edgehash[hpos];
-	if (e->next) {
-		e->next->prev = &(e->next);
-	}
-	edgehash[hpos] = e;
-	e->prev = &(edgehash[hpos]);
-#endif
-
 	parent->data.ddata.elements++;
 	if (child->type==TYPE_DIRECTORY) {
 		parent->data.ddata.nlink++;
 	}
+#ifdef EDGEHASH
+	e->hash = fsnodes_hash(nleng,name);
+	fsnodes_nameidx_add(parent,e);
+#endif
 #ifndef METARESTORE
 	fsnodes_get_stats(child,&sr);
 	fsnodes_add_stats(parent,&sr);
@@ -869,6 +1480,9 @@ static inline void fsnodes_link(uint32_t ts,fsnode *parent,fsnode *child,uint16_
 		parent->mtime = parent->ctime = ts;
 		child->ctime = ts;
 	}
+	fsnodes_dirty_newedge(e);
+	fsnodes_dirty(parent);
+	fsnodes_dirty(child);
 }
 
 static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nleng,const uint8_t *name,uint8_t type,uint16_t mode,uint32_t uid,uint32_t gid) {
@@ -876,8 +1490,7 @@ static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nlen
 #ifndef METARESTORE
 	statsrecord *sr;
 #endif
-	uint32_t nodepos;
-	p = malloc(sizeof(fsnode));
+	p = fsnode_malloc();
 	nodes++;
 	if (type==TYPE_DIRECTORY) {
 		dirnodes++;
@@ -919,6 +1532,9 @@ static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nlen
 		p->data.ddata.quota = NULL;
 #endif
 		p->data.ddata.children = NULL;
+#ifdef EDGEHASH
+		p->data.ddata.nameidx = NULL;
+#endif
 		p->data.ddata.nlink = 2;
 		p->data.ddata.elements = 0;
 		break;
@@ -945,9 +1561,7 @@ static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nlen
 //		node->data.ddata.nlink++;
 //	}
 //	node->mtime = node->ctime = ts;
-	nodepos = NODEHASHPOS(p->id);
-	p->next = nodehash[nodepos];
-	nodehash[nodepos] = p;
+	fsnodes_nodetab_insert(p);
 	fsnodes_link(ts,node,p,nleng,name);
 	return p;
 }
@@ -1280,9 +1894,7 @@ static inline uint32_t fsnodes_getdirsize(fsnode *p,uint8_t withattr) {
 	return result;
 }
 
-static inline void fsnodes_getdirdata(uint32_t ts,uint32_t rootinode,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t sesflags,fsnode *p,uint8_t *dbuff,uint8_t withattr) {
-	fsedge *e;
-	p->atime = ts;
+static inline uint8_t* fsnodes_getdirdata_dots(uint32_t rootinode,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t sesflags,fsnode *p,uint8_t *dbuff,uint8_t withattr) {
 // '.' - self
 	dbuff[0]=1;
 	dbuff[1]='.';
@@ -1337,19 +1949,31 @@ static inline void fsnodes_getdirdata(uint32_t ts,uint32_t rootinode,uint32_t ui
 			put8bit(&dbuff,TYPE_DIRECTORY);
 		}
 	}
+	return dbuff;
+}
+
+static inline uint8_t* fsnodes_getdirdata_entry(uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t sesflags,fsnode *p,fsedge *e,uint8_t *dbuff,uint8_t withattr) {
+	dbuff[0]=e->nleng;
+	dbuff++;
+	memcpy(dbuff,e->name,e->nleng);
+	dbuff+=e->nleng;
+	put32bit(&dbuff,e->child->id);
+	if (withattr) {
+		fsnodes_fill_attr(e->child,p,uid,gid,auid,agid,sesflags,dbuff);
+		dbuff+=35;
+	} else {
+		put8bit(&dbuff,e->child->type);
+	}
+	return dbuff;
+}
+
+static inline void fsnodes_getdirdata(uint32_t ts,uint32_t rootinode,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t sesflags,fsnode *p,uint8_t *dbuff,uint8_t withattr) {
+	fsedge *e;
+	p->atime = ts;
+	dbuff = fsnodes_getdirdata_dots(rootinode,uid,gid,auid,agid,sesflags,p,dbuff,withattr);
 // entries
 	for (e = p->data.ddata.children ; e ; e=e->nextchild) {
-		dbuff[0]=e->nleng;
-		dbuff++;
-		memcpy(dbuff,e->name,e->nleng);
-		dbuff+=e->nleng;
-		put32bit(&dbuff,e->child->id);
-		if (withattr) {
-			fsnodes_fill_attr(e->child,p,uid,gid,auid,agid,sesflags,dbuff);
-			dbuff+=35;
-		} else {
-			put8bit(&dbuff,e->child->type);
-		}
+		dbuff = fsnodes_getdirdata_entry(uid,gid,auid,agid,sesflags,p,e,dbuff,withattr);
 	}
 }
 
@@ -1463,12 +2087,13 @@ static inline void fsnodes_changefilegoal(fsnode *obj,uint8_t goal) {
 
 	fsnodes_get_stats(obj,&psr);
 	nsr = psr;
-	nsr.realsize = goal * nsr.size;
+	nsr.realsize = fsnodes_realsize(nsr.size,goal);
 	for (e=obj->parents ; e ; e=e->nextparent) {
 		fsnodes_add_sub_stats(e->parent,&nsr,&psr);
 	}
 #endif
 	obj->goal = goal;
+	fsnodes_dirty(obj);
 	for (i=0 ; i<obj->data.fdata.chunks ; i++) {
 		if (obj->data.fdata.chunktab[i]>0) {
 			chunk_set_file_goal(obj->data.fdata.chunktab[i],obj->id,i,goal);
@@ -1531,26 +2156,25 @@ static inline void fsnodes_setlength(fsnode *obj,uint64_t length) {
 
 
 static inline void fsnodes_remove_node(uint32_t ts,fsnode *toremove) {
-	uint32_t nodepos;
-	fsnode **ptr;
 	if (toremove->parents!=NULL) {
 		return;
 	}
-// remove from idhash
-	nodepos = NODEHASHPOS(toremove->id);
-	ptr = &(nodehash[nodepos]);
-	while (*ptr) {
-		if (*ptr==toremove) {
-			*ptr=toremove->next;
-			break;
-		}
-		ptr = &((*ptr)->next);
-	}
+	fsnodes_dirty(toremove);
+// remove from inode table
+	fsnodes_nodetab_remove(toremove);
 // and free
 	nodes--;
 	if (toremove->type==TYPE_DIRECTORY) {
 		dirnodes--;
+#ifdef EDGEHASH
+		if (toremove->data.ddata.nameidx) {
+			free(toremove->data.ddata.nameidx);
+		}
+#endif
 #ifndef METARESTORE
+		if (rdcursors>0) {
+			fsnodes_readdir_dir_removed(toremove);
+		}
 		if (toremove->data.ddata.quota) {
 			fsnodes_delete_quotanode(toremove->data.ddata.quota);
 		}
@@ -1583,9 +2207,126 @@ static inline void fsnodes_remove_node(uint32_t ts,fsnode *toremove) {
 #ifndef METARESTORE
 	dcm_modify(toremove->id,0);
 #endif
-	free(toremove);
+	fsnode_free(toremove);
+}
+
+
+#ifndef METARESTORE
+/* expiration index of trash (used only by the working master - built on first fs_emptytrash) - binary min-heap of
+   (expiration time,inode) pairs; entries are not removed when a node leaves the trash or its times change - they are
+   verified when they reach the top (dropped or put back with the current expiration time), so only changes that can make
+   expiration time earlier (unlink, setattr, settrashtime) have to add a new entry */
+typedef struct _trashexpire {
+	uint64_t expire;
+	uint32_t id;
+} trashexpire;
+
+static trashexpire *trashheap = NULL;
+static uint32_t trashheapsize = 0;
+static uint32_t trashheapmax = 0;
+static uint8_t trashindexon = 0;
+static uint32_t EmptyTrashLimit;
+static uint32_t *emptytrashids = NULL;
+static uint32_t emptytrashidsmax = 0;
+
+/* reserved files that have lost their last session (candidates for fs_emptyreserved - also verified before use) */
+static uint32_t *reservedfree = NULL;
+static uint32_t reservedfreesize = 0;
+static uint32_t reservedfreemax = 0;
+static uint8_t reservedindexon = 0;
+
+static inline uint64_t fsnodes_trash_expire(fsnode *p) {
+	uint32_t t;
+	t = p->atime;
+	if (p->mtime>t) {
+		t = p->mtime;
+	}
+	if (p->ctime>t) {
+		t = p->ctime;
+	}
+	return (uint64_t)t + (uint64_t)(p->trashtime);
+}
+
+static inline void fsnodes_trashheap_push(uint64_t expire,uint32_t id) {
+	uint32_t pos,parent;
+	if (trashheapsize>=trashheapmax) {
+		trashheapmax = (trashheapmax)?trashheapmax*2:0x10000;
+		trashheap = realloc(trashheap,sizeof(trashexpire)*trashheapmax);
+	}
+	pos = trashheapsize++;
+	while (pos>0) {
+		parent = (pos-1)/2;
+		if (trashheap[parent].expire<=expire) {
+			break;
+		}
+		trashheap[pos] = trashheap[parent];
+		pos = parent;
+	}
+	trashheap[pos].expire = expire;
+	trashheap[pos].id = id;
+}
+
+static inline void fsnodes_trashheap_pop(void) {
+	uint32_t pos,child;
+	trashexpire last;
+	if (trashheapsize==0) {
+		return;
+	}
+	last = trashheap[--trashheapsize];
+	pos = 0;
+	while ((child=pos*2+1)<trashheapsize) {
+		if (child+1<trashheapsize && trashheap[child+1].expire<trashheap[child].expire) {
+			child++;
+		}
+		if (last.expire<=trashheap[child].expire) {
+			break;
+		}
+		trashheap[pos] = trashheap[child];
+		pos = child;
+	}
+	trashheap[pos] = last;
+}
+
+static inline void fsnodes_trashindex_build(void) {
+	fsedge *e;
+	trashheapsize = 0;
+	for (e=trash ; e ; e=e->nextchild) {
+		fsnodes_trashheap_push(fsnodes_trash_expire(e->child),e->child->id);
+	}
+	trashindexon = 1;
+}
+
+// called after any change that could make expiration time of trash node earlier
+static inline void fsnodes_trashindex_update(fsnode *p) {
+	if (trashindexon && p->type==TYPE_TRASH) {
+		// too many stale entries - rebuild
+		if (trashheapsize>2*trashnodes+0x10000) {
+			fsnodes_trashindex_build();
+		} else {
+			fsnodes_trashheap_push(fsnodes_trash_expire(p),p->id);
+		}
+	}
 }
 
+static inline void fsnodes_reservedfree_add(uint32_t id) {
+	if (reservedfreesize>=reservedfreemax) {
+		reservedfreemax = (reservedfreemax)?reservedfreemax*2:0x1000;
+		reservedfree = realloc(reservedfree,sizeof(uint32_t)*reservedfreemax);
+	}
+	reservedfree[reservedfreesize++] = id;
+}
+
+static inline void fsnodes_reservedfree_build(void) {
+	fsedge *e;
+	reservedfreesize = 0;
+	for (e=reserved ; e ; e=e->nextchild) {
+		if (e->child->data.fdata.sessionids==NULL) {
+			fsnodes_reservedfree_add(e->child->id);
+		}
+	}
+	reservedindexon = 1;
+}
+#endif
 
 static inline void fsnodes_unlink(uint32_t ts,fsedge *e) {
 	fsnode *child;
@@ -1604,7 +2345,7 @@ static inline void fsnodes_unlink(uint32_t ts,fsedge *e) {
 			if (child->trashtime>0) {
 				child->type = TYPE_TRASH;
 				child->ctime = ts;
-				e = malloc(sizeof(fsedge));
+				e = fsedge_malloc(0);
 				e->nleng = pleng;
 				e->name = path;
 				e->child = child;
@@ -1616,17 +2357,16 @@ static inline void fsnodes_unlink(uint32_t ts,fsedge *e) {
 				if (e->nextchild) {
 					e->nextchild->prevchild = &(e->nextchild);
 				}
-#ifdef EDGEHASH
-				e->next = NULL;
-				e->prev = NULL;
-#endif
 				trash = e;
 				child->parents = e;
 				trashspace += child->data.fdata.length;
 				trashnodes++;
+#ifndef METARESTORE
+				fsnodes_trashindex_update(child);
+#endif
 			} else if (child->data.fdata.sessionids!=NULL) {
 				child->type = TYPE_RESERVED;
-				e = malloc(sizeof(fsedge));
+				e = fsedge_malloc(0);
 				e->nleng = pleng;
 				e->name = path;
 				e->child = child;
@@ -1638,10 +2378,6 @@ static inline void fsnodes_unlink(uint32_t ts,fsedge *e) {
 				if (e->nextchild) {
 					e->nextchild->prevchild = &(e->nextchild);
 				}
-#ifdef EDGEHASH
-				e->next = NULL;
-				e->prev = NULL;
-#endif
 				reserved = e;
 				child->parents = e;
 				reservedspace += child->data.fdata.length;
@@ -1664,6 +2400,7 @@ static inline int fsnodes_purge(uint32_t ts,fsnode *p) {
 		trashnodes--;
 		if (p->data.fdata.sessionids!=NULL) {
 			p->type = TYPE_RESERVED;
+			fsnodes_dirty(p);
 			reservedspace += p->data.fdata.length;
 			reservednodes++;
 			*(e->prevchild) = e->nextchild;
@@ -1814,7 +2551,7 @@ void fsnodes_get_file_stats(fsnode *node,uint32_t *undergoalfiles,uint32_t *miss
 	for (i=0 ; i<node->data.fdata.chunks ; i++) {
 		if (node->data.fdata.chunktab[i]>0) {
 			chunk_get_validcopies(node->data.fdata.chunktab[i],&cnt);
-			if (cnt<node->goal) {
+			if (cnt<GOAL_COPIES(node->goal)) {
 				if (cnt==0) {
 					m=1;
 					(*missingchunks)++;
@@ -1862,7 +2599,7 @@ void fsnodes_get_dir_stats(fsnode *node,uint32_t *inodes,uint32_t *dirs,uint32_t
 			for (i=0 ; i<n->data.fdata.chunks ; i++) {
 				if (n->data.fdata.chunktab[i]>0) {
 					chunk_get_validcopies(n->data.fdata.chunktab[i],&cnt);
-					if (cnt<n->goal) {
+					if (cnt<GOAL_COPIES(n->goal)) {
 						if (cnt==0) {
 							m=1;
 							(*missingchunks)++;
@@ -1894,11 +2631,11 @@ void fsnodes_get_dir_stats(fsnode *node,uint32_t *inodes,uint32_t *dirs,uint32_t
 }
 */
 
-static inline void fsnodes_getgoal_recursive(fsnode *node,uint8_t gmode,uint32_t fgtab[10],uint32_t dgtab[10]) {
+static inline void fsnodes_getgoal_recursive(fsnode *node,uint8_t gmode,uint32_t fgtab[GOAL_MAX+1],uint32_t dgtab[GOAL_MAX+1]) {
 	fsedge *e;
 
 	if (node->type==TYPE_FILE || node->type==TYPE_TRASH || node->type==TYPE_RESERVED) {
-		if (node->goal>9) {
+		if (node->goal>9 && !GOAL_IS_XOR(node->goal)) {
 			MFSLOG(LOG_WARNING,"inode %"PRIu32": goal>9 !!! - fixing",node->id);
 			fsnodes_changefilegoal(node,9);
 		} else if (node->goal<1) {
@@ -1907,7 +2644,7 @@ static inline void fsnodes_getgoal_recursive(fsnode *node,uint8_t gmode,uint32_t
 		}
 		fgtab[node->goal]++;
 	} else if (node->type==TYPE_DIRECTORY) {
-		if (node->goal>9) {
+		if (node->goal>9 && !GOAL_IS_XOR(node->goal)) {
 			MFSLOG(LOG_WARNING,"inode %"PRIu32": goal>9 !!! - fixing",node->id);
 			node->goal=9;
 		} else if (node->goal<1) {
@@ -2017,12 +2754,12 @@ static inline void fsnodes_setgoal_recursive(fsnode *node,uint32_t ts,uint32_t u
 				}
 				break;
 			case SMODE_INCREASE:
-				if (node->goal<goal) {
+				if (GOAL_RANK(node->goal)<GOAL_RANK(goal)) {
 					set=1;
 				}
 				break;
 			case SMODE_DECREASE:
-				if (node->goal>goal) {
+				if (GOAL_RANK(node->goal)>GOAL_RANK(goal)) {
 					set=1;
 				}
 				break;
@@ -2043,6 +2780,7 @@ static inline void fsnodes_setgoal_recursive(fsnode *node,uint32_t ts,uint32_t u
 				(*ncinodes)++;
 			}
 			node->ctime = ts;
+			fsnodes_dirty(node);
 		}
 		if (node->type==TYPE_DIRECTORY && (smode&SMODE_RMASK)) {
 //			if (quota==0 && node->data.ddata.quota && node->data.ddata.quota->exceeded) {
@@ -2086,10 +2824,14 @@ static inline void fsnodes_settrashtime_recursive(fsnode *node,uint32_t ts,uint3
 			}
 			if (set) {
 				(*sinodes)++;
+#ifndef METARESTORE
+				fsnodes_trashindex_update(node);
+#endif
 			} else {
 				(*ncinodes)++;
 			}
 			node->ctime = ts;
+			fsnodes_dirty(node);
 		}
 		if (node->type==TYPE_DIRECTORY && (smode&SMODE_RMASK)) {
 			for (e = node->data.ddata.children ; e ; e=e->nextchild) {
@@ -2130,6 +2872,7 @@ static inline void fsnodes_seteattr_recursive(fsnode *node,uint32_t ts,uint32_t
 			(*ncinodes)++;
 		}
 		node->ctime = ts;
+		fsnodes_dirty(node);
 	}
 	if (node->type==TYPE_DIRECTORY && (smode&SMODE_RMASK)) {
 		for (e = node->data.ddata.children ; e ; e=e->nextchild) {
@@ -2228,6 +2971,7 @@ static inline void fsnodes_snapshot(uint32_t ts,fsnode *srcnode,fsnode *parentno
 		dstnode->atime = srcnode->atime;
 		dstnode->mtime = srcnode->mtime;
 		dstnode->ctime = ts;
+		fsnodes_dirty(dstnode);
 	} else {
 		if (srcnode->type==TYPE_FILE || srcnode->type==TYPE_DIRECTORY || srcnode->type==TYPE_SYMLINK || srcnode->type==TYPE_BLOCKDEV || srcnode->type==TYPE_CHARDEV || srcnode->type==TYPE_SOCKET || srcnode->type==TYPE_FIFO) {
 #ifndef METARESTORE
@@ -2501,12 +3245,12 @@ uint8_t fs_setpath(uint32_t inode,const uint8_t *path) {
 	if (newpath==NULL) {
 		return ERROR_EINVAL;	// no mem ?
 	}
-	free(p->parents->name);
+	fsedge_name_free(p->parents);
 	memcpy(newpath,path,pleng);
 	p->parents->name = newpath;
 	p->parents->nleng = pleng;
 #ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|SETPATH(%"PRIu32",%s)",(uint32_t)get_current_time(),inode,fsnodes_escape_name(pleng,newpath));
+	fs_changelog(CHLOG_SETPATH,(uint32_t)get_current_time(),inode,fsnodes_escape_name(pleng,newpath));
 #else
 	version++;
 #endif
@@ -2540,7 +3284,7 @@ uint8_t fs_undel(uint32_t ts,uint32_t inode) {
 	status = fsnodes_undel(ts,p);
 #ifndef METARESTORE
 	if (status==STATUS_OK) {
-		changelog(version++,"%"PRIu32"|UNDEL(%"PRIu32")",ts,inode);
+		fs_changelog(CHLOG_UNDEL,ts,inode);
 	}
 #else
 	version++;
@@ -2573,7 +3317,7 @@ uint8_t fs_purge(uint32_t ts,uint32_t inode) {
 	}
 	fsnodes_purge(ts,p);
 #ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|PURGE(%"PRIu32")",ts,inode);
+	fs_changelog(CHLOG_PURGE,ts,inode);
 #else
 	version++;
 #endif
@@ -2592,6 +3336,10 @@ void fs_info(uint64_t *totalspace,uint64_t *availspace,uint64_t *trspace,uint32_
 	*fnodes = filenodes;
 }
 
+void fs_meminfo(uint64_t *allocated,uint64_t *used) {
+	fsobj_slabs_info(allocated,used);
+}
+
 uint8_t fs_getrootinode(uint32_t *rootinode,const uint8_t *path) {
 	uint32_t nleng;
 	const uint8_t *name;
@@ -2869,7 +3617,7 @@ uint8_t fs_try_setlength(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint
 				}
 				p->data.fdata.chunktab[indx] = nchunkid;
 				*chunkid = nchunkid;
-				changelog(version++,"%"PRIu32"|TRUNC(%"PRIu32",%"PRIu32"):%"PRIu64,(uint32_t)get_current_time(),inode,indx,nchunkid);
+				fs_changelog(CHLOG_TRUNC,(uint32_t)get_current_time(),inode,indx,nchunkid);
 				return ERROR_DELAYED;
 			}
 		}
@@ -2914,7 +3662,7 @@ uint8_t fs_trunc(uint32_t ts,uint32_t inode,uint32_t indx,uint64_t chunkid) {
 
 #ifndef METARESTORE
 uint8_t fs_end_setlength(uint64_t chunkid) {
-	changelog(version++,"%"PRIu32"|UNLOCK(%"PRIu64")",(uint32_t)get_current_time(),chunkid);
+	fs_changelog(CHLOG_UNLOCK,(uint32_t)get_current_time(),chunkid);
 	return chunk_unlock(chunkid);
 }
 #else
@@ -2955,7 +3703,7 @@ uint8_t fs_do_setlength(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint3
 		}
 	}
 	fsnodes_setlength(p,length);
-	changelog(version++,"%"PRIu32"|LENGTH(%"PRIu32",%"PRIu64")",(uint32_t)get_current_time(),inode,p->data.fdata.length);
+	fs_changelog(CHLOG_LENGTH,(uint32_t)get_current_time(),inode,p->data.fdata.length);
 	p->ctime = p->mtime = get_current_time();
 	fsnodes_fill_attr(p,NULL,uid,gid,auid,agid,sesflags,attr);
 	stats_setattr++;
@@ -3039,8 +3787,11 @@ uint8_t fs_setattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t u
 	if (setmask&SET_MTIME_FLAG) {
 		p->mtime = attrmtime;
 	}
-	changelog(version++,"%"PRIu32"|ATTR(%"PRIu32",%"PRIu16",%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu32")",get_current_time(),inode,p->mode & 07777,p->uid,p->gid,p->atime,p->mtime);
+	fs_changelog(CHLOG_ATTR,get_current_time(),inode,p->mode & 07777,p->uid,p->gid,p->atime,p->mtime);
 	p->ctime = get_current_time();
+	if (setmask&(SET_ATIME_FLAG|SET_MTIME_FLAG)) {
+		fsnodes_trashindex_update(p);
+	}
 	fsnodes_fill_attr(p,NULL,uid,gid,auid,agid,sesflags,attr);
 	stats_setattr++;
 	return STATUS_OK;
@@ -3120,7 +3871,7 @@ uint8_t fs_settrashtime(uint32_t ts,uint32_t inode,uint32_t trashto) {
 	p->trashtime = trashto;
 	p->ctime = ts;
 #ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|SETTRASHTIME(%"PRIu32",%"PRIu32")",ts,inode,p->trashtime);
+	fs_changelog(CHLOG_SETTRASHTO,ts,inode,p->trashtime);
 #else
 	version++;
 #endif
@@ -3163,7 +3914,7 @@ uint8_t fs_readlink(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t
 	*pleng = p->data.sdata.pleng;
 	*path = p->data.sdata.path;
 	p->atime = get_current_time();
-	changelog(version++,"%"PRIu32"|ACCESS(%"PRIu32")",(uint32_t)get_current_time(),inode);
+	fs_changelog(CHLOG_ACCESS,(uint32_t)get_current_time(),inode);
 	stats_readlink++;
 	return STATUS_OK;
 }
@@ -3263,7 +4014,7 @@ uint8_t fs_symlink(uint32_t ts,uint32_t parent,uint32_t nleng,const uint8_t *nam
 
 	*inode = p->id;
 	fsnodes_fill_attr(p,wd,uid,gid,auid,agid,sesflags,attr);
-	changelog(version++,"%"PRIu32"|SYMLINK(%"PRIu32",%s,%s,%"PRIu32",%"PRIu32"):%"PRIu32,(uint32_t)get_current_time(),parent,fsnodes_escape_name(nleng,name),fsnodes_escape_name(pleng,newpath),uid,gid,p->id);
+	fs_changelog(CHLOG_SYMLINK,(uint32_t)get_current_time(),parent,fsnodes_escape_name(nleng,name),fsnodes_escape_name(pleng,newpath),uid,gid,p->id);
 	stats_symlink++;
 #else
 	if (inode!=p->id) {
@@ -3329,7 +4080,7 @@ uint8_t fs_mknod(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t nl
 	}
 	*inode = p->id;
 	fsnodes_fill_attr(p,wd,uid,gid,auid,agid,sesflags,attr);
-	changelog(version++,"%"PRIu32"|CREATE(%"PRIu32",%s,%c,%"PRIu16",%"PRIu32",%"PRIu32",%"PRIu32"):%"PRIu32,(uint32_t)get_current_time(),parent,fsnodes_escape_name(nleng,name),type,mode,uid,gid,rdev,p->id);
+	fs_changelog(CHLOG_CREATE,(uint32_t)get_current_time(),parent,fsnodes_escape_name(nleng,name),type,mode,uid,gid,rdev,p->id);
 	stats_mknod++;
 	return STATUS_OK;
 }
@@ -3382,7 +4133,7 @@ uint8_t fs_mkdir(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t nl
 	p = fsnodes_create_node(get_current_time(),wd,nleng,name,TYPE_DIRECTORY,mode,uid,gid);
 	*inode = p->id;
 	fsnodes_fill_attr(p,wd,uid,gid,auid,agid,sesflags,attr);
-	changelog(version++,"%"PRIu32"|CREATE(%"PRIu32",%s,%c,%"PRIu16",%"PRIu32",%"PRIu32",%"PRIu32"):%"PRIu32,(uint32_t)get_current_time(),parent,fsnodes_escape_name(nleng,name),TYPE_DIRECTORY,mode,uid,gid,0,p->id);
+	fs_changelog(CHLOG_CREATE,(uint32_t)get_current_time(),parent,fsnodes_escape_name(nleng,name),TYPE_DIRECTORY,mode,uid,gid,0,p->id);
 	stats_mkdir++;
 	return STATUS_OK;
 }
@@ -3465,7 +4216,7 @@ uint8_t fs_unlink(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t n
 	if (e->child->type==TYPE_DIRECTORY) {
 		return ERROR_EPERM;
 	}
-	changelog(version++,"%"PRIu32"|UNLINK(%"PRIu32",%s):%"PRIu32,ts,parent,fsnodes_escape_name(nleng,name),e->child->id);
+	fs_changelog(CHLOG_UNLINK,ts,parent,fsnodes_escape_name(nleng,name),e->child->id);
 	fsnodes_unlink(ts,e);
 	stats_unlink++;
 	return STATUS_OK;
@@ -3525,7 +4276,7 @@ uint8_t fs_rmdir(uint32_t rootinode,uint8_t sesflags,uint32_t parent,uint16_t nl
 	if (e->child->data.ddata.children!=NULL) {
 		return ERROR_ENOTEMPTY;
 	}
-	changelog(version++,"%"PRIu32"|UNLINK(%"PRIu32",%s):%"PRIu32,ts,parent,fsnodes_escape_name(nleng,name),e->child->id);
+	fs_changelog(CHLOG_UNLINK,ts,parent,fsnodes_escape_name(nleng,name),e->child->id);
 	fsnodes_unlink(ts,e);
 	stats_rmdir++;
 	return STATUS_OK;
@@ -3686,7 +4437,7 @@ uint8_t fs_move(uint32_t ts,uint32_t parent_src,uint32_t nleng_src,const uint8_t
 	fsnodes_remove_edge(ts,se);
 	fsnodes_link(ts,dwd,node,nleng_dst,name_dst);
 #ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|MOVE(%"PRIu32",%s,%"PRIu32",%s):%"PRIu32,(uint32_t)get_current_time(),parent_src,fsnodes_escape_name(nleng_src,name_src),parent_dst,fsnodes_escape_name(nleng_dst,name_dst),node->id);
+	fs_changelog(CHLOG_MOVE,(uint32_t)get_current_time(),parent_src,fsnodes_escape_name(nleng_src,name_src),parent_dst,fsnodes_escape_name(nleng_dst,name_dst),node->id);
 	stats_rename++;
 #else
 	version++;
@@ -3788,7 +4539,7 @@ uint8_t fs_link(uint32_t ts,uint32_t inode_src,uint32_t parent_dst,uint32_t nlen
 #ifndef METARESTORE
 	*inode = inode_src;
 	fsnodes_fill_attr(sp,dwd,uid,gid,auid,agid,sesflags,attr);
-	changelog(version++,"%"PRIu32"|LINK(%"PRIu32",%"PRIu32",%s)",(uint32_t)get_current_time(),inode_src,parent_dst,fsnodes_escape_name(nleng_dst,name_dst));
+	fs_changelog(CHLOG_LINK,(uint32_t)get_current_time(),inode_src,parent_dst,fsnodes_escape_name(nleng_dst,name_dst));
 	stats_link++;
 #else
 	version++;
@@ -3889,7 +4640,7 @@ uint8_t fs_snapshot(uint32_t ts,uint32_t inode_src,uint32_t parent_dst,uint16_t
 #endif
 	fsnodes_snapshot(ts,sp,dwd,nleng_dst,name_dst);
 #ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|SNAPSHOT(%"PRIu32",%"PRIu32",%s,%"PRIu8")",ts,inode_src,parent_dst,fsnodes_escape_name(nleng_dst,name_dst),canoverwrite);
+	fs_changelog(CHLOG_SNAPSHOT,ts,inode_src,parent_dst,fsnodes_escape_name(nleng_dst,name_dst),canoverwrite);
 #else
 	version++;
 #endif
@@ -3986,7 +4737,7 @@ uint8_t fs_append(uint32_t ts,uint32_t inode,uint32_t inode_src) {
 		return status;
 	}
 #ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|APPEND(%"PRIu32",%"PRIu32")",ts,inode,inode_src);
+	fs_changelog(CHLOG_APPEND,ts,inode,inode_src);
 #else
 	version++;
 #endif
@@ -3994,10 +4745,8 @@ uint8_t fs_append(uint32_t ts,uint32_t inode,uint32_t inode_src) {
 }
 
 #ifndef METARESTORE
-uint8_t fs_readdir_size(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,uint8_t flags,void **dnode,uint32_t *dbuffsize) {
+static uint8_t fsnodes_readdir_node(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,fsnode **rp) {
 	fsnode *p,*rn;
-	*dnode = NULL;
-	*dbuffsize = 0;
 	if (rootinode==MFS_ROOT_ID) {
 		p = fsnodes_id_to_node(inode);
 		if (!p) {
@@ -4027,6 +4776,19 @@ uint8_t fs_readdir_size(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint3
 	if (!fsnodes_access(p,uid,gid,MODE_MASK_R,sesflags)) {
 		return ERROR_EACCES;
 	}
+	*rp = p;
+	return STATUS_OK;
+}
+
+uint8_t fs_readdir_size(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,uint8_t flags,void **dnode,uint32_t *dbuffsize) {
+	fsnode *p;
+	uint8_t status;
+	*dnode = NULL;
+	*dbuffsize = 0;
+	status = fsnodes_readdir_node(rootinode,sesflags,inode,uid,gid,&p);
+	if (status!=STATUS_OK) {
+		return status;
+	}
 	*dnode = p;
 	*dbuffsize = fsnodes_getdirsize(p,flags&GETDIR_FLAG_WITHATTR);
 	return STATUS_OK;
@@ -4034,11 +4796,96 @@ uint8_t fs_readdir_size(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint3
 
 void fs_readdir_data(uint32_t rootinode,uint8_t sesflags,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t flags,void *dnode,uint8_t *dbuff) {
 	fsnode *p = (fsnode*)dnode;
-	changelog(version++,"%"PRIu32"|ACCESS(%"PRIu32")",(uint32_t)get_current_time(),p->id);
+	fs_changelog(CHLOG_ACCESS,(uint32_t)get_current_time(),p->id);
 	fsnodes_getdirdata(get_current_time(),rootinode,uid,gid,auid,agid,sesflags,p,dbuff,flags&GETDIR_FLAG_WITHATTR);
 	stats_readdir++;
 }
 
+// paged readdir - state between fs_readdir_page_size and fs_readdir_page_data (both are always called one after another)
+static struct _readdirpage {
+	fsnode *dir;
+	fsedge *first,*end;
+	readdircursor *cursor;
+	uint8_t withattr;
+} rdpage;
+
+// cookie==0 - start listing (page begins with '.' and '..'), otherwise continue listing started with cookie returned by previous page
+uint8_t fs_readdir_page_size(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,uint8_t flags,uint64_t cookie,uint32_t maxsize,void **dnode,uint32_t *dbuffsize) {
+	fsnode *p;
+	fsedge *e;
+	readdircursor *c;
+	uint32_t esize,size,ts;
+	uint8_t status;
+
+	*dnode = NULL;
+	*dbuffsize = 0;
+	status = fsnodes_readdir_node(rootinode,sesflags,inode,uid,gid,&p);
+	if (status!=STATUS_OK) {
+		return status;
+	}
+	ts = get_current_time();
+	if (maxsize<READDIR_PAGE_MINSIZE) {
+		maxsize = READDIR_PAGE_MINSIZE;
+	} else if (maxsize>READDIR_PAGE_MAXSIZE) {
+		maxsize = READDIR_PAGE_MAXSIZE;
+	}
+	esize = (flags&GETDIR_FLAG_WITHATTR)?40:6;
+	if (cookie==0) {
+		c = NULL;
+		e = p->data.ddata.children;
+		size = esize*2+3;
+	} else {
+		c = fsnodes_readdir_cursor_find(cookie,p,ts);
+		if (c==NULL) {	// expired, unknown or belongs to other directory
+			return ERROR_EINVAL;
+		}
+		e = c->next;
+		size = 0;
+	}
+	rdpage.first = e;
+	while (e && size+esize+e->nleng<=maxsize) {
+		size += esize+e->nleng;
+		e = e->nextchild;
+	}
+	if (e && c==NULL) {
+		c = fsnodes_readdir_cursor_new(p,ts);
+	}
+	rdpage.dir = p;
+	rdpage.end = e;
+	rdpage.cursor = c;
+	rdpage.withattr = flags&GETDIR_FLAG_WITHATTR;
+	*dnode = &rdpage;
+	*dbuffsize = 8+size;
+	return STATUS_OK;
+}
+
+void fs_readdir_page_data(uint32_t rootinode,uint8_t sesflags,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint64_t cookie,void *dnode,uint8_t *dbuff) {
+	struct _readdirpage *rp = (struct _readdirpage*)dnode;
+	fsnode *p = rp->dir;
+	fsedge *e;
+	uint32_t ts;
+
+	if (rp->end) {
+		rp->cursor->next = rp->end;
+		put64bit(&dbuff,rp->cursor->cookie);
+	} else {
+		if (rp->cursor) {
+			fsnodes_readdir_cursor_free(rp->cursor);
+		}
+		put64bit(&dbuff,0);
+	}
+	if (cookie==0) {
+		ts = get_current_time();
+		fs_changelog(CHLOG_ACCESS,ts,p->id);
+		p->atime = ts;
+		dbuff = fsnodes_getdirdata_dots(rootinode,uid,gid,auid,agid,sesflags,p,dbuff,rp->withattr);
+		stats_readdir++;
+	}
+	for (e=rp->first ; e!=rp->end ; e=e->nextchild) {
+		dbuff = fsnodes_getdirdata_entry(uid,gid,auid,agid,sesflags,p,e,dbuff,rp->withattr);
+	}
+}
+
 
 uint8_t fs_checkfile(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint16_t chunkcount[256]) {
 	fsnode *p,*rn;
@@ -4155,7 +5002,7 @@ uint8_t fs_aquire(uint32_t inode,uint32_t sessionid) {
 	cr->next = p->data.fdata.sessionids;
 	p->data.fdata.sessionids = cr;
 #ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|AQUIRE(%"PRIu32",%"PRIu32")",(uint32_t)get_current_time(),inode,sessionid);
+	fs_changelog(CHLOG_AQUIRE,(uint32_t)get_current_time(),inode,sessionid);
 #else
 	version++;
 #endif
@@ -4186,7 +5033,10 @@ uint8_t fs_release(uint32_t inode,uint32_t sessionid) {
 			*crp = cr->next;
 			sessionidrec_free(cr);
 #ifndef METARESTORE
-			changelog(version++,"%"PRIu32"|RELEASE(%"PRIu32",%"PRIu32")",(uint32_t)get_current_time(),inode,sessionid);
+			if (reservedindexon && p->type==TYPE_RESERVED && p->data.fdata.sessionids==NULL) {
+				fsnodes_reservedfree_add(inode);
+			}
+			fs_changelog(CHLOG_RELEASE,(uint32_t)get_current_time(),inode,sessionid);
 #else
 			version++;
 #endif
@@ -4203,7 +5053,7 @@ uint8_t fs_release(uint32_t inode,uint32_t sessionid) {
 
 #ifndef METARESTORE
 uint32_t fs_newsessionid(void) {
-	changelog(version++,"%"PRIu32"|SESSION():%"PRIu32,(uint32_t)get_current_time(),nextsessionid);
+	fs_changelog(CHLOG_SESSION,(uint32_t)get_current_time(),nextsessionid);
 	return nextsessionid++;
 }
 #else
@@ -4237,14 +5087,14 @@ uint8_t fs_readchunk(uint32_t inode,uint32_t indx,uint64_t *chunkid,uint64_t *le
 	}
 	*length = p->data.fdata.length;
 	p->atime = get_current_time();
-	changelog(version++,"%"PRIu32"|ACCESS(%"PRIu32")",(uint32_t)get_current_time(),inode);
+	fs_changelog(CHLOG_ACCESS,(uint32_t)get_current_time(),inode);
 	stats_read++;
 	return STATUS_OK;
 }
 #endif
 
 #ifndef METARESTORE
-uint8_t fs_writechunk(uint32_t inode,uint32_t indx,uint64_t *chunkid,uint64_t *length,uint8_t *opflag) {
+uint8_t fs_writechunk(uint32_t inode,uint32_t indx,uint32_t sessionid,uint64_t *chunkid,uint64_t *length,uint8_t *opflag) {
 	int status;
 	uint32_t i;
 	uint64_t ochunkid,nchunkid;
@@ -4289,17 +5139,14 @@ uint8_t fs_writechunk(uint32_t inode,uint32_t indx,uint64_t *chunkid,uint64_t *l
 		p->data.fdata.chunks = newsize;
 	}
 	ochunkid = p->data.fdata.chunktab[indx];
-	status = chunk_multi_modify(&nchunkid,ochunkid,inode,indx,p->goal,opflag);
-/* zapis bez zwiekszania wersji
-	if (nchunkid==ochunkid && status==255) {
-		*chunkid = nchunkid;
-		*length = p->data.fdata.length;
-		stats_write++;
-		return 255;
-	}
-*/
-	if (status!=STATUS_OK) {
-		return status;
+	if (ochunkid>0 && chunk_lease_renew(ochunkid,sessionid)) {	// lease renewed - lockedto changed, so it is logged as a write without version change
+		nchunkid = ochunkid;
+		*opflag = 0;
+	} else {
+		status = chunk_multi_modify(&nchunkid,ochunkid,inode,indx,p->goal,sessionid,opflag);
+		if (status!=STATUS_OK) {
+			return status;
+		}
 	}
 	p->data.fdata.chunktab[indx] = nchunkid;
 	fsnodes_get_stats(p,&nsr);
@@ -4308,7 +5155,7 @@ uint8_t fs_writechunk(uint32_t inode,uint32_t indx,uint64_t *chunkid,uint64_t *l
 	}
 	*chunkid = nchunkid;
 	*length = p->data.fdata.length;
-	changelog(version++,"%"PRIu32"|WRITE(%"PRIu32",%"PRIu32",%"PRIu8"):%"PRIu64,(uint32_t)get_current_time(),inode,indx,*opflag,nchunkid);
+	fs_changelog(CHLOG_WRITE,(uint32_t)get_current_time(),inode,indx,*opflag,nchunkid);
 	p->mtime = p->ctime = get_current_time();
 	stats_write++;
 	return STATUS_OK;
@@ -4392,7 +5239,7 @@ uint8_t fs_reinitchunk(uint32_t inode,uint32_t indx,uint64_t *chunkid) {
 	if (status!=STATUS_OK) {
 		return status;
 	}
-	changelog(version++,"%"PRIu32"|REINIT(%"PRIu32",%"PRIu32"):%"PRIu64,(uint32_t)get_current_time(),inode,indx,nchunkid);
+	fs_changelog(CHLOG_REINIT,(uint32_t)get_current_time(),inode,indx,nchunkid);
 	*chunkid = nchunkid;
 	p->mtime = p->ctime = get_current_time();
 	return STATUS_OK;
@@ -4447,17 +5294,17 @@ uint8_t fs_writeend(uint32_t inode,uint64_t length,uint64_t chunkid) {
 		if (length>p->data.fdata.length) {
 			fsnodes_setlength(p,length);
 			p->mtime = p->ctime = get_current_time();
-			changelog(version++,"%"PRIu32"|LENGTH(%"PRIu32",%"PRIu64")",(uint32_t)get_current_time(),inode,length);
+			fs_changelog(CHLOG_LENGTH,(uint32_t)get_current_time(),inode,length);
 		}
 	}
-	changelog(version++,"%"PRIu32"|UNLOCK(%"PRIu64")",(uint32_t)get_current_time(),chunkid);
+	fs_changelog(CHLOG_UNLOCK,(uint32_t)get_current_time(),chunkid);
 	return chunk_unlock(chunkid);
 }
 #endif
 
 #ifndef METARESTORE
 void fs_incversion(uint64_t chunkid) {
-	changelog(version++,"%"PRIu32"|INCVERSION(%"PRIu64")",(uint32_t)get_current_time(),chunkid);
+	fs_changelog(CHLOG_INCVERSION,(uint32_t)get_current_time(),chunkid);
 }
 #else
 uint8_t fs_incversion(uint64_t chunkid) {
@@ -4466,6 +5313,33 @@ uint8_t fs_incversion(uint64_t chunkid) {
 }
 #endif
 
+#ifndef METARESTORE
+void fs_xorgroup(uint64_t parityid,uint8_t level,const uint64_t *chunkid,const uint32_t *cversion) {
+	char members[9*32];
+	uint32_t leng;
+	uint8_t i;
+	leng = 0;
+	for (i=0 ; i<level && i<9 ; i++) {
+		leng += snprintf(members+leng,sizeof(members)-leng,",%"PRIu64",%"PRIu32,chunkid[i],cversion[i]);
+	}
+	fs_changelog(CHLOG_XORGROUP,(uint32_t)get_current_time(),parityid,level,members);
+}
+
+void fs_xordel(uint64_t parityid) {
+	fs_changelog(CHLOG_XORDEL,(uint32_t)get_current_time(),parityid);
+}
+#else
+uint8_t fs_xorgroup(uint64_t parityid,uint8_t level,const uint64_t *chunkid,const uint32_t *cversion) {
+	version++;
+	return chunk_xor_add(parityid,level,chunkid,cversion);
+}
+
+uint8_t fs_xordel(uint64_t parityid) {
+	version++;
+	return chunk_xor_delete(parityid);
+}
+#endif
+
 
 #ifndef METARESTORE
 uint8_t fs_repair(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,uint32_t *notchanged,uint32_t *erased,uint32_t *repaired) {
@@ -4515,7 +5389,7 @@ uint8_t fs_repair(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t ui
 	fsnodes_get_stats(p,&psr);
 	for (indx=0 ; indx<p->data.fdata.chunks ; indx++) {
 		if (chunk_repair(inode,indx,p->data.fdata.chunktab[indx],&nversion)) {
-			changelog(version++,"%"PRIu32"|REPAIR(%"PRIu32",%"PRIu32"):%"PRIu32,(uint32_t)get_current_time(),inode,indx,nversion);
+			fs_changelog(CHLOG_REPAIR,(uint32_t)get_current_time(),inode,indx,nversion);
 			if (nversion>0) {
 				(*repaired)++;
 			} else {
@@ -4531,6 +5405,7 @@ uint8_t fs_repair(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t ui
 		fsnodes_add_sub_stats(e->parent,&nsr,&psr);
 	}
 	p->mtime = p->ctime = get_current_time();
+	fsnodes_dirty(p);	// times are changed even when no chunk was repaired (no REPAIR entry)
 	return STATUS_OK;
 }
 #else
@@ -4566,11 +5441,11 @@ uint8_t fs_repair(uint32_t ts,uint32_t inode,uint32_t indx,uint32_t nversion) {
 #endif
 
 #ifndef METARESTORE
-uint8_t fs_getgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t gmode,uint32_t fgtab[10],uint32_t dgtab[10]) {
+uint8_t fs_getgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t gmode,uint32_t fgtab[GOAL_MAX+1],uint32_t dgtab[GOAL_MAX+1]) {
 	fsnode *p,*rn;
 	(void)sesflags;
-	memset(fgtab,0,10*sizeof(uint32_t));
-	memset(dgtab,0,10*sizeof(uint32_t));
+	memset(fgtab,0,(GOAL_MAX+1)*sizeof(uint32_t));
+	memset(dgtab,0,(GOAL_MAX+1)*sizeof(uint32_t));
 	if (!GMODE_ISVALID(gmode)) {
 		return ERROR_EINVAL;
 	}
@@ -4733,7 +5608,7 @@ uint8_t fs_setgoal(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t
 	nci = 0;
 	nsi = 0;
 #endif
-	if (!SMODE_ISVALID(smode) || goal>9 || goal<1) {
+	if (!SMODE_ISVALID(smode) || !GOAL_ISVALID(goal)) {
 		return ERROR_EINVAL;
 	}
 #ifndef METARESTORE
@@ -4787,7 +5662,7 @@ uint8_t fs_setgoal(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t
 #endif
 
 #ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|SETGOAL(%"PRIu32",%"PRIu32",%"PRIu8",%"PRIu8"):%"PRIu32",%"PRIu32",%"PRIu32/*",%"PRIu32*/,ts,inode,uid,goal,smode,*sinodes,*ncinodes,*nsinodes/*,*qeinodes*/);
+	fs_changelog(CHLOG_SETGOAL,ts,inode,uid,goal,smode,*sinodes,*ncinodes,*nsinodes/*,*qeinodes*/);
 	return STATUS_OK;
 #else
 	version++;
@@ -4872,7 +5747,7 @@ uint8_t fs_settrashtime(uint32_t ts,uint32_t inode,uint32_t uid,uint32_t trashti
 #endif
 
 #ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|SETTRASHTIME(%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu8"):%"PRIu32",%"PRIu32",%"PRIu32,ts,inode,uid,trashtime,smode,*sinodes,*ncinodes,*nsinodes);
+	fs_changelog(CHLOG_SETTRASHTIME,ts,inode,uid,trashtime,smode,*sinodes,*ncinodes,*nsinodes);
 	return STATUS_OK;
 #else
 	version++;
@@ -4954,7 +5829,7 @@ uint8_t fs_seteattr(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t eattr,uint8_
 #endif
 
 #ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|SETEATTR(%"PRIu32",%"PRIu32",%"PRIu8",%"PRIu8"):%"PRIu32",%"PRIu32",%"PRIu32/*",%"PRIu32*/,ts,inode,uid,eattr,smode,*sinodes,*ncinodes,*nsinodes/*,*qeinodes*/);
+	fs_changelog(CHLOG_SETEATTR,ts,inode,uid,eattr,smode,*sinodes,*ncinodes,*nsinodes/*,*qeinodes*/);
 	return STATUS_OK;
 #else
 	version++;
@@ -5012,7 +5887,7 @@ uint8_t fs_eattr(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid
 		} else {
 			p->mode = p->mode | ((*nodeeattr)<<12);
 		}
-		changelog(version++,"%"PRIu32"|EATTR(%"PRIu32",%"PRIu16")",get_current_time(),inode,p->mode>>12);
+		fs_changelog(CHLOG_EATTR,get_current_time(),inode,p->mode>>12);
 		p->ctime = get_current_time();
 	}
 	*nodeeattr = p->mode>>12;
@@ -5321,8 +6196,8 @@ void fs_add_files_to_chunks() {
 	uint32_t i,j;
 	uint64_t chunkid;
 	fsnode *f;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (f=nodehash[i] ; f ; f=f->next) {
+	for (i=0 ; i<=maxnodeid ; i++) {
+		if ((f=fsnodes_id_to_node(i))!=NULL) {
 			if (f->type==TYPE_FILE || f->type==TYPE_TRASH || f->type==TYPE_RESERVED) {
 				for (j=0 ; j<f->data.fdata.chunks ; j++) {
 					chunkid = f->data.fdata.chunktab[j];
@@ -5421,7 +6296,7 @@ void fs_test_files() {
 	if ((uint32_t)(get_current_time())<=starttime+900) {
 		return;
 	}
-	if (i>=NODEHASHSIZE) {
+	if (i>maxnodeid) {
 		MFSLOG(LOG_NOTICE,"structure check loop");
 		i=0;
 		errors=0;
@@ -5515,8 +6390,8 @@ void fs_test_files() {
 		fsinfo_loopstart = fsinfo_loopend;
 		fsinfo_loopend = get_current_time();
 	}
-	for (k=0 ; k<(NODEHASHSIZE/14400) && i<NODEHASHSIZE ; k++,i++) {
-		for (f=nodehash[i] ; f ; f=f->next) {
+	for (k=0 ; k<(maxnodeid/14400)+1 && i<=maxnodeid ; k++,i++) {
+		if ((f=fsnodes_id_to_node(i))!=NULL) {
 			if (f->type==TYPE_FILE || f->type==TYPE_TRASH || f->type==TYPE_RESERVED) {
 				valid = 1;
 				ugflag = 0;
@@ -5557,7 +6432,7 @@ void fs_test_files() {
 							}
 							valid = 0;
 							mchunks++;
-						} else if (vc<f->goal) {
+						} else if (vc<GOAL_COPIES(f->goal)) {
 							ugflag = 1;
 							ugchunks++;
 						}
@@ -5655,16 +6530,6 @@ void fs_test_files() {
 							fs_test_log_inconsistency(e,"nextparent/prevparent",NULL,0);
 						}
 					}
-#ifdef EDGEHASH
-				} else if (e->next) {
-					if (e->next->prev != &(e->next)) {
-						if (leng<MSGBUFFSIZE) {
-							leng += fs_test_log_inconsistency(e,"nexthash/prevhash",msgbuff+leng,MSGBUFFSIZE-leng);
-						} else {
-							fs_test_log_inconsistency(e,"nexthash/prevhash",NULL,0);
-						}
-					}
-#endif
 				}
 			}
 			if (f->type == TYPE_DIRECTORY) {
@@ -5703,16 +6568,6 @@ void fs_test_files() {
 								fs_test_log_inconsistency(e,"nextparent/prevparent",NULL,0);
 							}
 						}
-#ifdef EDGEHASH
-					} else if (e->next) {
-						if (e->next->prev != &(e->next)) {
-							if (leng<MSGBUFFSIZE) {
-								leng += fs_test_log_inconsistency(e,"nexthash/prevhash",msgbuff+leng,MSGBUFFSIZE-leng);
-							} else {
-								fs_test_log_inconsistency(e,"nexthash/prevhash",NULL,0);
-							}
-						}
-#endif
 					}
 				}
 			}
@@ -5723,17 +6578,88 @@ void fs_test_files() {
 
 
 #ifndef METARESTORE
+/* purges expired trash using expiration index - at most EmptyTrashLimit files per call (files with the same expiration
+   time are never split); when limit is reached operation is stored with earlier time ('last purged expiration'+1)
+   so EMPTYTRASH replayed from changelog (full scan using given time) purges exactly the same set of files */
 void fs_emptytrash(void) {
-	uint32_t ts;
+	uint32_t ts,fi,ri,n,id,i;
+	uint64_t expire,lastexpire;
+	fsnode *p;
+
+	ts = get_current_time();
+	if (trashindexon==0) {
+		fsnodes_trashindex_build();
+	}
+	n = 0;
+	lastexpire = 0;
+	while (trashheapsize>0 && trashheap[0].expire<(uint64_t)ts) {
+		expire = trashheap[0].expire;
+		id = trashheap[0].id;
+		if (n>=EmptyTrashLimit && expire>lastexpire) {
+			break;
+		}
+		fsnodes_trashheap_pop();
+		p = fsnodes_id_to_node(id);
+		if (p==NULL || p->type!=TYPE_TRASH) {
+			continue;
+		}
+		if (fsnodes_trash_expire(p)!=expire) {	// times changed - put it back
+			fsnodes_trashheap_push(fsnodes_trash_expire(p),id);
+			continue;
+		}
+		if (n>=emptytrashidsmax) {
+			emptytrashidsmax = (emptytrashidsmax)?emptytrashidsmax*2:0x1000;
+			emptytrashids = realloc(emptytrashids,sizeof(uint32_t)*emptytrashidsmax);
+		}
+		emptytrashids[n++] = id;
+		lastexpire = expire;
+	}
+	if (n==0) {
+		return;
+	}
+	if (trashheapsize>0 && trashheap[0].expire<(uint64_t)ts) {
+		ts = lastexpire+1;
+	}
+	fi=0;
+	ri=0;
+	for (i=0 ; i<n ; i++) {
+		p = fsnodes_id_to_node(emptytrashids[i]);
+		if (p && p->type==TYPE_TRASH) {	// the same node could be taken twice
+			if (fsnodes_purge(ts,p)) {
+				fi++;
+			} else {
+				ri++;
+			}
+		}
+	}
+	fs_changelog(CHLOG_EMPTYTRASH,ts,fi,ri);
+}
+
+void fs_emptyreserved(void) {
+	uint32_t ts,fi,i,n;
+	fsnode *p;
+
+	ts = get_current_time();
+	if (reservedindexon==0) {
+		fsnodes_reservedfree_build();
+	}
+	fi=0;
+	n = reservedfreesize;
+	reservedfreesize = 0;
+	for (i=0 ; i<n ; i++) {
+		p = fsnodes_id_to_node(reservedfree[i]);
+		if (p && p->type==TYPE_RESERVED && p->data.fdata.sessionids==NULL) {
+			fsnodes_purge(ts,p);
+			fi++;
+		}
+	}
+	fs_changelog(CHLOG_EMPTYRESERVED,ts,fi);
+}
 #else
 uint8_t fs_emptytrash(uint32_t ts,uint32_t freeinodes,uint32_t reservedinodes) {
-#endif
 	uint32_t fi,ri;
 	fsedge *e;
 	fsnode *p;
-#ifndef METARESTORE
-	ts = get_current_time();
-#endif
 	fi=0;
 	ri=0;
 	e = trash;
@@ -5748,29 +6674,17 @@ uint8_t fs_emptytrash(uint32_t ts,uint32_t freeinodes,uint32_t reservedinodes) {
 			}
 		}
 	}
-#ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|EMPTYTRASH():%"PRIu32",%"PRIu32,ts,fi,ri);
-#else
 	version++;
 	if (freeinodes!=fi || reservedinodes!=ri) {
 		return ERROR_MISMATCH;
 	}
 	return STATUS_OK;
-#endif
 }
 
-#ifndef METARESTORE
-void fs_emptyreserved(void) {
-	uint32_t ts;
-#else
 uint8_t fs_emptyreserved(uint32_t ts,uint32_t freeinodes) {
-#endif
 	fsedge *e;
 	fsnode *p;
 	uint32_t fi;
-#ifndef METARESTORE
-	ts = get_current_time();
-#endif
 	fi=0;
 	e = reserved;
 	while (e) {
@@ -5781,16 +6695,13 @@ uint8_t fs_emptyreserved(uint32_t ts,uint32_t freeinodes) {
 			fi++;
 		}
 	}
-#ifndef METARESTORE
-	changelog(version++,"%"PRIu32"|EMPTYRESERVED():%"PRIu32,ts,fi);
-#else
 	version++;
 	if (freeinodes!=fi) {
 		return ERROR_MISMATCH;
 	}
 	return STATUS_OK;
-#endif
 }
+#endif
 
 
 #ifdef METARESTORE
@@ -5901,8 +6812,8 @@ void fs_dumpnode(fsnode *f) {
 void fs_dumpnodes() {
 	uint32_t i;
 	fsnode *p;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (p=nodehash[i] ; p ; p=p->next) {
+	for (i=0 ; i<=maxnodeid ; i++) {
+		if ((p=fsnodes_id_to_node(i))!=NULL) {
 			fs_dumpnode(p);
 		}
 	}
@@ -5942,12 +6853,107 @@ void fs_dump(void) {
 
 #endif
 
-void fs_storeedge(fsedge *e,FILE *fd) {
+/* "MFSM 2.0" image - signature, HEAD section (the same 16 bytes as 1.5 header, so fs_loadversion reads both formats), NODE and EDGE sections (up to FSSECTION_RECORDS records each, no end markers), FREE section, CHNK section (chunk_store output), section table and trailer
+   section table: count:32 count*[ tag:32 offset:64 length:64 crc:32 ] crc:32 (of count and entries) ; trailer: tableoffset:64 "MFSM END" */
+#define FSSECTION_HEAD 0x48454144
+#define FSSECTION_NODE 0x4E4F4445
+#define FSSECTION_EDGE 0x45444745
+#define FSSECTION_FREE 0x46524545
+#define FSSECTION_CHNK 0x43484E4B
+/* "MFSD 2.0" delta (metadata.mfs.back.delta.<fromversion>) - the same layout with HEAD extended by fromversion:64, NODE (changed inodes), EDGE (new names and paths of changed trash/reserved files), DELN (removed inodes: id:32), DELE (removed names: parent:32 nleng:16 name), FREE (whole list) and CHKD (chunk_delta_store output) */
+#define FSSECTION_DELN 0x44454C4E
+#define FSSECTION_DELE 0x44454C45
+#define FSSECTION_CHKD 0x43484B44
+/* XORG (chunk_xor_store output) follows CHNK in the image and CHKD in the delta - whole list of xor groups in both */
+#define FSSECTION_XORG 0x584F5247
+#define FSSECTION_RECORDS 0x40000
+#define FSSECTION_ENTRYSIZE (4+8+8+4)
+#define FSSECTION_TRAILERSIZE (8+8)
+
+typedef struct _fssection {
+	uint32_t tag;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t crc;
+} fssection;
+
+static fssection *storesections = NULL;
+static uint32_t storesectionscnt = 0;
+static uint32_t storesectionssize = 0;
+static uint32_t storerecords;
+
+static void fs_section_begin(metastream *ms,uint32_t tag) {
+	fssection *s;
+	if (storesectionscnt==storesectionssize) {
+		storesectionssize = (storesectionssize>0)?storesectionssize*2:64;
+		storesections = (fssection*)realloc(storesections,sizeof(fssection)*storesectionssize);
+	}
+	s = storesections+storesectionscnt;
+	s->tag = tag;
+	s->offset = metastream_tell(ms);
+	s->length = 0;
+	s->crc = 0;
+	storesectionscnt++;
+	storerecords = 0;
+	metastream_section_begin(ms);
+}
+
+static void fs_section_end(metastream *ms) {
+	fssection *s;
+	s = storesections+(storesectionscnt-1);
+	s->length = metastream_tell(ms)-s->offset;
+	s->crc = metastream_section_crc(ms);
+}
+
+// called before each node/edge record - closes full section and opens next one of the same kind
+static inline void fs_section_record(metastream *ms) {
+	if (storerecords==FSSECTION_RECORDS) {
+		fs_section_end(ms);
+		fs_section_begin(ms,storesections[storesectionscnt-1].tag);
+	}
+	storerecords++;
+	metastream_record(ms);
+}
+
+// writes section table (section checksums are calculated by the stream while sections are written) and trailer
+static int fs_section_table(metastream *ms) {
+	uint8_t *buff,*ptr;
+	fssection *s;
+	uint64_t tableoffset;
+	uint32_t i,crc;
+
+	buff = (uint8_t*)malloc(4+storesectionscnt*FSSECTION_ENTRYSIZE+4+FSSECTION_TRAILERSIZE);
+	if (buff==NULL) {
+		storesectionscnt = 0;
+		return -1;
+	}
+	tableoffset = metastream_tell(ms);
+	ptr = buff;
+	put32bit(&ptr,storesectionscnt);
+	for (i=0 ; i<storesectionscnt ; i++) {
+		s = storesections+i;
+		put32bit(&ptr,s->tag);
+		put64bit(&ptr,s->offset);
+		put64bit(&ptr,s->length);
+		put32bit(&ptr,s->crc);
+	}
+	crc = mycrc32(0,buff,ptr-buff);
+	put32bit(&ptr,crc);
+	put64bit(&ptr,tableoffset);
+	memcpy(ptr,"MFSM END",8);
+	ptr+=8;
+	metastream_write(ms,buff,ptr-buff);
+	free(buff);
+	storesectionscnt = 0;
+	return metastream_error(ms)?-1:0;
+}
+
+void fs_storeedge(fsedge *e,metastream *ms) {
 	uint8_t uedgebuff[4+4+2+65535];
 	uint8_t *ptr;
 	if (e==NULL) {	// last edge
 		memset(uedgebuff,0,4+4+2);
-		fwrite(uedgebuff,1,4+4+2,fd);
+		metastream_write(ms,uedgebuff,4+4+2);
 		return;
 	}
 	ptr = uedgebuff;
@@ -5959,54 +6965,100 @@ void fs_storeedge(fsedge *e,FILE *fd) {
 	put32bit(&ptr,e->child->id);
 	put16bit(&ptr,e->nleng);
 	memcpy(ptr,e->name,e->nleng);
-	fwrite(uedgebuff,1,4+4+2+e->nleng,fd);
+	metastream_write(ms,uedgebuff,4+4+2+e->nleng);
 }
 
-int fs_loadedge(FILE *fd) {
-	uint8_t uedgebuff[4+4+2];
-	const uint8_t *ptr;
-	uint32_t parent_id;
-	uint32_t child_id;
-#ifdef EDGEHASH
-	uint32_t hpos;
-#endif
-	fsedge *e;
+// links loaded (and already checked) edge into children list of its parent (or trash/reserved list) and parents list of its child
+static inline void fs_loadedge_link(fsedge *e) {
 #ifndef METARESTORE
 	statsrecord sr;
 #endif
-
-	if (fread(uedgebuff,1,4+4+2,fd)!=4+4+2) {
-#ifdef METARESTORE
-		fprintf(stderr,"loading edge: read error: %s\n",strerror(errno));
-#else
-		syslog(LOG_ERR,"loading edge: read error: %m");
-#endif
-		return -1;
-	}
-	ptr = uedgebuff;
-	parent_id = get32bit(&ptr);
-	child_id = get32bit(&ptr);
-	if (parent_id==0 && child_id==0) {	// last edge
-		return 1;
-	}
-	e = malloc(sizeof(fsedge));
-	if (e==NULL) {
-#ifdef METARESTORE
-		fprintf(stderr,"loading edge: edge alloc: out of memory\n");
-#else
-		syslog(LOG_ERR,"loading edge: edge alloc: out of memory");
-#endif
-		return -1;
-	}
-	e->nleng = get16bit(&ptr);
-	e->name = malloc(e->nleng);
-	if (e->name==NULL) {
-#ifdef METARESTORE
-		fprintf(stderr,"loading edge: name alloc: out of memory\n");
+	if (e->parent==NULL) {
+		if (e->child->type==TYPE_TRASH) {
+			e->nextchild = trash;
+			if (e->nextchild) {
+				e->nextchild->prevchild = &(e->nextchild);
+			}
+			trash = e;
+			e->prevchild = &trash;
+			trashspace += e->child->data.fdata.length;
+			trashnodes++;
+		} else {
+			e->nextchild = reserved;
+			if (e->nextchild) {
+				e->nextchild->prevchild = &(e->nextchild);
+			}
+			reserved = e;
+			e->prevchild = &reserved;
+			reservedspace += e->child->data.fdata.length;
+			reservednodes++;
+		}
+	} else {
+		e->nextchild = e->parent->data.ddata.children;
+		if (e->nextchild) {
+			e->nextchild->prevchild = &(e->nextchild);
+		}
+		e->parent->data.ddata.children = e;
+		e->prevchild = &(e->parent->data.ddata.children);
+		e->parent->data.ddata.elements++;
+		if (e->child->type==TYPE_DIRECTORY) {
+			e->parent->data.ddata.nlink++;
+		}
+	}
+	e->nextparent = e->child->parents;
+	if (e->nextparent) {
+		e->nextparent->prevparent = &(e->nextparent);
+	}
+	e->child->parents = e;
+	e->prevparent = &(e->child->parents);
+#ifndef METARESTORE
+	if (e->parent) {
+		fsnodes_get_stats(e->child,&sr);
+		fsnodes_add_stats(e->parent,&sr);
+	}
+#endif
+}
+
+int fs_loadedge(FILE *fd) {
+	uint8_t uedgebuff[4+4+2];
+	const uint8_t *ptr;
+	uint32_t parent_id;
+	uint32_t child_id;
+	uint16_t nleng;
+	fsedge *e;
+
+	if (fread(uedgebuff,1,4+4+2,fd)!=4+4+2) {
+#ifdef METARESTORE
+		fprintf(stderr,"loading edge: read error: %s\n",strerror(errno));
+#else
+		syslog(LOG_ERR,"loading edge: read error: %m");
+#endif
+		return -1;
+	}
+	ptr = uedgebuff;
+	parent_id = get32bit(&ptr);
+	child_id = get32bit(&ptr);
+	if (parent_id==0 && child_id==0) {	// last edge
+		return 1;
+	}
+	nleng = get16bit(&ptr);
+	e = fsedge_malloc(nleng);
+	if (e==NULL) {
+#ifdef METARESTORE
+		fprintf(stderr,"loading edge: edge alloc: out of memory\n");
+#else
+		syslog(LOG_ERR,"loading edge: edge alloc: out of memory");
+#endif
+		return -1;
+	}
+	e->nleng = nleng;
+	if (e->name==NULL && nleng>0) {
+#ifdef METARESTORE
+		fprintf(stderr,"loading edge: name alloc: out of memory\n");
 #else
 		syslog(LOG_ERR,"loading edge: name alloc: out of memory");
 #endif
-		free(e);
+		fsedge_free(e);
 		return -1;
 	}
 	if (fread(e->name,1,e->nleng,fd)!=e->nleng) {
@@ -6015,8 +7067,7 @@ int fs_loadedge(FILE *fd) {
 #else
 		syslog(LOG_ERR,"loading edge: read error: %m");
 #endif
-		free(e->name);
-		free(e);
+		fsedge_free(e);
 		return -1;
 	}
 	e->child = fsnodes_id_to_node(child_id);
@@ -6026,47 +7077,18 @@ int fs_loadedge(FILE *fd) {
 #else
 		syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: child not found",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
 #endif
-		free(e->name);
-		free(e);
+		fsedge_free(e);
 		return -1;
 	}
 	if (parent_id==0) {
-		if (e->child->type==TYPE_TRASH) {
-			e->parent = NULL;
-			e->nextchild = trash;
-			if (e->nextchild) {
-				e->nextchild->prevchild = &(e->nextchild);
-			}
-			trash = e;
-			e->prevchild = &trash;
-#ifdef EDGEHASH
-			e->next = NULL;
-			e->prev = NULL;
-#endif
-			trashspace += e->child->data.fdata.length;
-			trashnodes++;
-		} else if (e->child->type==TYPE_RESERVED) {
-			e->parent = NULL;
-			e->nextchild = reserved;
-			if (e->nextchild) {
-				e->nextchild->prevchild = &(e->nextchild);
-			}
-			reserved = e;
-			e->prevchild = &reserved;
-#ifdef EDGEHASH
-			e->next = NULL;
-			e->prev = NULL;
-#endif
-			reservedspace += e->child->data.fdata.length;
-			reservednodes++;
-		} else {
+		e->parent = NULL;
+		if (e->child->type!=TYPE_TRASH && e->child->type!=TYPE_RESERVED) {
 #ifdef METARESTORE
 			fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad child type (%c)\n",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,e->child->type);
 #else
 			syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad child type (%c)",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,e->child->type);
 #endif
-			free(e->name);
-			free(e);
+			fsedge_free(e);
 			return -1;
 		}
 	} else {
@@ -6077,8 +7099,7 @@ int fs_loadedge(FILE *fd) {
 #else
 			syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: parent not found",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
 #endif
-			free(e->name);
-			free(e);
+			fsedge_free(e);
 			return -1;
 		}
 		if (e->parent->type!=TYPE_DIRECTORY) {
@@ -6087,53 +7108,29 @@ int fs_loadedge(FILE *fd) {
 #else
 			syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad parent type (%c)",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,e->parent->type);
 #endif
-			free(e->name);
-			free(e);
+			fsedge_free(e);
 			return -1;
 		}
-		e->nextchild = e->parent->data.ddata.children;
-		if (e->nextchild) {
-			e->nextchild->prevchild = &(e->nextchild);
-		}
-		e->parent->data.ddata.children = e;
-		e->prevchild = &(e->parent->data.ddata.children);
-		e->parent->data.ddata.elements++;
-		if (e->child->type==TYPE_DIRECTORY) {
-			e->parent->data.ddata.nlink++;
-		}
-#ifdef EDGEHASH
-		hpos = EDGEHASHPOS(fsnodes_hash(e->parent->id,e->nleng,e->name));
-		e->next = edgehash[hpos];
-		if (e->next) {
-			e->next->prev = &(e->next);
-		}
-		edgehash[hpos] = e;
-		e->prev = &(edgehash[hpos]);
-#endif
-	}
-	e->nextparent = e->child->parents;
-	if (e->nextparent) {
-		e->nextparent->prevparent = &(e->nextparent);
 	}
-	e->child->parents = e;
-	e->prevparent = &(e->child->parents);
-#ifndef METARESTORE
+	fs_loadedge_link(e);
+#ifdef EDGEHASH
 	if (e->parent) {
-		fsnodes_get_stats(e->child,&sr);
-		fsnodes_add_stats(e->parent,&sr);
+		e->hash = fsnodes_hash(e->nleng,e->name);
+		fsnodes_nameidx_add(e->parent,e);
 	}
 #endif
 	return 0;
 }
 
-void fs_storenode(fsnode *f,FILE *fd) {
+void fs_storenode(fsnode *f,metastream *ms) {
 	uint8_t unodebuff[1+4+1+2+4+4+4+4+4+4+8+4+2+8*MAX_CHUNKS_PER_FILE+4*65536+4];
 	uint8_t *ptr;
 	uint32_t indx,ch,sessionids;
 	sessionidrec *sessionidptr;
 
 	if (f==NULL) {	// last node
-		fputc(0,fd);
+		unodebuff[0] = 0;
+		metastream_write(ms,unodebuff,1);
 		return;
 	}
 	ptr = unodebuff;
@@ -6151,17 +7148,17 @@ void fs_storenode(fsnode *f,FILE *fd) {
 	case TYPE_DIRECTORY:
 	case TYPE_SOCKET:
 	case TYPE_FIFO:
-		fwrite(unodebuff,1,1+4+1+2+4+4+4+4+4+4,fd);
+		metastream_write(ms,unodebuff,1+4+1+2+4+4+4+4+4+4);
 		break;
 	case TYPE_BLOCKDEV:
 	case TYPE_CHARDEV:
 		put32bit(&ptr,f->data.rdev);
-		fwrite(unodebuff,1,1+4+1+2+4+4+4+4+4+4+4,fd);
+		metastream_write(ms,unodebuff,1+4+1+2+4+4+4+4+4+4+4);
 		break;
 	case TYPE_SYMLINK:
 		put32bit(&ptr,f->data.sdata.pleng);
-		fwrite(unodebuff,1,1+4+1+2+4+4+4+4+4+4+4,fd);
-		fwrite(f->data.sdata.path,1,f->data.sdata.pleng,fd);
+		metastream_write(ms,unodebuff,1+4+1+2+4+4+4+4+4+4+4);
+		metastream_write(ms,f->data.sdata.path,f->data.sdata.pleng);
 		break;
 	case TYPE_FILE:
 	case TYPE_TRASH:
@@ -6190,7 +7187,7 @@ void fs_storenode(fsnode *f,FILE *fd) {
 			sessionids++;
 		}
 
-		fwrite(unodebuff,1,1+4+1+2+4+4+4+4+4+4+8+4+2+8*ch+4*sessionids,fd);
+		metastream_write(ms,unodebuff,1+4+1+2+4+4+4+4+4+4+8+4+2+8*ch+4*sessionids);
 	}
 }
 
@@ -6201,7 +7198,6 @@ int fs_loadnode(FILE *fd) {
 	uint32_t indx,pleng,ch,sessionids,sessionid;
 	fsnode *p;
 	sessionidrec *sessionidptr;
-	uint32_t nodepos;
 #ifndef METARESTORE
 	statsrecord *sr;
 #endif
@@ -6210,7 +7206,7 @@ int fs_loadnode(FILE *fd) {
 	if (type==0) {	// last node
 		return 1;
 	}
-	p = malloc(sizeof(fsnode));
+	p = fsnode_malloc();
 	if (p==NULL) {
 #ifdef METARESTORE
 		fprintf(stderr,"loading node: node alloc: out of memory\n");
@@ -6230,7 +7226,7 @@ int fs_loadnode(FILE *fd) {
 #else
 			syslog(LOG_ERR,"loading node: read error: %m");
 #endif
-			free(p);
+			fsnode_free(p);
 			return -1;
 		}
 		break;
@@ -6243,7 +7239,7 @@ int fs_loadnode(FILE *fd) {
 #else
 			syslog(LOG_ERR,"loading node: read error: %m");
 #endif
-			free(p);
+			fsnode_free(p);
 			return -1;
 		}
 		break;
@@ -6256,7 +7252,7 @@ int fs_loadnode(FILE *fd) {
 #else
 			syslog(LOG_ERR,"loading node: read error: %m");
 #endif
-			free(p);
+			fsnode_free(p);
 			return -1;
 		}
 		break;
@@ -6266,7 +7262,7 @@ int fs_loadnode(FILE *fd) {
 #else
 		syslog(LOG_ERR,"loading node: unrecognized node type: %c",type);
 #endif
-		free(p);
+		fsnode_free(p);
 		return -1;
 	}
 	ptr = unodebuff;
@@ -6288,6 +7284,9 @@ int fs_loadnode(FILE *fd) {
 		p->data.ddata.quota = NULL;
 #endif
 		p->data.ddata.children = NULL;
+#ifdef EDGEHASH
+		p->data.ddata.nameidx = NULL;
+#endif
 		p->data.ddata.nlink = 2;
 		p->data.ddata.elements = 0;
 	case TYPE_SOCKET:
@@ -6308,7 +7307,7 @@ int fs_loadnode(FILE *fd) {
 #else
 				syslog(LOG_ERR,"loading node: path alloc: out of memory");
 #endif
-				free(p);
+				fsnode_free(p);
 				return -1;
 			}
 			if (fread(p->data.sdata.path,1,pleng,fd)!=pleng) {
@@ -6318,7 +7317,7 @@ int fs_loadnode(FILE *fd) {
 				syslog(LOG_ERR,"loading node: read error: %m");
 #endif
 				free(p->data.sdata.path);
-				free(p);
+				fsnode_free(p);
 				return -1;
 			}
 		} else {
@@ -6340,7 +7339,7 @@ int fs_loadnode(FILE *fd) {
 #else
 				syslog(LOG_ERR,"loading node: chunktab alloc: out of memory");
 #endif
-				free(p);
+				fsnode_free(p);
 				return -1;
 			}
 		} else {
@@ -6355,7 +7354,7 @@ int fs_loadnode(FILE *fd) {
 			if (p->data.fdata.chunktab) {
 				free(p->data.fdata.chunktab);
 			}
-			free(p);
+			fsnode_free(p);
 			return -1;
 		}
 		for (indx=0 ; indx<ch ; indx++) {
@@ -6374,7 +7373,7 @@ int fs_loadnode(FILE *fd) {
 				if (p->data.fdata.chunktab) {
 					free(p->data.fdata.chunktab);
 				}
-				free(p);
+				fsnode_free(p);
 				return -1;
 			}
 			sessionidptr->sessionid = sessionid;
@@ -6387,9 +7386,7 @@ int fs_loadnode(FILE *fd) {
 		}
 	}
 	p->parents = NULL;
-	nodepos = NODEHASHPOS(p->id);
-	p->next = nodehash[nodepos];
-	nodehash[nodepos] = p;
+	fsnodes_nodetab_insert(p);
 	fsnodes_used_inode(p->id);
 	nodes++;
 	if (type==TYPE_DIRECTORY) {
@@ -6401,39 +7398,43 @@ int fs_loadnode(FILE *fd) {
 	return 0;
 }
 
-void fs_storenodes(FILE *fd) {
+void fs_storenodes(metastream *ms) {
 	uint32_t i;
 	fsnode *p;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (p=nodehash[i] ; p ; p=p->next) {
-			fs_storenode(p,fd);
+	fs_section_begin(ms,FSSECTION_NODE);
+	for (i=0 ; i<=maxnodeid ; i++) {
+		if ((p=fsnodes_id_to_node(i))!=NULL) {
+			fs_section_record(ms);
+			fs_storenode(p,ms);
 		}
 	}
-	fs_storenode(NULL,fd);	// end marker
+	fs_section_end(ms);
 }
 
-void fs_storeedgelist(fsedge *e,FILE *fd) {
+void fs_storeedgelist(fsedge *e,metastream *ms) {
 	while (e) {
-		fs_storeedge(e,fd);
+		fs_section_record(ms);
+		fs_storeedge(e,ms);
 		e=e->nextchild;
 	}
 }
 
-void fs_storeedges_rec(fsnode *f,FILE *fd) {
+void fs_storeedges_rec(fsnode *f,metastream *ms) {
 	fsedge *e;
-	fs_storeedgelist(f->data.ddata.children,fd);
+	fs_storeedgelist(f->data.ddata.children,ms);
 	for (e=f->data.ddata.children ; e ; e=e->nextchild) {
 		if (e->child->type==TYPE_DIRECTORY) {
-			fs_storeedges_rec(e->child,fd);
+			fs_storeedges_rec(e->child,ms);
 		}
 	}
 }
 
-void fs_storeedges(FILE *fd) {
-	fs_storeedges_rec(root,fd);
-	fs_storeedgelist(trash,fd);
-	fs_storeedgelist(reserved,fd);
-	fs_storeedge(NULL,fd);	// end marker
+void fs_storeedges(metastream *ms) {
+	fs_section_begin(ms,FSSECTION_EDGE);
+	fs_storeedges_rec(root,ms);
+	fs_storeedgelist(trash,ms);
+	fs_storeedgelist(reserved,ms);
+	fs_section_end(ms);
 }
 
 int fs_lostnode(fsnode *p) {
@@ -6458,8 +7459,8 @@ int fs_lostnode(fsnode *p) {
 int fs_checknodes() {
 	uint32_t i;
 	fsnode *p;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (p=nodehash[i] ; p ; p=p->next) {
+	for (i=0 ; i<=maxnodeid ; i++) {
+		if ((p=fsnodes_id_to_node(i))!=NULL) {
 			if (p->parents==NULL && p!=root) {
 #ifdef METARESTORE
 				fprintf(stderr,"fschk: found lost inode: %"PRIu32"\n",p->id);
@@ -6501,25 +7502,34 @@ int fs_loadedges(FILE *fd) {
 fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 	uint8_t unodebuff[4+2+MAXFNAMELENG+1+2+4+4+4+4+4+4+8+4+2+8*MAX_CHUNKS_PER_FILE+4*65536+4];
 	const uint8_t *ptr;
-	uint32_t pleng,indx,ch,sessionids,sessionid;
+	uint32_t pleng,indx,ch,sessionids,sessionid,nodeid;
+	uint16_t nleng;
 	fsnode *p;
 	fsedge *e;
 	sessionidrec *sessionidptr;
-	uint32_t nodepos;
-#ifdef EDGEHASH
-	uint32_t hpos;
-#endif
 #ifndef METARESTORE
 	statsrecord *sr;
 #endif
 
-	p = malloc(sizeof(fsnode));
+	if (fread(unodebuff,1,4+2,fd)!=4+2) {
+		return NULL;
+	}
+	ptr = unodebuff;
+	nodeid = get32bit(&ptr);
+	nleng = get16bit(&ptr);
+	p = fsnode_malloc();
 	if (p==NULL) {
 		return NULL;
 	}
-	e = malloc(sizeof(fsedge));
+	e = fsedge_malloc(nleng);
 	if (e==NULL) {
-		free(p);
+		fsnode_free(p);
+		return NULL;
+	}
+	e->nleng = nleng;
+	if (e->name==NULL && nleng>0) {
+		fsedge_free(e);
+		fsnode_free(p);
 		return NULL;
 	}
 	e->child = p;
@@ -6529,28 +7539,14 @@ fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 	p->parents = e;
 
 	p->type = type;
-	if (fread(unodebuff,1,4+2,fd)!=4+2) {
-		free(e);
-		free(p);
-		return NULL;
-	}
-	ptr = unodebuff;
-	p->id = get32bit(&ptr);
-	e->nleng = get16bit(&ptr);
-	e->name = malloc(e->nleng);
-	if (e->name==NULL) {
-		free(e);
-		free(p);
-		return NULL;
-	}
+	p->id = nodeid;
 	switch (type) {
 	case TYPE_DIRECTORY:
 	case TYPE_FIFO:
 	case TYPE_SOCKET:
 		if (fread(unodebuff+6,1,e->nleng+1+2+4+4+4+4+4+4,fd)!=(size_t)(e->nleng+1+2+4+4+4+4+4+4)) {
-			free(e->name);
-			free(e);
-			free(p);
+			fsedge_free(e);
+			fsnode_free(p);
 			return NULL;
 		}
 		break;
@@ -6558,24 +7554,21 @@ fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 	case TYPE_CHARDEV:
 	case TYPE_SYMLINK:
 		if (fread(unodebuff+6,1,e->nleng+1+2+4+4+4+4+4+4+4,fd)!=(size_t)(e->nleng+1+2+4+4+4+4+4+4+4)) {
-			free(e->name);
-			free(e);
-			free(p);
+			fsedge_free(e);
+			fsnode_free(p);
 			return NULL;
 		}
 		break;
 	case TYPE_FILE:
 		if (fread(unodebuff+6,1,e->nleng+1+2+4+4+4+4+4+4+8+4+2,fd)!=(size_t)(e->nleng+1+2+4+4+4+4+4+4+8+4+2)) {
-			free(e->name);
-			free(e);
-			free(p);
+			fsedge_free(e);
+			fsnode_free(p);
 			return NULL;
 		}
 		break;
 	default:
-		free(e->name);
-		free(e);
-		free(p);
+		fsedge_free(e);
+		fsnode_free(p);
 		return NULL;
 	}
 
@@ -6599,6 +7592,9 @@ fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 		p->data.ddata.quota = NULL;
 #endif
 		p->data.ddata.children = NULL;
+#ifdef EDGEHASH
+		p->data.ddata.nameidx = NULL;
+#endif
 		p->data.ddata.nlink = 2;
 		p->data.ddata.elements = 0;
 	case TYPE_SOCKET:
@@ -6613,15 +7609,13 @@ fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 		if (pleng>0) {
 			p->data.sdata.path = malloc(pleng);
 			if (p->data.sdata.path==NULL) {
-				free(e->name);
-				free(e);
-				free(p);
+				fsedge_free(e);
+				fsnode_free(p);
 				return NULL;
 			}
 			if (fread(p->data.sdata.path,1,pleng,fd)!=pleng) {
-				free(e->name);
-				free(e);
-				free(p);
+				fsedge_free(e);
+				fsnode_free(p);
 				return NULL;
 			}
 			while (pleng>0 && p->data.sdata.path[pleng-1]==0) {
@@ -6640,25 +7634,22 @@ fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 		sessionids = get16bit(&ptr);
 		if (flag==FLAG_TRASH) {
 			if (fread((uint8_t*)ptr,1,8*ch+4*sessionids+4,fd)!=8*ch+4*sessionids+4) {
-				free(e->name);
-				free(e);
-				free(p);
+				fsedge_free(e);
+				fsnode_free(p);
 				return NULL;
 			}
 		} else if (ch>0 || sessionids>0) {
 			if (fread((uint8_t*)ptr,1,8*ch+4*sessionids,fd)!=8*ch+4*sessionids) {
-				free(e->name);
-				free(e);
-				free(p);
+				fsedge_free(e);
+				fsnode_free(p);
 				return NULL;
 			}
 		}
 		if (ch>0) {
 			p->data.fdata.chunktab = malloc(sizeof(uint64_t)*ch);
 			if (p->data.fdata.chunktab==NULL) {
-				free(e->name);
-				free(e);
-				free(p);
+				fsedge_free(e);
+				fsnode_free(p);
 				return NULL;
 			}
 		} else {
@@ -6689,9 +7680,8 @@ fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 						free(p->data.fdata.chunktab);
 					}
 					// free sessionid list ?
-					free(e->name);
-					free(e);
-					free(p);
+					fsedge_free(e);
+					fsnode_free(p);
 					return NULL;
 				}
 				if (fread(tmpname,1,pleng,fd)!=pleng) {
@@ -6699,9 +7689,8 @@ fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 						free(p->data.fdata.chunktab);
 					}
 					// free sessionid list ?
-					free(e->name);
-					free(e);
-					free(p);
+					fsedge_free(e);
+					fsnode_free(p);
 					return NULL;
 				}
 				while (pleng>0 && tmpname[pleng-1]==0) {
@@ -6709,7 +7698,7 @@ fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 				}
 				tmpname[pleng]='/';
 				memcpy(tmpname+pleng+1,e->name,e->nleng);
-				free(e->name);
+				fsedge_name_free(e);
 				e->name = tmpname;
 				e->nleng+=pleng+1;
 			}
@@ -6729,13 +7718,8 @@ fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 		node->data.ddata.children = e;
 		e->prevchild = &(node->data.ddata.children);
 #ifdef EDGEHASH
-		hpos = EDGEHASHPOS(fsnodes_hash(e->parent->id,e->nleng,e->name));
-		e->next = edgehash[hpos];
-		if (e->next) {
-			e->next->prev = &(e->next);
-		}
-		edgehash[hpos] = e;
-		e->prev = &(edgehash[hpos]);
+		e->hash = fsnodes_hash(e->nleng,e->name);
+		fsnodes_nameidx_add(e->parent,e);
 #endif
 	} else if (flag==FLAG_TRASH) {
 //		p->parent = NULL;
@@ -6746,10 +7730,6 @@ fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 		}
 		trash = e;
 		e->prevchild = &trash;
-#ifdef EDGEHASH
-		e->next = NULL;
-		e->prev = NULL;
-#endif
 		trashspace += p->data.fdata.length;
 		trashnodes++;
 	} else {	// flag==FLAG_RESERVED
@@ -6761,17 +7741,11 @@ fsnode* fs_loaduninode_1_4(int flag,uint8_t type,fsnode* node,FILE *fd) {
 		}
 		reserved = e;
 		e->prevchild = &reserved;
-#ifdef EDGEHASH
-		e->next = NULL;
-		e->prev = NULL;
-#endif
 		reservedspace += p->data.fdata.length;
 		reservednodes++;
 	}
 //	p->parents = NULL;
-	nodepos = NODEHASHPOS(p->id);
-	p->next = nodehash[nodepos];
-	nodehash[nodepos] = p;
+	fsnodes_nodetab_insert(p);
 	fsnodes_used_inode(p->id);
 	nodes++;
 	if (type==TYPE_DIRECTORY) {
@@ -6787,18 +7761,18 @@ int fs_loadrootnode_1_4(FILE *fd) {
 	uint8_t dnodebuff[1+2+4+4+4+4+4+4];
 	const uint8_t *ptr;
 	fsnode *p;
-	uint32_t nodepos;
 #ifndef METARESTORE
 	statsrecord *sr;
 #endif
 
-	p = malloc(sizeof(fsnode));
+	p = fsnode_malloc();
 	if (p==NULL) {
 		return -1;
 	}
 	root = p;
 	if (fread(dnodebuff,1,1+2+4+4+4+4+4+4,fd)!=1+2+4+4+4+4+4+4) {
-		free(p);
+		fsnode_free(p);
+		root = NULL;
 		return -1;
 	}
 	ptr = dnodebuff;
@@ -6819,12 +7793,13 @@ int fs_loadrootnode_1_4(FILE *fd) {
 	p->data.ddata.quota = NULL;
 #endif
 	p->data.ddata.children = NULL;
+#ifdef EDGEHASH
+	p->data.ddata.nameidx = NULL;
+#endif
 	p->data.ddata.elements = 0;
 	p->data.ddata.nlink = 2;
 	p->parents = NULL;
-	nodepos = NODEHASHPOS(p->id);
-	p->next = nodehash[nodepos];
-	nodehash[nodepos] = p;
+	fsnodes_nodetab_insert(p);
 	fsnodes_used_inode(p->id);
 	nodes=1;
 	dirnodes=1;
@@ -6893,7 +7868,7 @@ int fs_loadreserved_1_4(FILE *fd) {
 }
 */
 
-void fs_storefree(FILE *fd) {
+void fs_storefree(metastream *ms) {
 	uint8_t wbuff[8*1024],*ptr;
 	freenode *n;
 	uint32_t l;
@@ -6903,12 +7878,12 @@ void fs_storefree(FILE *fd) {
 	}
 	ptr = wbuff;
 	put32bit(&ptr,l);
-	fwrite(wbuff,1,4,fd);
+	metastream_write(ms,wbuff,4);
 	l=0;
 	ptr=wbuff;
 	for (n=freelist ; n ; n=n->next) {
 		if (l==1024) {
-			fwrite(wbuff,1,8*1024,fd);
+			metastream_write(ms,wbuff,8*1024);
 			l=0;
 			ptr=wbuff;
 		}
@@ -6917,7 +7892,7 @@ void fs_storefree(FILE *fd) {
 		l++;
 	}
 	if (l>0) {
-		fwrite(wbuff,1,8*l,fd);
+		metastream_write(ms,wbuff,8*l);
 	}
 }
 
@@ -6940,136 +7915,1628 @@ int fs_loadfree(FILE *fd) {
 				if (fread(rbuff,1,8*1024,fd)!=8*1024) {
 					return -1;
 				}
-				l=1024;
-			} else {
-				if (fread(rbuff,1,8*t,fd)!=8*t) {
-					return -1;
+				l=1024;
+			} else {
+				if (fread(rbuff,1,8*t,fd)!=8*t) {
+					return -1;
+				}
+				l=t;
+			}
+			ptr = rbuff;
+		}
+		n = freenode_malloc();
+		if (n==NULL) {
+			return -1;
+		}
+		n->id = get32bit(&ptr);
+		n->ftime = get32bit(&ptr);
+		n->next = NULL;
+		*freetail = n;
+		freetail = &(n->next);
+		fsnodes_used_inode(n->id);
+		l--;
+		t--;
+	}
+	return 0;
+}
+
+int fs_store(metastream *ms) {
+	uint8_t hdr[16];
+	uint8_t *ptr;
+	ptr = hdr;
+	put32bit(&ptr,maxnodeid);
+	put64bit(&ptr,version);
+    MFSLOG(LOG_NOTICE, "store version:%llu\n", version);
+	put32bit(&ptr,nextsessionid);
+	metastream_write(ms,"MFSM 2.0",8);
+	fs_section_begin(ms,FSSECTION_HEAD);
+	metastream_write(ms,hdr,16);
+	fs_section_end(ms);
+	fs_storenodes(ms);
+	fs_storeedges(ms);
+	fs_section_begin(ms,FSSECTION_FREE);
+	fs_storefree(ms);
+	fs_section_end(ms);
+	fs_section_begin(ms,FSSECTION_CHNK);
+	chunk_store(ms);
+	fs_section_end(ms);
+	fs_section_begin(ms,FSSECTION_XORG);
+	chunk_xor_store(ms);
+	fs_section_end(ms);
+	return fs_section_table(ms);
+}
+
+static uint8_t fsstorelevel = 0;	// METADATA_COMPRESSION
+static uint8_t fsstoreverify = 0;	// METADATA_STORE_VERIFY
+
+// writes whole image to 'fname' (the file is fsynced and checked before returning) ; returns 0, -1 (write error) or -2 (checksum mismatch)
+static int fs_store_file(const char *fname,uint64_t bwlimit,metastream_progress *progress) {
+	metastream *ms;
+	int fd,status,ret;
+
+	fd = open(fname,O_RDWR|O_CREAT|O_TRUNC,0666);
+	if (fd<0) {
+		return -1;
+	}
+	ms = metastream_open(fd,fsstorelevel,bwlimit,fsstoreverify,progress);
+	if (ms==NULL) {
+		close(fd);
+		return -1;
+	}
+	status = fs_store(ms);
+	ret = metastream_close(ms,NULL,NULL);
+	if (ret==0 && status<0) {
+		ret = -1;
+	}
+	if (close(fd)<0 && ret==0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+#ifndef METARESTORE
+#define FSSTORE_IMAGE 0
+#define FSSTORE_DELTA 1
+#define FSSTORE_RESULT_NONE 0
+#define FSSTORE_RESULT_OK 1
+#define FSSTORE_RESULT_FAILED 2
+
+static uint32_t fsstorespeed = 0;	// METADATA_STORE_SPEED_LIMIT (MiB/s) - background stores only
+static metastream_progress *fsstoreprogress = NULL;	// [FSSTORE_IMAGE] and [FSSTORE_DELTA] - shared with background store process
+static pid_t fsstorechild = 0;
+static uint64_t fsstorelastbytes = 0;
+static uint64_t fsstorelastusec = 0;
+
+static void fs_storeprogress_init(void) {
+	void *p;
+	p = mmap(NULL,sizeof(metastream_progress)*2,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANON,-1,0);
+	if (p==MAP_FAILED) {	// progress of background stores won't be visible
+		p = malloc(sizeof(metastream_progress)*2);
+	}
+	memset(p,0,sizeof(metastream_progress)*2);
+	fsstoreprogress = (metastream_progress*)p;
+}
+
+static void fs_storeprogress_end(uint8_t kind,int status) {
+	fsstoreprogress[kind].laststatus = (status<0)?FSSTORE_RESULT_FAILED:FSSTORE_RESULT_OK;
+	fsstoreprogress[kind].status = 0;
+}
+
+// for charts - bytes written to disk and time spent by metadata stores since the previous call
+void fs_storestats(uint64_t *bytes,uint32_t *msec) {
+	uint64_t b,u;
+	b = fsstoreprogress[FSSTORE_IMAGE].totalbytes+fsstoreprogress[FSSTORE_DELTA].totalbytes;
+	u = fsstoreprogress[FSSTORE_IMAGE].totalusec+fsstoreprogress[FSSTORE_DELTA].totalusec;
+	*bytes = b-fsstorelastbytes;
+	*msec = (u-fsstorelastusec)/1000;
+	fsstorelastbytes = b;
+	fsstorelastusec = u;
+}
+
+// state of running (or the last) metadata store: status - bit 0: image store running, bit 1: delta store running ; result - FSSTORE_RESULT_* of the reported store
+void fs_storeinfo(uint8_t *status,uint8_t *result,uint32_t *start,uint32_t *msec,uint64_t *bytes,uint64_t *stored,uint64_t *records) {
+	metastream_progress *p;
+	p = fsstoreprogress+FSSTORE_IMAGE;
+	if (fsstoreprogress[FSSTORE_DELTA].starttime>p->starttime) {
+		p = fsstoreprogress+FSSTORE_DELTA;
+	}
+	*status = (fsstoreprogress[FSSTORE_IMAGE].status?1:0) | (fsstoreprogress[FSSTORE_DELTA].status?2:0);
+	*result = p->status?FSSTORE_RESULT_NONE:p->laststatus;
+	*start = p->starttime;
+	*msec = p->msec;
+	*bytes = p->bytes;
+	*stored = p->stored;
+	*records = p->records;
+}
+
+static uint32_t fsmaxdeltas = 23;	// METADATA_MAX_DELTAS
+static uint64_t fsdeltafrom = 0;	// version of the last checkpoint - base of the next delta
+static uint32_t fsdeltacount = 0;	// deltas written since the last full image
+static uint64_t fsdeltabytes = 0;
+static uint8_t fsdeltafailed = 0;	// delta chain is broken - next checkpoint has to be a full image
+
+// delta writer - delta is built in memory by the main thread and written to disk by a separate thread
+static pthread_mutex_t fsdeltalock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t fsdeltathread;
+static uint8_t fsdeltawriter = 0;	// writer started and not joined yet
+static uint8_t fsdeltabusy = 0;
+static uint8_t *fsdeltabuff = NULL;
+static uint64_t fsdeltaleng = 0;
+static uint64_t fsdeltarecords = 0;
+static uint64_t fsdeltaname = 0;
+
+// removes deltas made for older metadata.mfs.back files (all deltas with fromversion lower than 'below')
+static void fs_delta_cleanup(uint64_t below) {
+	DIR *dd;
+	struct dirent *de;
+	char *endp;
+	uint64_t fromversion;
+
+	dd = opendir(".");
+	if (dd==NULL) {
+		return;
+	}
+	while ((de = readdir(dd))!=NULL) {
+		if (strncmp(de->d_name,"metadata.mfs.back.delta.",24)==0) {
+			fromversion = strtoull(de->d_name+24,&endp,10);
+			if (fromversion<below || *endp) {
+				unlink(de->d_name);
+			}
+		}
+	}
+	closedir(dd);
+}
+
+// starts a new delta chain on top of just stored full image (or stops tracking changes)
+static void fs_delta_restart(void) {
+	uint32_t page,i,j;
+	fsnode *p;
+	fsedge *e;
+	uint8_t track;
+
+	track = (fsmaxdeltas>0 && ismaster())?1:0;
+	for (page=0 ; page<fsdirtypages ; page++) {
+		if (fsdirtytab[page]==NULL) {
+			continue;
+		}
+		for (i=0 ; i<NODETABPAGESIZE/32 ; i++) {
+			for (j=0 ; j<32 ; j++) {
+				if (fsdirtytab[page][i]&(1U<<j)) {
+					p = fsnodes_id_to_node(page*NODETABPAGESIZE+i*32+j);
+					if (p && p->type==TYPE_DIRECTORY) {
+						for (e=p->data.ddata.children ; e ; e=e->nextchild) {
+							e->delta = 0;
+						}
+					}
+				}
+			}
+		}
+		free(fsdirtytab[page]);
+		fsdirtytab[page] = NULL;
+	}
+	fsdeltadelleng = 0;
+	chunk_delta_reset(track);
+	fsdeltaon = track;
+	fsdeltafrom = version;
+	fsdeltacount = 0;
+	fsdeltabytes = 0;
+	fsdeltafailed = 0;
+}
+
+// mode: 0 - changed inodes (NODE), 1 - new names in changed directories and paths of changed trash/reserved files (EDGE), 2 - removed inodes (DELN)
+static void fs_storedelta_nodes(metastream *ms,uint8_t mode) {
+	uint32_t page,i,j,id;
+	uint8_t *ptr,idbuff[4];
+	fsnode *p;
+	fsedge *e;
+
+	for (page=0 ; page<fsdirtypages ; page++) {
+		if (fsdirtytab[page]==NULL) {
+			continue;
+		}
+		for (i=0 ; i<NODETABPAGESIZE/32 ; i++) {
+			if (fsdirtytab[page][i]==0) {
+				continue;
+			}
+			for (j=0 ; j<32 ; j++) {
+				if ((fsdirtytab[page][i]&(1U<<j))==0) {
+					continue;
+				}
+				id = page*NODETABPAGESIZE+i*32+j;
+				p = fsnodes_id_to_node(id);
+				if (mode==0 && p) {
+					fs_section_record(ms);
+					fs_storenode(p,ms);
+				} else if (mode==1 && p) {
+					if (p->type==TYPE_DIRECTORY) {
+						for (e=p->data.ddata.children ; e ; e=e->nextchild) {
+							if (e->delta) {
+								e->delta = 0;
+								fs_section_record(ms);
+								fs_storeedge(e,ms);
+							}
+						}
+					} else if ((p->type==TYPE_TRASH || p->type==TYPE_RESERVED) && p->parents) {
+						fs_section_record(ms);
+						fs_storeedge(p->parents,ms);
+					}
+				} else if (mode==2 && p==NULL) {
+					ptr = idbuff;
+					put32bit(&ptr,id);
+					fs_section_record(ms);
+					metastream_write(ms,idbuff,4);
+				}
+			}
+		}
+		if (mode==2) {
+			free(fsdirtytab[page]);
+			fsdirtytab[page] = NULL;
+		}
+	}
+}
+
+static int fs_storedelta_image(metastream *ms) {
+	uint8_t hdr[24];
+	uint8_t *ptr;
+	ptr = hdr;
+	put32bit(&ptr,maxnodeid);
+	put64bit(&ptr,version);
+	put32bit(&ptr,nextsessionid);
+	put64bit(&ptr,fsdeltafrom);
+	metastream_write(ms,"MFSD 2.0",8);
+	fs_section_begin(ms,FSSECTION_HEAD);
+	metastream_write(ms,hdr,24);
+	fs_section_end(ms);
+	fs_section_begin(ms,FSSECTION_NODE);
+	fs_storedelta_nodes(ms,0);
+	fs_section_end(ms);
+	fs_section_begin(ms,FSSECTION_EDGE);
+	fs_storedelta_nodes(ms,1);
+	fs_section_end(ms);
+	fs_section_begin(ms,FSSECTION_DELN);
+	fs_storedelta_nodes(ms,2);
+	fs_section_end(ms);
+	fs_section_begin(ms,FSSECTION_DELE);
+	metastream_write(ms,fsdeltadel,fsdeltadelleng);
+	fsdeltadelleng = 0;
+	fs_section_end(ms);
+	fs_section_begin(ms,FSSECTION_FREE);
+	fs_storefree(ms);
+	fs_section_end(ms);
+	fs_section_begin(ms,FSSECTION_CHKD);
+	chunk_delta_store(ms);
+	fs_section_end(ms);
+	fs_section_begin(ms,FSSECTION_XORG);
+	chunk_xor_store(ms);
+	fs_section_end(ms);
+	return fs_section_table(ms);
+}
+
+static void* fs_delta_writer(void *arg) {
+	char fname[100],tmpname[100];
+	metastream *ms;
+	uint64_t pos;
+	uint32_t l;
+	int fd,status;
+
+	(void)arg;
+	snprintf(fname,100,"metadata.mfs.back.delta.%"PRIu64,fsdeltaname);
+	snprintf(tmpname,100,"metadata.mfs.back.delta.%"PRIu64".tmp",fsdeltaname);
+	status = -1;
+	fd = open(tmpname,O_RDWR|O_CREAT|O_TRUNC,0666);
+	if (fd>=0) {
+		ms = metastream_open(fd,fsstorelevel,(uint64_t)fsstorespeed*1024*1024,fsstoreverify,fsstoreprogress+FSSTORE_DELTA);
+		if (ms) {
+			ms->records = fsdeltarecords;
+			for (pos=0 ; pos<fsdeltaleng ; pos+=l) {
+				l = (fsdeltaleng-pos>0x40000000)?0x40000000:(fsdeltaleng-pos);
+				metastream_write(ms,fsdeltabuff+pos,l);
+			}
+			status = metastream_close(ms,NULL,NULL);
+		}
+		if (close(fd)<0 && status==0) {
+			status = -1;
+		}
+		if (status==0 && rename(tmpname,fname)<0) {
+			status = -1;
+		}
+		if (status<0) {
+			unlink(tmpname);
+		}
+	}
+	if (status==-2) {
+		MFSLOG(LOG_ERR,"metadata delta %s has been written with errors (checksum mismatch) - next checkpoint will store whole metadata",fname);
+	} else if (status<0) {
+		MFSLOG(LOG_ERR,"can't write metadata delta %s (%m) - next checkpoint will store whole metadata",fname);
+	}
+	free(fsdeltabuff);
+	fsdeltabuff = NULL;
+	pthread_mutex_lock(&fsdeltalock);
+	if (status<0) {
+		fsdeltafailed = 1;
+	} else {
+		fsdeltabytes += fsstoreprogress[FSSTORE_DELTA].stored;
+	}
+	fs_storeprogress_end(FSSTORE_DELTA,status);
+	fsdeltabusy = 0;
+	pthread_mutex_unlock(&fsdeltalock);
+	return NULL;
+}
+
+static void fs_delta_wait(void) {
+	if (fsdeltawriter) {
+		pthread_join(fsdeltathread,NULL);
+		fsdeltawriter = 0;
+	}
+}
+
+// stores changes made since the last checkpoint as a delta of metadata.mfs.back ; returns 0 when done (or nothing to do) and -1 when full image should be stored instead
+static int fs_storedelta(void) {
+	metastream *ms;
+	struct stat st;
+	uint8_t busy,failed;
+	uint64_t deltabytes;
+	int status;
+
+	pthread_mutex_lock(&fsdeltalock);
+	busy = fsdeltabusy;
+	failed = fsdeltafailed;
+	deltabytes = fsdeltabytes;
+	pthread_mutex_unlock(&fsdeltalock);
+	if (busy) {
+		MFSLOG(LOG_WARNING,"previous metadata delta is still being written - checkpoint skipped");
+		return 0;
+	}
+	fs_delta_wait();
+	if (fsdeltaon==0 || failed || fsdeltacount>=fsmaxdeltas || stat("metadata.mfs.back",&st)<0 || deltabytes*2>(uint64_t)(st.st_size)) {
+		return -1;
+	}
+	if (version==fsdeltafrom) {
+		return 0;
+	}
+	fsdeltabuff = NULL;
+	fsdeltaleng = 0;
+	ms = metastream_open(-1,0,0,0,NULL);	// delta is built in memory and compressed/written by the writer thread
+	if (ms==NULL) {
+		return -1;
+	}
+	status = fs_storedelta_image(ms);
+	fsdeltarecords = ms->records;
+	if (metastream_close(ms,&fsdeltabuff,&fsdeltaleng)<0 || status<0) {
+		if (fsdeltabuff) {
+			free(fsdeltabuff);
+		}
+		fsdeltabuff = NULL;
+		fsdeltafailed = 1;
+		return -1;
+	}
+	fsdeltaname = fsdeltafrom;
+	fsdeltafrom = version;
+	fsdeltacount++;
+	fsdeltabusy = 1;
+	fsstoreprogress[FSSTORE_DELTA].status = 1;
+	if (pthread_create(&fsdeltathread,NULL,fs_delta_writer,NULL)!=0) {
+		fsdeltabusy = 0;
+		fsstoreprogress[FSSTORE_DELTA].status = 0;
+		free(fsdeltabuff);
+		fsdeltabuff = NULL;
+		fsdeltafailed = 1;
+		return -1;
+	}
+	fsdeltawriter = 1;
+	return 0;
+}
+#endif
+
+// reads version from header of plain or compressed image
+uint64_t fs_loadversion(FILE *fd) {
+	uint8_t hdr[8+12];
+	const uint8_t *ptr;
+	uint64_t fversion;
+
+	if (metastream_readhead(fileno(fd),hdr,8+12)<0) {
+		return 0;
+	}
+	ptr = hdr+8+4;
+//	maxnodeid = get32bit(&ptr);
+	fversion = get64bit(&ptr);
+//	nextsessionid = get32bit(&ptr);
+	return fversion;
+}
+
+void fs_loadheader(const uint8_t *hdr) {
+	const uint8_t *ptr;
+	uint64_t loadversion;
+
+	ptr = hdr;
+	maxnodeid = get32bit(&ptr);
+
+	loadversion = get64bit(&ptr);
+	if(loadversion > version) {
+		version = loadversion;
+	} else {
+		MFSLOG(LOG_NOTICE, "loadversion :%lu is smaller than version:%lu skip it\n",
+			loadversion, version);
+	}
+
+	nextsessionid = get32bit(&ptr);
+}
+
+int fs_load_check(void) {
+	MFSLOG(LOG_NOTICE,"checking filesystem consistency ... ");
+
+	root = fsnodes_id_to_node(MFS_ROOT_ID);
+	if (root==NULL) {
+		MFSLOG(LOG_NOTICE,"error\n");
+#ifndef METARESTORE
+		MFSLOG(LOG_ERR,"error reading metadata (no root)");
+#endif
+		return -1;
+	}
+	if (fs_checknodes()<0) {
+		MFSLOG(LOG_NOTICE,"error\n");
+		return -1;
+	}
+
+	MFSLOG(LOG_NOTICE,"ok\n");
+	
+	return 0;
+}
+
+int fs_load(FILE *fd) {
+	uint8_t hdr[16];
+	
+	if (fread(hdr,1,16,fd)!=16) {
+		fprintf(msgfd,"error loading header\n");
+		return -1;
+	}
+	fs_loadheader(hdr);
+
+	fsnodes_init_freebitmask();
+	MFSLOG(LOG_NOTICE, "loading objects (files,directories,etc.) ... ");
+	fflush(msgfd);	
+	
+	if (fs_loadnodes(fd)<0) {	
+			MFSLOG(LOG_NOTICE,"error\n");	
+#ifndef METARESTORE
+		MFSLOG(LOG_ERR,"error reading metadata (node)");
+#endif
+		return -1;
+	}
+	
+	MFSLOG(LOG_NOTICE,"ok\n");
+	MFSLOG(LOG_NOTICE,"loading names ... ");
+	
+	if (fs_loadedges(fd)<0) {
+		MFSLOG(LOG_NOTICE,"error\n");
+#ifndef METARESTORE
+		MFSLOG(LOG_ERR,"error reading metadata (edge)");
+#endif
+		return -1;
+	}
+
+	MFSLOG(LOG_NOTICE,"ok\n");
+	MFSLOG(LOG_NOTICE,"loading deletion timestamps ... ");
+
+	if (fs_loadfree(fd)<0) {
+		MFSLOG(LOG_NOTICE,"error\n");
+#ifndef METARESTORE
+		MFSLOG(LOG_ERR,"error reading metadata (free)");
+#endif
+		return -1;
+	}
+
+	MFSLOG(LOG_NOTICE,"ok\n");
+	return fs_load_check();
+}
+
+// "MFSM 2.0" loader - file is mapped, sections are verified and decoded by up to FSLOAD_MAXTHREADS threads, objects are linked together by the calling thread in file order
+#define FSLOAD_MAXTHREADS 16
+
+typedef struct _fsload_sessions {
+	fsnode *node;
+	const uint8_t *ptr;
+	uint32_t cnt;
+} fsload_sessions;
+
+typedef struct _fsload_section {
+	uint32_t tag;
+	const uint8_t *data;
+	uint64_t length;
+	uint32_t crc;
+	int status;
+	fsobj_slabs slabs;
+	uint32_t nodes,dirnodes,filenodes;
+	fsload_sessions *sessions;
+	uint32_t sessionscnt,sessionssize;
+	fsedge *edges,**edgestail;
+	uint8_t replace;	// nodes replace already loaded ones (delta)
+} fsload_section;
+
+typedef struct _fsload_pool {
+	void (*fn)(void *arg,uint32_t job);
+	void *arg;
+	uint32_t jobs;
+	uint32_t next;
+	pthread_mutex_t lock;
+} fsload_pool;
+
+static uint32_t fsloadthreads = 0;	// 0 - one thread per cpu
+
+static void* fs_load_worker(void *arg) {
+	fsload_pool *lp = (fsload_pool*)arg;
+	uint32_t job;
+	for (;;) {
+		pthread_mutex_lock(&(lp->lock));
+		job = lp->next;
+		if (job<lp->jobs) {
+			lp->next++;
+		}
+		pthread_mutex_unlock(&(lp->lock));
+		if (job>=lp->jobs) {
+			return NULL;
+		}
+		lp->fn(lp->arg,job);
+	}
+}
+
+// calls fn(arg,job) for every job in 0..jobs-1 using loader threads (calling thread is one of them)
+static void fs_load_parallel(void (*fn)(void *arg,uint32_t job),void *arg,uint32_t jobs) {
+	pthread_t th[FSLOAD_MAXTHREADS];
+	fsload_pool lp;
+	uint32_t i,n;
+	long cpus;
+
+	n = fsloadthreads;
+	if (n==0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = (cpus>0)?cpus:1;
+	}
+	if (n>FSLOAD_MAXTHREADS) {
+		n = FSLOAD_MAXTHREADS;
+	}
+	if (n>jobs) {
+		n = jobs;
+	}
+	lp.fn = fn;
+	lp.arg = arg;
+	lp.jobs = jobs;
+	lp.next = 0;
+	pthread_mutex_init(&(lp.lock),NULL);
+	for (i=1 ; i<n ; i++) {
+		if (pthread_create(th+i,NULL,fs_load_worker,&lp)!=0) {
+			break;
+		}
+	}
+	n = i;
+	fs_load_worker(&lp);
+	for (i=1 ; i<n ; i++) {
+		pthread_join(th[i],NULL);
+	}
+	pthread_mutex_destroy(&(lp.lock));
+}
+
+static uint32_t fs_load_crc(const uint8_t *data,uint64_t length) {
+	uint32_t crc,l;
+	crc = 0;
+	while (length>0) {
+		l = (length>0x40000000)?0x40000000:length;
+		crc = mycrc32(crc,data,l);
+		data += l;
+		length -= l;
+	}
+	return crc;
+}
+
+// decodes one node record (fs_storenode format) - session ids are only remembered here and attached later by the calling thread
+static int fs_load_decodenode(fsload_section *ls,const uint8_t **rptr,const uint8_t *eptr) {
+	const uint8_t *ptr;
+	uint8_t type;
+	uint32_t indx,pleng,ch,sessionids,hsize;
+	fsnode *p,*o;
+	fsload_sessions *lss;
+#ifndef METARESTORE
+	statsrecord *sr;
+#endif
+
+	ptr = *rptr;
+	type = *ptr;
+	switch (type) {
+	case TYPE_DIRECTORY:
+	case TYPE_FIFO:
+	case TYPE_SOCKET:
+		hsize = 1+4+1+2+4+4+4+4+4+4;
+		break;
+	case TYPE_BLOCKDEV:
+	case TYPE_CHARDEV:
+	case TYPE_SYMLINK:
+		hsize = 1+4+1+2+4+4+4+4+4+4+4;
+		break;
+	case TYPE_FILE:
+	case TYPE_TRASH:
+	case TYPE_RESERVED:
+		hsize = 1+4+1+2+4+4+4+4+4+4+8+4+2;
+		break;
+	default:
+#ifdef METARESTORE
+		fprintf(stderr,"loading node: unrecognized node type: %c\n",type);
+#else
+		syslog(LOG_ERR,"loading node: unrecognized node type: %c",type);
+#endif
+		return -1;
+	}
+	if ((uint64_t)(eptr-ptr)<hsize) {
+#ifdef METARESTORE
+		fprintf(stderr,"loading node: truncated record\n");
+#else
+		syslog(LOG_ERR,"loading node: truncated record");
+#endif
+		return -1;
+	}
+	p = fsnode_slab_malloc(&(ls->slabs));
+	if (p==NULL) {
+#ifdef METARESTORE
+		fprintf(stderr,"loading node: node alloc: out of memory\n");
+#else
+		syslog(LOG_ERR,"loading node: node alloc: out of memory");
+#endif
+		return -1;
+	}
+	ptr++;
+	p->type = type;
+	p->id = get32bit(&ptr);
+	p->goal = get8bit(&ptr);
+	p->mode = get16bit(&ptr);
+	p->uid = get32bit(&ptr);
+	p->gid = get32bit(&ptr);
+	p->atime = get32bit(&ptr);
+	p->mtime = get32bit(&ptr);
+	p->ctime = get32bit(&ptr);
+	p->trashtime = get32bit(&ptr);
+	switch (type) {
+	case TYPE_DIRECTORY:
+#ifndef METARESTORE
+		sr = malloc(sizeof(statsrecord));
+		memset(sr,0,sizeof(statsrecord));
+		p->data.ddata.stats = sr;
+		p->data.ddata.quota = NULL;
+#endif
+		p->data.ddata.children = NULL;
+#ifdef EDGEHASH
+		p->data.ddata.nameidx = NULL;
+#endif
+		p->data.ddata.nlink = 2;
+		p->data.ddata.elements = 0;
+	case TYPE_SOCKET:
+	case TYPE_FIFO:
+		break;
+	case TYPE_BLOCKDEV:
+	case TYPE_CHARDEV:
+		p->data.rdev = get32bit(&ptr);
+		break;
+	case TYPE_SYMLINK:
+		pleng = get32bit(&ptr);
+		p->data.sdata.pleng = pleng;
+		if ((uint64_t)(eptr-ptr)<pleng) {
+#ifdef METARESTORE
+			fprintf(stderr,"loading node: truncated record\n");
+#else
+			syslog(LOG_ERR,"loading node: truncated record");
+#endif
+			return -1;
+		}
+		if (pleng>0) {
+			p->data.sdata.path = malloc(pleng);
+			if (p->data.sdata.path==NULL) {
+#ifdef METARESTORE
+				fprintf(stderr,"loading node: path alloc: out of memory\n");
+#else
+				syslog(LOG_ERR,"loading node: path alloc: out of memory");
+#endif
+				return -1;
+			}
+			memcpy(p->data.sdata.path,ptr,pleng);
+			ptr += pleng;
+		} else {
+			p->data.sdata.path = NULL;
+		}
+		break;
+	case TYPE_FILE:
+	case TYPE_TRASH:
+	case TYPE_RESERVED:
+		p->data.fdata.length = get64bit(&ptr);
+		ch = get32bit(&ptr);
+		p->data.fdata.chunks = ch;
+		sessionids = get16bit(&ptr);
+		if ((uint64_t)(eptr-ptr)<8ULL*ch+4*sessionids) {
+#ifdef METARESTORE
+			fprintf(stderr,"loading node: truncated record\n");
+#else
+			syslog(LOG_ERR,"loading node: truncated record");
+#endif
+			return -1;
+		}
+		if (ch>0) {
+			p->data.fdata.chunktab = malloc(sizeof(uint64_t)*ch);
+			if (p->data.fdata.chunktab==NULL) {
+#ifdef METARESTORE
+				fprintf(stderr,"loading node: chunktab alloc: out of memory\n");
+#else
+				syslog(LOG_ERR,"loading node: chunktab alloc: out of memory");
+#endif
+				return -1;
+			}
+		} else {
+			p->data.fdata.chunktab = NULL;
+		}
+		for (indx=0 ; indx<ch ; indx++) {
+			p->data.fdata.chunktab[indx] = get64bit(&ptr);
+		}
+		p->data.fdata.sessionids = NULL;
+		if (sessionids>0) {
+			if (ls->sessionscnt==ls->sessionssize) {
+				ls->sessionssize = (ls->sessionssize>0)?ls->sessionssize*2:256;
+				ls->sessions = (fsload_sessions*)realloc(ls->sessions,sizeof(fsload_sessions)*ls->sessionssize);
+				if (ls->sessions==NULL) {
+#ifdef METARESTORE
+					fprintf(stderr,"loading node: sessionid list alloc: out of memory\n");
+#else
+					syslog(LOG_ERR,"loading node: sessionid list alloc: out of memory");
+#endif
+					return -1;
+				}
+			}
+			lss = ls->sessions+ls->sessionscnt;
+			lss->node = p;
+			lss->ptr = ptr;
+			lss->cnt = sessionids;
+			ls->sessionscnt++;
+			ptr += 4*sessionids;
+		}
+	}
+	p->parents = NULL;
+	if (NODETABPAGE(p->id)>=nodetabpages) {
+#ifdef METARESTORE
+		fprintf(stderr,"loading node: inode %"PRIu32" above maxnodeid (%"PRIu32")\n",p->id,maxnodeid);
+#else
+		syslog(LOG_ERR,"loading node: inode %"PRIu32" above maxnodeid (%"PRIu32")",p->id,maxnodeid);
+#endif
+		return -1;
+	}
+	// node sections are decoded in parallel, so duplicates from different sections are also caught here
+	o = NULL;
+	if (ls->replace) {
+		nodetab[NODETABPAGE(p->id)][NODETABPOS(p->id)] = p;
+	} else if (__atomic_compare_exchange_n(&(nodetab[NODETABPAGE(p->id)][NODETABPOS(p->id)]),&o,p,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)==0) {
+#ifdef METARESTORE
+		fprintf(stderr,"loading node: inode %"PRIu32" error: inode already loaded\n",p->id);
+#else
+		syslog(LOG_ERR,"loading node: inode %"PRIu32" error: inode already loaded",p->id);
+#endif
+		return -1;
+	}
+	ls->nodes++;
+	if (type==TYPE_DIRECTORY) {
+		ls->dirnodes++;
+	}
+	if (type==TYPE_FILE || type==TYPE_TRASH || type==TYPE_RESERVED) {
+		ls->filenodes++;
+	}
+	*rptr = ptr;
+	return 0;
+}
+
+// decodes one edge record (fs_storeedge format) and resolves its nodes - edge is linked later by the calling thread
+static int fs_load_decodeedge(fsload_section *ls,const uint8_t **rptr,const uint8_t *eptr) {
+	const uint8_t *ptr;
+	uint32_t parent_id;
+	uint32_t child_id;
+	uint16_t nleng;
+	fsedge *e;
+	char escname[3*MAXFNAMELENG+1];	// fsnodes_escape_name isn't thread safe
+
+	ptr = *rptr;
+	if (eptr-ptr<4+4+2) {
+#ifdef METARESTORE
+		fprintf(stderr,"loading edge: truncated record\n");
+#else
+		syslog(LOG_ERR,"loading edge: truncated record");
+#endif
+		return -1;
+	}
+	parent_id = get32bit(&ptr);
+	child_id = get32bit(&ptr);
+	nleng = get16bit(&ptr);
+	if (eptr-ptr<nleng) {
+#ifdef METARESTORE
+		fprintf(stderr,"loading edge: truncated record\n");
+#else
+		syslog(LOG_ERR,"loading edge: truncated record");
+#endif
+		return -1;
+	}
+	e = fsedge_slab_malloc(&(ls->slabs),nleng);
+	if (e==NULL || (e->name==NULL && nleng>0)) {
+#ifdef METARESTORE
+		fprintf(stderr,"loading edge: edge alloc: out of memory\n");
+#else
+		syslog(LOG_ERR,"loading edge: edge alloc: out of memory");
+#endif
+		return -1;
+	}
+	e->nleng = nleng;
+	memcpy(e->name,ptr,nleng);
+	ptr += nleng;
+	fsnodes_escape_name_buff(escname,(nleng>MAXFNAMELENG)?MAXFNAMELENG:nleng,e->name);
+	e->child = fsnodes_id_to_node(child_id);
+	if (e->child==NULL) {
+#ifdef METARESTORE
+		fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" error: child not found\n",parent_id,escname,child_id);
+#else
+		syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: child not found",parent_id,escname,child_id);
+#endif
+		return -1;
+	}
+	if (parent_id==0) {
+		e->parent = NULL;
+		if (e->child->type!=TYPE_TRASH && e->child->type!=TYPE_RESERVED) {
+#ifdef METARESTORE
+			fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad child type (%c)\n",parent_id,escname,child_id,e->child->type);
+#else
+			syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad child type (%c)",parent_id,escname,child_id,e->child->type);
+#endif
+			return -1;
+		}
+	} else {
+		e->parent = fsnodes_id_to_node(parent_id);
+		if (e->parent==NULL) {
+#ifdef METARESTORE
+			fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" error: parent not found\n",parent_id,escname,child_id);
+#else
+			syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: parent not found",parent_id,escname,child_id);
+#endif
+			return -1;
+		}
+		if (e->parent->type!=TYPE_DIRECTORY) {
+#ifdef METARESTORE
+			fprintf(stderr,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad parent type (%c)\n",parent_id,escname,child_id,e->parent->type);
+#else
+			syslog(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad parent type (%c)",parent_id,escname,child_id,e->parent->type);
+#endif
+			return -1;
+		}
+#ifdef EDGEHASH
+		e->hash = fsnodes_hash(e->nleng,e->name);
+#endif
+	}
+	e->nextchild = NULL;
+	*(ls->edgestail) = e;
+	ls->edgestail = &(e->nextchild);
+	*rptr = ptr;
+	return 0;
+}
+
+// first pass - checksums of all sections, nodes and chunks
+static void fs_load_nodes_job(void *arg,uint32_t job) {
+	fsload_section *ls = ((fsload_section*)arg)+job;
+	const uint8_t *ptr,*eptr;
+	FILE *fd;
+
+	if (fs_load_crc(ls->data,ls->length)!=ls->crc) {
+#ifdef METARESTORE
+		fprintf(stderr,"metadata section %"PRIu32" (%c%c%c%c): checksum error\n",job,ls->tag>>24,(ls->tag>>16)&0xFF,(ls->tag>>8)&0xFF,ls->tag&0xFF);
+#else
+		syslog(LOG_ERR,"metadata section %"PRIu32" (%c%c%c%c): checksum error",job,ls->tag>>24,(ls->tag>>16)&0xFF,(ls->tag>>8)&0xFF,ls->tag&0xFF);
+#endif
+		ls->status = -1;
+		return;
+	}
+	if (ls->tag==FSSECTION_NODE) {
+		ptr = ls->data;
+		eptr = ptr+ls->length;
+		while (ptr<eptr) {
+			if (fs_load_decodenode(ls,&ptr,eptr)<0) {
+				ls->status = -1;
+				return;
+			}
+		}
+	} else if (ls->tag==FSSECTION_CHNK) {
+		fd = fmemopen((void*)(ls->data),ls->length,"r");
+		if (fd==NULL || chunk_load(fd)<0) {
+#ifdef METARESTORE
+			fprintf(stderr,"error reading metadata (chunks)\n");
+#else
+			syslog(LOG_ERR,"error reading metadata (chunks)");
+#endif
+			ls->status = -1;
+		}
+		if (fd!=NULL) {
+			fclose(fd);
+		}
+	}
+}
+
+// second pass - edges (all nodes are already in nodetab)
+static void fs_load_edges_job(void *arg,uint32_t job) {
+	fsload_section *ls = ((fsload_section*)arg)+job;
+	const uint8_t *ptr,*eptr;
+
+	if (ls->tag==FSSECTION_EDGE) {
+		ptr = ls->data;
+		eptr = ptr+ls->length;
+		while (ptr<eptr) {
+			if (fs_load_decodeedge(ls,&ptr,eptr)<0) {
+				ls->status = -1;
+				return;
+			}
+		}
+	}
+}
+
+#ifdef EDGEHASH
+// third pass - name indexes of big directories, one nodetab page per job
+static void fs_load_nameidx_job(void *arg,uint32_t job) {
+	fsnode *p;
+	uint32_t i;
+	(void)arg;
+	for (i=0 ; i<NODETABPAGESIZE ; i++) {
+		p = nodetab[job][i];
+		if (p && p->type==TYPE_DIRECTORY && p->data.ddata.elements>LOOKUPNOHASHLIMIT) {
+			fsnodes_nameidx_rebuild(p);
+		}
+	}
+}
+#endif
+
+static int fs_load_checkstatus(fsload_section *lsections,uint32_t cnt) {
+	uint32_t i;
+	for (i=0 ; i<cnt ; i++) {
+		if (lsections[i].status<0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int fs_load_sections(fsload_section *lsections,uint32_t cnt) {
+	fsload_section *ls;
+	fsload_sessions *lss;
+	sessionidrec *sessionidptr;
+	fsedge *e,*ne;
+	FILE *ffd;
+	const uint8_t *ptr;
+	uint32_t i,j,k,sessionid;
+
+	if (cnt==0 || lsections[0].tag!=FSSECTION_HEAD || lsections[0].length!=16) {
+		MFSLOG(LOG_NOTICE,"error\n");
+#ifndef METARESTORE
+		MFSLOG(LOG_ERR,"error reading metadata (no header section)");
+#endif
+		return -1;
+	}
+	if (fs_load_crc(lsections[0].data,16)!=lsections[0].crc) {
+		MFSLOG(LOG_NOTICE,"error\n");
+#ifndef METARESTORE
+		MFSLOG(LOG_ERR,"error reading metadata (header checksum)");
+#endif
+		return -1;
+	}
+	fs_loadheader(lsections[0].data);
+	fsnodes_init_freebitmask();
+	fsnodes_nodetab_reserve(maxnodeid);
+	mycrc32(0,NULL,0);	// generate crc tables before starting threads
+
+	MFSLOG(LOG_NOTICE, "loading objects (files,directories,etc.) and chunks ... ");
+	fs_load_parallel(fs_load_nodes_job,lsections,cnt);
+	if (fs_load_checkstatus(lsections,cnt)<0) {
+		MFSLOG(LOG_NOTICE,"error\n");
+#ifndef METARESTORE
+		MFSLOG(LOG_ERR,"error reading metadata (node)");
+#endif
+		return -1;
+	}
+	for (i=0 ; i<cnt ; i++) {
+		ls = lsections+i;
+		if (ls->tag==FSSECTION_NODE) {
+			nodes += ls->nodes;
+			dirnodes += ls->dirnodes;
+			filenodes += ls->filenodes;
+			for (j=0 ; j<ls->sessionscnt ; j++) {
+				lss = ls->sessions+j;
+				ptr = lss->ptr;
+				for (k=0 ; k<lss->cnt ; k++) {
+					sessionid = get32bit(&ptr);
+					sessionidptr = sessionidrec_malloc();
+					sessionidptr->sessionid = sessionid;
+					sessionidptr->next = lss->node->data.fdata.sessionids;
+					lss->node->data.fdata.sessionids = sessionidptr;
+#ifndef METARESTORE
+					matocuserv_init_sessions(sessionid,lss->node->id);
+#endif
+				}
+			}
+			fsobj_slabs_merge(&(ls->slabs));
+		}
+	}
+	for (i=0 ; i<=maxnodeid ; i++) {
+		if (fsnodes_id_to_node(i)!=NULL) {
+			fsnodes_used_inode(i);
+		}
+	}
+	MFSLOG(LOG_NOTICE,"ok\n");
+	MFSLOG(LOG_NOTICE,"loading names ... ");
+
+	fs_load_parallel(fs_load_edges_job,lsections,cnt);
+	if (fs_load_checkstatus(lsections,cnt)<0) {
+		MFSLOG(LOG_NOTICE,"error\n");
+#ifndef METARESTORE
+		MFSLOG(LOG_ERR,"error reading metadata (edge)");
+#endif
+		return -1;
+	}
+	for (i=0 ; i<cnt ; i++) {
+		ls = lsections+i;
+		if (ls->tag==FSSECTION_EDGE) {
+			for (e=ls->edges ; e ; e=ne) {
+				ne = e->nextchild;
+				fs_loadedge_link(e);
+			}
+			fsobj_slabs_merge(&(ls->slabs));
+		}
+	}
+#ifdef EDGEHASH
+	fs_load_parallel(fs_load_nameidx_job,NULL,nodetabpages);
+#endif
+
+	MFSLOG(LOG_NOTICE,"ok\n");
+	MFSLOG(LOG_NOTICE,"loading deletion timestamps ... ");
+
+	ffd = NULL;
+	for (i=0 ; i<cnt && ffd==NULL ; i++) {
+		if (lsections[i].tag==FSSECTION_FREE) {
+			ffd = fmemopen((void*)(lsections[i].data),lsections[i].length,"r");
+		}
+	}
+	if (ffd==NULL || fs_loadfree(ffd)<0) {
+		MFSLOG(LOG_NOTICE,"error\n");
+#ifndef METARESTORE
+		MFSLOG(LOG_ERR,"error reading metadata (free)");
+#endif
+		if (ffd) {
+			fclose(ffd);
+		}
+		return -1;
+	}
+	fclose(ffd);
+	MFSLOG(LOG_NOTICE,"ok\n");
+	for (i=0 ; i<cnt ; i++) {
+		if (lsections[i].tag==FSSECTION_XORG) {
+			MFSLOG(LOG_NOTICE,"loading xor groups ... ");
+			ffd = fmemopen((void*)(lsections[i].data),lsections[i].length,"r");
+			if (ffd==NULL || chunk_xor_load(ffd)<0) {
+				MFSLOG(LOG_NOTICE,"error\n");
+#ifndef METARESTORE
+				MFSLOG(LOG_ERR,"error reading metadata (xor groups)");
+#endif
+				if (ffd) {
+					fclose(ffd);
+				}
+				return -1;
+			}
+			fclose(ffd);
+			MFSLOG(LOG_NOTICE,"ok\n");
+		}
+	}
+	return fs_load_check();
+}
+
+// maps image (or delta), reads and checks section table
+static void fs_loadimage_release(uint8_t *map,uint64_t fleng,uint8_t inflated) {
+	if (inflated) {
+		free(map);
+	} else {
+		munmap(map,fleng);
+	}
+}
+
+static int fs_loadimage_map(FILE *fd,uint8_t **rmap,uint64_t *rfleng,uint8_t *rinflated,fsload_section **rlsections,uint32_t *rcnt) {
+	struct stat st;
+	uint8_t *map,*image;
+	uint64_t ileng;
+	const uint8_t *ptr,*tptr;
+	fsload_section *lsections,*ls;
+	uint64_t fleng,tableoffset,offset,length;
+	uint32_t i,cnt;
+
+	if (fstat(fileno(fd),&st)<0 || st.st_size<8+FSSECTION_TRAILERSIZE) {
+		MFSLOG(LOG_NOTICE,"error reading metadata (file too short)\n");
+		return -1;
+	}
+	fleng = st.st_size;
+	map = mmap(NULL,fleng,PROT_READ,MAP_PRIVATE,fileno(fd),0);
+	if (map==MAP_FAILED) {
+		MFSLOG(LOG_NOTICE,"error mapping metadata file (%s)\n",strerror(errno));
+		return -1;
+	}
+	madvise(map,fleng,MADV_WILLNEED);
+	*rinflated = 0;
+	if (metastream_iscompressed(map)) {
+		MFSLOG(LOG_NOTICE,"decompressing metadata ... ");
+		if (metastream_inflate(map,fleng,&image,&ileng)<0) {
+			MFSLOG(LOG_NOTICE,"error reading metadata (damaged compressed file)\n");
+			munmap(map,fleng);
+			return -1;
+		}
+		munmap(map,fleng);
+		map = image;
+		fleng = ileng;
+		*rinflated = 1;
+		MFSLOG(LOG_NOTICE,"ok\n");
+		if (fleng<8+FSSECTION_TRAILERSIZE) {
+			MFSLOG(LOG_NOTICE,"error reading metadata (file too short)\n");
+			free(map);
+			return -1;
+		}
+	}
+	ptr = map+fleng-FSSECTION_TRAILERSIZE;
+	tableoffset = get64bit(&ptr);
+	if (memcmp(ptr,"MFSM END",8)!=0 || tableoffset<8 || tableoffset+4+4>fleng-FSSECTION_TRAILERSIZE) {
+		MFSLOG(LOG_NOTICE,"error reading metadata (bad trailer)\n");
+		fs_loadimage_release(map,fleng,*rinflated);
+		return -1;
+	}
+	ptr = map+tableoffset;
+	cnt = get32bit(&ptr);
+	if (cnt==0 || (uint64_t)cnt*FSSECTION_ENTRYSIZE+4+4!=fleng-FSSECTION_TRAILERSIZE-tableoffset) {
+		MFSLOG(LOG_NOTICE,"error reading metadata (bad section table)\n");
+		fs_loadimage_release(map,fleng,*rinflated);
+		return -1;
+	}
+	tptr = ptr+cnt*FSSECTION_ENTRYSIZE;
+	if (fs_load_crc(map+tableoffset,4+cnt*FSSECTION_ENTRYSIZE)!=get32bit(&tptr)) {
+		MFSLOG(LOG_NOTICE,"error reading metadata (section table checksum)\n");
+		fs_loadimage_release(map,fleng,*rinflated);
+		return -1;
+	}
+	lsections = (fsload_section*)malloc(sizeof(fsload_section)*cnt);
+	if (lsections==NULL) {
+		fs_loadimage_release(map,fleng,*rinflated);
+		return -1;
+	}
+	memset(lsections,0,sizeof(fsload_section)*cnt);
+	for (i=0 ; i<cnt ; i++) {
+		ls = lsections+i;
+		ls->tag = get32bit(&ptr);
+		offset = get64bit(&ptr);
+		length = get64bit(&ptr);
+		ls->crc = get32bit(&ptr);
+		if (offset<8 || offset>tableoffset || length>tableoffset-offset) {
+			MFSLOG(LOG_NOTICE,"error reading metadata (bad section table)\n");
+			free(lsections);
+			fs_loadimage_release(map,fleng,*rinflated);
+			return -1;
+		}
+		ls->data = map+offset;
+		ls->length = length;
+		ls->edgestail = &(ls->edges);
+	}
+	*rmap = map;
+	*rfleng = fleng;
+	*rlsections = lsections;
+	*rcnt = cnt;
+	return 0;
+}
+
+static void fs_loadimage_unmap(uint8_t *map,uint64_t fleng,uint8_t inflated,fsload_section *lsections,uint32_t cnt) {
+	uint32_t i;
+	for (i=0 ; i<cnt ; i++) {
+		if (lsections[i].sessions) {
+			free(lsections[i].sessions);
+		}
+	}
+	free(lsections);
+	fs_loadimage_release(map,fleng,inflated);
+}
+
+// maps image, reads section table and loads all sections
+int fs_loadimage(FILE *fd) {
+	uint8_t *map,inflated;
+	uint64_t fleng;
+	fsload_section *lsections;
+	uint32_t cnt;
+	int ret;
+
+	if (fs_loadimage_map(fd,&map,&fleng,&inflated,&lsections,&cnt)<0) {
+		return -1;
+	}
+	ret = fs_load_sections(lsections,cnt);
+	fs_loadimage_unmap(map,fleng,inflated,lsections,cnt);
+	return ret;
+}
+
+#ifdef METARESTORE
+// replaces node 'o' by just decoded node 'p' (already in nodetab) - names of the old node are moved to the new one
+static int fs_loaddelta_replacenode(fsnode *o,fsnode *p) {
+	fsedge *e,*ne;
+	sessionidrec *sr,*nsr;
+	uint32_t i,ctime;
+
+	if (o->type==TYPE_DIRECTORY && (p->type!=TYPE_DIRECTORY && o->data.ddata.children!=NULL)) {
+		fprintf(stderr,"loading delta: inode %"PRIu32": directory replaced by non empty object\n",p->id);
+		return -1;
+	}
+	p->parents = o->parents;
+	if (p->parents) {
+		p->parents->prevparent = &(p->parents);
+	}
+	for (e=p->parents ; e ; e=e->nextparent) {
+		e->child = p;
+	}
+	if (o->type==TYPE_DIRECTORY) {
+		if (p->type==TYPE_DIRECTORY) {
+			p->data.ddata.children = o->data.ddata.children;
+			if (p->data.ddata.children) {
+				p->data.ddata.children->prevchild = &(p->data.ddata.children);
+			}
+			for (e=p->data.ddata.children ; e ; e=e->nextchild) {
+				e->parent = p;
+			}
+			p->data.ddata.elements = o->data.ddata.elements;
+			p->data.ddata.nlink = o->data.ddata.nlink;
+#ifdef EDGEHASH
+			p->data.ddata.nameidx = o->data.ddata.nameidx;
+			o->data.ddata.nameidx = NULL;
+#endif
+		}
+#ifdef EDGEHASH
+		if (o->data.ddata.nameidx) {
+			free(o->data.ddata.nameidx);
+		}
+#endif
+	} else if (o->type==TYPE_FILE || o->type==TYPE_TRASH || o->type==TYPE_RESERVED) {
+		for (i=0 ; i<o->data.fdata.chunks ; i++) {
+			if (o->data.fdata.chunktab[i]>0) {
+				chunk_delete_file(o->data.fdata.chunktab[i],o->id,i);
+			}
+		}
+		if (o->data.fdata.chunktab!=NULL) {
+			free(o->data.fdata.chunktab);
+		}
+		for (sr=o->data.fdata.sessionids ; sr ; sr=nsr) {
+			nsr = sr->next;
+			sessionidrec_free(sr);
+		}
+	} else if (o->type==TYPE_SYMLINK) {
+		if (o->data.sdata.path) {
+			free(o->data.sdata.path);
+		}
+	}
+	fsnode_free(o);
+	if (p->type!=TYPE_TRASH && p->type!=TYPE_RESERVED) {
+		ctime = p->ctime;
+		for (e=p->parents ; e ; e=ne) {
+			ne = e->nextparent;
+			if (e->parent==NULL) {
+				fsnodes_remove_edge(0,e);
+			}
+		}
+		p->ctime = ctime;
+	}
+	return 0;
+}
+
+// applies one "MFSD 2.0" delta - order of sections matters: removed names, removed inodes, chunks, inodes, names, free inodes and then removed chunks
+static int fs_loaddelta_sections(fsload_section *lsections,uint32_t cnt) {
+	fsload_section *ls;
+	fsload_sessions *lss;
+	sessionidrec *sessionidptr;
+	fsnode *p,*o;
+	fsedge *e,*ne,*oe;
+	freenode *n,*nn;
+	FILE *ffd;
+	const uint8_t *ptr,*eptr,*iptr;
+	uint64_t fromversion;
+	uint32_t i,j,k,id,ctime;
+	uint16_t nleng;
+	uint8_t phase;
+
+	if (cnt==0 || lsections[0].tag!=FSSECTION_HEAD || lsections[0].length!=24) {
+		fprintf(stderr,"loading delta: no header section\n");
+		return -1;
+	}
+	for (i=0 ; i<cnt ; i++) {
+		ls = lsections+i;
+		if (fs_load_crc(ls->data,ls->length)!=ls->crc) {
+			fprintf(stderr,"delta section %"PRIu32" (%c%c%c%c): checksum error\n",i,ls->tag>>24,(ls->tag>>16)&0xFF,(ls->tag>>8)&0xFF,ls->tag&0xFF);
+			return -1;
+		}
+	}
+	ptr = lsections[0].data+16;
+	fromversion = get64bit(&ptr);
+	if (fromversion!=version) {
+		fprintf(stderr,"loading delta: made for version %"PRIu64" (current version: %"PRIu64")\n",fromversion,version);
+		return -1;
+	}
+	fs_loadheader(lsections[0].data);
+	fsnodes_nodetab_reserve(maxnodeid);
+
+	for (i=0 ; i<cnt ; i++) {
+		ls = lsections+i;
+		if (ls->tag!=FSSECTION_DELE) {
+			continue;
+		}
+		ptr = ls->data;
+		eptr = ptr+ls->length;
+		while (ptr<eptr) {
+			if (eptr-ptr<4+2) {
+				fprintf(stderr,"loading delta: truncated name record\n");
+				return -1;
+			}
+			id = get32bit(&ptr);
+			nleng = get16bit(&ptr);
+			if (eptr-ptr<nleng) {
+				fprintf(stderr,"loading delta: truncated name record\n");
+				return -1;
+			}
+			p = fsnodes_id_to_node(id);
+			e = (p && p->type==TYPE_DIRECTORY)?fsnodes_lookup(p,nleng,ptr):NULL;
+			if (e==NULL) {
+				fprintf(stderr,"loading delta: removed name %"PRIu32"/%s not found\n",id,fsnodes_escape_name(nleng,ptr));
+				return -1;
+			}
+			ptr += nleng;
+			fsnodes_remove_edge(0,e);
+		}
+	}
+	for (i=0 ; i<cnt ; i++) {
+		ls = lsections+i;
+		if (ls->tag!=FSSECTION_DELN) {
+			continue;
+		}
+		ptr = ls->data;
+		for (j=0 ; j<ls->length/4 ; j++) {
+			id = get32bit(&ptr);
+			p = fsnodes_id_to_node(id);
+			if (p==NULL) {	// created and removed after previous checkpoint
+				continue;
+			}
+			while (p->parents) {
+				if (p->parents->parent!=NULL || (p->type==TYPE_DIRECTORY && p->data.ddata.children!=NULL)) {
+					fprintf(stderr,"loading delta: removed inode %"PRIu32" is still in use\n",id);
+					return -1;
+				}
+				fsnodes_remove_edge(0,p->parents);
+			}
+			fsnodes_remove_node(0,p);
+		}
+	}
+	for (phase=0 ; phase<2 ; phase++) {
+		if (phase==1) {
+			for (i=0 ; i<cnt ; i++) {
+				ls = lsections+i;
+				if (ls->tag!=FSSECTION_NODE) {
+					continue;
+				}
+				ls->replace = 1;
+				ptr = ls->data;
+				eptr = ptr+ls->length;
+				while (ptr<eptr) {
+					if (eptr-ptr<5) {
+						fprintf(stderr,"loading delta: truncated node record\n");
+						return -1;
+					}
+					iptr = ptr+1;
+					id = get32bit(&iptr);
+					o = fsnodes_id_to_node(id);
+					if (fs_load_decodenode(ls,&ptr,eptr)<0) {
+						return -1;
+					}
+					p = fsnodes_id_to_node(id);
+					if (o && fs_loaddelta_replacenode(o,p)<0) {
+						return -1;
+					}
+					if (p->type==TYPE_FILE || p->type==TYPE_TRASH || p->type==TYPE_RESERVED) {
+						for (j=0 ; j<p->data.fdata.chunks ; j++) {
+							if (p->data.fdata.chunktab[j]>0) {
+								chunk_add_file(p->data.fdata.chunktab[j],p->id,j,p->goal);
+							}
+						}
+					}
+				}
+				for (j=0 ; j<ls->sessionscnt ; j++) {
+					lss = ls->sessions+j;
+					ptr = lss->ptr;
+					for (k=0 ; k<lss->cnt ; k++) {
+						sessionidptr = sessionidrec_malloc();
+						sessionidptr->sessionid = get32bit(&ptr);
+						sessionidptr->next = lss->node->data.fdata.sessionids;
+						lss->node->data.fdata.sessionids = sessionidptr;
+					}
 				}
-				l=t;
+				fsobj_slabs_merge(&(ls->slabs));
 			}
-			ptr = rbuff;
+			for (i=0 ; i<cnt ; i++) {
+				ls = lsections+i;
+				if (ls->tag!=FSSECTION_EDGE) {
+					continue;
+				}
+				ptr = ls->data;
+				eptr = ptr+ls->length;
+				while (ptr<eptr) {
+					if (fs_load_decodeedge(ls,&ptr,eptr)<0) {
+						return -1;
+					}
+				}
+				for (e=ls->edges ; e ; e=ne) {
+					ne = e->nextchild;
+					if (e->parent==NULL) {	// new path of trash/reserved file
+						ctime = e->child->ctime;
+						for (oe=e->child->parents ; oe ; oe=oe->nextparent) {
+							if (oe->parent==NULL) {
+								fsnodes_remove_edge(0,oe);
+								break;
+							}
+						}
+						e->child->ctime = ctime;
+					} else if (fsnodes_lookup(e->parent,e->nleng,e->name)!=NULL) {
+						fprintf(stderr,"loading delta: name %"PRIu32"/%s already exists\n",e->parent->id,fsnodes_escape_name(e->nleng,e->name));
+						return -1;
+					}
+					fs_loadedge_link(e);
+#ifdef EDGEHASH
+					if (e->parent) {
+						fsnodes_nameidx_add(e->parent,e);
+					}
+#endif
+				}
+				ls->edges = NULL;
+				fsobj_slabs_merge(&(ls->slabs));
+			}
+			ffd = NULL;
+			for (i=0 ; i<cnt && ffd==NULL ; i++) {
+				if (lsections[i].tag==FSSECTION_FREE) {
+					ffd = fmemopen((void*)(lsections[i].data),lsections[i].length,"r");
+				}
+			}
+			if (ffd==NULL) {
+				fprintf(stderr,"loading delta: no free inodes section\n");
+				return -1;
+			}
+			for (n=freelist ; n ; n=nn) {
+				nn = n->next;
+				freenode_free(n);
+			}
+			freelist = NULL;
+			freetail = &(freelist);
+			fsnodes_init_freebitmask();
+			for (id=0 ; id<=maxnodeid ; id++) {
+				if (fsnodes_id_to_node(id)!=NULL) {
+					fsnodes_used_inode(id);
+				}
+			}
+			if (fs_loadfree(ffd)<0) {
+				fprintf(stderr,"loading delta: error reading free inodes\n");
+				fclose(ffd);
+				return -1;
+			}
+			fclose(ffd);
 		}
-		n = freenode_malloc();
-		if (n==NULL) {
+		for (i=0 ; i<cnt ; i++) {
+			ls = lsections+i;
+			if (ls->tag!=FSSECTION_CHKD) {
+				continue;
+			}
+			ffd = fmemopen((void*)(ls->data),ls->length,"r");
+			if (ffd==NULL || chunk_delta_load(ffd,phase)<0) {
+				fprintf(stderr,"loading delta: error reading chunks\n");
+				if (ffd) {
+					fclose(ffd);
+				}
+				return -1;
+			}
+			fclose(ffd);
+		}
+	}
+	for (i=0 ; i<cnt ; i++) {
+		ls = lsections+i;
+		if (ls->tag!=FSSECTION_XORG) {
+			continue;
+		}
+		ffd = fmemopen((void*)(ls->data),ls->length,"r");
+		if (ffd==NULL || chunk_xor_load(ffd)<0) {
+			fprintf(stderr,"loading delta: error reading xor groups\n");
+			if (ffd) {
+				fclose(ffd);
+			}
 			return -1;
 		}
-		n->id = get32bit(&ptr);
-		n->ftime = get32bit(&ptr);
-		n->next = NULL;
-		*freetail = n;
-		freetail = &(n->next);
-		fsnodes_used_inode(n->id);
-		l--;
-		t--;
+		fclose(ffd);
 	}
 	return 0;
 }
 
-void fs_store(FILE *fd) {
-	uint8_t hdr[16];
-	uint8_t *ptr;
-	ptr = hdr;
-	put32bit(&ptr,maxnodeid);
-	put64bit(&ptr,version);
-    MFSLOG(LOG_NOTICE, "store version:%llu\n", version);
-	put32bit(&ptr,nextsessionid);
-	fwrite(hdr,1,16,fd);
-	fs_storenodes(fd);
-	fs_storeedges(fd);
-	fs_storefree(fd);
-}
-
-uint64_t fs_loadversion(FILE *fd) {
-	uint8_t hdr[12];
-	const uint8_t *ptr;
-	uint64_t fversion;
-
-	if (fread(hdr,1,12,fd)!=12) {
-		return 0;
-	}
-	ptr = hdr+4;
-//	maxnodeid = get32bit(&ptr);
-	fversion = get64bit(&ptr);
-//	nextsessionid = get32bit(&ptr);
-	return fversion;
-}
+// applies chain of deltas stored after the image: <fname>.delta.<version> (each delta moves version forward, so the next file name is known)
+static int fs_loaddeltas(const char *fname) {
+	FILE *fd;
+	char *dname;
+	uint8_t hdr[8];
+	uint8_t *map,inflated;
+	uint64_t fleng,fromversion;
+	fsload_section *lsections;
+	fsnode *p;
+	fsedge *e;
+	uint32_t cnt,applied,i;
+	int ret;
 
-int fs_load(FILE *fd) {
-	uint8_t hdr[16];
-	const uint8_t *ptr;
-	uint64_t loadversion;
-	
-	if (fread(hdr,1,16,fd)!=16) {
-		fprintf(msgfd,"error loading header\n");
+	dname = malloc(strlen(fname)+30);
+	if (dname==NULL) {
 		return -1;
 	}
-	ptr = hdr;
-	maxnodeid = get32bit(&ptr);
-
-	loadversion = get64bit(&ptr);
-	if(loadversion > version) {
-		version = loadversion;
-	} else {
-		MFSLOG(LOG_NOTICE, "loadversion :%lu is smaller than version:%lu skip it\n",
-			loadversion, version);
-	}
-
-	nextsessionid = get32bit(&ptr);
-
-	fsnodes_init_freebitmask();
-	MFSLOG(LOG_NOTICE, "loading objects (files,directories,etc.) ... ");
-	fflush(msgfd);	
-	
-	if (fs_loadnodes(fd)<0) {	
-			MFSLOG(LOG_NOTICE,"error\n");	
-#ifndef METARESTORE
-		MFSLOG(LOG_ERR,"error reading metadata (node)");
-#endif
-		return -1;
+	applied = 0;
+	ret = 0;
+	for (;;) {
+		sprintf(dname,"%s.delta.%"PRIu64,fname,version);
+		fd = fopen(dname,"r");
+		if (fd==NULL) {
+			break;
+		}
+		MFSLOG(LOG_NOTICE,"applying metadata delta %s ... ",dname);
+		fromversion = version;
+		if (metastream_readhead(fileno(fd),hdr,8)<0 || memcmp(hdr,"MFSD 2.0",8)!=0) {
+			fprintf(stderr,"wrong delta header\n");
+			ret = -1;
+		} else if (fs_loadimage_map(fd,&map,&fleng,&inflated,&lsections,&cnt)<0) {
+			ret = -1;
+		} else {
+			ret = fs_loaddelta_sections(lsections,cnt);
+			fs_loadimage_unmap(map,fleng,inflated,lsections,cnt);
+		}
+		fclose(fd);
+		if (ret==0 && version<=fromversion) {
+			fprintf(stderr,"delta doesn't change metadata version\n");
+			ret = -1;
+		}
+		if (ret<0) {
+			MFSLOG(LOG_NOTICE,"error\n");
+			break;
+		}
+		MFSLOG(LOG_NOTICE,"ok (version: %"PRIu64")\n",version);
+		applied++;
 	}
-	
-	MFSLOG(LOG_NOTICE,"ok\n");
-	MFSLOG(LOG_NOTICE,"loading names ... ");
-	
-	if (fs_loadedges(fd)<0) {
-		MFSLOG(LOG_NOTICE,"error\n");
-#ifndef METARESTORE
-		MFSLOG(LOG_ERR,"error reading metadata (edge)");
-#endif
-		return -1;
+	free(dname);
+	if (ret<0 || applied==0) {
+		return ret;
 	}
-
-	MFSLOG(LOG_NOTICE,"ok\n");
-	MFSLOG(LOG_NOTICE,"loading deletion timestamps ... ");
-
-	if (fs_loadfree(fd)<0) {
-		MFSLOG(LOG_NOTICE,"error\n");
-#ifndef METARESTORE
-		MFSLOG(LOG_ERR,"error reading metadata (free)");
-#endif
-		return -1;
+	nodes = 0;
+	dirnodes = 0;
+	filenodes = 0;
+	for (i=0 ; i<=maxnodeid ; i++) {
+		if ((p=fsnodes_id_to_node(i))!=NULL) {
+			nodes++;
+			if (p->type==TYPE_DIRECTORY) {
+				dirnodes++;
+			}
+			if (p->type==TYPE_FILE || p->type==TYPE_TRASH || p->type==TYPE_RESERVED) {
+				filenodes++;
+			}
+		}
 	}
-
-	MFSLOG(LOG_NOTICE,"ok\n");
-	MFSLOG(LOG_NOTICE,"checking filesystem consistency ... ");
-
-	root = fsnodes_id_to_node(MFS_ROOT_ID);
-	if (root==NULL) {
-		MFSLOG(LOG_NOTICE,"error\n");
-#ifndef METARESTORE
-		MFSLOG(LOG_ERR,"error reading metadata (no root)");
-#endif
-		return -1;
+	trashspace = 0;
+	trashnodes = 0;
+	for (e=trash ; e ; e=e->nextchild) {
+		trashspace += e->child->data.fdata.length;
+		trashnodes++;
 	}
-	if (fs_checknodes()<0) {
-		MFSLOG(LOG_NOTICE,"error\n");
-		return -1;
+	reservedspace = 0;
+	reservednodes = 0;
+	for (e=reserved ; e ; e=e->nextchild) {
+		reservedspace += e->child->data.fdata.length;
+		reservednodes++;
 	}
-
-	MFSLOG(LOG_NOTICE,"ok\n");
-	
-	return 0;
+	return fs_load_check();
 }
+#endif
+
 
 /*
 uint64_t fs_loadversion_1_4(FILE *fd) {
@@ -7141,7 +9608,6 @@ int fs_load_1_4(FILE *fd) {
 
 #ifndef METARESTORE
 void fs_new(void) {
-	uint32_t nodepos;
 //#ifndef METARESTORE
 	statsrecord *sr;
 //#endif
@@ -7149,7 +9615,7 @@ void fs_new(void) {
 	version = 0;
 	nextsessionid = 1;
 	fsnodes_init_freebitmask();
-	root = malloc(sizeof(fsnode));
+	root = fsnode_malloc();
 	root->id = MFS_ROOT_ID;
 	root->type = TYPE_DIRECTORY;
 	root->ctime = root->mtime = root->atime = get_current_time();
@@ -7165,12 +9631,13 @@ void fs_new(void) {
 	root->data.ddata.quota = NULL;
 // #endif
 	root->data.ddata.children = NULL;
+#ifdef EDGEHASH
+	root->data.ddata.nameidx = NULL;
+#endif
 	root->data.ddata.elements = 0;
 	root->data.ddata.nlink = 2;
 	root->parents = NULL;
-	nodepos = NODEHASHPOS(root->id);
-	root->next = nodehash[nodepos];
-	nodehash[nodepos] = root;
+	fsnodes_nodetab_insert(root);
 	fsnodes_used_inode(root->id);
 	chunk_newfs();
 	nodes=1;
@@ -7180,19 +9647,9 @@ void fs_new(void) {
 #endif
 
 int fs_emergency_storeall(const char *fname) {
-	FILE *fd;
-	fd = fopen(fname,"w");
-	if (fd==NULL) {
-		return -1;
-	}
-	fwrite("MFSM 1.5",1,8,fd);
-	fs_store(fd);
-	chunk_store(fd);
-	if (ferror(fd)!=0) {
-		fclose(fd);
+	if (fs_store_file(fname,0,NULL)<0) {
 		return -1;
 	}
-	fclose(fd);
 	MFSLOG(LOG_WARNING,"metadata were stored to emergency file: %s - please copy this file to your default location as 'metadata.mfs'",fname);
 	return 0;
 }
@@ -7253,18 +9710,24 @@ int fs_emergency_saves() {
 
 #ifndef METARESTORE
 int fs_storeall(int bg) {
-	FILE *fd;
-	
+	int status;
 #ifdef BACKGROUND_METASTORE
 	int i;
-	struct stat sb;
-	if (stat("metadata.mfs.back.tmp",&sb)==0) {
-		return -1;
+	if (fsstorechild>0) {
+		if (bg) {
+			MFSLOG(LOG_WARNING,"previous metadata store is still running - checkpoint skipped");
+			return -1;
+		}
+		kill(fsstorechild,SIGKILL);	// foreground store supersedes it
+		waitpid(fsstorechild,NULL,0);
+		fs_storeprogress_end(FSSTORE_IMAGE,-1);
+		fsstorechild = 0;
 	}
 #else
 	(void)bg;
 #endif
 	changelog_rotate();
+	fsstoreprogress[FSSTORE_IMAGE].status = 1;
 #ifdef BACKGROUND_METASTORE
 	if (bg) {
 		i = fork();
@@ -7272,69 +9735,82 @@ int fs_storeall(int bg) {
 		i = -1;
 	}
 	// if fork returned -1 (fork error) store metadata in foreground !!!
-	if (i<=0) {
-#endif
-		if(i < 0) {
-			MFSLOG(LOG_ERR, "for failed i:%d errno:%d\n", i, errno);
+	if (i>0) {
+		fsstorechild = i;
+	} else {
+		if (i<0 && bg) {
+			MFSLOG(LOG_ERR,"fork failed (%m) - storing metadata in foreground");
 		}
-			
-		if (rename("metadata.mfs.back","metadata.mfs.back.tmp")<0) {
-			if (errno!=ENOENT) {
-				MFSLOG(LOG_ERR,"can't rename metadata.mfs.back -> metadata.mfs.back.tmp (%m)");
-#ifdef BACKGROUND_METASTORE
-				if (i==0) {
-					exit(0);
-				}
-#endif
-				return 0;
-			}
+		// new image is written next to the old one and replaces it only after it has been read back and verified
+		status = fs_store_file("metadata.mfs.back.tmp",(i==0)?(uint64_t)fsstorespeed*1024*1024:0,fsstoreprogress+FSSTORE_IMAGE);
+#else
+		status = fs_store_file("metadata.mfs.back.tmp",0,fsstoreprogress+FSSTORE_IMAGE);
+#endif
+		if (status==0 && rename("metadata.mfs.back.tmp","metadata.mfs.back")<0) {
+			MFSLOG(LOG_ERR,"can't rename metadata.mfs.back.tmp -> metadata.mfs.back (%m)");
+			status = -1;
+		} else if (status==-2) {
+			MFSLOG(LOG_ERR,"metadata has been written with errors (checksum mismatch) - previous metadata.mfs.back left intact");
+		} else if (status<0) {
+			MFSLOG(LOG_ERR,"can't write metadata (%m)");
+		}
+		if (status<0) {
+			unlink("metadata.mfs.back.tmp");
+		} else {
+			unlink("metadata.mfs");
+			fs_delta_cleanup(version);
 		}
-		fd = fopen("metadata.mfs.back","w");
-		if (fd==NULL) {
-			MFSLOG(LOG_ERR,"can't open metadata file");
+		fs_storeprogress_end(FSSTORE_IMAGE,status);
 #ifdef BACKGROUND_METASTORE
-			if (i==0) {
-				exit(0);
-			}
+		if (i==0) {
+			exit((status<0)?1:0);
+		}
 #endif
+		if (status<0) {
+			fsdeltafailed = 1;
 			return 0;
 		}
-		fwrite("MFSM 1.5",1,8,fd);
-		fs_store(fd);
-		chunk_store(fd);
-		if (ferror(fd)!=0) {
-			MFSLOG(LOG_ERR,"can't write metadata");
-		}
-		fclose(fd);
-		unlink("metadata.mfs.back.tmp");
-		unlink("metadata.mfs");
 #ifdef BACKGROUND_METASTORE
-		if (i==0) {
-			exit(0);
-		}
 	}
 #endif
+	fs_delta_restart();	// child has a copy of the current state - next deltas are made against it
 	return 1;
 }
 
+// hourly checkpoint - delta of metadata.mfs.back, or full image after METADATA_MAX_DELTAS deltas (or when the chain is broken) ; changelog is rotated at every checkpoint (slaves get changelogs since metadata.mfs.back - changelog_openfrom)
 void fs_dostoreall(void) {
+	if (fs_storedelta()==0) {
+		changelog_rotate();
+		return;
+	}
 	fs_storeall(1);	// ignore error
 }
 
 void fs_waitchild(void) {
-        int statloc;
+	int statloc;
+	pid_t pid;
 
-        /* wait the fs_storeall child to exit */
-        wait3(&statloc, WNOHANG, NULL);
-}    
+	/* wait the fs_storeall child to exit */
+	pid = wait3(&statloc,WNOHANG,NULL);
+	if (pid>0 && pid==fsstorechild) {
+		fsstorechild = 0;
+		if (!WIFEXITED(statloc) || WEXITSTATUS(statloc)!=0) {
+			MFSLOG(LOG_WARNING,"background metadata store failed - next checkpoint will store whole metadata");
+			fs_storeprogress_end(FSSTORE_IMAGE,-1);
+			fsdeltafailed = 1;
+		}
+	}
+}
 
 void fs_term(void) {
 	int u;
+	fs_delta_wait();
 	for (u=0 ; u<3 ; u++) {
 		if (fs_storeall(0)==1) {
 			if (rename("metadata.mfs.back","metadata.mfs")<0) {
 				MFSLOG(LOG_WARNING,"can't rename metadata.mfs.back -> metadata.mfs (%m)");
 			}
+			fs_delta_cleanup(UINT64_MAX);
 			return ;
 		}
 		sleep(5);
@@ -7347,19 +9823,9 @@ void fs_term(void) {
 
 #else
 void fs_storeall(const char *fname) {
-	FILE *fd;
-	fd = fopen(fname,"w");
-	if (fd==NULL) {
-		printf("can't open metadata file\n");
-		return;
-	}
-	fwrite("MFSM 1.5",1,8,fd);
-	fs_store(fd);
-	chunk_store(fd);
-	if (ferror(fd)!=0) {
+	if (fs_store_file(fname,0,NULL)<0) {
 		printf("can't write metadata\n");
 	}
-	fclose(fd);
 }
 
 void fs_term(const char *fname) {
@@ -7390,11 +9856,11 @@ int fs_loadall(const char *fname) {
 	backversion = 0;
 	fd = fopen("metadata.mfs.back","r");
 	if (fd!=NULL) {
-		if (fread(bhdr,1,8,fd)==8) {
+		if (metastream_readhead(fileno(fd),bhdr,8)==0) {
 //			if (memcmp(bhdr,"MFSM 1.4",8)==0) {
 //				backversion = fs_loadversion_1_4(fd);
 //			} else
-			if (memcmp(bhdr,"MFSM 1.5",8)==0) {
+			if (memcmp(bhdr,"MFSM 1.5",8)==0 || memcmp(bhdr,"MFSM 2.0",8)==0) {
 				backversion = fs_loadversion(fd);
 			}
 		}
@@ -7439,7 +9905,7 @@ int fs_loadall(const char *fname) {
 #endif
 		return -1;
 	}
-	if (fread(hdr,1,8,fd)!=8) {
+	if (fread(hdr,1,8,fd)!=8 || (metastream_iscompressed(hdr) && metastream_readhead(fileno(fd),hdr,8)<0)) {
 			MFSLOG(LOG_NOTICE,"can't read metadata header\n");
 #ifndef METARESTORE
 		MFSLOG(LOG_ERR,"can't read metadata header");
@@ -7499,6 +9965,14 @@ int fs_loadall(const char *fname) {
 			return -1;
 		}
 		MFSLOG(LOG_NOTICE,"ok\n");
+	} else if (memcmp(hdr,"MFSM 2.0",8)==0) {
+		if (fs_loadimage(fd)<0) {
+#ifndef METARESTORE
+			MFSLOG(LOG_ERR,"error reading metadata (structure)");
+#endif
+			fclose(fd);
+			return -1;
+		}
 	} else {
 		MFSLOG(LOG_NOTICE,"wrong metadata header\n");
 #ifndef METARESTORE
@@ -7540,6 +10014,11 @@ int fs_loadall(const char *fname) {
 	MFSLOG(LOG_NOTICE,"connecting files and chunks ... ");
 	fs_add_files_to_chunks();
 	MFSLOG(LOG_NOTICE,"ok\n");
+#ifdef METARESTORE
+	if (fs_loaddeltas(fname)<0) {
+		return -1;
+	}
+#endif
 #ifndef METARESTORE
 	MFSLOG(LOG_NOTICE,"all inodes: %"PRIu32"\n",nodes);
 	MFSLOG(LOG_NOTICE,"directory inodes: %"PRIu32"\n",dirnodes);
@@ -7550,7 +10029,6 @@ int fs_loadall(const char *fname) {
 }
 
 void fs_strinit(void) {
-	uint32_t i;
 	root = NULL;
 	trash = NULL;
 	reserved = NULL;
@@ -7560,20 +10038,33 @@ void fs_strinit(void) {
 	reservednodes = 0;
 #ifndef METARESTORE
 	quotahead = NULL;
+	trashheapsize = 0;
+	trashindexon = 0;
+	reservedfreesize = 0;
+	reservedindexon = 0;
 #endif
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		nodehash[i]=NULL;
-	}
-#ifdef EDGEHASH
-	for (i=0 ; i<EDGEHASHSIZE ; i++) {
-		edgehash[i]=NULL;
-	}
-#endif
+	fsnodes_nodetab_free();
 }
 
 #ifndef METARESTORE
 int fs_init() {
+	uint32_t level;
 	LOG_COUNT = cfg_getuint32("LOG_PRINT_FREQUENCY",1000);
+	fsloadthreads = cfg_getuint32("METADATA_LOAD_THREADS",0);
+	fsmaxdeltas = cfg_getuint32("METADATA_MAX_DELTAS",23);
+	level = cfg_getuint32("METADATA_COMPRESSION",0);
+	fsstorelevel = (level>9)?9:level;
+	fsstorespeed = cfg_getuint32("METADATA_STORE_SPEED_LIMIT",0);
+	fsstoreverify = cfg_getuint8("METADATA_STORE_VERIFY",0);
+	EmptyTrashLimit = cfg_getuint32("EMPTY_TRASH_LIMIT",100000);
+	if (EmptyTrashLimit==0) {
+		EmptyTrashLimit = 1;
+	}
+	if (fsstorelevel>0 && metastream_compression_available()==0) {
+		MFSLOG(LOG_WARNING,"METADATA_COMPRESSION is set, but this binary was built without zlib - metadata will be stored uncompressed");
+		fsstorelevel = 0;
+	}
+	fs_storeprogress_init();
 	fprintf(msgfd,"the log print frequency is %d\n",LOG_COUNT);
 	fprintf(msgfd,"loading metadata ...\n");
 
@@ -7586,6 +10077,8 @@ int fs_init() {
 			return -1;
 		}
 		fprintf(msgfd,"metadata file has been loaded\n");
+		fs_delta_cleanup(UINT64_MAX);	// loaded file is now metadata.mfs.back - start new delta chain on top of it
+		fs_delta_restart();
 	}
 #if VERSMID==7
 #warning uncomment quota time limit
@@ -7597,18 +10090,50 @@ int fs_init() {
 	if(ismaster()) {
 		main_timeregister(TIMEMODE_RUNONCE,1,0,fs_test_files);
 		main_timeregister(TIMEMODE_RUNONCE,1,0,fsnodes_check_all_quotas);
-		main_timeregister(TIMEMODE_RUNONCE,300,0,fs_emptytrash);
+		main_timeregister(TIMEMODE_RUNONCE,60,0,fs_emptytrash);
 		main_timeregister(TIMEMODE_RUNONCE,60,0,fs_emptyreserved);
 		main_timeregister(TIMEMODE_RUNONCE,60,0,fsnodes_freeinodes);	
              	main_timeregister(TIMEMODE_RUNONCE,3600,0,fs_dostoreall);
 	}
 
 	main_destructregister(fs_term);		
+	main_timeregister(TIMEMODE_RUNONCE,10,0,fs_readdir_cursors_expire);	// also after slave -> master switch
 	main_timeregister(TIMEMODE_RUNONCE,60,0,log_print_control_fs);
        main_timeregister(TIMEMODE_RUNONCE, 60, 0, fs_waitchild);  
 
 	return 0;
 }
+
+#ifdef UNITTEST
+// empty file system (not stored yet)
+void fs_unittest_init(void) {
+	fsmaxdeltas = 23;
+	fsstorelevel = 0;
+	fs_storeprogress_init();
+	fs_strinit();
+	chunk_strinit();
+	fs_new();
+}
+
+// stores metadata.mfs.back in the current directory - following changes are tracked for deltas
+int fs_unittest_storeall(void) {
+	return (fs_storeall(0)==1)?0:-1;
+}
+
+// stores delta of metadata.mfs.back and waits until it is written
+int fs_unittest_storedelta(void) {
+	if (fs_storedelta()<0) {
+		return -1;
+	}
+	fs_delta_wait();
+	return fsdeltafailed?-1:0;
+}
+
+// stores whole image to 'fname' - metadata.mfs.back and deltas are not touched
+int fs_unittest_storeimage(const char *fname) {
+	return fs_store_file(fname,0,NULL);
+}
+#endif
 #else
 int fs_init(const char *fname) {
 	fs_strinit();
@@ -7623,19 +10148,14 @@ int fs_init(const char *fname) {
 
 #ifndef METARESTORE
 uint8_t slave_fs_freeinodes(uint32_t ts,uint32_t freeinodes) {
-        uint32_t fi,now,pos,mask;
+        uint32_t fi,now;
         freenode *n,*an;
 	now = ts;
 	fi = 0;
         n = freelist;
         while (n && n->ftime+86400<now) {
                 fi++;
-                pos = (n->id >> 5);
-                mask = 1<<(n->id&0x1F);
-                freebitmask[pos] &= ~mask;
-                if (pos<searchpos) {
-                        searchpos = pos;
-                }
+                fsnodes_freebitmask_clear(n->id);
                 an = n->next;
                 freenode_free(n);
                 n = an;
@@ -7656,6 +10176,9 @@ uint8_t slave_fs_freeinodes(uint32_t ts,uint32_t freeinodes) {
 
 static inline void slave_fsnodes_remove_edge(uint32_t ts,fsedge *e) {
         if (e->parent) {
+                if (rdcursors>0) {
+                        fsnodes_readdir_edge_removed(e);
+                }
                 e->parent->mtime = e->parent->ctime = ts;
                 e->parent->data.ddata.elements--;
                 if (e->child->type==TYPE_DIRECTORY) {
@@ -7674,15 +10197,11 @@ static inline void slave_fsnodes_remove_edge(uint32_t ts,fsedge *e) {
                 e->nextparent->prevparent = e->prevparent;
         }
 #ifdef EDGEHASH
-        if (e->prev) {
-                *(e->prev) = e->next;
-                if (e->next) {
-                        e->next->prev = e->prev;
-                }
+        if (e->parent) {
+                fsnodes_nameidx_del(e->parent,e);
         }
 #endif
-        free(e->name);
-        free(e);
+        fsedge_free(e);
 }
 
 //slave master interface
@@ -7815,25 +10334,20 @@ static inline void slave_fsnodes_setlength(fsnode *obj,uint64_t length) {
 } 
 
 static inline void slave_fsnodes_remove_node(uint32_t ts,fsnode *toremove) {
-        uint32_t nodepos;
-        fsnode **ptr;
         if (toremove->parents!=NULL) {
                 return;
         }
-// remove from idhash
-        nodepos = NODEHASHPOS(toremove->id);
-        ptr = &(nodehash[nodepos]);
-        while (*ptr) {
-                if (*ptr==toremove) {
-                        *ptr=toremove->next;
-                        break;
-                }
-                ptr = &((*ptr)->next);
-        }       
+// remove from inode table
+        fsnodes_nodetab_remove(toremove);
 // and free     
         nodes--;        
         if (toremove->type==TYPE_DIRECTORY) {
                 dirnodes--;
+#ifdef EDGEHASH
+                if (toremove->data.ddata.nameidx) {
+                        free(toremove->data.ddata.nameidx);
+                }
+#endif
                 if (toremove->data.ddata.quota) {
                         fsnodes_delete_quotanode(toremove->data.ddata.quota);
                 }
@@ -7863,7 +10377,7 @@ static inline void slave_fsnodes_remove_node(uint32_t ts,fsnode *toremove) {
         }
         fsnodes_free_id(toremove->id,ts);
         dcm_modify(toremove->id,0);
-        free(toremove);
+        fsnode_free(toremove);
 }
 
 static inline void slave_fsnodes_unlink(uint32_t ts,fsedge *e) {
@@ -7883,7 +10397,7 @@ static inline void slave_fsnodes_unlink(uint32_t ts,fsedge *e) {
 			if (child->trashtime>0) {
 				child->type = TYPE_TRASH;
 				child->ctime = ts;
-				e = malloc(sizeof(fsedge));
+				e = fsedge_malloc(0);
 				e->nleng = pleng;
 				e->name = path;
 				e->child = child;
@@ -7895,15 +10409,13 @@ static inline void slave_fsnodes_unlink(uint32_t ts,fsedge *e) {
 				if (e->nextchild) {
 					e->nextchild->prevchild = &(e->nextchild);
 				}
-				e->next = NULL;
-				e->prev = NULL;
 				trash = e;
 				child->parents = e;
 				trashspace += child->data.fdata.length;
 				trashnodes++;
 			} else if (child->data.fdata.sessionids!=NULL) {
 				child->type = TYPE_RESERVED;
-				e = malloc(sizeof(fsedge));
+				e = fsedge_malloc(0);
 				e->nleng = pleng;
 				e->name = path;
 				e->child = child;
@@ -7915,10 +10427,6 @@ static inline void slave_fsnodes_unlink(uint32_t ts,fsedge *e) {
 				if (e->nextchild) {
 					e->nextchild->prevchild = &(e->nextchild);
 				}
-#ifdef EDGEHASH
-				e->next = NULL;
-				e->prev = NULL;
-#endif
 				reserved = e;
 				child->parents = e;
 				reservedspace += child->data.fdata.length;
@@ -8127,7 +10635,7 @@ uint8_t slave_fs_setpath(uint32_t inode,const uint8_t *path) {
         if (newpath==NULL) {
                 return ERROR_EINVAL;
         }
-        free(p->parents->name);
+        fsedge_name_free(p->parents);
         memcpy(newpath,path,pleng);
         p->parents->name = newpath;
         p->parents->nleng = pleng;
@@ -8580,6 +11088,16 @@ uint8_t slave_fs_incversion(uint64_t chunkid) {
 	return chunk_increase_version(chunkid);
 }
 
+uint8_t slave_fs_xorgroup(uint64_t parityid,uint8_t level,const uint64_t *chunkid,const uint32_t *cversion) {
+	version++;
+	return chunk_xor_add(parityid,level,chunkid,cversion);
+}
+
+uint8_t slave_fs_xordel(uint64_t parityid) {
+	version++;
+	return chunk_xor_delete(parityid);
+}
+
 uint8_t slave_fs_repair(uint32_t ts,uint32_t inode,uint32_t indx,uint32_t nversion) {
 	fsnode *p;
 	uint8_t status;
@@ -8617,7 +11135,7 @@ uint8_t slave_fs_setgoal(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t goal,ui
 	si = 0;
         nci = 0;
         nsi = 0;
-        if (!SMODE_ISVALID(smode) || goal>9 || goal<1) {
+        if (!SMODE_ISVALID(smode) || !GOAL_ISVALID(goal)) {
                 return ERROR_EINVAL;
         }
         p = fsnodes_id_to_node(inode);
@@ -22,20 +22,26 @@
 #include <inttypes.h>
 #include <stdio.h>
 
+#include "MFSCommunication.h"
+
 #define USE_FREENODE_BUCKETS 1
 #define USE_CUIDREC_BUCKETS 1
+#define USE_FSOBJ_SLABS 1
 #define EDGEHASH 1
 #define BACKGROUND_METASTORE 1
 
-#define NODEHASHBITS (26)
-#define NODEHASHSIZE (1<<NODEHASHBITS)
-#define NODEHASHPOS(nodeid) ((nodeid)&(NODEHASHSIZE-1))
+#define NODETABPAGEBITS (16)
+#define NODETABPAGESIZE (1<<NODETABPAGEBITS)
+#define NODETABPAGE(nodeid) ((nodeid)>>NODETABPAGEBITS)
+#define NODETABPOS(nodeid) ((nodeid)&(NODETABPAGESIZE-1))
 
 #ifdef EDGEHASH
-#define EDGEHASHBITS (26)
-#define EDGEHASHSIZE (1<<EDGEHASHBITS)
-#define EDGEHASHPOS(hash) ((hash)&(EDGEHASHSIZE-1))
 #define LOOKUPNOHASHLIMIT 10
+#define NAMEIDXMINSIZE 32
+#endif
+
+#ifdef USE_FSOBJ_SLABS
+#define FSEDGE_INLINE_MAX 64
 #endif
 
 //#define GOAL(x) ((x)&0xF)
@@ -74,12 +80,23 @@ typedef struct _fsedge {
 	struct _fsedge *nextchild,*nextparent;
 	struct _fsedge **prevchild,**prevparent;
 #ifdef EDGEHASH
-	struct _fsedge *next,**prev;
+	uint32_t hash;
 #endif
 	uint16_t nleng;
+#ifdef USE_FSOBJ_SLABS
+	uint8_t eclass;
+#endif
+	uint8_t delta;	// created after the last metadata checkpoint
 	uint8_t *name;
 } fsedge;
 
+#ifdef EDGEHASH
+typedef struct _fsnameidx {
+	uint32_t size;
+	fsedge *slot[];
+} fsnameidx;
+#endif
+
 typedef struct _statsrecord {
 	uint32_t inodes;
 	uint32_t dirs;
@@ -114,6 +131,9 @@ typedef struct _fsnode {
 	union _data {
 		struct _ddata {				// type==TYPE_DIRECTORY
 			fsedge *children;
+#ifdef EDGEHASH
+			fsnameidx *nameidx;
+#endif
 			uint32_t nlink;
 			uint32_t elements;
 //			uint8_t quotaexceeded:1;	// quota exceeded
@@ -135,7 +155,6 @@ typedef struct _fsnode {
 		} fdata;
 	} data;
 	fsedge *parents;
-	struct _fsnode *next;
 } fsnode;
 
 typedef struct _freenode {
@@ -175,6 +194,8 @@ uint8_t fs_trunc(uint32_t ts,uint32_t inode,uint32_t indx,uint64_t chunkid);
 uint8_t fs_write(uint32_t ts,uint32_t inode,uint32_t indx,uint8_t opflag,uint64_t chunkid);
 uint8_t fs_unlock(uint64_t chunkid);
 uint8_t fs_incversion(uint64_t chunkid);
+uint8_t fs_xorgroup(uint64_t parityid,uint8_t level,const uint64_t *chunkid,const uint32_t *cversion);
+uint8_t fs_xordel(uint64_t parityid);
 uint8_t fs_setgoal(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t smode,uint32_t sinodes,uint32_t ncinodes,uint32_t nsinodes);
 uint8_t fs_settrashtime(uint32_t ts,uint32_t inode,uint32_t uid,uint32_t trashtime,uint8_t smode,uint32_t sinodes,uint32_t ncinodes,uint32_t nsinodes);
 uint8_t fs_seteattr(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t eattr,uint8_t smode,uint32_t sinodes,uint32_t ncinodes,uint32_t nsinodes);
@@ -192,6 +213,9 @@ void fs_strinit(void);
 // attr blob: [ type:8 goal:8 mode:16 uid:32 gid:32 atime:32 mtime:32 ctime:32 length:64 ]
 void fs_stats(uint32_t stats[16]);
 void fs_info(uint64_t *totalspace,uint64_t *availspace,uint64_t *trspace,uint32_t *trnodes,uint64_t *respace,uint32_t *renodes,uint32_t *inodes,uint32_t *dnodes,uint32_t *fnodes);
+void fs_meminfo(uint64_t *allocated,uint64_t *used);
+void fs_storestats(uint64_t *bytes,uint32_t *msec);
+void fs_storeinfo(uint8_t *status,uint8_t *result,uint32_t *start,uint32_t *msec,uint64_t *bytes,uint64_t *stored,uint64_t *records);
 void fs_test_getdata(uint32_t *loopstart,uint32_t *loopend,uint32_t *files,uint32_t *ugfiles,uint32_t *mfiles,uint32_t *chunks,uint32_t *ugchunks,uint32_t *mchunks,char **msgbuff,uint32_t *msgbuffleng);
 
 // void fs_attrtoblob(uint8_t attr[32],uint8_t attrblob[32]);
@@ -223,19 +247,21 @@ uint8_t fs_append(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t in
 
 uint8_t fs_readdir_size(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,uint8_t flags,void **dnode,uint32_t *dbuffsize);
 void fs_readdir_data(uint32_t rootinode,uint8_t sesflags,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t flags,void *dnode,uint8_t *dbuff);
+uint8_t fs_readdir_page_size(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,uint8_t flags,uint64_t cookie,uint32_t maxsize,void **dnode,uint32_t *dbuffsize);
+void fs_readdir_page_data(uint32_t rootinode,uint8_t sesflags,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint64_t cookie,void *dnode,uint8_t *dbuff);
 
 uint8_t fs_checkfile(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint16_t chunkcount[256]);
 
 uint8_t fs_opencheck(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,uint32_t auid,uint32_t agid,uint8_t flags,uint8_t attr[35]);
 
 uint8_t fs_readchunk(uint32_t inode,uint32_t indx,uint64_t *chunkid,uint64_t *length);
-uint8_t fs_writechunk(uint32_t inode,uint32_t indx,uint64_t *chunkid,uint64_t *length,uint8_t *opflag);
+uint8_t fs_writechunk(uint32_t inode,uint32_t indx,uint32_t sessionid,uint64_t *chunkid,uint64_t *length,uint8_t *opflag);
 // uint8_t fs_reinitchunk(uint32_t inode,uint32_t indx,uint64_t *chunkid);
 uint8_t fs_writeend(uint32_t inode,uint64_t length,uint64_t chunkid);
 
 uint8_t fs_repair(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,uint32_t *notchanged,uint32_t *erased,uint32_t *repaired);
 
-uint8_t fs_getgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t gmode,uint32_t fgtab[10],uint32_t dgtab[10]);
+uint8_t fs_getgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t gmode,uint32_t fgtab[GOAL_MAX+1],uint32_t dgtab[GOAL_MAX+1]);
 uint8_t fs_setgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t smode,uint32_t *sinodes,uint32_t *ncinodes,uint32_t *nsinodes);
 
 uint8_t fs_gettrashtime_prepare(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t gmode,void **fptr,void **dptr,uint32_t *fnodes,uint32_t *dnodes);
@@ -277,6 +303,9 @@ void fs_getquotainfo_data(uint8_t *buff);
 
 // SPECIAL - LOG EMERGENCY INCREASE VERSION FROM CHUNKS-MODULE
 void fs_incversion(uint64_t chunkid);
+// SPECIAL - LOG XOR GROUPS CREATED AND DISSOLVED BY CHUNKS-MODULE
+void fs_xorgroup(uint64_t parityid,uint8_t level,const uint64_t *chunkid,const uint32_t *cversion);
+void fs_xordel(uint64_t parityid);
 
 int fs_init();
 void fs_test_files(void) ;
@@ -313,10 +342,19 @@ uint8_t slave_fs_trunc(uint32_t ts,uint32_t inode,uint32_t indx,uint64_t chunkid
 uint8_t slave_fs_write(uint32_t ts,uint32_t inode,uint32_t indx,uint8_t opflag,uint64_t chunkid);
 uint8_t slave_fs_unlock(uint64_t chunkid);
 uint8_t slave_fs_incversion(uint64_t chunkid);
+uint8_t slave_fs_xorgroup(uint64_t parityid,uint8_t level,const uint64_t *chunkid,const uint32_t *cversion);
+uint8_t slave_fs_xordel(uint64_t parityid);
 uint8_t slave_fs_setgoal(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t goal,uint8_t smode,uint32_t sinodes,uint32_t ncinodes,uint32_t nsinodes);
 uint8_t slave_fs_settrashtime(uint32_t ts,uint32_t inode,uint32_t uid,uint32_t trashtime,uint8_t smode,uint32_t sinodes,uint32_t ncinodes,uint32_t nsinodes);
 uint8_t slave_fs_seteattr(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t eattr,uint8_t smode,uint32_t sinodes,uint32_t ncinodes,uint32_t nsinodes);
 
+#ifdef UNITTEST
+void fs_unittest_init(void);
+int fs_unittest_storeall(void);
+int fs_unittest_storedelta(void);
+int fs_unittest_storeimage(const char *fname);
+#endif
+
 #endif
 
 #endif
@@ -32,6 +32,7 @@
 #include "chartsdata.h"
 #include "state.h"
 #include "masterconn.h"
+#include "nettopology.h"
 
 #define STR_AUX(x) #x
 #define STR(x) STR_AUX(x)
@@ -54,6 +55,7 @@ struct {
 	{matoslaserv_init,"communication with slave"},
 	{masterconn_init,"connection with other master"},	
 	{matomlserv_init,"communication with metalogger"},	
+	{net_topology_init,"network topology"}, // has to be before 'matocsserv_init'
 	{matocsserv_init,"communication with chunkserver"},	
 	{matocuserv_networkinit,"communication with clients"},
 	{(runfn)0,"****"}
@@ -39,6 +39,7 @@
 #include "matocsserv.h"
 #include "cfg.h"
 #include "main.h"
+#include "pktbuf.h"
 #include "sockets.h"
 #include "chunks.h"
 #include "random.h"
@@ -46,6 +47,9 @@
 #include "state.h"
 
 #define MaxPacketSize 500000000
+
+// chunks from register packets processed per main loop iteration
+#define REGISTER_BATCH 100000
 /*print log control */
 //#define LOG_COUNT 1000
 
@@ -58,12 +62,15 @@ static uint32_t	log_got_duplicatechunk_status=0;
 static uint32_t	log_got_truncatechunk_status=0;
 static uint32_t	log_got_duptruncchunk_status=0;
 static uint32_t	log_got_chunkop_status=0;
+static uint32_t	log_got_chunkop_batch_status=0;
 
 static uint64_t maxtotalspace;
 serventry *matocsservhead=NULL;
 static int lsock;
 static int32_t lsockpdescpos;
 static int first_add_listen_sock;
+static serventry *matocsservflushhead=NULL;	// connections with new data (packets or batched operations) to send
+static uint8_t killpending;	// some connection is killed - list is walked in next desc
 
 // from config
 static char *ListenHost;
@@ -94,47 +101,17 @@ static repdst* rephash[REPHASHSIZE];
 static repsrc *repsrcfreehead=NULL;
 static repdst *repdstfreehead=NULL;
 
+#define WSLOTS 65536
+#define WSLOT_NONE 0xFFFFFFFF
+static uint64_t wtree[WSLOTS+1];
+static uint64_t wvalue[WSLOTS];
+static serventry *wserv[WSLOTS];
+static uint32_t wfree[WSLOTS];
+static uint32_t wfreecnt=0,wslotsused=0,wservers=0;
+static uint64_t wtotal=0;
+static uint8_t wracksdirty=0,wmultirack=0;
+static uint32_t wtopogeneration=0;
 
-enum chkreg_check_result {
-    CHKREG_CHK_SUC = 0,
-    CHKREG_CHK_FAIL,
-};
-
-typedef struct chkreg_manager {
-    uint32_t chkreg_time_limit;
-    uint32_t chkreg_time_begin;
-} chkreg_manger_t;
-
-chkreg_manger_t chkreg_manager;
-
-inline void chkreg_limit_init(uint32_t chkreg_time_limit)
-{
-    chkreg_manager.chkreg_time_limit = chkreg_time_limit;
-}
-
-inline void chkreg_time_init()
-{
-    struct timeval now;
-    
-    gettimeofday(&now,NULL);
-    chkreg_manager.chkreg_time_begin = now.tv_sec;
-}
-
-inline int32_t chkreg_check()
-{
-    struct timeval now;
-    
-    gettimeofday(&now,NULL);
-
-    if(now.tv_sec - chkreg_manager.chkreg_time_begin < chkreg_manager.chkreg_time_limit) {
-        return CHKREG_CHK_SUC;
-    } 
-
-    //syslog(LOG_NOTICE, "excess the chunk register limit begin:%d now:%lu limit:%d\n",
-    //        chkreg_manager.chkreg_time_begin, now.tv_sec, chkreg_manager.chkreg_time_limit);
-
-    return CHKREG_CHK_FAIL;
-}
 
 repsrc* matocsserv_repsrc_malloc() {
 	repsrc *r;
@@ -312,7 +289,9 @@ void matocsserv_usagedifference(double *minusage,double *maxusage,uint16_t *usab
 				}
 				j++;
 			}
-			k++;
+			if (eptr->registering==0) {	// chunks not known yet - don't treat as connected
+				k++;
+			}
 		}
 	}
 	*usablescount = j;
@@ -434,95 +413,162 @@ uint16_t matocsserv_getservers_ordered(void* ptrs[65535],double maxusagediff,uin
 }
 
 
-int matocsserv_carry_compare(const void *a,const void *b) {
-	const struct rservsort {
-		double w;
-		double carry;
-		serventry *ptr;
-	} *aa=a,*bb=b;
-	if (aa->carry > bb->carry) {
-		return -1;
+/* servers for new chunks are chosen with probability proportional to their total space (like the former
+   'carry' algorithm) - weights are kept in a Fenwick tree updated when server's space changes, servers
+   which can't accept new chunks have weight 0. 'demand' servers are chosen by systematic sampling:
+   points start+i*(W/demand) always hit different servers unless one server has more than 1/demand of
+   all weight, so every server is used with probability demand*w/W and selection is O(demand*log(n)) */
+
+static inline uint64_t matocsserv_rnd64(void) {
+	return (((uint64_t)rndu32())<<32) | rndu32();
+}
+
+static void matocsserv_wtree_add(uint32_t slot,uint64_t delta) {	// delta in two's complement
+	uint32_t i;
+	for (i=slot+1 ; i<=WSLOTS ; i+=(i&(-i))) {
+		wtree[i]+=delta;
 	}
-	if (aa->carry < bb->carry) {
-		return 1;
+	wtotal+=delta;
+}
+
+// returns slot containing point 'pos' (pos<wtotal)
+static uint32_t matocsserv_wtree_find(uint64_t pos) {
+	uint32_t i,bit;
+	i = 0;
+	for (bit=WSLOTS ; bit>0 ; bit>>=1) {
+		if (i+bit<=WSLOTS && wtree[i+bit]<=pos) {
+			i+=bit;
+			pos-=wtree[i];
+		}
+	}
+	return i;
+}
+
+static void matocsserv_weight_update(serventry *eptr) {
+	uint64_t w;
+	uint32_t slot;
+
+	if (eptr->listen_sock==0 && eptr->mode!=KILL
+			&& eptr->totalspace > 0 && eptr->usedspace <= eptr->totalspace
+			&& (double)eptr->usedspace / (double)eptr->totalspace < HighSpaceUsage
+			&& (eptr->totalspace - eptr->usedspace) > LowFreeSpace) {
+		w = (eptr->totalspace>>20)+1;	// MiB
+	} else {
+		w = 0;
+	}
+	slot = eptr->wslot;
+	if (slot==WSLOT_NONE) {
+		if (w==0) {
+			return;
+		}
+		if (wfreecnt>0) {
+			slot = wfree[--wfreecnt];
+		} else if (wslotsused<WSLOTS) {
+			slot = wslotsused++;
+		} else {
+			return;
+		}
+		eptr->wslot = slot;
+		wserv[slot] = eptr;
+		wvalue[slot] = 0;
+		wservers++;
+		wracksdirty = 1;
+	}
+	if (w!=wvalue[slot]) {
+		matocsserv_wtree_add(slot,w-wvalue[slot]);
+		wvalue[slot] = w;
+	}
+	if (w==0) {
+		wserv[slot] = NULL;
+		wfree[wfreecnt++] = slot;
+		eptr->wslot = WSLOT_NONE;
+		wservers--;
+		wracksdirty = 1;
 	}
-	return 0;
+}
+
+// recalculated only when the set of available servers or the topology has changed
+static uint8_t matocsserv_weight_multirack(void) {
+	uint32_t i,rack = 0;
+	serventry *eptr;
+	if (wracksdirty || wtopogeneration!=net_topology_generation()) {
+		wtopogeneration = net_topology_generation();
+		wmultirack = 0;
+		eptr = NULL;
+		for (i=0 ; i<wslotsused && wmultirack==0 ; i++) {
+			if (wserv[i]) {
+				if (eptr==NULL) {
+					eptr = wserv[i];
+					rack = net_get_rack(eptr->servip);
+				} else if (net_get_rack(wserv[i]->servip)!=rack) {
+					wmultirack = 1;
+				}
+			}
+		}
+		wracksdirty = 0;
+	}
+	return wmultirack;
 }
 
 uint16_t matocsserv_getservers_wrandom(void* ptrs[65536],uint16_t demand) {
-	static struct rservsort {
-		double w;
-		double carry;
-		serventry *ptr;
-	} servtab[65536], servtabtmp;
 	serventry *eptr;
-	double carry;
-	uint32_t i, j;
-	uint32_t allcnt;
-	uint32_t availcnt;
-    int multirack;
-	if (maxtotalspace==0) {
+	uint64_t step,pos;
+	uint32_t i,j,slot,tries;
+
+	if (wtotal==0) {
 		return 0;
 	}
-	allcnt=0;
-	availcnt=0;
-    multirack=0;
-	for (eptr = matocsservhead ; eptr && allcnt<65536 ; eptr=eptr->next) {
-		if (eptr->listen_sock==0 && eptr->mode!=KILL
-                && eptr->totalspace > 0 && eptr->usedspace <= eptr->totalspace
-                && (double)eptr->usedspace / (double)eptr->totalspace < HighSpaceUsage
-                && (eptr->totalspace - eptr->usedspace) > LowFreeSpace) {
-			servtab[allcnt].w = (double)eptr->totalspace/(double)maxtotalspace;
-			servtab[allcnt].carry = eptr->carry;
-			servtab[allcnt].ptr = eptr;
-            if(!multirack && !net_is_same_rack(servtab[0].ptr->servip, servtab[allcnt].ptr->servip)) {
-                multirack = 1;
-            }
-			allcnt++;
-			if (eptr->carry>=1.0) {
-				availcnt++;
+	if (demand>wservers) {
+		demand=wservers;
+	}
+	step = wtotal/demand;
+	pos = matocsserv_rnd64()%step;
+	for (i=0 ; i<demand ; i++) {
+		slot = matocsserv_wtree_find(pos);
+		pos += step;
+		for (;;) {	// server with more than 1/demand of weight can be hit twice - take next one
+			eptr = wserv[slot];
+			if (eptr) {
+				for (j=0 ; j<i && ptrs[j]!=eptr ; j++) {}
+				if (j==i) {
+					break;
+				}
 			}
-
+			slot = (slot+1<wslotsused)?slot+1:0;
 		}
+		ptrs[i] = eptr;
 	}
-	if (demand>allcnt) {
-		demand=allcnt;
+	// points are ordered - shuffle servers, so the first one is random
+	for (i=0 ; i+1<demand ; i++) {
+		j = i+rndu32()%(demand-i);
+		if (i!=j) {
+			void *p = ptrs[i];
+			ptrs[i] = ptrs[j];
+			ptrs[j] = p;
+		}
 	}
-	while (availcnt<demand) {
-		availcnt=0;
-		for (i=0 ; i<allcnt ; i++) {
-			carry = servtab[i].carry + servtab[i].w;
-			servtab[i].carry = carry;
-			servtab[i].ptr->carry = carry;
-			if (carry>=1.0) {
-				availcnt++;
+	// make sure that at least one copy is in other rack than the first one
+	if (demand>1 && matocsserv_weight_multirack()) {
+		for (i=1 ; i<demand ; i++) {
+			if (!net_is_same_rack(((serventry*)ptrs[0])->servip,((serventry*)ptrs[i])->servip)) {
+				return demand;
 			}
 		}
-	}
-	qsort(servtab,allcnt,sizeof(struct rservsort),matocsserv_carry_compare);
-    if(multirack && demand>1) {
-        for(i=1; i<allcnt; i++) {
-            if(!net_is_same_rack(servtab[0].ptr->servip, servtab[i].ptr->servip)) {
-                if(servtab[i].carry<1.0) {
-                    for(j=0; j<allcnt; j++) {
-                        carry = servtab[j].carry + servtab[j].w/servtab[i].w;
-                        servtab[j].carry = carry;
-                        servtab[j].ptr->carry = carry;
-                    }
-                }
-                if(i>=demand) {
-                    servtabtmp = servtab[demand-1];
-                    servtab[demand-1] = servtab[i];
-                    servtab[i] = servtabtmp;
-                }
-                break;
-            }
-        }
-    }
-
-	for (i=0 ; i<demand ; i++) {
-		ptrs[i] = servtab[i].ptr;
-		servtab[i].ptr->carry-=1.0;
+		eptr = NULL;
+		for (tries=0 ; tries<16 && eptr==NULL ; tries++) {
+			eptr = wserv[matocsserv_wtree_find(matocsserv_rnd64()%wtotal)];
+			if (eptr && net_is_same_rack(((serventry*)ptrs[0])->servip,eptr->servip)) {
+				eptr = NULL;
+			}
+		}
+		for (slot=0 ; slot<wslotsused && eptr==NULL ; slot++) {
+			if (wserv[slot] && !net_is_same_rack(((serventry*)ptrs[0])->servip,wserv[slot]->servip)) {
+				eptr = wserv[slot];
+			}
+		}
+		if (eptr) {
+			ptrs[demand-1] = eptr;
+		}
 	}
 	return demand;
 }
@@ -733,7 +779,7 @@ int matocsserv_balanced(double balancelimit) {
 	return 0;
 }
 */
-uint32_t matocsserv_cservlist_size(void) {
+uint32_t matocsserv_cservlist_size(uint8_t withmem) {
 	serventry *eptr;
 	uint32_t i;
 	i=0;
@@ -742,10 +788,10 @@ uint32_t matocsserv_cservlist_size(void) {
 			i++;
 		}
 	}
-	return i*(4+4+2+8+8+4+8+8+4+4);
+	return i*(4+4+2+8+8+4+8+8+4+4+(withmem?8:0));
 }
 
-void matocsserv_cservlist_data(uint8_t *ptr) {
+void matocsserv_cservlist_data(uint8_t *ptr,uint8_t withmem) {
 	serventry *eptr;
 	for (eptr = matocsservhead ; eptr ; eptr=eptr->next) {
 		if (eptr->mode!=KILL && eptr->listen_sock==0) {
@@ -759,6 +805,9 @@ void matocsserv_cservlist_data(uint8_t *ptr) {
 			put64bit(&ptr,eptr->todeltotalspace);
 			put32bit(&ptr,eptr->todelchunkscount);
 			put32bit(&ptr,eptr->errorcounter);
+			if (withmem) {
+				put64bit(&ptr,(uint64_t)(eptr->registered?eptr->chunkhlist.size:0)*sizeof(void*));
+			}
 		}
 	}
 }
@@ -773,6 +822,7 @@ void log_print_control(void) {
 	log_got_truncatechunk_status=0;
 	log_got_duptruncchunk_status=0;
 	log_got_chunkop_status=0;
+	log_got_chunkop_batch_status=0;
 }
 
 void matocsserv_status(void) {
@@ -795,7 +845,7 @@ void matocsserv_status(void) {
 			n++;
 			us = (double)(eptr->usedspace)/(double)(1024*1024*1024);
 			ts = (double)(eptr->totalspace)/(double)(1024*1024*1024);
-			MFSLOG(LOG_NOTICE,"server %"PRIu32" (ip: %s, port: %"PRIu16"): usedspace: %"PRIu64" (%.2lf GiB), totalspace: %"PRIu64" (%.2lf GiB), usage: %.2lf%%",n,eptr->servstrip,eptr->servport,eptr->usedspace,us,eptr->totalspace,ts,(ts>0.0)?100.0*us/ts:0.0);
+			MFSLOG(LOG_NOTICE,"server %"PRIu32" (ip: %s, port: %"PRIu16"): usedspace: %"PRIu64" (%.2lf GiB), totalspace: %"PRIu64" (%.2lf GiB), usage: %.2lf%%, chunks: %"PRIu32" (table: %"PRIu32" slots)",n,eptr->servstrip,eptr->servport,eptr->usedspace,us,eptr->totalspace,ts,(ts>0.0)?100.0*us/ts:0.0,eptr->registered?eptr->chunkhlist.num:0,eptr->registered?eptr->chunkhlist.size:0);
 		}
 	}
 	us = (double)(uspace)/(double)(1024*1024*1024);
@@ -856,31 +906,124 @@ char* matocsserv_makestrip(uint32_t ip) {
 	return optr;
 }
 
+/* chunk operations for chunkservers with CSFEATURE_CHUNKOP_BATCH are collected and sent as
+   MATOCS_CHUNKOP_BATCH (up to CHUNKOP_BATCH_MAX records, the rest is sent before next poll);
+   chunkserver answers with one vector of statuses per batch */
+#define BATCH_RECSIZE (8+4+4+8+4+4)
+
+typedef struct _opbatch {
+	uint32_t batchid;
+	uint32_t cnt;
+	uint8_t *ops;		// records as sent - needed to dispatch statuses
+	struct _opbatch *next;
+} opbatch;
+
+static void matocsserv_batch_flush(serventry *eptr);
+
+/* new data for connection with nothing queued - it will be sent directly in next desc (see matocsserv_flush) */
+static inline void matocsserv_flushlater(serventry *eptr) {
+	if (eptr->flushpending==0 && eptr->mode!=KILL) {
+		eptr->flushpending = 1;
+		eptr->flushnext = matocsservflushhead;
+		matocsservflushhead = eptr;
+	}
+}
+
+/* EPOLLOUT only while there is something left after direct write, no EPOLLIN while chunk list from register is processed */
+static inline uint32_t matocsserv_interest(serventry *eptr) {
+	uint32_t events = (eptr->regleft>0)?0:EPOLLIN;
+	if (eptr->outputhead!=NULL && eptr->flushpending==0) {
+		events |= EPOLLOUT;
+	}
+	return events;
+}
+
 uint8_t* matocsserv_createpacket(serventry *eptr,uint32_t type,uint32_t size) {
-	packetstruct *outpacket;
 	uint8_t *ptr;
-	uint32_t psize;
+	uint8_t wasempty;
 
-	outpacket=(packetstruct*)malloc(sizeof(packetstruct));
-	if (outpacket==NULL) {
-		return NULL;
+	if (eptr->batchcnt>0 && type!=MATOCS_CHUNKOP_BATCH) {	// keep order of commands
+		matocsserv_batch_flush(eptr);
 	}
-	psize = size+8;
-	outpacket->packet=malloc(psize);
-	outpacket->bytesleft = psize;
-	if (outpacket->packet==NULL) {
-		free(outpacket);
+	wasempty = (eptr->outputhead==NULL)?1:0;
+	ptr = pktbuf_append(&(eptr->outputhead),&(eptr->outputtail),type,size);
+	if (ptr==NULL) {
 		return NULL;
 	}
-	ptr = outpacket->packet;
-	put32bit(&ptr,type);
-	put32bit(&ptr,size);
-	outpacket->startptr = (uint8_t*)(outpacket->packet);
-	outpacket->next = NULL;
-	*(eptr->outputtail) = outpacket;
-	eptr->outputtail = &(outpacket->next);
+	if (wasempty) {
+		matocsserv_flushlater(eptr);
+	}
 	return ptr;
 }
+
+static void matocsserv_batch_flush(serventry *eptr) {
+	opbatch *ob,**obp;
+	uint8_t *data;
+	uint32_t cnt;
+
+	cnt = eptr->batchcnt;
+	eptr->batchcnt = 0;
+	data = matocsserv_createpacket(eptr,MATOCS_CHUNKOP_BATCH,4+cnt*BATCH_RECSIZE);
+	ob = malloc(sizeof(opbatch));
+	if (data==NULL || ob==NULL) {
+		if (ob) {
+			free(ob);
+		}
+		eptr->mode = KILL;
+		return;
+	}
+	eptr->batchid++;
+	put32bit(&data,eptr->batchid);
+	memcpy(data,eptr->batchbuff,cnt*BATCH_RECSIZE);
+	ob->batchid = eptr->batchid;
+	ob->cnt = cnt;
+	ob->ops = eptr->batchbuff;
+	ob->next = NULL;
+	eptr->batchbuff = NULL;
+	for (obp=&(eptr->batchsent) ; *obp ; obp=&((*obp)->next)) {}
+	*obp = ob;
+}
+
+static int matocsserv_batch_add(serventry *eptr,uint64_t chunkid,uint32_t version,uint32_t newversion,uint64_t copychunkid,uint32_t copyversion,uint32_t leng) {
+	uint8_t *ptr;
+
+	if (eptr->batchbuff==NULL) {
+		eptr->batchbuff = malloc(CHUNKOP_BATCH_MAX*BATCH_RECSIZE);
+		if (eptr->batchbuff==NULL) {
+			return -1;
+		}
+	}
+	ptr = eptr->batchbuff+eptr->batchcnt*BATCH_RECSIZE;
+	put64bit(&ptr,chunkid);
+	put32bit(&ptr,version);
+	put32bit(&ptr,newversion);
+	put64bit(&ptr,copychunkid);
+	put32bit(&ptr,copyversion);
+	put32bit(&ptr,leng);
+	eptr->batchcnt++;
+	if (eptr->batchcnt>=CHUNKOP_BATCH_MAX) {
+		matocsserv_batch_flush(eptr);
+	} else if (eptr->batchcnt==1) {	/* operations collected in this loop are sent in next desc */
+		matocsserv_flushlater(eptr);
+	}
+	return 0;
+}
+
+static void matocsserv_batch_free(serventry *eptr) {
+	opbatch *ob,*nob;
+
+	if (eptr->batchbuff) {
+		free(eptr->batchbuff);
+		eptr->batchbuff = NULL;
+	}
+	eptr->batchcnt = 0;
+	for (ob=eptr->batchsent ; ob ; ob=nob) {
+		nob = ob->next;
+		free(ob->ops);
+		free(ob);
+	}
+	eptr->batchsent = NULL;
+}
 /* for future use */
 int matocsserv_send_chunk_checksum(void *e,uint64_t chunkid,uint32_t version) {
 	serventry *eptr = (serventry *)e;
@@ -930,6 +1073,9 @@ int matocsserv_send_createchunk(void *e,uint64_t chunkid,uint32_t version) {
 	uint8_t *data;
 
 	if (eptr->mode!=KILL) {
+		if (eptr->features&CSFEATURE_CHUNKOP_BATCH) {
+			return matocsserv_batch_add(eptr,chunkid,version,0,0,0,1);
+		}
 		data = matocsserv_createpacket(eptr,MATOCS_CREATE,8+4);
 		if (data==NULL) {
 			return -1;
@@ -964,6 +1110,9 @@ int matocsserv_send_deletechunk(void *e,uint64_t chunkid,uint32_t version) {
 	uint8_t *data;
 
 	if (eptr->mode!=KILL) {
+		if (eptr->features&CSFEATURE_CHUNKOP_BATCH) {
+			return matocsserv_batch_add(eptr,chunkid,version,0,0,0,0);
+		}
 		data = matocsserv_createpacket(eptr,MATOCS_DELETE,8+4);
 		if (data==NULL) {
 			return -1;
@@ -1011,7 +1160,6 @@ int matocsserv_send_replicatechunk(void *e,uint64_t chunkid,uint32_t version,voi
 		put32bit(&data,srceptr->servip);
 		put16bit(&data,srceptr->servport);
 		matocsserv_replication_begin(chunkid,version,eptr,1,&src);
-		eptr->carry = 0;
 	}
 	return 0;
 }
@@ -1046,7 +1194,6 @@ int matocsserv_send_replicatechunk_xor(void *e,uint64_t chunkid,uint32_t version
 			put16bit(&data,srceptr->servport);
 		}
 		matocsserv_replication_begin(chunkid,version,eptr,cnt,src);
-		eptr->carry = 0;
 	}
 	return 0;
 }
@@ -1118,6 +1265,9 @@ int matocsserv_send_setchunkversion(void *e,uint64_t chunkid,uint32_t version,ui
 	uint8_t *data;
 
 	if (eptr->mode!=KILL) {
+		if (eptr->features&CSFEATURE_CHUNKOP_BATCH) {
+			return matocsserv_batch_add(eptr,chunkid,oldversion,version,0,0,0xFFFFFFFF);
+		}
 		data = matocsserv_createpacket(eptr,MATOCS_SET_VERSION,8+4+4);
 		if (data==NULL) {
 			return -1;
@@ -1154,6 +1304,9 @@ int matocsserv_send_duplicatechunk(void *e,uint64_t chunkid,uint32_t version,uin
 	uint8_t *data;
 
 	if (eptr->mode!=KILL) {
+		if (eptr->features&CSFEATURE_CHUNKOP_BATCH) {
+			return matocsserv_batch_add(eptr,oldchunkid,oldversion,oldversion,chunkid,version,0xFFFFFFFF);
+		}
 		data = matocsserv_createpacket(eptr,MATOCS_DUPLICATE,8+4+8+4);
 		if (data==NULL) {
 			return -1;
@@ -1190,6 +1343,9 @@ int matocsserv_send_truncatechunk(void *e,uint64_t chunkid,uint32_t length,uint3
 	uint8_t *data;
 
 	if (eptr->mode!=KILL) {
+		if (eptr->features&CSFEATURE_CHUNKOP_BATCH) {
+			return matocsserv_batch_add(eptr,chunkid,oldversion,version,0,0,length);
+		}
 		data = matocsserv_createpacket(eptr,MATOCS_TRUNCATE,8+4+4+4);
 		if (data==NULL) {
 			return -1;
@@ -1227,6 +1383,9 @@ int matocsserv_send_duptruncchunk(void *e,uint64_t chunkid,uint32_t version,uint
 	uint8_t *data;
 
 	if (eptr->mode!=KILL) {
+		if (eptr->features&CSFEATURE_CHUNKOP_BATCH) {
+			return matocsserv_batch_add(eptr,oldchunkid,oldversion,oldversion,chunkid,version,length);
+		}
 		data = matocsserv_createpacket(eptr,MATOCS_DUPTRUNC,8+4+8+4+4);
 		if (data==NULL) {
 			return -1;
@@ -1265,6 +1424,9 @@ int matocsserv_send_chunkop(void *e,uint64_t chunkid,uint32_t version,uint32_t n
 	uint8_t *data;
 
 	if (eptr->mode!=KILL) {
+		if (eptr->features&CSFEATURE_CHUNKOP_BATCH) {
+			return matocsserv_batch_add(eptr,chunkid,version,newversion,copychunkid,copyversion,leng);
+		}
 		data = matocsserv_createpacket(eptr,MATOCS_CHUNKOP,8+4+4+8+4+4);
 		if (data==NULL) {
 			return -1;
@@ -1309,6 +1471,69 @@ void matocsserv_got_chunkop_status(serventry *eptr,const uint8_t *data,uint32_t
 	}
 }
 
+void matocsserv_got_chunkop_batch_status(serventry *eptr,const uint8_t *data,uint32_t length) {
+	opbatch *ob,**obp;
+	const uint8_t *ptr;
+	uint64_t chunkid,copychunkid;
+	uint32_t batchid,i;
+	uint32_t version,newversion,copyversion,leng;
+	uint8_t status;
+	if (length<4) {
+		MFSLOG(LOG_NOTICE,"CSTOMA_CHUNKOP_BATCH - wrong size (%"PRIu32"/4+N)",length);
+		eptr->mode=KILL;
+		return;
+	}
+	batchid = get32bit(&data);
+	for (obp=&(eptr->batchsent) ; (ob=*obp) ; obp=&(ob->next)) {
+		if (ob->batchid==batchid) {
+			break;
+		}
+	}
+	if (ob==NULL) {
+		MFSLOG(LOG_NOTICE,"CSTOMA_CHUNKOP_BATCH - unknown batch: %"PRIu32,batchid);
+		eptr->mode=KILL;
+		return;
+	}
+	if (length!=4+ob->cnt) {
+		MFSLOG(LOG_NOTICE,"CSTOMA_CHUNKOP_BATCH - wrong size (%"PRIu32"/%"PRIu32")",length,4+ob->cnt);
+		eptr->mode=KILL;
+		return;
+	}
+	*obp = ob->next;
+	ptr = ob->ops;
+	for (i=0 ; i<ob->cnt ; i++) {
+		chunkid = get64bit(&ptr);
+		version = get32bit(&ptr);
+		newversion = get32bit(&ptr);
+		copychunkid = get64bit(&ptr);
+		copyversion = get32bit(&ptr);
+		leng = get32bit(&ptr);
+		status = get8bit(&data);
+		if (newversion==0) {
+			if (leng==0) {
+				chunk_got_delete_status(eptr,chunkid,status);
+			} else {
+				chunk_got_chunkop_status(eptr,chunkid,status);
+			}
+		} else {
+			if (newversion!=version) {
+				chunk_got_chunkop_status(eptr,chunkid,status);
+			}
+			if (copychunkid>0) {
+				chunk_got_chunkop_status(eptr,copychunkid,status);
+			}
+		}
+		if (status!=0) {
+			log_got_chunkop_batch_status %= LOG_COUNT;
+			if (log_got_chunkop_batch_status++ == 0) {
+				MFSLOG(LOG_NOTICE,"(%s:%"PRIu16") chunkop(%016"PRIX64",%08"PRIX32",%08"PRIX32",%016"PRIX64",%08"PRIX32",%"PRIu32") status: %"PRIu8,eptr->servstrip,eptr->servport,chunkid,version,newversion,copychunkid,copyversion,leng,status);
+			}
+		}
+	}
+	free(ob->ops);
+	free(ob);
+}
+
 static uint64_t chunk_hlist_get_cfg()
 {
     uint32_t cfg_size = cfg_getuint32("CHUNK_HLIST_SIZE", 1);
@@ -1328,11 +1553,12 @@ static uint64_t chunk_hlist_get_cfg()
 static int chunk_hlist_init(serventry *eptr, uint32_t used_chunk_num) {	
        uint32_t size = chunk_hlist_get_cfg();
 
-	while(size < used_chunk_num) {
+	/* open addressing - keep load factor below 3/4 */
+	while((uint64_t)size * 3 < (uint64_t)used_chunk_num * 4) {
 		size = size << 1;
 	}
 
-	eptr->chunkhlist.elem = calloc(size, sizeof(chunk_helem_t));
+	eptr->chunkhlist.elem = calloc(size, sizeof(void*));
 	if(eptr->chunkhlist.elem == NULL) {
 		MFSLOG(LOG_NOTICE, "alloc mem failed size:%llu\n", size);
 		return -ENOMEM;		
@@ -1347,13 +1573,82 @@ static int chunk_hlist_init(serventry *eptr, uint32_t used_chunk_num) {
 	return 0;		
 }
 
-extern int meta_ready;
-void matocsserv_register(serventry *eptr,const uint8_t *data,uint32_t length) {
+/* chunk lists are processed in background (REGISTER_BATCH chunks per loop), reading from
+   the connection is suspended until the whole list from the current packet is processed */
+static void matocsserv_register_chunks(serventry *eptr,const uint8_t *data,uint32_t chunkcount) {
+	if (chunkcount==0) {
+		return;
+	}
+	eptr->regbuff = eptr->inputpacket.packet;
+	eptr->inputpacket.packet = NULL;
+	eptr->regptr = data;
+	eptr->regleft = chunkcount;
+}
+
+static void matocsserv_register_continue(serventry *eptr,const uint8_t *data,uint32_t length) {
+	uint8_t rversion;
+
+	rversion = get8bit(&data);
+	if (eptr->registering!=1) {
+		MFSLOG(LOG_WARNING,"CSTOMA_REGISTER (ver %"PRIu8") - registration not started",rversion);
+		eptr->mode=KILL;
+		return;
+	}
+	if (rversion==6) {
+		if (((length-1)%12)!=0) {
+			MFSLOG(LOG_NOTICE,"CSTOMA_REGISTER (ver 6) - wrong size (%"PRIu32"/1+N*12)",length);
+			eptr->mode=KILL;
+			return;
+		}
+		matocsserv_register_chunks(eptr,data,(length-1)/12);
+	} else {
+		if (length!=1) {
+			MFSLOG(LOG_NOTICE,"CSTOMA_REGISTER (ver 7) - wrong size (%"PRIu32"/1)",length);
+			eptr->mode=KILL;
+			return;
+		}
+		eptr->registering = 0;
+		MFSLOG(LOG_NOTICE,"chunkserver register end - ip: %s, port: %"PRIu16", chunks: %"PRIu32,eptr->servstrip,eptr->servport,eptr->chunkhlist.num);
+	}
+}
+
+static void matocsserv_register_loop(void) {
+	serventry *eptr;
 	uint64_t chunkid;
 	uint32_t chunkversion;
+	uint32_t steps;
+
+	steps = 0;
+	for (eptr=matocsservhead ; eptr && steps<REGISTER_BATCH ; eptr=eptr->next) {
+		if (eptr->regleft==0 || eptr->mode==KILL) {
+			continue;
+		}
+		while (eptr->regleft>0 && steps<REGISTER_BATCH) {
+			chunkid = get64bit(&(eptr->regptr));
+			chunkversion = get32bit(&(eptr->regptr));
+			chunk_server_has_chunk(eptr,chunkid,chunkversion);
+			eptr->regleft--;
+			steps++;
+		}
+		eptr->lastread = get_current_time();
+		if (eptr->regleft==0) {
+			free(eptr->regbuff);
+			eptr->regbuff = NULL;
+			eptr->regptr = NULL;
+			main_epollinterest(eptr,matocsserv_interest(eptr));
+			if (eptr->registering==2) {
+				eptr->registering = 0;
+				MFSLOG(LOG_NOTICE,"chunkserver register end - ip: %s, port: %"PRIu16", chunks: %"PRIu32,eptr->servstrip,eptr->servport,eptr->chunkhlist.num);
+			}
+		}
+	}
+}
+
+extern int meta_ready;
+void matocsserv_register(serventry *eptr,const uint8_t *data,uint32_t length) {
 	serventry *eaptr;
-	uint32_t i,chunkcount = 0;
-	uint8_t rversion;
+	uint32_t chunkcount = 0;
+	uint8_t rversion = 0;
 	double us,ts;
 
 	if(meta_ready == 1) {
@@ -1362,21 +1657,10 @@ void matocsserv_register(serventry *eptr,const uint8_t *data,uint32_t length) {
 		return;
 	}
 
-    /**
-     * in order to make sure the serve cost time is not too long to let heart beat between master
-     * and chunk server lost, we record the cost total time, if exceed the heat beat time,
-     * let the follow register failed and retry 
-     *
-     * Dongyang Zhang, 2013-7-22
-     */ 
-    //syslog(LOG_NOTICE, "chunkcount:%u time:%u\n", chunkcount, get_current_time());
-    if(CHKREG_CHK_FAIL == chkreg_check()) {
-        //syslog(LOG_WARNING, "exceed total time chunknum:%u failed set the eptr to KILL to let the ip: %s port:%"PRIu16" "
-            //"retry", chunkcount, eptr->servstrip, eptr->servport);
-        eptr->mode=KILL;
-        
-        return;
-    }
+	if ((length&1) && (data[0]==6 || data[0]==7)) {
+		matocsserv_register_continue(eptr,data,length);
+		return;
+	}
 
 	if (eptr->servip>0 || eptr->servport>0) {
 		MFSLOG(LOG_WARNING,"got register message from registered chunk-server !!!");
@@ -1441,12 +1725,17 @@ void matocsserv_register(serventry *eptr,const uint8_t *data,uint32_t length) {
 			eptr->todeltotalspace = get64bit(&data);
 			eptr->todelchunkscount = get32bit(&data);
 			length-=49;
-		} else if (rversion==4) {
-			if (length<53 || ((length-53)%12)!=0) {
+		} else if (rversion==4 || rversion==5) {
+			if (rversion==4 && (length<53 || ((length-53)%12)!=0)) {
 				MFSLOG(LOG_NOTICE,"CSTOMA_REGISTER (ver 4) - wrong size (%"PRIu32"/53+N*12)",length);
 				eptr->mode=KILL;
 				return;
 			}
+			if (rversion==5 && length!=53 && length!=57) {
+				MFSLOG(LOG_NOTICE,"CSTOMA_REGISTER (ver 5) - wrong size (%"PRIu32"/53|57)",length);
+				eptr->mode=KILL;
+				return;
+			}
 			eptr->version = get32bit(&data);
 			eptr->servip = get32bit(&data);
 			eptr->servport = get16bit(&data);
@@ -1458,8 +1747,12 @@ void matocsserv_register(serventry *eptr,const uint8_t *data,uint32_t length) {
 			eptr->todeltotalspace = get64bit(&data);
 			eptr->todelchunkscount = get32bit(&data);
 			length-=53;
+			if (rversion==5 && length==4) {
+				eptr->features = get32bit(&data);
+				length-=4;
+			}
 		} else {
-			MFSLOG(LOG_NOTICE,"CSTOMA_REGISTER - wrong version (%"PRIu8"/1..4)",rversion);
+			MFSLOG(LOG_NOTICE,"CSTOMA_REGISTER - wrong version (%"PRIu8"/1..7)",rversion);
 			eptr->mode=KILL;
 			return;
 		}
@@ -1490,29 +1783,28 @@ void matocsserv_register(serventry *eptr,const uint8_t *data,uint32_t length) {
 		}
 	}
 
-	chunkcount = length/(8+4);
+	if (rversion==5) {
+		// chunks will be sent in following packets - size table using counters from header
+		chunkcount = eptr->chunkscount+eptr->todelchunkscount;
+	} else {
+		chunkcount = length/(8+4);
+	}
 
 	if(chunk_hlist_init(eptr, chunkcount) < 0) {
 		MFSLOG(LOG_NOTICE, "init chunk hlist failed\n");
 		eptr->mode = KILL;
 		return;
 	}
-	
-//	eptr->creation = NULL;
-//	eptr->setversion = NULL;
-//	eptr->duplication = NULL;
-
-       eptr->registered = 1;
 
-    //sleep(1);
+	eptr->registered = 1;
+	matocsserv_weight_update(eptr);
 
-	for (i=0 ; i<chunkcount ; i++) {
-		chunkid = get64bit(&data);
-		chunkversion = get32bit(&data);
-		chunk_server_has_chunk(eptr,chunkid,chunkversion);
+	if (rversion==5) {
+		eptr->registering = 1;
+	} else if (length>0) {
+		eptr->registering = 2;
+		matocsserv_register_chunks(eptr,data,length/(8+4));
 	}
-
-    //syslog(LOG_NOTICE, "after chunk deal chunkcount:%u time:%u\n", chunkcount, get_current_time());
 }
 
 void matocsserv_space(serventry *eptr,const uint8_t *data,uint32_t length) {
@@ -1536,6 +1828,7 @@ void matocsserv_space(serventry *eptr,const uint8_t *data,uint32_t length) {
 			eptr->todelchunkscount = get32bit(&data);
 		}
 	}
+	matocsserv_weight_update(eptr);
 }
 
 void matocsserv_chunk_damaged(serventry *eptr,const uint8_t *data,uint32_t length) {
@@ -1647,6 +1940,12 @@ void matocsserv_gotpacket(serventry *eptr,uint32_t type,const uint8_t *data,uint
 		case CSTOMA_DUPTRUNC:
 			matocsserv_got_duptruncchunk_status(eptr,data,length);
 			break;
+		case CSTOMA_CHUNKOP:
+			matocsserv_got_chunkop_status(eptr,data,length);
+			break;
+		case CSTOMA_CHUNKOP_BATCH:
+			matocsserv_got_chunkop_batch_status(eptr,data,length);
+			break;
 		default:
 			MFSLOG(LOG_NOTICE,"matocs: got unknown message (type:%"PRIu32")",type);
 			eptr->mode=KILL;
@@ -1655,7 +1954,6 @@ void matocsserv_gotpacket(serventry *eptr,uint32_t type,const uint8_t *data,uint
 
 void matocsserv_term(void) {
 	serventry *eptr,*eaptr;
-	packetstruct *pptr,*paptr;
 	MFSLOG(LOG_INFO,"matocs: closing %s:%s",ListenHost,ListenPort);
 	tcpclose(lsock);
 
@@ -1664,15 +1962,12 @@ void matocsserv_term(void) {
 		if (eptr->inputpacket.packet) {
 			free(eptr->inputpacket.packet);
 		}
-		pptr = eptr->outputhead;
-		while (pptr) {
-			if (pptr->packet) {
-				free(pptr->packet);
-			}
-			paptr = pptr;
-			pptr = pptr->next;
-			free(paptr);
+		if (eptr->regbuff) {
+			free(eptr->regbuff);
 		}
+		matocsserv_batch_free(eptr);
+		pktbuf_freechain(eptr->outputhead);
+		main_timercancel(eptr->timer);
 		eaptr = eptr;
 		eptr = eptr->next;
 		free(eaptr);
@@ -1744,40 +2039,84 @@ void matocsserv_read(serventry *eptr) {
 				free(eptr->inputpacket.packet);
 			}
 			eptr->inputpacket.packet=NULL;
+			if (eptr->regleft>0) {
+				return;
+			}
 		}
 	}
 }
 
+void matocsserv_disconnection_finished(void *e) {
+	serventry *eptr = (serventry *)e;
+
+	pktbuf_freechain(eptr->outputhead);
+	chunk_hlist_free(eptr);
+	if (eptr->servstrip) {
+		free(eptr->servstrip);
+	}
+	free(eptr);
+}
+
 void matocsserv_write(serventry *eptr) {
-	packetstruct *pack;
-	int32_t i;
-	for (;;) {
-		pack = eptr->outputhead;
-		if (pack==NULL) {
-			return;
-		}
-		i=write(eptr->sock,pack->startptr,pack->bytesleft);
-		if (i<0) {
-			if (errno!=EAGAIN) {
-				MFSLOG(LOG_INFO,"write to CS(%s) error: %m",eptr->servstrip);
-				eptr->mode = KILL;
-			}
-			return;
-		}
-		pack->startptr+=i;
-		pack->bytesleft-=i;
-		if (pack->bytesleft>0) {
-			return;
-		}
-		free(pack->packet);
-		eptr->outputhead = pack->next;
-		if (eptr->outputhead==NULL) {
-			eptr->outputtail = &(eptr->outputhead);
+	if (pktbuf_writev(eptr->sock,&(eptr->outputhead),&(eptr->outputtail),NULL)<0) {
+		MFSLOG(LOG_INFO,"write to CS(%s) error: %m",eptr->servstrip);
+		eptr->mode = KILL;
+	}
+}
+
+static void matocsserv_flush(void) {
+	serventry *eptr;
+	while ((eptr=matocsservflushhead)!=NULL) {
+		matocsservflushhead = eptr->flushnext;
+		if (eptr->mode!=KILL && eptr->batchcnt>0) {
+			matocsserv_batch_flush(eptr);
+		}
+		if (eptr->mode!=KILL && eptr->outputhead!=NULL) {
+			matocsserv_write(eptr);
+			eptr->lastwrite = main_time();
+		}
+		eptr->flushpending = 0;
+		if (eptr->mode==KILL) {
+			killpending = 1;
+		} else {
+			main_epollinterest(eptr,matocsserv_interest(eptr));
 		}
-		free(pack);
 	}
 }
 
+/* connection timeout and nops - every connection has one timer which is rearmed lazily (lastread and lastwrite
+   are only stored on traffic, the timer checks them when the earliest of both deadlines comes) */
+static uint32_t matocsserv_timerdelay(serventry *eptr,uint32_t now) {
+	uint32_t due;
+	due = eptr->lastread+eptr->timeout+1;
+	if (eptr->lastwrite+6<due) {
+		due = eptr->lastwrite+6;
+	}
+	if (due<=now) {
+		due = now+1;
+	}
+	return (due-now)*1000;
+}
+
+static void matocsserv_timeout(void *arg) {
+	serventry *eptr = (serventry*)arg;
+	uint32_t now = main_time();
+	if (eptr->mode==KILL) {		// killed outside of serve/flush - timer is cancelled in matocsserv_desc
+		killpending = 1;
+		return;
+	}
+	if ((uint32_t)(eptr->lastread+eptr->timeout)<now) {
+		eptr->mode = KILL;
+		killpending = 1;
+		return;
+	}
+	if (eptr->outputhead==NULL && eptr->batchcnt==0 && (uint32_t)(eptr->lastwrite+5)<now) {
+		matocsserv_createpacket(eptr,ANTOAN_NOP,0);
+		eptr->lastwrite = now;
+	}
+	main_timerset(eptr->timer,matocsserv_timerdelay(eptr,now));
+}
+
 void matocsserv_desc(int epoll_fd) {
     /**
       * should not call the gettimeof time anywhere as the this syscall may 
@@ -1786,8 +2125,7 @@ void matocsserv_desc(int epoll_fd) {
       * Dongyang Zhang
       */    
     uint32_t now=get_current_time();
-    serventry *eptr,**kptr,**wptr;
-    packetstruct *pptr,*paptr;
+    serventry *eptr,**kptr,**wptr,**fptr;
     struct epoll_event ev;
     int ret;
 
@@ -1795,6 +2133,19 @@ void matocsserv_desc(int epoll_fd) {
         eptr = malloc(sizeof(serventry));
 
         eptr->registered = 0;
+        eptr->regbuff = NULL;
+        eptr->regptr = NULL;
+        eptr->regleft = 0;
+        eptr->registering = 0;
+        eptr->disconnected = 0;
+        eptr->wslot = WSLOT_NONE;
+        eptr->rebalsrc = 0;
+        eptr->rebaldst = 0;
+        eptr->features = 0;
+        eptr->batchbuff = NULL;
+        eptr->batchcnt = 0;
+        eptr->batchid = 0;
+        eptr->batchsent = NULL;
         eptr->next = matocsservhead;
         matocsservhead = eptr;
         eptr->sock = lsock;
@@ -1812,6 +2163,9 @@ void matocsserv_desc(int epoll_fd) {
 
         eptr->listen_sock = 1;
         eptr->connection = 1;
+        eptr->flushpending = 0;
+        eptr->flushnext = NULL;
+        eptr->timer = NULL;
 
 
         ev.data.ptr = eptr;
@@ -1820,73 +2174,50 @@ void matocsserv_desc(int epoll_fd) {
         if(ret!=0) {
             MFSLOG(LOG_NOTICE,"epoll_ctl error");
         }
+        eptr->epollevents = EPOLLIN;
 
         first_add_listen_sock = 1;
         //		syslog(LOG_NOTICE,"chunkserver:first add listen socket,last read is %d,last write is %d",eptr->lastread,eptr->lastwrite);
     }
 
+    matocsserv_flush();
+    if (killpending==0) {
+        return;
+    }
+    killpending = 0;
     kptr = &matocsservhead;
     wptr = &matocsservhead;
     while((eptr=*kptr)) {
-        if (eptr->listen_sock == 1) {
-            eptr->lastread = eptr->lastwrite = now;
-        }          
-        if ((uint32_t)(eptr->lastread+eptr->timeout)<(uint32_t)now) {
-            eptr->mode = KILL;
-        }			
-        if (eptr->mode != KILL && eptr->outputhead==NULL && (uint32_t)(eptr->lastwrite+5)< (uint32_t)now) {
-            matocsserv_createpacket(eptr,ANTOAN_NOP,0);
-        }  			
-        if (eptr->listen_sock == 0 && eptr->mode != KILL) {
-            ev.data.ptr = eptr;
-            ev.events = EPOLLIN;
-            if (eptr->outputhead!=NULL && eptr->mode != KILL) {
-                ev.events = EPOLLIN|EPOLLOUT;
-            }
-            ret = epoll_ctl(epoll_fd,EPOLL_CTL_MOD,eptr->sock,&ev);
-            if(ret!=0) {
-                MFSLOG(LOG_NOTICE,"epoll_ctl error epoll_fd:%d errno:%d\n", epoll_fd, errno);
-            }
-        }
         if (eptr->mode == KILL) {
             ev.data.ptr = eptr;
 
             MFSLOG(LOG_NOTICE,"chunkserver disconnected - ip: %s, port: %"PRIu16" ",eptr->servstrip,eptr->servport);
 
             matocsserv_replication_disconnected(eptr);
-
-            /**
-             * if no register, we should not check the hash table which may be 
-             * very big
-             * Dongyang Zhang, 2013-7-22
-             */
-            if(!eptr->registered) {
-               MFSLOG(LOG_WARNING, "not register bypass it ip: %s port:%"PRIu16"\n", eptr->servstrip,
-                      eptr->servport);
-            } else {
-                chunk_server_disconnected(eptr);
-                now = get_current_time();
-            }
-
-            //syslog(LOG_NOTICE,"after chunkserver disconnected - ip: %s, port: %"PRIu16" time:%d",eptr->servstrip,eptr->servport, get_current_time());
+            matocsserv_weight_update(eptr);
+            main_timercancel(eptr->timer);
+            eptr->timer = NULL;
 
             epoll_ctl(epoll_fd,EPOLL_CTL_DEL,eptr->sock,&ev);
             tcpclose(eptr->sock);
+            if (eptr->flushpending) {	/* got data before it was killed */
+                for (fptr=&matocsservflushhead ; *fptr!=eptr ; fptr=&((*fptr)->flushnext)) {}
+                *fptr = eptr->flushnext;
+                eptr->flushpending = 0;
+            }
             if (eptr->inputpacket.packet) {
                 free(eptr->inputpacket.packet);
+                eptr->inputpacket.packet = NULL;
             }
-            pptr = eptr->outputhead;
-            while (pptr) {
-                if (pptr->packet) {
-                    free(pptr->packet);
-                }
-                paptr = pptr;
-                pptr = pptr->next;
-                free(paptr);
-            }
-            if (eptr->servstrip) {
-                free(eptr->servstrip);
+            if (eptr->regbuff) {
+                free(eptr->regbuff);
+                eptr->regbuff = NULL;
+                eptr->regleft = 0;
             }
+            matocsserv_batch_free(eptr);
+            pktbuf_freechain(eptr->outputhead);
+            eptr->outputhead = NULL;
+            eptr->outputtail = &(eptr->outputhead);
             if(eptr == matocsservhead) {
                 matocsservhead = eptr->next;
                 wptr = &matocsservhead;
@@ -1895,22 +2226,27 @@ void matocsserv_desc(int epoll_fd) {
                 (*wptr)->next = eptr->next;
             }
             *kptr = eptr->next;
-             /* not register and alloc mem for chunk_hlist */   
-             if(eptr->registered) {
-                chunk_hlist_free(eptr);
-             }   
-            free(eptr);
+            /**
+             * if no register, we should not check the hash table which may be
+             * very big
+             * Dongyang Zhang, 2013-7-22
+             */
+            if(!eptr->registered) {
+                MFSLOG(LOG_WARNING, "not register bypass it ip: %s port:%"PRIu16"\n", eptr->servstrip,
+                       eptr->servport);
+                if (eptr->servstrip) {
+                    free(eptr->servstrip);
+                }
+                free(eptr);
+            } else {
+                /* copies are removed in background - eptr is freed in matocsserv_disconnection_finished */
+                chunk_server_disconnected(eptr);
+            }
         } else {
             wptr = &eptr;
             kptr = &(eptr->next);
         }
     }
-
-    /*
-     * init the chunk registe time for serve
-     */
-    //syslog(LOG_WARNING, "init the serve limit time\n");
-    chkreg_time_init();    
 }
 
 void matocsserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
@@ -1961,8 +2297,14 @@ void matocsserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
                 eptr->errorcounter=0;
                 eptr->rrepcounter=0;
                 eptr->wrepcounter=0;
-
-                eptr->carry=(double)(rndu32())/(double)(0xFFFFFFFFU);
+                eptr->wslot=WSLOT_NONE;
+                eptr->rebalsrc=0;
+                eptr->rebaldst=0;
+                eptr->features=0;
+                eptr->batchbuff=NULL;
+                eptr->batchcnt=0;
+                eptr->batchid=0;
+                eptr->batchsent=NULL;
 
                 eptr->listen_sock = 0;
                 eptr->connection = 1;
@@ -1970,7 +2312,16 @@ void matocsserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
                 ev.data.ptr = eptr;
                 ev.events = EPOLLIN;
                 epoll_ctl(epoll_fd,EPOLL_CTL_ADD,ns,&ev);
+                eptr->epollevents = EPOLLIN;
+                eptr->flushpending = 0;
+                eptr->flushnext = NULL;
                 eptr->registered = 0;
+                eptr->regbuff = NULL;
+                eptr->regptr = NULL;
+                eptr->regleft = 0;
+                eptr->registering = 0;
+                eptr->disconnected = 0;
+                eptr->timer = main_timeradd(matocsserv_timerdelay(eptr,eptr->lastread),0,matocsserv_timeout,eptr);
             }
         } while(ns >= 0);
 	}
@@ -1978,7 +2329,7 @@ void matocsserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
 		if (pdesc[count].events & (EPOLLERR|EPOLLHUP)) {
 			weptr->mode = KILL;
 		}
-		if ((pdesc[count].events & EPOLLIN) && weptr->mode!=KILL) {
+		if ((pdesc[count].events & EPOLLIN) && weptr->mode!=KILL && weptr->regleft==0) {
 			matocsserv_read(weptr);
 			weptr->lastread = get_current_time();
 		}
@@ -1986,6 +2337,11 @@ void matocsserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
 			matocsserv_write(weptr);
 			weptr->lastwrite = get_current_time();
 		}
+		if (weptr->mode==KILL) {
+			killpending = 1;
+		} else {
+			main_epollinterest(weptr,matocsserv_interest(weptr));
+		}
 	}	
 }
 
@@ -1996,8 +2352,6 @@ int matocsserv_init() {
     LowFreeSpace = cfg_getuint64("MATOCS_LOW_FREE_SPACE", 100);
     LowFreeSpace = LowFreeSpace<<30;
     HighSpaceUsage = cfg_getdouble("MATOCS_HIGH_SPACE_USAGE", 0.9);
-    
-    chkreg_limit_init(cfg_getuint32("CHUNK_REGISTER_LIMIT_TIME",10));
 
 	first_add_listen_sock = 0;
 	lsock = tcpsocket();
@@ -2024,6 +2378,7 @@ int matocsserv_init() {
 	matocsservhead = NULL;
 	main_destructregister(matocsserv_term);
 	main_epollregister(matocsserv_desc,matocsserv_serve);
+	main_eachloopregister(matocsserv_register_loop);
 	main_timeregister(TIMEMODE_SKIP,60,0,matocsserv_status);
 	main_timeregister(TIMEMODE_RUNONCE,60,0,log_print_control);
 	return 0;
@@ -2041,12 +2396,30 @@ void* matocsserv_unittest_add_chunkserver(uint32_t servip, uint64_t usedspace, u
     eptr->totalspace = totalspace;
     eptr->servip = servip;
     eptr->servstrip = matocsserv_makestrip(servip);
-    eptr->carry=(double)(rndu32())/(double)(0xFFFFFFFFU);
+    eptr->wslot=WSLOT_NONE;
     eptr->rrepcounter = 0;
     eptr->wrepcounter = 0;
+    eptr->registering = 0;
+    eptr->disconnected = 0;
+    eptr->rebalsrc = 0;
+    eptr->rebaldst = 0;
+    eptr->features = 0;
+    eptr->batchbuff = NULL;
+    eptr->batchcnt = 0;
+    eptr->batchid = 0;
+    eptr->batchsent = NULL;
+    eptr->epollevents = 0;
+    eptr->flushpending = 0;
+    eptr->flushnext = NULL;
+    eptr->timer = NULL;
+    eptr->outputhead = NULL;
+    eptr->outputtail = &(eptr->outputhead);
+    eptr->chunkscount = 0;
+    chunk_hlist_init(eptr, 0);
     if(eptr->totalspace > maxtotalspace) {
         maxtotalspace = eptr->totalspace;
     }
+    matocsserv_weight_update(eptr);
 
     return (void *)matocsservhead;
 
@@ -2074,9 +2447,17 @@ void matocsserv_unittest_clean() {
         eptr = matocsservhead;
         //printf("chunkserver %s, used:%lu, total:%lu, carry:%lf.\n", eptr->servstrip, eptr->usedspace>>30, eptr->totalspace>>30, eptr->carry);
         free(eptr->servstrip);
+        free(eptr->chunkhlist.elem);
         matocsservhead = eptr->next;
         free(eptr);
     }
+    memset(wtree,0,sizeof(wtree));
+    memset(wvalue,0,sizeof(wvalue));
+    memset(wserv,0,sizeof(wserv));
+    wfreecnt = wslotsused = wservers = 0;
+    wtotal = 0;
+    wracksdirty = 0;
+    wmultirack = 0;
     matocsserv_status();
 }
 #endif
@@ -31,8 +31,8 @@ char* matocsserv_getstrip(void *e);
 int matocsserv_getlocation(void *e,uint32_t *servip,uint16_t *servport);
 uint16_t matocsserv_replication_read_counter(void *e);
 uint16_t matocsserv_replication_write_counter(void *e);
-uint32_t matocsserv_cservlist_size(void);
-void matocsserv_cservlist_data(uint8_t *ptr);
+uint32_t matocsserv_cservlist_size(uint8_t withmem);
+void matocsserv_cservlist_data(uint8_t *ptr,uint8_t withmem);
 int matocsserv_send_replicatechunk(void *e,uint64_t chunkid,uint32_t version,void *src);
 int matocsserv_send_replicatechunk_xor(void *e,uint64_t chunkid,uint32_t version,uint8_t cnt,void **src,uint64_t *srcchunkid,uint32_t *srcversion);
 //int matocsserv_send_replicatechunk(void *e,uint64_t chunkid,uint32_t version,uint32_t ip,uint16_t port);
@@ -47,6 +47,7 @@ int matocsserv_send_truncatechunk(void *e,uint64_t chunkid,uint32_t length,uint3
 int matocsserv_send_duptruncchunk(void *e,uint64_t chunkid,uint32_t version,uint64_t oldchunkid,uint32_t oldversion,uint32_t length);
 //void matocsserv_broadcast_logstring(uint64_t version,uint8_t *logstr,uint32_t logstrsize);
 //void matocsserv_broadcast_logrotate();
+void matocsserv_disconnection_finished(void *e);
 int matocsserv_init();
 
 #ifdef UNITTEST
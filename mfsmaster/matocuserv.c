@@ -45,6 +45,8 @@
 #include "charts.h"
 #include "cfg.h"
 #include "main.h"
+#include "netio.h"
+#include "pktbuf.h"
 #include "sockets.h"
 #include "state.h"
 
@@ -62,6 +64,16 @@ static int lsock;
 static int32_t lsockpdescpos;
 static int exiting;
 static int first_add_listen_sock;
+static serventry *matocuservflushhead=NULL;	// connections with new data in empty output queue
+static uint8_t killpending;	// some connection is killed - list is walked in next desc
+static uint32_t IOThreads;	// 0 - sockets are served by main thread
+static serventry iowake;	// eventfd of network i/o threads (in main epoll)
+static uint8_t iowakeadded;
+
+/* handling time of client packets - histogram per packet type ("cuop:type") */
+#define OPHIST_TYPES 1024
+static lathist *ophist[OPHIST_TYPES+1];		// last one - all types above
+static uint64_t opcount=0,opusecsum=0,opusecmax=0;	// for charts (max since last matocuserv_opstats)
 extern int meta_ready;
 
 // from config
@@ -70,6 +82,8 @@ static char *ListenPort;
 static uint32_t RejectOld;
 //static uint32_t Timeout;
 
+static void matocu_session_timerarm(session *asesdata);
+
 /* new registration procedure */
 session* matocuserv_new_session(uint8_t newsession,uint8_t nonewid) {
 	session *asesdata;
@@ -91,6 +105,7 @@ session* matocuserv_new_session(uint8_t newsession,uint8_t nonewid) {
 	asesdata->openedfiles = NULL;
 	asesdata->disconnected = 0;
 	asesdata->nsocks = 1;
+	asesdata->timer = NULL;
 	memset(asesdata->currentopstats,0,4*16);
 	memset(asesdata->lasthouropstats,0,4*16);
 	asesdata->next = sessionshead;
@@ -244,6 +259,7 @@ int matocuserv_load_sessions() {
 			asesdata->openedfiles = NULL;
 			asesdata->disconnected = get_current_time();
 			asesdata->nsocks = 0;
+			asesdata->timer = NULL;
 			for (i=0 ; i<16 ; i++) {
 				asesdata->currentopstats[i] = get32bit(&ptr);
 			}
@@ -263,6 +279,7 @@ int matocuserv_load_sessions() {
 			}
 			asesdata->next = sessionshead;
 			sessionshead = asesdata;
+			matocu_session_timerarm(asesdata);
 		}
 		if (ferror(fd)) {
 			MFSLOG(LOG_WARNING,"can't load sessions, fread error");
@@ -352,10 +369,12 @@ void matocuserv_init_sessions(uint32_t sessionid,uint32_t inode) {
 		asesdata->openedfiles = NULL;
 		asesdata->disconnected = get_current_time();
 		asesdata->nsocks = 0;
+		asesdata->timer = NULL;
 		memset(asesdata->currentopstats,0,4*16);
 		memset(asesdata->lasthouropstats,0,4*16);
 		asesdata->next = sessionshead;
 		sessionshead = asesdata;
+		matocu_session_timerarm(asesdata);
 	}
 
 	ofpptr = &(asesdata->openedfiles);
@@ -375,28 +394,19 @@ void matocuserv_init_sessions(uint32_t sessionid,uint32_t inode) {
 }
 
 uint8_t* matocuserv_createpacket(serventry *eptr,uint32_t type,uint32_t size) {
-	packetstruct *outpacket;
 	uint8_t *ptr;
-	uint32_t psize;
+	uint8_t wasempty;
 
-	outpacket=(packetstruct*)malloc(sizeof(packetstruct));
-	if (outpacket==NULL) {
+	wasempty = (eptr->outputhead==NULL)?1:0;
+	ptr = pktbuf_append(&(eptr->outputhead),&(eptr->outputtail),type,size);
+	if (ptr==NULL) {
 		return NULL;
 	}
-	psize = size+8;
-	outpacket->packet=malloc(psize);
-	outpacket->bytesleft = psize;
-	if (outpacket->packet==NULL) {
-		free(outpacket);
-		return NULL;
+	if (wasempty && eptr->flushpending==0 && eptr->mode!=KILL) {
+		eptr->flushpending = 1;
+		eptr->flushnext = matocuservflushhead;
+		matocuservflushhead = eptr;
 	}
-	ptr = outpacket->packet;
-	put32bit(&ptr,type);
-	put32bit(&ptr,size);
-	outpacket->startptr = (uint8_t*)(outpacket->packet);
-	outpacket->next = NULL;
-	*(eptr->outputtail) = outpacket;
-	eptr->outputtail = &(outpacket->next);
 	return ptr;
 }
 
@@ -537,19 +547,20 @@ void matocuserv_chunk_status(uint64_t chunkid,uint8_t status) {
 
 void matocuserv_cserv_list(serventry *eptr,const uint8_t *data,uint32_t length) {
 	uint8_t *ptr;
-	(void)data;
-	if (length!=0) {
-		MFSLOG(LOG_NOTICE,"CUTOMA_CSERV_LIST - wrong size (%"PRIu32"/0)",length);
+	uint8_t withmem;
+	if (length!=0 && length!=1) {
+		MFSLOG(LOG_NOTICE,"CUTOMA_CSERV_LIST - wrong size (%"PRIu32"/0|1)",length);
 		eptr->mode = KILL;
 		return;
 	}
-	ptr = matocuserv_createpacket(eptr,MATOCU_CSERV_LIST,matocsserv_cservlist_size());
+	withmem = (length==1)?get8bit(&data):0;
+	ptr = matocuserv_createpacket(eptr,MATOCU_CSERV_LIST,matocsserv_cservlist_size(withmem));
 	if (ptr==NULL) {
 		MFSLOG(LOG_NOTICE,"can't allocate memory for packet");
 		eptr->mode = KILL;
 		return;
 	}
-	matocsserv_cservlist_data(ptr);
+	matocsserv_cservlist_data(ptr,withmem);
 }
 
 void matocuserv_session_list(serventry *eptr,const uint8_t *data,uint32_t length) {
@@ -675,6 +686,9 @@ void matocuserv_info(serventry *eptr,const uint8_t *data,uint32_t length) {
 	uint64_t totalspace,availspace,trspace,respace;
 	uint32_t trnodes,renodes,inodes,dnodes,fnodes;
 	uint32_t chunks,chunkcopies,tdcopies;
+	uint8_t storestatus,storeresult;
+	uint32_t storestart,storemsec;
+	uint64_t storebytes,storestored,storerecords;
 	uint8_t *ptr;
 	(void)data;
 	if (length!=0) {
@@ -684,7 +698,8 @@ void matocuserv_info(serventry *eptr,const uint8_t *data,uint32_t length) {
 	}
 	fs_info(&totalspace,&availspace,&trspace,&trnodes,&respace,&renodes,&inodes,&dnodes,&fnodes);
 	chunk_info(&chunks,&chunkcopies,&tdcopies);
-	ptr = matocuserv_createpacket(eptr,MATOCU_INFO,68);
+	fs_storeinfo(&storestatus,&storeresult,&storestart,&storemsec,&storebytes,&storestored,&storerecords);
+	ptr = matocuserv_createpacket(eptr,MATOCU_INFO,102);
 	if (ptr==NULL) {
 		MFSLOG(LOG_NOTICE,"can't allocate memory for packet");
 		eptr->mode = KILL;
@@ -707,6 +722,14 @@ void matocuserv_info(serventry *eptr,const uint8_t *data,uint32_t length) {
 	put32bit(&ptr,chunks);
 	put32bit(&ptr,chunkcopies);
 	put32bit(&ptr,tdcopies);
+	/* metadata store (running or the last one) */
+	put8bit(&ptr,storestatus);
+	put8bit(&ptr,storeresult);
+	put32bit(&ptr,storestart);
+	put32bit(&ptr,storemsec);
+	put64bit(&ptr,storebytes);
+	put64bit(&ptr,storestored);
+	put64bit(&ptr,storerecords);
 }
 
 void matocuserv_fstest_info(serventry *eptr,const uint8_t *data,uint32_t length) {
@@ -748,7 +771,7 @@ void matocuserv_chunkstest_info(serventry *eptr,const uint8_t *data,uint32_t len
 		eptr->mode = KILL;
 		return;
 	}
-	ptr = matocuserv_createpacket(eptr,MATOCU_CHUNKSTEST_INFO,52);
+	ptr = matocuserv_createpacket(eptr,MATOCU_CHUNKSTEST_INFO,68);
 	if (ptr==NULL) {
 		MFSLOG(LOG_NOTICE,"can't allocate memory for packet");
 		eptr->mode = KILL;
@@ -831,6 +854,23 @@ void matocuserv_mlog_list(serventry *eptr,const uint8_t *data,uint32_t length) {
 	matomlserv_mloglist_data(ptr);
 }
 
+void matocuserv_latency_info(serventry *eptr,const uint8_t *data,uint32_t length) {
+	uint8_t *ptr;
+	(void)data;
+	if (length!=0) {
+		MFSLOG(LOG_NOTICE,"CUTOMA_LATENCY_INFO - wrong size (%"PRIu32"/0)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	ptr = matocuserv_createpacket(eptr,MATOCU_LATENCY_INFO,main_lathistsize());
+	if (ptr==NULL) {
+		MFSLOG(LOG_NOTICE,"can't allocate memory for packet");
+		eptr->mode = KILL;
+		return;
+	}
+	main_lathiststore(ptr);
+}
+
 void matocuserv_fuse_register(serventry *eptr,const uint8_t *data,uint32_t length) {
 	const uint8_t *rptr;
 	uint8_t *wptr;
@@ -1042,7 +1082,7 @@ void matocuserv_fuse_register(serventry *eptr,const uint8_t *data,uint32_t lengt
 				}
 				matocuserv_store_sessions();
 			}
-			wptr = matocuserv_createpacket(eptr,MATOCU_FUSE_REGISTER,(status==STATUS_OK)?((eptr->version>=0x010601)?21:13):1);
+			wptr = matocuserv_createpacket(eptr,MATOCU_FUSE_REGISTER,(status==STATUS_OK)?((eptr->version>=0x010611)?25:(eptr->version>=0x010601)?21:13):1);
 			if (wptr==NULL) {
 				MFSLOG(LOG_NOTICE,"can't allocate memory for packet");
 				eptr->mode = KILL;
@@ -1061,6 +1101,11 @@ void matocuserv_fuse_register(serventry *eptr,const uint8_t *data,uint32_t lengt
 				put32bit(&wptr,mapalluid);
 				put32bit(&wptr,mapallgid);
 			}
+			if (eptr->version>=0x010611) {	// mount uses features of this master (paged readdir) only when it knows its version
+				put16bit(&wptr,VERSMAJ);
+				put8bit(&wptr,VERSMID);
+				put8bit(&wptr,VERSMIN);
+			}
 			eptr->registered = 1;
 			return;
 		case 5:
@@ -1941,6 +1986,47 @@ void matocuserv_fuse_getdir(serventry *eptr,const uint8_t *data,uint32_t length)
 	}
 }
 
+void matocuserv_fuse_readdir(serventry *eptr,const uint8_t *data,uint32_t length) {
+	uint32_t inode,uid,gid,auid,agid;
+	uint8_t flags;
+	uint64_t cookie;
+	uint32_t maxsize;
+	uint32_t msgid;
+	uint8_t *ptr;
+	uint8_t status;
+	uint32_t dleng;
+	void *custom;
+	if (length!=29) {
+		MFSLOG(LOG_NOTICE,"CUTOMA_FUSE_READDIR - wrong size (%"PRIu32"/29)",length);
+		eptr->mode = KILL;
+		return;
+	}
+	msgid = get32bit(&data);
+	inode = get32bit(&data);
+	auid = uid = get32bit(&data);
+	agid = gid = get32bit(&data);
+	matocuserv_ugid_remap(eptr,&uid,&gid);
+	flags = get8bit(&data);
+	cookie = get64bit(&data);
+	maxsize = get32bit(&data);
+	status = fs_readdir_page_size(eptr->sesdata->rootinode,eptr->sesdata->sesflags,inode,uid,gid,flags,cookie,maxsize,&custom,&dleng);
+	ptr = matocuserv_createpacket(eptr,MATOCU_FUSE_READDIR,(status!=STATUS_OK)?5:4+dleng);
+	if (ptr==NULL) {
+		MFSLOG(LOG_NOTICE,"can't allocate memory for packet");
+		eptr->mode = KILL;
+		return;
+	}
+	put32bit(&ptr,msgid);
+	if (status!=STATUS_OK) {
+		put8bit(&ptr,status);
+	} else {
+		fs_readdir_page_data(eptr->sesdata->rootinode,eptr->sesdata->sesflags,uid,gid,auid,agid,cookie,custom,ptr);
+	}
+	if (eptr->sesdata && cookie==0) {
+		eptr->sesdata->currentopstats[12]++;
+	}
+}
+
 void matocuserv_fuse_open(serventry *eptr,const uint8_t *data,uint32_t length) {
 	uint32_t inode,uid,gid,auid,agid;
 	uint8_t flags;
@@ -2075,7 +2161,7 @@ void matocuserv_fuse_write_chunk(serventry *eptr,const uint8_t *data,uint32_t le
 	if (eptr->sesdata->sesflags&SESFLAG_READONLY) {
 		status = ERROR_EROFS;
 	} else {
-		status = fs_writechunk(inode,indx,&chunkid,&fleng,&opflag);
+		status = fs_writechunk(inode,indx,eptr->sesdata->sessionid,&chunkid,&fleng,&opflag);
 	}
 	if (status!=STATUS_OK) {
 		ptr = matocuserv_createpacket(eptr,MATOCU_FUSE_WRITE_CHUNK,5);
@@ -2314,7 +2400,7 @@ void matocuserv_fuse_settrashtime(serventry *eptr,const uint8_t *data,uint32_t l
 void matocuserv_fuse_getgoal(serventry *eptr,const uint8_t *data,uint32_t length) {
 	uint32_t inode;
 	uint32_t msgid;
-	uint32_t fgtab[10],dgtab[10];
+	uint32_t fgtab[GOAL_MAX+1],dgtab[GOAL_MAX+1];
 	uint8_t i,fn,dn,gmode;
 	uint8_t *ptr;
 	uint8_t status;
@@ -2330,7 +2416,7 @@ void matocuserv_fuse_getgoal(serventry *eptr,const uint8_t *data,uint32_t length
 	fn=0;
 	dn=0;
 	if (status==STATUS_OK) {
-		for (i=1 ; i<10 ; i++) {
+		for (i=1 ; i<=GOAL_MAX ; i++) {
 			if (fgtab[i]) {
 				fn++;
 			}
@@ -2351,13 +2437,13 @@ void matocuserv_fuse_getgoal(serventry *eptr,const uint8_t *data,uint32_t length
 	} else {
 		put8bit(&ptr,fn);
 		put8bit(&ptr,dn);
-		for (i=1 ; i<10 ; i++) {
+		for (i=1 ; i<=GOAL_MAX ; i++) {
 			if (fgtab[i]) {
 				put8bit(&ptr,i);
 				put32bit(&ptr,fgtab[i]);
 			}
 		}
-		for (i=1 ; i<10 ; i++) {
+		for (i=1 ; i<=GOAL_MAX ; i++) {
 			if (dgtab[i]) {
 				put8bit(&ptr,i);
 				put32bit(&ptr,dgtab[i]);
@@ -2941,20 +3027,39 @@ void matocu_session_timedout(session *sesdata) {
 	}
 }
 
-void matocu_session_check(void) {
-	session **sesdata,*asesdata;
+/* disconnected sessions expire by their own timers - armed when the last connection is gone, a session
+   which got connected again is just skipped when its timer fires */
+static void matocu_session_expire(void *arg) {
+	session **sesdata,*asesdata = (session*)arg;
 	uint32_t now;
 
-	now = get_current_time();
-	sesdata = &(sessionshead);
-	while ((asesdata=*sesdata)) {
-		if (asesdata->nsocks==0 && ((asesdata->newsession && asesdata->disconnected+NEWSESSION_TIMEOUT<now) || (asesdata->newsession==0 && asesdata->disconnected+OLDSESSION_TIMEOUT<now))) {
+	if (asesdata->nsocks>0) {
+		return;
+	}
+	now = main_time();
+	if ((asesdata->newsession && asesdata->disconnected+NEWSESSION_TIMEOUT<now) || (asesdata->newsession==0 && asesdata->disconnected+OLDSESSION_TIMEOUT<now)) {
+		main_timercancel(asesdata->timer);
+		asesdata->timer = NULL;
+		for (sesdata = &(sessionshead) ; *sesdata && *sesdata!=asesdata ; sesdata = &((*sesdata)->next)) {}
+		if (*sesdata) {
 			matocu_session_timedout(asesdata);
 			*sesdata = asesdata->next;
 			free(asesdata);
-		} else {
-			sesdata = &(asesdata->next);
 		}
+	} else {
+		matocu_session_timerarm(asesdata);
+	}
+}
+
+static void matocu_session_timerarm(session *asesdata) {
+	uint32_t due,now;
+	now = main_time();
+	due = asesdata->disconnected + 1 + ((asesdata->newsession)?NEWSESSION_TIMEOUT:OLDSESSION_TIMEOUT);
+	due = (due>now)?(due-now)*1000:1;
+	if (asesdata->timer==NULL) {
+		asesdata->timer = main_timeradd(due,0,matocu_session_expire,asesdata);
+	} else {
+		main_timerset(asesdata->timer,due);
 	}
 }
 
@@ -2999,14 +3104,12 @@ void matocu_beforedisconnect(serventry *eptr) {
 		}
 		if (eptr->sesdata->nsocks==0) {
 			eptr->sesdata->disconnected = get_current_time();
+			matocu_session_timerarm(eptr->sesdata);
 		}
 	}
 }
 
-void matocuserv_gotpacket(serventry *eptr,uint32_t type,const uint8_t *data,uint32_t length) {
-	if (type==ANTOAN_NOP) {
-		return;
-	}
+static void matocuserv_handlepacket(serventry *eptr,uint32_t type,const uint8_t *data,uint32_t length) {
 	if (eptr->registered==0) {	// sesdata is NULL
 		switch (type) {
 			case CUTOMA_FUSE_REGISTER:
@@ -3045,6 +3148,9 @@ void matocuserv_gotpacket(serventry *eptr,uint32_t type,const uint8_t *data,uint
 			case CUTOMA_MLOG_LIST:
 				matocuserv_mlog_list(eptr,data,length);
 				break;
+			case CUTOMA_LATENCY_INFO:
+				matocuserv_latency_info(eptr,data,length);
+				break;
 			default:
 				MFSLOG(LOG_NOTICE,"matocu: got unknown message from unregistered (type:%"PRIu32")",type);
 				eptr->mode=KILL;
@@ -3101,6 +3207,9 @@ void matocuserv_gotpacket(serventry *eptr,uint32_t type,const uint8_t *data,uint
 			case CUTOMA_FUSE_GETDIR:
 				matocuserv_fuse_getdir(eptr,data,length);
 				break;
+			case CUTOMA_FUSE_READDIR:
+				matocuserv_fuse_readdir(eptr,data,length);
+				break;
 			case CUTOMA_FUSE_OPEN:
 				matocuserv_fuse_open(eptr,data,length);
 				break;
@@ -3224,26 +3333,53 @@ void matocuserv_gotpacket(serventry *eptr,uint32_t type,const uint8_t *data,uint
 	}
 }
 
+void matocuserv_gotpacket(serventry *eptr,uint32_t type,const uint8_t *data,uint32_t length) {
+	char name[32];
+	uint64_t usec;
+	uint32_t h;
+	if (type==ANTOAN_NOP) {
+		return;
+	}
+	usec = main_preciseutime();
+	matocuserv_handlepacket(eptr,type,data,length);
+	usec = main_preciseutime()-usec;
+	h = (type<OPHIST_TYPES)?type:OPHIST_TYPES;
+	if (ophist[h]==NULL) {
+		if (h<OPHIST_TYPES) {
+			snprintf(name,32,"cuop:%"PRIu32,type);
+		} else {
+			snprintf(name,32,"cuop:other");
+		}
+		ophist[h] = main_lathist(name);
+	}
+	main_lathistadd(ophist[h],usec);
+	opcount++;
+	opusecsum += usec;
+	if (usec>opusecmax) {
+		opusecmax = usec;
+	}
+}
+
+void matocuserv_opstats(uint64_t *ops,uint64_t *usecsum,uint64_t *usecmax) {
+	*ops = opcount;
+	*usecsum = opusecsum;
+	*usecmax = opusecmax;
+	opusecmax = 0;
+}
+
 void matocuserv_term(void) {
 	serventry *eptr,*eaptr;
-	packetstruct *pptr,*paptr;
 	MFSLOG(LOG_INFO,"matocu: closing %s:%s",ListenHost,ListenPort);
 	tcpclose(lsock);
+	netio_term();	// closes sockets owned by i/o threads
 
 	eptr = matocuservhead;
 	while (eptr) {
 		if (eptr->inputpacket.packet) {
 			free(eptr->inputpacket.packet);
 		}
-		pptr = eptr->outputhead;
-		while (pptr) {
-			if (pptr->packet) {
-				free(pptr->packet);
-			}
-			paptr = pptr;
-			pptr = pptr->next;
-			free(paptr);
-		}
+		pktbuf_freechain(eptr->outputhead);
+		main_timercancel(eptr->timer);
 		eaptr = eptr;
 		eptr = eptr->next;
 		free(eaptr);
@@ -3327,37 +3463,99 @@ void matocuserv_read(serventry *eptr) {
 }
 
 void matocuserv_write(serventry *eptr) {
-	packetstruct *pack;
-	int32_t i;
-	for (;;) {
-		pack = eptr->outputhead;
-		if (pack==NULL) {
-			return;
+	if (pktbuf_writev(eptr->sock,&(eptr->outputhead),&(eptr->outputtail),NULL)<0) {
+		MFSLOG(LOG_INFO,"matocu: write error: %m");
+		eptr->mode = KILL;
+	}
+}
+
+/* EPOLLOUT only while there is something left after direct write (see matocuserv_flush) */
+static inline uint32_t matocuserv_interest(serventry *eptr) {
+	uint32_t events = exiting?0:EPOLLIN;
+	if (eptr->outputhead!=NULL && eptr->flushpending==0) {
+		events |= EPOLLOUT;
+	}
+	return events;
+}
+
+/* replies are written directly - epoll is asked for EPOLLOUT only when socket buffer is full */
+static void matocuserv_flush(void) {
+	serventry *eptr;
+	while ((eptr=matocuservflushhead)!=NULL) {
+		matocuservflushhead = eptr->flushnext;
+		eptr->flushpending = 0;
+		if (eptr->ioconn) {
+			if (eptr->mode!=KILL) {
+				netio_send(eptr);
+				eptr->lastwrite = main_time();
+			}
+			continue;
+		}
+		if (eptr->mode!=KILL && eptr->outputhead!=NULL) {
+			matocuserv_write(eptr);
+			eptr->lastwrite = main_time();
+		}
+		if (eptr->mode==KILL) {
+			killpending = 1;
+		} else {
+			main_epollinterest(eptr,matocuserv_interest(eptr));
 		}
-		i=write(eptr->sock,pack->startptr,pack->bytesleft);
-		if (i<0) {
-			if (errno!=EAGAIN) {
-				MFSLOG(LOG_INFO,"matocu: write error: %m");
-				eptr->mode = KILL;
+	}
+	if (IOThreads>0) {
+		netio_wakeup();
+	}
+}
+
+/* messages from network i/o threads - packets are processed here (in main thread) exactly as
+   they would be in matocuserv_read */
+static void matocuserv_iomsg(serventry *eptr,uint8_t cmd,uint32_t type,uint8_t *data,uint32_t leng) {
+	switch (cmd) {
+	case NETIO_PACKET:
+		if (eptr->mode!=KILL && exiting==0) {
+			eptr->lastread = main_time();
+			matocuserv_gotpacket(eptr,type,data,leng);
+			if (eptr->mode==KILL) {
+				killpending = 1;
 			}
-			return;
 		}
-		pack->startptr+=i;
-		pack->bytesleft-=i;
-		if (pack->bytesleft>0) {
-			return;
+		if (data) {
+			free(data);
 		}
-		free(pack->packet);
-		eptr->outputhead = pack->next;
-		if (eptr->outputhead==NULL) {
-			eptr->outputtail = &(eptr->outputhead);
+		break;
+	case NETIO_ERROR:
+		if (type==EMSGSIZE) {
+			MFSLOG(LOG_WARNING,"matocu: packet too long (%"PRIu32"/%u)",leng,MaxPacketSize);
+		} else if (type==ENOMEM) {
+			MFSLOG(LOG_WARNING,"matocu: out of memory");
+		} else if (type!=0) {
+#ifdef ECONNRESET
+			if (type!=ECONNRESET || eptr->registered<100) {
+#endif
+				errno = type;
+				MFSLOG(LOG_INFO,"matocu: connection error: %m");
+#ifdef ECONNRESET
+			}
+#endif
 		}
-		free(pack);
+		eptr->mode = KILL;
+		killpending = 1;
+		break;
+	case NETIO_CLOSED:
+		eptr->ioconn = NULL;
+		eptr->sock = -1;
+		killpending = 1;
+		break;
 	}
 }
 
 void matocuserv_wantexit(void) {
+	serventry *eptr;
 	exiting=1;
+	for (eptr=matocuservhead ; eptr ; eptr=eptr->next) {
+		if (eptr->listen_sock==0 && eptr->mode!=KILL && eptr->ioconn==NULL) {
+			main_epollinterest(eptr,matocuserv_interest(eptr));
+		}
+	}
 }
 
 int matocuserv_canexit(void) {
@@ -3370,13 +3568,50 @@ int matocuserv_canexit(void) {
 			return 0;
 		}
 	}
+	if (IOThreads>0 && netio_idle()==0) {
+		return 0;
+	}
 	return 1;
 }
 
+/* connection timeout and nops - one lazily rearmed timer per connection (see matocsserv_timeout) */
+static uint32_t matocuserv_timerdelay(serventry *eptr,uint32_t now) {
+	uint32_t due;
+	due = eptr->lastread+11;
+	if (eptr->registered<100 && eptr->lastwrite+3<due) {
+		due = eptr->lastwrite+3;
+	}
+	if (due<=now) {
+		due = now+1;
+	}
+	return (due-now)*1000;
+}
+
+static void matocuserv_timeout(void *arg) {
+	serventry *eptr = (serventry*)arg;
+	uint32_t now = main_time();
+	uint8_t *ptr;
+	if (eptr->mode==KILL) {		// killed outside of serve/flush - timer is cancelled in matocuserv_desc
+		killpending = 1;
+		return;
+	}
+	if (eptr->lastread+10<now && exiting==0) {
+		eptr->mode = KILL;
+		killpending = 1;
+		return;
+	}
+	if (eptr->lastwrite+2<now && eptr->registered<100 && eptr->outputhead==NULL) {
+		ptr = matocuserv_createpacket(eptr,ANTOAN_NOP,4);	// 4 byte length because of 'msgid'
+		if (ptr) {
+			put32bit(&ptr,0);
+		}
+		eptr->lastwrite = now;
+	}
+	main_timerset(eptr->timer,matocuserv_timerdelay(eptr,now));
+}
+
 void matocuserv_desc(int epoll_fd) {
-	uint32_t now=get_current_time();
-	serventry *eptr,**kptr,**wptr;
-        packetstruct *pptr,*paptr;
+	serventry *eptr,**kptr,**wptr,**fptr;
 	int ret;
 	struct epoll_event ev = {0,{0}};
 
@@ -3401,6 +3636,11 @@ void matocuserv_desc(int epoll_fd) {
 		
 		eptr->listen_sock = 1;
                 eptr->connection = 0;
+		eptr->flushpending = 0;
+		eptr->flushnext = NULL;
+		eptr->ioconn = NULL;
+		eptr->ioclosing = 0;
+		eptr->timer = NULL;
 
 		ev.data.ptr = eptr;
 		ev.events = EPOLLIN;
@@ -3408,6 +3648,7 @@ void matocuserv_desc(int epoll_fd) {
 		if(ret!=0) {
 			MFSLOG(LOG_NOTICE,"epoll_ctl error");
 		}
+		eptr->epollevents = EPOLLIN;
  
 //		syslog(LOG_NOTICE,"listen_socket:connection:%d,lastread:%d,lastwrite:%d,eptr_sock:%d,listen_sock:%d,registered:%d,version:%d",eptr->connection,eptr->lastread,eptr->lastwrite,eptr->sock,eptr->listen_sock,eptr->registered,eptr->version);
 		first_add_listen_sock = 1;
@@ -3415,50 +3656,48 @@ void matocuserv_desc(int epoll_fd) {
 	} else if(exiting==1) {
 		lsockpdescpos = -1;
 	}
+	if (IOThreads>0 && iowakeadded==0) {
+		ev.data.ptr = &iowake;
+		ev.events = EPOLLIN;
+		if (epoll_ctl(epoll_fd,EPOLL_CTL_ADD,iowake.sock,&ev)!=0) {
+			MFSLOG(LOG_NOTICE,"epoll_ctl error");
+		}
+		iowake.epollevents = EPOLLIN;
+		iowakeadded = 1;
+	}
+	matocuserv_flush();
+	if (killpending==0) {
+		return;
+	}
+	killpending = 0;
 	kptr = &matocuservhead;
 	wptr = &matocuservhead;
 	while((eptr=*kptr)) {
-		if (eptr->listen_sock == 0 && eptr->mode != KILL) {
-			ev.data.ptr = eptr;
-	        	if (exiting==0 && eptr->mode != KILL) {
-				ev.events = EPOLLIN;
-			}		
-			if (eptr->outputhead!=NULL && eptr->mode != KILL) {
-				ev.events = EPOLLIN|EPOLLOUT;
-			}		
-			ret = epoll_ctl(epoll_fd,EPOLL_CTL_MOD,eptr->sock,&ev);
-			if(ret!=0) {
-                		MFSLOG(LOG_NOTICE,"epoll_ctl error");
-                	}
-		}
-
-		if (eptr->listen_sock == 1) {
-			eptr->lastread = eptr->lastwrite = get_current_time();
-		}
-		if (eptr->lastread+10<now && exiting==0) {
-                        eptr->mode = KILL;
-                }
-                if (eptr->lastwrite+2<now && eptr->registered<100 && eptr->outputhead==NULL) {
-                        uint8_t *ptr = matocuserv_createpacket(eptr,ANTOAN_NOP,4);      // 4 byte length because of 'msgid'
-                        *((uint32_t*)ptr) = 0;
-                }
-		if (eptr->mode == KILL) {
+		if (eptr->mode == KILL && eptr->ioconn!=NULL) {	// socket is closed by its i/o thread - wait for NETIO_CLOSED
+			if (eptr->ioclosing==0) {
+				eptr->ioclosing = 1;
+				main_timercancel(eptr->timer);
+				eptr->timer = NULL;
+				netio_close(eptr);
+			}
+			wptr = &eptr;
+			kptr = &(eptr->next);
+		} else if (eptr->mode == KILL) {
 			ev.data.ptr = eptr;
+			main_timercancel(eptr->timer);
 			matocu_beforedisconnect(eptr);
-			epoll_ctl(epoll_fd,EPOLL_CTL_DEL,eptr->sock,&ev);			
-			tcpclose(eptr->sock);
+			if (eptr->sock>=0) {
+				epoll_ctl(epoll_fd,EPOLL_CTL_DEL,eptr->sock,&ev);
+				tcpclose(eptr->sock);
+			}
+			if (eptr->flushpending) {	// got packet before it was killed
+				for (fptr=&matocuservflushhead ; *fptr!=eptr ; fptr=&((*fptr)->flushnext)) {}
+				*fptr = eptr->flushnext;
+			}
 			if (eptr->inputpacket.packet) {
 				free(eptr->inputpacket.packet);
 			}
-			pptr = eptr->outputhead;
-			while (pptr) {
-				if (pptr->packet) {
-					free(pptr->packet);
-				}
-				paptr = pptr;
-				pptr = pptr->next;
-				free(paptr);
-			}
+			pktbuf_freechain(eptr->outputhead);
 			if(eptr == matocuservhead) {
                                 matocuservhead = eptr->next;
                                 wptr = &matocuservhead;
@@ -3483,6 +3722,10 @@ void matocuserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
 	struct epoll_event ev = {0,{0}};
 	
 	weptr = (serventry*)pdesc[count].data.ptr;
+	if (weptr==&iowake) {
+		netio_receive(matocuserv_iomsg);
+		return;
+	}
 	if((weptr->listen_sock == 1) && (lsockpdescpos >= 0) && (pdesc[count].events & EPOLLIN) && (meta_ready == 0) ) {
 		ns = tcpaccept(lsock);
 		if (ns < 0) {
@@ -3512,10 +3755,20 @@ void matocuserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
 					               
                         eptr->listen_sock = 0;
                         eptr->connection = 0;
- 
-			ev.data.ptr = eptr;
-             		ev.events = EPOLLIN;
-                	epoll_ctl(epoll_fd,EPOLL_CTL_ADD,ns,&ev);
+			eptr->epollevents = EPOLLIN;
+			eptr->flushpending = 0;
+			eptr->flushnext = NULL;
+			eptr->ioconn = NULL;
+			eptr->ioclosing = 0;
+			eptr->timer = main_timeradd(matocuserv_timerdelay(eptr,eptr->lastread),0,matocuserv_timeout,eptr);
+
+			if (IOThreads>0) {
+				netio_attach(eptr);
+			} else {
+				ev.data.ptr = eptr;
+				ev.events = EPOLLIN;
+				epoll_ctl(epoll_fd,EPOLL_CTL_ADD,ns,&ev);
+			}
               	}
 	} 
         if((weptr->listen_sock == 0) && (meta_ready == 0) ) {
@@ -3530,6 +3783,11 @@ void matocuserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
                         matocuserv_write(weptr);
                         weptr->lastwrite = now;						
                 }
+		if (weptr->mode==KILL) {
+			killpending = 1;
+		} else {
+			main_epollinterest(weptr,matocuserv_interest(weptr));
+		}
 	}               
 }
 
@@ -3551,6 +3809,10 @@ int matocuserv_networkinit() {
 	ListenHost = cfg_getstr("MATOCU_LISTEN_HOST","*");
 	ListenPort = cfg_getstr("MATOCU_LISTEN_PORT","9421");
 	RejectOld = cfg_getuint32("REJECT_OLD_CLIENTS",0);
+	IOThreads = cfg_getuint32("MATOCU_IO_THREADS",0);
+	if (IOThreads>64) {
+		IOThreads = 64;
+	}
 
 	/* as master, the meta data is ok */
 	if(ismaster()) {
@@ -3581,7 +3843,19 @@ int matocuserv_networkinit() {
 
 	matocuservhead = NULL;
 
-	main_timeregister(TIMEMODE_RUNONCE,10,0,matocu_session_check);
+	iowakeadded = 0;
+	if (IOThreads>0) {
+		memset(&iowake,0,sizeof(serventry));
+		iowake.connection = 0;
+		iowake.sock = netio_init(IOThreads,MaxPacketSize);
+		if (iowake.sock<0) {
+			MFSLOG(LOG_WARNING,"matocu: can't start network i/o threads - using main thread");
+			IOThreads = 0;
+		} else {
+			MFSLOG(LOG_NOTICE,"matocu: %"PRIu32" network i/o threads",IOThreads);
+		}
+	}
+
 	main_timeregister(TIMEMODE_RUNONCE,3600,0,matocu_session_statsmove);
 	main_destructregister(matocuserv_term);
 	main_epollregister(matocuserv_desc,matocuserv_serve);
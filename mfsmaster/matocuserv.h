@@ -26,5 +26,7 @@ void matocuserv_chunk_status(uint64_t chunkid,uint8_t status);
 void matocuserv_init_sessions(uint32_t sessionid,uint32_t inode);
 int matocuserv_sessionsinit();
 int matocuserv_networkinit();
+/* client packets handled (monotonic), their total time and longest one since last call (us) */
+void matocuserv_opstats(uint64_t *ops,uint64_t *usecsum,uint64_t *usecmax);
 
 #endif
@@ -41,9 +41,12 @@
 #include "crc.h"
 #include "cfg.h"
 #include "main.h"
+#include "pktbuf.h"
 #include "sockets.h"
 #include "state.h"
 #include "changelog.h"
+#include "changelogrec.h"
+#include "metastream.h"
 
 #define MaxLogCount 100
 #define MaxConnect 30
@@ -132,6 +135,7 @@ static int open_changelog(file_info *new_file) {
 //changelog read function
 static int read_changelog(file_info *cur_file,char *buff) {
 	uint64_t cur_idx = 0;
+	int status;
 
 	if (cur_file != NULL) {
         	cur_idx = ftell(cur_file->fd);
@@ -150,26 +154,12 @@ static int read_changelog(file_info *cur_file,char *buff) {
 		return -1;
 	}
 
-	if (fgets(buff,1000,cur_file->fd) != NULL) {
-		if (buff[strlen(buff)-1] != '\n') {
-			if (fseek(cur_file->fd,cur_idx,SEEK_SET) != 0) {
-				MFSLOG(LOG_ERR,"seek_set failed");
-				return -1;
-			} 
-//			syslog(LOG_NOTICE,"no more line 1");
-			return 0;
-		} else {
-			return strlen(buff);
-		}
-	} else {
-		if (fseek(cur_file->fd,cur_idx,SEEK_SET) != 0) {
-               		MFSLOG(LOG_ERR,"seek_set failed");
-               		return -1;
-		} else {
-//			syslog(LOG_NOTICE,"no more line 2");
-			return 0;
-		}
+	// binary records are converted to text lines - metaloggers and slaves get the same text as before
+	status = changelogrec_read(cur_file->fd,buff,1000);
+	if (status<0) {
+		MFSLOG(LOG_ERR,"broken changelog entry at offset %"PRIu64,cur_idx);
 	}
+	return status;
 }
 
 uint32_t matomlserv_mloglist_size(void) {
@@ -199,6 +189,9 @@ uint8_t* matomlserv_createpacket(serventry *eptr,uint32_t type,uint32_t size) {
 	uint8_t *ptr;
 	uint32_t psize;
 
+	if (eptr->syncworker==0) {
+		return pktbuf_append(&(eptr->outputhead),&(eptr->outputtail),type,size);
+	}
 	outpacket=(packetstruct*)malloc(sizeof(packetstruct));
 	if (outpacket==NULL) {
 		return NULL;
@@ -265,6 +258,7 @@ static int sync_socket_init(serventry *eptr,pthread_t tid) {
 	int num;
 	int count = 0;
 
+	eptr->syncworker = 1;
 	num = worker_thread_indent(tid);
 	if (tcpresolve(worker_addr[num].host,worker_addr[num].port,&shadow_ip,&shadow_port,0)>=0) {
 		eptr->masterip = shadow_ip;
@@ -938,6 +932,8 @@ void matomlserv_download_start(serventry *eptr,const uint8_t *data,uint32_t leng
 	uint8_t filenum;
 	uint64_t size;
 	uint8_t *ptr;
+	uint8_t hdr[8+12];
+	const uint8_t *rptr;
 	if (length!=1) {
 		MFSLOG(LOG_NOTICE,"MLTOMA_DOWNLOAD_START - wrong size (%"PRIu32"/1)",length);
 		eptr->mode=KILL;
@@ -949,9 +945,16 @@ void matomlserv_download_start(serventry *eptr,const uint8_t *data,uint32_t leng
 	}
 	filenum = get8bit(&data);
 	if (filenum==1) {
+		// always full image (deltas are kept in separate files) - remember its version, so the changelog sent next starts there
 		eptr->metafd = open("metadata.mfs.back",O_RDONLY);
+		eptr->metaversion = 0;
+		if (eptr->metafd>=0 && metastream_readhead(eptr->metafd,hdr,8+12)==0) {
+			rptr = hdr+8+4;
+			eptr->metaversion = get64bit(&rptr);
+		}
 	} else if (filenum==2) {
-		eptr->metafd = open("changelog.0.mfs",O_RDONLY);
+		// changelog.0.mfs starts at the last checkpoint (it may be a delta) - older changelogs are added when needed
+		eptr->metafd = changelog_openfrom(eptr->metaversion,&(eptr->changelog_offset));
 	} else {
 		eptr->mode=KILL;
 		return;
@@ -966,10 +969,6 @@ void matomlserv_download_start(serventry *eptr,const uint8_t *data,uint32_t leng
 		return;
 	}
 	size = lseek(eptr->metafd,0,SEEK_END);
-	if (filenum==2) {
-		eptr->changelog_offset = size;
-//		syslog(LOG_NOTICE,"changelog_offset is %d",changelog_offset);
-	}
 	ptr = matomlserv_createpacket(eptr,MATOML_DOWNLOAD_START,8);
 	if (ptr==NULL) {
 		eptr->mode=KILL;
@@ -1057,7 +1056,6 @@ void matomlserv_gotpacket(serventry *eptr,uint32_t type,const uint8_t *data,uint
 
 void matomlserv_term(void) {
 	serventry *eptr,*eaptr;
-	packetstruct *pptr,*paptr;
 	MFSLOG(LOG_INFO,"matoml: closing %s:%s",ListenHost,ListenPort);
 	tcpclose(lsock);
 
@@ -1066,15 +1064,7 @@ void matomlserv_term(void) {
 		if (eptr->inputpacket.packet) {
 			free(eptr->inputpacket.packet);
 		}
-		pptr = eptr->outputhead;
-		while (pptr) {
-			if (pptr->packet) {
-				free(pptr->packet);
-			}
-			paptr = pptr;
-			pptr = pptr->next;
-			free(paptr);
-		}
+		pktbuf_freechain(eptr->outputhead);
 		eaptr = eptr;
 		eptr = eptr->next;
 		free(eaptr);
@@ -1151,39 +1141,15 @@ void matomlserv_read(serventry *eptr) {
 }
 
 void matomlserv_write(serventry *eptr) {
-	packetstruct *pack;
-	int32_t i;
-	for (;;) {
-		pack = eptr->outputhead;
-		if (pack==NULL) {
-			return;
-		}
-		i=write(eptr->sock,pack->startptr,pack->bytesleft);
-		if (i<0) {
-			if (errno!=EAGAIN) {
-				MFSLOG(LOG_INFO,"write to ML(%s) error: %m",eptr->servstrip);
-				eptr->mode = KILL;
-			}
-			return;
-		}
-		pack->startptr+=i;
-		pack->bytesleft-=i;
-		if (pack->bytesleft>0) {
-			return;
-		}
-		free(pack->packet);
-		eptr->outputhead = pack->next;
-		if (eptr->outputhead==NULL) {
-			eptr->outputtail = &(eptr->outputhead);
-		}
-		free(pack);
+	if (pktbuf_writev(eptr->sock,&(eptr->outputhead),&(eptr->outputtail),NULL)<0) {
+		MFSLOG(LOG_INFO,"write to ML(%s) error: %m",eptr->servstrip);
+		eptr->mode = KILL;
 	}
 }
 
 void matomlserv_desc(int epoll_fd) {
 	//uint32_t now=main_time();
         serventry *eptr,**kptr,**wptr;
-        packetstruct *pptr,*paptr;
 	struct epoll_event ev;
 	int ret;
 
@@ -1211,6 +1177,8 @@ void matomlserv_desc(int epoll_fd) {
                 eptr->servstrip = matomlserv_makestrip(eptr->servip);
                 eptr->version=0;
                 eptr->metafd=-1;
+                eptr->metaversion=0;
+                eptr->syncworker=0;
 	
 		eptr->listen_sock = 1;
                 eptr->connection = 2;
@@ -1227,15 +1195,7 @@ void matomlserv_desc(int epoll_fd) {
         wptr = &matomlservhead;
 	while ((eptr=*kptr)) {
 		if (eptr->listen_sock == 0 && eptr->mode != KILL) {
-			ev.data.ptr = eptr;
-			ev.events = EPOLLIN;		
-			if (eptr->outputhead != NULL && eptr->mode != KILL) {
-				ev.events = EPOLLIN|EPOLLOUT;
-			}
-			ret = epoll_ctl(epoll_fd,EPOLL_CTL_MOD,eptr->sock,&ev);
-			if(ret!=0) {
-	                        MFSLOG(LOG_NOTICE,"epoll_ctl error 2");
-	                }
+			main_epollinterest(eptr,(eptr->outputhead!=NULL)?(EPOLLIN|EPOLLOUT):EPOLLIN);
 		}
 		
 	        if (eptr->listen_sock == 1) {
@@ -1255,15 +1215,7 @@ void matomlserv_desc(int epoll_fd) {
                         if (eptr->inputpacket.packet) {
                                 free(eptr->inputpacket.packet);
                         }
-                        pptr = eptr->outputhead;
-                        while (pptr) {
-                                if (pptr->packet) {
-                                        free(pptr->packet);
-                                }
-                                paptr = pptr;
-                                pptr = pptr->next;
-                                free(paptr);
-                        }
+                        pktbuf_freechain(eptr->outputhead);
 			if(eptr == matomlservhead) {
 	                	matomlservhead = eptr->next;
 	                	wptr = &matomlservhead;
@@ -1312,6 +1264,8 @@ void matomlserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
 			eptr->servstrip = matomlserv_makestrip(eptr->servip);
 			eptr->version=0;
 			eptr->metafd=-1;
+			eptr->metaversion=0;
+			eptr->syncworker=0;
 
 			eptr->listen_sock = 0;
                         eptr->connection = 2;
@@ -1319,6 +1273,7 @@ void matomlserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
 			ev.data.ptr = eptr;
                         ev.events = EPOLLIN | EPOLLOUT;
                         epoll_ctl(epoll_fd,EPOLL_CTL_ADD,ns,&ev);
+                        eptr->epollevents = EPOLLIN|EPOLLOUT;
 		}
 	}
 	if(weptr->listen_sock == 0) {
@@ -41,10 +41,12 @@
 #include "crc.h"
 #include "cfg.h"
 #include "main.h"
+#include "pktbuf.h"
 #include "sockets.h"
 #include "main.h"
 #include "state.h"
 #include "changelog.h"
+#include "changelogrec.h"
 
 #define MaxLogCount 100
 #define MaxConnect 30
@@ -118,6 +120,9 @@ uint8_t* matoslaserv_createpacket(serventry *eptr,uint32_t type,uint32_t size) {
 	uint8_t *ptr;
 	uint32_t psize;
 
+	if (eptr->syncworker==0) {
+		return pktbuf_append(&(eptr->outputhead),&(eptr->outputtail),type,size);
+	}
 	outpacket=(packetstruct*)malloc(sizeof(packetstruct));
 	if (outpacket==NULL) {
 		return NULL;
@@ -323,6 +328,7 @@ static int sla_sync_socket_init(serventry *eptr,pthread_t tid) {
 	int num;
 	int count = 0;
 
+	eptr->syncworker = 1;
 	num = sla_worker_thread_indent(tid);
 	if (tcpresolve(sla_worker_addr[num].host,sla_worker_addr[num].port,&shadow_ip,&shadow_port,0)>=0) {
 		eptr->masterip = shadow_ip;
@@ -560,6 +566,7 @@ static int sla_open_changelog(file_info *new_file) {
 //changelog read function
 static int sla_read_changelog(file_info *cur_file,char *buff) {
 	uint64_t cur_idx = 0;
+	int status;
 
 	if (cur_file != NULL) {
         	cur_idx = ftell(cur_file->fd);
@@ -576,26 +583,12 @@ static int sla_read_changelog(file_info *cur_file,char *buff) {
 		return -1;
 	}
 
-	if (fgets(buff,1000,cur_file->fd) != NULL) {
-		if (buff[strlen(buff)-1] != '\n') {
-			if (fseek(cur_file->fd,cur_idx,SEEK_SET) != 0) {
-				MFSLOG(LOG_ERR,"seek_set failed");
-				return -1;
-			} 
-//			syslog(LOG_NOTICE,"no more line 1");
-			return 0;
-		} else {
-			return strlen(buff);
-		}
-	} else {
-		if (fseek(cur_file->fd,cur_idx,SEEK_SET) != 0) {
-               		MFSLOG(LOG_ERR,"seek_set failed");
-               		return -1;
-		} else {
-//			syslog(LOG_NOTICE,"no more line 2");
-			return 0;
-		}
+	// binary records are converted to text lines - metaloggers and slaves get the same text as before
+	status = changelogrec_read(cur_file->fd,buff,1000);
+	if (status<0) {
+		MFSLOG(LOG_ERR,"broken changelog entry at offset %"PRIu64,cur_idx);
 	}
+	return status;
 }
 
 //rewrited download end 
@@ -1027,7 +1020,6 @@ void matoslaserv_gotpacket(serventry *eptr,uint32_t type,const uint8_t *data,uin
 
 void matoslaserv_term(void) {
 	serventry *eptr,*eaptr;
-	packetstruct *pptr,*paptr;
     void * end;
 
     set_state(MFS_STATE_SHUTDOWN);
@@ -1047,15 +1039,7 @@ void matoslaserv_term(void) {
 		if (eptr->inputpacket.packet) {
 			free(eptr->inputpacket.packet);
 		}
-		pptr = eptr->outputhead;
-		while (pptr) {
-			if (pptr->packet) {
-				free(pptr->packet);
-			}
-			paptr = pptr;
-			pptr = pptr->next;
-			free(paptr);
-		}
+		pktbuf_freechain(eptr->outputhead);
 		eaptr = eptr;
 		eptr = eptr->next;
 		free(eaptr);
@@ -1132,39 +1116,15 @@ void matoslaserv_read(serventry *eptr) {
 }
 
 void matoslaserv_write(serventry *eptr) {
-	packetstruct *pack;
-	int32_t i;
-	for (;;) {
-		pack = eptr->outputhead;
-		if (pack==NULL) {
-			return;
-		}
-		i=write(eptr->sock,pack->startptr,pack->bytesleft);
-		if (i<0) {
-			if (errno!=EAGAIN) {
-				MFSLOG(LOG_INFO,"write to sla(%s) error: %m",eptr->servstrip);
-				eptr->mode = KILL;
-			}
-			return;
-		}
-		pack->startptr+=i;
-		pack->bytesleft-=i;
-		if (pack->bytesleft>0) {
-			return;
-		}
-		free(pack->packet);
-		eptr->outputhead = pack->next;
-		if (eptr->outputhead==NULL) {
-			eptr->outputtail = &(eptr->outputhead);
-		}
-		free(pack);
+	if (pktbuf_writev(eptr->sock,&(eptr->outputhead),&(eptr->outputtail),NULL)<0) {
+		MFSLOG(LOG_INFO,"write to sla(%s) error: %m",eptr->servstrip);
+		eptr->mode = KILL;
 	}
 }
 
 void matoslaserv_desc(int epoll_fd) {
 	//uint32_t now=main_time();
         serventry *eptr,**kptr,**wptr;
-        packetstruct *pptr,*paptr;
 	struct epoll_event ev;
 	int ret;
 
@@ -1193,6 +1153,7 @@ void matoslaserv_desc(int epoll_fd) {
                 eptr->servstrip = matoslaserv_makestrip(eptr->servip);
                 eptr->version=0;
                 eptr->metafd=-1;
+                eptr->syncworker=0;
 	
 		   eptr->listen_sock = 1;
                 eptr->connection = 4;
@@ -1209,15 +1170,7 @@ void matoslaserv_desc(int epoll_fd) {
         wptr = &matoslaservhead;
 	while ((eptr=*kptr)) {
 		if (eptr->listen_sock == 0 && eptr->mode != KILL) {
-			ev.data.ptr = eptr;
-			ev.events = EPOLLIN;		
-			if (eptr->outputhead != NULL && eptr->mode != KILL) {
-				ev.events = EPOLLIN|EPOLLOUT;
-			}
-			ret = epoll_ctl(epoll_fd,EPOLL_CTL_MOD,eptr->sock,&ev);
-			if(ret!=0) {
-	                        MFSLOG(LOG_NOTICE,"epoll_ctl error 2");
-	                }
+			main_epollinterest(eptr,(eptr->outputhead!=NULL)?(EPOLLIN|EPOLLOUT):EPOLLIN);
 		}
 		
 	        if (eptr->listen_sock == 1) {
@@ -1238,15 +1191,7 @@ void matoslaserv_desc(int epoll_fd) {
                         if (eptr->inputpacket.packet) {
                                 free(eptr->inputpacket.packet);
                         }
-                        pptr = eptr->outputhead;
-                        while (pptr) {
-                                if (pptr->packet) {
-                                        free(pptr->packet);
-                                }
-                                paptr = pptr;
-                                pptr = pptr->next;
-                                free(paptr);
-                        }
+                        pktbuf_freechain(eptr->outputhead);
 			if(eptr == matoslaservhead) {
 	                	matoslaservhead = eptr->next;
 	                	wptr = &matoslaservhead;
@@ -1295,6 +1240,7 @@ void matoslaserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
 			eptr->servstrip = matoslaserv_makestrip(eptr->servip);
 			eptr->version=0;
 			eptr->metafd=-1;
+			eptr->syncworker=0;
 
 			eptr->listen_sock = 0;
                     eptr->connection = 4;
@@ -1302,6 +1248,7 @@ void matoslaserv_serve(int epoll_fd,int count,struct epoll_event *pdesc) {
 			ev.data.ptr = eptr;
                         ev.events = EPOLLIN | EPOLLOUT;
                         epoll_ctl(epoll_fd,EPOLL_CTL_ADD,ns,&ev);
+                        eptr->epollevents = EPOLLIN|EPOLLOUT;
 		}
 	}
 	if(weptr->listen_sock == 0) {
@@ -1393,6 +1340,7 @@ int matoslaserv_init() {
 	fprintf(msgfd,"master <-> metaloggers module: listen on %s:%s\n",ListenHost,ListenPort);
 
 	matoslaservhead = NULL;
+	main_destructregister(pktbuf_term);	// after all *_term functions which free packets (matosla is initialized first)
 	main_destructregister(matoslaserv_term);
 	main_epollregister(matoslaserv_desc,matoslaserv_serve);
 	return 0;
@@ -1,15 +1,363 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "main.h"
+#include "cfg.h"
 #include "nettopology.h"
 
+// topology file format (one network per line):
+//   CIDR  rack  [row  [dc]]
+// e.g. "10.1.2.0/23  r12  row3  dc1"; '-' means "not specified"
+// the longest matching prefix wins; addresses not covered by any network
+// fall back to the old heuristic (one /24 = one rack)
+
+#define NETHASHBITS 12
+#define NETHASHSIZE (1<<NETHASHBITS)
+#define NETHASH(net,bits) ((((net)^(bits))*0x9E3779B1U)>>(32-NETHASHBITS))
+
+// above this number of racks distances are computed on demand instead of being kept in a matrix (racks^2 bytes)
+#define MAXDISTRACKS 1024
+
+#define UNKNOWN 0xFFFFFFFFU
+
+typedef struct _netentry {
+	uint32_t net;
+	uint8_t bits;
+	uint32_t rack;
+	struct _netentry *next;
+} netentry;
+
+typedef struct _nametab {
+	char **names;
+	uint32_t cnt,size;
+} nametab;
+
+typedef struct _topology {
+	netentry *nethash[NETHASHSIZE];
+	uint8_t bitslist[33];	// prefix lengths present in the map - longest first
+	uint8_t bitscnt;
+	uint32_t nets;
+	uint32_t racks;
+	uint32_t *rackrow;
+	uint32_t *rackdc;
+	uint8_t *dist;
+} topology;
+
+static topology *topo = NULL;
+static uint32_t topogeneration = 0;
+static char *TopologyFileName;
+
+static uint32_t net_nametab_get(nametab *nt,const char *name) {
+	uint32_t i;
+	for (i=0 ; i<nt->cnt ; i++) {
+		if (strcmp(nt->names[i],name)==0) {
+			return i;
+		}
+	}
+	if (nt->cnt==nt->size) {
+		nt->size = nt->size?nt->size*2:64;
+		nt->names = realloc(nt->names,sizeof(char*)*nt->size);
+	}
+	nt->names[nt->cnt] = strdup(name);
+	return nt->cnt++;
+}
+
+static void net_nametab_free(nametab *nt) {
+	uint32_t i;
+	for (i=0 ; i<nt->cnt ; i++) {
+		free(nt->names[i]);
+	}
+	free(nt->names);
+}
+
+static void net_topology_free(topology *t) {
+	uint32_t i;
+	netentry *ne,*nne;
+	if (t==NULL) {
+		return;
+	}
+	for (i=0 ; i<NETHASHSIZE ; i++) {
+		for (ne=t->nethash[i] ; ne ; ne=nne) {
+			nne = ne->next;
+			free(ne);
+		}
+	}
+	free(t->rackrow);
+	free(t->rackdc);
+	free(t->dist);
+	free(t);
+}
+
+static inline uint32_t net_mask(uint8_t bits) {
+	return bits?(0xFFFFFFFFU<<(32-bits)):0;
+}
+
+static inline uint8_t net_rack_distance(const topology *t,uint32_t r1,uint32_t r2) {
+	if (r1==r2) {
+		return 1;
+	}
+	if (t->rackrow[r1]!=UNKNOWN && t->rackrow[r1]==t->rackrow[r2]) {
+		return 2;
+	}
+	if (t->rackdc[r1]!=UNKNOWN && t->rackdc[r1]==t->rackdc[r2]) {
+		return 3;
+	}
+	return 4;
+}
+
+// "a.b.c.d" or "a.b.c.d/bits"
+static int net_parse_cidr(const char *str,uint32_t *net,uint8_t *bits) {
+	uint32_t ip,i,v;
+	char *end;
+	ip = 0;
+	for (i=0 ; i<4 ; i++) {
+		if (*str<'0' || *str>'9') {
+			return -1;
+		}
+		v = strtoul(str,&end,10);
+		if (v>255) {
+			return -1;
+		}
+		ip = (ip<<8) | v;
+		str = end;
+		if (i<3) {
+			if (*str!='.') {
+				return -1;
+			}
+			str++;
+		}
+	}
+	if (*str==0) {
+		*bits = 32;
+	} else if (*str=='/' && str[1]>='0' && str[1]<='9') {
+		v = strtoul(str+1,&end,10);
+		if (*end!=0 || v>32) {
+			return -1;
+		}
+		*bits = v;
+	} else {
+		return -1;
+	}
+	*net = ip & net_mask(*bits);
+	return 0;
+}
+
+static int net_topology_parseline(topology *t,char *line,uint32_t lineno,nametab *racks,nametab *rows,nametab *dcs,uint32_t **rackrow,uint32_t **rackdc,uint32_t *rackssize) {
+	char *tok[5];
+	uint32_t n,rack,row,dc,hash,oldracks;
+	uint32_t net;
+	uint8_t bits;
+	netentry *ne;
+	char *p;
+
+	NOT_USED(lineno);	// used only in log messages and MFSLOG is empty in unit tests
+	n = 0;
+	p = line;
+	while (n<5) {
+		while (*p==' ' || *p=='\t') {
+			p++;
+		}
+		if (*p==0 || *p=='#') {
+			break;
+		}
+		tok[n++] = p;
+		while (*p && *p!=' ' && *p!='\t') {
+			p++;
+		}
+		if (*p) {
+			*p++ = 0;
+		}
+	}
+	if (n==0) {
+		return 0;
+	}
+	if (n<2 || n>4) {
+		MFSLOG(LOG_WARNING,"%s:%"PRIu32": wrong number of fields - line ignored",TopologyFileName,lineno);
+		return -1;
+	}
+	if (net_parse_cidr(tok[0],&net,&bits)<0) {
+		MFSLOG(LOG_WARNING,"%s:%"PRIu32": incorrect network definition - line ignored",TopologyFileName,lineno);
+		return -1;
+	}
+	hash = NETHASH(net,bits);
+	for (ne=t->nethash[hash] ; ne ; ne=ne->next) {
+		if (ne->net==net && ne->bits==bits) {
+			MFSLOG(LOG_WARNING,"%s:%"PRIu32": network already defined - line ignored",TopologyFileName,lineno);
+			return -1;
+		}
+	}
+	row = (n>2 && strcmp(tok[2],"-")!=0)?net_nametab_get(rows,tok[2]):UNKNOWN;
+	dc = (n>3 && strcmp(tok[3],"-")!=0)?net_nametab_get(dcs,tok[3]):UNKNOWN;
+	oldracks = racks->cnt;
+	rack = net_nametab_get(racks,tok[1]);
+	if (rack==*rackssize) {
+		*rackssize = *rackssize?*rackssize*2:64;
+		*rackrow = realloc(*rackrow,sizeof(uint32_t)*(*rackssize));
+		*rackdc = realloc(*rackdc,sizeof(uint32_t)*(*rackssize));
+	}
+	if (rack==oldracks) {	// new rack
+		(*rackrow)[rack] = row;
+		(*rackdc)[rack] = dc;
+	} else if ((*rackrow)[rack]!=row || (*rackdc)[rack]!=dc) {
+		MFSLOG(LOG_WARNING,"%s:%"PRIu32": rack '%s' placed differently - previous placement kept",TopologyFileName,lineno,tok[1]);
+	}
+	ne = malloc(sizeof(netentry));
+	ne->net = net;
+	ne->bits = bits;
+	ne->rack = rack;
+	ne->next = t->nethash[hash];
+	t->nethash[hash] = ne;
+	t->nets++;
+	return 0;
+}
+
+static void net_topology_load(void) {
+	FILE *fd;
+	char linebuff[1000];
+	uint32_t lineno,i,j,rackssize;
+	uint8_t bitspresent[33];
+	nametab racks,rows,dcs;
+	uint32_t *rackrow,*rackdc;
+	netentry *ne;
+	topology *t;
+
+	fd = fopen(TopologyFileName,"r");
+	if (fd==NULL) {
+		if (errno==ENOENT) {
+			if (topo) {
+				MFSLOG(LOG_WARNING,"mfstopology configuration file (%s) not found - topology not changed",TopologyFileName);
+			} else {
+				MFSLOG(LOG_NOTICE,"mfstopology configuration file (%s) not found - using one rack per /24 network",TopologyFileName);
+			}
+		} else {
+			MFSLOG(LOG_WARNING,"can't open mfstopology configuration file (%s): %m - topology not changed",TopologyFileName);
+		}
+		return;
+	}
+	t = malloc(sizeof(topology));
+	memset(t,0,sizeof(topology));
+	memset(&racks,0,sizeof(nametab));
+	memset(&rows,0,sizeof(nametab));
+	memset(&dcs,0,sizeof(nametab));
+	rackrow = NULL;
+	rackdc = NULL;
+	rackssize = 0;
+	lineno = 1;
+	while (fgets(linebuff,1000,fd)) {
+		linebuff[999]=0;
+		i = strlen(linebuff);
+		while (i>0 && (linebuff[i-1]=='\r' || linebuff[i-1]=='\n')) {
+			i--;
+		}
+		linebuff[i]=0;
+		net_topology_parseline(t,linebuff,lineno,&racks,&rows,&dcs,&rackrow,&rackdc,&rackssize);
+		lineno++;
+	}
+	t->racks = racks.cnt;
+	t->rackrow = rackrow;
+	t->rackdc = rackdc;
+	net_nametab_free(&racks);
+	net_nametab_free(&rows);
+	net_nametab_free(&dcs);
+	if (ferror(fd)) {
+		fclose(fd);
+		MFSLOG(LOG_WARNING,"error reading mfstopology file - topology not changed");
+		net_topology_free(t);
+		return;
+	}
+	fclose(fd);
+
+	memset(bitspresent,0,33);
+	for (i=0 ; i<NETHASHSIZE ; i++) {
+		for (ne=t->nethash[i] ; ne ; ne=ne->next) {
+			bitspresent[ne->bits] = 1;
+		}
+	}
+	for (i=33 ; i>0 ; i--) {
+		if (bitspresent[i-1]) {
+			t->bitslist[t->bitscnt++] = i-1;
+		}
+	}
+	if (t->racks>0 && t->racks<=MAXDISTRACKS) {
+		t->dist = malloc(t->racks*t->racks);
+		for (i=0 ; i<t->racks ; i++) {
+			for (j=0 ; j<t->racks ; j++) {
+				t->dist[i*t->racks+j] = net_rack_distance(t,i,j);
+			}
+		}
+	}
+
+	net_topology_free(topo);
+	topo = t;
+	topogeneration++;
+	MFSLOG(LOG_NOTICE,"topology file has been loaded (networks: %"PRIu32", racks: %"PRIu32")",t->nets,t->racks);
+}
+
+uint32_t net_get_rack(uint32_t ip) {
+	uint32_t i,net;
+	uint8_t bits;
+	netentry *ne;
+	if (topo) {
+		for (i=0 ; i<topo->bitscnt ; i++) {
+			bits = topo->bitslist[i];
+			net = ip & net_mask(bits);
+			for (ne=topo->nethash[NETHASH(net,bits)] ; ne ; ne=ne->next) {
+				if (ne->net==net && ne->bits==bits) {
+					return NET_RACK_MAPPED+ne->rack;
+				}
+			}
+		}
+	}
+	return ip>>8;
+}
+
+// 0 - same host, 1 - same rack, 2 - same row, 3 - same dc, 4 - elsewhere
+// for addresses not covered by the map: number of differing trailing octets
 uint32_t net_get_distance(uint32_t ip1, uint32_t ip2) {
-    uint32_t exact_dist;
-    uint32_t std_dist;
-    exact_dist = ip1^ip2;
-    std_dist = 0;
-    while(exact_dist) {
-        exact_dist = exact_dist>>8;
-        std_dist++;
-    }
-    return std_dist;
+	uint32_t exact_dist;
+	uint32_t std_dist;
+	uint32_t r1,r2;
+	if (ip1==ip2) {
+		return 0;
+	}
+	if (topo) {
+		r1 = net_get_rack(ip1);
+		r2 = net_get_rack(ip2);
+		if (r1>=NET_RACK_MAPPED && r2>=NET_RACK_MAPPED) {
+			r1 -= NET_RACK_MAPPED;
+			r2 -= NET_RACK_MAPPED;
+			if (topo->dist) {
+				return topo->dist[r1*topo->racks+r2];
+			}
+			return net_rack_distance(topo,r1,r2);
+		}
+	}
+	exact_dist = ip1^ip2;
+	std_dist = 0;
+	while(exact_dist) {
+		exact_dist = exact_dist>>8;
+		std_dist++;
+	}
+	return std_dist;
 }
 
+uint32_t net_topology_generation(void) {
+	return topogeneration;
+}
+
+void net_topology_reload(void) {
+	net_topology_load();
+}
 
+int net_topology_init(void) {
+	TopologyFileName = cfg_getstr("TOPOLOGY_FILENAME",ETC_PATH "/mfstopology.cfg");
+	net_topology_load();
+	main_reloadregister(net_topology_reload);
+	return 0;
+}
@@ -3,14 +3,18 @@
 
 #include <inttypes.h>
 
-static inline uint32_t net_get_rack(uint32_t ip) {
-    return ip>>8;
-}
+// racks defined in the topology file get ids from this value up, unmapped addresses use ip>>8
+#define NET_RACK_MAPPED 0x01000000U
+
+uint32_t net_get_rack(uint32_t ip);
 
 static inline int net_is_same_rack(uint32_t ip1, uint32_t ip2) {
     return net_get_rack(ip1) == net_get_rack(ip2);
 }
 
 uint32_t net_get_distance(uint32_t ip1, uint32_t ip2);
+uint32_t net_topology_generation(void);
+void net_topology_reload(void);
+int net_topology_init(void);
 
 #endif
@@ -130,10 +130,10 @@ static void state_refresh()
              set_state(MFS_STATE_MASTER);
         	matocuserv_sessionsinit(NULL);
 
-		main_timeregister(TIMEMODE_RUNONCE,1,0,chunk_jobs_main);
+		chunk_jobs_start();
 		main_timeregister(TIMEMODE_RUNONCE,1,0,fs_test_files);
 		main_timeregister(TIMEMODE_RUNONCE,1,0,fsnodes_check_all_quotas);
-		main_timeregister(TIMEMODE_RUNONCE,300,0,fs_emptytrash);
+		main_timeregister(TIMEMODE_RUNONCE,60,0,fs_emptytrash);
 		main_timeregister(TIMEMODE_RUNONCE,60,0,fs_emptyreserved);
 		main_timeregister(TIMEMODE_RUNONCE,60,0,fsnodes_freeinodes);	
              	main_timeregister(TIMEMODE_RUNONCE,3600,0,fs_dostoreall);
@@ -19,11 +19,14 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <sys/types.h>
 
 #include "MFSCommunication.h"
 #include "datapack.h"
+#include "metastream.h"
 
 #define STR_AUX(x) #x
 #define STR(x) STR_AUX(x)
@@ -32,7 +35,21 @@ const char id[]="@(#) version: " STR(VERSMAJ) "." STR(VERSMID) "." STR(VERSMIN)
 #define MAX_INDEX 0x7FFF
 #define MAX_CHUNKS_PER_FILE (MAX_INDEX+1)
 
-int chunk_load(FILE *fd) {
+// "MFSM 2.0" and "MFSD 2.0" (delta) sections (see mfsmaster/filesystem.c)
+#define FSSECTION_HEAD 0x48454144
+#define FSSECTION_NODE 0x4E4F4445
+#define FSSECTION_EDGE 0x45444745
+#define FSSECTION_FREE 0x46524545
+#define FSSECTION_CHNK 0x43484E4B
+#define FSSECTION_DELN 0x44454C4E
+#define FSSECTION_DELE 0x44454C45
+#define FSSECTION_CHKD 0x43484B44
+#define FSSECTION_XORG 0x584F5247
+#define FSSECTION_ENTRYSIZE (4+8+8+4)
+#define FSSECTION_TRAILERSIZE (8+8)
+
+// endpos==0 - read chunks up to the end of file
+int chunk_load(FILE *fd,uint64_t endpos) {
 	uint8_t hdr[8];
 	uint8_t loadbuff[16];
 	const uint8_t *ptr;
@@ -47,6 +64,9 @@ int chunk_load(FILE *fd) {
 	nextchunkid = get64bit(&ptr);
 	printf("# nextchunkid: %016"PRIX64"\n",nextchunkid);
 	for (;;) {
+		if (endpos>0 && (uint64_t)ftello(fd)>=endpos) {
+			return 0;
+		}
 		r = fread(loadbuff,1,16,fd);
 		if (r==0) {
 			return 0;
@@ -59,6 +79,83 @@ int chunk_load(FILE *fd) {
 	}
 }
 
+int chunk_loaddelta(FILE *fd) {
+	uint8_t loadbuff[16];
+	const uint8_t *ptr;
+	uint64_t chunkid;
+	uint32_t version,lockedto,deleted;
+
+	if (fread(loadbuff,1,8,fd)!=8) {
+		return -1;
+	}
+	ptr = loadbuff;
+	printf("# nextchunkid: %016"PRIX64"\n",get64bit(&ptr));
+	for (;;) {
+		if (fread(loadbuff,1,16,fd)!=16) {
+			return -1;
+		}
+		ptr = loadbuff;
+		chunkid = get64bit(&ptr);
+		if (chunkid==0) {
+			break;
+		}
+		version = get32bit(&ptr);
+		lockedto = get32bit(&ptr);
+		printf("*|i:%016"PRIX64"|v:%08"PRIX32"|t:%10"PRIu32"\n",chunkid,version,lockedto);
+	}
+	if (fread(loadbuff,1,4,fd)!=4) {
+		return -1;
+	}
+	ptr = loadbuff;
+	deleted = get32bit(&ptr);
+	printf("# deleted chunks: %"PRIu32"\n",deleted);
+	while (deleted>0) {
+		if (fread(loadbuff,1,8,fd)!=8) {
+			return -1;
+		}
+		ptr = loadbuff;
+		printf("X|i:%016"PRIX64"\n",get64bit(&ptr));
+		deleted--;
+	}
+	return 0;
+}
+
+int chunk_loadxor(FILE *fd) {
+	uint8_t buff[8+1+9*(8+4)];
+	const uint8_t *ptr;
+	uint64_t parityid,chunkid;
+	uint32_t cnt,version;
+	uint8_t level,i;
+
+	if (fread(buff,1,4,fd)!=4) {
+		return -1;
+	}
+	ptr = buff;
+	cnt = get32bit(&ptr);
+	printf("# xor groups: %"PRIu32"\n",cnt);
+	while (cnt>0) {
+		if (fread(buff,1,8+1,fd)!=8+1) {
+			return -1;
+		}
+		ptr = buff;
+		parityid = get64bit(&ptr);
+		level = get8bit(&ptr);
+		if (level<2 || level>9 || fread(buff,1,level*(8+4),fd)!=level*(8+4U)) {
+			return -1;
+		}
+		printf("^|p:%016"PRIX64"|l:%"PRIu8"|c:",parityid,level);
+		ptr = buff;
+		for (i=0 ; i<level ; i++) {
+			chunkid = get64bit(&ptr);
+			version = get32bit(&ptr);
+			printf("%s%016"PRIX64"_%08"PRIX32,i?",":"",chunkid,version);
+		}
+		printf("\n");
+		cnt--;
+	}
+	return 0;
+}
+
 void print_name(FILE *in,uint32_t nleng) {
 	uint8_t buff[1024];
 	uint32_t x,y,i;
@@ -290,7 +387,7 @@ int fs_loadfree(FILE *fd) {
 	return 0;
 }
 
-int fs_load(FILE *fd) {
+int fs_loadheader(FILE *fd) {
 	uint32_t maxnodeid,nextsessionid;
 	uint64_t version;
 	uint8_t hdr[16];
@@ -304,6 +401,13 @@ int fs_load(FILE *fd) {
 	nextsessionid = get32bit(&ptr);
 
 	printf("# maxnodeid: %"PRIu32" ; version: %"PRIu64" ; nextsessionid: %"PRIu32"\n",maxnodeid,version,nextsessionid);
+	return 0;
+}
+
+int fs_load(FILE *fd) {
+	if (fs_loadheader(fd)<0) {
+		return -1;
+	}
 
 	printf("# -------------------------------------------------------------------\n");
 	if (fs_loadnodes(fd)<0) {
@@ -328,8 +432,165 @@ static inline char dispchar(uint8_t c) {
 	return (c>=32 && c<=126)?c:'.';
 }
 
+typedef struct _section {
+	uint32_t tag;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t crc;
+} section;
+
+int fs_loadsection(FILE *fd,section *s) {
+	uint8_t buff[8];
+	const uint8_t *ptr;
+	uint64_t endpos;
+	uint16_t nleng;
+	endpos = s->offset+s->length;
+	if (fseeko(fd,s->offset,SEEK_SET)<0) {
+		return -1;
+	}
+	switch (s->tag) {
+	case FSSECTION_HEAD:
+		if (fs_loadheader(fd)<0) {
+			return -1;
+		}
+		if (s->length==16+8) {	// delta
+			if (fread(buff,1,8,fd)!=8) {
+				return -1;
+			}
+			ptr = buff;
+			printf("# delta of version: %"PRIu64"\n",get64bit(&ptr));
+		}
+		return 0;
+	case FSSECTION_DELN:
+		while ((uint64_t)ftello(fd)<endpos) {
+			if (fread(buff,1,4,fd)!=4) {
+				return -1;
+			}
+			ptr = buff;
+			printf("x|i:%10"PRIu32"\n",get32bit(&ptr));
+		}
+		return 0;
+	case FSSECTION_DELE:
+		while ((uint64_t)ftello(fd)<endpos) {
+			if (fread(buff,1,4+2,fd)!=4+2) {
+				return -1;
+			}
+			ptr = buff;
+			printf("e|p:%10"PRIu32"|n:",get32bit(&ptr));
+			nleng = get16bit(&ptr);
+			print_name(fd,nleng);
+			printf("\n");
+		}
+		return 0;
+	case FSSECTION_CHKD:
+		return chunk_loaddelta(fd);
+	case FSSECTION_NODE:
+		while ((uint64_t)ftello(fd)<endpos) {
+			if (fs_loadnode(fd)!=0) {
+				return -1;
+			}
+		}
+		return 0;
+	case FSSECTION_EDGE:
+		while ((uint64_t)ftello(fd)<endpos) {
+			if (fs_loadedge(fd)!=0) {
+				return -1;
+			}
+		}
+		return 0;
+	case FSSECTION_FREE:
+		return fs_loadfree(fd);
+	case FSSECTION_CHNK:
+		return chunk_load(fd,endpos);
+	case FSSECTION_XORG:
+		return chunk_loadxor(fd);
+	}
+	printf("# unknown section - skipped\n");
+	return 0;
+}
+
+int fs_loadsections(FILE *fd) {
+	uint8_t buff[FSSECTION_ENTRYSIZE];
+	const uint8_t *ptr;
+	uint64_t tableoffset;
+	uint32_t i,cnt;
+	section *sections;
+
+	if (fseeko(fd,-FSSECTION_TRAILERSIZE,SEEK_END)<0 || fread(buff,1,FSSECTION_TRAILERSIZE,fd)!=FSSECTION_TRAILERSIZE || memcmp(buff+8,"MFSM END",8)!=0) {
+		printf("can't read metadata trailer\n");
+		return -1;
+	}
+	ptr = buff;
+	tableoffset = get64bit(&ptr);
+	if (fseeko(fd,tableoffset,SEEK_SET)<0 || fread(buff,1,4,fd)!=4) {
+		printf("can't read section table\n");
+		return -1;
+	}
+	ptr = buff;
+	cnt = get32bit(&ptr);
+	sections = malloc(sizeof(section)*(cnt+1));
+	if (sections==NULL) {
+		return -1;
+	}
+	for (i=0 ; i<cnt ; i++) {
+		if (fread(buff,1,FSSECTION_ENTRYSIZE,fd)!=FSSECTION_ENTRYSIZE) {
+			printf("can't read section table\n");
+			free(sections);
+			return -1;
+		}
+		ptr = buff;
+		sections[i].tag = get32bit(&ptr);
+		sections[i].offset = get64bit(&ptr);
+		sections[i].length = get64bit(&ptr);
+		sections[i].crc = get32bit(&ptr);
+		printf("# section: %c%c%c%c ; offset: %"PRIu64" ; length: %"PRIu64" ; crc: %08"PRIX32"\n",dispchar(sections[i].tag>>24),dispchar(sections[i].tag>>16),dispchar(sections[i].tag>>8),dispchar(sections[i].tag),sections[i].offset,sections[i].length,sections[i].crc);
+	}
+	for (i=0 ; i<cnt ; i++) {
+		if (i==0 || sections[i].tag!=sections[i-1].tag) {
+			printf("# -------------------------------------------------------------------\n");
+		}
+		if (fs_loadsection(fd,sections+i)<0) {
+			printf("error reading metadata (section %c%c%c%c)\n",dispchar(sections[i].tag>>24),dispchar(sections[i].tag>>16),dispchar(sections[i].tag>>8),dispchar(sections[i].tag));
+			free(sections);
+			return -1;
+		}
+	}
+	printf("# -------------------------------------------------------------------\n");
+	free(sections);
+	return 0;
+}
+
+// compressed image ("MFSZ 2.0") is decompressed to temporary file, so the rest of the code can seek in it
+FILE* fs_inflatefile(FILE *fd) {
+	uint8_t *data,*image;
+	uint64_t leng,ileng;
+	FILE *tfd;
+
+	if (fseeko(fd,0,SEEK_END)<0) {
+		return NULL;
+	}
+	leng = ftello(fd);
+	data = malloc(leng);
+	if (data==NULL || fseeko(fd,0,SEEK_SET)<0 || fread(data,1,leng,fd)!=leng) {
+		free(data);
+		return NULL;
+	}
+	if (metastream_inflate(data,leng,&image,&ileng)<0) {
+		free(data);
+		return NULL;
+	}
+	free(data);
+	tfd = tmpfile();
+	if (tfd!=NULL && (fwrite(image,1,ileng,tfd)!=ileng || fseeko(tfd,0,SEEK_SET)<0)) {
+		fclose(tfd);
+		tfd = NULL;
+	}
+	free(image);
+	return tfd;
+}
+
 int fs_loadall(const char *fname) {
-	FILE *fd;
+	FILE *fd,*tfd;
 	uint8_t hdr[8];
 
 	fd = fopen(fname,"r");
@@ -342,6 +603,21 @@ int fs_loadall(const char *fname) {
 		printf("can't read metadata header\n");
 		return -1;
 	}
+	if (metastream_iscompressed(hdr)) {
+		printf("# compressed image\n");
+		tfd = fs_inflatefile(fd);
+		fclose(fd);
+		if (tfd==NULL) {
+			printf("error decompressing metadata\n");
+			return -1;
+		}
+		fd = tfd;
+		if (fread(hdr,1,8,fd)!=8) {
+			printf("can't read metadata header\n");
+			fclose(fd);
+			return -1;
+		}
+	}
 	printf("# header: %c%c%c%c%c%c%c%c (%02X%02X%02X%02X%02X%02X%02X%02X)\n",dispchar(hdr[0]),dispchar(hdr[1]),dispchar(hdr[2]),dispchar(hdr[3]),dispchar(hdr[4]),dispchar(hdr[5]),dispchar(hdr[6]),dispchar(hdr[7]),hdr[0],hdr[1],hdr[2],hdr[3],hdr[4],hdr[5],hdr[6],hdr[7]);
 	if (memcmp(hdr,"MFSM 1.5",8)==0) {
 		if (fs_load(fd)<0) {
@@ -349,11 +625,16 @@ int fs_loadall(const char *fname) {
 			fclose(fd);
 			return -1;
 		}
-		if (chunk_load(fd)<0) {
+		if (chunk_load(fd,0)<0) {
 			printf("error reading metadata (chunks)\n");
 			fclose(fd);
 			return -1;
 		}
+	} else if (memcmp(hdr,"MFSM 2.0",8)==0 || memcmp(hdr,"MFSD 2.0",8)==0) {
+		if (fs_loadsections(fd)<0) {
+			fclose(fd);
+			return -1;
+		}
 	} else {
 		printf("wrong metadata header (old version ?)\n");
 		fclose(fd);
@@ -56,7 +56,7 @@ int chlogfile_cmp(const void *a,const void *b) {
 }
 
 void usage(const char* appname) {
-	fprintf(stderr,"restore metadata:\n\t%s -m <meta data file> -o <restored meta data file> [ <change log file> [ <change log file> [ .... ]]\ndump metadata:\n\t%s -m <meta data file>\nautorestore:\n\t%s -a [-d <data path>]\nprint version:\n\t%s -v\n",appname,appname,appname,appname);
+	fprintf(stderr,"restore metadata:\n\t%s -m <meta data file> -o <restored meta data file> [ <change log file> [ <change log file> [ .... ]]\ndump metadata:\n\t%s -m <meta data file>\nprint change log as text:\n\t%s -c <change log file>\nautorestore:\n\t%s -a [-d <data path>]\nprint version:\n\t%s -v\n",appname,appname,appname,appname,appname);
 }
 
 int main(int argc,char **argv) {
@@ -67,10 +67,11 @@ int main(int argc,char **argv) {
 	char *metadata = NULL;
 	char *datapath = NULL;
 	char *chgdata = NULL;
+	char *chgdump = NULL;
 	char *appname = argv[0];
 	uint32_t dplen = 0;
 
-	while ((ch = getopt(argc, argv, "vm:o:d:a?")) != -1) {
+	while ((ch = getopt(argc, argv, "vm:o:d:c:a?")) != -1) {
 		switch (ch) {
 			case 'v':
 				printf("version: %u.%u.%u\n",VERSMAJ,VERSMID,VERSMIN);
@@ -84,6 +85,9 @@ int main(int argc,char **argv) {
 			case 'd':
 				datapath = strdup(optarg);
 				break;
+			case 'c':
+				chgdump = strdup(optarg);
+				break;
 			case 'a':
 				autorestore=1;
 				break;
@@ -96,6 +100,14 @@ int main(int argc,char **argv) {
 	argc -= optind;
 	argv += optind;
 
+	if (chgdump) {
+		if (autorestore || metadata!=NULL || metaout!=NULL || datapath!=NULL || argc>0) {
+			usage(appname);
+			return 1;
+		}
+		return changelog_dump(chgdump);
+	}
+
 	if ((autorestore==0 && (metadata==NULL || datapath!=NULL)) || (autorestore && (metadata!=NULL || metaout!=NULL))) {
 		usage(appname);
 		return 1;
@@ -25,6 +25,7 @@
 
 #include "MFSCommunication.h"
 #include "filesystem.h"
+#include "changelogrec.h"
 
 #define EAT(clptr,vno,c) { \
 	if (*(clptr)!=(c)) { \
@@ -522,9 +523,42 @@ uint8_t do_write(uint64_t lv,uint32_t ts,char *ptr) {
 	return fs_write(ts,inode,indx,opflag,chunkid);
 }
 
+uint8_t do_xorgroup(uint64_t lv,uint32_t ts,char *ptr) {
+	uint64_t parityid;
+	uint64_t chunkid[9];
+	uint32_t cversion[9];
+	uint32_t level,i;
+	(void)ts;
+	EAT(ptr,lv,'(');
+	GETU64(parityid,ptr);
+	EAT(ptr,lv,',');
+	GETU32(level,ptr);
+	if (level<2 || level>9) {
+		return ERROR_EINVAL;
+	}
+	for (i=0 ; i<level ; i++) {
+		EAT(ptr,lv,',');
+		GETU64(chunkid[i],ptr);
+		EAT(ptr,lv,',');
+		GETU32(cversion[i],ptr);
+	}
+	EAT(ptr,lv,')');
+	return fs_xorgroup(parityid,level,chunkid,cversion);
+}
+
+uint8_t do_xordel(uint64_t lv,uint32_t ts,char *ptr) {
+	uint64_t parityid;
+	(void)ts;
+	EAT(ptr,lv,'(');
+	GETU64(parityid,ptr);
+	EAT(ptr,lv,')');
+	return fs_xordel(parityid);
+}
+
 int restore(const char *rfname) {
 	FILE *fd;
 	char buff[10000];
+	int rl;
 	char *ptr;
 	uint64_t v,lv;
 	uint32_t ts;
@@ -541,7 +575,7 @@ int restore(const char *rfname) {
 		printf("can't open changemeta file: %s\n",rfname);
 		return 1;
 	}
-	while (fgets(buff,10000,fd)) {
+	while ((rl=changelogrec_read(fd,buff,10000))>0) {
 		ptr = buff;
 		GETU64(lv,ptr);
 		if (lv<v) {
@@ -674,6 +708,15 @@ int restore(const char *rfname) {
 					printf("%"PRIu64": unknown entry '%s'\n",lv,ptr);
 				}
 				break;
+			case 'X':
+				if (strncmp(ptr,"XORGROUP",8)==0) {
+					status = do_xorgroup(lv,ts,ptr+8);
+				} else if (strncmp(ptr,"XORDEL",6)==0) {
+					status = do_xordel(lv,ts,ptr+6);
+				} else {
+					printf("%"PRIu64": unknown entry '%s'\n",lv,ptr);
+				}
+				break;
 			default:
 				printf("%"PRIu64": unknown entry '%s'\n",lv,ptr);
 			}
@@ -688,7 +731,36 @@ int restore(const char *rfname) {
 			}
 		}
 	}
+	if (rl<0) {
+		printf("broken changelog entry after version %"PRIu64"\n",lv);
+		fclose(fd);
+		return 1;
+	}
 	fclose(fd);
 	printf("version after applying changelog: %"PRIu64"\n",v);
 	return 0;
 }
+
+int changelog_dump(const char *rfname) {
+	FILE *fd;
+	char buff[10000];
+	int rl;
+	uint64_t lv;
+
+	fd = fopen(rfname,"r");
+	if (fd==NULL) {
+		printf("can't open changemeta file: %s\n",rfname);
+		return 1;
+	}
+	lv = 0;
+	while ((rl=changelogrec_read(fd,buff,10000))>0) {
+		lv = strtoull(buff,NULL,10);
+		fputs(buff,stdout);
+	}
+	fclose(fd);
+	if (rl<0) {
+		fprintf(stderr,"broken changelog entry after version %"PRIu64"\n",lv);
+		return 1;
+	}
+	return 0;
+}
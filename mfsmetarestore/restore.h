@@ -20,5 +20,6 @@
 #define _RESTORE_H_
 
 int restore(const char *rfname);
+int changelog_dump(const char *rfname);
 
 #endif
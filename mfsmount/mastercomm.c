@@ -44,6 +44,7 @@ typedef struct _master_info {
 	time_t lastwrite;
 	int sessionlost;
 	uint32_t sessionid;
+	uint32_t version;	// version of master (0 - older than 1.6.17, which doesn't send it)
 	pthread_mutex_t fdlock;
 	pthread_t rpthid,npthid;
 	struct _master_info *next;
@@ -119,6 +120,20 @@ uint32_t fs_getsrcip() {
 	return srcip;
 }
 
+// pages are used only when every master announced version which can send them (older ones close session)
+uint8_t fs_readdir_pages(void) {
+	master_info *master_item;
+	if (master_head==NULL) {
+		return 0;
+	}
+	for (master_item=master_head ; master_item ; master_item=master_item->next) {
+		if (master_item->version<0x010611) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
 enum {
 	MASTER_CONNECTS = 0,
 	MASTER_BYTESSENT,
@@ -335,6 +350,7 @@ master_info* master_select(uint32_t command_info){
 		case MATOCU_FUSE_RENAME:
 		case MATOCU_FUSE_LINK:
 		case MATOCU_FUSE_GETDIR:
+		case MATOCU_FUSE_READDIR:
 		case MATOCU_FUSE_OPEN:
 		case MATOCU_FUSE_READ_CHUNK:
 		case MATOCU_FUSE_WRITE_CHUNK:
@@ -732,7 +748,7 @@ int fs_connect(master_info* master_item,uint8_t meta,const char *info,const char
 		return -1;
 	}
 	i = get32bit(&rptr);
-	if ( !(i==1 || (meta && i==5) || (meta==0 && (i==13 || i==21)))) {
+	if ( !(i==1 || (meta && i==5) || (meta==0 && (i==13 || i==21 || i==25)))) {
 //		syslog(LOG_WARNING,"master: register error (bad length: %"PRIu32")",i);
 		fprintf(stderr,"got incorrect answer from mfsmaster\n");
 		tcpclose(master_item->fd);
@@ -774,7 +790,7 @@ int fs_connect(master_info* master_item,uint8_t meta,const char *info,const char
 		} else {
 			rptr+=4;
 		}
-		if (i==21) {
+		if (i>=21) {
 			if (mapalluid) {
 				*mapalluid = get32bit(&rptr);
 			} else {
@@ -793,6 +809,11 @@ int fs_connect(master_info* master_item,uint8_t meta,const char *info,const char
 				*mapallgid = 0;
 			}
 		}
+		if (i==25) {
+			master_item->version = get16bit(&rptr)<<16;
+			master_item->version |= get8bit(&rptr)<<8;
+			master_item->version |= get8bit(&rptr);
+		}
 	}
 	free(regbuff);
 	master_item->lastwrite = time(NULL);
@@ -1032,6 +1053,7 @@ int fs_init_master_connection(const char *masterhostname,const char *masterportn
 		master_new->fd = -1;
 		master_new->sessionlost = 0;
 		master_new->sessionid = 0;
+		master_new->version = 0;
 		master_new->disconnect = 0;
 		if(master_head==NULL){
 			master_new->fd = fs_connect(master_new,meta,info,subfolder,passworddigest,flags,rootuid,rootgid,mapalluid,mapallgid);
@@ -1614,6 +1636,42 @@ uint8_t fs_getdir_plus(uint32_t inode,uint32_t uid,uint32_t gid,const uint8_t **
 	return ret;
 }
 
+// one page of directory listing - cookie==0 starts listing, *nextcookie==0 means that there are no more entries
+uint8_t fs_readdir(uint32_t inode,uint32_t uid,uint32_t gid,uint8_t flags,uint64_t cookie,uint32_t maxsize,uint64_t *nextcookie,const uint8_t **dbuff,uint32_t *dbuffsize) {
+	uint8_t *wptr;
+	const uint8_t *rptr;
+	uint32_t i;
+	uint8_t ret;
+	threc *rec = fs_get_my_threc();
+	wptr = fs_createpacket(rec,CUTOMA_FUSE_READDIR,25);
+	if (wptr==NULL) {
+		return ERROR_IO;
+	}
+	put32bit(&wptr,inode);
+	put32bit(&wptr,uid);
+	put32bit(&wptr,gid);
+	put8bit(&wptr,flags);
+	put64bit(&wptr,cookie);
+	put32bit(&wptr,maxsize);
+	rptr = fs_sendandreceive(rec,MATOCU_FUSE_READDIR,&i);
+	if (rptr==NULL) {
+		ret = ERROR_IO;
+	} else if (i==1) {
+		ret = rptr[0];
+	} else if (i<8) {
+		pthread_mutex_lock(&rec->master_used->fdlock);
+		rec->master_used->disconnect = 1;
+		pthread_mutex_unlock(&rec->master_used->fdlock);
+		ret = ERROR_IO;
+	} else {
+		*nextcookie = get64bit(&rptr);
+		*dbuff = rptr;
+		*dbuffsize = i-8;
+		ret = STATUS_OK;
+	}
+	return ret;
+}
+
 /*
 uint8_t fs_check(uint32_t inode,uint8_t dbuff[22]) {
 	uint8_t *wptr;
@@ -23,6 +23,7 @@
 
 void fs_getmasterlocation(uint8_t loc[10]);
 uint32_t fs_getsrcip(void);
+uint8_t fs_readdir_pages(void);
 
 //int fs_direct_connect(void);
 //void fs_direct_close(int rfd);
@@ -45,6 +46,7 @@ uint8_t fs_rename(uint32_t parent_src,uint8_t nleng_src,const uint8_t *name_src,
 uint8_t fs_link(uint32_t inode_src,uint32_t parent_dst,uint8_t nleng_dst,const uint8_t *name_dst,uint32_t uid,uint32_t gid,uint32_t *inode,uint8_t attr[35]);
 uint8_t fs_getdir(uint32_t inode,uint32_t uid,uint32_t gid,const uint8_t **dbuff,uint32_t *dbuffsize);
 uint8_t fs_getdir_plus(uint32_t inode,uint32_t uid,uint32_t gid,const uint8_t **dbuff,uint32_t *dbuffsize);
+uint8_t fs_readdir(uint32_t inode,uint32_t uid,uint32_t gid,uint8_t flags,uint64_t cookie,uint32_t maxsize,uint64_t *nextcookie,const uint8_t **dbuff,uint32_t *dbuffsize);
 
 // uint8_t fs_check(uint32_t inode,uint8_t dbuff[22]);
 
@@ -76,6 +76,9 @@ typedef struct _dirbuf {
 	gid_t gid;
 	uint8_t *p;
 	size_t size;
+	off_t pageidx;	// number of the first entry in 'p' (offsets given to fuse are entry numbers)
+	uint32_t pageents;	// number of complete entries in 'p'
+	uint64_t cookie;	// cookie of the next page (0 - no more pages)
 	void *dcache;
 	pthread_mutex_t lock;
 } dirbuf;
@@ -94,6 +97,7 @@ static int keep_cache = 0;
 static double direntry_cache_timeout = 0.1;
 static double entry_cache_timeout = 0.0;
 static double attr_cache_timeout = 0.1;
+static uint32_t dir_page_size = 0;
 
 //static int local_mode = 0;
 //static int no_attr_cache = 0;
@@ -1060,6 +1064,9 @@ void mfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 		pthread_mutex_init(&(dirinfo->lock),NULL);
 		dirinfo->p = NULL;
 		dirinfo->size = 0;
+		dirinfo->pageidx = 0;
+		dirinfo->pageents = 0;
+		dirinfo->cookie = 0;
 		dirinfo->dcache = NULL;
 		dirinfo->wasread = 0;
 		fi->fh = (unsigned long)dirinfo;
@@ -1071,6 +1078,65 @@ void mfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 	}
 }
 
+// reads whole directory (dir_page_size==0) or one page of it - cookie==0 means the first page
+static int mfs_readdir_fetch(fuse_req_t req, fuse_ino_t ino, dirbuf *dirinfo, uint64_t cookie) {
+	const uint8_t *dbuff,*ptr,*eptr;
+	uint32_t dsize;
+	uint64_t nextcookie;
+	int status;
+	const struct fuse_ctx *ctx;
+
+	ctx = fuse_req_ctx(req);
+	nextcookie = 0;
+	// listing started with pages is continued with pages
+	if (dir_page_size>0 || cookie>0) {
+		status = fs_readdir(ino,ctx->uid,ctx->gid,usedircache?GETDIR_FLAG_WITHATTR:0,cookie,dir_page_size,&nextcookie,&dbuff,&dsize);
+		if (status==ERROR_IO && cookie==0) {
+			// older mfsmaster (e.g. after switching to another one) closes session when asked for a page
+			syslog(LOG_WARNING,"can't read directory page from mfsmaster - reading whole directories from now on");
+			dir_page_size = 0;
+		}
+	}
+	if (dir_page_size==0 && cookie==0) {
+		if (usedircache) {
+			status = fs_getdir_plus(ino,ctx->uid,ctx->gid,&dbuff,&dsize);
+		} else {
+			status = fs_getdir(ino,ctx->uid,ctx->gid,&dbuff,&dsize);
+		}
+	}
+	status = mfs_errorconv(status);
+	if (status!=0) {
+		return status;
+	}
+	if (dirinfo->dcache) {
+		dcache_release(dirinfo->dcache);
+		dirinfo->dcache = NULL;
+	}
+	if (dirinfo->p) {
+		free(dirinfo->p);
+	}
+	dirinfo->size = 0;
+	dirinfo->pageents = 0;
+	dirinfo->cookie = 0;
+	dirinfo->p = malloc(dsize);
+	if (dirinfo->p == NULL) {
+		return EINVAL;
+	}
+	memcpy(dirinfo->p,dbuff,dsize);
+	dirinfo->size = dsize;
+	dirinfo->cookie = nextcookie;
+	ptr = dirinfo->p;
+	eptr = dirinfo->p+dsize;
+	while (ptr<eptr && ptr+ptr[0]+(usedircache?40:6)<=eptr) {
+		ptr += ptr[0]+(usedircache?40:6);
+		dirinfo->pageents++;
+	}
+	if (usedircache) {
+		dirinfo->dcache = dcache_new(ctx,ino,dirinfo->p,dirinfo->size);
+	}
+	return 0;
+}
+
 void mfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
 	int status;
         dirbuf *dirinfo = (dirbuf *)((unsigned long)(fi->fh));
@@ -1082,8 +1148,8 @@ void mfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct
 	uint8_t nleng;
 	uint32_t inode;
 	uint8_t type;
+	off_t i;
 	struct stat stbuf;
-	const struct fuse_ctx *ctx;
 
 	mfs_stats_inc(OP_READDIR);
 	if (debug_mode) {
@@ -1094,74 +1160,64 @@ void mfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct
 		return;
 	}
 	pthread_mutex_lock(&(dirinfo->lock));
-	if (dirinfo->wasread==0 || (dirinfo->wasread==1 && off==0)) {
-		const uint8_t *dbuff;
-		uint32_t dsize;
-		ctx = fuse_req_ctx(req);
-		if (usedircache) {
-			status = fs_getdir_plus(ino,ctx->uid,ctx->gid,&dbuff,&dsize);
-		} else {
-			status = fs_getdir(ino,ctx->uid,ctx->gid,&dbuff,&dsize);
-		}
-		status = mfs_errorconv(status);
+	// cookies can't be used to go back (master cursor moves forward only), so seek back starts listing again
+	if (dirinfo->wasread==0 || (dirinfo->wasread==1 && off==0) || off<dirinfo->pageidx) {
+		dirinfo->pageidx = 0;
+		status = mfs_readdir_fetch(req,ino,dirinfo,0);
 		if (status!=0) {
+			dirinfo->wasread = 0;
 			fuse_reply_err(req, status);
 			pthread_mutex_unlock(&(dirinfo->lock));
 			return;
 		}
-		if (dirinfo->dcache) {
-			dcache_release(dirinfo->dcache);
-		}
-		if (dirinfo->p) {
-			free(dirinfo->p);
-		}
-		dirinfo->p = malloc(dsize);
-		if (dirinfo->p == NULL) {
-			fuse_reply_err(req,EINVAL);
+	}
+	dirinfo->wasread=1;
+	// offsets are entry numbers counted from the beginning of the listing, next page is fetched when all entries from the current one were sent
+	while (off>=dirinfo->pageidx+(off_t)(dirinfo->pageents) && dirinfo->cookie!=0) {
+		dirinfo->pageidx += dirinfo->pageents;
+		status = mfs_readdir_fetch(req,ino,dirinfo,dirinfo->cookie);
+		if (status!=0) {
+			dirinfo->wasread = 0;
+			fuse_reply_err(req, status);
 			pthread_mutex_unlock(&(dirinfo->lock));
 			return;
 		}
-		memcpy(dirinfo->p,dbuff,dsize);
-		dirinfo->size = dsize;
-		if (usedircache) {
-			dirinfo->dcache = dcache_new(ctx,ino,dirinfo->p,dirinfo->size);
-		}
 	}
-	dirinfo->wasread=1;
 
-	if (off>=(off_t)(dirinfo->size)) {
+	if (off>=dirinfo->pageidx+(off_t)(dirinfo->pageents)) {
 		fuse_reply_buf(req, NULL, 0);
 	} else {
 		if (size>READDIR_BUFFSIZE) {
 			size=READDIR_BUFFSIZE;
 		}
-		ptr = dirinfo->p+off;
-		eptr = dirinfo->p+dirinfo->size;
+		// skip entries already sent - only complete entries are counted, so this never leaves the page
+		ptr = dirinfo->p;
+		for (i=dirinfo->pageidx ; i<off ; i++) {
+			ptr += ptr[0]+(usedircache?40:6);
+		}
 		opos = 0;
 		end = 0;
 
-		while (ptr<eptr && end==0) {
+		while (off<dirinfo->pageidx+(off_t)(dirinfo->pageents) && end==0) {
 			nleng = ptr[0];
 			ptr++;
 			memcpy(name,ptr,nleng);
 			name[nleng]=0;
 			ptr+=nleng;
-			off+=nleng+(usedircache?40:6);
-			if (ptr+5<=eptr) {
-				inode = get32bit(&ptr);
-				if (usedircache) {
-					mfs_attr_to_stat(inode,ptr,&stbuf);
-					ptr+=35;
-				} else {
-					type = get8bit(&ptr);
-					mfs_type_to_stat(inode,type,&stbuf);
-				}
-				oleng = fuse_add_direntry(req, buffer + opos, size - opos, name, &stbuf, off);
-				if (opos+oleng>size) {
-					end=1;
-				} else {
-					opos+=oleng;
-				}
+			off++;
+			inode = get32bit(&ptr);
+			if (usedircache) {
+				mfs_attr_to_stat(inode,ptr,&stbuf);
+				ptr+=35;
+			} else {
+				type = get8bit(&ptr);
+				mfs_type_to_stat(inode,type,&stbuf);
+			}
+			oleng = fuse_add_direntry(req, buffer + opos, size - opos, name, &stbuf, off);
+			if (opos+oleng>size) {
+				end=1;
+			} else {
+				opos+=oleng;
 			}
 		}
 
@@ -1682,8 +1738,9 @@ void mfs_setlk(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct
 */
 #endif
 
-void mfs_init(int debug_mode_in,int keep_cache_in,double direntry_cache_timeout_in,double entry_cache_timeout_in,double attr_cache_timeout_in) {
+void mfs_init(int debug_mode_in,int keep_cache_in,double direntry_cache_timeout_in,double entry_cache_timeout_in,double attr_cache_timeout_in,uint32_t dir_page_size_in) {
 	debug_mode = debug_mode_in;
+	dir_page_size = fs_readdir_pages()?dir_page_size_in:0;
 	keep_cache = keep_cache_in;
 	direntry_cache_timeout = direntry_cache_timeout_in;
 	entry_cache_timeout = entry_cache_timeout_in;
@@ -60,6 +60,16 @@ static inline const char* mfs_strerror(uint8_t status) {
 	return errtab[status];
 }
 
+static inline const char* goal_str(uint8_t goal) {
+	static char buff[8];
+	if (GOAL_IS_XOR(goal)) {
+		snprintf(buff,8,"xor%"PRIu8,(uint8_t)GOAL_XOR_LEVEL(goal));
+	} else {
+		snprintf(buff,8,"%"PRIu8,goal);
+	}
+	return buff;
+}
+
 static uint8_t humode=0;
 
 #define PHN_USESI       0x01
@@ -861,7 +871,7 @@ int get_goal(const char *fname,uint8_t mode) {
 			free(buff);
 			return -1;
 		}
-		printf("%s: %"PRIu8"\n",fname,goal);
+		printf("%s: %s\n",fname,goal_str(goal));
 	} else {
 		fn = get8bit(&rptr);
 		dn = get8bit(&rptr);
@@ -869,13 +879,13 @@ int get_goal(const char *fname,uint8_t mode) {
 		for (i=0 ; i<fn ; i++) {
 			goal = get8bit(&rptr);
 			cnt = get32bit(&rptr);
-			printf(" files with goal        %"PRIu8" :",goal);
+			printf(" files with goal        %4s :",goal_str(goal));
 			print_number(" ","\n",cnt,0,1);
 		}
 		for (i=0 ; i<dn ; i++) {
 			goal = get8bit(&rptr);
 			cnt = get32bit(&rptr);
-			printf(" directories with goal  %"PRIu8" :",goal);
+			printf(" directories with goal  %4s :",goal_str(goal));
 			print_number(" ","\n",cnt,0,1);
 		}
 	}
@@ -1210,7 +1220,7 @@ int set_goal(const char *fname,uint8_t goal,uint8_t mode) {
 	notpermitted = get32bit(&rptr);
 	if ((mode&SMODE_RMASK)==0) {
 		if (changed || mode==SMODE_SET) {
-			printf("%s: %"PRIu8"\n",fname,goal);
+			printf("%s: %s\n",fname,goal_str(goal));
 		} else {
 			printf("%s: goal not changed\n",fname);
 		}
@@ -2222,6 +2232,8 @@ void usage(int f) {
 			fprintf(stderr," GOAL+ - increase goal to given value\n");
 			fprintf(stderr," GOAL- - decrease goal to given value\n");
 			fprintf(stderr," GOAL - just set goal to given value\n");
+			fprintf(stderr," GOAL is the number of copies (1-9) or xorN (N=2-9) - one copy of every chunk and one parity chunk for every N chunks\n");
+			fprintf(stderr," goal order: 1 < xor9 < ... < xor2 < 2 < ... < 9\n");
 			break;
 		case MFSGETTRASHTIME:
 			fprintf(stderr,"get objects trashtime (how many seconds file should be left in trash)\n\nusage: mfsgettrashtime [-nhHr] name [name ...]\n");
@@ -2487,15 +2499,22 @@ int main(int argc,char **argv) {
 		}
 		if (f==MFSSETGOAL) {
 			char *p = argv[0];
-			if (p[0]>'0' && p[0]<='9' && (p[1]=='\0' || ((p[1]=='-' || p[1]=='+') && p[2]=='\0'))) {
+			if (strncmp(p,"xor",3)==0 && p[3]>'1' && p[3]<='9') {
+				goal = GOAL_XOR(p[3]-'0');
+				p+=3;
+			} else if (p[0]>'0' && p[0]<='9') {
 				goal = p[0]-'0';
+			} else {
+				goal = 0;
+			}
+			if (goal>0 && (p[1]=='\0' || ((p[1]=='-' || p[1]=='+') && p[2]=='\0'))) {
 				if (p[1]=='-') {
 					smode=SMODE_DECREASE;
 				} else if (p[1]=='+') {
 					smode=SMODE_INCREASE;
 				}
 			} else {
-				fprintf(stderr,"goal should be given as a digit between 1 and 9 optionally folowed by '-' or '+'\n");
+				fprintf(stderr,"goal should be given as a digit between 1 and 9 or as 'xor' followed by a digit between 2 and 9, optionally folowed by '-' or '+'\n");
 				usage(f);
 			}
 			argc--;
@@ -56,8 +56,10 @@
 #define CHARTS_OPEN 17
 #define CHARTS_READ 18
 #define CHARTS_WRITE 19
+#define CHARTS_FSMEMALLOC 20
+#define CHARTS_FSMEMUSED 21
 
-#define CHARTS 20
+#define CHARTS 22
 
 /* name , join mode , percent , scale , multiplier , divisor */
 #define STATDEFS { \
@@ -81,6 +83,8 @@
 	{"open"         ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
 	{"read"         ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
 	{"write"        ,CHARTS_MODE_ADD,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"fsmemalloc"   ,CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1, 1}, \
+	{"fsmemused"    ,CHARTS_MODE_MAX,0,CHARTS_SCALE_NONE ,   1, 1}, \
 	{NULL           ,0              ,0,0                 ,   0, 0}  \
 };
 
@@ -103,6 +107,7 @@ static struct itimerval it_set;
 void chartsdata_refresh(void) {
 	uint64_t data[CHARTS];
 	uint32_t fsdata[16];
+	uint64_t memalloc,memused;
 	uint32_t i,del,repl; //,bin,bout,opr,opw,dbr,dbw,dopr,dopw,repl;
 	struct itimerval uc,pc;
 	uint32_t ucusec,pcusec;
@@ -147,6 +152,9 @@ void chartsdata_refresh(void) {
 	for (i=0 ; i<16 ; i++) {
 		data[CHARTS_STATFS+i]=fsdata[i];
 	}
+	fs_meminfo(&memalloc,&memused);
+	data[CHARTS_FSMEMALLOC]=memalloc;
+	data[CHARTS_FSMEMUSED]=memused;
 
 	charts_add(data,get_current_time()-60);
 }
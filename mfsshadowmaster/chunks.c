@@ -45,8 +45,14 @@
 #define USE_FLIST_BUCKETS 1
 #define USE_CHUNK_BUCKETS 1
 
-#define HASHSIZE 65536
-#define HASHPOS(chunkid) (((uint32_t)chunkid)&0xFFFF)
+/* chunk hash - linear hashing: when average chain becomes longer than HASHMAXLOAD next bucket (in order) is split
+   into itself and bucket number 'hashmask+1' higher, so the table grows by one bucket at a time and never has to be
+   rehashed at once; buckets are allocated in segments, so growing never moves existing buckets */
+#define HASHSEGBITS 16
+#define HASHSEGSIZE (1<<HASHSEGBITS)
+#define HASHSEGMAX 32768
+#define HASHMAXLOAD 4
+#define HASHBUCKET(pos) (chunkhash[(pos)>>HASHSEGBITS]+((pos)&(HASHSEGSIZE-1)))
 
 /* log print control */
 //#define LOG_COUNT 1000
@@ -132,6 +138,7 @@ typedef struct chunk {
 	uint8_t needverincrease:1;
 	uint8_t interrupted:1;
 	uint8_t operation:4;
+	uint8_t xorpart:1;	// member or parity of xor group - group is in xorparthash
 	uint32_t lockedto;
 //	uint32_t lockedby;
 	slist *slisthead;
@@ -152,7 +159,117 @@ static chunk_bucket *cbhead = NULL;
 static chunk *chfreehead = NULL;
 #endif /* USE_CHUNK_BUCKETS */
 
-static chunk *chunkhash[HASHSIZE];
+/* xor groups (goal xorN) - only kept in sync with master here (XORGROUP/XORDEL and XORG section), groups are built
+   and rebuilt by master */
+#define XOR_MAXLEVEL 9
+
+typedef struct _xorgroup {
+	uint64_t parityid;
+	uint64_t chunkid[XOR_MAXLEVEL];
+	uint32_t version[XOR_MAXLEVEL];
+	uint8_t level;
+	struct _xorgroup *next,**prev;
+} xorgroup;
+
+static xorgroup *xorgroups = NULL;
+static uint32_t xorgroupscnt = 0;
+
+// group of every chunk with 'xorpart' set - kept outside chunk structure (only small part of chunks is in groups)
+typedef struct _xorpart {
+	uint64_t chunkid;
+	xorgroup *g;
+	struct _xorpart *next;
+} xorpart;
+
+#define XORPART_MINHASHSIZE 1024
+
+static xorpart **xorparthash = NULL;
+static uint32_t xorparthashsize = 0;
+static uint32_t xorpartcnt = 0;
+
+static inline uint32_t chunk_xorpart_hashpos(uint64_t chunkid) {
+	return ((uint32_t)chunkid) & (xorparthashsize-1);
+}
+
+static void chunk_xorpart_rehash(uint32_t newsize) {
+	xorpart **oldhash,*xp,*xpn;
+	uint32_t i,oldsize;
+	oldhash = xorparthash;
+	oldsize = xorparthashsize;
+	xorparthash = (xorpart**)malloc(sizeof(xorpart*)*newsize);
+	for (i=0 ; i<newsize ; i++) {
+		xorparthash[i] = NULL;
+	}
+	xorparthashsize = newsize;
+	for (i=0 ; i<oldsize ; i++) {
+		for (xp=oldhash[i] ; xp ; xp=xpn) {
+			xpn = xp->next;
+			xp->next = xorparthash[chunk_xorpart_hashpos(xp->chunkid)];
+			xorparthash[chunk_xorpart_hashpos(xp->chunkid)] = xp;
+		}
+	}
+	free(oldhash);
+}
+
+static inline xorgroup* chunk_xorpart_get(uint64_t chunkid) {
+	xorpart *xp;
+	if (xorpartcnt==0) {
+		return NULL;
+	}
+	for (xp=xorparthash[chunk_xorpart_hashpos(chunkid)] ; xp ; xp=xp->next) {
+		if (xp->chunkid==chunkid) {
+			return xp->g;
+		}
+	}
+	return NULL;
+}
+
+static inline void chunk_xorpart_add(uint64_t chunkid,xorgroup *g) {
+	xorpart *xp;
+	if (xorpartcnt>=xorparthashsize) {
+		chunk_xorpart_rehash((xorparthashsize<XORPART_MINHASHSIZE)?XORPART_MINHASHSIZE:xorparthashsize*2);
+	}
+	xp = (xorpart*)malloc(sizeof(xorpart));
+	xp->chunkid = chunkid;
+	xp->g = g;
+	xp->next = xorparthash[chunk_xorpart_hashpos(chunkid)];
+	xorparthash[chunk_xorpart_hashpos(chunkid)] = xp;
+	xorpartcnt++;
+}
+
+// removes entry only if it belongs to given group - returns 1 if removed
+static inline int chunk_xorpart_delete(uint64_t chunkid,xorgroup *g) {
+	xorpart *xp,**xpp;
+	if (xorpartcnt==0) {
+		return 0;
+	}
+	xpp = xorparthash+chunk_xorpart_hashpos(chunkid);
+	while ((xp=*xpp)) {
+		if (xp->chunkid==chunkid) {
+			if (xp->g!=g) {
+				return 0;
+			}
+			*xpp = xp->next;
+			free(xp);
+			xorpartcnt--;
+			return 1;
+		}
+		xpp = &(xp->next);
+	}
+	return 0;
+}
+
+static inline xorgroup* chunk_xorgroup(const chunk *c) {
+	return (c->xorpart)?chunk_xorpart_get(c->chunkid):NULL;
+}
+
+#define CHUNK_IS_PARITY(c) ((c)->xorpart && chunk_xorgroup(c)->parityid==(c)->chunkid)
+
+static chunk **chunkhash[HASHSEGMAX];
+static uint32_t chunkhashmask;	// bucket count at the beginning of current round - 1
+static uint32_t chunkhashsplit;	// next bucket to split
+static uint32_t chunkhashsize;	// number of buckets (chunkhashmask+1+chunkhashsplit)
+static uint64_t chunkhashelements;
 static uint64_t nextchunkid=1;
 #define LOCKTIMEOUT 120
 
@@ -169,19 +286,16 @@ static uint32_t ReplicationsDelayInit=300;
 // static uint32_t MaxRepl=1;
 // static uint32_t MaxDel=100;
 // static uint32_t LoopTime=300;
-// static uint32_t HashSteps=1+((HASHSIZE)/3600);
 static uint32_t MaxWriteRepl;
 static uint32_t MaxReadRepl;
 static uint32_t MaxDel;
 static double TmpMaxDelFrac;
 static uint32_t TmpMaxDel;
 static uint32_t LoopTime;
-static uint32_t HashSteps;
 
 //#define MAXCOPY 2
 //#define MAXDEL 6
 //#define LOOPTIME 3600
-//#define HASHSTEPS (1+((HASHSIZE)/(LOOPTIME)))
 
 #define ACCEPTABLE_DIFFERENCE 0.01
 
@@ -213,6 +327,10 @@ static chunk* lastchunkptr=NULL;
 
 static uint32_t chunks;
 
+// xor goals are counted with goal 1 (one full copy of every chunk)
+#define CHUNK_GOAL_ROW(g) (GOAL_IS_XOR(g)?1:(((g)>9)?10:(g)))
+// copies of a new chunk - chunks with xor goal are kept in two copies until they are added to a group
+#define CHUNK_NEW_COPIES(g) (GOAL_IS_XOR(g)?2:(g))
 uint32_t allchunkcounts[11][11];
 uint32_t regularchunkcounts[11][11];
 
@@ -334,15 +452,80 @@ static inline void chunk_free(chunk* p) {
 
 #endif /* USE_CHUNK_BUCKETS */
 
+static inline uint32_t chunk_hashpos(uint64_t chunkid) {
+	uint32_t pos;
+	pos = ((uint32_t)chunkid) & (chunkhashmask*2+1);
+	if (pos>=chunkhashsize) {
+		pos &= chunkhashmask;
+	}
+	return pos;
+}
+
+// moves chunks from the next bucket to split into the new one - only to the bucket with higher number, so iterating by bucket number never misses any chunk
+static inline void chunk_hash_split(void) {
+	uint32_t newpos,newmask;
+	chunk *c,**cp,**np;
+
+	newpos = chunkhashsize;
+	if (newpos>>HASHSEGBITS>=HASHSEGMAX) {
+		return;
+	}
+	if (chunkhash[newpos>>HASHSEGBITS]==NULL) {
+		chunkhash[newpos>>HASHSEGBITS] = (chunk**)calloc(HASHSEGSIZE,sizeof(chunk*));
+		if (chunkhash[newpos>>HASHSEGBITS]==NULL) {
+			return;
+		}
+	}
+	newmask = chunkhashmask*2+1;
+	cp = HASHBUCKET(chunkhashsplit);
+	np = HASHBUCKET(newpos);
+	while ((c=*cp)!=NULL) {
+		if ((((uint32_t)(c->chunkid))&newmask)==newpos) {
+			*cp = c->next;
+			c->next = NULL;
+			*np = c;
+			np = &(c->next);
+		} else {
+			cp = &(c->next);
+		}
+	}
+	chunkhashsize++;
+	chunkhashsplit++;
+	if (chunkhashsplit>chunkhashmask) {
+		chunkhashmask = newmask;
+		chunkhashsplit = 0;
+	}
+}
+
+static inline void chunk_hash_init(void) {
+	uint32_t i;
+	for (i=0 ; i<HASHSEGMAX ; i++) {
+		if (chunkhash[i]) {
+			free(chunkhash[i]);
+			chunkhash[i] = NULL;
+		}
+	}
+	chunkhash[0] = (chunk**)calloc(HASHSEGSIZE,sizeof(chunk*));
+	chunkhashmask = HASHSEGSIZE-1;
+	chunkhashsplit = 0;
+	chunkhashsize = HASHSEGSIZE;
+	chunkhashelements = 0;
+}
+
 chunk* chunk_new(uint64_t chunkid) {
-	uint32_t chunkpos = HASHPOS(chunkid);
+	chunk **bucket;
 	chunk *newchunk;
 	newchunk = chunk_malloc();
 	chunks++;
 	allchunkcounts[0][0]++;
 	regularchunkcounts[0][0]++;
-	newchunk->next = chunkhash[chunkpos];
-	chunkhash[chunkpos] = newchunk;
+	if (chunkhashelements>=(uint64_t)chunkhashsize*HASHMAXLOAD) {
+		chunk_hash_split();
+	}
+	chunkhashelements++;
+	bucket = HASHBUCKET(chunk_hashpos(chunkid));
+	newchunk->next = *bucket;
+	*bucket = newchunk;
 	newchunk->chunkid = chunkid;
 	newchunk->version = 0;
 	newchunk->goal = 0;
@@ -352,6 +535,7 @@ chunk* chunk_new(uint64_t chunkid) {
 	newchunk->needverincrease = 1;
 	newchunk->interrupted = 0;
 	newchunk->operation = NONE;
+	newchunk->xorpart = 0;
 	newchunk->slisthead = NULL;
 	newchunk->flisthead = NULL;
 	lastchunkid = chunkid;
@@ -360,12 +544,11 @@ chunk* chunk_new(uint64_t chunkid) {
 }
 
 chunk* chunk_find(uint64_t chunkid) {
-	uint32_t chunkpos = HASHPOS(chunkid);
 	chunk *chunkit;
 	if (lastchunkid==chunkid) {
 		return lastchunkptr;
 	}
-	for (chunkit = chunkhash[chunkpos] ; chunkit ; chunkit = chunkit->next ) {
+	for (chunkit = *HASHBUCKET(chunk_hashpos(chunkid)) ; chunkit ; chunkit = chunkit->next ) {
 		if (chunkit->chunkid == chunkid) {
 			lastchunkid = chunkid;
 			lastchunkptr = chunkit;
@@ -395,18 +578,14 @@ void chunk_delete(chunk* c) {
 	}
 */
 	chunks--;
-	allchunkcounts[c->goal][0]--;
-	regularchunkcounts[c->goal][0]--;
+	allchunkcounts[CHUNK_GOAL_ROW(c->goal)][0]--;
+	regularchunkcounts[CHUNK_GOAL_ROW(c->goal)][0]--;
 	chunk_free(c);
 }
 
 static inline void chunk_state_change(uint8_t oldgoal,uint8_t newgoal,uint8_t oldavc,uint8_t newavc,uint8_t oldrvc,uint8_t newrvc) {
-	if (oldgoal>9) {
-		oldgoal=10;
-	}
-	if (newgoal>9) {
-		newgoal=10;
-	}
+	oldgoal = CHUNK_GOAL_ROW(oldgoal);
+	newgoal = CHUNK_GOAL_ROW(newgoal);
 	if (oldavc>9) {
 		oldavc=10;
 	}
@@ -470,7 +649,7 @@ void chunk_refresh_goal(chunk* c) {
 	uint8_t oldgoal = c->goal;
 	c->goal = 0;
 	for (f=c->flisthead ; f ; f=f->next) {
-		if (f->goal > c->goal) {
+		if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
 			c->goal = f->goal;
 		}
 	}
@@ -493,7 +672,7 @@ int chunk_set_file_goal(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t go
 		if (f->inode == inode && f->indx == indx) {
 			f->goal = goal;
 		}
-		if (f->goal > c->goal) {
+		if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
 			c->goal = f->goal;
 		}
 	}
@@ -520,7 +699,7 @@ int shadow_chunk_delete_file(uint64_t chunkid,uint32_t inode,uint16_t indx) {
                         flist_free(f);
                         i=1;
                 } else {
-                        if (f->goal > c->goal) {
+                        if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
                                 c->goal = f->goal;
                         }
                         fp = &(f->next);
@@ -555,7 +734,7 @@ int chunk_delete_file(uint64_t chunkid,uint32_t inode,uint16_t indx) {
 			flist_free(f);
 			i=1;
 		} else {
-			if (f->goal > c->goal) {
+			if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
 				c->goal = f->goal;
 			}
 			fp = &(f->next);
@@ -590,7 +769,7 @@ int shadow_chunk_add_file(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t
                         f->goal = goal;
                         i=1;
                 }
-                if (f->goal > c->goal) {
+                if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
                         c->goal = f->goal;
                 }
         }
@@ -601,7 +780,7 @@ int shadow_chunk_add_file(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t
                 f->goal = goal;
                 f->next = c->flisthead;
                 c->flisthead = f;
-                if (goal > c->goal) {
+                if (GOAL_RANK(goal) > GOAL_RANK(c->goal)) {
                         c->goal = goal;
                 }
         } else {
@@ -630,7 +809,7 @@ int chunk_add_file(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t goal) {
 			f->goal = goal;
 			i=1;
 		}
-		if (f->goal > c->goal) {
+		if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
 			c->goal = f->goal;
 		}
 	}
@@ -641,7 +820,7 @@ int chunk_add_file(uint64_t chunkid,uint32_t inode,uint16_t indx,uint8_t goal) {
 		f->goal = goal;
 		f->next = c->flisthead;
 		c->flisthead = f;
-		if (goal > c->goal) {
+		if (GOAL_RANK(goal) > GOAL_RANK(c->goal)) {
 			c->goal = goal;
 		}
 	} else {
@@ -779,7 +958,7 @@ int shadow_chunk_multi_modify(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid,u
 			*nchunkid = c->chunkid;
 			oc->goal = 0;
 			for (f=oc->flisthead ; f ; f=f->next) {
-				if (f->goal > oc->goal) {
+				if (GOAL_RANK(f->goal) > GOAL_RANK(oc->goal)) {
 					oc->goal = f->goal;
 				}
 			}
@@ -793,14 +972,15 @@ int chunk_multi_modify(uint64_t *nchunkid,uint64_t ochunkid,uint32_t inode,uint1
 	void* ptrs[65536];
 	uint16_t servcount;
 	slist *os,*s;
-	uint8_t oldgoal;
+	uint8_t oldgoal,copies;
 	uint32_t i;
 	chunk *oc,*c;
 	flist *f,**fp;
 
 	if (ochunkid==0) {	// new chunk
 //		servcount = matocsserv_getservers_ordered(ptrs,MINMAXRND,NULL,NULL);
-		servcount = matocsserv_getservers_wrandom(ptrs,goal);
+		copies = CHUNK_NEW_COPIES(goal);
+		servcount = matocsserv_getservers_wrandom(ptrs,copies);
 		if (servcount==0) {
 			uint16_t uscount,tscount;
 			double minusage,maxusage;
@@ -821,12 +1001,12 @@ int chunk_multi_modify(uint64_t *nchunkid,uint64_t ochunkid,uint32_t inode,uint1
 		c->flisthead->indx = indx;
 		c->flisthead->goal = goal;
 		c->flisthead->next = NULL;
-		if (servcount<goal) {
+		if (servcount<copies) {
 			c->allvalidcopies = servcount;
 			c->regularvalidcopies = servcount;
 		} else {
-			c->allvalidcopies = goal;
-			c->regularvalidcopies = goal;
+			c->allvalidcopies = copies;
+			c->regularvalidcopies = copies;
 		}
 		for (i=0 ; i<c->allvalidcopies ; i++) {
 			s = slist_malloc();
@@ -932,7 +1112,7 @@ int chunk_multi_modify(uint64_t *nchunkid,uint64_t ochunkid,uint32_t inode,uint1
 				oldgoal = oc->goal;
 				oc->goal = 0;
 				for (f=oc->flisthead ; f ; f=f->next) {
-					if (f->goal > oc->goal) {
+					if (GOAL_RANK(f->goal) > GOAL_RANK(oc->goal)) {
 						oc->goal = f->goal;
 					}
 				}
@@ -989,7 +1169,7 @@ int shadow_chunk_multi_truncate(uint32_t ts,uint64_t *nchunkid,uint64_t ochunkid
 		*nchunkid = c->chunkid;
                 oc->goal = 0;
                 for (f=oc->flisthead ; f ; f=f->next) {
-                	if (f->goal > oc->goal) {
+                	if (GOAL_RANK(f->goal) > GOAL_RANK(oc->goal)) {
                         	oc->goal = f->goal;
                         }
                 }
@@ -1091,7 +1271,7 @@ int chunk_multi_truncate(uint64_t *nchunkid,uint64_t ochunkid,uint32_t length,ui
 			oldgoal = oc->goal;
 			oc->goal = 0;
 			for (f=oc->flisthead ; f ; f=f->next) {
-				if (f->goal > oc->goal) {
+				if (GOAL_RANK(f->goal) > GOAL_RANK(oc->goal)) {
 					oc->goal = f->goal;
 				}
 			}
@@ -1146,7 +1326,7 @@ int chunk_repair(uint32_t inode,uint16_t indx,uint64_t ochunkid,uint32_t *nversi
 				*fp = f->next;
 				flist_free(f);
 			} else {
-				if (f->goal > c->goal) {
+				if (GOAL_RANK(f->goal) > GOAL_RANK(c->goal)) {
 					c->goal = f->goal;
 				}
 				fp = &(f->next);
@@ -1420,8 +1600,8 @@ void chunk_server_disconnected(void *ptr) {
 	uint8_t valid,vs;
 	//jobsnorepbefore = main_time()+ReplicationsDelayDisconnect;
 	//jobslastdisconnect = main_time();
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (c=chunkhash[i] ; c ; c=c->next ) {
+	for (i=0 ; i<chunkhashsize ; i++) {
+		for (c=*HASHBUCKET(i) ; c ; c=c->next ) {
 			st = &(c->slisthead);
 			while (*st) {
 				s = *st;
@@ -2216,8 +2396,8 @@ void chunk_dump(void) {
 	uint32_t i,lockedto,now;
 	now = time(NULL);
 
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (c=chunkhash[i] ; c ; c=c->next) {
+	for (i=0 ; i<chunkhashsize ; i++) {
+		for (c=*HASHBUCKET(i) ; c ; c=c->next) {
 			lockedto = c->lockedto;
 			if (lockedto<now) {
 				lockedto = 0;
@@ -2300,8 +2480,8 @@ void chunk_store(FILE *fd) {
 	fwrite(hdr,1,8,fd);
 	j=0;
 	ptr = storebuff;
-	for (i=0 ; i<HASHSIZE ; i++) {
-		for (c=chunkhash[i] ; c ; c=c->next) {
+	for (i=0 ; i<chunkhashsize ; i++) {
+		for (c=*HASHBUCKET(i) ; c ; c=c->next) {
 			chunkid = c->chunkid;
 			put64bit(&ptr,chunkid);
 			version = c->version;
@@ -2324,6 +2504,158 @@ void chunk_store(FILE *fd) {
 	fwrite(storebuff,1,CHUNKFSIZE*j,fd);
 }
 
+/* ---- xor groups */
+
+static void chunk_xor_link(xorgroup *g) {
+	chunk *c;
+	uint8_t i;
+	for (i=0 ; i<g->level ; i++) {
+		c = chunk_find(g->chunkid[i]);
+		if (c!=NULL && c->xorpart==0) {
+			c->xorpart = 1;
+			chunk_xorpart_add(c->chunkid,g);
+		}
+	}
+	c = chunk_find(g->parityid);
+	if (c!=NULL) {
+		c->xorpart = 1;
+		chunk_xorpart_add(c->chunkid,g);
+		chunk_state_change(c->goal,GOAL_XOR(g->level),c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+		c->goal = GOAL_XOR(g->level);
+	}
+	g->next = xorgroups;
+	if (g->next) {
+		g->next->prev = &(g->next);
+	}
+	g->prev = &xorgroups;
+	xorgroups = g;
+	xorgroupscnt++;
+}
+
+static void chunk_xor_unlink(xorgroup *g) {
+	chunk *c;
+	uint8_t i;
+	for (i=0 ; i<g->level ; i++) {
+		if (chunk_xorpart_delete(g->chunkid[i],g) && (c=chunk_find(g->chunkid[i]))!=NULL) {
+			c->xorpart = 0;
+		}
+	}
+	if (chunk_xorpart_delete(g->parityid,g) && (c=chunk_find(g->parityid))!=NULL) {
+		c->xorpart = 0;
+		chunk_state_change(c->goal,0,c->allvalidcopies,c->allvalidcopies,c->regularvalidcopies,c->regularvalidcopies);
+		c->goal = 0;	// no files - parity will be deleted as unused chunk
+	}
+	*(g->prev) = g->next;
+	if (g->next) {
+		g->next->prev = g->prev;
+	}
+	xorgroupscnt--;
+}
+
+// new group - parity chunk gets next chunk id (the same as in master)
+int chunk_xor_add(uint64_t parityid,uint8_t level,const uint64_t *chunkid,const uint32_t *version) {
+	xorgroup *g;
+	chunk *c;
+	uint8_t i;
+	if (level<2 || level>XOR_MAXLEVEL) {
+		return ERROR_EINVAL;
+	}
+	if (parityid!=nextchunkid) {
+		return ERROR_MISMATCH;
+	}
+	c = chunk_new(nextchunkid++);
+	c->version = 1;
+	g = (xorgroup*)malloc(sizeof(xorgroup));
+	g->parityid = parityid;
+	g->level = level;
+	for (i=0 ; i<level ; i++) {
+		g->chunkid[i] = chunkid[i];
+		g->version[i] = version[i];
+	}
+	chunk_xor_link(g);
+	return STATUS_OK;
+}
+
+int chunk_xor_delete(uint64_t parityid) {
+	xorgroup *g;
+	chunk *c;
+	c = chunk_find(parityid);
+	if (c==NULL || !CHUNK_IS_PARITY(c)) {
+		return ERROR_NOCHUNK;
+	}
+	g = chunk_xorgroup(c);
+	chunk_xor_unlink(g);
+	free(g);
+	return STATUS_OK;
+}
+
+// xor groups: groups:32 , groups*[ parityid:64 level:8 level*[ chunkid:64 version:32 ] ]
+void chunk_xor_store(FILE *fd) {
+	uint8_t buff[8+1+XOR_MAXLEVEL*(8+4)];
+	uint8_t *ptr;
+	xorgroup *g;
+	uint8_t i;
+	ptr = buff;
+	put32bit(&ptr,xorgroupscnt);
+	fwrite(buff,1,4,fd);
+	for (g=xorgroups ; g ; g=g->next) {
+		ptr = buff;
+		put64bit(&ptr,g->parityid);
+		put8bit(&ptr,g->level);
+		for (i=0 ; i<g->level ; i++) {
+			put64bit(&ptr,g->chunkid[i]);
+			put32bit(&ptr,g->version[i]);
+		}
+		fwrite(buff,1,ptr-buff,fd);
+	}
+}
+
+// replaces all groups (image or delta) - groups whose parity chunk doesn't exist are dropped
+int chunk_xor_load(FILE *fd) {
+	uint8_t buff[8+1+XOR_MAXLEVEL*(8+4)];
+	const uint8_t *ptr;
+	xorgroup *g;
+	uint32_t cnt;
+	uint8_t i;
+
+	while ((g=xorgroups)!=NULL) {
+		chunk_xor_unlink(g);
+		free(g);
+	}
+	if (fread(buff,1,4,fd)!=4) {
+		return -1;
+	}
+	ptr = buff;
+	cnt = get32bit(&ptr);
+	while (cnt>0) {
+		if (fread(buff,1,9,fd)!=9) {
+			return -1;
+		}
+		ptr = buff;
+		g = (xorgroup*)malloc(sizeof(xorgroup));
+		g->parityid = get64bit(&ptr);
+		g->level = get8bit(&ptr);
+		if (g->level<2 || g->level>XOR_MAXLEVEL || fread(buff,1,g->level*(8+4),fd)!=(size_t)(g->level*(8+4))) {
+			free(g);
+			return -1;
+		}
+		ptr = buff;
+		for (i=0 ; i<g->level ; i++) {
+			g->chunkid[i] = get64bit(&ptr);
+			g->version[i] = get32bit(&ptr);
+		}
+		if (chunk_find(g->parityid)==NULL) {
+			free(g);
+		} else {
+			chunk_xor_link(g);
+		}
+		cnt--;
+	}
+	return 0;
+}
+
+/* ---- */
+
 void chunk_newfs(void) {
 	chunks = 0;
 	nextchunkid = 1;
@@ -2341,11 +2673,8 @@ void chunk_strinit(void) {
 	MaxWriteRepl = cfg_getuint32("CHUNKS_WRITE_REP_LIMIT",1);
 	MaxReadRepl = cfg_getuint32("CHUNKS_READ_REP_LIMIT",5);
 	LoopTime = cfg_getuint32("CHUNKS_LOOP_TIME",300);
-	HashSteps = 1+((HASHSIZE)/LoopTime);
 //	config_getnewstr("CHUNKS_CONFIG",ETC_PATH "/mfschunks.cfg",&CfgFileName);
-	for (i=0 ; i<HASHSIZE ; i++) {
-		chunkhash[i]=NULL;
-	}
+	chunk_hash_init();
 	for (i=0 ; i<11 ; i++) {
 		for (j=0 ; j<11 ; j++) {
 			allchunkcounts[i][j]=0;
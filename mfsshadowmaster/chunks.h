@@ -88,6 +88,10 @@ void chunk_got_duptrunc_status(void *ptr,uint64_t chunkid,uint8_t status);
 // int chunk_load_1_1(FILE *fd);
 int chunk_load(FILE *fd);
 void chunk_store(FILE *fd);
+int chunk_xor_add(uint64_t parityid,uint8_t level,const uint64_t *chunkid,const uint32_t *version);
+int chunk_xor_delete(uint64_t parityid);
+int chunk_xor_load(FILE *fd);
+void chunk_xor_store(FILE *fd);
 void chunk_newfs(void);
 void chunk_strinit(void);
 
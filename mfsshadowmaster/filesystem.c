@@ -31,6 +31,8 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "MFSCommunication.h"
 
 #include <sys/types.h>
@@ -45,6 +47,8 @@
 #include "chunks.h"
 #include "filesystem.h"
 #include "datapack.h"
+#include "crc.h"
+#include "metastream.h"
 
 #include "datacachemgr.h"
 #include "acl.h"
@@ -55,18 +59,22 @@
 
 #define USE_FREENODE_BUCKETS 1
 #define USE_CUIDREC_BUCKETS 1
+#define USE_FSOBJ_SLABS 1
 #define EDGEHASH 1
 #define BACKGROUND_METASTORE 1
 
-#define NODEHASHBITS (26)
-#define NODEHASHSIZE (1<<NODEHASHBITS)
-#define NODEHASHPOS(nodeid) ((nodeid)&(NODEHASHSIZE-1))
+#define NODETABPAGEBITS (16)
+#define NODETABPAGESIZE (1<<NODETABPAGEBITS)
+#define NODETABPAGE(nodeid) ((nodeid)>>NODETABPAGEBITS)
+#define NODETABPOS(nodeid) ((nodeid)&(NODETABPAGESIZE-1))
 
 #ifdef EDGEHASH
-#define EDGEHASHBITS (26)
-#define EDGEHASHSIZE (1<<EDGEHASHBITS)
-#define EDGEHASHPOS(hash) ((hash)&(EDGEHASHSIZE-1))
 #define LOOKUPNOHASHLIMIT 10
+#define NAMEIDXMINSIZE 32
+#endif
+
+#ifdef USE_FSOBJ_SLABS
+#define FSEDGE_INLINE_MAX 64
 #endif
 
 //#define GOAL(x) ((x)&0xF)
@@ -112,12 +120,22 @@ typedef struct _fsedge {
 	struct _fsedge *nextchild,*nextparent;
 	struct _fsedge **prevchild,**prevparent;
 #ifdef EDGEHASH
-	struct _fsedge *next,**prev;
+	uint32_t hash;
 #endif
 	uint16_t nleng;
+#ifdef USE_FSOBJ_SLABS
+	uint8_t eclass;
+#endif
 	uint8_t *name;
 } fsedge;
 
+#ifdef EDGEHASH
+typedef struct _fsnameidx {
+	uint32_t size;
+	fsedge *slot[];
+} fsnameidx;
+#endif
+
 typedef struct _statsrecord {
 	uint32_t inodes;
 	uint32_t dirs;
@@ -155,6 +173,9 @@ typedef struct _fsnode {
 	union _data {
 		struct _ddata {				// type==TYPE_DIRECTORY
 			fsedge *children;
+#ifdef EDGEHASH
+			fsnameidx *nameidx;
+#endif
 			uint32_t nlink;
 			uint32_t elements;
 //			uint8_t quotaexceeded:1;	// quota exceeded
@@ -174,7 +195,6 @@ typedef struct _fsnode {
 		} fdata;
 	} data;
 	fsedge *parents;
-	struct _fsnode *next;
 } fsnode;
 
 typedef struct _freenode {
@@ -183,17 +203,17 @@ typedef struct _freenode {
 	struct _freenode *next;
 } freenode;
 
-static uint32_t *freebitmask;
-static uint32_t bitmasksize;
-static uint32_t searchpos;
+static uint64_t *idmask[3];
+static uint32_t idmaskl2words;
+static uint32_t idmaskl2pos;
 static freenode *freelist,**freetail;
 
 static fsedge *trash;
 static fsedge *reserved;
 static fsnode *root;
-static fsnode* nodehash[NODEHASHSIZE];
+static fsnode ***nodetab;
+static uint32_t nodetabpages;
 #ifdef EDGEHASH
-static fsedge* edgehash[EDGEHASHSIZE];
 #endif
 
 static uint32_t maxnodeid;
@@ -373,25 +393,287 @@ static inline void sessionidrec_free(sessionidrec* p) {
 
 #endif /* USE_CUIDREC_BUCKETS */
 
-uint32_t fsnodes_get_next_id() {
-	uint32_t i,mask;
-	while (searchpos<bitmasksize && freebitmask[searchpos]==0xFFFFFFFF) {
-		searchpos++;
+#ifdef USE_FSOBJ_SLABS
+// nodes and edges are taken from size-classed slabs - edges with names up to FSEDGE_INLINE_MAX bytes keep the name in the same slot right after the edge
+#define FSSLAB_BUCKET_BYTES 0x40000
+#define FSEDGE_CLASSES ((FSEDGE_INLINE_MAX/8)+1)
+#define FSEDGE_INLINE(e) ((uint8_t*)((e)+1))
+#define FSSLAB_ESIZE(size) (((size)+7)&~((size_t)7))
+#define FSNODE_ESIZE FSSLAB_ESIZE(sizeof(fsnode))
+#define FSEDGE_ESIZE(eclass) FSSLAB_ESIZE(sizeof(fsedge)+(eclass)*8)
+
+typedef struct _fsslab_bucket {
+	struct _fsslab_bucket *next;
+	uint64_t data[];
+} fsslab_bucket;
+
+typedef struct _fsslab {
+	uint32_t firstfree;
+	fsslab_bucket *head;
+	void *freehead;
+	uint64_t buckets;
+	uint64_t used;
+} fsslab;
+
+typedef struct _fsobj_slabs {
+	fsslab nodes;
+	fsslab edges[FSEDGE_CLASSES];
+} fsobj_slabs;
+
+static fsobj_slabs fsobjslabs;
+
+static inline void* fsslab_malloc(fsslab *s,uint32_t esize) {
+	fsslab_bucket *b;
+	void *ret;
+	if (s->freehead) {
+		ret = s->freehead;
+		s->freehead = *((void**)ret);
+		s->used++;
+		return ret;
 	}
-	if (searchpos==bitmasksize) {	// no more freeinodes
-		bitmasksize+=0xF0;
-		freebitmask = (uint32_t*)realloc(freebitmask,bitmasksize*sizeof(uint32_t));
-		memset(freebitmask+searchpos,0,0xF0*sizeof(uint32_t));
+	if (s->head==NULL || s->firstfree==FSSLAB_BUCKET_BYTES/esize) {
+		b = (fsslab_bucket*)malloc(sizeof(fsslab_bucket)+FSSLAB_BUCKET_BYTES);
+		if (b==NULL) {
+			return NULL;
+		}
+		b->next = s->head;
+		s->head = b;
+		s->firstfree = 0;
+		s->buckets++;
 	}
-	mask = freebitmask[searchpos];
-	i=0;
-	while (mask&1) {
+	ret = ((uint8_t*)(s->head->data))+(s->firstfree*esize);
+	s->firstfree++;
+	s->used++;
+	return ret;
+}
+
+static inline void fsslab_free(fsslab *s,void *p) {
+	*((void**)p) = s->freehead;
+	s->freehead = p;
+	s->used--;
+}
+
+// moves all objects of slab 'src' to slab 'dst' - unused tail of the source head bucket goes to the free list
+static void fsslab_merge(fsslab *dst,fsslab *src,uint32_t esize) {
+	fsslab_bucket *b;
+	uint8_t *p;
+	uint32_t i;
+	if (src->head!=NULL) {
+		if (dst->head==NULL) {
+			dst->head = src->head;
+			dst->firstfree = src->firstfree;
+		} else {
+			for (i=src->firstfree ; i<FSSLAB_BUCKET_BYTES/esize ; i++) {
+				p = ((uint8_t*)(src->head->data))+(i*esize);
+				*((void**)p) = dst->freehead;
+				dst->freehead = p;
+			}
+			for (b=dst->head ; b->next ; b=b->next) {}
+			b->next = src->head;
+		}
+	}
+	if (src->freehead!=NULL) {
+		for (p=src->freehead ; *((void**)p) ; p=*((void**)p)) {}
+		*((void**)p) = dst->freehead;
+		dst->freehead = src->freehead;
+	}
+	dst->buckets += src->buckets;
+	dst->used += src->used;
+	memset(src,0,sizeof(fsslab));
+}
+
+static inline fsnode* fsnode_slab_malloc(fsobj_slabs *s) {
+	return (fsnode*)fsslab_malloc(&(s->nodes),FSNODE_ESIZE);
+}
+
+static inline fsnode* fsnode_malloc() {
+	return fsnode_slab_malloc(&fsobjslabs);
+}
+
+static inline void fsnode_free(fsnode *p) {
+	fsslab_free(&(fsobjslabs.nodes),p);
+}
+
+// returns edge with name buffer for nleng bytes (name is NULL for nleng==0 - caller sets it)
+static inline fsedge* fsedge_slab_malloc(fsobj_slabs *s,uint16_t nleng) {
+	fsedge *e;
+	uint8_t eclass;
+	eclass = (nleng<=FSEDGE_INLINE_MAX)?(nleng+7)/8:0;
+	e = (fsedge*)fsslab_malloc(s->edges+eclass,FSEDGE_ESIZE(eclass));
+	if (e==NULL) {
+		return NULL;
+	}
+	e->eclass = eclass;
+	if (eclass>0) {
+		e->name = FSEDGE_INLINE(e);
+	} else if (nleng>0) {
+		e->name = malloc(nleng);
+	} else {
+		e->name = NULL;
+	}
+	return e;
+}
+
+static inline fsedge* fsedge_malloc(uint16_t nleng) {
+	return fsedge_slab_malloc(&fsobjslabs,nleng);
+}
+
+static inline void fsedge_name_free(fsedge *e) {
+	if (e->eclass==0 || e->name!=FSEDGE_INLINE(e)) {
+		free(e->name);
+	}
+}
+
+static inline void fsedge_free(fsedge *e) {
+	fsedge_name_free(e);
+	fsslab_free(fsobjslabs.edges+e->eclass,e);
+}
+
+// private slabs are used by loader threads and then merged into the global ones
+static void fsobj_slabs_merge(fsobj_slabs *s) {
+	uint32_t i;
+	fsslab_merge(&(fsobjslabs.nodes),&(s->nodes),FSNODE_ESIZE);
+	for (i=0 ; i<FSEDGE_CLASSES ; i++) {
+		fsslab_merge(fsobjslabs.edges+i,s->edges+i,FSEDGE_ESIZE(i));
+	}
+}
+
+static inline void fsobj_slabs_info(uint64_t *allocated,uint64_t *used) {
+	uint32_t i;
+	*allocated = fsobjslabs.nodes.buckets*FSSLAB_BUCKET_BYTES;
+	*used = fsobjslabs.nodes.used*FSNODE_ESIZE;
+	for (i=0 ; i<FSEDGE_CLASSES ; i++) {
+		*allocated += fsobjslabs.edges[i].buckets*FSSLAB_BUCKET_BYTES;
+		*used += fsobjslabs.edges[i].used*FSEDGE_ESIZE(i);
+	}
+}
+#else /* USE_FSOBJ_SLABS */
+
+typedef struct _fsobj_slabs {
+	uint8_t dummy;
+} fsobj_slabs;
+
+static inline fsnode* fsnode_malloc() {
+	return (fsnode*)malloc(sizeof(fsnode));
+}
+
+static inline fsnode* fsnode_slab_malloc(fsobj_slabs *s) {
+	(void)s;
+	return fsnode_malloc();
+}
+
+static inline void fsnode_free(fsnode *p) {
+	free(p);
+}
+
+static inline fsedge* fsedge_malloc(uint16_t nleng) {
+	fsedge *e;
+	e = (fsedge*)malloc(sizeof(fsedge));
+	if (e==NULL) {
+		return NULL;
+	}
+	e->name = (nleng>0)?malloc(nleng):NULL;
+	return e;
+}
+
+static inline fsedge* fsedge_slab_malloc(fsobj_slabs *s,uint16_t nleng) {
+	(void)s;
+	return fsedge_malloc(nleng);
+}
+
+static void fsobj_slabs_merge(fsobj_slabs *s) {
+	(void)s;
+}
+
+static inline void fsedge_name_free(fsedge *e) {
+	free(e->name);
+}
+
+static inline void fsedge_free(fsedge *e) {
+	free(e->name);
+	free(e);
+}
+
+static inline void fsobj_slabs_info(uint64_t *allocated,uint64_t *used) {
+	*allocated = 0;
+	*used = 0;
+}
+#endif /* USE_FSOBJ_SLABS */
+
+/* free inode bitmap - level 0 has one bit per inode (set - inode used), level 1 one bit per level 0 word (set - word full)
+   and level 2 one bit per level 1 word; the lowest free inode is found by going down from the first not full level 2 word,
+   so allocation always returns the same inode as linear search did (changelog replay depends on it) */
+#define IDMASK_L2BITS 18	// inodes covered by one level 2 word (64*64*64)
+#define IDMASK_RESERVE 0x4000	// free inodes always available above maxnodeid after initialization
+
+static inline uint32_t fsnodes_ctz64(uint64_t x) {
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#else
+	uint32_t i = 0;
+	while ((x&1)==0) {
 		i++;
-		mask>>=1;
+		x>>=1;
+	}
+	return i;
+#endif
+}
+
+static inline void fsnodes_freebitmask_resize(uint32_t l2words) {
+	uint32_t i;
+	idmask[0] = (uint64_t*)realloc(idmask[0],sizeof(uint64_t)*((uint64_t)l2words<<12));
+	idmask[1] = (uint64_t*)realloc(idmask[1],sizeof(uint64_t)*((uint64_t)l2words<<6));
+	idmask[2] = (uint64_t*)realloc(idmask[2],sizeof(uint64_t)*l2words);
+	for (i=idmaskl2words ; i<l2words ; i++) {
+		memset(idmask[0]+((uint64_t)i<<12),0,sizeof(uint64_t)<<12);
+		memset(idmask[1]+((uint64_t)i<<6),0,sizeof(uint64_t)<<6);
+		idmask[2][i] = 0;
+	}
+	idmaskl2words = l2words;
+}
+
+static inline void fsnodes_freebitmask_set(uint32_t id) {
+	uint32_t w0,w1,l2words;
+	l2words = (id>>IDMASK_L2BITS)+1;
+	if (l2words>idmaskl2words) {
+		fsnodes_freebitmask_resize(l2words);
+	}
+	w0 = id>>6;
+	idmask[0][w0] |= UINT64_C(1)<<(id&0x3F);
+	if (idmask[0][w0]==UINT64_C(0xFFFFFFFFFFFFFFFF)) {
+		w1 = w0>>6;
+		idmask[1][w1] |= UINT64_C(1)<<(w0&0x3F);
+		if (idmask[1][w1]==UINT64_C(0xFFFFFFFFFFFFFFFF)) {
+			idmask[2][w1>>6] |= UINT64_C(1)<<(w1&0x3F);
+		}
+	}
+}
+
+static inline void fsnodes_freebitmask_clear(uint32_t id) {
+	uint32_t w0,w1;
+	w0 = id>>6;
+	w1 = w0>>6;
+	idmask[0][w0] &= ~(UINT64_C(1)<<(id&0x3F));
+	idmask[1][w1] &= ~(UINT64_C(1)<<(w0&0x3F));
+	idmask[2][w1>>6] &= ~(UINT64_C(1)<<(w1&0x3F));
+	if ((w1>>6)<idmaskl2pos) {
+		idmaskl2pos = w1>>6;
 	}
-	mask = 1<<i;
-	freebitmask[searchpos] |= mask;
-	i+=(searchpos<<5);
+}
+
+uint32_t fsnodes_get_next_id() {
+	uint32_t w0,w1,i;
+	// all level 2 words before idmaskl2pos are full
+	while (idmaskl2pos<idmaskl2words && idmask[2][idmaskl2pos]==UINT64_C(0xFFFFFFFFFFFFFFFF)) {
+		idmaskl2pos++;
+	}
+	if (idmaskl2pos==idmaskl2words) {	// no more free inodes
+		fsnodes_freebitmask_resize(idmaskl2words+1);
+	}
+	w1 = (idmaskl2pos<<6) + fsnodes_ctz64(~idmask[2][idmaskl2pos]);
+	w0 = (w1<<6) + fsnodes_ctz64(~idmask[1][w1]);
+	i = (w0<<6) + fsnodes_ctz64(~idmask[0][w0]);
+	fsnodes_freebitmask_set(i);
 	if (i>maxnodeid) {
 		maxnodeid=i;
 	}
@@ -409,19 +691,14 @@ void fsnodes_free_id(uint32_t id,uint32_t ts) {
 }
 
 uint8_t shadow_fs_freeinodes(uint32_t ts,uint32_t freeinodes) {
-        uint32_t fi,now,pos,mask;
+        uint32_t fi,now;
         freenode *n,*an;
 	now = ts;
 	fi = 0;
         n = freelist;
         while (n && n->ftime+86400<now) {
                 fi++;
-                pos = (n->id >> 5);
-                mask = 1<<(n->id&0x1F);
-                freebitmask[pos] &= ~mask;
-                if (pos<searchpos) {
-                        searchpos = pos;
-                }
+                fsnodes_freebitmask_clear(n->id);
                 an = n->next;
                 freenode_free(n);
                 n = an;
@@ -441,18 +718,21 @@ uint8_t shadow_fs_freeinodes(uint32_t ts,uint32_t freeinodes) {
 }
 
 void fsnodes_init_freebitmask (void) {
-	bitmasksize = 0x200+(((maxnodeid)>>5)&0xFFFFFF80);
-	freebitmask = (uint32_t*)malloc(bitmasksize*sizeof(uint32_t));
-	memset(freebitmask,0,bitmasksize*sizeof(uint32_t));
-	freebitmask[0]=1;	// reserve inode 0
-	searchpos = 0;
+	uint32_t i;
+	for (i=0 ; i<3 ; i++) {
+		if (idmask[i]) {
+			free(idmask[i]);
+			idmask[i] = NULL;
+		}
+	}
+	idmaskl2words = 0;
+	idmaskl2pos = 0;
+	fsnodes_freebitmask_resize((((uint64_t)maxnodeid+IDMASK_RESERVE)>>IDMASK_L2BITS)+1);
+	fsnodes_freebitmask_set(0);	// reserve inode 0
 }
 
 void fsnodes_used_inode (uint32_t id) {
-	uint32_t pos,mask;
-	pos = id>>5;
-	mask = 1<<(id&0x1F);
-	freebitmask[pos]|=mask;
+	fsnodes_freebitmask_set(id);
 }
 
 
@@ -478,13 +758,31 @@ char* fsnodes_escape_name(uint16_t nleng,const uint8_t *name) {
 }
 */
 
+// buff - at least nleng*3+1 bytes
+static void fsnodes_escape_name_buff(char *buff,uint16_t nleng,const uint8_t *name) {
+	uint32_t i;
+	uint8_t c;
+	i = 0;
+	while (nleng>0) {
+		c = *name;
+		if (c<32 || c>=127 || c==',' || c=='%' || c=='(' || c==')') {
+			buff[i++]='%';
+			buff[i++]="0123456789ABCDEF"[(c>>4)&0xF];
+			buff[i++]="0123456789ABCDEF"[c&0xF];
+		} else {
+			buff[i++]=c;
+		}
+		name++;
+		nleng--;
+	}
+	buff[i]=0;
+}
+
 static char* fsnodes_escape_name(uint16_t nleng,const uint8_t *name) {
 	static char *escname[2]={NULL,NULL};
 	static uint32_t escnamesize[2]={0,0};
 	static uint8_t buffid=0;
-	char *currescname=NULL;
 	uint32_t i;
-	uint8_t c;
 	buffid = 1-buffid;
 	i = nleng;
 	i = i*3+1;
@@ -495,92 +793,136 @@ static char* fsnodes_escape_name(uint16_t nleng,const uint8_t *name) {
 		}
 		escname[buffid] = malloc(escnamesize[buffid]);
 	}
-	i = 0;
-	currescname = escname[buffid];
-	while (nleng>0) {
-		c = *name;
-		if (c<32 || c>=127 || c==',' || c=='%' || c=='(' || c==')') {
-			currescname[i++]='%';
-			currescname[i++]="0123456789ABCDEF"[(c>>4)&0xF];
-			currescname[i++]="0123456789ABCDEF"[c&0xF];
-		} else {
-			currescname[i++]=c;
-		}
-		name++;
-		nleng--;
-	}
-	currescname[i]=0;
-	return currescname;
+	fsnodes_escape_name_buff(escname[buffid],nleng,name);
+	return escname[buffid];
 }
 
 #ifdef EDGEHASH
-static inline uint32_t fsnodes_hash(uint32_t parentid,uint16_t nleng,const uint8_t *name) {
+static inline uint32_t fsnodes_hash(uint16_t nleng,const uint8_t *name) {
 	uint32_t hash,i;
-	hash = ((parentid * 0x5F2318BD) + nleng);
+	hash = nleng * 0x5F2318BD;
 	for (i=0 ; i<nleng ; i++) {
 		hash = hash*33+name[i];
 	}
+	hash ^= hash>>16;
+	hash *= 0x85EBCA6B;
+	hash ^= hash>>13;
 	return hash;
 }
-#endif
 
-static int fsnodes_nameisused(fsnode *node,uint16_t nleng,const uint8_t *name) {
-	fsedge *ei;
-#ifdef EDGEHASH
-	if (node->data.ddata.elements>LOOKUPNOHASHLIMIT) {
-		ei = edgehash[EDGEHASHPOS(fsnodes_hash(node->id,nleng,name))];
-		while (ei) {
-			if (ei->parent==node && nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-				return 1;
-			}
-			ei = ei->next;
+// per-directory name index - open addressing with linear probing, kept at most 3/4 full, built when directory has more than LOOKUPNOHASHLIMIT elements and dropped when it falls to LOOKUPNOHASHLIMIT/2
+static inline void fsnodes_nameidx_put(fsnameidx *ni,fsedge *e) {
+	uint32_t pos,mask;
+	mask = ni->size-1;
+	pos = e->hash & mask;
+	while (ni->slot[pos]) {
+		pos = (pos+1) & mask;
+	}
+	ni->slot[pos] = e;
+}
+
+static void fsnodes_nameidx_rebuild(fsnode *node) {
+	fsnameidx *ni;
+	fsedge *e;
+	uint32_t size;
+	size = NAMEIDXMINSIZE;
+	while (size < node->data.ddata.elements*2) {
+		size<<=1;
+	}
+	ni = malloc(sizeof(fsnameidx)+sizeof(fsedge*)*size);
+	memset(ni->slot,0,sizeof(fsedge*)*size);
+	ni->size = size;
+	for (e=node->data.ddata.children ; e ; e=e->nextchild) {
+		fsnodes_nameidx_put(ni,e);
+	}
+	if (node->data.ddata.nameidx) {
+		free(node->data.ddata.nameidx);
+	}
+	node->data.ddata.nameidx = ni;
+}
+
+// called after edge has been added to children list and elements counter
+static inline void fsnodes_nameidx_add(fsnode *node,fsedge *e) {
+	fsnameidx *ni;
+	ni = node->data.ddata.nameidx;
+	if (ni==NULL) {
+		if (node->data.ddata.elements>LOOKUPNOHASHLIMIT) {
+			fsnodes_nameidx_rebuild(node);
 		}
+	} else if (node->data.ddata.elements*4>ni->size*3) {
+		fsnodes_nameidx_rebuild(node);
 	} else {
-		ei = node->data.ddata.children;
-		while (ei) {
-			if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-				return 1;
-			}
-			ei = ei->nextchild;
+		fsnodes_nameidx_put(ni,e);
+	}
+}
+
+// called after edge has been removed from children list and elements counter
+static inline void fsnodes_nameidx_del(fsnode *node,fsedge *e) {
+	fsnameidx *ni;
+	uint32_t i,j,k,mask;
+	ni = node->data.ddata.nameidx;
+	if (ni==NULL) {
+		return;
+	}
+	if (node->data.ddata.elements<=LOOKUPNOHASHLIMIT/2) {
+		free(ni);
+		node->data.ddata.nameidx = NULL;
+		return;
+	}
+	if (ni->size>NAMEIDXMINSIZE && node->data.ddata.elements*8<ni->size) {
+		fsnodes_nameidx_rebuild(node);
+		return;
+	}
+	mask = ni->size-1;
+	i = e->hash & mask;
+	while (ni->slot[i]!=e) {
+		if (ni->slot[i]==NULL) {
+			return;
 		}
+		i = (i+1) & mask;
 	}
-#else
-	ei = node->data.ddata.children;
-	while (ei) {
-		if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-			return 1;
+// shift back following entries, so no tombstones are needed
+	j = i;
+	for (;;) {
+		j = (j+1) & mask;
+		if (ni->slot[j]==NULL) {
+			break;
+		}
+		k = ni->slot[j]->hash & mask;
+		if ((j>i && (k<=i || k>j)) || (j<i && k<=i && k>j)) {
+			ni->slot[i] = ni->slot[j];
+			i = j;
 		}
-		ei = ei->nextchild;
 	}
-#endif
-	return 0;
+	ni->slot[i] = NULL;
 }
+#endif
 
 static fsedge* fsnodes_lookup(fsnode *node,uint16_t nleng,const uint8_t *name) {
 	fsedge *ei;
+#ifdef EDGEHASH
+	fsnameidx *ni;
+	uint32_t hash,pos,mask;
+#endif
 
 	if (node->type!=TYPE_DIRECTORY) {
 		return NULL;
 	}
 #ifdef EDGEHASH
-	if (node->data.ddata.elements>LOOKUPNOHASHLIMIT) {
-		ei = edgehash[EDGEHASHPOS(fsnodes_hash(node->id,nleng,name))];
-		while (ei) {
-			if (ei->parent==node && nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
-				return ei;
-			}
-			ei = ei->next;
-		}
-	} else {
-		ei = node->data.ddata.children;
-		while (ei) {
-			if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
+	ni = node->data.ddata.nameidx;
+	if (ni) {
+		hash = fsnodes_hash(nleng,name);
+		mask = ni->size-1;
+		pos = hash & mask;
+		while ((ei=ni->slot[pos])!=NULL) {
+			if (ei->hash==hash && nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
 				return ei;
 			}
-			ei = ei->nextchild;
+			pos = (pos+1) & mask;
 		}
+		return NULL;
 	}
-#else
+#endif
 	ei = node->data.ddata.children;
 	while (ei) {
 		if (nleng==ei->nleng && memcmp((char*)(ei->name),(char*)name,nleng)==0) {
@@ -588,21 +930,60 @@ static fsedge* fsnodes_lookup(fsnode *node,uint16_t nleng,const uint8_t *name) {
 		}
 		ei = ei->nextchild;
 	}
-#endif
 	return NULL;
 }
 
+static inline int fsnodes_nameisused(fsnode *node,uint16_t nleng,const uint8_t *name) {
+	return (fsnodes_lookup(node,nleng,name)!=NULL)?1:0;
+}
+
+// inode table - pages are allocated up to the highest used page, so every page below nodetabpages exists
 static inline fsnode* fsnodes_id_to_node(uint32_t id) {
-	fsnode *p;
-	uint32_t nodepos = NODEHASHPOS(id);
-	for (p=nodehash[nodepos]; p ; p=p->next ) {
-		if (p->id == id) {
-			return p;
-		}
+	if (NODETABPAGE(id)<nodetabpages) {
+		return nodetab[NODETABPAGE(id)][NODETABPOS(id)];
 	}
 	return NULL;
 }
 
+// allocates all pages up to the one containing 'id'
+static inline void fsnodes_nodetab_reserve(uint32_t id) {
+	uint32_t newpages;
+	newpages = NODETABPAGE(id)+1;
+	if (newpages>nodetabpages) {
+		nodetab = (fsnode***)realloc(nodetab,sizeof(fsnode**)*newpages);
+		while (nodetabpages<newpages) {
+			nodetab[nodetabpages] = (fsnode**)malloc(sizeof(fsnode*)*NODETABPAGESIZE);
+			memset(nodetab[nodetabpages],0,sizeof(fsnode*)*NODETABPAGESIZE);
+			nodetabpages++;
+		}
+	}
+}
+
+static inline void fsnodes_nodetab_insert(fsnode *p) {
+	fsnodes_nodetab_reserve(p->id);
+	nodetab[NODETABPAGE(p->id)][NODETABPOS(p->id)] = p;
+	if (p->id>maxnodeid) {
+		maxnodeid = p->id;
+	}
+}
+
+
+static inline void fsnodes_nodetab_remove(fsnode *p) {
+	if (NODETABPAGE(p->id)<nodetabpages) {
+		nodetab[NODETABPAGE(p->id)][NODETABPOS(p->id)] = NULL;
+	}
+}
+
+static inline void fsnodes_nodetab_free(void) {
+	uint32_t i;
+	for (i=0 ; i<nodetabpages ; i++) {
+		free(nodetab[i]);
+	}
+	free(nodetab);
+	nodetab = NULL;
+	nodetabpages = 0;
+}
+
 
 /*
 static inline uint8_t fsnodes_geteattr(fsnode *p) {
@@ -756,6 +1137,14 @@ static inline uint8_t fsnodes_test_quota(fsnode *node) {
 
 // stats
 
+// estimated hdd usage of 'size' bytes of file data stored with given goal
+static inline uint64_t fsnodes_realsize(uint64_t size,uint8_t goal) {
+	if (GOAL_IS_XOR(goal)) {
+		return size+size/GOAL_XOR_LEVEL(goal);
+	}
+	return size*goal;
+}
+
 static inline void fsnodes_get_stats(fsnode *node,statsrecord *sr) {
 	uint32_t i,lastchunk,lastchunksize;
 	switch (node->type) {
@@ -790,7 +1179,7 @@ static inline void fsnodes_get_stats(fsnode *node,statsrecord *sr) {
 				sr->chunks++;
 			}
 		}
-		sr->realsize = sr->size * node->goal;
+		sr->realsize = fsnodes_realsize(sr->size,node->goal);
 		break;
 	case TYPE_SYMLINK:
 		sr->inodes = 1;
@@ -894,15 +1283,11 @@ static inline void fsnodes_remove_edge(uint32_t ts,fsedge *e) {
 		e->nextparent->prevparent = e->prevparent;
 	}
 #ifdef EDGEHASH
-	if (e->prev) {
-		*(e->prev) = e->next;
-		if (e->next) {
-			e->next->prev = e->prev;
-		}
+	if (e->parent) {
+		fsnodes_nameidx_del(e->parent,e);
 	}
 #endif
-	free(e->name);
-	free(e);
+	fsedge_free(e);
 }
 
 static inline void shadow_fsnodes_remove_edge(uint32_t ts,fsedge *e) {
@@ -925,27 +1310,19 @@ static inline void shadow_fsnodes_remove_edge(uint32_t ts,fsedge *e) {
                 e->nextparent->prevparent = e->prevparent;
         }
 #ifdef EDGEHASH
-        if (e->prev) {
-                *(e->prev) = e->next;
-                if (e->next) {
-                        e->next->prev = e->prev;
-                }
+        if (e->parent) {
+                fsnodes_nameidx_del(e->parent,e);
         }
 #endif
-        free(e->name);
-        free(e);
+        fsedge_free(e);
 }
 
 static inline void fsnodes_link(uint32_t ts,fsnode *parent,fsnode *child,uint16_t nleng,const uint8_t *name) {
 	fsedge *e;
 	statsrecord sr;
-#ifdef EDGEHASH
-	uint32_t hpos;
-#endif
 
-	e = malloc(sizeof(fsedge));
+	e = fsedge_malloc(nleng);
 	e->nleng = nleng;
-	e->name = malloc(nleng);
 	memcpy(e->name,name,nleng);
 	e->child = child;
 	e->parent = parent;
@@ -961,20 +1338,14 @@ static inline void fsnodes_link(uint32_t ts,fsnode *parent,fsnode *child,uint16_
 	}
 	child->parents = e;
 	e->prevparent = &(child->parents);
-#ifdef EDGEHASH
-	hpos = EDGEHASHPOS(fsnodes_hash(parent->id,nleng,name));
-	e->next = edgehash[hpos];
-	if (e->next) {
-		e->next->prev = &(e->next);
-	}
-	edgehash[hpos] = e;
-	e->prev = &(edgehash[hpos]);
-#endif
-
 	parent->data.ddata.elements++;
 	if (child->type==TYPE_DIRECTORY) {
 		parent->data.ddata.nlink++;
 	}
+#ifdef EDGEHASH
+	e->hash = fsnodes_hash(nleng,name);
+	fsnodes_nameidx_add(parent,e);
+#endif
 	fsnodes_get_stats(child,&sr);
 	fsnodes_add_stats(parent,&sr);
 	if (ts>0) {
@@ -986,8 +1357,7 @@ static inline void fsnodes_link(uint32_t ts,fsnode *parent,fsnode *child,uint16_
 static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nleng,const uint8_t *name,uint8_t type,uint16_t mode,uint32_t uid,uint32_t gid) {
 	fsnode *p;
 	statsrecord *sr;
-	uint32_t nodepos;
-	p = malloc(sizeof(fsnode));
+	p = fsnode_malloc();
 	nodes++;
 	if (type==TYPE_DIRECTORY) {
 		dirnodes++;
@@ -1019,6 +1389,9 @@ static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nlen
 		p->data.ddata.stats = sr;
 		p->data.ddata.quota = NULL;
 		p->data.ddata.children = NULL;
+#ifdef EDGEHASH
+		p->data.ddata.nameidx = NULL;
+#endif
 		p->data.ddata.nlink = 2;
 		p->data.ddata.elements = 0;
 		break;
@@ -1037,9 +1410,7 @@ static inline fsnode* fsnodes_create_node(uint32_t ts,fsnode* node,uint16_t nlen
 		p->data.rdev = 0;
 	}
 	p->parents = NULL;
-	nodepos = NODEHASHPOS(p->id);
-	p->next = nodehash[nodepos];
-	nodehash[nodepos] = p;
+	fsnodes_nodetab_insert(p);
 	fsnodes_link(ts,node,p,nleng,name);
 	return p;
 }
@@ -1626,7 +1997,7 @@ static inline void fsnodes_changefilegoal(fsnode *obj,uint8_t goal) {
 
 	fsnodes_get_stats(obj,&psr);
 	nsr = psr;
-	nsr.realsize = goal * nsr.size;
+	nsr.realsize = fsnodes_realsize(nsr.size,goal);
 	for (e=obj->parents ; e ; e=e->nextparent) {
 		fsnodes_add_sub_stats(e->parent,&nsr,&psr);
 	}
@@ -1737,25 +2108,20 @@ static inline void fsnodes_setlength(fsnode *obj,uint64_t length) {
 }
 
 static inline void shadow_fsnodes_remove_node(uint32_t ts,fsnode *toremove) {
-        uint32_t nodepos;
-        fsnode **ptr;
         if (toremove->parents!=NULL) {
                 return;
         }
-// remove from idhash
-        nodepos = NODEHASHPOS(toremove->id);
-        ptr = &(nodehash[nodepos]);
-        while (*ptr) {
-                if (*ptr==toremove) {
-                        *ptr=toremove->next;
-                        break;
-                }
-                ptr = &((*ptr)->next);
-        }       
+// remove from inode table
+        fsnodes_nodetab_remove(toremove);
 // and free     
         nodes--;        
         if (toremove->type==TYPE_DIRECTORY) {
                 dirnodes--;
+#ifdef EDGEHASH
+                if (toremove->data.ddata.nameidx) {
+                        free(toremove->data.ddata.nameidx);
+                }
+#endif
                 if (toremove->data.ddata.quota) {
                         fsnodes_delete_quotanode(toremove->data.ddata.quota);
                 }
@@ -1785,29 +2151,24 @@ static inline void shadow_fsnodes_remove_node(uint32_t ts,fsnode *toremove) {
         }
         fsnodes_free_id(toremove->id,ts);
         dcm_modify(toremove->id,0);
-        free(toremove);
+        fsnode_free(toremove);
 }
 
 static inline void fsnodes_remove_node(uint32_t ts,fsnode *toremove) {
-	uint32_t nodepos;
-	fsnode **ptr;
 	if (toremove->parents!=NULL) {
 		return;
 	}
-// remove from idhash
-	nodepos = NODEHASHPOS(toremove->id);
-	ptr = &(nodehash[nodepos]);
-	while (*ptr) {
-		if (*ptr==toremove) {
-			*ptr=toremove->next;
-			break;
-		}
-		ptr = &((*ptr)->next);
-	}
+// remove from inode table
+	fsnodes_nodetab_remove(toremove);
 // and free
 	nodes--;
 	if (toremove->type==TYPE_DIRECTORY) {
 		dirnodes--;
+#ifdef EDGEHASH
+		if (toremove->data.ddata.nameidx) {
+			free(toremove->data.ddata.nameidx);
+		}
+#endif
 		if (toremove->data.ddata.quota) {
 			fsnodes_delete_quotanode(toremove->data.ddata.quota);
 		}
@@ -1837,7 +2198,7 @@ static inline void fsnodes_remove_node(uint32_t ts,fsnode *toremove) {
 	}
 	fsnodes_free_id(toremove->id,ts);
 	dcm_modify(toremove->id,0);
-	free(toremove);
+	fsnode_free(toremove);
 }
 
 
@@ -1858,7 +2219,7 @@ static inline void shadow_fsnodes_unlink(uint32_t ts,fsedge *e) {
 			if (child->trashtime>0) {
 				child->type = TYPE_TRASH;
 				child->ctime = ts;
-				e = malloc(sizeof(fsedge));
+				e = fsedge_malloc(0);
 				e->nleng = pleng;
 				e->name = path;
 				e->child = child;
@@ -1870,15 +2231,13 @@ static inline void shadow_fsnodes_unlink(uint32_t ts,fsedge *e) {
 				if (e->nextchild) {
 					e->nextchild->prevchild = &(e->nextchild);
 				}
-				e->next = NULL;
-				e->prev = NULL;
 				trash = e;
 				child->parents = e;
 				trashspace += child->data.fdata.length;
 				trashnodes++;
 			} else if (child->data.fdata.sessionids!=NULL) {
 				child->type = TYPE_RESERVED;
-				e = malloc(sizeof(fsedge));
+				e = fsedge_malloc(0);
 				e->nleng = pleng;
 				e->name = path;
 				e->child = child;
@@ -1890,10 +2249,6 @@ static inline void shadow_fsnodes_unlink(uint32_t ts,fsedge *e) {
 				if (e->nextchild) {
 					e->nextchild->prevchild = &(e->nextchild);
 				}
-#ifdef EDGEHASH
-				e->next = NULL;
-				e->prev = NULL;
-#endif
 				reserved = e;
 				child->parents = e;
 				reservedspace += child->data.fdata.length;
@@ -1924,7 +2279,7 @@ static inline void fsnodes_unlink(uint32_t ts,fsedge *e) {
 			if (child->trashtime>0) {
 				child->type = TYPE_TRASH;
 				child->ctime = ts;
-				e = malloc(sizeof(fsedge));
+				e = fsedge_malloc(0);
 				e->nleng = pleng;
 				e->name = path;
 				e->child = child;
@@ -1936,15 +2291,13 @@ static inline void fsnodes_unlink(uint32_t ts,fsedge *e) {
 				if (e->nextchild) {
 					e->nextchild->prevchild = &(e->nextchild);
 				}
-				e->next = NULL;
-				e->prev = NULL;
 				trash = e;
 				child->parents = e;
 				trashspace += child->data.fdata.length;
 				trashnodes++;
 			} else if (child->data.fdata.sessionids!=NULL) {
 				child->type = TYPE_RESERVED;
-				e = malloc(sizeof(fsedge));
+				e = fsedge_malloc(0);
 				e->nleng = pleng;
 				e->name = path;
 				e->child = child;
@@ -1956,10 +2309,6 @@ static inline void fsnodes_unlink(uint32_t ts,fsedge *e) {
 				if (e->nextchild) {
 					e->nextchild->prevchild = &(e->nextchild);
 				}
-#ifdef EDGEHASH
-				e->next = NULL;
-				e->prev = NULL;
-#endif
 				reserved = e;
 				child->parents = e;
 				reservedspace += child->data.fdata.length;
@@ -2166,7 +2515,7 @@ void fsnodes_get_file_stats(fsnode *node,uint32_t *undergoalfiles,uint32_t *miss
 	for (i=0 ; i<node->data.fdata.chunks ; i++) {
 		if (node->data.fdata.chunktab[i]>0) {
 			chunk_get_validcopies(node->data.fdata.chunktab[i],&cnt);
-			if (cnt<node->goal) {
+			if (cnt<GOAL_COPIES(node->goal)) {
 				if (cnt==0) {
 					m=1;
 					(*missingchunks)++;
@@ -2214,7 +2563,7 @@ void fsnodes_get_dir_stats(fsnode *node,uint32_t *inodes,uint32_t *dirs,uint32_t
 			for (i=0 ; i<n->data.fdata.chunks ; i++) {
 				if (n->data.fdata.chunktab[i]>0) {
 					chunk_get_validcopies(n->data.fdata.chunktab[i],&cnt);
-					if (cnt<n->goal) {
+					if (cnt<GOAL_COPIES(n->goal)) {
 						if (cnt==0) {
 							m=1;
 							(*missingchunks)++;
@@ -2246,11 +2595,11 @@ void fsnodes_get_dir_stats(fsnode *node,uint32_t *inodes,uint32_t *dirs,uint32_t
 }
 */
 
-static inline void fsnodes_getgoal_recursive(fsnode *node,uint8_t gmode,uint32_t fgtab[10],uint32_t dgtab[10]) {
+static inline void fsnodes_getgoal_recursive(fsnode *node,uint8_t gmode,uint32_t fgtab[GOAL_MAX+1],uint32_t dgtab[GOAL_MAX+1]) {
 	fsedge *e;
 
 	if (node->type==TYPE_FILE || node->type==TYPE_TRASH || node->type==TYPE_RESERVED) {
-		if (node->goal>9) {
+		if (node->goal>9 && !GOAL_IS_XOR(node->goal)) {
 			MFSLOG(LOG_WARNING,"inode %"PRIu32": goal>9 !!! - fixing",node->id);
 			fsnodes_changefilegoal(node,9);
 		} else if (node->goal<1) {
@@ -2259,7 +2608,7 @@ static inline void fsnodes_getgoal_recursive(fsnode *node,uint8_t gmode,uint32_t
 		}
 		fgtab[node->goal]++;
 	} else if (node->type==TYPE_DIRECTORY) {
-		if (node->goal>9) {
+		if (node->goal>9 && !GOAL_IS_XOR(node->goal)) {
 			MFSLOG(LOG_WARNING,"inode %"PRIu32": goal>9 !!! - fixing",node->id);
 			node->goal=9;
 		} else if (node->goal<1) {
@@ -2368,12 +2717,12 @@ static inline void fsnodes_setgoal_recursive(fsnode *node,uint32_t ts,uint32_t u
 				}
 				break;
 			case SMODE_INCREASE:
-				if (node->goal<goal) {
+				if (GOAL_RANK(node->goal)<GOAL_RANK(goal)) {
 					set=1;
 				}
 				break;
 			case SMODE_DECREASE:
-				if (node->goal>goal) {
+				if (GOAL_RANK(node->goal)>GOAL_RANK(goal)) {
 					set=1;
 				}
 				break;
@@ -2941,7 +3290,7 @@ uint8_t shadow_fs_setpath(uint32_t inode,const uint8_t *path) {
         if (newpath==NULL) {
                 return ERROR_EINVAL;
         }
-        free(p->parents->name);
+        fsedge_name_free(p->parents);
         memcpy(newpath,path,pleng);
         p->parents->name = newpath;
         p->parents->nleng = pleng;
@@ -2978,7 +3327,7 @@ uint8_t fs_settrashpath(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint3
 	if (newpath==NULL) {
 		return ERROR_EINVAL;	// no mem ?
 	}
-	free(p->parents->name);
+	fsedge_name_free(p->parents);
 	memcpy(newpath,path,pleng);
 	p->parents->name = newpath;
 	p->parents->nleng = pleng;
@@ -3073,6 +3422,10 @@ void fs_info(uint64_t *totalspace,uint64_t *availspace,uint64_t *trspace,uint32_
 	*fnodes = filenodes;
 }
 
+void fs_meminfo(uint64_t *allocated,uint64_t *used) {
+	fsobj_slabs_info(allocated,used);
+}
+
 uint8_t fs_getrootinode(uint32_t *rootinode,const uint8_t *path) {
 	uint32_t nleng;
 	const uint8_t *name;
@@ -4887,6 +5240,16 @@ uint8_t shadow_fs_incversion(uint64_t chunkid) {
 	return chunk_increase_version(chunkid);
 }
 
+uint8_t shadow_fs_xorgroup(uint64_t parityid,uint8_t level,const uint64_t *chunkid,const uint32_t *cversion) {
+	version++;
+	return chunk_xor_add(parityid,level,chunkid,cversion);
+}
+
+uint8_t shadow_fs_xordel(uint64_t parityid) {
+	version++;
+	return chunk_xor_delete(parityid);
+}
+
 
 uint8_t fs_repair(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t uid,uint32_t gid,uint32_t *notchanged,uint32_t *erased,uint32_t *repaired) {
 	uint32_t nversion,indx;
@@ -4984,11 +5347,11 @@ uint8_t shadow_fs_repair(uint32_t ts,uint32_t inode,uint32_t indx,uint32_t nvers
 	return status;
 }
 
-uint8_t fs_getgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t gmode,uint32_t fgtab[10],uint32_t dgtab[10]) {
+uint8_t fs_getgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint8_t gmode,uint32_t fgtab[GOAL_MAX+1],uint32_t dgtab[GOAL_MAX+1]) {
 	fsnode *p,*rn;
 	(void)sesflags;
-	memset(fgtab,0,10*sizeof(uint32_t));
-	memset(dgtab,0,10*sizeof(uint32_t));
+	memset(fgtab,0,(GOAL_MAX+1)*sizeof(uint32_t));
+	memset(dgtab,0,(GOAL_MAX+1)*sizeof(uint32_t));
 	if (!GMODE_ISVALID(gmode)) {
 		return ERROR_EINVAL;
 	}
@@ -5135,7 +5498,7 @@ uint8_t shadow_fs_setgoal(uint32_t ts,uint32_t inode,uint32_t uid,uint8_t goal,u
 	si = 0;
         nci = 0;
         nsi = 0;
-        if (!SMODE_ISVALID(smode) || goal>9 || goal<1) {
+        if (!SMODE_ISVALID(smode) || !GOAL_ISVALID(goal)) {
                 return ERROR_EINVAL;
         }
         p = fsnodes_id_to_node(inode);
@@ -5164,7 +5527,7 @@ uint8_t fs_setgoal(uint32_t rootinode,uint8_t sesflags,uint32_t inode,uint32_t u
 	*sinodes = 0;
 	*ncinodes = 0;
 	*nsinodes = 0;
-	if (!SMODE_ISVALID(smode) || goal>9 || goal<1) {
+	if (!SMODE_ISVALID(smode) || !GOAL_ISVALID(goal)) {
 		return ERROR_EINVAL;
 	}
 	if (sesflags&SESFLAG_READONLY) {
@@ -5644,8 +6007,8 @@ void fs_add_files_to_chunks() {
 	uint32_t i,j;
 	uint64_t chunkid;
 	fsnode *f;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (f=nodehash[i] ; f ; f=f->next) {
+	for (i=0 ; i<=maxnodeid ; i++) {
+		if ((f=fsnodes_id_to_node(i))!=NULL) {
 			if (f->type==TYPE_FILE || f->type==TYPE_TRASH || f->type==TYPE_RESERVED) {
 				for (j=0 ; j<f->data.fdata.chunks ; j++) {
 					chunkid = f->data.fdata.chunktab[j];
@@ -5743,7 +6106,7 @@ void fs_test_files() {
 	if ((uint32_t)(get_current_time())<=starttime+900) {
 		return;
 	}
-	if (i>=NODEHASHSIZE) {
+	if (i>maxnodeid) {
 		MFSLOG(LOG_NOTICE,"structure check loop");
 		i=0;
 		errors=0;
@@ -5837,8 +6200,8 @@ void fs_test_files() {
 		fsinfo_loopstart = fsinfo_loopend;
 		fsinfo_loopend = get_current_time();
 	}
-	for (k=0 ; k<(NODEHASHSIZE/14400) && i<NODEHASHSIZE ; k++,i++) {
-		for (f=nodehash[i] ; f ; f=f->next) {
+	for (k=0 ; k<(maxnodeid/14400)+1 && i<=maxnodeid ; k++,i++) {
+		if ((f=fsnodes_id_to_node(i))!=NULL) {
 			if (f->type==TYPE_FILE || f->type==TYPE_TRASH || f->type==TYPE_RESERVED) {
 				valid = 1;
 				ugflag = 0;
@@ -5879,7 +6242,7 @@ void fs_test_files() {
 							}
 							valid = 0;
 							mchunks++;
-						} else if (vc<f->goal) {
+						} else if (vc<GOAL_COPIES(f->goal)) {
 							ugflag = 1;
 							ugchunks++;
 						}
@@ -5977,16 +6340,6 @@ void fs_test_files() {
 							fs_test_log_inconsistency(e,"nextparent/prevparent",NULL,0);
 						}
 					}
-#ifdef EDGEHASH
-				} else if (e->next) {
-					if (e->next->prev != &(e->next)) {
-						if (leng<MSGBUFFSIZE) {
-							leng += fs_test_log_inconsistency(e,"nexthash/prevhash",msgbuff+leng,MSGBUFFSIZE-leng);
-						} else {
-							fs_test_log_inconsistency(e,"nexthash/prevhash",NULL,0);
-						}
-					}
-#endif
 				}
 			}
 			if (f->type == TYPE_DIRECTORY) {
@@ -6025,16 +6378,6 @@ void fs_test_files() {
 								fs_test_log_inconsistency(e,"nextparent/prevparent",NULL,0);
 							}
 						}
-#ifdef EDGEHASH
-					} else if (e->next) {
-						if (e->next->prev != &(e->next)) {
-							if (leng<MSGBUFFSIZE) {
-								leng += fs_test_log_inconsistency(e,"nexthash/prevhash",msgbuff+leng,MSGBUFFSIZE-leng);
-							} else {
-								fs_test_log_inconsistency(e,"nexthash/prevhash",NULL,0);
-							}
-						}
-#endif
 					}
 				}
 			}
@@ -6195,8 +6538,8 @@ void fs_dumpnode(fsnode *f) {
 void fs_dumpnodes() {
 	uint32_t i;
 	fsnode *p;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (p=nodehash[i] ; p ; p=p->next) {
+	for (i=0 ; i<=maxnodeid ; i++) {
+		if ((p=fsnodes_id_to_node(i))!=NULL) {
 			fs_dumpnode(p);
 		}
 	}
@@ -6235,7 +6578,123 @@ void fs_dump(void) {
 }
 
 
-void fs_storeedge(fsedge *e,FILE *fd) {
+/* "MFSM 2.0" image - signature, HEAD section (the same 16 bytes as 1.5 header, so fs_loadversion reads both formats), NODE and EDGE sections (up to FSSECTION_RECORDS records each, no end markers), FREE section, CHNK section (chunk_store output), section table and trailer
+   section table: count:32 count*[ tag:32 offset:64 length:64 crc:32 ] crc:32 (of count and entries) ; trailer: tableoffset:64 "MFSM END" */
+#define FSSECTION_HEAD 0x48454144
+#define FSSECTION_NODE 0x4E4F4445
+#define FSSECTION_EDGE 0x45444745
+#define FSSECTION_FREE 0x46524545
+#define FSSECTION_CHNK 0x43484E4B
+/* XORG (chunk_xor_store output) follows CHNK - whole list of xor groups */
+#define FSSECTION_XORG 0x584F5247
+#define FSSECTION_RECORDS 0x40000
+#define FSSECTION_ENTRYSIZE (4+8+8+4)
+#define FSSECTION_TRAILERSIZE (8+8)
+#define FSSECTION_CRCBUFFSIZE 0x100000
+
+typedef struct _fssection {
+	uint32_t tag;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t crc;
+} fssection;
+
+static fssection *storesections = NULL;
+static uint32_t storesectionscnt = 0;
+static uint32_t storesectionssize = 0;
+static uint32_t storerecords;
+
+static void fs_section_begin(FILE *fd,uint32_t tag) {
+	fssection *s;
+	if (storesectionscnt==storesectionssize) {
+		storesectionssize = (storesectionssize>0)?storesectionssize*2:64;
+		storesections = (fssection*)realloc(storesections,sizeof(fssection)*storesectionssize);
+	}
+	s = storesections+storesectionscnt;
+	s->tag = tag;
+	s->offset = ftello(fd);
+	s->length = 0;
+	s->crc = 0;
+	storesectionscnt++;
+	storerecords = 0;
+}
+
+static void fs_section_end(FILE *fd) {
+	fssection *s;
+	s = storesections+(storesectionscnt-1);
+	s->length = ftello(fd)-s->offset;
+}
+
+// called before each node/edge record - closes full section and opens next one of the same kind
+static inline void fs_section_record(FILE *fd) {
+	if (storerecords==FSSECTION_RECORDS) {
+		fs_section_end(fd);
+		fs_section_begin(fd,storesections[storesectionscnt-1].tag);
+	}
+	storerecords++;
+}
+
+// reads stored sections back to calculate their checksums, then writes section table and trailer
+static int fs_section_table(FILE *fd) {
+	uint8_t *buff,*ptr;
+	fssection *s;
+	uint64_t pos,tableoffset;
+	uint32_t i,l,crc,bsize;
+	int ret;
+
+	ret = 0;
+	if (fflush(fd)!=0) {
+		ret = -1;
+	}
+	bsize = 4+storesectionscnt*FSSECTION_ENTRYSIZE+4+FSSECTION_TRAILERSIZE;
+	if (bsize<FSSECTION_CRCBUFFSIZE) {
+		bsize = FSSECTION_CRCBUFFSIZE;
+	}
+	buff = (uint8_t*)malloc(bsize);
+	if (buff==NULL) {
+		ret = -1;
+	}
+	for (i=0 ; i<storesectionscnt && ret==0 ; i++) {
+		s = storesections+i;
+		crc = 0;
+		for (pos=0 ; pos<s->length && ret==0 ; pos+=l) {
+			l = (s->length-pos>bsize)?bsize:(s->length-pos);
+			if (pread(fileno(fd),buff,l,s->offset+pos)!=(ssize_t)l) {
+				ret = -1;
+			} else {
+				crc = mycrc32(crc,buff,l);
+			}
+		}
+		s->crc = crc;
+	}
+	if (ret==0) {
+		tableoffset = ftello(fd);
+		ptr = buff;
+		put32bit(&ptr,storesectionscnt);
+		for (i=0 ; i<storesectionscnt ; i++) {
+			s = storesections+i;
+			put32bit(&ptr,s->tag);
+			put64bit(&ptr,s->offset);
+			put64bit(&ptr,s->length);
+			put32bit(&ptr,s->crc);
+		}
+		crc = mycrc32(0,buff,ptr-buff);
+		put32bit(&ptr,crc);
+		put64bit(&ptr,tableoffset);
+		memcpy(ptr,"MFSM END",8);
+		ptr+=8;
+		if (fwrite(buff,1,ptr-buff,fd)!=(size_t)(ptr-buff)) {
+			ret = -1;
+		}
+	}
+	if (buff) {
+		free(buff);
+	}
+	storesectionscnt = 0;
+	return ret;
+}
+
+void fs_storeedge(fsedge *e,FILE *fd) {
 	uint8_t uedgebuff[4+4+2+65535];
 	uint8_t *ptr;
 	if (e==NULL) {	// last edge
@@ -6255,16 +6714,60 @@ void fs_storeedge(fsedge *e,FILE *fd) {
 	fwrite(uedgebuff,1,4+4+2+e->nleng,fd);
 }
 
+// links loaded (and already checked) edge into children list of its parent (or trash/reserved list) and parents list of its child
+static inline void fs_loadedge_link(fsedge *e) {
+	statsrecord sr;
+	if (e->parent==NULL) {
+		if (e->child->type==TYPE_TRASH) {
+			e->nextchild = trash;
+			if (e->nextchild) {
+				e->nextchild->prevchild = &(e->nextchild);
+			}
+			trash = e;
+			e->prevchild = &trash;
+			trashspace += e->child->data.fdata.length;
+			trashnodes++;
+		} else {
+			e->nextchild = reserved;
+			if (e->nextchild) {
+				e->nextchild->prevchild = &(e->nextchild);
+			}
+			reserved = e;
+			e->prevchild = &reserved;
+			reservedspace += e->child->data.fdata.length;
+			reservednodes++;
+		}
+	} else {
+		e->nextchild = e->parent->data.ddata.children;
+		if (e->nextchild) {
+			e->nextchild->prevchild = &(e->nextchild);
+		}
+		e->parent->data.ddata.children = e;
+		e->prevchild = &(e->parent->data.ddata.children);
+		e->parent->data.ddata.elements++;
+		if (e->child->type==TYPE_DIRECTORY) {
+			e->parent->data.ddata.nlink++;
+		}
+	}
+	e->nextparent = e->child->parents;
+	if (e->nextparent) {
+		e->nextparent->prevparent = &(e->nextparent);
+	}
+	e->child->parents = e;
+	e->prevparent = &(e->child->parents);
+	if (e->parent) {
+		fsnodes_get_stats(e->child,&sr);
+		fsnodes_add_stats(e->parent,&sr);
+	}
+}
+
 int fs_loadedge(FILE *fd) {
 	uint8_t uedgebuff[4+4+2];
 	const uint8_t *ptr;
 	uint32_t parent_id;
 	uint32_t child_id;
-#ifdef EDGEHASH
-	uint32_t hpos;
-#endif
+	uint16_t nleng;
 	fsedge *e;
-	statsrecord sr;
 
 	if (fread(uedgebuff,1,4+4+2,fd)!=4+4+2) {
 		MFSLOG(LOG_ERR,"loading edge: read error: %m");
@@ -6276,110 +6779,56 @@ int fs_loadedge(FILE *fd) {
 	if (parent_id==0 && child_id==0) {	// last edge
 		return 1;
 	}
-	e = malloc(sizeof(fsedge));
+	nleng = get16bit(&ptr);
+	e = fsedge_malloc(nleng);
 	if (e==NULL) {
 		MFSLOG(LOG_ERR,"loading edge: edge alloc: out of memory");
 		return -1;
 	}
-	e->nleng = get16bit(&ptr);
-	e->name = malloc(e->nleng);
-	if (e->name==NULL) {
+	e->nleng = nleng;
+	if (e->name==NULL && nleng>0) {
 		MFSLOG(LOG_ERR,"loading edge: name alloc: out of memory");
-		free(e);
+		fsedge_free(e);
 		return -1;
 	}
 	if (fread(e->name,1,e->nleng,fd)!=e->nleng) {
 		MFSLOG(LOG_ERR,"loading edge: read error: %m");
-		free(e->name);
-		free(e);
+		fsedge_free(e);
 		return -1;
 	}
 	e->child = fsnodes_id_to_node(child_id);
 	if (e->child==NULL) {
 		MFSLOG(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: child not found",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
-		free(e->name);
-		free(e);
+		fsedge_free(e);
 		return -1;
 	}
 	if (parent_id==0) {
-		if (e->child->type==TYPE_TRASH) {
-			e->parent = NULL;
-			e->nextchild = trash;
-			if (e->nextchild) {
-				e->nextchild->prevchild = &(e->nextchild);
-			}
-			trash = e;
-			e->prevchild = &trash;
-#ifdef EDGEHASH
-			e->next = NULL;
-			e->prev = NULL;
-#endif
-			trashspace += e->child->data.fdata.length;
-			trashnodes++;
-		} else if (e->child->type==TYPE_RESERVED) {
-			e->parent = NULL;
-			e->nextchild = reserved;
-			if (e->nextchild) {
-				e->nextchild->prevchild = &(e->nextchild);
-			}
-			reserved = e;
-			e->prevchild = &reserved;
-#ifdef EDGEHASH
-			e->next = NULL;
-			e->prev = NULL;
-#endif
-			reservedspace += e->child->data.fdata.length;
-			reservednodes++;
-		} else {
+		e->parent = NULL;
+		if (e->child->type!=TYPE_TRASH && e->child->type!=TYPE_RESERVED) {
 			MFSLOG(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad child type (%c)",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,e->child->type);
-			free(e->name);
-			free(e);
+			fsedge_free(e);
 			return -1;
 		}
 	} else {
 		e->parent = fsnodes_id_to_node(parent_id);
 		if (e->parent==NULL) {
 			MFSLOG(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: parent not found",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id);
-			free(e->name);
-			free(e);
+			fsedge_free(e);
 			return -1;
 		}
 		if (e->parent->type!=TYPE_DIRECTORY) {
 			MFSLOG(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad parent type (%c)",parent_id,fsnodes_escape_name(e->nleng,e->name),child_id,e->parent->type);
-			free(e->name);
-			free(e);
+			fsedge_free(e);
 			return -1;
 		}
-		e->nextchild = e->parent->data.ddata.children;
-		if (e->nextchild) {
-			e->nextchild->prevchild = &(e->nextchild);
-		}
-		e->parent->data.ddata.children = e;
-		e->prevchild = &(e->parent->data.ddata.children);
-		e->parent->data.ddata.elements++;
-		if (e->child->type==TYPE_DIRECTORY) {
-			e->parent->data.ddata.nlink++;
-		}
-#ifdef EDGEHASH
-		hpos = EDGEHASHPOS(fsnodes_hash(e->parent->id,e->nleng,e->name));
-		e->next = edgehash[hpos];
-		if (e->next) {
-			e->next->prev = &(e->next);
-		}
-		edgehash[hpos] = e;
-		e->prev = &(edgehash[hpos]);
-#endif
-	}
-	e->nextparent = e->child->parents;
-	if (e->nextparent) {
-		e->nextparent->prevparent = &(e->nextparent);
 	}
-	e->child->parents = e;
-	e->prevparent = &(e->child->parents);
+	fs_loadedge_link(e);
+#ifdef EDGEHASH
 	if (e->parent) {
-		fsnodes_get_stats(e->child,&sr);
-		fsnodes_add_stats(e->parent,&sr);
+		e->hash = fsnodes_hash(e->nleng,e->name);
+		fsnodes_nameidx_add(e->parent,e);
 	}
+#endif
 	return 0;
 }
 
@@ -6458,14 +6907,13 @@ int fs_loadnode(FILE *fd) {
 	uint32_t indx,pleng,ch,sessionids,sessionid;
 	fsnode *p;
 	sessionidrec *sessionidptr;
-	uint32_t nodepos;
 	statsrecord *sr;
 
 	type = fgetc(fd);
 	if (type==0) {	// last node
 		return 1;
 	}
-	p = malloc(sizeof(fsnode));
+	p = fsnode_malloc();
 	if (p==NULL) {
 		MFSLOG(LOG_ERR,"loading node: node alloc: out of memory");
 		return -1;
@@ -6477,7 +6925,7 @@ int fs_loadnode(FILE *fd) {
 	case TYPE_SOCKET:
 		if (fread(unodebuff,1,4+1+2+4+4+4+4+4+4,fd)!=4+1+2+4+4+4+4+4+4) {
 			MFSLOG(LOG_ERR,"loading node: read error: %m");
-			free(p);
+			fsnode_free(p);
 			return -1;
 		}
 		break;
@@ -6486,7 +6934,7 @@ int fs_loadnode(FILE *fd) {
 	case TYPE_SYMLINK:
 		if (fread(unodebuff,1,4+1+2+4+4+4+4+4+4+4,fd)!=4+1+2+4+4+4+4+4+4+4) {
 			MFSLOG(LOG_ERR,"loading node: read error: %m");
-			free(p);
+			fsnode_free(p);
 			return -1;
 		}
 		break;
@@ -6495,13 +6943,13 @@ int fs_loadnode(FILE *fd) {
 	case TYPE_RESERVED:
 		if (fread(unodebuff,1,4+1+2+4+4+4+4+4+4+8+4+2,fd)!=4+1+2+4+4+4+4+4+4+8+4+2) {
 			MFSLOG(LOG_ERR,"loading node: read error: %m");
-			free(p);
+			fsnode_free(p);
 			return -1;
 		}
 		break;
 	default:
 		MFSLOG(LOG_ERR,"loading node: unrecognized node type: %c",type);
-		free(p);
+		fsnode_free(p);
 		return -1;
 	}
 	ptr = unodebuff;
@@ -6521,6 +6969,9 @@ int fs_loadnode(FILE *fd) {
 		p->data.ddata.stats = sr;
 		p->data.ddata.quota = NULL;
 		p->data.ddata.children = NULL;
+#ifdef EDGEHASH
+		p->data.ddata.nameidx = NULL;
+#endif
 		p->data.ddata.nlink = 2;
 		p->data.ddata.elements = 0;
 	case TYPE_SOCKET:
@@ -6537,13 +6988,13 @@ int fs_loadnode(FILE *fd) {
 			p->data.sdata.path = malloc(pleng);
 			if (p->data.sdata.path==NULL) {
 				MFSLOG(LOG_ERR,"loading node: path alloc: out of memory");
-				free(p);
+				fsnode_free(p);
 				return -1;
 			}
 			if (fread(p->data.sdata.path,1,pleng,fd)!=pleng) {
 				MFSLOG(LOG_ERR,"loading node: read error: %m");
 				free(p->data.sdata.path);
-				free(p);
+				fsnode_free(p);
 				return -1;
 			}
 		} else {
@@ -6561,7 +7012,7 @@ int fs_loadnode(FILE *fd) {
 			p->data.fdata.chunktab = malloc(sizeof(uint64_t)*ch);
 			if (p->data.fdata.chunktab==NULL) {
 				MFSLOG(LOG_ERR,"loading node: chunktab alloc: out of memory");
-				free(p);
+				fsnode_free(p);
 				return -1;
 			}
 		} else {
@@ -6572,7 +7023,7 @@ int fs_loadnode(FILE *fd) {
 			if (p->data.fdata.chunktab) {
 				free(p->data.fdata.chunktab);
 			}
-			free(p);
+			fsnode_free(p);
 			return -1;
 		}
 		for (indx=0 ; indx<ch ; indx++) {
@@ -6587,7 +7038,7 @@ int fs_loadnode(FILE *fd) {
 				if (p->data.fdata.chunktab) {
 					free(p->data.fdata.chunktab);
 				}
-				free(p);
+				fsnode_free(p);
 				return -1;
 			}
 			sessionidptr->sessionid = sessionid;
@@ -6598,9 +7049,7 @@ int fs_loadnode(FILE *fd) {
 		}
 	}
 	p->parents = NULL;
-	nodepos = NODEHASHPOS(p->id);
-	p->next = nodehash[nodepos];
-	nodehash[nodepos] = p;
+	fsnodes_nodetab_insert(p);
 	fsnodes_used_inode(p->id);
 	nodes++;
 	if (type==TYPE_DIRECTORY) {
@@ -6615,16 +7064,19 @@ int fs_loadnode(FILE *fd) {
 void fs_storenodes(FILE *fd) {
 	uint32_t i;
 	fsnode *p;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (p=nodehash[i] ; p ; p=p->next) {
+	fs_section_begin(fd,FSSECTION_NODE);
+	for (i=0 ; i<=maxnodeid ; i++) {
+		if ((p=fsnodes_id_to_node(i))!=NULL) {
+			fs_section_record(fd);
 			fs_storenode(p,fd);
 		}
 	}
-	fs_storenode(NULL,fd);	// end marker
+	fs_section_end(fd);
 }
 
 void fs_storeedgelist(fsedge *e,FILE *fd) {
 	while (e) {
+		fs_section_record(fd);
 		fs_storeedge(e,fd);
 		e=e->nextchild;
 	}
@@ -6641,10 +7093,11 @@ void fs_storeedges_rec(fsnode *f,FILE *fd) {
 }
 
 void fs_storeedges(FILE *fd) {
+	fs_section_begin(fd,FSSECTION_EDGE);
 	fs_storeedges_rec(root,fd);
 	fs_storeedgelist(trash,fd);
 	fs_storeedgelist(reserved,fd);
-	fs_storeedge(NULL,fd);	// end marker
+	fs_section_end(fd);
 }
 
 int fs_lostnode(fsnode *p) {
@@ -6669,8 +7122,8 @@ int fs_lostnode(fsnode *p) {
 int fs_checknodes() {
 	uint32_t i;
 	fsnode *p;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		for (p=nodehash[i] ; p ; p=p->next) {
+	for (i=0 ; i<=maxnodeid ; i++) {
+		if ((p=fsnodes_id_to_node(i))!=NULL) {
 			if (p->parents==NULL && p!=root) {
 				MFSLOG(LOG_ERR,"fschk: found lost inode: %"PRIu32,p->id);
 				if (fs_lostnode(p)<0) {
@@ -6776,44 +7229,52 @@ int fs_loadfree(FILE *fd) {
 	return 0;
 }
 
-void fs_store(FILE *fd) {
+int fs_store(FILE *fd) {
 	uint8_t hdr[16];
 	uint8_t *ptr;
 	ptr = hdr;
 	put32bit(&ptr,maxnodeid);
 	put64bit(&ptr,version);
 	put32bit(&ptr,nextsessionid);
+	fwrite("MFSM 2.0",1,8,fd);
+	fs_section_begin(fd,FSSECTION_HEAD);
 	fwrite(hdr,1,16,fd);
+	fs_section_end(fd);
 	fs_storenodes(fd);
 	fs_storeedges(fd);
+	fs_section_begin(fd,FSSECTION_FREE);
 	fs_storefree(fd);
+	fs_section_end(fd);
+	fs_section_begin(fd,FSSECTION_CHNK);
+	chunk_store(fd);
+	fs_section_end(fd);
+	fs_section_begin(fd,FSSECTION_XORG);
+	chunk_xor_store(fd);
+	fs_section_end(fd);
+	return fs_section_table(fd);
 }
 
+// reads version from header of plain or compressed image
 uint64_t fs_loadversion(FILE *fd) {
-	uint8_t hdr[12];
+	uint8_t hdr[8+12];
 	const uint8_t *ptr;
 	uint64_t fversion;
 
-	if (fread(hdr,1,12,fd)!=12) {
+	if (metastream_readhead(fileno(fd),hdr,8+12)<0) {
 		return 0;
 	}
-	ptr = hdr+4;
+	ptr = hdr+8+4;
 //	maxnodeid = get32bit(&ptr);
 	fversion = get64bit(&ptr);
 //	nextsessionid = get32bit(&ptr);
 	return fversion;
 }
 
-int fs_load(FILE *fd) {
-	uint8_t hdr[16];
+void fs_loadheader(const uint8_t *hdr) {
 	const uint8_t *ptr;
 	uint64_t loadversion;
 	//uint32_t loadsessionid;	
-	
-	if (fread(hdr,1,16,fd)!=16) {
-		MFSLOG(LOG_NOTICE,"error loading header");
-		return -1;
-	}
+
 	ptr = hdr;
 	maxnodeid = get32bit(&ptr);
 
@@ -6844,7 +7305,31 @@ int fs_load(FILE *fd) {
 			nextsessionid = loadsessionid;
 	}
 	*/
+}
+
+int fs_load_check(void) {
+	MFSLOG(LOG_NOTICE,"checking filesystem consistency ... ");
+	root = fsnodes_id_to_node(MFS_ROOT_ID);
+	if (root==NULL) {
+		MFSLOG(LOG_ERR,"error reading metadata (no root)");
+		return -1;
+	}
+	if (fs_checknodes()<0) {
+		MFSLOG(LOG_NOTICE,"error");
+		return -1;
+	}
+	MFSLOG(LOG_NOTICE,"ok");
+	return 0;
+}
+
+int fs_load(FILE *fd) {
+	uint8_t hdr[16];
 	
+	if (fread(hdr,1,16,fd)!=16) {
+		MFSLOG(LOG_NOTICE,"error loading header");
+		return -1;
+	}
+	fs_loadheader(hdr);
 	fsnodes_init_freebitmask();
 	MFSLOG(LOG_NOTICE,"loading objects (files,directories,etc.) ... ");
 	if (fs_loadnodes(fd)<0) {
@@ -6864,28 +7349,622 @@ int fs_load(FILE *fd) {
 		return -1;
 	}
 	MFSLOG(LOG_NOTICE,"ok");
-	MFSLOG(LOG_NOTICE,"checking filesystem consistency ... ");
-	root = fsnodes_id_to_node(MFS_ROOT_ID);
-	if (root==NULL) {
-		MFSLOG(LOG_ERR,"error reading metadata (no root)");
+	return fs_load_check();
+}
+
+// "MFSM 2.0" loader - file is mapped, sections are verified and decoded by up to FSLOAD_MAXTHREADS threads, objects are linked together by the calling thread in file order
+#define FSLOAD_MAXTHREADS 16
+
+typedef struct _fsload_sessions {
+	fsnode *node;
+	const uint8_t *ptr;
+	uint32_t cnt;
+} fsload_sessions;
+
+typedef struct _fsload_section {
+	uint32_t tag;
+	const uint8_t *data;
+	uint64_t length;
+	uint32_t crc;
+	int status;
+	fsobj_slabs slabs;
+	uint32_t nodes,dirnodes,filenodes;
+	fsload_sessions *sessions;
+	uint32_t sessionscnt,sessionssize;
+	fsedge *edges,**edgestail;
+} fsload_section;
+
+typedef struct _fsload_pool {
+	void (*fn)(void *arg,uint32_t job);
+	void *arg;
+	uint32_t jobs;
+	uint32_t next;
+	pthread_mutex_t lock;
+} fsload_pool;
+
+static uint32_t fsloadthreads = 0;	// 0 - one thread per cpu
+
+static void* fs_load_worker(void *arg) {
+	fsload_pool *lp = (fsload_pool*)arg;
+	uint32_t job;
+	for (;;) {
+		pthread_mutex_lock(&(lp->lock));
+		job = lp->next;
+		if (job<lp->jobs) {
+			lp->next++;
+		}
+		pthread_mutex_unlock(&(lp->lock));
+		if (job>=lp->jobs) {
+			return NULL;
+		}
+		lp->fn(lp->arg,job);
+	}
+}
+
+// calls fn(arg,job) for every job in 0..jobs-1 using loader threads (calling thread is one of them)
+static void fs_load_parallel(void (*fn)(void *arg,uint32_t job),void *arg,uint32_t jobs) {
+	pthread_t th[FSLOAD_MAXTHREADS];
+	fsload_pool lp;
+	uint32_t i,n;
+	long cpus;
+
+	n = fsloadthreads;
+	if (n==0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = (cpus>0)?cpus:1;
+	}
+	if (n>FSLOAD_MAXTHREADS) {
+		n = FSLOAD_MAXTHREADS;
+	}
+	if (n>jobs) {
+		n = jobs;
+	}
+	lp.fn = fn;
+	lp.arg = arg;
+	lp.jobs = jobs;
+	lp.next = 0;
+	pthread_mutex_init(&(lp.lock),NULL);
+	for (i=1 ; i<n ; i++) {
+		if (pthread_create(th+i,NULL,fs_load_worker,&lp)!=0) {
+			break;
+		}
+	}
+	n = i;
+	fs_load_worker(&lp);
+	for (i=1 ; i<n ; i++) {
+		pthread_join(th[i],NULL);
+	}
+	pthread_mutex_destroy(&(lp.lock));
+}
+
+static uint32_t fs_load_crc(const uint8_t *data,uint64_t length) {
+	uint32_t crc,l;
+	crc = 0;
+	while (length>0) {
+		l = (length>0x40000000)?0x40000000:length;
+		crc = mycrc32(crc,data,l);
+		data += l;
+		length -= l;
+	}
+	return crc;
+}
+
+// decodes one node record (fs_storenode format) - session ids are only remembered here and attached later by the calling thread
+static int fs_load_decodenode(fsload_section *ls,const uint8_t **rptr,const uint8_t *eptr) {
+	const uint8_t *ptr;
+	uint8_t type;
+	uint32_t indx,pleng,ch,sessionids,hsize;
+	fsnode *p,*o;
+	fsload_sessions *lss;
+	statsrecord *sr;
+
+	ptr = *rptr;
+	type = *ptr;
+	switch (type) {
+	case TYPE_DIRECTORY:
+	case TYPE_FIFO:
+	case TYPE_SOCKET:
+		hsize = 1+4+1+2+4+4+4+4+4+4;
+		break;
+	case TYPE_BLOCKDEV:
+	case TYPE_CHARDEV:
+	case TYPE_SYMLINK:
+		hsize = 1+4+1+2+4+4+4+4+4+4+4;
+		break;
+	case TYPE_FILE:
+	case TYPE_TRASH:
+	case TYPE_RESERVED:
+		hsize = 1+4+1+2+4+4+4+4+4+4+8+4+2;
+		break;
+	default:
+		MFSLOG(LOG_ERR,"loading node: unrecognized node type: %c",type);
 		return -1;
 	}
-	if (fs_checknodes()<0) {
+	if ((uint64_t)(eptr-ptr)<hsize) {
+		MFSLOG(LOG_ERR,"loading node: truncated record");
+		return -1;
+	}
+	p = fsnode_slab_malloc(&(ls->slabs));
+	if (p==NULL) {
+		MFSLOG(LOG_ERR,"loading node: node alloc: out of memory");
+		return -1;
+	}
+	ptr++;
+	p->type = type;
+	p->id = get32bit(&ptr);
+	p->goal = get8bit(&ptr);
+	p->mode = get16bit(&ptr);
+	p->uid = get32bit(&ptr);
+	p->gid = get32bit(&ptr);
+	p->atime = get32bit(&ptr);
+	p->mtime = get32bit(&ptr);
+	p->ctime = get32bit(&ptr);
+	p->trashtime = get32bit(&ptr);
+	switch (type) {
+	case TYPE_DIRECTORY:
+		sr = malloc(sizeof(statsrecord));
+		memset(sr,0,sizeof(statsrecord));
+		p->data.ddata.stats = sr;
+		p->data.ddata.quota = NULL;
+		p->data.ddata.children = NULL;
+#ifdef EDGEHASH
+		p->data.ddata.nameidx = NULL;
+#endif
+		p->data.ddata.nlink = 2;
+		p->data.ddata.elements = 0;
+	case TYPE_SOCKET:
+	case TYPE_FIFO:
+		break;
+	case TYPE_BLOCKDEV:
+	case TYPE_CHARDEV:
+		p->data.rdev = get32bit(&ptr);
+		break;
+	case TYPE_SYMLINK:
+		pleng = get32bit(&ptr);
+		p->data.sdata.pleng = pleng;
+		if ((uint64_t)(eptr-ptr)<pleng) {
+			MFSLOG(LOG_ERR,"loading node: truncated record");
+			return -1;
+		}
+		if (pleng>0) {
+			p->data.sdata.path = malloc(pleng);
+			if (p->data.sdata.path==NULL) {
+				MFSLOG(LOG_ERR,"loading node: path alloc: out of memory");
+				return -1;
+			}
+			memcpy(p->data.sdata.path,ptr,pleng);
+			ptr += pleng;
+		} else {
+			p->data.sdata.path = NULL;
+		}
+		break;
+	case TYPE_FILE:
+	case TYPE_TRASH:
+	case TYPE_RESERVED:
+		p->data.fdata.length = get64bit(&ptr);
+		ch = get32bit(&ptr);
+		p->data.fdata.chunks = ch;
+		sessionids = get16bit(&ptr);
+		if ((uint64_t)(eptr-ptr)<8ULL*ch+4*sessionids) {
+			MFSLOG(LOG_ERR,"loading node: truncated record");
+			return -1;
+		}
+		if (ch>0) {
+			p->data.fdata.chunktab = malloc(sizeof(uint64_t)*ch);
+			if (p->data.fdata.chunktab==NULL) {
+				MFSLOG(LOG_ERR,"loading node: chunktab alloc: out of memory");
+				return -1;
+			}
+		} else {
+			p->data.fdata.chunktab = NULL;
+		}
+		for (indx=0 ; indx<ch ; indx++) {
+			p->data.fdata.chunktab[indx] = get64bit(&ptr);
+		}
+		p->data.fdata.sessionids = NULL;
+		if (sessionids>0) {
+			if (ls->sessionscnt==ls->sessionssize) {
+				ls->sessionssize = (ls->sessionssize>0)?ls->sessionssize*2:256;
+				ls->sessions = (fsload_sessions*)realloc(ls->sessions,sizeof(fsload_sessions)*ls->sessionssize);
+				if (ls->sessions==NULL) {
+					MFSLOG(LOG_ERR,"loading node: sessionid list alloc: out of memory");
+					return -1;
+				}
+			}
+			lss = ls->sessions+ls->sessionscnt;
+			lss->node = p;
+			lss->ptr = ptr;
+			lss->cnt = sessionids;
+			ls->sessionscnt++;
+			ptr += 4*sessionids;
+		}
+	}
+	p->parents = NULL;
+	if (NODETABPAGE(p->id)>=nodetabpages) {
+		MFSLOG(LOG_ERR,"loading node: inode %"PRIu32" above maxnodeid (%"PRIu32")",p->id,maxnodeid);
+		return -1;
+	}
+	// node sections are decoded in parallel, so duplicates from different sections are also caught here
+	o = NULL;
+	if (__atomic_compare_exchange_n(&(nodetab[NODETABPAGE(p->id)][NODETABPOS(p->id)]),&o,p,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)==0) {
+		MFSLOG(LOG_ERR,"loading node: inode %"PRIu32" error: inode already loaded",p->id);
+		return -1;
+	}
+	ls->nodes++;
+	if (type==TYPE_DIRECTORY) {
+		ls->dirnodes++;
+	}
+	if (type==TYPE_FILE || type==TYPE_TRASH || type==TYPE_RESERVED) {
+		ls->filenodes++;
+	}
+	*rptr = ptr;
+	return 0;
+}
+
+// decodes one edge record (fs_storeedge format) and resolves its nodes - edge is linked later by the calling thread
+static int fs_load_decodeedge(fsload_section *ls,const uint8_t **rptr,const uint8_t *eptr) {
+	const uint8_t *ptr;
+	uint32_t parent_id;
+	uint32_t child_id;
+	uint16_t nleng;
+	fsedge *e;
+	char escname[3*MAXFNAMELENG+1];	// fsnodes_escape_name isn't thread safe
+
+	ptr = *rptr;
+	if (eptr-ptr<4+4+2) {
+		MFSLOG(LOG_ERR,"loading edge: truncated record");
+		return -1;
+	}
+	parent_id = get32bit(&ptr);
+	child_id = get32bit(&ptr);
+	nleng = get16bit(&ptr);
+	if (eptr-ptr<nleng) {
+		MFSLOG(LOG_ERR,"loading edge: truncated record");
+		return -1;
+	}
+	e = fsedge_slab_malloc(&(ls->slabs),nleng);
+	if (e==NULL || (e->name==NULL && nleng>0)) {
+		MFSLOG(LOG_ERR,"loading edge: edge alloc: out of memory");
+		return -1;
+	}
+	e->nleng = nleng;
+	memcpy(e->name,ptr,nleng);
+	ptr += nleng;
+	fsnodes_escape_name_buff(escname,(nleng>MAXFNAMELENG)?MAXFNAMELENG:nleng,e->name);
+	e->child = fsnodes_id_to_node(child_id);
+	if (e->child==NULL) {
+		MFSLOG(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: child not found",parent_id,escname,child_id);
+		return -1;
+	}
+	if (parent_id==0) {
+		e->parent = NULL;
+		if (e->child->type!=TYPE_TRASH && e->child->type!=TYPE_RESERVED) {
+			MFSLOG(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad child type (%c)",parent_id,escname,child_id,e->child->type);
+			return -1;
+		}
+	} else {
+		e->parent = fsnodes_id_to_node(parent_id);
+		if (e->parent==NULL) {
+			MFSLOG(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: parent not found",parent_id,escname,child_id);
+			return -1;
+		}
+		if (e->parent->type!=TYPE_DIRECTORY) {
+			MFSLOG(LOG_ERR,"loading edge: %"PRIu32",%s->%"PRIu32" error: bad parent type (%c)",parent_id,escname,child_id,e->parent->type);
+			return -1;
+		}
+#ifdef EDGEHASH
+		e->hash = fsnodes_hash(e->nleng,e->name);
+#endif
+	}
+	e->nextchild = NULL;
+	*(ls->edgestail) = e;
+	ls->edgestail = &(e->nextchild);
+	*rptr = ptr;
+	return 0;
+}
+
+// first pass - checksums of all sections, nodes and chunks
+static void fs_load_nodes_job(void *arg,uint32_t job) {
+	fsload_section *ls = ((fsload_section*)arg)+job;
+	const uint8_t *ptr,*eptr;
+	FILE *fd;
+
+	if (fs_load_crc(ls->data,ls->length)!=ls->crc) {
+		MFSLOG(LOG_ERR,"metadata section %"PRIu32" (%c%c%c%c): checksum error",job,ls->tag>>24,(ls->tag>>16)&0xFF,(ls->tag>>8)&0xFF,ls->tag&0xFF);
+		ls->status = -1;
+		return;
+	}
+	if (ls->tag==FSSECTION_NODE) {
+		ptr = ls->data;
+		eptr = ptr+ls->length;
+		while (ptr<eptr) {
+			if (fs_load_decodenode(ls,&ptr,eptr)<0) {
+				ls->status = -1;
+				return;
+			}
+		}
+	} else if (ls->tag==FSSECTION_CHNK) {
+		fd = fmemopen((void*)(ls->data),ls->length,"r");
+		if (fd==NULL || chunk_load(fd)<0) {
+			MFSLOG(LOG_ERR,"error reading metadata (chunks)");
+			ls->status = -1;
+		}
+		if (fd!=NULL) {
+			fclose(fd);
+		}
+	}
+}
+
+// second pass - edges (all nodes are already in nodetab)
+static void fs_load_edges_job(void *arg,uint32_t job) {
+	fsload_section *ls = ((fsload_section*)arg)+job;
+	const uint8_t *ptr,*eptr;
+
+	if (ls->tag==FSSECTION_EDGE) {
+		ptr = ls->data;
+		eptr = ptr+ls->length;
+		while (ptr<eptr) {
+			if (fs_load_decodeedge(ls,&ptr,eptr)<0) {
+				ls->status = -1;
+				return;
+			}
+		}
+	}
+}
+
+#ifdef EDGEHASH
+// third pass - name indexes of big directories, one nodetab page per job
+static void fs_load_nameidx_job(void *arg,uint32_t job) {
+	fsnode *p;
+	uint32_t i;
+	(void)arg;
+	for (i=0 ; i<NODETABPAGESIZE ; i++) {
+		p = nodetab[job][i];
+		if (p && p->type==TYPE_DIRECTORY && p->data.ddata.elements>LOOKUPNOHASHLIMIT) {
+			fsnodes_nameidx_rebuild(p);
+		}
+	}
+}
+#endif
+
+static int fs_load_checkstatus(fsload_section *lsections,uint32_t cnt) {
+	uint32_t i;
+	for (i=0 ; i<cnt ; i++) {
+		if (lsections[i].status<0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int fs_load_sections(fsload_section *lsections,uint32_t cnt) {
+	fsload_section *ls;
+	fsload_sessions *lss;
+	sessionidrec *sessionidptr;
+	fsedge *e,*ne;
+	FILE *ffd;
+	const uint8_t *ptr;
+	uint32_t i,j,k,sessionid;
+
+	if (cnt==0 || lsections[0].tag!=FSSECTION_HEAD || lsections[0].length!=16) {
+		MFSLOG(LOG_NOTICE,"error");
+		MFSLOG(LOG_ERR,"error reading metadata (no header section)");
+		return -1;
+	}
+	if (fs_load_crc(lsections[0].data,16)!=lsections[0].crc) {
+		MFSLOG(LOG_NOTICE,"error");
+		MFSLOG(LOG_ERR,"error reading metadata (header checksum)");
+		return -1;
+	}
+	fs_loadheader(lsections[0].data);
+	fsnodes_init_freebitmask();
+	fsnodes_nodetab_reserve(maxnodeid);
+	mycrc32(0,NULL,0);	// generate crc tables before starting threads
+
+	MFSLOG(LOG_NOTICE, "loading objects (files,directories,etc.) and chunks ... ");
+	fs_load_parallel(fs_load_nodes_job,lsections,cnt);
+	if (fs_load_checkstatus(lsections,cnt)<0) {
 		MFSLOG(LOG_NOTICE,"error");
+		MFSLOG(LOG_ERR,"error reading metadata (node)");
 		return -1;
 	}
+	for (i=0 ; i<cnt ; i++) {
+		ls = lsections+i;
+		if (ls->tag==FSSECTION_NODE) {
+			nodes += ls->nodes;
+			dirnodes += ls->dirnodes;
+			filenodes += ls->filenodes;
+			for (j=0 ; j<ls->sessionscnt ; j++) {
+				lss = ls->sessions+j;
+				ptr = lss->ptr;
+				for (k=0 ; k<lss->cnt ; k++) {
+					sessionid = get32bit(&ptr);
+					sessionidptr = sessionidrec_malloc();
+					sessionidptr->sessionid = sessionid;
+					sessionidptr->next = lss->node->data.fdata.sessionids;
+					lss->node->data.fdata.sessionids = sessionidptr;
+					matocuserv_init_sessions(sessionid,lss->node->id);
+				}
+			}
+			fsobj_slabs_merge(&(ls->slabs));
+		}
+	}
+	for (i=0 ; i<=maxnodeid ; i++) {
+		if (fsnodes_id_to_node(i)!=NULL) {
+			fsnodes_used_inode(i);
+		}
+	}
 	MFSLOG(LOG_NOTICE,"ok");
-	return 0;
+	MFSLOG(LOG_NOTICE,"loading names ... ");
+
+	fs_load_parallel(fs_load_edges_job,lsections,cnt);
+	if (fs_load_checkstatus(lsections,cnt)<0) {
+		MFSLOG(LOG_NOTICE,"error");
+		MFSLOG(LOG_ERR,"error reading metadata (edge)");
+		return -1;
+	}
+	for (i=0 ; i<cnt ; i++) {
+		ls = lsections+i;
+		if (ls->tag==FSSECTION_EDGE) {
+			for (e=ls->edges ; e ; e=ne) {
+				ne = e->nextchild;
+				fs_loadedge_link(e);
+			}
+			fsobj_slabs_merge(&(ls->slabs));
+		}
+	}
+#ifdef EDGEHASH
+	fs_load_parallel(fs_load_nameidx_job,NULL,nodetabpages);
+#endif
+
+	MFSLOG(LOG_NOTICE,"ok");
+	MFSLOG(LOG_NOTICE,"loading deletion timestamps ... ");
+
+	ffd = NULL;
+	for (i=0 ; i<cnt && ffd==NULL ; i++) {
+		if (lsections[i].tag==FSSECTION_FREE) {
+			ffd = fmemopen((void*)(lsections[i].data),lsections[i].length,"r");
+		}
+	}
+	if (ffd==NULL || fs_loadfree(ffd)<0) {
+		MFSLOG(LOG_NOTICE,"error");
+		MFSLOG(LOG_ERR,"error reading metadata (free)");
+		if (ffd) {
+			fclose(ffd);
+		}
+		return -1;
+	}
+	fclose(ffd);
+	MFSLOG(LOG_NOTICE,"ok");
+	for (i=0 ; i<cnt ; i++) {
+		if (lsections[i].tag==FSSECTION_XORG) {
+			MFSLOG(LOG_NOTICE,"loading xor groups ... ");
+			ffd = fmemopen((void*)(lsections[i].data),lsections[i].length,"r");
+			if (ffd==NULL || chunk_xor_load(ffd)<0) {
+				MFSLOG(LOG_NOTICE,"error");
+				MFSLOG(LOG_ERR,"error reading metadata (xor groups)");
+				if (ffd) {
+					fclose(ffd);
+				}
+				return -1;
+			}
+			fclose(ffd);
+			MFSLOG(LOG_NOTICE,"ok");
+		}
+	}
+	return fs_load_check();
+}
+
+static void fs_loadimage_release(uint8_t *map,uint64_t fleng,uint8_t inflated) {
+	if (inflated) {
+		free(map);
+	} else {
+		munmap(map,fleng);
+	}
 }
 
+// maps (or decompresses) image, reads section table and loads all sections
+int fs_loadimage(FILE *fd) {
+	struct stat st;
+	uint8_t *map,*image,inflated;
+	const uint8_t *ptr,*tptr;
+	fsload_section *lsections,*ls;
+	uint64_t fleng,ileng,tableoffset,offset,length;
+	uint32_t i,cnt;
+	int ret;
+
+	if (fstat(fileno(fd),&st)<0 || st.st_size<8+FSSECTION_TRAILERSIZE) {
+		MFSLOG(LOG_NOTICE,"error reading metadata (file too short)");
+		return -1;
+	}
+	fleng = st.st_size;
+	map = mmap(NULL,fleng,PROT_READ,MAP_PRIVATE,fileno(fd),0);
+	if (map==MAP_FAILED) {
+		MFSLOG(LOG_NOTICE,"error mapping metadata file (%s)\n",strerror(errno));
+		return -1;
+	}
+	madvise(map,fleng,MADV_WILLNEED);
+	inflated = 0;
+	if (metastream_iscompressed(map)) {
+		MFSLOG(LOG_NOTICE,"decompressing metadata ...");
+		if (metastream_inflate(map,fleng,&image,&ileng)<0) {
+			MFSLOG(LOG_NOTICE,"error reading metadata (damaged compressed file)");
+			munmap(map,fleng);
+			return -1;
+		}
+		munmap(map,fleng);
+		map = image;
+		fleng = ileng;
+		inflated = 1;
+		if (fleng<8+FSSECTION_TRAILERSIZE) {
+			MFSLOG(LOG_NOTICE,"error reading metadata (file too short)");
+			free(map);
+			return -1;
+		}
+	}
+	ptr = map+fleng-FSSECTION_TRAILERSIZE;
+	tableoffset = get64bit(&ptr);
+	if (memcmp(ptr,"MFSM END",8)!=0 || tableoffset<8 || tableoffset+4+4>fleng-FSSECTION_TRAILERSIZE) {
+		MFSLOG(LOG_NOTICE,"error reading metadata (bad trailer)");
+		fs_loadimage_release(map,fleng,inflated);
+		return -1;
+	}
+	ptr = map+tableoffset;
+	cnt = get32bit(&ptr);
+	if (cnt==0 || (uint64_t)cnt*FSSECTION_ENTRYSIZE+4+4!=fleng-FSSECTION_TRAILERSIZE-tableoffset) {
+		MFSLOG(LOG_NOTICE,"error reading metadata (bad section table)");
+		fs_loadimage_release(map,fleng,inflated);
+		return -1;
+	}
+	tptr = ptr+cnt*FSSECTION_ENTRYSIZE;
+	if (fs_load_crc(map+tableoffset,4+cnt*FSSECTION_ENTRYSIZE)!=get32bit(&tptr)) {
+		MFSLOG(LOG_NOTICE,"error reading metadata (section table checksum)");
+		fs_loadimage_release(map,fleng,inflated);
+		return -1;
+	}
+	lsections = (fsload_section*)malloc(sizeof(fsload_section)*cnt);
+	if (lsections==NULL) {
+		fs_loadimage_release(map,fleng,inflated);
+		return -1;
+	}
+	memset(lsections,0,sizeof(fsload_section)*cnt);
+	ret = 0;
+	for (i=0 ; i<cnt ; i++) {
+		ls = lsections+i;
+		ls->tag = get32bit(&ptr);
+		offset = get64bit(&ptr);
+		length = get64bit(&ptr);
+		ls->crc = get32bit(&ptr);
+		if (offset<8 || offset>tableoffset || length>tableoffset-offset) {
+			ret = -1;
+		}
+		ls->data = map+offset;
+		ls->length = length;
+		ls->edgestail = &(ls->edges);
+	}
+	if (ret<0) {
+		MFSLOG(LOG_NOTICE,"error reading metadata (bad section table)");
+	} else {
+		ret = fs_load_sections(lsections,cnt);
+	}
+	for (i=0 ; i<cnt ; i++) {
+		if (lsections[i].sessions) {
+			free(lsections[i].sessions);
+		}
+	}
+	free(lsections);
+	fs_loadimage_release(map,fleng,inflated);
+	return ret;
+}
+
+
 void fs_new(void) {
-	uint32_t nodepos;
 	statsrecord *sr;
 	maxnodeid = MFS_ROOT_ID;
 	version = 0;
 	nextsessionid = 1;
 	fsnodes_init_freebitmask();
-	root = malloc(sizeof(fsnode));
+	root = fsnode_malloc();
 	root->id = MFS_ROOT_ID;
 	root->type = TYPE_DIRECTORY;
 	root->ctime = root->mtime = root->atime = get_current_time();
@@ -6899,12 +7978,13 @@ void fs_new(void) {
 	root->data.ddata.stats = sr;
 	root->data.ddata.quota = NULL;
 	root->data.ddata.children = NULL;
+#ifdef EDGEHASH
+	root->data.ddata.nameidx = NULL;
+#endif
 	root->data.ddata.elements = 0;
 	root->data.ddata.nlink = 2;
 	root->parents = NULL;
-	nodepos = NODEHASHPOS(root->id);
-	root->next = nodehash[nodepos];
-	nodehash[nodepos] = root;
+	fsnodes_nodetab_insert(root);
 	fsnodes_used_inode(root->id);
 	chunk_newfs();
 	nodes=1;
@@ -6914,14 +7994,11 @@ void fs_new(void) {
 
 int fs_emergency_storeall(const char *fname) {
 	FILE *fd;
-	fd = fopen(fname,"w");
+	fd = fopen(fname,"w+");
 	if (fd==NULL) {
 		return -1;
 	}
-	fwrite("MFSM 1.5",1,8,fd);
-	fs_store(fd);
-	chunk_store(fd);
-	if (ferror(fd)!=0) {
+	if (fs_store(fd)<0 || ferror(fd)!=0) {
 		fclose(fd);
 		return -1;
 	}
@@ -7021,7 +8098,7 @@ int fs_storeall(int bg) {
 				return 0;
 			}
 		}
-		fd = fopen("metadata.mfs.back","w");
+		fd = fopen("metadata.mfs.back","w+");
 		if (fd==NULL) {
 			MFSLOG(LOG_ERR,"can't open metadata file");
 #ifdef BACKGROUND_METASTORE
@@ -7031,10 +8108,7 @@ int fs_storeall(int bg) {
 #endif
 			return 0;
 		}
-		fwrite("MFSM 1.5",1,8,fd);
-		fs_store(fd);
-		chunk_store(fd);
-		if (ferror(fd)!=0) {
+		if (fs_store(fd)<0 || ferror(fd)!=0) {
 			MFSLOG(LOG_ERR,"can't write metadata");
 		}
 		fclose(fd);
@@ -7088,11 +8162,11 @@ int fs_loadall() {
 	backversion = 0;
 	fd = fopen("metadata.mfs.back","r");
 	if (fd!=NULL) {
-		if (fread(bhdr,1,8,fd)==8) {
+		if (metastream_readhead(fileno(fd),bhdr,8)==0) {
 //			if (memcmp(bhdr,"MFSM 1.4",8)==0) {
 //				backversion = fs_loadversion_1_4(fd);
 //			} else
-			if (memcmp(bhdr,"MFSM 1.5",8)==0) {
+			if (memcmp(bhdr,"MFSM 1.5",8)==0 || memcmp(bhdr,"MFSM 2.0",8)==0) {
 				backversion = fs_loadversion(fd);
 			}
 		}
@@ -7134,7 +8208,7 @@ int fs_loadall() {
 		MFSLOG(LOG_ERR,"can't open metadata file");
 		return -1;
 	}
-	if (fread(hdr,1,8,fd)!=8) {
+	if (fread(hdr,1,8,fd)!=8 || (metastream_iscompressed(hdr) && metastream_readhead(fileno(fd),hdr,8)<0)) {
 		MFSLOG(LOG_ERR,"can't read metadata header");
 		return -1;
 	}
@@ -7181,6 +8255,12 @@ int fs_loadall() {
 			fclose(fd);
 			return -1;
 		}
+	} else if (memcmp(hdr,"MFSM 2.0",8)==0) {
+		if (fs_loadimage(fd)<0) {
+			MFSLOG(LOG_ERR,"error reading metadata (structure)");
+			fclose(fd);
+			return -1;
+		}
 	} else {
 		MFSLOG(LOG_ERR,"wrong metadata header");
 		fclose(fd);
@@ -7221,7 +8301,6 @@ int fs_loadall() {
 }
 
 void fs_strinit(void) {
-	uint32_t i;
 	root = NULL;
 	trash = NULL;
 	reserved = NULL;
@@ -7230,18 +8309,12 @@ void fs_strinit(void) {
 	trashnodes = 0;
 	reservednodes = 0;
 	quotahead = NULL;
-	for (i=0 ; i<NODEHASHSIZE ; i++) {
-		nodehash[i]=NULL;
-	}
-#ifdef EDGEHASH
-	for (i=0 ; i<EDGEHASHSIZE ; i++) {
-		edgehash[i]=NULL;
-	}
-#endif
+	fsnodes_nodetab_free();
 }
 
 int fs_init() {
 	LOG_COUNT = cfg_getuint32("LOG_PRINT_FREQUENCY",1000);
+	fsloadthreads = cfg_getuint32("METADATA_LOAD_THREADS",0);
 	fprintf(msgfd,"the log print frequency is %d\n",LOG_COUNT);
 	fprintf(msgfd,"loading metadata ...\n");
 //	fs_strinit();
@@ -2318,7 +2318,7 @@ void matocuserv_fuse_settrashtime(serventry *eptr,const uint8_t *data,uint32_t l
 void matocuserv_fuse_getgoal(serventry *eptr,const uint8_t *data,uint32_t length) {
 	uint32_t inode;
 	uint32_t msgid;
-	uint32_t fgtab[10],dgtab[10];
+	uint32_t fgtab[GOAL_MAX+1],dgtab[GOAL_MAX+1];
 	uint8_t i,fn,dn,gmode;
 	uint8_t *ptr;
 	uint8_t status;
@@ -2334,7 +2334,7 @@ void matocuserv_fuse_getgoal(serventry *eptr,const uint8_t *data,uint32_t length
 	fn=0;
 	dn=0;
 	if (status==STATUS_OK) {
-		for (i=1 ; i<10 ; i++) {
+		for (i=1 ; i<=GOAL_MAX ; i++) {
 			if (fgtab[i]) {
 				fn++;
 			}
@@ -2355,13 +2355,13 @@ void matocuserv_fuse_getgoal(serventry *eptr,const uint8_t *data,uint32_t length
 	} else {
 		put8bit(&ptr,fn);
 		put8bit(&ptr,dn);
-		for (i=1 ; i<10 ; i++) {
+		for (i=1 ; i<=GOAL_MAX ; i++) {
 			if (fgtab[i]) {
 				put8bit(&ptr,i);
 				put32bit(&ptr,fgtab[i]);
 			}
 		}
-		for (i=1 ; i<10 ; i++) {
+		for (i=1 ; i<=GOAL_MAX ; i++) {
 			if (dgtab[i]) {
 				put8bit(&ptr,i);
 				put32bit(&ptr,dgtab[i]);
@@ -26,6 +26,7 @@
 
 #include "MFSCommunication.h"
 #include "filesystem.h"
+#include "changelogrec.h"
 #include "main.h"
 
 #define EAT(clptr,vno,c) { \
@@ -487,9 +488,42 @@ uint8_t do_write(uint64_t lv,uint32_t ts,char *ptr) {
         return shadow_fs_write(ts,inode,indx,opflag,chunkid);
 }
 
+uint8_t do_xorgroup(uint64_t lv,uint32_t ts,char *ptr) {
+        uint64_t parityid;
+        uint64_t chunkid[9];
+        uint32_t cversion[9];
+        uint32_t level,i;
+        (void)ts;
+        EAT(ptr,lv,'(');
+        GETU64(parityid,ptr);
+        EAT(ptr,lv,',');
+        GETU32(level,ptr);
+        if (level<2 || level>9) {
+                return ERROR_EINVAL;
+        }
+        for (i=0 ; i<level ; i++) {
+                EAT(ptr,lv,',');
+                GETU64(chunkid[i],ptr);
+                EAT(ptr,lv,',');
+                GETU32(cversion[i],ptr);
+        }
+        EAT(ptr,lv,')');
+        return shadow_fs_xorgroup(parityid,level,chunkid,cversion);
+}
+
+uint8_t do_xordel(uint64_t lv,uint32_t ts,char *ptr) {
+        uint64_t parityid;
+        (void)ts;
+        EAT(ptr,lv,'(');
+        GETU64(parityid,ptr);
+        EAT(ptr,lv,')');
+        return shadow_fs_xordel(parityid);
+}
+
 int restore(void) {
         FILE *fd;
         char buff[10000];
+        int rl;
         char *ptr;
         uint64_t v,lv;
         uint32_t ts;
@@ -514,7 +548,7 @@ int restore(void) {
                 MFSLOG(LOG_NOTICE,"can't open changemeta file: %s",logpath);
                 return 1;
         }
-        while (fgets(buff,10000,fd)) {
+        while ((rl=changelogrec_read(fd,buff,10000))>0) {
                 ptr = buff;
                 GETU64(lv,ptr);
                 if (lv<v) {
@@ -647,6 +681,15 @@ int restore(void) {
                                         MFSLOG(LOG_NOTICE,"%"PRIu64": unknown entry '%s'",lv,ptr);
                                 }
                                 break;
+                        case 'X':
+                                if (strncmp(ptr,"XORGROUP",8)==0) {
+                                        status = do_xorgroup(lv,ts,ptr+8);
+                                } else if (strncmp(ptr,"XORDEL",6)==0) {
+                                        status = do_xordel(lv,ts,ptr+6);
+                                } else {
+                                        MFSLOG(LOG_NOTICE,"%"PRIu64": unknown entry '%s'",lv,ptr);
+                                }
+                                break;
                         default:
                                 MFSLOG(LOG_NOTICE,"%"PRIu64": unknown entry '%s'",lv,ptr);
                         }
@@ -666,6 +709,11 @@ int restore(void) {
                         }
                 }
         }
+        if (rl<0) {
+                MFSLOG(LOG_ERR,"broken changelog entry after version %"PRIu64"",lv);
+                fclose(fd);
+                return 1;
+        }
         fclose(fd);
         MFSLOG(LOG_NOTICE,"version after applying changelog: %"PRIu64"",v);
         return 0;
@@ -818,6 +866,15 @@ int replay(const char *log_data) {
                                         MFSLOG(LOG_ERR,"%"PRIu64": unknown entry '%s'",lv,ptr);
                                 }
                                 break;
+                        case 'X':
+                                if (strncmp(ptr,"XORGROUP",8)==0) {
+                                        status = do_xorgroup(lv,ts,ptr+8);
+                                } else if (strncmp(ptr,"XORDEL",6)==0) {
+                                        status = do_xordel(lv,ts,ptr+6);
+                                } else {
+                                        MFSLOG(LOG_ERR,"%"PRIu64": unknown entry '%s'",lv,ptr);
+                                }
+                                break;
                         default:
                                 MFSLOG(LOG_ERR,"%"PRIu64": unknown entry '%s'",lv,ptr);
                         }
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <assert.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Automated.h>
+#include <CUnit/TestDB.h>
+#include "MFSCommunication.h"
+#include "main.h"
+#include "changelog.h"
+#include "filesystem.h"
+#include "state.h"
+
+static char testdir[] = "/tmp/mfstest.XXXXXX";
+static char metarestore_path[PATH_MAX];
+static uint8_t attr[35];
+
+#define NAME(s) (sizeof(s)-1),(const uint8_t*)(s)
+
+//restore metadata.mfs.back with its deltas (no changelogs) into 'fname'
+int metarestore(const char *fname) {
+    char cmd[1024];
+    int status;
+    snprintf(cmd, sizeof(cmd), "%s -m %s/metadata.mfs.back -o %s/%s >/dev/null 2>&1", metarestore_path, testdir, testdir, fname);
+    status = system(cmd);
+    return (status!=-1 && WIFEXITED(status))?WEXITSTATUS(status):-1;
+}
+
+//compare contents of two images - order of names in directories may differ, so sorted dumps are compared
+int same_images(const char *fname1, const char *fname2) {
+    char cmd[1024];
+    int status;
+    snprintf(cmd, sizeof(cmd), "%s -m %s/%s 2>/dev/null | sort > %s/%s.dump", metarestore_path, testdir, fname1, testdir, fname1);
+    if(system(cmd)!=0) {
+        return 0;
+    }
+    snprintf(cmd, sizeof(cmd), "%s -m %s/%s 2>/dev/null | sort > %s/%s.dump", metarestore_path, testdir, fname2, testdir, fname2);
+    if(system(cmd)!=0) {
+        return 0;
+    }
+    snprintf(cmd, sizeof(cmd), "cmp -s %s/%s.dump %s/%s.dump", testdir, fname1, testdir, fname2);
+    status = system(cmd);
+    return (status!=-1 && WIFEXITED(status) && WEXITSTATUS(status)==0);
+}
+
+//names, attributes and a few files in trash
+void make_changes_1(uint32_t *dir, uint32_t *file, uint32_t *link) {
+    uint32_t inode, sub, sinodes, ncinodes, nsinodes;
+
+    CU_ASSERT_EQUAL(fs_mkdir(MFS_ROOT_ID, 0, MFS_ROOT_ID, NAME("dir"), 0755, 0, 0, 0, 0, dir, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_mkdir(MFS_ROOT_ID, 0, *dir, NAME("sub"), 0755, 0, 0, 0, 0, &sub, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_mknod(MFS_ROOT_ID, 0, *dir, NAME("file"), TYPE_FILE, 0644, 0, 0, 0, 0, 0, file, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_mknod(MFS_ROOT_ID, 0, sub, NAME("gone"), TYPE_FILE, 0644, 0, 0, 0, 0, 0, &inode, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_mknod(MFS_ROOT_ID, 0, sub, NAME("fifo"), TYPE_FIFO, 0600, 0, 0, 0, 0, 0, &inode, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_setattr(MFS_ROOT_ID, 0, inode, 0, 0, 0, 0, SET_UID_FLAG|SET_GID_FLAG, 0, 1000, 1000, 0, 0, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_symlink(MFS_ROOT_ID, 0, *dir, NAME("link"), NAME("file"), 0, 0, 0, 0, link, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_link(MFS_ROOT_ID, 0, *file, sub, NAME("hard"), 0, 0, 0, 0, &inode, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_setattr(MFS_ROOT_ID, 0, *file, 0, 0, 0, 0, SET_MODE_FLAG|SET_MTIME_FLAG, 0600, 0, 0, 0, 12345, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_do_setlength(MFS_ROOT_ID, 0, *file, 0, 0, 0, 0, 1000, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_unlink(MFS_ROOT_ID, 0, sub, NAME("gone"), 0, 0), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_setgoal(MFS_ROOT_ID, 0, *dir, 0, 3, SMODE_RINCREASE, &sinodes, &ncinodes, &nsinodes), STATUS_OK);
+}
+
+//renames, removals, recursive changes and snapshots on top of the first delta
+void make_changes_2(uint32_t dir, uint32_t link) {
+    uint32_t inode, sinodes, ncinodes, nsinodes;
+    uint32_t pleng;
+    uint8_t *path;
+
+    CU_ASSERT_EQUAL(fs_rename(MFS_ROOT_ID, 0, dir, NAME("file"), MFS_ROOT_ID, NAME("moved"), 0, 0), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_readlink(MFS_ROOT_ID, 0, link, &pleng, &path), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_unlink(MFS_ROOT_ID, 0, MFS_ROOT_ID, NAME("moved"), 0, 0), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_settrashtime(MFS_ROOT_ID, 0, dir, 0, 3600, SMODE_SET, &sinodes, &ncinodes, &nsinodes), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_seteattr(MFS_ROOT_ID, 0, MFS_ROOT_ID, 0, EATTR_NOOWNER, SMODE_RINCREASE, &sinodes, &ncinodes, &nsinodes), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_snapshot(MFS_ROOT_ID, 0, dir, MFS_ROOT_ID, NAME("snap"), 0, 0, 0), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_mknod(MFS_ROOT_ID, 0, dir, NAME("new"), TYPE_FILE, 0644, 0, 0, 0, 0, 0, &inode, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_aquire(inode, 7), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_unlink(MFS_ROOT_ID, 0, dir, NAME("new"), 0, 0), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_rmdir(MFS_ROOT_ID, 0, MFS_ROOT_ID, NAME("dir"), 0, 0), ERROR_ENOTEMPTY);
+}
+
+void test_fs_delta_restore() {
+    uint32_t dir, file, link;
+
+    make_changes_1(&dir, &file, &link);
+    CU_ASSERT_EQUAL(fs_unittest_storedelta(), 0);
+    make_changes_2(dir, link);
+    CU_ASSERT_EQUAL(fs_unittest_storedelta(), 0);
+
+    CU_ASSERT_EQUAL(fs_unittest_storeimage("metadata.full"), 0);
+    CU_ASSERT_EQUAL(metarestore("metadata.restored"), 0);
+    CU_ASSERT_TRUE(same_images("metadata.full", "metadata.restored"));
+}
+
+//full store starts a new chain - older deltas are removed and new ones are made against the new image
+void test_fs_delta_after_full() {
+    uint32_t inode;
+
+    CU_ASSERT_EQUAL(fs_unittest_storeall(), 0);
+    CU_ASSERT_EQUAL(fs_unittest_storedelta(), 0);
+    CU_ASSERT_EQUAL(fs_lookup(MFS_ROOT_ID, 0, MFS_ROOT_ID, NAME("base7"), 0, 0, 0, 0, &inode, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_setattr(MFS_ROOT_ID, 0, inode, 0, 0, 0, 0, SET_MODE_FLAG, 0600, 0, 0, 0, 0, attr), STATUS_OK);
+    CU_ASSERT_EQUAL(fs_unittest_storedelta(), 0);
+
+    CU_ASSERT_EQUAL(fs_unittest_storeimage("metadata.full"), 0);
+    CU_ASSERT_EQUAL(metarestore("metadata.restored"), 0);
+    CU_ASSERT_TRUE(same_images("metadata.full", "metadata.restored"));
+}
+
+CU_TestInfo delta_cases[] = {
+    {"delta restored image equals full image:", test_fs_delta_restore},
+    {"delta after full store:", test_fs_delta_after_full},
+    CU_TEST_INFO_NULL
+};
+
+//file system with some files in temporary directory - changes are tracked from its metadata.mfs.back (deltas bigger than half of it are not stored)
+int suite_delta_init(void) {
+    const char *path;
+    char name[20];
+    uint32_t i, inode;
+
+    //mfsmetarestore built next to this test (or given by MFSMETARESTORE)
+    path = getenv("MFSMETARESTORE");
+    if(realpath((path!=NULL)?path:"../mfsmetarestore/mfsmetarestore", metarestore_path)==NULL) {
+        return -1;
+    }
+    if(mkdtemp(testdir)==NULL || chdir(testdir)<0) {
+        return -1;
+    }
+    set_state(MFS_STATE_MASTER);
+    if(changelog_init()<0) {
+        return -1;
+    }
+    fs_unittest_init();
+    for(i=0; i<1000; i++) {
+        snprintf(name, sizeof(name), "base%u", i);
+        if(fs_mknod(MFS_ROOT_ID, 0, MFS_ROOT_ID, strlen(name), (uint8_t*)name, TYPE_FILE, 0644, 0, 0, 0, 0, 0, &inode, attr)!=STATUS_OK) {
+            return -1;
+        }
+    }
+    return fs_unittest_storeall();
+}
+
+int suite_delta_clean(void) {
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", testdir);
+    return (system(cmd)==0)?0:-1;
+}
+
+CU_SuiteInfo cunit_suites[] = {
+    {"metadata deltas.", suite_delta_init, suite_delta_clean, delta_cases},
+    CU_SUITE_INFO_NULL
+};
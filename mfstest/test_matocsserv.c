@@ -5,10 +5,12 @@
 #include <CUnit/CUnit.h>
 #include <CUnit/Automated.h>
 #include <CUnit/TestDB.h>
+#include "MFSCommunication.h"
 #include "main.h"
 #include "matocsserv.h"
 #include "chunks.h"
 #include "nettopology.h"
+#include "random.h"
 static serventry *matocsservhead = NULL;
 
 //check the replication is multirack
@@ -355,6 +357,85 @@ void test_chunk_move_multirack() {
     }
 }
 
+//one chunkserver has more space than all others together - it can't be selected twice
+void test_matocsserv_getservers_dominant() {
+    void* ptrs[65536];
+    uint16_t servcount;
+    uint64_t i,j;
+    int big_count = 0;
+
+    for(i=0; i<1000; i++) {
+        servcount = matocsserv_getservers_wrandom(ptrs, 2);
+        CU_ASSERT_TRUE(servcount==2);
+        CU_ASSERT_TRUE(check_replist_unique(ptrs, 2));
+        for(j=0; j<2; j++) {
+            if((((serventry *)ptrs[j])->totalspace>>30) == 10000) {
+                big_count++;
+            }
+        }
+        servcount = matocsserv_getservers_wrandom(ptrs, 5);
+        CU_ASSERT_TRUE(servcount==3);
+        CU_ASSERT_TRUE(check_replist_unique(ptrs, 3));
+    }
+    CU_ASSERT_TRUE(big_count==1000);
+}
+
+//chunks from the overloaded chunkserver are planned to move to the empty one in the same rack, balanced ones are left alone
+void test_chunk_rebalance_plan() {
+    void* ptrs[2];
+    void* src[1000];
+    void* dst[1000];
+    serventry *eptr, *full = NULL, *empty = NULL, *other = NULL;
+    uint32_t i, count;
+
+    for(eptr=matocsservhead; eptr; eptr=eptr->next) {
+        if((eptr->usedspace>>30) == 900) {
+            full = eptr;
+        } else if((eptr->usedspace>>30) == 100) {
+            empty = eptr;
+        } else {
+            other = eptr;
+        }
+    }
+    CU_ASSERT_TRUE(full!=NULL && empty!=NULL && other!=NULL);
+    if(full==NULL || empty==NULL || other==NULL) {
+        return;
+    }
+    ptrs[0] = full;
+    ptrs[1] = other;
+    for(i=0; i<100; i++) {
+        chunk_unittest_create_by_servlist(ptrs, 2, 2);
+    }
+    count = chunk_unittest_rebalance_plan(src, dst, 1000);
+    //400G above target, 9G per chunk
+    CU_ASSERT_TRUE(count==44);
+    for(i=0; i<count; i++) {
+        CU_ASSERT_TRUE(src[i]==full);
+        CU_ASSERT_TRUE(dst[i]==empty);
+    }
+}
+
+//new chunk of a file with xor goal is written in two copies, not in goal (0x12..0x19) copies
+void test_chunk_create_xor() {
+    uint64_t chunkid;
+    uint8_t opflag;
+
+    CU_ASSERT_TRUE(chunk_multi_modify(&chunkid, 0, 1, 0, GOAL_XOR(3), 0, &opflag)==STATUS_OK);
+    CU_ASSERT_TRUE(chunk_unittest_validcopies(chunkid)==2);
+    CU_ASSERT_TRUE(chunk_multi_modify(&chunkid, 0, 2, 0, 3, 0, &opflag)==STATUS_OK);
+    CU_ASSERT_TRUE(chunk_unittest_validcopies(chunkid)==3);
+}
+
+CU_TestInfo rebalance_cases[] = {
+    {"rebalance plan:", test_chunk_rebalance_plan},
+    CU_TEST_INFO_NULL
+};
+
+CU_TestInfo dominant_cases[] = {
+    {"getservers with dominant chunkserver:", test_matocsserv_getservers_dominant},
+    CU_TEST_INFO_NULL
+};
+
 CU_TestInfo samerack_cases[] = {
     {"getservers in same rack:", test_matocsserv_getservers_samerack},
     {"chunk delete in same rack:", test_chunk_delete_samerack},
@@ -369,6 +450,7 @@ CU_TestInfo multirack_cases[] = {
     {"chunk delete in multirack:", test_chunk_delete_multirack},
     {"chunk recovery in multirack:", test_chunk_recovery_multirack},
     {"chunk move in multirack:", test_chunk_move_multirack},
+    {"chunk create with xor goal:", test_chunk_create_xor},
     CU_TEST_INFO_NULL
 };
 
@@ -377,6 +459,7 @@ int suite_samerack_init(void) {
     uint32_t rackid = 128;
     uint64_t i,j;
 
+    rndinit();
     matocsserv_unittest_init(100, 0.9);
     chunk_uinttest_init(5, 1);
 
@@ -401,6 +484,7 @@ int suite_multirack_init(void) {
     uint64_t i,j;
     uint32_t rackid[3] = {1, 128, 256};
 
+    rndinit();
     matocsserv_unittest_init(100, 0.9);
     chunk_uinttest_init(5, 1);
 
@@ -422,6 +506,39 @@ int suite_multirack_init(void) {
     return 0;
 }
 
+//add one big chunkserver and two small ones
+int suite_dominant_init(void) {
+    uint32_t rackid = 64;
+    uint64_t totalspace;
+
+    rndinit();
+    matocsserv_unittest_init(100, 0.9);
+    chunk_uinttest_init(5, 1);
+
+    totalspace = 10000;
+    matocsservhead = matocsserv_unittest_add_chunkserver((rackid<<8) + 1, 0, totalspace<<30);
+    totalspace = 500;
+    matocsservhead = matocsserv_unittest_add_chunkserver_batch((rackid<<8) + 2, 0, totalspace<<30, 2);
+    matocsserv_status();
+    return 0;
+}
+
+//one overloaded and one empty chunkserver in the first rack, two balanced ones in the second
+int suite_rebalance_init(void) {
+    uint32_t rackid[2] = {32, 48};
+    uint64_t totalspace = 1000;
+
+    rndinit();
+    matocsserv_unittest_init(100, 0.9);
+    chunk_uinttest_init(5, 1);
+
+    matocsservhead = matocsserv_unittest_add_chunkserver((rackid[0]<<8) + 1, (uint64_t)900<<30, totalspace<<30);
+    matocsservhead = matocsserv_unittest_add_chunkserver((rackid[0]<<8) + 2, (uint64_t)100<<30, totalspace<<30);
+    matocsservhead = matocsserv_unittest_add_chunkserver_batch((rackid[1]<<8) + 1, (uint64_t)500<<30, totalspace<<30, 2);
+    matocsserv_status();
+    return 0;
+}
+
 int suite_getservers_clean(void) {
     matocsserv_unittest_clean();
     return 0;
@@ -430,6 +547,8 @@ int suite_getservers_clean(void) {
 CU_SuiteInfo cunit_suites[] = {
     {"chunkserver in samerack.", suite_samerack_init, suite_getservers_clean, samerack_cases},
     {"chunkserver in multirack.:", suite_multirack_init, suite_getservers_clean, multirack_cases},
+    {"chunkserver with dominant space.", suite_dominant_init, suite_getservers_clean, dominant_cases},
+    {"chunkserver rebalance.", suite_rebalance_init, suite_getservers_clean, rebalance_cases},
     CU_SUITE_INFO_NULL
 };
 